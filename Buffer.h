@@ -36,6 +36,31 @@ enum PageLockedState
   LOCKED
 };
 
+//------------------------------------------------------------------------------
+//
+// Where device buffers get their memory.  POOLED buffers take blocks from a
+// per-device cache and return them on free, so repeated batches and rebuilds
+// do not pay for cudaMalloc/cudaFree (which also synchronizes the device).
+// A pooled block is reused as soon as it is freed: only free device buffers
+// once the work that reads or writes them has finished.  MANAGED buffers are
+// unified memory, which may exceed the device's memory: pages it can't hold
+// stay on the host and are faulted in when kernels touch them.
+//
+enum DeviceAllocPolicy
+{
+  DEVICE_ALLOC_POOLED,
+  DEVICE_ALLOC_DIRECT,
+  DEVICE_ALLOC_MANAGED
+};
+
+// Caching device allocator used by POOLED buffers, defined in bake_util.cpp.
+// devicePoolAlloc allocates on the current device; freed blocks stay cached
+// for the device they came from until trimDevicePool releases them.
+void*  devicePoolAlloc( size_t bytes );
+void   devicePoolFree( void* ptr, size_t bytes, int device );
+size_t devicePoolCachedBytes( int device );
+void   trimDevicePool();
+
 
 //------------------------------------------------------------------------------
 //
@@ -45,10 +70,13 @@ template<typename T>
 class Buffer
 {
 public:
-  Buffer( size_t count=0, RTPbuffertype type=RTP_BUFFER_TYPE_HOST, PageLockedState pageLockedState=UNLOCKED, unsigned stride=0 ) 
+  Buffer( size_t count=0, RTPbuffertype type=RTP_BUFFER_TYPE_HOST, PageLockedState pageLockedState=UNLOCKED, unsigned stride=0,
+          DeviceAllocPolicy allocPolicy=DEVICE_ALLOC_POOLED ) 
     : m_ptr( 0 ),
+      m_device( 0 ),
       m_tempHost( 0 ),
-      m_pageLockedState( pageLockedState )
+      m_pageLockedState( pageLockedState ),
+      m_allocPolicy( allocPolicy )
   {
     alloc( count, type, pageLockedState, stride );
   }
@@ -79,20 +107,35 @@ public:
       else
       {
         CHK_CUDA( cudaGetDevice( &m_device ) );
-        CHK_CUDA( cudaMalloc( &m_ptr, sizeInBytes() ) );
+        if( m_allocPolicy == DEVICE_ALLOC_POOLED )
+          m_ptr = (T*)devicePoolAlloc( sizeInBytes() );
+        else if( m_allocPolicy == DEVICE_ALLOC_MANAGED )
+        {
+          CHK_CUDA( cudaMallocManaged( &m_ptr, sizeInBytes() ) );
+        }
+        else
+          CHK_CUDA( cudaMalloc( &m_ptr, sizeInBytes() ) );
       }
     }
   }
 
   void free()
   {
-    if( m_ptr && m_type == RTP_BUFFER_TYPE_HOST )
+    if( !m_ptr )
+    {
+      // nothing allocated, e.g. default constructed buffer
+    }
+    else if( m_type == RTP_BUFFER_TYPE_HOST )
     {
       if( m_pageLockedState ) {
         rtpHostBufferUnlock( m_ptr );
       }
       ::free(m_ptr);
-      ::free(m_tempHost);
+    }
+    else if( m_allocPolicy == DEVICE_ALLOC_POOLED )
+    {
+      // No device switch needed, the block just goes back to its device's cache
+      devicePoolFree( m_ptr, sizeInBytes(), m_device );
     }
     else 
     {
@@ -102,6 +145,7 @@ public:
       CHK_CUDA( cudaFree( m_ptr ) );
       CHK_CUDA( cudaSetDevice( oldDevice ) );
     }
+    ::free(m_tempHost);
 
     m_ptr = 0;
     m_tempHost = 0;
@@ -120,6 +164,7 @@ public:
   T* ptr()                   { return m_ptr; }
   RTPbuffertype type() const { return m_type; }
   unsigned stride()    const { return m_stride; }
+  DeviceAllocPolicy allocPolicy() const { return m_allocPolicy; }
 
   const T* hostPtr() 
   {
@@ -138,6 +183,7 @@ protected:
   size_t m_count;
   unsigned m_stride;
   PageLockedState m_pageLockedState;
+  DeviceAllocPolicy m_allocPolicy;
   T* m_tempHost;
   
 private:
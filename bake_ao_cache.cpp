@@ -0,0 +1,252 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+// Sparse AO in the spirit of irradiance caching (Ward et al. 1988, Ward and Heckbert 1992): full ray sets are traced
+// at one record per cell of a hash of position and normal, each record gets a gradient, and the other samples are
+// interpolated from the records around them, where those agree.  The tracers return only the AO of a sample, not
+// its ray hits, so gradients are fit to the neighboring records instead of estimated from the hits.
+
+#include "bake_ao_cache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+
+namespace {
+
+const int      CELL_BITS   = 20;
+const uint64_t CELL_MASK   = (uint64_t(1) << CELL_BITS) - 1;
+const int      NORMAL_BINS = 6;  // the dominant axis of the normal and its sign
+
+// Fit regularization, in units of the cell size squared per record
+const double GRADIENT_DAMPING = 1.0e-3;
+
+int normal_bin( const float* n )
+{
+  const float a[3] = { std::fabs( n[0] ), std::fabs( n[1] ), std::fabs( n[2] ) };
+  const int axis = a[0] >= a[1] && a[0] >= a[2] ? 0 : a[1] >= a[2] ? 1 : 2;
+  return 2*axis + (n[axis] < 0.0f ? 1 : 0);
+}
+
+uint64_t cell_key( const int bin, const uint64_t x, const uint64_t y, const uint64_t z )
+{
+  return (uint64_t( bin ) << (3*CELL_BITS)) | (x << (2*CELL_BITS)) | (y << CELL_BITS) | z;
+}
+
+// Cell of a key and its neighbors with the same normal bin, that have samples
+void neighbor_cells( const bake::AOCacheCells& cells, const uint64_t key, std::vector<size_t>& neighbors )
+{
+  neighbors.clear();
+  const uint64_t bin = key >> (3*CELL_BITS);
+  const int64_t c[3] = { int64_t( (key >> (2*CELL_BITS)) & CELL_MASK ), int64_t( (key >> CELL_BITS) & CELL_MASK ), int64_t( key & CELL_MASK ) };
+  for (int dx = -1; dx <= 1; ++dx) {
+    for (int dy = -1; dy <= 1; ++dy) {
+      for (int dz = -1; dz <= 1; ++dz) {
+        const int64_t x = c[0] + dx, y = c[1] + dy, z = c[2] + dz;
+        if (x < 0 || y < 0 || z < 0 || x > int64_t( CELL_MASK ) || y > int64_t( CELL_MASK ) || z > int64_t( CELL_MASK )) continue;
+        const uint64_t k = cell_key( int( bin ), uint64_t( x ), uint64_t( y ), uint64_t( z ) );
+        const std::vector<uint64_t>::const_iterator it = std::lower_bound( cells.keys.begin(), cells.keys.end(), k );
+        if (it != cells.keys.end() && *it == k) neighbors.push_back( size_t( it - cells.keys.begin() ) );
+      }
+    }
+  }
+}
+
+// Solves the symmetric 3x3 system a g = b by Cramer's rule; false if it is singular
+bool solve3( const double a[6], const double b[3], double g[3] )
+{
+  // a: xx, xy, xz, yy, yz, zz
+  const double c00 = a[3]*a[5] - a[4]*a[4];
+  const double c01 = a[2]*a[4] - a[1]*a[5];
+  const double c02 = a[1]*a[4] - a[2]*a[3];
+  const double det = a[0]*c00 + a[1]*c01 + a[2]*c02;
+  if (!(std::fabs( det ) > 0.0)) return false;
+  const double c11 = a[0]*a[5] - a[2]*a[2];
+  const double c12 = a[1]*a[2] - a[0]*a[4];
+  const double c22 = a[0]*a[3] - a[1]*a[1];
+  g[0] = (c00*b[0] + c01*b[1] + c02*b[2]) / det;
+  g[1] = (c01*b[0] + c11*b[1] + c12*b[2]) / det;
+  g[2] = (c02*b[0] + c12*b[1] + c22*b[2]) / det;
+  return true;
+}
+
+} // end namespace
+
+
+void bake::ao_cache_cells( const AOSamples& ao_samples, const float cell_size, AOCacheCells& cells )
+{
+  const size_t n = ao_samples.num_samples;
+  const float* positions = ao_samples.sample_positions;
+  const float* normals = ao_samples.sample_normals;
+  cells.cell_size = cell_size;
+  for (int k = 0; k < 3; ++k) cells.origin[k] = n > 0 ? positions[k] : 0.0f;
+  for (size_t i = 1; i < n; ++i) {
+    for (int k = 0; k < 3; ++k) cells.origin[k] = std::min( cells.origin[k], positions[3*i+k] );
+  }
+
+  std::vector< std::pair<uint64_t, size_t> > sample_keys( n );
+#pragma omp parallel for if( n >= (1 << 16) )
+  for (ptrdiff_t i = 0; i < ptrdiff_t(n); ++i) {
+    uint64_t c[3];
+    for (int k = 0; k < 3; ++k) {
+      const double x = std::floor( (double( positions[3*i+k] ) - cells.origin[k]) / cell_size );
+      c[k] = uint64_t( std::min( std::max( x, 0.0 ), double( CELL_MASK ) ) );
+    }
+    sample_keys[i] = std::make_pair( cell_key( normal_bin( normals + 3*i ), c[0], c[1], c[2] ), size_t( i ) );
+  }
+  std::sort( sample_keys.begin(), sample_keys.end() );
+
+  cells.keys.clear();
+  cells.cell_begin.clear();
+  cells.order.resize( n );
+  for (size_t i = 0; i < n; ++i) {
+    if (i == 0 || sample_keys[i].first != sample_keys[i-1].first) {
+      cells.keys.push_back( sample_keys[i].first );
+      cells.cell_begin.push_back( i );
+    }
+    cells.order[i] = sample_keys[i].second;
+  }
+  cells.cell_begin.push_back( n );
+
+  const size_t num_cells = cells.keys.size();
+  cells.records.resize( num_cells );
+#pragma omp parallel for schedule(dynamic, 256)
+  for (ptrdiff_t c = 0; c < ptrdiff_t(num_cells); ++c) {
+    double mean[3] = { 0.0, 0.0, 0.0 };
+    const size_t begin = cells.cell_begin[c], end = cells.cell_begin[c+1];
+    for (size_t i = begin; i < end; ++i) {
+      for (int k = 0; k < 3; ++k) mean[k] += positions[3*cells.order[i]+k];
+    }
+    for (int k = 0; k < 3; ++k) mean[k] /= double( end - begin );
+    double best = -1.0;
+    for (size_t i = begin; i < end; ++i) {
+      double d = 0.0;
+      for (int k = 0; k < 3; ++k) {
+        const double x = positions[3*cells.order[i]+k] - mean[k];
+        d += x*x;
+      }
+      if (best < 0.0 || d < best) {
+        best = d;
+        cells.records[c] = cells.order[i];
+      }
+    }
+  }
+}
+
+
+void bake::ao_cache_interpolate( const AOSamples& ao_samples, const AOCacheCells& cells, const float error_threshold, float* ao_values, 
+                                 std::vector<size_t>& refine_samples )
+{
+  const float* positions = ao_samples.sample_positions;
+  const float* normals = ao_samples.sample_normals;
+  const size_t num_cells = cells.keys.size();
+  const double h = cells.cell_size;
+
+  // A gradient per record, fit to the records around it with the record's own AO held, and whether the fit predicts 
+  // those records within the threshold
+  std::vector<float> gradients( 3*num_cells, 0.0f );
+  std::vector<unsigned char> refine( num_cells, 0 );
+#pragma omp parallel for schedule(dynamic, 256)
+  for (ptrdiff_t c = 0; c < ptrdiff_t(num_cells); ++c) {
+    std::vector<size_t> neighbors;
+    neighbor_cells( cells, cells.keys[c], neighbors );
+    const size_t r = cells.records[c];
+    const float* pr = positions + 3*r;
+    double a[6] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+    double b[3] = { 0.0, 0.0, 0.0 };
+    for (size_t j = 0; j < neighbors.size(); ++j) {
+      const size_t s = cells.records[neighbors[j]];
+      if (s == r) continue;
+      const double d[3] = { double( positions[3*s] ) - pr[0], double( positions[3*s+1] ) - pr[1], double( positions[3*s+2] ) - pr[2] };
+      const double dao = double( ao_values[s] ) - ao_values[r];
+      a[0] += d[0]*d[0]; a[1] += d[0]*d[1]; a[2] += d[0]*d[2];
+      a[3] += d[1]*d[1]; a[4] += d[1]*d[2]; a[5] += d[2]*d[2];
+      for (int k = 0; k < 3; ++k) b[k] += d[k]*dao;
+    }
+    // Too few records around to tell; the cell is traced
+    if (neighbors.size() < 4) {
+      refine[c] = 1;
+      continue;
+    }
+    const double damping = GRADIENT_DAMPING * h*h * double( neighbors.size() );
+    a[0] += damping; a[3] += damping; a[5] += damping;
+    double g[3] = { 0.0, 0.0, 0.0 };
+    if (!solve3( a, b, g )) {
+      refine[c] = 1;
+      continue;
+    }
+    double error = 0.0;
+    for (size_t j = 0; j < neighbors.size(); ++j) {
+      const size_t s = cells.records[neighbors[j]];
+      double predicted = ao_values[r];
+      for (int k = 0; k < 3; ++k) predicted += g[k] * (double( positions[3*s+k] ) - pr[k]);
+      error = std::max( error, std::fabs( predicted - ao_values[s] ) );
+    }
+    for (int k = 0; k < 3; ++k) gradients[3*c+k] = float( g[k] );
+    refine[c] = error > error_threshold ? 1 : 0;
+  }
+
+  // The other samples of the cells that hold: records around them, extrapolated along their gradients, weighted by
+  // distance and normal divergence as Ward's error estimate
+#pragma omp parallel for schedule(dynamic, 256)
+  for (ptrdiff_t c = 0; c < ptrdiff_t(num_cells); ++c) {
+    if (refine[c]) continue;
+    std::vector<size_t> neighbors;
+    neighbor_cells( cells, cells.keys[c], neighbors );
+    for (size_t i = cells.cell_begin[c]; i < cells.cell_begin[c+1]; ++i) {
+      const size_t s = cells.order[i];
+      if (s == cells.records[c]) continue;
+      const float* p = positions + 3*s;
+      const float* n = normals + 3*s;
+      double sum = 0.0, weight = 0.0;
+      for (size_t j = 0; j < neighbors.size(); ++j) {
+        const size_t nc = neighbors[j];
+        if (refine[nc]) continue;
+        const size_t r = cells.records[nc];
+        const float* pr = positions + 3*r;
+        const float* nr = normals + 3*r;
+        double dist_sq = 0.0, extrapolated = ao_values[r], cos_n = 0.0;
+        for (int k = 0; k < 3; ++k) {
+          const double d = double( p[k] ) - pr[k];
+          dist_sq += d*d;
+          extrapolated += gradients[3*nc+k] * d;
+          cos_n += double( n[k] ) * nr[k];
+        }
+        const double w = 1.0 / (std::sqrt( dist_sq ) / h + std::sqrt( std::max( 1.0 - cos_n, 0.0 ) ) + 1.0e-3);
+        sum += w * extrapolated;
+        weight += w;
+      }
+      ao_values[s] = float( std::min( std::max( sum / weight, 0.0 ), 1.0 ) );
+    }
+  }
+
+  refine_samples.clear();
+  for (size_t c = 0; c < num_cells; ++c) {
+    if (!refine[c]) continue;
+    for (size_t i = cells.cell_begin[c]; i < cells.cell_begin[c+1]; ++i) {
+      if (cells.order[i] != cells.records[c]) refine_samples.push_back( cells.order[i] );
+    }
+  }
+}
@@ -0,0 +1,58 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#include "bake_api.h"
+
+#include <vector>
+
+namespace bake {
+
+// Samples binned by a spatial hash of position and normal direction, with one record sample per cell
+struct AOCacheCells
+{
+  float cell_size;
+  float origin[3];
+  std::vector<uint64_t> keys;        // per cell, ascending
+  std::vector<size_t>   cell_begin;  // samples of cell c are order[cell_begin[c], cell_begin[c+1])
+  std::vector<size_t>   order;       // sample indices, by cell
+  std::vector<size_t>   records;     // per cell, the sample closest to the mean position of the cell's
+};
+
+void ao_cache_cells(
+    const AOSamples& ao_samples,
+    const float      cell_size,
+    AOCacheCells&    cells  // output
+    );
+
+// With the AO of the records in ao_values, fits each cell an AO gradient from the records around it and fills the 
+// other samples of the cells the fit holds in within error_threshold by interpolating the records.  The samples of the 
+// others are returned in refine_samples, for tracing, their records excluded.
+void ao_cache_interpolate(
+    const AOSamples&     ao_samples,
+    const AOCacheCells&  cells,
+    const float          error_threshold,
+    float*               ao_values,
+    std::vector<size_t>& refine_samples  // output
+    );
+
+}
@@ -0,0 +1,412 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#include "bake_ao_embree.h"
+#include "bake_kernels.h"
+#include "bake_util.h"
+
+#include <cassert>
+
+#if defined( BAKE_WITH_EMBREE )
+
+#include "bake_ray_sampling.h"
+
+#include <embree3/rtcore.h>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+using namespace optix;
+
+namespace
+{
+
+// Rays of one sample traced together.  A multiple of 16 lines packets up with the power of two ray counts 
+// at which adaptive sampling tests a sample.
+const int PACKET_SIZE = 16;
+
+void errorCallback( void*, const RTCError code, const char* message )
+{
+  std::cerr << "Embree error (" << int( code ) << "): " << ( message ? message : "" ) << std::endl;
+}
+
+// Build quality of the accel presets, as for OptiX: fast builds quickly, quality takes the spatial splits
+RTCBuildQuality buildQuality( const bake::AccelPreset preset )
+{
+  return preset == bake::ACCEL_PRESET_FAST ? RTC_BUILD_QUALITY_LOW : 
+         preset == bake::ACCEL_PRESET_QUALITY ? RTC_BUILD_QUALITY_HIGH : RTC_BUILD_QUALITY_MEDIUM;
+}
+
+inline float3 loadFloat3( const float* p, const size_t i )
+{
+  return make_float3( p[3*i+0], p[3*i+1], p[3*i+2] );
+}
+
+} // end namespace
+
+
+namespace bake {
+
+struct EmbreeAOContext {
+  RTCDevice device;
+  std::vector<RTCScene> mesh_scenes;  // NULL for meshes without triangles
+  std::vector<RTCGeometry> mesh_geometries;  // the triangles of each mesh scene, owned by it
+  std::vector<float*>   mesh_vertices;      // Embree's vertex buffer of each
+  RTCScene  scene;                    // instances of the mesh scenes
+  RTCBuildQuality build_quality;
+  RTCSceneFlags   scene_flags;
+  DeviceGroundPlane ground_plane;     // axis < 0 if none
+
+  Timer setup_timer;
+  Timer accel_timer;
+};
+
+}
+
+
+namespace {
+
+RTCScene newScene( const bake::EmbreeAOContext& ctx )
+{
+  RTCScene scene = rtcNewScene( ctx.device );
+  rtcSetSceneBuildQuality( scene, ctx.build_quality );
+  rtcSetSceneFlags( scene, ctx.scene_flags );
+  return scene;
+}
+
+// Embree keeps its own copy of the geometry, with the vertices packed whatever the stride of the mesh
+RTCScene buildMeshScene( const bake::EmbreeAOContext& ctx, const bake::Mesh& mesh, RTCGeometry& triangles, float*& triangle_vertices )
+{
+  RTCGeometry geometry = rtcNewGeometry( ctx.device, RTC_GEOMETRY_TYPE_TRIANGLE );
+  rtcSetGeometryBuildQuality( geometry, ctx.build_quality );
+
+  float* vertices = static_cast<float*>( rtcSetNewGeometryBuffer( geometry, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 
+                                                                  3*sizeof(float), mesh.num_vertices ) );
+  packMeshVertices( mesh, vertices );
+  unsigned* indices = static_cast<unsigned*>( rtcSetNewGeometryBuffer( geometry, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 
+                                                                       3*sizeof(unsigned), mesh.num_triangles ) );
+  std::copy( mesh.tri_vertex_indices, mesh.tri_vertex_indices + 3*mesh.num_triangles, indices );
+  rtcCommitGeometry( geometry );
+
+  RTCScene scene = newScene( ctx );
+  rtcAttachGeometry( scene, geometry );
+  rtcReleaseGeometry( geometry );
+  rtcCommitScene( scene );
+  triangles = geometry;
+  triangle_vertices = vertices;
+  return scene;
+}
+
+// The top level scene over the mesh scenes; instances are row major 4x4, of which Embree takes the top 3 rows
+void buildInstanceScene( bake::EmbreeAOContext& ctx, const bake::Instance* instances, const size_t num_instances )
+{
+  if ( ctx.scene ) rtcReleaseScene( ctx.scene );
+  ctx.scene = newScene( ctx );
+  for (size_t i = 0; i < num_instances; ++i) {
+    RTCScene mesh_scene = ctx.mesh_scenes[instances[i].mesh_index];
+    if ( !mesh_scene ) continue;
+    RTCGeometry geometry = rtcNewGeometry( ctx.device, RTC_GEOMETRY_TYPE_INSTANCE );
+    rtcSetGeometryInstancedScene( geometry, mesh_scene );
+    rtcSetGeometryTransform( geometry, 0, RTC_FORMAT_FLOAT3X4_ROW_MAJOR, instances[i].xform );
+    rtcCommitGeometry( geometry );
+    rtcAttachGeometry( ctx.scene, geometry );
+    rtcReleaseGeometry( geometry );
+  }
+  rtcCommitScene( ctx.scene );
+}
+
+} // end namespace
+
+
+bake::EmbreeAOContext* bake::ao_embree_create_context(
+    const Scene& occluders,
+    const bool   conserve_memory,
+    const AccelPreset accel_preset,
+    const GroundPlane* ground_plane
+    )
+{
+  RTCDevice device = rtcNewDevice( NULL );
+  if ( !device ) return NULL;
+  rtcSetDeviceErrorFunction( device, &errorCallback, NULL );
+
+  EmbreeAOContext* ctx = new EmbreeAOContext;
+  ctx->device = device;
+  ctx->scene = NULL;
+  ctx->build_quality = buildQuality( accel_preset );
+  ctx->scene_flags = conserve_memory ? RTC_SCENE_FLAG_COMPACT : RTC_SCENE_FLAG_NONE;
+  ctx->ground_plane.axis = ground_plane ? ground_plane->axis : -1;
+  if ( ground_plane ) {
+    ctx->ground_plane.bbox_min = make_float3( ground_plane->bbox_min[0], ground_plane->bbox_min[1], ground_plane->bbox_min[2] );
+    ctx->ground_plane.bbox_max = make_float3( ground_plane->bbox_max[0], ground_plane->bbox_max[1], ground_plane->bbox_max[2] );
+  }
+
+  // The build counts as setup time of the first computeAO
+  ctx->setup_timer.start();
+  ctx->accel_timer.start();
+  ProfileRange range( "build accels", PROFILE_COLOR_ACCEL );
+  ctx->mesh_scenes.assign( occluders.num_meshes, (RTCScene)NULL );
+  ctx->mesh_geometries.assign( occluders.num_meshes, (RTCGeometry)NULL );
+  ctx->mesh_vertices.assign( occluders.num_meshes, (float*)NULL );
+  for (size_t i = 0; i < occluders.num_meshes; ++i) {
+    if ( occluders.meshes[i].num_triangles > 0 ) {
+      ctx->mesh_scenes[i] = buildMeshScene( *ctx, occluders.meshes[i], ctx->mesh_geometries[i], ctx->mesh_vertices[i] );
+    }
+  }
+  buildInstanceScene( *ctx, occluders.instances, occluders.num_instances );
+  ctx->accel_timer.stop();
+  ctx->setup_timer.stop();
+  return ctx;
+}
+
+
+void bake::ao_embree_update_instances( EmbreeAOContext* ctx, const Instance* instances, const size_t num_instances )
+{
+  // Mesh scenes are kept, only the top level scene is rebuilt
+  ctx->setup_timer.start();
+  ProfileRange range( "update instances", PROFILE_COLOR_ACCEL );
+  buildInstanceScene( *ctx, instances, num_instances );
+  ctx->setup_timer.stop();
+}
+
+
+void bake::ao_embree_update_geometry( EmbreeAOContext* ctx, const Mesh* meshes, const size_t num_meshes, const Instance* instances, 
+                                      const size_t num_instances )
+{
+  // The new positions go into Embree's copy, and the BVH of each mesh scene is refit to them rather than built again
+  assert( num_meshes == ctx->mesh_scenes.size() );
+  ctx->setup_timer.start();
+  ctx->accel_timer.start();
+  ProfileRange range( "update geometry", PROFILE_COLOR_ACCEL );
+  size_t num_refits = 0;
+  for (size_t i = 0; i < num_meshes; ++i) {
+    RTCGeometry geometry = ctx->mesh_geometries[i];
+    if ( !geometry ) continue;
+    packMeshVertices( meshes[i], ctx->mesh_vertices[i] );
+    rtcUpdateGeometryBuffer( geometry, RTC_BUFFER_TYPE_VERTEX, 0 );
+    rtcSetGeometryBuildQuality( geometry, RTC_BUILD_QUALITY_REFIT );
+    rtcCommitGeometry( geometry );
+    rtcCommitScene( ctx->mesh_scenes[i] );
+    ++num_refits;
+  }
+  buildInstanceScene( *ctx, instances, num_instances );
+  ctx->accel_timer.stop();
+  ctx->setup_timer.stop();
+  recordCount( "ao.accel_refits", num_refits );
+}
+
+
+void bake::ao_embree_destroy_context( EmbreeAOContext* ctx )
+{
+  if ( !ctx ) return;
+  if ( ctx->scene ) rtcReleaseScene( ctx->scene );
+  for (size_t i = 0; i < ctx->mesh_scenes.size(); ++i) {
+    if ( ctx->mesh_scenes[i] ) rtcReleaseScene( ctx->mesh_scenes[i] );
+  }
+  rtcReleaseDevice( ctx->device );
+  delete ctx;
+}
+
+
+void bake::ao_embree(
+    EmbreeAOContext* ctx,
+    const Scene& scene,
+    const AOSamples& ao_samples,
+    const int    rays_per_sample,
+    const float  scene_offset,
+    const float  scene_maxdistance,
+    const size_t requested_batch_size,
+    const float  adaptive_tolerance,
+    float*       ao_values,
+    const float* radii,
+    const size_t num_radii,
+    const bool   two_sided,
+    BatchCursor* shared_batches
+    )
+{
+  Timer trace_timer;
+  trace_timer.start();
+  ProfileRange range( "trace samples", PROFILE_COLOR_TRACE, uint64_t( ao_samples.num_samples ) );
+
+  assert( ao_samples.sample_positions && ao_samples.sample_normals && ao_samples.sample_face_normals );
+  assert( ao_values );
+  assert( num_radii <= size_t( MAX_DEVICE_AO_RADII ) );
+  assert( !two_sided || num_radii == 0 );
+
+  const int num_passes = std::max( rays_per_sample, 1 );
+  const int num_sides = two_sided ? 2 : 1;
+  const int num_radius_channels = num_radii > 0 ? int( num_radii ) : 1;
+  const float tolerance = num_radii == 0 && !two_sided ? adaptive_tolerance : 0.0f;
+  const bool has_ground_plane = ctx->ground_plane.axis >= 0;
+  const RTCScene top_scene = ctx->scene;
+
+  // Samples are seeded by their index, as on the devices, so every backend traces the same rays.  Batches only matter
+  // when shared with another tracer.
+  BatchCursor local_batches( requested_batch_size > 0 ? requested_batch_size : size_t(1) << 22, ao_samples.num_samples );
+  BatchCursor& batches = shared_batches ? *shared_batches : local_batches;
+
+  Timer query_timer;
+  query_timer.start();
+  long long num_rays_traced = 0;
+  size_t num_batches = 0;
+  size_t batch_idx;
+  while ( batches.take( batch_idx ) ) {
+    ProfileRange batch_range( "batch", PROFILE_COLOR_TRACE, uint64_t( batch_idx ) );
+    ++num_batches;
+    const size_t sample_offset = batch_idx*batches.batch_size;
+    const ptrdiff_t num_samples = static_cast<ptrdiff_t>( std::min( batches.batch_size, ao_samples.num_samples - sample_offset ) );
+#pragma omp parallel for schedule( dynamic, 64 ) reduction( +: num_rays_traced ) if( num_samples >= 256 )
+    for (ptrdiff_t i = 0; i < num_samples; ++i) {
+      const size_t idx = sample_offset + i;
+      const unsigned int scramble_seed = bake::aoScrambleSeed( ao_samples.first_sample_index + idx );
+      const float3 ray_origin = loadFloat3( ao_samples.sample_positions, idx );
+
+      RTCIntersectContext context;
+      rtcInitIntersectContext( &context );
+
+      for (int s = 0; s < num_sides; ++s) {
+        const float  side             = s == 0 ? 1.0f : -1.0f;
+        const float3 sample_norm      = side * loadFloat3( ao_samples.sample_normals, idx );
+        const float3 sample_face_norm = side * loadFloat3( ao_samples.sample_face_normals, idx );
+
+        int occluded[MAX_DEVICE_AO_RADII] = {0};
+        int num_rays = 0;
+        while ( num_rays < num_passes ) {
+          const int count = std::min( PACKET_SIZE, num_passes - num_rays );
+
+          // Lanes are independent scalar code, for the compiler to vectorize
+          RTCRayHit16 packet;
+          int   valid[PACKET_SIZE];
+          float plane_t[PACKET_SIZE];
+          bool  any_valid = false;
+          for (int k = 0; k < PACKET_SIZE; ++k) {
+            const float3 ray_dir = bake::sampleAODirection( num_rays + k, scramble_seed, sample_norm, sample_face_norm );
+            plane_t[k] = has_ground_plane ? 
+              bake::groundPlaneDistance( ctx->ground_plane, ray_origin, ray_dir, scene_offset, scene_maxdistance ) : -1.0f;
+
+            packet.ray.org_x[k] = ray_origin.x;
+            packet.ray.org_y[k] = ray_origin.y;
+            packet.ray.org_z[k] = ray_origin.z;
+            packet.ray.dir_x[k] = ray_dir.x;
+            packet.ray.dir_y[k] = ray_dir.y;
+            packet.ray.dir_z[k] = ray_dir.z;
+            packet.ray.tnear[k] = scene_offset;
+            // As in __raygen__ao: a distance ray blocked by the plane only looks for closer hits, and an 
+            // occlusion ray blocked by it is not traced at all
+            packet.ray.tfar[k]  = num_radii > 0 && plane_t[k] >= 0.0f ? plane_t[k] : scene_maxdistance;
+            packet.ray.time[k]  = 0.0f;
+            packet.ray.mask[k]  = 0xffffffffu;
+            packet.ray.id[k]    = unsigned( k );
+            packet.ray.flags[k] = 0;
+            packet.hit.geomID[k] = RTC_INVALID_GEOMETRY_ID;
+            valid[k] = k < count && ( num_radii > 0 || plane_t[k] < 0.0f ) ? -1 : 0;
+            any_valid = any_valid || valid[k] != 0;
+          }
+
+          if ( num_radii > 0 ) {
+            if ( any_valid ) rtcIntersect16( valid, top_scene, &context, &packet );
+            for (int k = 0; k < count; ++k) {
+              const float t = packet.hit.geomID[k] != RTC_INVALID_GEOMETRY_ID ? packet.ray.tfar[k] : plane_t[k];
+              if ( t < 0.0f ) continue;
+              for (size_t r = 0; r < num_radii; ++r) occluded[r] += t <= radii[r] ? 1 : 0;
+            }
+          } else {
+            // Occluded rays come back with tfar set to -inf
+            if ( any_valid ) rtcOccluded16( valid, top_scene, &context, &packet.ray );
+            for (int k = 0; k < count; ++k) {
+              occluded[0] += plane_t[k] >= 0.0f || packet.ray.tfar[k] < 0.0f ? 1 : 0;
+            }
+          }
+          num_rays += count;
+
+          if ( tolerance > 0.0f && num_rays >= bake::ADAPTIVE_MIN_RAYS && ( num_rays & ( num_rays - 1 ) ) == 0 ) {
+            const float p = float( occluded[0] ) / num_rays;
+            if ( sqrtf( p*( 1.0f - p ) / num_rays ) <= tolerance ) break;
+          }
+        }
+
+        for (int c = 0; c < num_radius_channels; ++c) {
+          ao_values[( s + c )*ao_samples.num_samples + idx] = 1.0f - float( occluded[c] ) / num_rays;
+        }
+        num_rays_traced += num_rays;
+      }
+    }
+  }
+  query_timer.stop();
+
+  // Tracers that share batches finish together; keep their reports apart
+#pragma omp critical( bake_report )
+  {
+    std::cerr << "\n\tbackend ...         Embree, " << maxThreads() << " threads\n";
+    std::cerr << "\tbatches ...         " << num_batches << " of " << batches.num_batches << "\n";
+    std::cerr << "\tsetup ...           ";  printTimeElapsed( ctx->setup_timer );
+    std::cerr << "\t  build accels ...  ";  printTimeElapsed( ctx->accel_timer );
+    std::cerr << "\ttrace ...           ";  printTimeElapsed( query_timer );
+  }
+
+  recordTime( "ao.setup",       ctx->setup_timer );
+  recordTime( "ao.accel_build", ctx->accel_timer );
+  recordTime( "ao.query",       query_timer );
+  recordCount( "ao.batches",    num_batches );
+  recordCount( "ao.rays",       size_t( num_rays_traced ) );
+  ctx->setup_timer.reset();
+  ctx->accel_timer.reset();
+
+  trace_timer.stop();
+  recordTime( "ao.trace", trace_timer );
+  recordCount( "ao.samples", ao_samples.num_samples );
+  if ( trace_timer.elapsed > 0.0 ) {
+    recordGauge( "ao.rays_per_second", double( num_rays_traced ) / trace_timer.elapsed );
+  }
+}
+
+#else
+
+// Without Embree at build time host bakes are traced with Prime
+
+bake::EmbreeAOContext* bake::ao_embree_create_context( const Scene&, const bool, const AccelPreset, const GroundPlane* )
+{
+  return NULL;
+}
+
+void bake::ao_embree( EmbreeAOContext*, const Scene&, const AOSamples&, const int, const float, const float, const size_t, const float, 
+                      float*, const float*, const size_t, const bool, BatchCursor* )
+{
+  assert( false );
+}
+
+void bake::ao_embree_update_instances( EmbreeAOContext*, const Instance*, const size_t )
+{
+  assert( false );
+}
+
+void bake::ao_embree_update_geometry( EmbreeAOContext*, const Mesh*, const size_t, const Instance*, const size_t )
+{
+  assert( false );
+}
+
+void bake::ao_embree_destroy_context( EmbreeAOContext* )
+{
+}
+
+#endif
@@ -0,0 +1,80 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#pragma once
+
+#include "bake_api.h"
+
+struct BatchCursor;
+
+namespace bake
+{
+
+// Embree scenes of the occluders on the host
+struct EmbreeAOContext;
+
+// Returns NULL if the build has no Embree backend (BAKE_WITH_EMBREE) or Embree can't be started.  Needs no 
+// CUDA device.
+EmbreeAOContext* ao_embree_create_context(
+    const Scene& occluders,
+    const bool   conserve_memory,
+    const AccelPreset accel_preset,
+    const GroundPlane* ground_plane
+    );
+
+// Same results as ao_optix_prime, for samples with host positions and normals, with rays generated and traced
+// on the host: 16 ray packets of one sample, samples spread over OpenMP threads.
+void ao_embree(
+    EmbreeAOContext* context,
+    const Scene& scene,
+    const AOSamples& ao_samples,
+    const int    rays_per_sample,
+    const float  scene_offset,
+    const float  scene_maxdistance,
+    const size_t batch_size,    // only sets the seeds of samples, as batches do for the device backends
+    const float  adaptive_tolerance,
+    float*  ao_values,
+    const float* radii = NULL,  // as for ao_optix_prime
+    const size_t num_radii = 0,
+    const bool   two_sided = false,
+    BatchCursor* shared_batches = NULL  // batches to take turns at with another tracer, instead of batch_size
+    );
+
+void ao_embree_update_instances(
+    EmbreeAOContext* context,
+    const Instance*  instances,
+    const size_t     num_instances
+    );
+
+// New positions of the same meshes, e.g. the next frame of an animation: the mesh scenes are refit in place
+void ao_embree_update_geometry(
+    EmbreeAOContext* context,
+    const Mesh*      meshes,
+    const size_t     num_meshes,
+    const Instance*  instances,
+    const size_t     num_instances
+    );
+
+void ao_embree_destroy_context( EmbreeAOContext* context );
+
+}
@@ -0,0 +1,1454 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#include "bake_ao_file.h"
+#include "bake_api.h"
+#include "bake_util.h"
+
+#ifndef NOGZLIB
+#include <zlib.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+
+namespace {
+
+const char     AO_FILE_MAGIC[8] = { 'B', 'A', 'K', 'E', 'A', 'O', '2', '\0' };
+const uint32_t AO_FILE_VERSION  = 2;
+
+enum AOFileCompression {
+  AO_FILE_UNCOMPRESSED = 0,
+  AO_FILE_DEFLATE      = 1
+};
+
+struct AOFileHeader {
+  char     magic[8];
+  uint32_t version;
+  uint32_t bits_per_value;   // 8, 16 or 32
+  uint32_t compression;      // AOFileCompression
+  uint32_t reserved;
+  uint64_t num_instances;
+  uint64_t num_vertices;     // summed over instances, as in the raw format
+  uint64_t num_blobs;
+  // followed by num_instances x { storage_identifier, offset_vertices, num_vertices, blob_index },
+  // then num_instances x { file_offset, stored_bytes } of which num_blobs are used
+};
+
+const char     AO_INDEX_MAGIC[8] = { 'B', 'A', 'K', 'E', 'A', 'O', 'X', '\0' };
+
+// Last thing in a file with an index.  The index is num_slots x { storage_identifier, instance + 1, offset_vertices,
+// num_vertices } at index_offset, open addressed with linear probing; instance + 1 is 0 in empty slots.
+struct AOIndexFooter {
+  char     magic[8];
+  uint64_t num_slots;
+  uint64_t index_offset;
+};
+
+const size_t AO_INDEX_SLOT_ENTRIES = 4;
+
+// splitmix64 finalizer: identifiers are often counters or packed indices, which need mixing before masking
+uint64_t indexHash( uint64_t key )
+{
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  return key ^ ( key >> 31 );
+}
+
+// Power of two, at least twice the instances, so probes stay short
+uint64_t indexSlots( const uint64_t num_instances )
+{
+  uint64_t n = 2;
+  while ( n < 2*num_instances ) n *= 2;
+  return n;
+}
+
+// The index of instances whose table has 'entries' values each, starting with identifier, vertex offset and count,
+// followed by its footer.  The first instance with an identifier gets its slot.
+void buildIndex( const uint64_t* instance_table, const size_t entries, const uint64_t num_instances, const uint64_t index_offset,
+                 std::vector<uint64_t>& section )
+{
+  const uint64_t num_slots = indexSlots( num_instances );
+  section.assign( AO_INDEX_SLOT_ENTRIES*num_slots + sizeof(AOIndexFooter)/sizeof(uint64_t), 0 );
+  for (uint64_t i = 0; i < num_instances; ++i) {
+    const uint64_t* instance = instance_table + entries*i;
+    uint64_t slot = indexHash( instance[0] ) & ( num_slots - 1 );
+    while ( section[AO_INDEX_SLOT_ENTRIES*slot + 1] != 0 && section[AO_INDEX_SLOT_ENTRIES*slot] != instance[0] ) {
+      slot = ( slot + 1 ) & ( num_slots - 1 );
+    }
+    uint64_t* s = &section[AO_INDEX_SLOT_ENTRIES*slot];
+    if ( s[1] != 0 ) continue;
+    s[0] = instance[0];
+    s[1] = i + 1;
+    s[2] = instance[1];
+    s[3] = instance[2];
+  }
+  AOIndexFooter footer;
+  std::memcpy( footer.magic, AO_INDEX_MAGIC, sizeof(footer.magic) );
+  footer.num_slots = num_slots;
+  footer.index_offset = index_offset;
+  std::memcpy( &section[AO_INDEX_SLOT_ENTRIES*num_slots], &footer, sizeof(footer) );
+}
+
+uint64_t indexBytes( const uint64_t num_instances )
+{
+  return AO_INDEX_SLOT_ENTRIES*indexSlots( num_instances )*sizeof(uint64_t) + sizeof(AOIndexFooter);
+}
+
+// FNV-1a
+uint64_t hashBytes( const unsigned char* bytes, const size_t size )
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; ++i) {
+    h = (h ^ bytes[i]) * 1099511628211ULL;
+  }
+  return h ^ size;
+}
+
+uint64_t hashBytes( const std::vector<unsigned char>& bytes )
+{
+  return hashBytes( bytes.empty() ? NULL : &bytes[0], bytes.size() );
+}
+
+uint64_t instanceTableHash( const uint64_t* instance_table, const size_t entries, const uint64_t num_instances )
+{
+  return hashBytes( reinterpret_cast<const unsigned char*>( instance_table ), size_t( entries*num_instances*sizeof(uint64_t) ) );
+}
+
+template <typename T>
+void dequantize( const unsigned char* values, size_t n, float* ao )
+{
+  const float scale = 1.0f / float( T(~T(0)) );
+  for (size_t i = 0; i < n; ++i) {
+    T q;
+    std::memcpy( &q, values + i*sizeof(T), sizeof(T) );
+    ao[i] = float( q )*scale;
+  }
+}
+
+template <typename T>
+void quantize( const float* ao, size_t n, unsigned char* out )
+{
+  const float scale = float( T(~T(0)) );
+  T* q = reinterpret_cast<T*>( out );
+  for (size_t i = 0; i < n; ++i) {
+    const float v = std::min( std::max( ao[i], 0.0f ), 1.0f );
+    q[i] = T( v*scale + 0.5f );
+  }
+}
+
+// Deflates the stored values of an instance if asked for, and if that works
+void compressValues( std::vector<unsigned char>& values, bool compress, std::vector<unsigned char>& out )
+{
+#ifndef NOGZLIB
+  if ( compress && !values.empty() ) {
+    uLongf size = compressBound( (uLong)values.size() );
+    out.resize( size );
+    if ( compress2( &out[0], &size, &values[0], (uLong)values.size(), Z_DEFAULT_COMPRESSION ) == Z_OK ) {
+      out.resize( size );
+      return;
+    }
+  }
+#endif
+  out.swap( values );
+}
+
+void encodeInstance( const float* ao, size_t n, unsigned bits, bool compress, std::vector<unsigned char>& out )
+{
+  std::vector<unsigned char> values( n*(bits/8) );
+  if ( n > 0 ) {
+    if ( bits == 32 ) std::memcpy( &values[0], ao, n*sizeof(float) );
+    else              bake::quantizeVertexAO( ao, n, bits, &values[0] );
+  }
+  compressValues( values, compress, out );
+}
+
+struct Span {
+  const void* data;
+  size_t size;
+  Span( const void* d, size_t n ) : data( d ), size( n ) {}
+};
+
+} // end namespace
+
+
+void bake::quantizeVertexAO( const float* ao, const size_t n, const unsigned bits, unsigned char* out )
+{
+  if ( bits == 8 ) quantize<uint8_t>( ao, n, out );
+  else             quantize<uint16_t>( ao, n, out );
+}
+
+
+// Positioned reads and writes; buffers are written in order with as few system calls as possible
+struct bake::VertexAOWriter::File
+{
+#if defined(_WIN32)
+  FILE* file;
+
+  File() : file( NULL ) {}
+  bool open( const char* filename )  { file = fopen( filename, "w+b" ); return file != NULL; }
+  bool close()                       { const bool ok = fflush( file ) == 0; fclose( file ); file = NULL; return ok; }
+
+  bool writeAt( uint64_t offset, const std::vector<Span>& spans )
+  {
+    if ( _fseeki64( file, (__int64)offset, SEEK_SET ) != 0 ) return false;
+    for (size_t i = 0; i < spans.size(); ++i) {
+      if ( spans[i].size > 0 && fwrite( spans[i].data, 1, spans[i].size, file ) != spans[i].size ) return false;
+    }
+    return true;
+  }
+
+  bool readAt( uint64_t offset, void* data, size_t size )
+  {
+    return _fseeki64( file, (__int64)offset, SEEK_SET ) == 0 && fread( data, 1, size, file ) == size;
+  }
+#else
+  int fd;
+
+  File() : fd( -1 ) {}
+  bool open( const char* filename )  { fd = ::open( filename, O_RDWR | O_CREAT | O_TRUNC, 0644 ); return fd >= 0; }
+  bool close()                       { const bool ok = ::close( fd ) == 0; fd = -1; return ok; }
+
+  bool writeAt( uint64_t offset, const std::vector<Span>& spans )
+  {
+    if ( lseek( fd, (off_t)offset, SEEK_SET ) == (off_t)-1 ) return false;
+    std::vector<iovec> iov;
+    size_t next = 0;
+    while ( next < spans.size() ) {
+      iov.clear();
+      for (; next < spans.size() && iov.size() < IOV_MAX; ++next) {
+        if ( spans[next].size == 0 ) continue;
+        iovec v;
+        v.iov_base = const_cast<void*>( spans[next].data );
+        v.iov_len  = spans[next].size;
+        iov.push_back( v );
+      }
+      // writev may stop short; resume after the last byte written
+      size_t first = 0;
+      while ( first < iov.size() ) {
+        const ssize_t written = writev( fd, &iov[first], int(iov.size() - first) );
+        if ( written < 0 ) {
+          if ( errno == EINTR ) continue;
+          return false;
+        }
+        size_t remaining = size_t( written );
+        while ( first < iov.size() && remaining >= iov[first].iov_len ) {
+          remaining -= iov[first].iov_len;
+          ++first;
+        }
+        if ( first < iov.size() ) {
+          iov[first].iov_base = static_cast<char*>( iov[first].iov_base ) + remaining;
+          iov[first].iov_len -= remaining;
+        }
+      }
+    }
+    return true;
+  }
+
+  bool readAt( uint64_t offset, void* data, size_t size )
+  {
+    char* p = static_cast<char*>( data );
+    while ( size > 0 ) {
+      const ssize_t n = pread( fd, p, size, (off_t)offset );
+      if ( n < 0 && errno == EINTR ) continue;
+      if ( n <= 0 ) return false;
+      p += n;
+      offset += n;
+      size -= size_t( n );
+    }
+    return true;
+  }
+#endif
+};
+
+
+bake::VertexAOWriter::VertexAOWriter()
+  : m_file( NULL ), m_bits( 32 ), m_compress( false ), m_index( false ), m_end( 0 ), m_failed( false ), m_num_shared( 0 )
+{
+}
+
+
+bake::VertexAOWriter::~VertexAOWriter()
+{
+  if ( m_file ) {
+    m_file->close();
+    delete m_file;
+  }
+}
+
+
+bool bake::VertexAOWriter::open( const char* filename, const Scene& scene, const unsigned bits_per_value, const bool compress,
+                                 const bool index )
+{
+  if ( bits_per_value != 8 && bits_per_value != 16 && bits_per_value != 32 ) return false;
+#ifdef NOGZLIB
+  if ( compress ) return false;
+#endif
+  m_bits = bits_per_value;
+  m_compress = compress;
+  m_index = index;
+  m_failed = false;
+  m_num_shared = 0;
+  m_blobs.clear();
+  m_blob_hashes.clear();
+
+  // v2 reads back earlier blobs to confirm duplicates
+  m_file = new File;
+  if ( !m_file->open( filename ) ) {
+    delete m_file;
+    m_file = NULL;
+    return false;
+  }
+
+  uint64_t num_vertices = 0;
+  m_instance_table.resize( 4*scene.num_instances );
+  for (size_t i = 0; i < scene.num_instances; ++i) {
+    const uint64_t n = scene.meshes[scene.instances[i].mesh_index].num_vertices;
+    m_instance_table[4*i+0] = scene.instances[i].storage_identifier;
+    m_instance_table[4*i+1] = num_vertices;
+    m_instance_table[4*i+2] = n;
+    m_instance_table[4*i+3] = 0;
+    num_vertices += n;
+  }
+
+  if ( isRaw() ) {
+    std::vector<uint64_t> table( 2 + 3*scene.num_instances );
+    table[0] = scene.num_instances;
+    table[1] = num_vertices;
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      std::copy( &m_instance_table[4*i], &m_instance_table[4*i] + 3, &table[2 + 3*i] );
+    }
+    m_end = table.size()*sizeof(uint64_t);
+    m_failed = !m_file->writeAt( 0, std::vector<Span>( 1, Span( &table[0], m_end ) ) );
+    return !m_failed;
+  }
+
+  // Tables are written by close(), once blob offsets are known
+  m_end = sizeof(AOFileHeader) + scene.num_instances*( 4*sizeof(uint64_t) + sizeof(BlobEntry) );
+  return true;
+}
+
+
+bool bake::VertexAOWriter::sameAsStored( const BlobEntry& blob, const std::vector<unsigned char>& bytes )
+{
+  if ( blob.stored_bytes != bytes.size() ) return false;
+  std::vector<unsigned char> stored( bytes.size() );
+  if ( !stored.empty() && !m_file->readAt( blob.file_offset, &stored[0], stored.size() ) ) return false;
+  return stored == bytes;
+}
+
+
+bool bake::VertexAOWriter::append( const Scene& scene, const size_t begin, const size_t count, const float* const* ao_vertex )
+{
+  if ( !m_file || m_failed ) return false;
+
+  if ( isRaw() ) {
+    std::vector<Span> spans;
+    spans.reserve( count );
+    uint64_t bytes = 0;
+    for (size_t i = begin; i < begin + count; ++i) {
+      const size_t n = scene.meshes[scene.instances[i].mesh_index].num_vertices;
+      spans.push_back( Span( ao_vertex[i], sizeof(float)*n ) );
+      bytes += sizeof(float)*n;
+    }
+    m_failed = !m_file->writeAt( m_end, spans );
+    m_end += bytes;
+    return !m_failed;
+  }
+
+  // Quantize and compress in parallel; deduplicate and write in order
+  std::vector< std::vector<unsigned char> > encoded( count );
+#pragma omp parallel for schedule(dynamic)
+  for (ptrdiff_t k = 0; k < ptrdiff_t(count); ++k) {
+    const size_t i = begin + size_t(k);
+    encodeInstance( ao_vertex[i], scene.meshes[scene.instances[i].mesh_index].num_vertices, m_bits, m_compress, encoded[k] );
+  }
+  return appendEncoded( begin, encoded );
+}
+
+
+bool bake::VertexAOWriter::appendPacked( const Scene& scene, const size_t begin, const size_t count, const unsigned char* packed_ao )
+{
+  if ( !m_file || m_failed ) return false;
+  if ( m_bits != 8 && m_bits != 16 ) {
+    m_failed = true;
+    return false;
+  }
+
+  // Instances are back to back in the packed values; compress in parallel
+  const size_t value_bytes = m_bits/8;
+  std::vector<size_t> offsets( count + 1, 0 );
+  for (size_t k = 0; k < count; ++k) {
+    offsets[k+1] = offsets[k] + value_bytes*scene.meshes[scene.instances[begin + k].mesh_index].num_vertices;
+  }
+  std::vector< std::vector<unsigned char> > encoded( count );
+#pragma omp parallel for schedule(dynamic)
+  for (ptrdiff_t k = 0; k < ptrdiff_t(count); ++k) {
+    std::vector<unsigned char> values( packed_ao + offsets[k], packed_ao + offsets[k+1] );
+    compressValues( values, m_compress, encoded[k] );
+  }
+  return appendEncoded( begin, encoded );
+}
+
+
+bool bake::VertexAOWriter::appendEncoded( const size_t begin, const std::vector< std::vector<unsigned char> >& encoded )
+{
+  const size_t count = encoded.size();
+
+  // New blobs go out together after the loop; duplicates of those are confirmed from memory
+  const size_t first_new_blob = m_blobs.size();
+  std::vector<size_t> new_blob_sources;
+  std::vector<Span> spans;
+  const uint64_t write_offset = m_end;
+
+  for (size_t k = 0; k < count; ++k) {
+    const std::vector<unsigned char>& bytes = encoded[k];
+    const uint64_t hash = hashBytes( bytes );
+
+    size_t blob_index = m_blobs.size();
+    typedef std::multimap<uint64_t, size_t>::const_iterator Iter;
+    std::pair<Iter, Iter> candidates = m_blob_hashes.equal_range( hash );
+    for (Iter it = candidates.first; it != candidates.second; ++it) {
+      const bool same = it->second >= first_new_blob ? encoded[new_blob_sources[it->second - first_new_blob]] == bytes
+                                                     : sameAsStored( m_blobs[it->second], bytes );
+      if ( same ) {
+        blob_index = it->second;
+        break;
+      }
+    }
+
+    if ( blob_index == m_blobs.size() ) {
+      BlobEntry blob;
+      blob.file_offset = m_end;
+      blob.stored_bytes = bytes.size();
+      m_end += bytes.size();
+      m_blob_hashes.insert( std::make_pair( hash, m_blobs.size() ) );
+      m_blobs.push_back( blob );
+      new_blob_sources.push_back( k );
+      spans.push_back( Span( bytes.empty() ? NULL : &bytes[0], bytes.size() ) );
+    } else {
+      m_num_shared++;
+    }
+    m_instance_table[4*(begin + k) + 3] = blob_index;
+  }
+
+  m_failed = !m_file->writeAt( write_offset, spans );
+  return !m_failed;
+}
+
+
+bool bake::VertexAOWriter::close()
+{
+  if ( !m_file ) return false;
+  bool ok = !m_failed;
+
+  // The index goes after the values or blobs
+  if ( ok && m_index ) {
+    std::vector<uint64_t> section;
+    buildIndex( m_instance_table.empty() ? NULL : &m_instance_table[0], 4, m_instance_table.size() / 4, m_end, section );
+    ok = m_file->writeAt( m_end, std::vector<Span>( 1, Span( &section[0], section.size()*sizeof(uint64_t) ) ) );
+  }
+
+  if ( ok && !isRaw() ) {
+    const size_t num_instances = m_instance_table.size() / 4;
+    AOFileHeader header;
+    std::memset( &header, 0, sizeof(header) );
+    std::memcpy( header.magic, AO_FILE_MAGIC, sizeof(header.magic) );
+    header.version = AO_FILE_VERSION;
+    header.bits_per_value = m_bits;
+    header.compression = m_compress ? AO_FILE_DEFLATE : AO_FILE_UNCOMPRESSED;
+    header.num_instances = num_instances;
+    for (size_t i = 0; i < num_instances; ++i) header.num_vertices += m_instance_table[4*i+2];
+    header.num_blobs = m_blobs.size();
+
+    std::vector<BlobEntry> blobs( m_blobs );
+    blobs.resize( num_instances );  // unused entries are zero
+
+    std::vector<Span> spans;
+    spans.push_back( Span( &header, sizeof(header) ) );
+    if ( num_instances > 0 ) {
+      spans.push_back( Span( &m_instance_table[0], m_instance_table.size()*sizeof(uint64_t) ) );
+      spans.push_back( Span( &blobs[0], blobs.size()*sizeof(BlobEntry) ) );
+    }
+    ok = m_file->writeAt( 0, spans );
+  }
+
+  ok = m_file->close() && ok;
+  delete m_file;
+  m_file = NULL;
+  return ok;
+}
+
+
+// A mapping of a whole file: read-write of a new file created at its size, or read-only or read-write of an existing one
+struct bake::FileMapping
+{
+#if defined(_WIN32)
+  HANDLE file, map;
+  void*  data;
+  size_t size;
+
+  FileMapping() : file( INVALID_HANDLE_VALUE ), map( NULL ), data( NULL ), size( 0 ) {}
+
+  bool openRead( const char* filename )
+  {
+    file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+    if ( file == INVALID_HANDLE_VALUE ) return false;
+    LARGE_INTEGER bytes;
+    if ( !GetFileSizeEx( file, &bytes ) || bytes.QuadPart <= 0 ) return false;
+    map = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+    if ( !map ) return false;
+    data = MapViewOfFile( map, FILE_MAP_READ, 0, 0, 0 );
+    size = size_t( bytes.QuadPart );
+    return data != NULL;
+  }
+
+  bool openReadWrite( const char* filename )
+  {
+    file = CreateFileA( filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+    if ( file == INVALID_HANDLE_VALUE ) return false;
+    LARGE_INTEGER bytes;
+    if ( !GetFileSizeEx( file, &bytes ) || bytes.QuadPart <= 0 ) return false;
+    map = CreateFileMappingA( file, NULL, PAGE_READWRITE, 0, 0, NULL );
+    if ( !map ) return false;
+    data = MapViewOfFile( map, FILE_MAP_WRITE, 0, 0, 0 );
+    size = size_t( bytes.QuadPart );
+    return data != NULL;
+  }
+
+  bool open( const char* filename, const uint64_t bytes )
+  {
+    file = CreateFileA( filename, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+    if ( file == INVALID_HANDLE_VALUE ) return false;
+    map = CreateFileMappingA( file, NULL, PAGE_READWRITE, DWORD( bytes >> 32 ), DWORD( bytes & 0xffffffffu ), NULL );
+    if ( !map ) return false;
+    data = MapViewOfFile( map, FILE_MAP_WRITE, 0, 0, 0 );
+    size = size_t( bytes );
+    return data != NULL;
+  }
+
+  bool flush() { return FlushViewOfFile( data, 0 ) && FlushFileBuffers( file ); }
+
+  bool close( const bool written = true )
+  {
+    bool ok = true;
+    if ( data ) ok = ( !written || flush() ) && UnmapViewOfFile( data );
+    if ( map ) CloseHandle( map );
+    if ( file != INVALID_HANDLE_VALUE ) ok = CloseHandle( file ) && ok;
+    file = INVALID_HANDLE_VALUE;
+    map = NULL;
+    data = NULL;
+    return ok;
+  }
+#else
+  int    fd;
+  void*  data;
+  size_t size;
+
+  FileMapping() : fd( -1 ), data( NULL ), size( 0 ) {}
+
+  bool openRead( const char* filename )
+  {
+    fd = ::open( filename, O_RDONLY );
+    struct stat st;
+    if ( fd < 0 || fstat( fd, &st ) != 0 || st.st_size <= 0 ) return false;
+    size = size_t( st.st_size );
+    void* addr = mmap( NULL, size, PROT_READ, MAP_SHARED, fd, 0 );
+    if ( addr == MAP_FAILED ) return false;
+    data = addr;
+    return true;
+  }
+
+  bool openReadWrite( const char* filename )
+  {
+    fd = ::open( filename, O_RDWR );
+    struct stat st;
+    if ( fd < 0 || fstat( fd, &st ) != 0 || st.st_size <= 0 ) return false;
+    size = size_t( st.st_size );
+    void* addr = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if ( addr == MAP_FAILED ) return false;
+    data = addr;
+    return true;
+  }
+
+  bool open( const char* filename, const uint64_t bytes )
+  {
+    fd = ::open( filename, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if ( fd < 0 || ftruncate( fd, (off_t)bytes ) != 0 ) return false;
+    // An empty file can't be mapped; there is nothing to write to it either
+    size = size_t( bytes );
+    void* addr = mmap( NULL, std::max( size, size_t(1) ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if ( addr == MAP_FAILED ) return false;
+    data = addr;
+    return true;
+  }
+
+  bool flush() { return msync( data, size, MS_SYNC ) == 0; }
+
+  bool close( const bool written = true )
+  {
+    bool ok = true;
+    if ( data ) ok = ( !written || flush() ) && munmap( data, std::max( size, size_t(1) ) ) == 0;
+    if ( fd >= 0 ) ok = ::close( fd ) == 0 && ok;
+    fd = -1;
+    data = NULL;
+    return ok;
+  }
+#endif
+};
+
+
+bake::MappedVertexAOFile::MappedVertexAOFile()
+  : m_mapping( NULL ), m_values( NULL )
+{
+}
+
+
+bake::MappedVertexAOFile::~MappedVertexAOFile()
+{
+  close();
+}
+
+
+bool bake::MappedVertexAOFile::open( const char* filename, const Scene& scene, const bool index )
+{
+  close();
+
+  std::vector<uint64_t> table( 2 + 3*scene.num_instances );
+  m_offsets.resize( scene.num_instances );
+  uint64_t num_vertices = 0;
+  for (size_t i = 0; i < scene.num_instances; ++i) {
+    const uint64_t n = scene.meshes[scene.instances[i].mesh_index].num_vertices;
+    table[2 + 3*i + 0] = scene.instances[i].storage_identifier;
+    table[2 + 3*i + 1] = num_vertices;
+    table[2 + 3*i + 2] = n;
+    m_offsets[i] = num_vertices;
+    num_vertices += n;
+  }
+  table[0] = scene.num_instances;
+  table[1] = num_vertices;
+
+  const uint64_t table_bytes = table.size()*sizeof(uint64_t);
+  const uint64_t values_end = table_bytes + num_vertices*sizeof(float);
+  m_mapping = new FileMapping;
+  if ( !m_mapping->open( filename, values_end + ( index ? indexBytes( scene.num_instances ) : 0 ) ) ) {
+    m_mapping->close();
+    delete m_mapping;
+    m_mapping = NULL;
+    return false;
+  }
+  std::memcpy( m_mapping->data, &table[0], table_bytes );
+  m_values = reinterpret_cast<float*>( static_cast<char*>( m_mapping->data ) + table_bytes );
+  if ( index ) {
+    std::vector<uint64_t> section;
+    buildIndex( &table[2], 3, scene.num_instances, values_end, section );
+    std::memcpy( static_cast<char*>( m_mapping->data ) + values_end, &section[0], section.size()*sizeof(uint64_t) );
+  }
+  return true;
+}
+
+
+bool bake::MappedVertexAOFile::flush()
+{
+  return m_mapping && m_mapping->flush();
+}
+
+
+bool bake::MappedVertexAOFile::close()
+{
+  if ( !m_mapping ) return false;
+  const bool ok = m_mapping->close();
+  delete m_mapping;
+  m_mapping = NULL;
+  m_values = NULL;
+  return ok;
+}
+
+
+bake::VertexAOReader::VertexAOReader()
+  : m_mapping( NULL ), m_instances( NULL ), m_blobs( NULL ), m_data( NULL ), m_slots( NULL ), m_num_slots( 0 ), m_num_instances( 0 ),
+    m_bits( 32 ), m_raw( true ), m_compressed( false )
+{
+}
+
+
+bake::VertexAOReader::~VertexAOReader()
+{
+  close();
+}
+
+
+bool bake::VertexAOReader::open( const char* filename )
+{
+  close();
+  m_mapping = new FileMapping;
+  if ( !m_mapping->openRead( filename ) ) {
+    close();
+    return false;
+  }
+  const unsigned char* file = static_cast<const unsigned char*>( m_mapping->data );
+  const uint64_t size = m_mapping->size;
+
+  // Tables are checked against the file size, so lookups stay inside the mapping
+  uint64_t tables_end = 0;
+  if ( size >= sizeof(AOFileHeader) && std::memcmp( file, AO_FILE_MAGIC, sizeof(AO_FILE_MAGIC) ) == 0 ) {
+    const AOFileHeader* header = reinterpret_cast<const AOFileHeader*>( file );
+    if ( header->version != AO_FILE_VERSION ) {
+      close();
+      return false;
+    }
+    m_raw = false;
+    m_bits = header->bits_per_value;
+    m_compressed = header->compression == AO_FILE_DEFLATE;
+    m_num_instances = header->num_instances;
+    if ( m_num_instances > size / ( 6*sizeof(uint64_t) ) ) {
+      close();
+      return false;
+    }
+    m_instances = reinterpret_cast<const uint64_t*>( file + sizeof(AOFileHeader) );
+    m_blobs = m_instances + 4*m_num_instances;
+    m_data = file;
+    tables_end = sizeof(AOFileHeader) + 6*m_num_instances*sizeof(uint64_t);
+  } else if ( size >= 2*sizeof(uint64_t) ) {
+    const uint64_t* counts = reinterpret_cast<const uint64_t*>( file );
+    m_raw = true;
+    m_bits = 32;
+    m_compressed = false;
+    m_num_instances = counts[0];
+    if ( m_num_instances > size / ( 3*sizeof(uint64_t) ) || counts[1] > size / sizeof(float) ) {
+      close();
+      return false;
+    }
+    m_instances = counts + 2;
+    m_data = file + ( 2 + 3*m_num_instances )*sizeof(uint64_t);
+    tables_end = ( 2 + 3*m_num_instances )*sizeof(uint64_t) + counts[1]*sizeof(float);
+  }
+  if ( tables_end == 0 || tables_end > size ) {
+    close();
+    return false;
+  }
+
+  if ( size >= tables_end + sizeof(AOIndexFooter) ) {
+    AOIndexFooter footer;
+    std::memcpy( &footer, file + size - sizeof(footer), sizeof(footer) );
+    if ( std::memcmp( footer.magic, AO_INDEX_MAGIC, sizeof(footer.magic) ) == 0 && footer.num_slots > 0 &&
+         footer.index_offset + footer.num_slots*AO_INDEX_SLOT_ENTRIES*sizeof(uint64_t) + sizeof(footer) == size ) {
+      m_slots = reinterpret_cast<const uint64_t*>( file + footer.index_offset );
+      m_num_slots = footer.num_slots;
+    }
+  }
+  return true;
+}
+
+
+void bake::VertexAOReader::close()
+{
+  if ( m_mapping ) {
+    m_mapping->close( false );
+    delete m_mapping;
+  }
+  m_mapping = NULL;
+  m_instances = m_blobs = m_slots = NULL;
+  m_data = NULL;
+  m_num_slots = m_num_instances = 0;
+}
+
+
+uint64_t bake::VertexAOReader::layoutHash() const
+{
+  return instanceTableHash( m_instances, m_raw ? 3 : 4, m_num_instances );
+}
+
+
+bool bake::VertexAOReader::entry( const uint64_t instance, VertexAOEntry& e ) const
+{
+  const size_t entries = m_raw ? 3 : 4;
+  const uint64_t* table = m_instances + entries*instance;
+  e.instance = instance;
+  e.offset_vertices = table[1];
+  e.num_vertices = table[2];
+  if ( m_raw ) {
+    e.data = m_data + e.offset_vertices*sizeof(float);
+    e.stored_bytes = e.num_vertices*sizeof(float);
+  } else {
+    const uint64_t* blob = m_blobs + 2*table[3];
+    if ( table[3] >= m_num_instances || blob[0] + blob[1] > m_mapping->size ) return false;
+    e.data = m_data + blob[0];
+    e.stored_bytes = blob[1];
+  }
+  return true;
+}
+
+
+bool bake::VertexAOReader::find( const uint64_t storage_identifier, VertexAOEntry& e ) const
+{
+  if ( !m_mapping ) return false;
+  if ( m_num_slots > 0 ) {
+    uint64_t slot = indexHash( storage_identifier ) & ( m_num_slots - 1 );
+    for (uint64_t probe = 0; probe < m_num_slots; ++probe) {
+      const uint64_t* s = m_slots + AO_INDEX_SLOT_ENTRIES*slot;
+      if ( s[1] == 0 || s[1] > m_num_instances ) return false;
+      if ( s[0] == storage_identifier ) return entry( s[1] - 1, e );
+      slot = ( slot + 1 ) & ( m_num_slots - 1 );
+    }
+    return false;
+  }
+  const size_t entries = m_raw ? 3 : 4;
+  for (uint64_t i = 0; i < m_num_instances; ++i) {
+    if ( m_instances[entries*i] == storage_identifier ) return entry( i, e );
+  }
+  return false;
+}
+
+
+bool bake::VertexAOReader::decode( const VertexAOEntry& e, float* ao ) const
+{
+  const size_t n = size_t( e.num_vertices );
+  const size_t bytes = n*( m_bits/8 );
+  if ( n == 0 ) return true;
+  if ( !m_mapping ) return false;
+  const unsigned char* values = static_cast<const unsigned char*>( e.data );
+  std::vector<unsigned char> inflated;
+  // The writer stores a blob as is where deflating it failed
+  if ( m_compressed && e.stored_bytes != bytes ) {
+#ifdef NOGZLIB
+    return false;
+#else
+    inflated.resize( bytes );
+    uLongf size = (uLongf)bytes;
+    if ( uncompress( &inflated[0], &size, values, (uLong)e.stored_bytes ) != Z_OK || size != bytes ) return false;
+    values = &inflated[0];
+#endif
+  } else if ( e.stored_bytes != bytes ) {
+    return false;
+  }
+  const unsigned char* file = static_cast<const unsigned char*>( m_mapping->data );
+  if ( m_raw && ( values < file || uint64_t( values - file ) + bytes > m_mapping->size ) ) return false;
+
+  if ( m_bits == 8 )       dequantize<uint8_t>( values, n, ao );
+  else if ( m_bits == 16 ) dequantize<uint16_t>( values, n, ao );
+  else if ( m_bits == 32 ) std::memcpy( ao, values, bytes );
+  else return false;
+  return true;
+}
+
+
+namespace {
+
+// Tables of one input to mergeVertexAOFiles; its values or blobs follow them to the end of the file
+struct MergeInput {
+  bool raw;
+  AOFileHeader header;                // v2 only
+  std::vector<uint64_t> instances;    // 3 (raw) or 4 (v2) entries per instance
+  std::vector<uint64_t> blobs;        // 2 entries per blob table entry, v2 only
+  uint64_t data_offset;
+  bool indexed;
+  uint64_t index_offset;              // where the values or blobs end, if indexed
+};
+
+bool readMergeInput( FILE* file, MergeInput& input )
+{
+  uint64_t first[2];
+  if ( fread( first, sizeof(uint64_t), 2, file ) != 2 ) return false;
+  input.raw = std::memcmp( first, AO_FILE_MAGIC, sizeof(AO_FILE_MAGIC) ) != 0;
+  uint64_t num_instances = first[0];
+  if ( !input.raw ) {
+    std::memcpy( &input.header, first, sizeof(first) );
+    if ( fread( reinterpret_cast<char*>( &input.header ) + sizeof(first), sizeof(input.header) - sizeof(first), 1, file ) != 1 ) return false;
+    if ( input.header.version != AO_FILE_VERSION ) return false;
+    num_instances = input.header.num_instances;
+  }
+  const size_t entries = input.raw ? 3 : 4;
+  input.instances.resize( entries*num_instances );
+  if ( num_instances > 0 && fread( &input.instances[0], sizeof(uint64_t), input.instances.size(), file ) != input.instances.size() ) return false;
+  if ( !input.raw ) {
+    input.blobs.resize( 2*num_instances );
+    if ( num_instances > 0 && fread( &input.blobs[0], sizeof(uint64_t), input.blobs.size(), file ) != input.blobs.size() ) return false;
+  }
+  input.data_offset = input.raw ? (2 + input.instances.size())*sizeof(uint64_t) 
+                                : sizeof(AOFileHeader) + (input.instances.size() + input.blobs.size())*sizeof(uint64_t);
+
+  AOIndexFooter footer;
+  input.indexed = fseek( file, -long( sizeof(footer) ), SEEK_END ) == 0 && fread( &footer, sizeof(footer), 1, file ) == 1 &&
+                  std::memcmp( footer.magic, AO_INDEX_MAGIC, sizeof(footer.magic) ) == 0;
+  input.index_offset = input.indexed ? footer.index_offset : 0;
+  return true;
+}
+
+bool copyBytes( FILE* from, FILE* to, uint64_t bytes )
+{
+  std::vector<char> buffer( 1 << 20 );
+  while ( bytes > 0 ) {
+    const size_t n = size_t( std::min( bytes, uint64_t( buffer.size() ) ) );
+    if ( fread( &buffer[0], 1, n, from ) != n || fwrite( &buffer[0], 1, n, to ) != n ) return false;
+    bytes -= n;
+  }
+  return true;
+}
+
+bool copyToEnd( FILE* from, FILE* to )
+{
+  std::vector<char> buffer( 1 << 20 );
+  size_t n;
+  while ( (n = fread( &buffer[0], 1, buffer.size(), from )) > 0 ) {
+    if ( fwrite( &buffer[0], 1, n, to ) != n ) return false;
+  }
+  return ferror( from ) == 0;
+}
+
+} // end namespace
+
+
+bool bake::mergeVertexAOFiles( const char* output_filename, const char* const* input_filenames, const size_t num_inputs )
+{
+  if ( num_inputs == 0 ) return false;
+
+  // The tables come first, so they are merged before any values are copied
+  std::vector<MergeInput> inputs( num_inputs );
+  uint64_t num_instances = 0;
+  bool indexed = true;
+  for (size_t k = 0; k < num_inputs; ++k) {
+    FILE* file = fopen( input_filenames[k], "rb" );
+    if ( !file ) return false;
+    const bool ok = readMergeInput( file, inputs[k] );
+    fclose( file );
+    if ( !ok ) return false;
+    const MergeInput& input = inputs[k];
+    if ( input.raw != inputs[0].raw ) return false;
+    if ( !input.raw && ( input.header.bits_per_value != inputs[0].header.bits_per_value || 
+                         input.header.compression != inputs[0].header.compression ) ) return false;
+    num_instances += input.instances.size() / (input.raw ? 3 : 4);
+    indexed = indexed && input.indexed;
+  }
+
+  const bool raw = inputs[0].raw;
+  const size_t entries = raw ? 3 : 4;
+  std::vector<uint64_t> instance_table;
+  std::vector<uint64_t> blob_table;
+  instance_table.reserve( entries*num_instances );
+  blob_table.reserve( 2*num_instances );
+  const uint64_t data_offset = raw ? (2 + entries*num_instances)*sizeof(uint64_t) 
+                                   : sizeof(AOFileHeader) + (entries + 2)*num_instances*sizeof(uint64_t);
+  uint64_t num_vertices = 0;
+  uint64_t num_blobs = 0;
+  uint64_t data_bytes = 0;
+  for (size_t k = 0; k < num_inputs; ++k) {
+    const MergeInput& input = inputs[k];
+    const size_t n = input.instances.size() / entries;
+    uint64_t input_vertices = 0;
+    for (size_t i = 0; i < n; ++i) {
+      const uint64_t* entry = &input.instances[entries*i];
+      instance_table.push_back( entry[0] );
+      instance_table.push_back( entry[1] + num_vertices );
+      instance_table.push_back( entry[2] );
+      if ( !raw ) instance_table.push_back( entry[3] + num_blobs );
+      input_vertices += entry[2];
+    }
+
+    // Raw values are one float per vertex; v2 blobs end with the last one stored
+    uint64_t input_bytes = input_vertices*sizeof(float);
+    if ( !raw ) {
+      input_bytes = 0;
+      for (uint64_t b = 0; b < input.header.num_blobs; ++b) {
+        blob_table.push_back( input.blobs[2*b] - input.data_offset + data_offset + data_bytes );
+        blob_table.push_back( input.blobs[2*b+1] );
+        input_bytes = std::max( input_bytes, input.blobs[2*b] + input.blobs[2*b+1] - input.data_offset );
+      }
+      num_blobs += input.header.num_blobs;
+    }
+    num_vertices += input_vertices;
+    data_bytes += input_bytes;
+  }
+
+  FILE* out = fopen( output_filename, "wb" );
+  if ( !out ) return false;
+  bool ok = true;
+  if ( raw ) {
+    const uint64_t counts[2] = { num_instances, num_vertices };
+    ok = fwrite( counts, sizeof(counts), 1, out ) == 1;
+  } else {
+    AOFileHeader header = inputs[0].header;
+    header.num_instances = num_instances;
+    header.num_vertices = num_vertices;
+    header.num_blobs = num_blobs;
+    ok = fwrite( &header, sizeof(header), 1, out ) == 1;
+    blob_table.resize( 2*num_instances );  // unused entries are zero
+  }
+  if ( ok && !instance_table.empty() ) ok = fwrite( &instance_table[0], sizeof(uint64_t), instance_table.size(), out ) == instance_table.size();
+  if ( ok && !blob_table.empty() ) ok = fwrite( &blob_table[0], sizeof(uint64_t), blob_table.size(), out ) == blob_table.size();
+
+  for (size_t k = 0; ok && k < num_inputs; ++k) {
+    FILE* file = fopen( input_filenames[k], "rb" );
+    if ( !file ) {
+      ok = false;
+      break;
+    }
+    // Tables are small enough for fseek's long offset.  An index ends the data of its input.
+    ok = fseek( file, long( inputs[k].data_offset ), SEEK_SET ) == 0 && 
+         ( inputs[k].indexed ? copyBytes( file, out, inputs[k].index_offset - inputs[k].data_offset ) : copyToEnd( file, out ) );
+    fclose( file );
+  }
+
+  if ( ok && indexed ) {
+    std::vector<uint64_t> section;
+    buildIndex( instance_table.empty() ? NULL : &instance_table[0], entries, num_instances, data_offset + data_bytes, section );
+    ok = fwrite( &section[0], sizeof(uint64_t), section.size(), out ) == section.size();
+  }
+
+  ok = fclose( out ) == 0 && ok;
+  return ok;
+}
+
+
+bool bake::overlayVertexAOFiles( const char* output_filename, const char* base_filename, const char* overlay_filename,
+                                 size_t* num_replaced )
+{
+  VertexAOReader base;
+  VertexAOReader overlay;
+  if ( !base.open( base_filename ) || !overlay.open( overlay_filename ) ) return false;
+
+  // The writer only reads vertex counts and identifiers from a scene, so each instance gets a mesh of its count
+  const size_t num_instances = size_t( base.numInstances() );
+  std::vector<VertexAOEntry> entries( num_instances );
+  std::vector<char> replaced( num_instances, 0 );
+  std::vector<Mesh> meshes( num_instances );
+  std::vector<Instance> instances( num_instances );
+  size_t count = 0;
+  for (size_t i = 0; i < num_instances; ++i) {
+    if ( !base.entry( i, entries[i] ) ) return false;
+    VertexAOEntry e;
+    const uint64_t id = base.storageIdentifier( i );
+    if ( overlay.find( id, e ) && e.num_vertices == entries[i].num_vertices ) {
+      entries[i] = e;
+      replaced[i] = 1;
+      count++;
+    }
+    meshes[i].num_vertices = size_t( entries[i].num_vertices );
+    instances[i].storage_identifier = id;
+    instances[i].mesh_index = unsigned( i );
+  }
+  const Scene scene = { meshes.empty() ? NULL : &meshes[0], num_instances, instances.empty() ? NULL : &instances[0], num_instances };
+
+  VertexAOWriter writer;
+  if ( !writer.open( output_filename, scene, base.bitsPerValue(), base.compressed(), base.hasIndex() ) ) return false;
+
+  // Decoded a chunk at a time, to bound memory for large files
+  const size_t chunk = 4096;
+  std::vector< std::vector<float> > values( std::min( chunk, num_instances ) );
+  std::vector<const float*> ao_vertex( num_instances, (const float*)NULL );
+  bool ok = true;
+  for (size_t begin = 0; ok && begin < num_instances; begin += chunk) {
+    const size_t end = std::min( begin + chunk, num_instances );
+    int failures = 0;
+#pragma omp parallel for reduction(+:failures) schedule(dynamic)
+    for (ptrdiff_t i = ptrdiff_t(begin); i < ptrdiff_t(end); ++i) {
+      std::vector<float>& v = values[size_t(i) - begin];
+      v.resize( size_t( entries[i].num_vertices ) );
+      if ( !( replaced[i] ? overlay : base ).decode( entries[i], v.empty() ? NULL : &v[0] ) ) failures++;
+      ao_vertex[i] = v.empty() ? NULL : &v[0];
+    }
+    ok = failures == 0 && writer.append( scene, begin, end - begin, &ao_vertex[0] );
+  }
+  ok = writer.close() && ok;
+  if ( num_replaced ) *num_replaced = count;
+  return ok;
+}
+
+
+namespace {
+
+const char     AO_PATCH_MAGIC[8] = { 'B', 'A', 'K', 'E', 'A', 'O', 'P', '\0' };
+const uint32_t AO_PATCH_VERSION  = 1;
+
+struct AOPatchHeader {
+  char     magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t base_hash;        // instanceTableHash of the base
+  uint64_t num_entries;
+  uint64_t num_vertices;     // summed over entries
+  // followed by num_entries x { storage_identifier, base instance, offset_vertices in the base, num_vertices },
+  // then the float values of the entries in order
+};
+
+const size_t AO_PATCH_ENTRIES = 4;
+
+} // end namespace
+
+
+bool bake::writeVertexAOPatch( const char* patch_filename, const char* base_filename, const Scene& scene, const float* const* ao_vertex,
+                               size_t* num_changed )
+{
+  VertexAOReader base;
+  if ( !base.open( base_filename ) || !base.raw() ) return false;
+
+  // Unchanged instances are found in parallel; the table keeps scene order
+  std::vector<VertexAOEntry> entries( scene.num_instances );
+  std::vector<char> changed( scene.num_instances, 0 );
+#pragma omp parallel for schedule(dynamic, 256)
+  for (ptrdiff_t i = 0; i < ptrdiff_t(scene.num_instances); ++i) {
+    const size_t n = scene.meshes[scene.instances[i].mesh_index].num_vertices;
+    VertexAOEntry& e = entries[i];
+    if ( !ao_vertex[i] || !base.find( scene.instances[i].storage_identifier, e ) || e.num_vertices != n ) continue;
+    changed[i] = n > 0 && std::memcmp( e.data, ao_vertex[i], n*sizeof(float) ) != 0;
+  }
+
+  std::vector<uint64_t> table;
+  uint64_t num_vertices = 0;
+  for (size_t i = 0; i < scene.num_instances; ++i) {
+    if ( !changed[i] ) continue;
+    table.push_back( scene.instances[i].storage_identifier );
+    table.push_back( entries[i].instance );
+    table.push_back( entries[i].offset_vertices );
+    table.push_back( entries[i].num_vertices );
+    num_vertices += entries[i].num_vertices;
+  }
+
+  AOPatchHeader header;
+  std::memset( &header, 0, sizeof(header) );
+  std::memcpy( header.magic, AO_PATCH_MAGIC, sizeof(header.magic) );
+  header.version = AO_PATCH_VERSION;
+  header.base_hash = base.layoutHash();
+  header.num_entries = table.size() / AO_PATCH_ENTRIES;
+  header.num_vertices = num_vertices;
+
+  FILE* out = fopen( patch_filename, "wb" );
+  if ( !out ) return false;
+  bool ok = fwrite( &header, sizeof(header), 1, out ) == 1;
+  if ( ok && !table.empty() ) ok = fwrite( &table[0], sizeof(uint64_t), table.size(), out ) == table.size();
+  for (size_t i = 0; ok && i < scene.num_instances; ++i) {
+    if ( changed[i] ) ok = fwrite( ao_vertex[i], sizeof(float), size_t( entries[i].num_vertices ), out ) == entries[i].num_vertices;
+  }
+  ok = fclose( out ) == 0 && ok;
+  if ( num_changed ) *num_changed = size_t( header.num_entries );
+  return ok;
+}
+
+
+bool bake::diffVertexAOFiles( const char* patch_filename, const char* base_filename, const char* new_filename, size_t* num_changed )
+{
+  VertexAOReader input;
+  if ( !input.open( new_filename ) ) return false;
+
+  // As in overlayVertexAOFiles, each instance gets a mesh of its vertex count
+  const size_t num_instances = size_t( input.numInstances() );
+  std::vector< std::vector<float> > values( num_instances );
+  std::vector<const float*> ao_vertex( num_instances, (const float*)NULL );
+  std::vector<Mesh> meshes( num_instances );
+  std::vector<Instance> instances( num_instances );
+  int failures = 0;
+#pragma omp parallel for reduction(+:failures) schedule(dynamic)
+  for (ptrdiff_t i = 0; i < ptrdiff_t(num_instances); ++i) {
+    VertexAOEntry e;
+    if ( !input.entry( uint64_t(i), e ) ) {
+      failures++;
+      continue;
+    }
+    values[i].resize( size_t( e.num_vertices ) );
+    if ( !input.decode( e, values[i].empty() ? NULL : &values[i][0] ) ) failures++;
+    ao_vertex[i] = values[i].empty() ? NULL : &values[i][0];
+    meshes[i].num_vertices = size_t( e.num_vertices );
+    instances[i].storage_identifier = input.storageIdentifier( uint64_t(i) );
+    instances[i].mesh_index = unsigned( i );
+  }
+  if ( failures > 0 ) return false;
+  const Scene scene = { meshes.empty() ? NULL : &meshes[0], num_instances, instances.empty() ? NULL : &instances[0], num_instances };
+  return writeVertexAOPatch( patch_filename, base_filename, scene, ao_vertex.empty() ? NULL : &ao_vertex[0], num_changed );
+}
+
+
+bool bake::applyVertexAOPatch( const char* base_filename, const char* patch_filename, size_t* num_applied )
+{
+  FileMapping patch;
+  if ( !patch.openRead( patch_filename ) || patch.size < sizeof(AOPatchHeader) ) {
+    patch.close( false );
+    return false;
+  }
+  AOPatchHeader header;
+  std::memcpy( &header, patch.data, sizeof(header) );
+  const uint64_t* table = reinterpret_cast<const uint64_t*>( static_cast<const char*>( patch.data ) + sizeof(header) );
+  const uint64_t table_bytes = header.num_entries*AO_PATCH_ENTRIES*sizeof(uint64_t);
+  const float* values = reinterpret_cast<const float*>( reinterpret_cast<const char*>( table ) + table_bytes );
+  if ( std::memcmp( header.magic, AO_PATCH_MAGIC, sizeof(header.magic) ) != 0 || header.version != AO_PATCH_VERSION ||
+       header.num_entries > patch.size / ( AO_PATCH_ENTRIES*sizeof(uint64_t) ) || header.num_vertices > patch.size / sizeof(float) ||
+       sizeof(header) + table_bytes + header.num_vertices*sizeof(float) != patch.size ) {
+    patch.close( false );
+    return false;
+  }
+
+  FileMapping base;
+  bool ok = base.openReadWrite( base_filename ) && base.size >= 2*sizeof(uint64_t) &&
+            std::memcmp( base.data, AO_FILE_MAGIC, sizeof(AO_FILE_MAGIC) ) != 0;
+  const uint64_t* counts = ok ? static_cast<const uint64_t*>( base.data ) : NULL;
+  ok = ok && counts[0] <= base.size / ( 3*sizeof(uint64_t) ) && counts[1] <= base.size / sizeof(float) &&
+       ( 2 + 3*counts[0] )*sizeof(uint64_t) + counts[1]*sizeof(float) <= base.size &&
+       instanceTableHash( counts + 2, 3, counts[0] ) == header.base_hash;
+
+  // Every entry is checked before anything is written
+  uint64_t patch_vertices = 0;
+  for (uint64_t k = 0; ok && k < header.num_entries; ++k) {
+    const uint64_t* entry = table + AO_PATCH_ENTRIES*k;
+    const uint64_t* instance = entry[1] < counts[0] ? counts + 2 + 3*entry[1] : NULL;
+    ok = instance && instance[0] == entry[0] && instance[1] == entry[2] && instance[2] == entry[3] && entry[2] + entry[3] <= counts[1];
+    patch_vertices += entry[3];
+  }
+  ok = ok && patch_vertices == header.num_vertices;
+
+  if ( ok ) {
+    float* base_values = reinterpret_cast<float*>( static_cast<char*>( base.data ) + ( 2 + 3*counts[0] )*sizeof(uint64_t) );
+    uint64_t offset = 0;
+    for (uint64_t k = 0; k < header.num_entries; ++k) {
+      const uint64_t* entry = table + AO_PATCH_ENTRIES*k;
+      std::memcpy( base_values + entry[2], values + offset, size_t( entry[3] )*sizeof(float) );
+      offset += entry[3];
+    }
+  }
+  ok = base.close( ok ) && ok;
+  patch.close( false );
+  if ( num_applied ) *num_applied = ok ? size_t( header.num_entries ) : 0;
+  return ok;
+}
+
+
+namespace {
+
+// One file per part: a header, then the float vertex AO
+const char PART_CACHE_MAGIC[8] = { 'B', 'A', 'K', 'E', 'P', 'R', 'T', '1' };
+
+struct PartCacheHeader
+{
+  char     magic[8];
+  uint64_t key;
+  uint64_t num_vertices;
+};
+
+std::string part_cache_filename( const char* dir, const uint64_t key )
+{
+  char name[64];
+  sprintf( name, "part_%016llx.bin", (unsigned long long)key );
+  std::string filename( dir );
+  if ( !filename.empty() && filename[filename.size()-1] != '/' && filename[filename.size()-1] != '\\' ) filename += '/';
+  return filename + name;
+}
+
+} // namespace
+
+bool bake::loadPartAO( const char* cache_dir, const uint64_t key, const size_t num_vertices, float* vertex_ao )
+{
+  FILE* file = fopen( part_cache_filename( cache_dir, key ).c_str(), "rb" );
+  if ( !file ) return false;
+  PartCacheHeader header;
+  const bool ok = fread( &header, sizeof(header), 1, file ) == 1 && memcmp( header.magic, PART_CACHE_MAGIC, sizeof(header.magic) ) == 0 &&
+    header.key == key && header.num_vertices == num_vertices && 
+    fread( vertex_ao, sizeof(float), num_vertices, file ) == num_vertices;
+  fclose( file );
+  return ok;
+}
+
+bool bake::savePartAO( const char* cache_dir, const uint64_t key, const size_t num_vertices, const float* vertex_ao )
+{
+  PartCacheHeader header;
+  memset( &header, 0, sizeof(header) );
+  memcpy( header.magic, PART_CACHE_MAGIC, sizeof(header.magic) );
+  header.key = key;
+  header.num_vertices = num_vertices;
+
+  // Write to a temporary name so an interrupted run never leaves a truncated file that looks valid
+  const std::string filename = part_cache_filename( cache_dir, key );
+  char suffix[32];
+  sprintf( suffix, ".tmp%d", threadIndex() );
+  const std::string temp_filename = filename + suffix;
+  FILE* file = fopen( temp_filename.c_str(), "wb" );
+  if ( !file ) return false;
+  bool ok = fwrite( &header, sizeof(header), 1, file ) == 1 && 
+    fwrite( vertex_ao, sizeof(float), num_vertices, file ) == num_vertices;
+  ok = fclose( file ) == 0 && ok;
+  if ( ok ) {
+    remove( filename.c_str() );
+    ok = rename( temp_filename.c_str(), filename.c_str() ) == 0;
+  }
+  if ( !ok ) remove( temp_filename.c_str() );
+  return ok;
+}
+
+
+namespace {
+
+const char RESULT_CACHE_PREFIX[] = "result_";
+const char RESULT_CACHE_SUFFIX[] = ".ao";
+
+std::string cache_path( const char* dir, const std::string& name )
+{
+  std::string path( dir );
+  if ( !path.empty() && path[path.size()-1] != '/' && path[path.size()-1] != '\\' ) path += '/';
+  return path + name;
+}
+
+std::string result_cache_filename( const char* dir, const uint64_t key )
+{
+  char name[64];
+  sprintf( name, "%s%016llx%s", RESULT_CACHE_PREFIX, (unsigned long long)key, RESULT_CACHE_SUFFIX );
+  return cache_path( dir, name );
+}
+
+bool copyFile( const char* from_filename, const char* to_filename )
+{
+  FILE* from = fopen( from_filename, "rb" );
+  if ( !from ) return false;
+  FILE* to = fopen( to_filename, "wb" );
+  if ( !to ) {
+    fclose( from );
+    return false;
+  }
+  bool ok = copyToEnd( from, to );
+  fclose( from );
+  ok = fclose( to ) == 0 && ok;
+  return ok;
+}
+
+struct CachedResult {
+  std::string path;
+  uint64_t bytes;
+  int64_t  last_used;
+
+  bool operator<( const CachedResult& other ) const { return last_used < other.last_used; }
+};
+
+bool isCachedResultName( const std::string& name )
+{
+  const size_t prefix = sizeof(RESULT_CACHE_PREFIX) - 1;
+  const size_t suffix = sizeof(RESULT_CACHE_SUFFIX) - 1;
+  return name.size() > prefix + suffix && name.compare( 0, prefix, RESULT_CACHE_PREFIX ) == 0 &&
+         name.compare( name.size() - suffix, suffix, RESULT_CACHE_SUFFIX ) == 0;
+}
+
+// The result files of a cache directory, with the time each was last written or fetched
+void listCachedResults( const char* dir, std::vector<CachedResult>& results )
+{
+  results.clear();
+#if defined(_WIN32)
+  WIN32_FIND_DATAA found;
+  HANDLE find = FindFirstFileA( cache_path( dir, std::string( RESULT_CACHE_PREFIX ) + "*" + RESULT_CACHE_SUFFIX ).c_str(), &found );
+  if ( find == INVALID_HANDLE_VALUE ) return;
+  do {
+    if ( found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY || !isCachedResultName( found.cFileName ) ) continue;
+    CachedResult result;
+    result.path = cache_path( dir, found.cFileName );
+    result.bytes = ( uint64_t( found.nFileSizeHigh ) << 32 ) | found.nFileSizeLow;
+    result.last_used = ( int64_t( found.ftLastWriteTime.dwHighDateTime ) << 32 ) | found.ftLastWriteTime.dwLowDateTime;
+    results.push_back( result );
+  } while ( FindNextFileA( find, &found ) );
+  FindClose( find );
+#else
+  DIR* d = opendir( dir );
+  if ( !d ) return;
+  while ( struct dirent* e = readdir( d ) ) {
+    if ( !isCachedResultName( e->d_name ) ) continue;
+    CachedResult result;
+    result.path = cache_path( dir, e->d_name );
+    struct stat st;
+    if ( stat( result.path.c_str(), &st ) != 0 || !S_ISREG( st.st_mode ) ) continue;
+    result.bytes = uint64_t( st.st_size );
+    result.last_used = int64_t( st.st_mtime );
+    results.push_back( result );
+  }
+  closedir( d );
+#endif
+}
+
+} // namespace
+
+bool bake::fetchCachedResult( const char* cache_dir, const uint64_t key, const char* output_filename )
+{
+  const std::string filename = result_cache_filename( cache_dir, key );
+  if ( !copyFile( filename.c_str(), output_filename ) ) {
+    remove( output_filename );
+    return false;
+  }
+  // A fetch counts as a use for eviction
+#if defined(_WIN32)
+  HANDLE file = CreateFileA( filename.c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL, NULL );
+  if ( file != INVALID_HANDLE_VALUE ) {
+    FILETIME now;
+    GetSystemTimeAsFileTime( &now );
+    SetFileTime( file, NULL, NULL, &now );
+    CloseHandle( file );
+  }
+#else
+  utime( filename.c_str(), NULL );
+#endif
+  return true;
+}
+
+bool bake::storeCachedResult( const char* cache_dir, const uint64_t key, const char* output_filename, const uint64_t max_bytes )
+{
+  // As for parts, a temporary name keeps an interrupted copy from ever being fetched
+  const std::string filename = result_cache_filename( cache_dir, key );
+  char suffix[32];
+  sprintf( suffix, ".tmp%d", threadIndex() );
+  const std::string temp_filename = filename + suffix;
+  bool ok = copyFile( output_filename, temp_filename.c_str() );
+  if ( ok ) {
+    remove( filename.c_str() );
+    ok = rename( temp_filename.c_str(), filename.c_str() ) == 0;
+  }
+  if ( !ok ) remove( temp_filename.c_str() );
+  if ( max_bytes == 0 ) return ok;
+
+  // Oldest first; the file just stored goes last, even where timestamps are too coarse to order it
+  std::vector<CachedResult> results;
+  listCachedResults( cache_dir, results );
+  std::sort( results.begin(), results.end() );
+  uint64_t total = 0;
+  for (size_t i = 0; i < results.size(); ++i) total += results[i].bytes;
+  for (size_t i = 0; i < results.size() && total > max_bytes; ++i) {
+    if ( results[i].path == filename ) continue;
+    if ( remove( results[i].path.c_str() ) == 0 ) total -= results[i].bytes;
+  }
+  return ok;
+}
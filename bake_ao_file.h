@@ -0,0 +1,226 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <vector>
+#if defined(_WIN32)
+#include <cstdint>
+#else
+#include <stdint.h>
+#endif
+
+namespace bake {
+
+struct Scene;
+struct FileMapping;
+
+// AO values clamped to [0,1] and rounded to the nearest of 2^bits - 1 steps, 8 or 16 bits, as format v2 stores them
+void quantizeVertexAO( const float* ao, const size_t n, const unsigned bits, unsigned char* out );
+
+// Writes per-instance vertex AO, one chunk of instances at a time.
+//
+// With 32 bits and no compression this is the original raw format (see README).  Otherwise it writes
+// format v2: AO quantized to 8 or 16 bits, each instance optionally deflated, and instances with identical
+// results sharing one stored blob.  The instance and blob tables sit at the front of the file, so a reader
+// can map it and fetch any instance directly.
+//
+// With an index, close() appends a hash table of the instances keyed by storage identifier, found from a footer at
+// the end of the file, so VertexAOReader resolves an identifier without reading the instance table.  Readers of the
+// formats above ignore it.
+//
+// The header and tables go out in one write, and each append writes all of its instances with vectored 
+// writes where the platform has them.
+class VertexAOWriter
+{
+public:
+  VertexAOWriter();
+  ~VertexAOWriter();
+
+  bool open( const char* filename, const Scene& scene, const unsigned bits_per_value = 32, const bool compress = false,
+             const bool index = false );
+
+  // Instances [begin, begin + count), in order; the first call starts at 0
+  bool append( const Scene& scene, const size_t begin, const size_t count, const float* const* ao_vertex );
+
+  // Same, from values already quantized to the writer's 8 or 16 bits, as quantizeVertexAO does, with the instances
+  // back to back, e.g. as computeAOToPackedVertices downloads them
+  bool appendPacked( const Scene& scene, const size_t begin, const size_t count, const unsigned char* packed_ao );
+
+  bool close();
+
+  // Instances that reused an earlier blob, for v2
+  size_t numSharedInstances() const { return m_num_shared; }
+
+private:
+  struct BlobEntry {
+    uint64_t file_offset;
+    uint64_t stored_bytes;
+  };
+
+  struct File;
+
+  bool isRaw() const { return m_bits == 32 && !m_compress; }
+  bool appendEncoded( const size_t begin, const std::vector< std::vector<unsigned char> >& encoded );
+  bool sameAsStored( const BlobEntry& blob, const std::vector<unsigned char>& bytes );
+
+  File*    m_file;
+  unsigned m_bits;
+  bool     m_compress;
+  bool     m_index;
+  uint64_t m_end;         // where the next blob goes
+  bool     m_failed;
+  size_t   m_num_shared;
+
+  std::vector<uint64_t>  m_instance_table;  // 4 entries per instance: identifier, vertex offset, vertices, blob
+  std::vector<BlobEntry> m_blobs;
+  std::multimap<uint64_t, size_t> m_blob_hashes;
+
+  VertexAOWriter( const VertexAOWriter& );            // forbidden
+  VertexAOWriter& operator=( const VertexAOWriter& ); // forbidden
+};
+
+// The raw format, created at its final size and mapped, so that filters write vertex AO straight into the file.  The
+// instance table, and the index if asked for, go in on open; vertexAO(i) is where instance i's values go, and flush() 
+// writes the mapping back.
+class MappedVertexAOFile
+{
+public:
+  MappedVertexAOFile();
+  ~MappedVertexAOFile();
+
+  bool open( const char* filename, const Scene& scene, const bool index = false );
+
+  float* vertexAO( const size_t i ) { return m_values + m_offsets[i]; }
+
+  bool flush();
+
+  // Flushes and unmaps; vertexAO pointers are invalid after
+  bool close();
+
+private:
+  FileMapping* m_mapping;
+  float*       m_values;
+  std::vector<uint64_t> m_offsets;  // first vertex of each instance
+
+  MappedVertexAOFile( const MappedVertexAOFile& );            // forbidden
+  MappedVertexAOFile& operator=( const MappedVertexAOFile& ); // forbidden
+};
+
+// Where the stored AO of one instance is in a mapped vertex AO file
+struct VertexAOEntry
+{
+  uint64_t instance;
+  uint64_t offset_vertices;
+  uint64_t num_vertices;
+  const void* data;         // raw: num_vertices floats; v2: the stored blob, quantized and maybe deflated
+  uint64_t stored_bytes;
+};
+
+// Maps a vertex AO file read-only and finds instances by storage identifier: from the index in O(1) where the file 
+// has one, by a scan of the instance table otherwise.  Only the pages a lookup touches are read.
+class VertexAOReader
+{
+public:
+  VertexAOReader();
+  ~VertexAOReader();
+
+  bool open( const char* filename );
+  void close();
+
+  bool hasIndex() const { return m_num_slots > 0; }
+  uint64_t numInstances() const { return m_num_instances; }
+  // 32 for raw files
+  unsigned bitsPerValue() const { return m_bits; }
+  bool compressed() const { return m_compressed; }
+
+  // The first instance with this identifier; false if there is none
+  bool find( const uint64_t storage_identifier, VertexAOEntry& entry ) const;
+
+  // Expands the stored values of an entry into entry.num_vertices floats in [0, 1]
+  bool decode( const VertexAOEntry& entry, float* ao ) const;
+
+  // Instance i of the file, in the order written
+  bool entry( const uint64_t instance, VertexAOEntry& entry ) const;
+  uint64_t storageIdentifier( const uint64_t instance ) const { return m_instances[(m_raw ? 3 : 4)*instance]; }
+
+  // The original raw format, as opposed to v2
+  bool raw() const { return m_raw; }
+  // Hash of the instance table: identifiers, vertex offsets and counts, not the values
+  uint64_t layoutHash() const;
+
+private:
+
+  FileMapping*   m_mapping;
+  const uint64_t* m_instances;  // instance table
+  const uint64_t* m_blobs;      // v2 blob table
+  const unsigned char* m_data;  // raw values, or the file for v2 blob offsets
+  const uint64_t* m_slots;
+  uint64_t m_num_slots;
+  uint64_t m_num_instances;
+  unsigned m_bits;
+  bool     m_raw;
+  bool     m_compressed;
+
+  VertexAOReader( const VertexAOReader& );            // forbidden
+  VertexAOReader& operator=( const VertexAOReader& ); // forbidden
+};
+
+// Joins files written for consecutive ranges of instances, e.g. the partitions of a distributed bake, in the order 
+// given, into one file as if all instances were written at once.  All inputs must be raw, or v2 with the same bits 
+// and compression.  Blobs are not shared across inputs.  The output has an index if all inputs do.
+bool mergeVertexAOFiles( const char* output_filename, const char* const* input_filenames, const size_t num_inputs );
+
+// Writes the instances of base_filename, taking the AO of those found by storage identifier in overlay_filename from 
+// there, e.g. a region of interest rebaked after a full bake.  Overlay instances with a different vertex count, or not
+// in the base, are skipped.  The output has the bits, compression and index of the base, and must be another file.
+bool overlayVertexAOFiles( const char* output_filename, const char* base_filename, const char* overlay_filename,
+                           size_t* num_replaced = NULL );
+
+// Patches: the vertex AO of only the instances that changed against a raw base file, e.g. after an incremental or region
+// of interest rebake, so that distributing a rebake costs what changed.  A patch names its base by a hash of the base's
+// instance table, which applying a patch leaves as is, so patches made against the same base apply in any sequence.
+//
+// writeVertexAOPatch holds the instances of the scene found by storage identifier in the base whose values differ
+// from it; instances not in the base, or with a different vertex count, are skipped.  diffVertexAOFiles does the same
+// for the instances of a file in any format.  applyVertexAOPatch maps the base read-write and overwrites the patched
+// instances in place, after checking the whole patch against it, so a patch that doesn't match leaves the base as is.
+bool writeVertexAOPatch( const char* patch_filename, const char* base_filename, const Scene& scene, const float* const* ao_vertex,
+                         size_t* num_changed = NULL );
+bool diffVertexAOFiles( const char* patch_filename, const char* base_filename, const char* new_filename, size_t* num_changed = NULL );
+bool applyVertexAOPatch( const char* base_filename, const char* patch_filename, size_t* num_applied = NULL );
+
+// Part cache: the self-occlusion-only vertex AO of a mesh, one file per key in cache_dir, where the key hashes the mesh
+// and the bake settings.  load fails if there is no file or it holds another key or vertex count.
+bool loadPartAO( const char* cache_dir, const uint64_t key, const size_t num_vertices, float* vertex_ao );
+bool savePartAO( const char* cache_dir, const uint64_t key, const size_t num_vertices, const float* vertex_ao );
+
+// Result cache: whole output files in cache_dir, by a key that hashes the scene and every setting of the output.  fetch
+// copies the file of a key to output_filename and marks it used; store copies output_filename in and then removes the
+// least recently used other files until the cache holds at most max_bytes, 0 meaning no limit.
+bool fetchCachedResult( const char* cache_dir, const uint64_t key, const char* output_filename );
+bool storeCachedResult( const char* cache_dir, const uint64_t key, const char* output_filename, const uint64_t max_bytes );
+
+}
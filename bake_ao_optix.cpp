@@ -0,0 +1,849 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#include "bake_ao_optix.h"
+#include <cassert>
+
+#if defined( BAKE_WITH_OPTIX7 )
+
+#include "bake_kernels.h"
+#include "bake_util.h"
+#include "optix7/bake_ao_optix_params.h"
+
+#include "Buffer.h"
+#include <optix.h>
+#include <optix_function_table_definition.h>
+#include <optix_stubs.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+// PTX of optix7/bake_ao_optix_programs.cu, embedded by the build
+extern "C" const char bake_ao_optix_programs_ptx[];
+
+//------------------------------------------------------------------------------
+#define CHK_OPTIX( code )                                                      \
+{                                                                              \
+  OptixResult res__ = code;                                                    \
+  if( res__ != OPTIX_SUCCESS )                                                 \
+  {                                                                            \
+    std::cerr << "Error on line " << __LINE__ << ": '"                         \
+              << optixGetErrorString( res__ )                                  \
+              << "' (" << res__ << ")" << std::endl;                           \
+    exit(1);                                                                   \
+  }                                                                            \
+}
+
+namespace
+{
+
+inline size_t idivCeil( size_t x, size_t y )
+{
+  return (x + y-1)/y;
+}
+
+inline CUdeviceptr devicePtr( const void* p )
+{
+  return reinterpret_cast<CUdeviceptr>( p );
+}
+
+// Samples traced per launch when the caller doesn't pick a batch size.  Rays only live in registers, so 
+// batches are small: this just bounds the staging memory and keeps the device busy.
+const size_t DEFAULT_BATCH_SIZE = size_t(1) << 22;
+
+// Launch width is an unsigned int, and kernels index samples with an int
+const size_t MAX_BATCH_SIZE = size_t(1) << 30;
+
+// Shader binding table records only have their headers; the programs take everything from the launch parameters
+struct SbtRecord
+{
+  __align__( OPTIX_SBT_RECORD_ALIGNMENT ) char header[OPTIX_SBT_RECORD_HEADER_SIZE];
+};
+
+// Program groups in SBT order: raygen, a miss program per ray type, the hit group
+enum ProgramGroup
+{
+  GROUP_RAYGEN = 0,
+  GROUP_MISS_OCCLUSION,
+  GROUP_MISS_DISTANCE,
+  GROUP_HIT,
+  NUM_PROGRAM_GROUPS
+};
+
+void logCallback( unsigned int level, const char* tag, const char* message, void* )
+{
+  // Fatal, error and warning
+  if ( level <= 3 ) std::cerr << "OptiX [" << tag << "]: " << message << std::endl;
+}
+
+
+// Accels, pipeline and batch buffers on one device
+struct OptixDevice {
+  int device;
+  cudaStream_t stream;
+  OptixDeviceContext context;
+  OptixModule module;
+  OptixProgramGroup groups[NUM_PROGRAM_GROUPS];
+  OptixPipeline pipeline;
+  Buffer<SbtRecord> sbt_records;
+  OptixShaderBindingTable sbt;
+
+  // One bottom level accel per mesh over the device copy of its geometry, and the instance accel over them.  Meshes
+  // without triangles have no buffers.
+  std::vector<Buffer<unsigned char>* > vertex_buffers;
+  std::vector<Buffer<unsigned char>* > index_buffers;
+  std::vector<Buffer<unsigned char>* > gas_buffers;
+  std::vector<OptixTraversableHandle>  gas_handles;
+  std::vector<unsigned>                gas_build_flags;  // as built, which a refit must repeat
+  std::vector<unsigned>                gas_refits;       // since the last build
+  Buffer<OptixInstance>   instances;
+  Buffer<unsigned char>*  ias_buffer;
+  OptixTraversableHandle  ias_handle;
+
+  // Batch buffers, kept between computeAO calls while they fit
+  Buffer<float4>  sample_positions, staging_positions;
+  Buffer<float3>  peer_samples;  // caller's device samples of a batch, copied over from another device
+  Buffer<uint2>   sample_normals, staging_normals;
+  Buffer<float>   ao, staging_ao;
+  Buffer<bake::OptixAOParams> params;
+  Buffer<unsigned long long>  num_rays;
+
+  Timer setup_timer;
+  Timer accel_timer;
+  Timer trace_timer;
+  Timer copyao_timer;
+  size_t num_batches;
+  size_t num_rays_traced;
+  size_t bytes_to_device;
+  size_t bytes_to_host;
+
+  OptixDevice() : device( 0 ), stream( 0 ), context( 0 ), module( 0 ), pipeline( 0 ), ias_buffer( NULL ), ias_handle( 0 ) {
+    std::memset( groups, 0, sizeof( groups ) );
+    std::memset( &sbt, 0, sizeof( sbt ) );
+    resetStats();
+  }
+
+  ~OptixDevice() {
+    for (size_t i = 0; i < vertex_buffers.size(); ++i) delete vertex_buffers[i];
+    for (size_t i = 0; i < index_buffers.size(); ++i) delete index_buffers[i];
+    for (size_t i = 0; i < gas_buffers.size(); ++i) delete gas_buffers[i];
+    delete ias_buffer;
+    if ( pipeline ) optixPipelineDestroy( pipeline );
+    for (int i = 0; i < NUM_PROGRAM_GROUPS; ++i) {
+      if ( groups[i] ) optixProgramGroupDestroy( groups[i] );
+    }
+    if ( module ) optixModuleDestroy( module );
+    if ( context ) optixDeviceContextDestroy( context );
+    if ( stream ) cudaStreamDestroy( stream );
+  }
+
+  void resetStats() {
+    setup_timer.reset();
+    accel_timer.reset();
+    trace_timer.reset();
+    copyao_timer.reset();
+    num_batches = 0;
+    num_rays_traced = 0;
+    bytes_to_device = 0;
+    bytes_to_host = 0;
+  }
+
+  // Grow the batch buffers to hold num_samples samples of num_channels AO values, and to copy over samples 
+  // from another device if asked to
+  void reserveBatch( const size_t num_samples, const size_t num_channels, const bool peer ) {
+    if ( peer && peer_samples.count() < 3*num_samples ) {
+      peer_samples.alloc( 3*num_samples, RTP_BUFFER_TYPE_CUDA_LINEAR );
+    }
+    if ( sample_positions.count() < num_samples ) {
+      sample_positions.alloc( num_samples, RTP_BUFFER_TYPE_CUDA_LINEAR );
+      staging_positions.alloc( num_samples, RTP_BUFFER_TYPE_HOST, LOCKED );
+      sample_normals.alloc( num_samples, RTP_BUFFER_TYPE_CUDA_LINEAR );
+      staging_normals.alloc( num_samples, RTP_BUFFER_TYPE_HOST, LOCKED );
+    }
+    if ( ao.count() < num_channels*num_samples ) {
+      ao.alloc( num_channels*num_samples, RTP_BUFFER_TYPE_CUDA_LINEAR );
+      staging_ao.alloc( num_channels*num_samples, RTP_BUFFER_TYPE_HOST, LOCKED );
+    }
+    if ( params.count() == 0 ) {
+      params.alloc( 1, RTP_BUFFER_TYPE_CUDA_LINEAR );
+      num_rays.alloc( 1, RTP_BUFFER_TYPE_CUDA_LINEAR );
+    }
+  }
+
+private:
+  OptixDevice( const OptixDevice& );             // forbidden
+  OptixDevice& operator=( const OptixDevice& );  // forbidden
+};
+
+
+// Builds an accel, compacted if asked to, into a new buffer.  Waits for the stream.
+OptixTraversableHandle buildAccel( OptixDevice& dev, const OptixBuildInput& input, const unsigned build_flags, const bool compact, 
+                                   Buffer<unsigned char>*& output )
+{
+  OptixAccelBuildOptions options;
+  std::memset( &options, 0, sizeof( options ) );
+  options.buildFlags = build_flags | ( compact ? OPTIX_BUILD_FLAG_ALLOW_COMPACTION : 0 );
+  options.operation  = OPTIX_BUILD_OPERATION_BUILD;
+
+  OptixAccelBufferSizes sizes;
+  CHK_OPTIX( optixAccelComputeMemoryUsage( dev.context, &options, &input, 1, &sizes ) );
+  Buffer<unsigned char> temp( sizes.tempSizeInBytes, RTP_BUFFER_TYPE_CUDA_LINEAR );
+  output = new Buffer<unsigned char>( sizes.outputSizeInBytes, RTP_BUFFER_TYPE_CUDA_LINEAR );
+
+  Buffer<size_t> compacted_size( 1, RTP_BUFFER_TYPE_CUDA_LINEAR );
+  OptixAccelEmitDesc emit;
+  emit.type   = OPTIX_PROPERTY_TYPE_COMPACTED_SIZE;
+  emit.result = devicePtr( compacted_size.ptr() );
+
+  OptixTraversableHandle handle = 0;
+  CHK_OPTIX( optixAccelBuild( dev.context, dev.stream, &options, &input, 1, devicePtr( temp.ptr() ), sizes.tempSizeInBytes, 
+                              devicePtr( output->ptr() ), sizes.outputSizeInBytes, &handle, compact ? &emit : NULL, compact ? 1 : 0 ) );
+  if ( compact ) {
+    size_t size = 0;
+    CHK_CUDA( cudaMemcpyAsync( &size, compacted_size.ptr(), sizeof(size_t), cudaMemcpyDeviceToHost, dev.stream ) );
+    CHK_CUDA( cudaStreamSynchronize( dev.stream ) );
+    if ( size < sizes.outputSizeInBytes ) {
+      Buffer<unsigned char>* compacted = new Buffer<unsigned char>( size, RTP_BUFFER_TYPE_CUDA_LINEAR );
+      CHK_OPTIX( optixAccelCompact( dev.context, dev.stream, handle, devicePtr( compacted->ptr() ), size, &handle ) );
+      CHK_CUDA( cudaStreamSynchronize( dev.stream ) );
+      delete output;
+      output = compacted;
+    }
+  }
+  CHK_CUDA( cudaStreamSynchronize( dev.stream ) );
+  return handle;
+}
+
+// Refits an accel built with OPTIX_BUILD_FLAG_ALLOW_UPDATE to the moved geometry of input, in place.  The build flags
+// must be those of the build.  Waits for the stream.
+void refitAccel( OptixDevice& dev, const OptixBuildInput& input, const unsigned build_flags, Buffer<unsigned char>& output, 
+                 OptixTraversableHandle& handle )
+{
+  OptixAccelBuildOptions options;
+  std::memset( &options, 0, sizeof( options ) );
+  options.buildFlags = build_flags;
+  options.operation  = OPTIX_BUILD_OPERATION_UPDATE;
+
+  OptixAccelBufferSizes sizes;
+  CHK_OPTIX( optixAccelComputeMemoryUsage( dev.context, &options, &input, 1, &sizes ) );
+  Buffer<unsigned char> temp( std::max( sizes.tempUpdateSizeInBytes, size_t(1) ), RTP_BUFFER_TYPE_CUDA_LINEAR );
+  CHK_OPTIX( optixAccelBuild( dev.context, dev.stream, &options, &input, 1, devicePtr( temp.ptr() ), sizes.tempUpdateSizeInBytes, 
+                              devicePtr( output.ptr() ), output.sizeInBytes(), &handle, NULL, 0 ) );
+  CHK_CUDA( cudaStreamSynchronize( dev.stream ) );
+}
+
+
+// Build flags of the accel presets: fast builds quickly, balanced and quality trace fast, and quality compacts 
+// too, as does conserve_memory
+unsigned accelBuildFlags( const bake::AccelPreset preset )
+{
+  return preset == bake::ACCEL_PRESET_FAST ? OPTIX_BUILD_FLAG_PREFER_FAST_BUILD : OPTIX_BUILD_FLAG_PREFER_FAST_TRACE;
+}
+
+bool compactAccels( const bake::AccelPreset preset, const bool conserve_memory )
+{
+  return preset == bake::ACCEL_PRESET_QUALITY || conserve_memory;
+}
+
+
+// Refits in a row before a mesh accel is built again, since a refit keeps the tree of the first pose and traces
+// slower the further the vertices move from it
+const unsigned MAX_ACCEL_REFITS = 8;
+
+// Only positions are traced, so interleaved attributes are packed out before the upload
+void uploadMeshVertices( const bake::Mesh& mesh, Buffer<unsigned char>& vertices )
+{
+  if ( packedMeshVertices( mesh ) ) {
+    CHK_CUDA( cudaMemcpy( vertices.ptr(), mesh.vertices, vertices.sizeInBytes(), cudaMemcpyHostToDevice ) );
+  } else {
+    std::vector<float> packed( 3*mesh.num_vertices );
+    packMeshVertices( mesh, &packed[0] );
+    CHK_CUDA( cudaMemcpy( vertices.ptr(), &packed[0], vertices.sizeInBytes(), cudaMemcpyHostToDevice ) );
+  }
+}
+
+// Triangle build input of mesh i over its device buffers.  The input points into this struct, so it isn't copied.
+struct MeshBuildInput {
+  CUdeviceptr     vertex_buffer;
+  unsigned        geometry_flags;
+  OptixBuildInput input;
+
+  MeshBuildInput( const OptixDevice& dev, const bake::Mesh& mesh, const size_t i ) {
+    vertex_buffer = devicePtr( dev.vertex_buffers[i]->ptr() );
+    geometry_flags = OPTIX_GEOMETRY_FLAG_DISABLE_ANYHIT;
+    std::memset( &input, 0, sizeof( input ) );
+    input.type = OPTIX_BUILD_INPUT_TYPE_TRIANGLES;
+    input.triangleArray.vertexFormat        = OPTIX_VERTEX_FORMAT_FLOAT3;
+    input.triangleArray.vertexStrideInBytes = 3*sizeof(float);
+    input.triangleArray.numVertices         = (unsigned)mesh.num_vertices;
+    input.triangleArray.vertexBuffers       = &vertex_buffer;
+    input.triangleArray.indexFormat         = OPTIX_INDICES_FORMAT_UNSIGNED_INT3;
+    input.triangleArray.indexStrideInBytes  = 3*sizeof(unsigned);
+    input.triangleArray.numIndexTriplets    = (unsigned)mesh.num_triangles;
+    input.triangleArray.indexBuffer         = devicePtr( dev.index_buffers[i]->ptr() );
+    input.triangleArray.flags               = &geometry_flags;
+    input.triangleArray.numSbtRecords       = 1;
+  }
+
+private:
+  MeshBuildInput( const MeshBuildInput& );             // forbidden
+  MeshBuildInput& operator=( const MeshBuildInput& );  // forbidden
+};
+
+
+void buildMeshAccels( OptixDevice& dev, const bake::Mesh* meshes, const size_t num_meshes, const unsigned build_flags, const bool compact )
+{
+  dev.vertex_buffers.assign( num_meshes, (Buffer<unsigned char>*)NULL );
+  dev.index_buffers.assign( num_meshes, (Buffer<unsigned char>*)NULL );
+  dev.gas_handles.assign( num_meshes, 0 );
+  dev.gas_buffers.assign( num_meshes, (Buffer<unsigned char>*)NULL );
+  dev.gas_build_flags.assign( num_meshes, build_flags | ( compact ? OPTIX_BUILD_FLAG_ALLOW_COMPACTION : 0 ) );
+  dev.gas_refits.assign( num_meshes, 0 );
+  for (size_t i = 0; i < num_meshes; ++i) {
+    const bake::Mesh& mesh = meshes[i];
+    if ( mesh.num_triangles == 0 ) continue;
+
+    dev.vertex_buffers[i] = new Buffer<unsigned char>( mesh.num_vertices*3*sizeof(float), RTP_BUFFER_TYPE_CUDA_LINEAR );
+    dev.index_buffers[i]  = new Buffer<unsigned char>( mesh.num_triangles*3*sizeof(unsigned), RTP_BUFFER_TYPE_CUDA_LINEAR );
+    uploadMeshVertices( mesh, *dev.vertex_buffers[i] );
+    CHK_CUDA( cudaMemcpy( dev.index_buffers[i]->ptr(), mesh.tri_vertex_indices, dev.index_buffers[i]->sizeInBytes(), cudaMemcpyHostToDevice ) );
+
+    const MeshBuildInput build( dev, mesh, i );
+    dev.gas_handles[i] = buildAccel( dev, build.input, dev.gas_build_flags[i], compact, dev.gas_buffers[i] );
+  }
+}
+
+// Moves the mesh accels to new positions of the same meshes; returns the number refit.  An accel built without 
+// OPTIX_BUILD_FLAG_ALLOW_UPDATE, as the first ones are so that static bakes trace at full speed, or refit too 
+// often, is built again, with the flag.
+size_t updateMeshAccels( OptixDevice& dev, const bake::Mesh* meshes, const size_t num_meshes, const unsigned build_flags, const bool compact )
+{
+  assert( num_meshes == dev.gas_handles.size() );
+  size_t num_refits = 0;
+  for (size_t i = 0; i < num_meshes; ++i) {
+    if ( !dev.vertex_buffers[i] ) continue;
+    const bake::Mesh& mesh = meshes[i];
+    uploadMeshVertices( mesh, *dev.vertex_buffers[i] );
+    const MeshBuildInput build( dev, mesh, i );
+    if ( ( dev.gas_build_flags[i] & OPTIX_BUILD_FLAG_ALLOW_UPDATE ) && dev.gas_refits[i] < MAX_ACCEL_REFITS ) {
+      refitAccel( dev, build.input, dev.gas_build_flags[i], *dev.gas_buffers[i], dev.gas_handles[i] );
+      ++dev.gas_refits[i];
+      ++num_refits;
+    } else {
+      delete dev.gas_buffers[i];
+      dev.gas_build_flags[i] = build_flags | OPTIX_BUILD_FLAG_ALLOW_UPDATE | ( compact ? OPTIX_BUILD_FLAG_ALLOW_COMPACTION : 0 );
+      dev.gas_handles[i] = buildAccel( dev, build.input, dev.gas_build_flags[i], compact, dev.gas_buffers[i] );
+      dev.gas_refits[i] = 0;
+    }
+  }
+  return num_refits;
+}
+
+
+// The instance accel over the mesh accels; instances are row major 4x4, of which OptiX takes the top 3 rows.  Instances
+// that aren't visible stay in the accel with an empty mask, so no ray hits them.
+void buildInstanceAccel( OptixDevice& dev, const bake::Instance* instances, const size_t num_instances, const unsigned build_flags,
+                         const unsigned char* visible = NULL )
+{
+  std::vector<OptixInstance> optix_instances( num_instances );
+  for (size_t i = 0; i < num_instances; ++i) {
+    OptixInstance& inst = optix_instances[i];
+    std::memset( &inst, 0, sizeof( inst ) );
+    std::copy( instances[i].xform, instances[i].xform + 12, inst.transform );
+    inst.instanceId        = (unsigned)i;
+    inst.sbtOffset         = 0;
+    inst.flags             = OPTIX_INSTANCE_FLAG_NONE;
+    inst.traversableHandle = dev.gas_handles[instances[i].mesh_index];
+    inst.visibilityMask    = inst.traversableHandle && ( !visible || visible[i] ) ? 255 : 0;  // meshes without triangles have no accel
+  }
+  if ( dev.instances.count() < std::max( num_instances, size_t(1) ) ) {
+    dev.instances.alloc( std::max( num_instances, size_t(1) ), RTP_BUFFER_TYPE_CUDA_LINEAR );
+  }
+  if ( num_instances > 0 ) {
+    CHK_CUDA( cudaMemcpy( dev.instances.ptr(), &optix_instances[0], num_instances*sizeof(OptixInstance), cudaMemcpyHostToDevice ) );
+  }
+
+  OptixBuildInput input;
+  std::memset( &input, 0, sizeof( input ) );
+  input.type = OPTIX_BUILD_INPUT_TYPE_INSTANCES;
+  input.instanceArray.instances    = devicePtr( dev.instances.ptr() );
+  input.instanceArray.numInstances = (unsigned)num_instances;
+  delete dev.ias_buffer;
+  dev.ias_handle = buildAccel( dev, input, build_flags, false, dev.ias_buffer );
+}
+
+
+void createPipeline( OptixDevice& dev )
+{
+  char log[2048];
+  size_t log_size = sizeof( log );
+
+  OptixModuleCompileOptions module_options;
+  std::memset( &module_options, 0, sizeof( module_options ) );
+  module_options.maxRegisterCount = OPTIX_COMPILE_DEFAULT_MAX_REGISTER_COUNT;
+  module_options.optLevel         = OPTIX_COMPILE_OPTIMIZATION_DEFAULT;
+  module_options.debugLevel       = OPTIX_COMPILE_DEBUG_LEVEL_NONE;
+
+  OptixPipelineCompileOptions pipeline_options;
+  std::memset( &pipeline_options, 0, sizeof( pipeline_options ) );
+  pipeline_options.usesMotionBlur        = 0;
+  pipeline_options.traversableGraphFlags = OPTIX_TRAVERSABLE_GRAPH_FLAG_ALLOW_SINGLE_LEVEL_INSTANCING;
+  pipeline_options.numPayloadValues      = 1;
+  pipeline_options.numAttributeValues    = 2;
+  pipeline_options.exceptionFlags        = OPTIX_EXCEPTION_FLAG_NONE;
+  pipeline_options.pipelineLaunchParamsVariableName = "params";
+#if OPTIX_VERSION >= 70100
+  pipeline_options.usesPrimitiveTypeFlags = OPTIX_PRIMITIVE_TYPE_FLAGS_TRIANGLE;
+#endif
+
+  const char* ptx = bake_ao_optix_programs_ptx;
+#if OPTIX_VERSION >= 70700
+  CHK_OPTIX( optixModuleCreate( dev.context, &module_options, &pipeline_options, ptx, std::strlen( ptx ), log, &log_size, &dev.module ) );
+#else
+  CHK_OPTIX( optixModuleCreateFromPTX( dev.context, &module_options, &pipeline_options, ptx, std::strlen( ptx ), log, &log_size, &dev.module ) );
+#endif
+
+  OptixProgramGroupDesc descs[NUM_PROGRAM_GROUPS];
+  std::memset( descs, 0, sizeof( descs ) );
+  descs[GROUP_RAYGEN].kind                         = OPTIX_PROGRAM_GROUP_KIND_RAYGEN;
+  descs[GROUP_RAYGEN].raygen.module                = dev.module;
+  descs[GROUP_RAYGEN].raygen.entryFunctionName     = "__raygen__ao";
+  descs[GROUP_MISS_OCCLUSION].kind                 = OPTIX_PROGRAM_GROUP_KIND_MISS;
+  descs[GROUP_MISS_OCCLUSION].miss.module          = dev.module;
+  descs[GROUP_MISS_OCCLUSION].miss.entryFunctionName = "__miss__occlusion";
+  descs[GROUP_MISS_DISTANCE].kind                  = OPTIX_PROGRAM_GROUP_KIND_MISS;
+  descs[GROUP_MISS_DISTANCE].miss.module           = dev.module;
+  descs[GROUP_MISS_DISTANCE].miss.entryFunctionName = "__miss__distance";
+  descs[GROUP_HIT].kind                            = OPTIX_PROGRAM_GROUP_KIND_HITGROUP;
+  descs[GROUP_HIT].hitgroup.moduleCH               = dev.module;
+  descs[GROUP_HIT].hitgroup.entryFunctionNameCH    = "__closesthit__distance";
+
+  OptixProgramGroupOptions group_options;
+  std::memset( &group_options, 0, sizeof( group_options ) );
+  log_size = sizeof( log );
+  CHK_OPTIX( optixProgramGroupCreate( dev.context, descs, NUM_PROGRAM_GROUPS, &group_options, log, &log_size, dev.groups ) );
+
+  OptixPipelineLinkOptions link_options;
+  std::memset( &link_options, 0, sizeof( link_options ) );
+  link_options.maxTraceDepth = 1;
+#if OPTIX_VERSION < 70700
+  link_options.debugLevel    = OPTIX_COMPILE_DEBUG_LEVEL_NONE;
+#endif
+  log_size = sizeof( log );
+  CHK_OPTIX( optixPipelineCreate( dev.context, &pipeline_options, &link_options, dev.groups, NUM_PROGRAM_GROUPS, log, &log_size, &dev.pipeline ) );
+
+  SbtRecord records[NUM_PROGRAM_GROUPS];
+  for (int i = 0; i < NUM_PROGRAM_GROUPS; ++i) {
+    CHK_OPTIX( optixSbtRecordPackHeader( dev.groups[i], &records[i] ) );
+  }
+  dev.sbt_records.alloc( NUM_PROGRAM_GROUPS, RTP_BUFFER_TYPE_CUDA_LINEAR );
+  CHK_CUDA( cudaMemcpy( dev.sbt_records.ptr(), records, sizeof( records ), cudaMemcpyHostToDevice ) );
+
+  const CUdeviceptr base = devicePtr( dev.sbt_records.ptr() );
+  dev.sbt.raygenRecord                = base + GROUP_RAYGEN*sizeof(SbtRecord);
+  dev.sbt.missRecordBase              = base + GROUP_MISS_OCCLUSION*sizeof(SbtRecord);
+  dev.sbt.missRecordStrideInBytes     = sizeof(SbtRecord);
+  dev.sbt.missRecordCount             = bake::OPTIX_AO_RAY_TYPE_COUNT;
+  dev.sbt.hitgroupRecordBase          = base + GROUP_HIT*sizeof(SbtRecord);
+  dev.sbt.hitgroupRecordStrideInBytes = sizeof(SbtRecord);
+  dev.sbt.hitgroupRecordCount         = 1;
+}
+
+} // end namespace
+
+
+namespace bake {
+
+struct OptixAOContext {
+  int  caller_device;
+  DeviceGroundPlane ground_plane;  // axis < 0 if none
+  unsigned build_flags;
+  bool     compact;
+  std::vector<OptixDevice*> devices;
+};
+
+}
+
+
+bake::OptixAOContext* bake::ao_optix_create_context(
+    const Scene& occluders,
+    const bool   conserve_memory,
+    const int*   requested_devices,
+    const size_t num_requested_devices,
+    const AccelPreset accel_preset,
+    const GroundPlane* ground_plane,
+    const bool   require_rt_cores
+    )
+{
+  // Fails without a driver that supports OptiX 7, and then Prime is used instead
+  if ( optixInit() != OPTIX_SUCCESS ) return NULL;
+
+  OptixAOContext* ctx = new OptixAOContext;
+  CHK_CUDA( cudaGetDevice( &ctx->caller_device ) );
+  ctx->build_flags = accelBuildFlags( accel_preset );
+  ctx->compact = compactAccels( accel_preset, conserve_memory );
+  ctx->ground_plane.axis = ground_plane ? ground_plane->axis : -1;
+  if ( ground_plane ) {
+    ctx->ground_plane.bbox_min = make_float3( ground_plane->bbox_min[0], ground_plane->bbox_min[1], ground_plane->bbox_min[2] );
+    ctx->ground_plane.bbox_max = make_float3( ground_plane->bbox_max[0], ground_plane->bbox_max[1], ground_plane->bbox_max[2] );
+  }
+
+  std::vector<int> device_numbers;
+  if ( num_requested_devices > 0 ) {
+    device_numbers.assign( requested_devices, requested_devices + num_requested_devices );
+  } else {
+    int device_count = 0;
+    CHK_CUDA( cudaGetDeviceCount( &device_count ) );
+    for (int i = 0; i < device_count; ++i) device_numbers.push_back( i );
+  }
+
+  // Device contexts first, to find out whether the devices are worth using before building anything
+  bool has_rt_cores = true;
+  for (size_t d = 0; d < device_numbers.size(); ++d) {
+    OptixDevice* dev = new OptixDevice;
+    ctx->devices.push_back( dev );
+    dev->device = device_numbers[d];
+    CHK_CUDA( cudaSetDevice( dev->device ) );
+    CHK_CUDA( cudaFree( 0 ) );  // creates the CUDA context OptiX runs in
+    CHK_CUDA( cudaStreamCreateWithFlags( &dev->stream, cudaStreamNonBlocking ) );
+
+    OptixDeviceContextOptions options;
+    std::memset( &options, 0, sizeof( options ) );
+    options.logCallbackFunction = &logCallback;
+    options.logCallbackLevel    = 3;
+    if ( optixDeviceContextCreate( 0, &options, &dev->context ) != OPTIX_SUCCESS ) {
+      dev->context = 0;
+      has_rt_cores = false;
+      break;
+    }
+    unsigned rtcore_version = 0;
+    CHK_OPTIX( optixDeviceContextGetProperty( dev->context, OPTIX_DEVICE_PROPERTY_RTCORE_VERSION, &rtcore_version, sizeof( rtcore_version ) ) );
+    has_rt_cores = has_rt_cores && rtcore_version > 0;
+  }
+  if ( device_numbers.empty() || !ctx->devices.back()->context || ( require_rt_cores && !has_rt_cores ) ) {
+    ao_optix_destroy_context( ctx );
+    return NULL;
+  }
+
+  // Build on every device in parallel.  The build counts as setup time of the first computeAO.
+  const ptrdiff_t num_devices = static_cast<ptrdiff_t>( ctx->devices.size() );
+#pragma omp parallel for num_threads( (int)num_devices ) schedule( static, 1 )
+  for (ptrdiff_t d = 0; d < num_devices; ++d) {
+    OptixDevice& dev = *ctx->devices[d];
+    CHK_CUDA( cudaSetDevice( dev.device ) );
+    dev.setup_timer.start();
+    ProfileRange range( "build accels", PROFILE_COLOR_ACCEL, uint64_t( dev.device ) );
+    createPipeline( dev );
+
+    dev.accel_timer.start();
+    buildMeshAccels( dev, occluders.meshes, occluders.num_meshes, ctx->build_flags, ctx->compact );
+    buildInstanceAccel( dev, occluders.instances, occluders.num_instances, ctx->build_flags );
+    dev.accel_timer.stop();
+
+    dev.setup_timer.stop();
+  }
+
+  CHK_CUDA( cudaSetDevice( ctx->caller_device ) );
+  return ctx;
+}
+
+
+void bake::ao_optix_update_instances( OptixAOContext* ctx, const Instance* instances, const size_t num_instances, 
+                                      const unsigned char* visible )
+{
+  // Mesh accels are kept, only the instance accel is rebuilt
+  const ptrdiff_t num_devices = static_cast<ptrdiff_t>( ctx->devices.size() );
+#pragma omp parallel for num_threads( (int)num_devices ) schedule( static, 1 )
+  for (ptrdiff_t d = 0; d < num_devices; ++d) {
+    OptixDevice& dev = *ctx->devices[d];
+    CHK_CUDA( cudaSetDevice( dev.device ) );
+    dev.setup_timer.start();
+    ProfileRange range( "update instances", PROFILE_COLOR_ACCEL, uint64_t( dev.device ) );
+    buildInstanceAccel( dev, instances, num_instances, ctx->build_flags, visible );
+    dev.setup_timer.stop();
+  }
+  CHK_CUDA( cudaSetDevice( ctx->caller_device ) );
+}
+
+
+void bake::ao_optix_update_geometry( OptixAOContext* ctx, const Mesh* meshes, const size_t num_meshes, const Instance* instances, 
+                                     const size_t num_instances, const unsigned char* visible )
+{
+  // Mesh accels are refit where they can be, and the instance accel is rebuilt over their new bounds
+  const ptrdiff_t num_devices = static_cast<ptrdiff_t>( ctx->devices.size() );
+  std::vector<size_t> num_refits( ctx->devices.size(), 0 );
+#pragma omp parallel for num_threads( (int)num_devices ) schedule( static, 1 )
+  for (ptrdiff_t d = 0; d < num_devices; ++d) {
+    OptixDevice& dev = *ctx->devices[d];
+    CHK_CUDA( cudaSetDevice( dev.device ) );
+    dev.setup_timer.start();
+    ProfileRange range( "update geometry", PROFILE_COLOR_ACCEL, uint64_t( dev.device ) );
+    dev.accel_timer.start();
+    num_refits[d] = updateMeshAccels( dev, meshes, num_meshes, ctx->build_flags, ctx->compact );
+    buildInstanceAccel( dev, instances, num_instances, ctx->build_flags, visible );
+    dev.accel_timer.stop();
+    dev.setup_timer.stop();
+  }
+  CHK_CUDA( cudaSetDevice( ctx->caller_device ) );
+  size_t total_refits = 0;
+  for (size_t d = 0; d < num_refits.size(); ++d) total_refits += num_refits[d];
+  recordCount( "ao.accel_refits", total_refits );
+}
+
+
+void bake::ao_optix_destroy_context( OptixAOContext* ctx )
+{
+  if ( !ctx ) return;
+  for (size_t d = 0; d < ctx->devices.size(); ++d) {
+    CHK_CUDA( cudaSetDevice( ctx->devices[d]->device ) );
+    delete ctx->devices[d];
+  }
+  trimDevicePool();
+  CHK_CUDA( cudaSetDevice( ctx->caller_device ) );
+  delete ctx;
+}
+
+
+void bake::ao_optix(
+    OptixAOContext* ctx,
+    const Scene& scene,
+    const AOSamples& ao_samples,
+    const int    rays_per_sample,
+    const float  scene_offset,
+    const float  scene_maxdistance,
+    const size_t requested_batch_size,
+    const float  adaptive_tolerance,
+    float*       ao_values,
+    const float* radii,
+    const size_t num_radii,
+    const bool   two_sided,
+    BatchCursor* shared_batches
+    )
+{
+  Timer trace_timer;
+  trace_timer.start();
+  ProfileRange range( "trace samples", PROFILE_COLOR_TRACE, uint64_t( ao_samples.num_samples ) );
+
+  assert( ao_samples.sample_positions && ao_samples.sample_normals && ao_samples.sample_face_normals );
+  assert( ao_values );
+  assert( num_radii <= size_t( MAX_DEVICE_AO_RADII ) );
+  assert( !two_sided || num_radii == 0 );
+
+  std::vector<OptixDevice*>& devices = ctx->devices;
+  const ptrdiff_t num_devices = static_cast<ptrdiff_t>( devices.size() );
+  const int num_passes = std::max( rays_per_sample, 1 );
+  const size_t num_channels = num_radii > 0 ? num_radii : ( two_sided ? 2 : 1 );
+
+  // Device and pinned ao_values take the AO straight from the device
+  const bool direct_ao = ao_samples.ao_memory == MEMORY_SPACE_DEVICE || isPinnedHostMemory( ao_values );
+
+  // Samples the caller has in device memory are packed into the device layout where they are
+  const bool device_samples = ao_samples.sample_memory == MEMORY_SPACE_DEVICE;
+  const int samples_device = device_samples ? pointerDevice( ao_samples.sample_positions ) : -1;
+
+  DeviceAORadii device_radii;
+  device_radii.count = (int)num_radii;
+  for (size_t r = 0; r < num_radii; ++r) device_radii.radii[r] = radii[r];
+
+  // Devices pull batches from a shared cursor, so faster devices trace more of them
+  BatchCursor local_batches( std::min( requested_batch_size > 0 ? requested_batch_size : DEFAULT_BATCH_SIZE, MAX_BATCH_SIZE ), 
+                             ao_samples.num_samples );
+  BatchCursor& batches = shared_batches ? *shared_batches : local_batches;
+  const size_t batch_size = batches.batch_size;
+  const size_t num_batches = batches.num_batches;
+  const size_t batch_capacity = std::min( batch_size, ao_samples.num_samples );
+  assert( batch_size <= MAX_BATCH_SIZE );
+
+#pragma omp parallel for num_threads( (int)num_devices ) schedule( static, 1 )
+  for (ptrdiff_t d = 0; d < num_devices; ++d) {
+    OptixDevice& dev = *devices[d];
+    CHK_CUDA( cudaSetDevice( dev.device ) );
+
+    dev.setup_timer.start();
+    dev.reserveBatch( batch_capacity, num_channels, device_samples && samples_device != dev.device );
+    CHK_CUDA( cudaMemsetAsync( dev.num_rays.ptr(), 0, sizeof(unsigned long long), dev.stream ) );
+    recordMemoryUsage();
+    dev.setup_timer.stop();
+
+    for (;;) {
+      size_t batch_idx;
+      if ( !batches.take( batch_idx ) ) break;
+
+      ProfileRange batch_range( "batch", PROFILE_COLOR_TRACE, uint64_t( batch_idx ) );
+      dev.num_batches++;
+      const size_t sample_offset = batch_idx*batch_size;
+      const size_t num_samples = std::min( batch_size, ao_samples.num_samples - sample_offset );
+
+      // Same device layout of the samples as for Prime
+      dev.setup_timer.start();
+      const float3* normals      = reinterpret_cast<const float3*>( ao_samples.sample_normals )      + sample_offset;
+      const float3* face_normals = reinterpret_cast<const float3*>( ao_samples.sample_face_normals ) + sample_offset;
+      const float3* positions    = reinterpret_cast<const float3*>( ao_samples.sample_positions )    + sample_offset;
+      if ( device_samples ) {
+        if ( samples_device != dev.device ) {
+          float3* peer = dev.peer_samples.ptr();
+          CHK_CUDA( cudaMemcpyAsync( peer,                 positions,    num_samples*sizeof(float3), cudaMemcpyDefault, dev.stream ) );
+          CHK_CUDA( cudaMemcpyAsync( peer + num_samples,   normals,      num_samples*sizeof(float3), cudaMemcpyDefault, dev.stream ) );
+          CHK_CUDA( cudaMemcpyAsync( peer + 2*num_samples, face_normals, num_samples*sizeof(float3), cudaMemcpyDefault, dev.stream ) );
+          positions = peer;
+          normals = peer + num_samples;
+          face_normals = peer + 2*num_samples;
+        }
+        packSamplesDevice( num_samples, positions, normals, face_normals, dev.sample_positions.ptr(), dev.sample_normals.ptr(), dev.stream );
+      } else {
+        float4* staging_positions = dev.staging_positions.ptr();
+        uint2*  staging_normals   = dev.staging_normals.ptr();
+#pragma omp parallel for if( num_samples >= (1 << 16) )
+        for (ptrdiff_t i = 0; i < ptrdiff_t(num_samples); ++i) {
+          staging_positions[i] = make_float4( positions[i].x, positions[i].y, positions[i].z, 0.0f );
+          staging_normals[i]   = make_uint2( bake::encodeOctahedral( normals[i].x, normals[i].y, normals[i].z ),
+                                             bake::encodeOctahedral( face_normals[i].x, face_normals[i].y, face_normals[i].z ) );
+        }
+        CHK_CUDA( cudaMemcpyAsync( dev.sample_positions.ptr(), staging_positions, num_samples*sizeof(float4), cudaMemcpyHostToDevice, dev.stream ) );
+        CHK_CUDA( cudaMemcpyAsync( dev.sample_normals.ptr(),   staging_normals,   num_samples*sizeof(uint2),  cudaMemcpyHostToDevice, dev.stream ) );
+        dev.bytes_to_device += num_samples*( sizeof(float4) + sizeof(uint2) );
+      }
+
+      OptixAOParams params;
+      params.handle                = dev.ias_handle;
+      params.samples.num_samples   = num_samples;
+      params.samples.positions     = dev.sample_positions.ptr();
+      params.samples.normals       = dev.sample_normals.ptr();
+      params.samples.flat_normals  = false;
+      params.first_sample_index    = ao_samples.first_sample_index + sample_offset;
+      params.num_passes            = num_passes;
+      params.scene_offset          = scene_offset;
+      params.scene_maxdistance     = scene_maxdistance;
+      params.adaptive_tolerance    = num_radii == 0 && !two_sided ? adaptive_tolerance : 0.0f;
+      params.two_sided             = two_sided ? 1 : 0;
+      params.ground_plane          = ctx->ground_plane;
+      params.radii                 = device_radii;
+      params.ao                    = dev.ao.ptr();
+      params.num_rays_traced       = dev.num_rays.ptr();
+      CHK_CUDA( cudaMemcpyAsync( dev.params.ptr(), &params, sizeof( params ), cudaMemcpyHostToDevice, dev.stream ) );
+      dev.setup_timer.stop();
+
+      dev.trace_timer.start();
+      if ( num_samples > 0 ) {
+        CHK_OPTIX( optixLaunch( dev.pipeline, dev.stream, devicePtr( dev.params.ptr() ), sizeof( OptixAOParams ), &dev.sbt, 
+                                (unsigned)num_samples, 1, 1 ) );
+      }
+      CHK_CUDA( cudaStreamSynchronize( dev.stream ) );
+      dev.trace_timer.stop();
+
+      dev.copyao_timer.start();
+      if ( direct_ao ) {
+        for (size_t c = 0; c < num_channels; ++c) {
+          CHK_CUDA( cudaMemcpyAsync( ao_values + c*ao_samples.num_samples + sample_offset, dev.ao.ptr() + c*num_samples, 
+                                     num_samples*sizeof(float), cudaMemcpyDefault, dev.stream ) );
+        }
+        CHK_CUDA( cudaStreamSynchronize( dev.stream ) );
+      } else {
+        CHK_CUDA( cudaMemcpyAsync( dev.staging_ao.ptr(), dev.ao.ptr(), num_channels*num_samples*sizeof(float), cudaMemcpyDeviceToHost, dev.stream ) );
+        CHK_CUDA( cudaStreamSynchronize( dev.stream ) );
+        for (size_t c = 0; c < num_channels; ++c) {
+          std::copy( dev.staging_ao.ptr() + c*num_samples, dev.staging_ao.ptr() + (c+1)*num_samples, 
+                     ao_values + c*ao_samples.num_samples + sample_offset );
+        }
+      }
+      dev.bytes_to_host += num_channels*num_samples*sizeof(float);
+      dev.copyao_timer.stop();
+    }
+
+    unsigned long long num_rays = 0;
+    CHK_CUDA( cudaMemcpy( &num_rays, dev.num_rays.ptr(), sizeof(unsigned long long), cudaMemcpyDeviceToHost ) );
+    dev.num_rays_traced += static_cast<size_t>( num_rays );
+  }
+  CHK_CUDA( cudaSetDevice( ctx->caller_device ) );
+
+  size_t total_rays_traced = 0;
+
+  // Tracers that share batches finish together; keep their reports apart
+#pragma omp critical( bake_report )
+  {
+    std::cerr << "\n\tbackend ...         OptiX\n";
+    std::cerr << "\tbatch size ...      " << batch_size << (requested_batch_size > 0 ? "" : " (default)") << ", " << num_batches << " batches\n";
+    for (ptrdiff_t d = 0; d < num_devices; ++d) {
+      OptixDevice& dev = *devices[d];
+      if ( num_devices > 1 || shared_batches ) {
+        std::cerr << "\tdevice " << dev.device << ": " << dev.num_batches << " batches\n";
+      }
+      std::cerr << "\tsetup ...           ";  printTimeElapsed( dev.setup_timer );
+      std::cerr << "\t  build accels ...  ";  printTimeElapsed( dev.accel_timer );
+      std::cerr << "\ttrace ...           ";  printTimeElapsed( dev.trace_timer );
+      std::cerr << "\tcopy AO out ...     ";  printTimeElapsed( dev.copyao_timer );
+
+      recordTime( "ao.setup",       dev.setup_timer );
+      recordTime( "ao.accel_build", dev.accel_timer );
+      recordTime( "ao.query",       dev.trace_timer );
+      recordTime( "ao.copy_ao",     dev.copyao_timer );
+      recordCount( "ao.batches",  dev.num_batches );
+      recordCount( "ao.rays",     dev.num_rays_traced );
+      recordCount( "ao.bytes_to_device", dev.bytes_to_device );
+      recordCount( "ao.bytes_to_host",   dev.bytes_to_host );
+      total_rays_traced += dev.num_rays_traced;
+      dev.resetStats();
+    }
+  }
+
+  trace_timer.stop();
+  recordTime( "ao.trace", trace_timer );
+  recordCount( "ao.samples", ao_samples.num_samples );
+  if ( trace_timer.elapsed > 0.0 ) {
+    recordGauge( "ao.rays_per_second", double( total_rays_traced ) / trace_timer.elapsed );
+  }
+}
+
+#else
+
+// Without the OptiX SDK at build time every context is traced with Prime
+
+bake::OptixAOContext* bake::ao_optix_create_context( const Scene&, const bool, const int*, const size_t, const AccelPreset, 
+                                                      const GroundPlane*, const bool )
+{
+  return NULL;
+}
+
+void bake::ao_optix( OptixAOContext*, const Scene&, const AOSamples&, const int, const float, const float, const size_t, const float, 
+                     float*, const float*, const size_t, const bool, BatchCursor* )
+{
+  assert( false );
+}
+
+void bake::ao_optix_update_instances( OptixAOContext*, const Instance*, const size_t, const unsigned char* )
+{
+  assert( false );
+}
+
+void bake::ao_optix_update_geometry( OptixAOContext*, const Mesh*, const size_t, const Instance*, const size_t, const unsigned char* )
+{
+  assert( false );
+}
+
+void bake::ao_optix_destroy_context( OptixAOContext* )
+{
+}
+
+#endif
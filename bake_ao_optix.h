@@ -0,0 +1,86 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#pragma once
+
+#include "bake_api.h"
+
+struct BatchCursor;
+
+namespace bake
+{
+
+// OptiX 7 accels and pipelines of the occluders, one set per device
+struct OptixAOContext;
+
+// Returns NULL if the build has no OptiX backend (BAKE_WITH_OPTIX7) or OptiX can't be initialized.  With 
+// require_rt_cores, also if a device has no ray tracing cores.
+OptixAOContext* ao_optix_create_context(
+    const Scene& occluders,
+    const bool   conserve_memory,
+    const int*   devices,
+    const size_t num_devices,
+    const AccelPreset accel_preset,
+    const GroundPlane* ground_plane,
+    const bool   require_rt_cores
+    );
+
+// Same results as ao_optix_prime, for samples with host positions and normals.  All rays of a sample are traced
+// by one thread of the ray generation program, so there is no ray buffer and no passes per query.
+void ao_optix(
+    OptixAOContext* context,
+    const Scene& scene,
+    const AOSamples& ao_samples,
+    const int    rays_per_sample,
+    const float  scene_offset,
+    const float  scene_maxdistance,
+    const size_t batch_size,
+    const float  adaptive_tolerance,
+    float*  ao_values,
+    const float* radii = NULL,   // as for ao_optix_prime
+    const size_t num_radii = 0,
+    const bool   two_sided = false,
+    BatchCursor* shared_batches = NULL  // batches to take turns at with another tracer, instead of batch_size
+    );
+
+void ao_optix_update_instances(
+    OptixAOContext* context,
+    const Instance* instances,
+    const size_t    num_instances,
+    const unsigned char* visible = NULL  // per instance, 0 to leave it out of the traces; NULL for all
+    );
+
+// New positions of the same meshes, e.g. the next frame of an animation: mesh accels are refit in place, except that
+// the first update of each, and every few after, builds it again to allow refits and to keep traces fast
+void ao_optix_update_geometry(
+    OptixAOContext* context,
+    const Mesh*     meshes,
+    const size_t    num_meshes,
+    const Instance* instances,
+    const size_t    num_instances,
+    const unsigned char* visible = NULL  // as for ao_optix_update_instances
+    );
+
+void ao_optix_destroy_context( OptixAOContext* context );
+
+}
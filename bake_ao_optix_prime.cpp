@@ -22,7 +22,9 @@
 -----------------------------------------------------------------------*/
 
 #include "bake_ao_optix_prime.h"
+#include "bake_ao_file.h"
 #include "bake_kernels.h"
+#include "bake_sample.h"
 #include "bake_util.h"
 
 #include "Buffer.h"
@@ -33,21 +35,128 @@
 #include "random.h"
 
 #include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
 #include <float.h>
+#include <iomanip>
 #include <iostream>
 #include <map>
+#include <sstream>
+#include <string>
+#include <vector>
 
+// Times x into t, inside a profiler range named after the timer
 #define ACCUM_TIME( t, x )        \
 do {                              \
+  ProfileRange range_( #t );      \
   t.start();                      \
   x;                              \
   t.stop();                       \
 } while( false )
 
+// Same, plus the device time of the work x queues on the stream, into the EventTimer g
+#define ACCUM_GPU_TIME( t, g, stream, x ) \
+do {                              \
+  ProfileRange range_( #t );      \
+  t.start();                      \
+  g.start( stream );              \
+  x;                              \
+  g.stop( stream );               \
+  t.stop();                       \
+} while( false )
+
 namespace
 {
 
 
+// Per-mesh models kept across the Prime contexts of a device, with the device geometry they were built over, so
+// later contexts, e.g. of the next batch job, reuse the accels of the meshes they share instead of building them
+// again.  Meshes are keyed by two content hashes of different seeds and the builder settings.  A model only works
+// with the Prime context it was made in, so the library holds that context for its device, and contexts that use
+// the library take it instead of a prepared one.
+struct LibraryMeshKey {
+  uint64_t hash[2];
+  size_t   num_vertices;
+  size_t   num_triangles;
+  bool     conserve_memory;
+  int      accel_preset;
+
+  bool operator<( const LibraryMeshKey& other ) const {
+    if ( hash[0] != other.hash[0] ) return hash[0] < other.hash[0];
+    if ( hash[1] != other.hash[1] ) return hash[1] < other.hash[1];
+    if ( num_vertices != other.num_vertices ) return num_vertices < other.num_vertices;
+    if ( num_triangles != other.num_triangles ) return num_triangles < other.num_triangles;
+    if ( conserve_memory != other.conserve_memory ) return conserve_memory < other.conserve_memory;
+    return accel_preset < other.accel_preset;
+  }
+};
+
+struct LibraryMesh {
+  optix::prime::Model model;
+  Buffer<float3>* vertices;
+  Buffer<int3>*   indices;
+  size_t   bytes;     // of the geometry; Prime doesn't tell the size of its accels
+  uint64_t last_use;
+  int      users;     // scenes built with the model that are still around; only unused meshes are dropped
+
+  LibraryMesh() : vertices( NULL ), indices( NULL ), bytes( 0 ), last_use( 0 ), users( 0 ) {}
+  ~LibraryMesh() {
+    delete vertices;
+    delete indices;
+  }
+
+private:
+  LibraryMesh( const LibraryMesh& );            // forbidden
+  LibraryMesh& operator=( const LibraryMesh& ); // forbidden
+};
+
+struct DeviceMeshLibrary {
+  int device;
+  optix::prime::Context context;
+  std::map<LibraryMeshKey, LibraryMesh*> meshes;
+  size_t   bytes;
+  uint64_t clock;     // for last_use
+  Mutex    mutex;     // held by a scene build or release on the device that uses the library
+
+  DeviceMeshLibrary() : device( 0 ), bytes( 0 ), clock( 0 ) {}
+};
+
+struct MeshLibrary {
+  std::vector<DeviceMeshLibrary*> devices;
+  size_t budget_bytes;  // per device; 0 when there is no library
+  Mutex  mutex;
+
+  MeshLibrary() : budget_bytes( 0 ) {}
+};
+
+MeshLibrary& meshLibrary()
+{
+  static MeshLibrary library;
+  return library;
+}
+
+// Drops unused meshes, least recently used first, until the library fits in budget_bytes.  With the library's mutex
+// held, on its device.
+void trimMeshLibrary( DeviceMeshLibrary& library, const size_t budget_bytes )
+{
+  typedef std::map<LibraryMeshKey, LibraryMesh*>::iterator Iter;
+  while ( library.bytes > budget_bytes || ( budget_bytes == 0 && !library.meshes.empty() ) ) {
+    Iter oldest = library.meshes.end();
+    for (Iter it = library.meshes.begin(); it != library.meshes.end(); ++it) {
+      if ( it->second->users == 0 && ( oldest == library.meshes.end() || it->second->last_use < oldest->second->last_use ) ) {
+        oldest = it;
+      }
+    }
+    if ( oldest == library.meshes.end() ) break;  // the rest are in use
+    library.bytes -= oldest->second->bytes;
+    delete oldest->second;
+    library.meshes.erase( oldest );
+    recordCount( "ao.mesh_library.evictions", 1 );
+  }
+}
+
+
 // For scoping Prime data that needs to stay around during queries
 struct PrimeSceneData {
 
@@ -55,7 +164,50 @@ struct PrimeSceneData {
   std::vector<Buffer<int3>* >   index_buffers;
   std::vector<optix::prime::Model> models;
 
+  // Device geometry per mesh, for a CUDA context, and the host arrays it was copied from.
+  std::vector<const float3*> mesh_vertices;
+  std::vector<const int3*>   mesh_indices;
+  std::vector<const void*>   mesh_host_vertices;
+  std::vector<const void*>   mesh_host_indices;
+
+  // Top level arrays, kept for rebuilds: the model of each instance and the top 3 rows of its row major xform
+  std::vector<RTPmodel> instance_models;
+  std::vector<float>    instance_transforms;
+
+  // Geometry bytes this device holds in managed memory, and the part of them that didn't fit in its free memory
+  size_t managed_bytes;
+  size_t oversubscribed_bytes;
+
+  // Library meshes whose models are in the scene, and the library they are in; their buffers are the library's
+  DeviceMeshLibrary* library;
+  std::vector<LibraryMesh*> library_meshes;
+
+  PrimeSceneData() : managed_bytes( 0 ), oversubscribed_bytes( 0 ), library( NULL ) {}
+
+  // Exchange the contents with those of another scene's data, e.g. to put a rebuilt one in place
+  void swap( PrimeSceneData& other ) {
+    vertex_buffers.swap( other.vertex_buffers );
+    index_buffers.swap( other.index_buffers );
+    models.swap( other.models );
+    mesh_vertices.swap( other.mesh_vertices );
+    mesh_indices.swap( other.mesh_indices );
+    mesh_host_vertices.swap( other.mesh_host_vertices );
+    mesh_host_indices.swap( other.mesh_host_indices );
+    instance_models.swap( other.instance_models );
+    instance_transforms.swap( other.instance_transforms );
+    std::swap( managed_bytes, other.managed_bytes );
+    std::swap( oversubscribed_bytes, other.oversubscribed_bytes );
+    std::swap( library, other.library );
+    library_meshes.swap( other.library_meshes );
+  }
+
   virtual ~PrimeSceneData() {
+    if ( library ) {
+      ScopedLock lock( library->mutex );
+      for (size_t i = 0; i < library_meshes.size(); ++i) --library_meshes[i]->users;
+      models.clear();
+      trimMeshLibrary( *library, meshLibrary().budget_bytes );
+    }
     // clean up Buffer pointers.
     for (size_t i = 0; i < vertex_buffers.size(); ++i) {
       delete vertex_buffers[i];
@@ -69,25 +221,150 @@ struct PrimeSceneData {
 };
 
 
-// Build and return a two-level Prime scene that is ready for ray queries.
+// (Re)build the top level of a two-level scene: one instance of a per-mesh model per scene instance.
+// Transforms go to Prime as 4x3, the top rows of the row major instance xforms, filled in parallel for scenes with
+// millions of instances.  The arrays are kept in psd, so rebuilds after instances move don't reallocate them.
+void setPrimeInstances( optix::prime::Model& scene_model, PrimeSceneData& psd, const bake::Instance* instances, const size_t num_instances )
+{
+  psd.instance_models.resize( num_instances );
+  psd.instance_transforms.resize( 12*num_instances );
+  RTPmodel* models = psd.instance_models.empty() ? NULL : &psd.instance_models[0];
+  float* transforms = psd.instance_transforms.empty() ? NULL : &psd.instance_transforms[0];
+#pragma omp parallel for if(num_instances >= (1 << 14))
+  for (ptrdiff_t i = 0; i < ptrdiff_t(num_instances); ++i) {
+    const size_t index = instances[i].mesh_index;
+    assert( index < psd.models.size() );
+    models[i] = psd.models[index]->getRTPmodel();
+    std::copy( instances[i].xform, instances[i].xform + 12, transforms + 12*i );
+  }
+
+  scene_model->setInstances( num_instances, RTP_BUFFER_TYPE_HOST, models,
+                      RTP_BUFFER_FORMAT_TRANSFORM_FLOAT4x3, RTP_BUFFER_TYPE_HOST, transforms );
+  scene_model->update( 0 );
+}
+
 
-optix::prime::Model createPrimeScene( optix::prime::Context& context, const RTPcontexttype context_type,
-    const bake::Mesh* meshes, const size_t num_meshes, const bake::Instance* instances, const size_t num_instances, 
+// Accel builds of a CUDA context that may be in flight at once; each holds temporary device memory until finished
+const size_t MAX_ASYNC_BUILDS = 64;
+const size_t FAST_CALLER_TRIANGLES = 1 << 14;  // fast preset builds meshes from this size on the caller's triangles
+
+
+// Prime builder parameters of one mesh.  Caller triangles save the copy into Prime's layout, which is most of
+// the build time of a large mesh, at some cost in query speed.
+void setBuilderParameters( optix::prime::Model& model, const bake::Mesh& mesh, const bool conserve_memory, const bake::AccelPreset accel_preset )
+{
+  if (conserve_memory){
+    model->setBuilderParameter(RTP_BUILDER_PARAM_USE_CALLER_TRIANGLES, 1);
+    model->setBuilderParameter<size_t>(RTP_BUILDER_PARAM_CHUNK_SIZE, 512 * 1024 * 1024);
+  } else if (accel_preset == bake::ACCEL_PRESET_FAST && mesh.num_triangles >= FAST_CALLER_TRIANGLES) {
+    model->setBuilderParameter(RTP_BUILDER_PARAM_USE_CALLER_TRIANGLES, 1);
+  }
+}
+
+
+// A device buffer of the current device, filled with count elements of host data on the stream; the caller
+// synchronizes the stream before the host data goes away.  Managed buffers are advised read mostly and prefetched
+// to the device, and may exceed its memory: the pages it can't hold are faulted in from the host when queries
+// touch them, at reduced speed instead of a failed allocation.
+template <typename T>
+Buffer<T>* uploadGeometry( const void* host_data, const size_t count, const bool managed, cudaStream_t stream, PrimeSceneData& psd )
+{
+  Buffer<T>* buffer = new Buffer<T>( count, RTP_BUFFER_TYPE_CUDA_LINEAR, UNLOCKED, 0, managed ? DEVICE_ALLOC_MANAGED : DEVICE_ALLOC_POOLED );
+  CHK_CUDA( cudaMemcpyAsync( buffer->ptr(), host_data, buffer->sizeInBytes(), cudaMemcpyHostToDevice, stream ) );
+  if ( managed ) {
+    int device = 0;
+    CHK_CUDA( cudaGetDevice( &device ) );
+    CHK_CUDA( cudaMemAdvise( buffer->ptr(), buffer->sizeInBytes(), cudaMemAdviseSetReadMostly, device ) );
+    CHK_CUDA( cudaMemPrefetchAsync( buffer->ptr(), buffer->sizeInBytes(), device, stream ) );
+    psd.managed_bytes += buffer->sizeInBytes();
+  }
+  return buffer;
+}
+
+// Managed geometry bytes of a device beyond the memory it had free before they were uploaded: a lower bound on
+// what queries page in from the host each time they traverse all of it
+void countOversubscription( PrimeSceneData& psd, const size_t free_bytes )
+{
+  psd.oversubscribed_bytes = psd.managed_bytes > free_bytes ? psd.managed_bytes - free_bytes : 0;
+}
+
+// Meshes with identical geometry, e.g. duplicated parts in a CAD assembly that don't share buffers,
+// can share one model and accel.  Find the first mesh with the same content for each mesh.  Meshes with geometry
+// in device memory aren't compared; each is its own source.
+void findSourceMeshes( const bake::Mesh* meshes, const size_t num_meshes, std::vector<size_t>& source_mesh )
+{
+  std::vector<uint64_t> mesh_hashes( num_meshes, 0 );
+#pragma omp parallel for
+  for (ptrdiff_t meshIdx = 0; meshIdx < ptrdiff_t(num_meshes); ++meshIdx) {
+    if ( meshes[meshIdx].geometry_memory == bake::MEMORY_SPACE_HOST ) mesh_hashes[meshIdx] = hashMeshGeometry( meshes[meshIdx] );
+  }
+
+  source_mesh.resize( num_meshes );
+  std::multimap< uint64_t, size_t > meshes_by_hash;
+  for (size_t meshIdx = 0; meshIdx < num_meshes; ++meshIdx) {
+    source_mesh[meshIdx] = meshIdx;
+    if ( meshes[meshIdx].geometry_memory != bake::MEMORY_SPACE_HOST ) continue;
+    typedef std::multimap< uint64_t, size_t >::const_iterator Iter;
+    std::pair<Iter, Iter> range = meshes_by_hash.equal_range( mesh_hashes[meshIdx] );
+    for (Iter it = range.first; it != range.second; ++it) {
+      if ( sameMeshGeometry( meshes[it->second], meshes[meshIdx] ) ) {
+        source_mesh[meshIdx] = it->second;
+        break;
+      }
+    }
+    if ( source_mesh[meshIdx] == meshIdx ) meshes_by_hash.insert( std::make_pair( mesh_hashes[meshIdx], meshIdx ) );
+  }
+}
+
+// True if any mesh of the scene has its geometry in device memory
+bool hasDeviceGeometry( const bake::Scene& scene )
+{
+  for (size_t meshIdx = 0; meshIdx < scene.num_meshes; ++meshIdx) {
+    if ( scene.meshes[meshIdx].geometry_memory == bake::MEMORY_SPACE_DEVICE ) return true;
+  }
+  return false;
+}
+
+
+// Vertex and index buffers of the occluders spread over the devices of a context, each buffer on one device and
+// read by the others through peer access, instead of a copy on every device.  The buffers are owned by the
+// PrimeSceneData of the device they live on.
+struct PeerGeometry {
+  std::vector<const float3*> mesh_vertices;  // per mesh, packed positions
+  std::vector<const int3*>   mesh_indices;
+};
+
+
+// Build the per-mesh models of a two-level Prime scene, the lower level.  With peer geometry, the models are
+// built over its buffers rather than over copies uploaded to this device; with managed geometry, the copies are
+// in unified memory.  With a mesh library, of a CUDA context that is the library's, meshes found there take its
+// models, and the others are uploaded on their own and built into it; the caller holds the library's mutex.
+// Meshes with geometry in device memory are built over the caller's buffers, in any case, and are not kept in the
+// library.
+void buildPrimeMeshes( optix::prime::Context& context, const RTPcontexttype context_type,
+    const bake::Mesh* meshes, const size_t num_meshes,
     const bool conserve_memory,
+    const bake::AccelPreset accel_preset,
+    const PeerGeometry* peer_geometry,
+    const bool managed_geometry,
+    DeviceMeshLibrary* library,
     // output
     PrimeSceneData& psd )
 {
+  std::vector<size_t> source_mesh;
+  findSourceMeshes( meshes, num_meshes, source_mesh );
 
-  // Create one Prime model per input mesh.  Each of these models will have its own accel structure; this is the lower
+  // Create one Prime model per unique input mesh.  Each of these models will have its own accel structure; this is the lower
   // level of a two-level scene hierarchy.
 
   psd.models.reserve( num_meshes );
   for (size_t meshIdx = 0; meshIdx < num_meshes; ++meshIdx) {
-    optix::prime::Model model = context->createModel();
-    if (conserve_memory){
-      model->setBuilderParameter(RTP_BUILDER_PARAM_USE_CALLER_TRIANGLES, 1);
-      model->setBuilderParameter<size_t>(RTP_BUILDER_PARAM_CHUNK_SIZE, 512 * 1024 * 1024);
+    if ( source_mesh[meshIdx] != meshIdx ) {
+      psd.models.push_back( psd.models[source_mesh[meshIdx]] );
+      continue;
     }
+    optix::prime::Model model = context->createModel();
+    setBuilderParameters( model, meshes[meshIdx], conserve_memory, accel_preset );
     psd.models.push_back(model);
 
     // Delay building accels until we connect buffers below
@@ -100,50 +377,176 @@ optix::prime::Model createPrimeScene( optix::prime::Context& context, const RTPc
 
     std::map< float*, Buffer<float3>* > unique_vertex_buffers;
     std::map< unsigned int*, Buffer<int3>* > unique_index_buffers;
+    psd.mesh_vertices.resize( num_meshes, NULL );
+    psd.mesh_indices.resize( num_meshes, NULL );
+    psd.mesh_host_vertices.resize( num_meshes, NULL );
+    psd.mesh_host_indices.resize( num_meshes, NULL );
+
+    // Builds are asynchronous, and uploads go through their own stream, so the copies for one mesh overlap the
+    // builds of the meshes before it.  Only the wait for its own copies holds up the next build.  The stream does
+    // not synchronize with the default stream, which Prime may build on.
+    cudaStream_t upload_stream;
+    CHK_CUDA( cudaStreamCreateWithFlags( &upload_stream, cudaStreamNonBlocking ) );
+    size_t free_bytes = 0, total_bytes = 0;
+    CHK_CUDA( cudaMemGetInfo( &free_bytes, &total_bytes ) );
+    std::vector<size_t> builds;
+    size_t num_finished = 0;
+    std::vector<float> packed_vertices;
+    psd.library = library;
+    size_t num_library_hits = 0;
 
     for (size_t meshIdx = 0; meshIdx < num_meshes; ++meshIdx) {
       
+      if ( source_mesh[meshIdx] != meshIdx ) continue;  // accel already built for identical mesh
       const bake::Mesh& mesh = meshes[meshIdx];
 
-      // Verts
-      Buffer<float3>* vertex_buffer = NULL;
-      if (unique_vertex_buffers.find(mesh.vertices) != unique_vertex_buffers.end()) {
-        vertex_buffer = unique_vertex_buffers.find(mesh.vertices)->second;
+      const float3* vertices = NULL;
+      const int3* indices = NULL;
+      LibraryMesh* library_mesh = NULL;
+      const bool device_geometry = mesh.geometry_memory == bake::MEMORY_SPACE_DEVICE;
+      if ( library && !device_geometry ) {
+        LibraryMeshKey key;
+        key.hash[0] = hashMeshGeometry( mesh );
+        key.hash[1] = hashMeshGeometry( mesh, ~HASH_SEED );
+        key.num_vertices = mesh.num_vertices;
+        key.num_triangles = mesh.num_triangles;
+        key.conserve_memory = conserve_memory;
+        key.accel_preset = int( accel_preset );
+        LibraryMesh*& entry = library->meshes[key];
+        const bool found = entry != NULL;
+        if ( !found ) {
+          // Buffers of its own, so the library can drop it without the meshes it shared buffers with
+          entry = new LibraryMesh;
+          const float* host_vertices = mesh.vertices;
+          if ( !packedMeshVertices( mesh ) ) {
+            packed_vertices.resize( 3*mesh.num_vertices );
+            packMeshVertices( mesh, &packed_vertices[0] );
+            host_vertices = &packed_vertices[0];
+          }
+          entry->vertices = uploadGeometry<float3>( host_vertices, mesh.num_vertices, false, upload_stream, psd );
+          entry->indices = uploadGeometry<int3>( mesh.tri_vertex_indices, mesh.num_triangles, false, upload_stream, psd );
+          entry->model = psd.models[meshIdx];
+          entry->bytes = entry->vertices->sizeInBytes() + entry->indices->sizeInBytes();
+          library->bytes += entry->bytes;
+          CHK_CUDA( cudaStreamSynchronize( upload_stream ) );
+        }
+        ++entry->users;
+        entry->last_use = ++library->clock;
+        psd.library_meshes.push_back( entry );
+        psd.models[meshIdx] = entry->model;
+        psd.mesh_vertices[meshIdx] = entry->vertices->ptr();
+        psd.mesh_indices[meshIdx] = entry->indices->ptr();
+        if ( found ) {
+          ++num_library_hits;
+          continue;  // built by an earlier context
+        }
+        library_mesh = entry;
+      }
+      if ( library_mesh ) {
+        vertices = library_mesh->vertices->ptr();
+        indices = library_mesh->indices->ptr();
+      } else if ( device_geometry ) {
+        // The caller's buffers, with interleaved attributes packed out on the device; no host copy either way
+        vertices = reinterpret_cast<const float3*>( mesh.vertices );
+        if ( !packedMeshVertices( mesh ) ) {
+          Buffer<float3>* vertex_buffer = new Buffer<float3>( mesh.num_vertices, RTP_BUFFER_TYPE_CUDA_LINEAR );
+          CHK_CUDA( cudaMemcpy2DAsync( vertex_buffer->ptr(), sizeof(float3), mesh.vertices, mesh.vertex_stride_bytes, 
+                                       sizeof(float3), mesh.num_vertices, cudaMemcpyDeviceToDevice, upload_stream ) );
+          CHK_CUDA( cudaStreamSynchronize( upload_stream ) );
+          psd.vertex_buffers.push_back( vertex_buffer );
+          vertices = vertex_buffer->ptr();
+        }
+        indices = reinterpret_cast<const int3*>( mesh.tri_vertex_indices );
+        recordCount( "ao.device_geometry_meshes", 1 );
+      } else if ( peer_geometry ) {
+        vertices = peer_geometry->mesh_vertices[meshIdx];
+        indices = peer_geometry->mesh_indices[meshIdx];
       } else {
-        vertex_buffer = new Buffer<float3>( mesh.num_vertices, RTP_BUFFER_TYPE_CUDA_LINEAR, UNLOCKED, mesh.vertex_stride_bytes );
-        cudaMemcpy( vertex_buffer->ptr(), mesh.vertices, vertex_buffer->sizeInBytes(), cudaMemcpyHostToDevice );
-        unique_vertex_buffers[mesh.vertices] = vertex_buffer;
+        // Verts
+        Buffer<float3>* vertex_buffer = NULL;
+        if (unique_vertex_buffers.find(mesh.vertices) != unique_vertex_buffers.end()) {
+          vertex_buffer = unique_vertex_buffers.find(mesh.vertices)->second;
+        } else {
+          // Only positions are traced, so interleaved attributes are packed out before the upload
+          const float* host_vertices = mesh.vertices;
+          if ( !packedMeshVertices( mesh ) ) {
+            packed_vertices.resize( 3*mesh.num_vertices );
+            packMeshVertices( mesh, &packed_vertices[0] );
+            host_vertices = &packed_vertices[0];
+          }
+          vertex_buffer = uploadGeometry<float3>( host_vertices, mesh.num_vertices, managed_geometry, upload_stream, psd );
+          unique_vertex_buffers[mesh.vertices] = vertex_buffer;
 
-        // Don't leak the buffer
-        psd.vertex_buffers.push_back(vertex_buffer);
-      }
+          // Don't leak the buffer
+          psd.vertex_buffers.push_back(vertex_buffer);
+        }
       
-      // Indices
-      Buffer<int3>* index_buffer = NULL;
-      if (unique_index_buffers.find(mesh.tri_vertex_indices) != unique_index_buffers.end()) {
-        index_buffer = unique_index_buffers.find(mesh.tri_vertex_indices)->second;
-      } else {
-        index_buffer = new Buffer<int3>( mesh.num_triangles, RTP_BUFFER_TYPE_CUDA_LINEAR );
-        cudaMemcpy( index_buffer->ptr(), mesh.tri_vertex_indices, index_buffer->sizeInBytes(), cudaMemcpyHostToDevice );
-        unique_index_buffers[mesh.tri_vertex_indices] = index_buffer;
-        psd.index_buffers.push_back(index_buffer);
+        // Indices
+        Buffer<int3>* index_buffer = NULL;
+        if (unique_index_buffers.find(mesh.tri_vertex_indices) != unique_index_buffers.end()) {
+          index_buffer = unique_index_buffers.find(mesh.tri_vertex_indices)->second;
+        } else {
+          index_buffer = uploadGeometry<int3>( mesh.tri_vertex_indices, mesh.num_triangles, managed_geometry, upload_stream, psd );
+          unique_index_buffers[mesh.tri_vertex_indices] = index_buffer;
+          psd.index_buffers.push_back(index_buffer);
+        }
+
+        vertices = vertex_buffer->ptr();
+        indices = index_buffer->ptr();
+        CHK_CUDA( cudaStreamSynchronize( upload_stream ) );
       }
+      psd.mesh_vertices[meshIdx] = vertices;
+      psd.mesh_indices[meshIdx] = indices;
 
       // Connect device buffers to model
       psd.models[meshIdx]->setTriangles(
-          index_buffer->count(), index_buffer->type(), index_buffer->ptr(),
-          vertex_buffer->count(), vertex_buffer->type(), vertex_buffer->ptr(), vertex_buffer->stride()
+          mesh.num_triangles, RTP_BUFFER_TYPE_CUDA_LINEAR, indices,
+          mesh.num_vertices, RTP_BUFFER_TYPE_CUDA_LINEAR, vertices, 0
           );
 
-      // Build the accel on the device.  This is a blocking call.
-      psd.models[meshIdx]->update( 0 );
+      // Build the accel on the device, without waiting for it
+      if (builds.size() - num_finished >= MAX_ASYNC_BUILDS) {
+        psd.models[builds[num_finished++]]->finish();
+      }
+      psd.models[meshIdx]->update( RTP_MODEL_HINT_ASYNC );
+      builds.push_back( meshIdx );
+    }
+
+    // All bottom level accels must be done before the top level build
+    for (; num_finished < builds.size(); ++num_finished) {
+      psd.models[builds[num_finished]]->finish();
+    }
+    CHK_CUDA( cudaStreamDestroy( upload_stream ) );
+    if ( !peer_geometry ) countOversubscription( psd, free_bytes );
+    if ( library ) {
+      recordCount( "ao.mesh_library.hits", num_library_hits );
+      recordCount( "ao.mesh_library.misses", psd.library_meshes.size() - num_library_hits );
+      trimMeshLibrary( *library, meshLibrary().budget_bytes );
+      recordGauge( "ao.mesh_library_bytes", double( library->bytes ) );
+    }
+
+    for (size_t meshIdx = 0; meshIdx < num_meshes; ++meshIdx) {
+      psd.models[meshIdx] = psd.models[source_mesh[meshIdx]];
+      psd.mesh_vertices[meshIdx] = psd.mesh_vertices[source_mesh[meshIdx]];
+      psd.mesh_indices[meshIdx] = psd.mesh_indices[source_mesh[meshIdx]];
+      psd.mesh_host_vertices[meshIdx] = meshes[meshIdx].vertices;
+      psd.mesh_host_indices[meshIdx] = meshes[meshIdx].tri_vertex_indices;
     }
 
   } else {
-    // CPU context: just hand Prime the pointers we already have, no need for another copy
+    // CPU context: just hand Prime the pointers we already have, no need for another copy.  Each thread builds
+    // the accels of whole meshes.
+    std::vector<size_t> unique_meshes;
     for (size_t meshIdx = 0; meshIdx < num_meshes; ++meshIdx) {
+      if ( source_mesh[meshIdx] == meshIdx ) unique_meshes.push_back( meshIdx );  // others share the accel of an identical mesh
+    }
+
+#pragma omp parallel for schedule(dynamic, 1) if(unique_meshes.size() > 1)
+    for (ptrdiff_t k = 0; k < ptrdiff_t(unique_meshes.size()); ++k) {
 
+      const size_t meshIdx = unique_meshes[k];
       const bake::Mesh& mesh = meshes[meshIdx];
+      assert( mesh.geometry_memory == bake::MEMORY_SPACE_HOST );
 
       // Connect host buffers to model
       psd.models[meshIdx]->setTriangles(
@@ -157,24 +560,24 @@ optix::prime::Model createPrimeScene( optix::prime::Context& context, const RTPc
     }
   }
 
-  // The lower level of the scene hierarchy is done, now build the upper level of instances.
+}
 
-  std::vector<RTPmodel> rtp_models;
-  std::vector<optix::Matrix4x4> transforms;
-  rtp_models.reserve(num_instances);
-  transforms.reserve(num_instances);
-  for (int i = 0; i < num_instances; ++i) {
-    const size_t index = instances[i].mesh_index;
-    RTPmodel rtp_model = psd.models[index]->getRTPmodel();
-    rtp_models.push_back(rtp_model);
-    transforms.push_back(optix::Matrix4x4(instances[i].xform));
-  }
 
+// Build and return a two-level Prime scene that is ready for ray queries: the mesh models as buildPrimeMeshes makes
+// them, and the upper level of instances over them
+optix::prime::Model createPrimeScene( optix::prime::Context& context, const RTPcontexttype context_type,
+    const bake::Mesh* meshes, const size_t num_meshes, const bake::Instance* instances, const size_t num_instances, 
+    const bool conserve_memory,
+    const bake::AccelPreset accel_preset,
+    const PeerGeometry* peer_geometry,
+    const bool managed_geometry,
+    DeviceMeshLibrary* library,
+    // output
+    PrimeSceneData& psd )
+{
+  buildPrimeMeshes( context, context_type, meshes, num_meshes, conserve_memory, accel_preset, peer_geometry, managed_geometry, library, psd );
   optix::prime::Model scene_model = context->createModel();
-  scene_model->setInstances( rtp_models.size(), RTP_BUFFER_TYPE_HOST, &rtp_models[0],
-                      RTP_BUFFER_FORMAT_TRANSFORM_FLOAT4x4, RTP_BUFFER_TYPE_HOST, &transforms[0] );
-  scene_model->update( 0 );
-
+  setPrimeInstances( scene_model, psd, instances, num_instances );
   return scene_model;
 }
 
@@ -185,103 +588,2246 @@ inline size_t idivCeil( size_t x, size_t y )
 }
 
 
-} // end namespace
+// Device time of work queued on a stream, from pairs of events around it.  Host timers around async launches
+// only see the launch; the events are read back by resolve once the stream is done, so timing adds no waits.
+struct EventTimer {
+  std::vector<cudaEvent_t> events;  // start and stop of each interval, reused between batches
+  size_t num_intervals;             // recorded since the last resolve
+  double elapsed;                   // seconds, of the resolved intervals
 
+  EventTimer() : num_intervals( 0 ), elapsed( 0.0 ) {}
+  ~EventTimer() {
+    for (size_t i = 0; i < events.size(); ++i) cudaEventDestroy( events[i] );
+  }
 
-void bake::ao_optix_prime(
-    const Scene& scene,
-    const bake::AOSamples& ao_samples,
-    const int rays_per_sample,
-    const float  scene_offset,
-    const float  scene_maxdistance,
-    const bool   cpu_mode,
-    const bool   conserve_memory,
-    float* ao_values
-    )
+  void start( cudaStream_t stream ) {
+    if ( events.size() < 2*num_intervals + 2 ) {
+      cudaEvent_t pair[2];
+      CHK_CUDA( cudaEventCreate( &pair[0] ) );
+      CHK_CUDA( cudaEventCreate( &pair[1] ) );
+      events.insert( events.end(), pair, pair + 2 );
+    }
+    CHK_CUDA( cudaEventRecord( events[2*num_intervals], stream ) );
+  }
+
+  void stop( cudaStream_t stream ) {
+    CHK_CUDA( cudaEventRecord( events[2*num_intervals + 1], stream ) );
+    ++num_intervals;
+  }
+
+  // Precondition: the stream has finished the recorded work
+  void resolve() {
+    for (size_t i = 0; i < num_intervals; ++i) {
+      float ms = 0.0f;
+      CHK_CUDA( cudaEventElapsedTime( &ms, events[2*i], events[2*i + 1] ) );
+      elapsed += 0.001 * ms;
+    }
+    num_intervals = 0;
+  }
+
+private:
+  EventTimer( const EventTimer& );             // forbidden
+  EventTimer& operator=( const EventTimer& );  // forbidden
+};
+
+// Device side phases of a batch, timed with events
+enum GpuPhase {
+  GPU_UPLOAD = 0,   // sample upload or placement
+  GPU_RAYGEN,
+  GPU_QUERY,
+  GPU_UPDATE_AO,
+  GPU_COPY_AO,
+  NUM_GPU_PHASES
+};
+
+const char* const GPU_PHASE_LABELS[NUM_GPU_PHASES] = { "\tgpu upload ...      ", "\tgpu raygen ...      ", "\tgpu query ...       ",
+                                                       "\tgpu update AO ...   ", "\tgpu copy AO out ... " };
+const char* const GPU_PHASE_METRICS[NUM_GPU_PHASES] = { "ao.gpu_upload", "ao.gpu_raygen", "ao.gpu_query", "ao.gpu_update_ao", "ao.gpu_copy_ao" };
+
+
+// Everything needed to have one batch of samples in flight on the device.  Batches are assigned to slots
+// round robin, and each slot has its own stream and query, so the upload of one batch and the download of
+// another can overlap with the query of a third.
+struct BatchSlot {
+
+  // Device working set, allocated once for the largest batch and reused
+  Buffer<float4> sample_positions;  // in the bake::DeviceSamples layout
+  Buffer<uint2>  sample_normals;
+  Buffer<unsigned> hits;  // one bit per ray
+  Buffer<unsigned> plane_hits;  // same, for the analytic ground plane
+  Buffer<float>  hit_t;   // closest hit distance per ray, instead of the bits, for multi radius AO
+  Buffer<Ray>    rays;
+  Buffer<float>  ao;
+
+  // Caller's device samples of the batch, copied over when they are on another device
+  Buffer<float3> peer_samples;
+
+  // Page-locked host staging, so async copies are really async
+  Buffer<float4> staging_positions;
+  Buffer<uint2>  staging_normals;
+  Buffer<float>  staging_ao;
+
+  // Triangle ranges of the batch, when samples are placed on the device
+  Buffer<bake::TriangleSampleRange> sample_ranges;
+  Buffer<bake::TriangleSampleRange> staging_sample_ranges;
+
+  // Locations of the batch's host samples, when they are rebuilt on the device
+  Buffer<bake::SampleLocation> sample_locations;
+  Buffer<bake::SampleLocation> staging_sample_locations;
+
+  // Adaptive sampling: double buffered lists of samples that are still tracing, and their keep flags
+  Buffer<int> active_samples[2];
+  Buffer<unsigned char> keep_flags;
+
+  cudaStream_t stream;
+  optix::prime::Query query;
+
+  // Number of rays/hits last bound to the query
+  size_t query_count;
+
+  // Batch currently in flight, if any, the order it was submitted in, and the time since
+  bool   busy;
+  size_t sequence;
+  size_t sample_offset;
+  size_t num_samples;
+  Timer  timer;
+
+  // Device time of the batches traced on this slot, per phase
+  EventTimer gpu_timers[NUM_GPU_PHASES];
+
+  BatchSlot() : stream( 0 ), query_count( 0 ), busy( false ), sequence( 0 ), sample_offset( 0 ), num_samples( 0 ) {}
+
+  // Multi radius slots (num_radii > 0) have one AO value per radius and sample, two-sided slots one per side
+  void alloc( size_t capacity, size_t passes_per_query, bool device_sampling, bool adaptive, size_t num_radii, size_t num_channels ) {
+    sample_positions.alloc   ( capacity, RTP_BUFFER_TYPE_CUDA_LINEAR );
+    sample_normals.alloc     ( capacity, RTP_BUFFER_TYPE_CUDA_LINEAR );
+    if ( num_radii > 0 ) {
+      hit_t.alloc            ( capacity*passes_per_query, RTP_BUFFER_TYPE_CUDA_LINEAR );
+    } else {
+      hits.alloc             ( idivCeil( capacity*passes_per_query, size_t(32) ), RTP_BUFFER_TYPE_CUDA_LINEAR );
+      plane_hits.alloc       ( idivCeil( capacity*passes_per_query, size_t(32) ), RTP_BUFFER_TYPE_CUDA_LINEAR );
+    }
+    rays.alloc               ( capacity*passes_per_query, RTP_BUFFER_TYPE_CUDA_LINEAR );
+    ao.alloc                 ( capacity*num_channels, RTP_BUFFER_TYPE_CUDA_LINEAR );
+    if ( !device_sampling ) {
+      staging_positions.alloc   ( capacity, RTP_BUFFER_TYPE_HOST, LOCKED );
+      staging_normals.alloc     ( capacity, RTP_BUFFER_TYPE_HOST, LOCKED );
+    }
+    staging_ao.alloc          ( capacity*num_channels, RTP_BUFFER_TYPE_HOST, LOCKED );
+    if ( adaptive ) {
+      active_samples[0].alloc ( capacity, RTP_BUFFER_TYPE_CUDA_LINEAR );
+      active_samples[1].alloc ( capacity, RTP_BUFFER_TYPE_CUDA_LINEAR );
+      keep_flags.alloc        ( capacity, RTP_BUFFER_TYPE_CUDA_LINEAR );
+    }
+  }
+
+  ~BatchSlot() {
+    query = optix::prime::Query();  // release before the stream it is bound to
+    if ( stream ) cudaStreamDestroy( stream );
+  }
+};
+
+
+const char CHECKPOINT_MAGIC[8] = { 'B', 'A', 'K', 'E', 'C', 'K', 'P', '\0' };
+
+// Identifies the sample set and batching a checkpoint file was written for
+struct CheckpointHeader {
+  char     magic[8];
+  uint64_t bake_hash;           // scene and options, from the caller
+  uint64_t first_sample_index;
+  uint64_t num_samples;
+  uint64_t num_channels;
+  uint64_t batch_size;
+};
+
+// Finished batches of one sample set, appended to a file in the checkpoint directory as their AO values land in
+// host memory, so that a later run of the same bake restores them instead of tracing them again.  Each record is
+// the batch's sample offset and count, its AO values channel by channel, and a hash of the values; a record cut
+// short by a crash fails the hash, and is overwritten by the next batch.
+class BatchCheckpoint
 {
+public:
+  BatchCheckpoint() : m_file( NULL ), m_ao_values( NULL ), m_num_total_samples( 0 ), m_num_channels( 0 ), m_batch_size( 0 ) {}
+  ~BatchCheckpoint() { if ( m_file ) fclose( m_file ); }
 
-  Timer setup_timer;
-  setup_timer.start( );
+  static std::string path( const std::string& dir, const uint64_t bake_hash, const size_t first_sample_index )
+  {
+    std::ostringstream name;
+    name << dir << "/ao_" << std::hex << bake_hash << std::dec << "_" << first_sample_index << ".ckpt";
+    return name.str();
+  }
 
-  const RTPcontexttype context_type = cpu_mode ? RTP_CONTEXT_TYPE_CPU : RTP_CONTEXT_TYPE_CUDA;
-  optix::prime::Context ctx = optix::prime::Context::create( context_type );
+  // Batch size of the run that wrote the checkpoint of this sample set, or 0 if there is none
+  static size_t savedBatchSize( const std::string& filename, const CheckpointHeader& key )
+  {
+    FILE* file = fopen( filename.c_str(), "rb" );
+    if ( !file ) return 0;
+    CheckpointHeader header;
+    const bool ok = fread( &header, sizeof(header), 1, file ) == 1 && sameSampleSet( header, key );
+    fclose( file );
+    return ok ? size_t( header.batch_size ) : 0;
+  }
 
-  PrimeSceneData psd;
+  // Restores the batches of an earlier run with the same key into ao_values, marking them in done, and opens the 
+  // file for the batches still to come.  Returns the number of batches restored.
+  size_t open( const std::string& filename, const CheckpointHeader& key, float* ao_values, std::vector<bool>& done )
+  {
+    m_ao_values = ao_values;
+    m_num_total_samples = size_t( key.num_samples );
+    m_num_channels = size_t( key.num_channels );
+    m_batch_size = size_t( key.batch_size );
 
-  optix::prime::Model prime_scene = createPrimeScene( ctx, context_type, scene.meshes, scene.num_meshes, scene.instances, scene.num_instances, conserve_memory, psd );
+    size_t num_restored = 0;
+    uint64_t valid_end = 0;
+    m_file = fopen( filename.c_str(), "r+b" );
+    CheckpointHeader header;
+    if ( m_file && fread( &header, sizeof(header), 1, m_file ) == 1 && sameSampleSet( header, key ) && header.batch_size == key.batch_size ) {
+      valid_end = sizeof(header);
+      std::vector<float> values;
+      uint64_t record[2];
+      while ( fread( record, sizeof(record), 1, m_file ) == 1 ) {
+        const uint64_t offset = record[0], count = record[1];
+        if ( offset % m_batch_size != 0 || offset >= m_num_total_samples || count != std::min( uint64_t( m_batch_size ), uint64_t( m_num_total_samples ) - offset ) ) break;
+        values.resize( m_num_channels*count );
+        uint64_t hash = 0;
+        if ( fread( &values[0], sizeof(float), values.size(), m_file ) != values.size() || fread( &hash, sizeof(hash), 1, m_file ) != 1 ) break;
+        if ( hash != hashBytes( &values[0], values.size()*sizeof(float) ) ) break;
+        for (size_t c = 0; c < m_num_channels; ++c) {
+          std::copy( &values[c*count], &values[c*count] + count, m_ao_values + c*m_num_total_samples + offset );
+        }
+        const size_t batch_idx = size_t( offset / m_batch_size );
+        if ( !done[batch_idx] ) num_restored++;
+        done[batch_idx] = true;
+        valid_end += sizeof(record) + values.size()*sizeof(float) + sizeof(hash);
+      }
+    }
 
-  optix::prime::Query query = prime_scene->createQuery( RTP_QUERY_TYPE_ANY );
+    if ( valid_end == 0 ) {
+      // Nothing to resume: start the file over
+      if ( m_file ) fclose( m_file );
+      m_file = fopen( filename.c_str(), "w+b" );
+      if ( m_file ) {
+        header = key;
+        std::memcpy( header.magic, CHECKPOINT_MAGIC, sizeof(header.magic) );
+        if ( fwrite( &header, sizeof(header), 1, m_file ) != 1 || fflush( m_file ) != 0 ) {
+          fclose( m_file );
+          m_file = NULL;
+        }
+      }
+    } else if ( !seek( valid_end ) ) {
+      fclose( m_file );
+      m_file = NULL;
+    }
+    if ( !m_file ) {
+      std::cerr << "\tcan't write checkpoint " << filename << ", continuing without it" << std::endl;
+    }
+    return num_restored;
+  }
 
-  const int sqrt_rays_per_sample = static_cast<int>( sqrtf( static_cast<float>( rays_per_sample ) ) + .5f );
-  setup_timer.stop();
+  // Called by the tracing threads once a batch's AO values are in ao_values
+  void save( const size_t sample_offset, const size_t num_samples )
+  {
+    ScopedLock lock( m_mutex );
+    if ( !m_file ) return;
+    std::vector<float> values( m_num_channels*num_samples );
+    for (size_t c = 0; c < m_num_channels; ++c) {
+      const float* channel = m_ao_values + c*m_num_total_samples + sample_offset;
+      std::copy( channel, channel + num_samples, &values[c*num_samples] );
+    }
+    const uint64_t record[2] = { sample_offset, num_samples };
+    const uint64_t hash = hashBytes( values.empty() ? NULL : &values[0], values.size()*sizeof(float) );
+    const bool ok = fwrite( record, sizeof(record), 1, m_file ) == 1 && 
+                    ( values.empty() || fwrite( &values[0], sizeof(float), values.size(), m_file ) == values.size() ) &&
+                    fwrite( &hash, sizeof(hash), 1, m_file ) == 1 && fflush( m_file ) == 0;
+    if ( !ok ) {
+      std::cerr << "\tfailed to write checkpoint, continuing without it" << std::endl;
+      fclose( m_file );
+      m_file = NULL;
+    }
+  }
 
-  Timer raygen_timer;
-  Timer query_timer;
-  Timer updateao_timer;
-  Timer copyao_timer;
+private:
+  static bool sameSampleSet( const CheckpointHeader& a, const CheckpointHeader& b )
+  {
+    return std::memcmp( a.magic, CHECKPOINT_MAGIC, sizeof(a.magic) ) == 0 && a.bake_hash == b.bake_hash && 
+           a.first_sample_index == b.first_sample_index && a.num_samples == b.num_samples && a.num_channels == b.num_channels;
+  }
 
-  unsigned seed = 0;
-
-  // Split sample points into batches to help limit device memory usage.
-  const size_t batch_size = 2000000;  // Note: fits on GTX 750 (1 GB) along with Hunter model
-  const size_t num_batches = std::max(idivCeil(ao_samples.num_samples, batch_size), size_t(1));
-
-  for (size_t batch_idx = 0; batch_idx < num_batches; batch_idx++, seed++) {
-
-    setup_timer.start();
-    const size_t sample_offset = batch_idx*batch_size;
-    const size_t num_samples = std::min(batch_size, ao_samples.num_samples - sample_offset);
-
-    // Copy sample points to device
-    Buffer<float3> sample_normals     ( num_samples, RTP_BUFFER_TYPE_CUDA_LINEAR );
-    Buffer<float3> sample_face_normals( num_samples, RTP_BUFFER_TYPE_CUDA_LINEAR );
-    Buffer<float3> sample_positions   ( num_samples, RTP_BUFFER_TYPE_CUDA_LINEAR );
-    
-    cudaMemcpy( sample_normals.ptr(),      ao_samples.sample_normals + 3*sample_offset,      sample_normals.sizeInBytes(),  cudaMemcpyHostToDevice );
-    cudaMemcpy( sample_face_normals.ptr(), ao_samples.sample_face_normals + 3*sample_offset, sample_face_normals.sizeInBytes(),  cudaMemcpyHostToDevice );
-    cudaMemcpy( sample_positions.ptr(),    ao_samples.sample_positions + 3*sample_offset,    sample_positions.sizeInBytes(),  cudaMemcpyHostToDevice );
-    bake::AOSamples ao_samples_device;
-    ao_samples_device.num_samples = num_samples;
-    ao_samples_device.sample_normals      = reinterpret_cast<float*>( sample_normals.ptr() );
-    ao_samples_device.sample_face_normals = reinterpret_cast<float*>( sample_face_normals.ptr() );
-    ao_samples_device.sample_positions    = reinterpret_cast<float*>( sample_positions.ptr() );
-    ao_samples_device.sample_infos = 0;
-
-    Buffer<float> hits( num_samples, RTP_BUFFER_TYPE_CUDA_LINEAR );
-    Buffer<Ray>   rays( num_samples, RTP_BUFFER_TYPE_CUDA_LINEAR );
-    Buffer<float> ao  ( num_samples, RTP_BUFFER_TYPE_CUDA_LINEAR );
-    cudaMemset( ao.ptr(), 0, ao.sizeInBytes() );
-    
-    query->setRays( rays.count(), Ray::format,             rays.type(), rays.ptr() );
-    query->setHits( hits.count(), RTP_BUFFER_FORMAT_HIT_T, hits.type(), hits.ptr() );
-
-    setup_timer.stop();
-
-    for( int i = 0; i < sqrt_rays_per_sample; ++i )
-    for( int j = 0; j < sqrt_rays_per_sample; ++j )
-    {
-      ACCUM_TIME(raygen_timer,    generateRaysDevice(seed, i, j, sqrt_rays_per_sample, scene_offset, scene_maxdistance, ao_samples_device, rays.ptr()));
+  bool seek( const uint64_t offset )
+  {
+#if defined(_WIN32)
+    return _fseeki64( m_file, (__int64)offset, SEEK_SET ) == 0;
+#else
+    return fseeko( m_file, (off_t)offset, SEEK_SET ) == 0;
+#endif
+  }
+
+  FILE*  m_file;
+  float* m_ao_values;
+  size_t m_num_total_samples;
+  size_t m_num_channels;
+  size_t m_batch_size;
+  Mutex  m_mutex;
+
+  BatchCheckpoint( const BatchCheckpoint& );            // forbidden
+  BatchCheckpoint& operator=( const BatchCheckpoint& ); // forbidden
+};
 
-      // Host or device, depending on Prime context type.  For a host context, which we assume is rare, Prime will copy the rays from device to host.
-      ACCUM_TIME( query_timer,    query->execute( 0 ) );
 
-      ACCUM_TIME(updateao_timer,  updateAODevice((int)num_samples, hits.ptr(), ao.ptr()));
+// Wait for the batch in flight on a slot, then hand its AO values to the caller, if it wants them.  Multi radius
+// and two-sided AO, and AO with bent normals, go to num_channels channels of num_total_samples values each.  A checkpoint gets them too.
+void finishBatch( BatchSlot& slot, float* ao_values, const size_t num_total_samples = 0, const size_t num_channels = 1,
+                  BatchCheckpoint* checkpoint = NULL, bake::AOBatchCallback batch_callback = NULL, void* batch_data = NULL,
+                  ProgressCounter* progress = NULL )
+{
+  if ( !slot.busy ) return;
+  CHK_CUDA( cudaStreamSynchronize( slot.stream ) );
+  for (int p = 0; p < NUM_GPU_PHASES; ++p) slot.gpu_timers[p].resolve();
+  if ( ao_values ) {
+    for (size_t c = 0; c < num_channels; ++c) {
+      const float* channel = slot.staging_ao.ptr() + c*slot.num_samples;
+      std::copy( channel, channel + slot.num_samples, ao_values + c*num_total_samples + slot.sample_offset );
     }
+  }
+  if ( checkpoint ) checkpoint->save( slot.sample_offset, slot.num_samples );
+  if ( batch_callback ) batch_callback( batch_data, slot.sample_offset, slot.num_samples, slot.staging_ao.ptr(), num_channels );
+  if ( progress ) progress->add( slot.num_samples );
+  slot.busy = false;
+  slot.timer.stop();
+  recordTime( "ao.batch", slot.timer );
+}
+
 
-    ACCUM_TIME(updateao_timer, normalizeAODevice((int)num_samples, ao.ptr(), rays_per_sample));
+// Slot for the next batch: an idle one, else the first whose batch the device has finished, so that batches retire
+// in the order they finish rather than the order they went in, else the one in flight longest
+size_t nextSlot( const std::vector<BatchSlot*>& slots, const size_t num_slots )
+{
+  if ( num_slots == 1 ) return 0;
+  size_t oldest = 0;
+  for (size_t i = 0; i < num_slots; ++i) {
+    if ( !slots[i]->busy ) return i;
+    if ( slots[i]->sequence < slots[oldest]->sequence ) oldest = i;
+  }
+  for (size_t i = 0; i < num_slots; ++i) {
+    if ( cudaStreamQuery( slots[i]->stream ) == cudaSuccess ) return i;
+  }
+  return oldest;
+}
 
-    // copy AO values back to host
-    copyao_timer.start();
-    cudaMemcpy( &ao_values[sample_offset], ao.ptr(), ao.sizeInBytes(), cudaMemcpyDeviceToHost ); 
-    copyao_timer.stop();
+
+// Device bytes needed per sample in one batch slot: position, packed normals and AO, plus a ray
+// and a hit and ground plane hit bit for each pass traced by one query, and two active list entries and a flag for adaptive sampling.
+// Multi radius AO has an AO value per radius, and a hit distance instead of the bits; two-sided AO an AO value per side.
+inline size_t bytesPerBatchSample( const size_t passes_per_query, const bool adaptive, const size_t num_radii, const size_t num_channels )
+{
+  if ( num_radii > 0 ) {
+    return sizeof(float4) + sizeof(uint2) + num_radii*sizeof(float) + passes_per_query*( sizeof(Ray) + sizeof(float) );
+  }
+  return sizeof(float4) + sizeof(uint2) + num_channels*sizeof(float) + passes_per_query*sizeof(Ray) + 2*idivCeil( passes_per_query, size_t(8) ) + (adaptive ? 2*sizeof(int) + 1 : 0);
+}
+
+// Ray passes traced by one query unless the batch is small, or the caller asks for another number
+const int DEFAULT_PASSES_PER_QUERY = 8;
+
+// Pipelined batch slots of a device context, each with a query in flight on its own stream, unless the caller asks
+// for more; CPU contexts have one
+const size_t DEFAULT_BATCH_SLOTS = 2;
+
+// Kernels index rays with an int
+const size_t MAX_RAYS_PER_QUERY = size_t(1) << 30;
+
+// Queries smaller than this are mostly launch overhead
+const size_t MIN_RAYS_PER_QUERY = size_t(1) << 21;
+
+// Far field volumes have between these many voxels along each axis at level 0, and the near field of the rays reaches
+// at least this many voxels out, so that cones start clear of the voxels of the sample's own surface
+const int   MIN_FAR_FIELD_RESOLUTION = 16;
+const int   MAX_FAR_FIELD_RESOLUTION = 1024;
+const float MIN_FAR_FIELD_NEAR_VOXELS = 3.0f;
+
+// Pick the largest batch that fits in the device memory left over after the accel build, and after reserved_bytes
+// the caller needs besides the slots.
+size_t autoBatchSize( const size_t num_slots, const size_t passes_per_query, const bool adaptive, const size_t num_radii, const size_t num_channels,
+                      const size_t reserved_bytes = 0 )
+{
+  const size_t min_batch_size = 1 << 16;
+  size_t free_bytes = 0, total_bytes = 0;
+  CHK_CUDA( cudaMemGetInfo( &free_bytes, &total_bytes ) );
+  // Blocks cached by the device pool are free for our purposes
+  int device = 0;
+  CHK_CUDA( cudaGetDevice( &device ) );
+  free_bytes += devicePoolCachedBytes( device );
+  free_bytes = free_bytes > reserved_bytes ? free_bytes - reserved_bytes : 0;
+
+  // Leave headroom for Prime's per-query scratch memory and for other clients of the device
+  const size_t margin = std::max( free_bytes / 10, size_t(256) << 20 );
+  const size_t usable = free_bytes > margin ? free_bytes - margin : 0;
+  const size_t batch_size = std::min( usable / (bytesPerBatchSample( passes_per_query, adaptive, num_radii, num_channels )*num_slots), MAX_RAYS_PER_QUERY / passes_per_query );
+  return std::max( batch_size, min_batch_size );
+}
+
+
+// Pack host samples of a batch into the device layout, in the slot's page-locked staging buffers
+void stageHostSamples( const bake::AOSamples& ao_samples, const size_t sample_offset, const size_t num_samples, BatchSlot& slot )
+{
+  const float3* normals      = reinterpret_cast<const float3*>( ao_samples.sample_normals )      + sample_offset;
+  const float3* face_normals = reinterpret_cast<const float3*>( ao_samples.sample_face_normals ) + sample_offset;
+  const float3* positions    = reinterpret_cast<const float3*>( ao_samples.sample_positions )    + sample_offset;
+  float4* staging_positions = slot.staging_positions.ptr();
+  uint2*  staging_normals   = slot.staging_normals.ptr();
+#pragma omp parallel for if( num_samples >= (1 << 16) )
+  for (ptrdiff_t i = 0; i < ptrdiff_t(num_samples); ++i) {
+    staging_positions[i] = make_float4( positions[i].x, positions[i].y, positions[i].z, 0.0f );
+    staging_normals[i]   = make_uint2( bake::encodeOctahedral( normals[i].x, normals[i].y, normals[i].z ),
+                                       bake::encodeOctahedral( face_normals[i].x, face_normals[i].y, face_normals[i].z ) );
+  }
+}
+
+
+// Locations of host samples of a batch, in the slot's page-locked staging buffer, from full or compact sample infos
+void stageSampleLocations( const bake::AOSamples& ao_samples, const size_t sample_offset, const size_t num_samples, BatchSlot& slot )
+{
+  bake::SampleLocation* locations = slot.staging_sample_locations.ptr();
+#pragma omp parallel for if( num_samples >= (1 << 16) )
+  for (ptrdiff_t i = 0; i < ptrdiff_t(num_samples); ++i) {
+    const size_t s = sample_offset + i;
+    bake::SampleLocation& location = locations[i];
+    location.instance_index = ao_samples.sample_instances[s];
+    if ( ao_samples.sample_infos ) {
+      const bake::SampleInfo& info = ao_samples.sample_infos[s];
+      location.tri_idx = info.tri_idx;
+      location.bary[0] = bake::encode_bary( info.bary[0] );
+      location.bary[1] = bake::encode_bary( info.bary[1] );
+    } else {
+      const bake::CompactSampleInfo& info = ao_samples.compact_sample_infos[s];
+      location.tri_idx = info.tri_idx;
+      location.bary[0] = info.bary[0];
+      location.bary[1] = info.bary[1];
+    }
+  }
+}
+
+
+// Where the samples placed on the device come from: per-triangle sample counts of the leading instances of the
+// scene, as written by sampleInstances, in prefix sum form.
+struct SamplePlacement {
+  size_t num_instances;                        // instances that have sample counts
+  std::vector<size_t> tri_sample_offsets;      // first sample of each (instance, triangle) entry, plus the total
+  std::vector<size_t> instance_entry_offsets;  // first entry of each instance, plus the total
+  std::vector<float>  tri_sample_dA;           // area per sample of each entry, for splatting AO onto vertices
+
+  SamplePlacement() : num_instances( 0 ) {}
+};
+
+void createSamplePlacement( const bake::Scene& scene, const bake::AOSamples& ao_samples, SamplePlacement& placement )
+{
+  // Counts cover the instances that were sampled, which come first in the scene
+  size_t num_entries = 0;
+  size_t num_samples = 0;
+  placement.instance_entry_offsets.push_back( 0 );
+  for (size_t i = 0; i < scene.num_instances && num_samples < ao_samples.num_samples; ++i) {
+    const size_t num_triangles = scene.meshes[scene.instances[i].mesh_index].num_triangles;
+    for (size_t k = 0; k < num_triangles; ++k) num_samples += ao_samples.tri_sample_counts[num_entries + k];
+    num_entries += num_triangles;
+    placement.instance_entry_offsets.push_back( num_entries );
+    placement.num_instances = i+1;
+  }
+  assert( num_samples == ao_samples.num_samples );
+
+  placement.tri_sample_offsets.resize( num_entries+1 );
+  placement.tri_sample_dA.assign( num_entries, 0.0f );
+  size_t offset = 0;
+  for (size_t e = 0; e < num_entries; ++e) {
+    placement.tri_sample_offsets[e] = offset;
+    if ( ao_samples.tri_sample_dA ) {
+      placement.tri_sample_dA[e] = ao_samples.tri_sample_dA[e];
+    } else if ( ao_samples.sample_infos && ao_samples.tri_sample_counts[e] > 0 ) {
+      placement.tri_sample_dA[e] = ao_samples.sample_infos[offset].dA;
+    }
+    offset += ao_samples.tri_sample_counts[e];
+  }
+  placement.tri_sample_offsets[num_entries] = offset;
+}
+
+
+// Triangle ranges covering samples [sample_offset, sample_offset + num_samples)
+void buildSampleRanges( const SamplePlacement& placement, const size_t sample_offset, const size_t num_samples,
+                        std::vector<bake::TriangleSampleRange>& ranges )
+{
+  ranges.clear();
+  const std::vector<size_t>& offsets = placement.tri_sample_offsets;
+  const size_t num_entries = offsets.size() - 1;
+  const size_t end = sample_offset + num_samples;
+
+  size_t e = size_t( std::upper_bound( offsets.begin(), offsets.end(), sample_offset ) - offsets.begin() ) - 1;
+  size_t k = size_t( std::upper_bound( placement.instance_entry_offsets.begin(), placement.instance_entry_offsets.end(), e ) -
+                     placement.instance_entry_offsets.begin() ) - 1;
+  for ( ; e < num_entries && offsets[e] < end; ++e ) {
+    if ( offsets[e+1] == offsets[e] ) continue;  // no samples on this triangle
+    while ( placement.instance_entry_offsets[k+1] <= e ) ++k;
+    bake::TriangleSampleRange range;
+    range.instance_index = (unsigned)k;
+    range.tri_idx = (unsigned)( e - placement.instance_entry_offsets[k] );
+    range.first_sample = (unsigned)( std::max( offsets[e], sample_offset ) - sample_offset );
+    range.first_index = (unsigned)( offsets[e] < sample_offset ? sample_offset - offsets[e] : 0 );
+    range.dA = placement.tri_sample_dA[e];
+    ranges.push_back( range );
+  }
+}
+
+
+// Mesh and instance tables on one device, for generateSamplesDevice
+struct DeviceSamplerData {
+  std::vector<Buffer<unsigned char>*> buffers;  // geometry that Prime did not already put on the device
+  Buffer<bake::DeviceMesh>     meshes;
+  Buffer<bake::DeviceInstance> instances;
+
+  // Area based vertex AO accumulated on the device: vertices of the placed instances, concatenated
+  Buffer<unsigned> instance_vertex_offsets;
+  Buffer<float2>   vertex_accum;
+
+  ~DeviceSamplerData() {
+    for (size_t i = 0; i < buffers.size(); ++i) delete buffers[i];
+  }
+};
+
+// Copy to device, once per host pointer to preserve sharing between meshes
+const void* uploadOnce( const void* host_ptr, const size_t num_bytes, std::map<const void*, const void*>& uploaded, 
+                        std::vector<Buffer<unsigned char>*>& buffers )
+{
+  std::map<const void*, const void*>::const_iterator it = uploaded.find( host_ptr );
+  if ( it != uploaded.end() ) return it->second;
+  Buffer<unsigned char>* buffer = new Buffer<unsigned char>( num_bytes, RTP_BUFFER_TYPE_CUDA_LINEAR );
+  cudaMemcpy( buffer->ptr(), host_ptr, num_bytes, cudaMemcpyHostToDevice );
+  buffers.push_back( buffer );
+  uploaded[host_ptr] = buffer->ptr();
+  return buffer->ptr();
+}
+
+void createDeviceSampler( const bake::Scene& scene, const size_t num_instances, const PrimeSceneData& psd, DeviceSamplerData& sampler )
+{
+  std::map<const void*, const void*> uploaded;
+  std::vector<bake::DeviceMesh> meshes( scene.num_meshes );
+  for (size_t meshIdx = 0; meshIdx < scene.num_meshes; ++meshIdx) {
+    const bake::Mesh& mesh = scene.meshes[meshIdx];
+    bake::DeviceMesh& device_mesh = meshes[meshIdx];
+    const unsigned vertex_stride_bytes = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+    const unsigned normal_stride_bytes = mesh.normal_stride_bytes > 0 ? mesh.normal_stride_bytes : 3*sizeof(float);
+    device_mesh.vertex_stride_bytes = vertex_stride_bytes;
+    device_mesh.normal_stride_bytes = normal_stride_bytes;
+
+    // Reuse the copies made for a CUDA Prime context, if the occluders share this mesh's geometry; their positions are packed
+    if ( meshIdx < psd.mesh_vertices.size() && psd.mesh_vertices[meshIdx] &&
+         psd.mesh_host_vertices[meshIdx] == mesh.vertices && psd.mesh_host_indices[meshIdx] == mesh.tri_vertex_indices ) {
+      device_mesh.vertices           = reinterpret_cast<const float*>( psd.mesh_vertices[meshIdx] );
+      device_mesh.vertex_stride_bytes = sizeof(float3);
+      device_mesh.tri_vertex_indices = psd.mesh_indices[meshIdx];
+    } else if ( mesh.geometry_memory == bake::MEMORY_SPACE_DEVICE ) {
+      device_mesh.vertices = mesh.vertices;
+      device_mesh.tri_vertex_indices = reinterpret_cast<const int3*>( mesh.tri_vertex_indices );
+    } else {
+      device_mesh.vertices = static_cast<const float*>( 
+        uploadOnce( mesh.vertices, mesh.num_vertices*vertex_stride_bytes, uploaded, sampler.buffers ) );
+      device_mesh.tri_vertex_indices = static_cast<const int3*>( 
+        uploadOnce( mesh.tri_vertex_indices, mesh.num_triangles*sizeof(int3), uploaded, sampler.buffers ) );
+    }
+    if ( mesh.geometry_memory == bake::MEMORY_SPACE_DEVICE ) {
+      device_mesh.normals = mesh.normals;
+    } else {
+      device_mesh.normals = mesh.normals ? static_cast<const float*>( 
+          uploadOnce( mesh.normals, mesh.num_vertices*normal_stride_bytes, uploaded, sampler.buffers ) ) : NULL;
+    }
+  }
+  sampler.meshes.alloc( meshes.size(), RTP_BUFFER_TYPE_CUDA_LINEAR );
+  cudaMemcpy( sampler.meshes.ptr(), &meshes[0], sampler.meshes.sizeInBytes(), cudaMemcpyHostToDevice );
+
+  std::vector<bake::DeviceInstance> instances( num_instances );
+  for (size_t i = 0; i < num_instances; ++i) {
+    const optix::Matrix4x4 xform( scene.instances[i].xform );
+    const optix::Matrix4x4 xform_invtrans = xform.inverse().transpose();
+    std::copy( xform.getData(), xform.getData() + 12, instances[i].xform );
+    std::copy( xform_invtrans.getData(), xform_invtrans.getData() + 12, instances[i].xform_invtrans );
+    instances[i].mesh_index = scene.instances[i].mesh_index;
+  }
+  if ( num_instances > 0 ) {
+    sampler.instances.alloc( num_instances, RTP_BUFFER_TYPE_CUDA_LINEAR );
+    cudaMemcpy( sampler.instances.ptr(), &instances[0], sampler.instances.sizeInBytes(), cudaMemcpyHostToDevice );
+  }
+}
+
+// Zeroed vertex accumulators for splatVertexAODevice; vertex_offsets has an entry per placed instance, plus the total.
+void createVertexAccumulators( const std::vector<unsigned>& vertex_offsets, DeviceSamplerData& sampler )
+{
+  const size_t num_vertices = vertex_offsets.back();
+  sampler.instance_vertex_offsets.alloc( vertex_offsets.size(), RTP_BUFFER_TYPE_CUDA_LINEAR );
+  cudaMemcpy( sampler.instance_vertex_offsets.ptr(), &vertex_offsets[0], sampler.instance_vertex_offsets.sizeInBytes(), cudaMemcpyHostToDevice );
+  if ( num_vertices > 0 ) {
+    sampler.vertex_accum.alloc( num_vertices, RTP_BUFFER_TYPE_CUDA_LINEAR );
+    CHK_CUDA( cudaMemset( sampler.vertex_accum.ptr(), 0, sampler.vertex_accum.sizeInBytes() ) );
   }
-  
-  std::cerr << "\n\tsetup ...           ";  printTimeElapsed( setup_timer );
-  std::cerr << "\taccum raygen ...    ";  printTimeElapsed( raygen_timer );
-  std::cerr << "\taccum query ...     ";  printTimeElapsed( query_timer );
-  std::cerr << "\taccum update AO ... ";  printTimeElapsed( updateao_timer );
-  std::cerr << "\tcopy AO out ...     ";  printTimeElapsed( copyao_timer );
 }
 
 
+// Device time per ray first assumed by the latency governor, before it has measured any: on the slow side, so the
+// first submissions stay within budget on smaller devices
+const double LATENCY_INITIAL_RAYS_PER_MS = 50000.0;
+
+// Host sleep after each governed submission, so that other clients of the device get it in between
+const double LATENCY_YIELD_MS = 1.0;
+
+// Keeps each submission of a batch, the ray generation, query and AO update of a pass group, within a budget of device
+// time, for devices shared with interactive work.  A submission gets as many rays as the rays per millisecond
+// measured with events around the ones before allow; the host waits for it and sleeps briefly before the next.
+struct LatencyGovernor {
+  double rays_per_ms;  // kept between sample sets
+  cudaEvent_t start_event;
+  cudaEvent_t stop_event;
+  size_t num_submissions;
+  double device_ms;    // of the submissions of this sample set
+
+  LatencyGovernor() : rays_per_ms( LATENCY_INITIAL_RAYS_PER_MS ), start_event( 0 ), stop_event( 0 ), num_submissions( 0 ), device_ms( 0.0 ) {}
+  ~LatencyGovernor() {
+    if ( start_event ) cudaEventDestroy( start_event );
+    if ( stop_event ) cudaEventDestroy( stop_event );
+  }
+
+  size_t maxRays( const double budget_ms ) const { return std::max( size_t( budget_ms*rays_per_ms ), size_t(1) ); }
 
+  void begin( cudaStream_t stream ) {
+    if ( !start_event ) {
+      CHK_CUDA( cudaEventCreate( &start_event ) );
+      CHK_CUDA( cudaEventCreate( &stop_event ) );
+    }
+    CHK_CUDA( cudaEventRecord( start_event, stream ) );
+  }
+
+  // Over budget, the estimate drops to the measured rate at once; under it, it moves halfway there
+  void end( cudaStream_t stream, const size_t num_rays, const double budget_ms ) {
+    CHK_CUDA( cudaEventRecord( stop_event, stream ) );
+    CHK_CUDA( cudaEventSynchronize( stop_event ) );
+    float ms = 0.0f;
+    CHK_CUDA( cudaEventElapsedTime( &ms, start_event, stop_event ) );
+    if ( ms > 0.0f ) {
+      const double measured = double( num_rays ) / ms;
+      rays_per_ms = ms > budget_ms ? measured : 0.5*( rays_per_ms + measured );
+    }
+    num_submissions++;
+    device_ms += ms;
+    sleepMilliseconds( LATENCY_YIELD_MS );
+  }
+
+private:
+  LatencyGovernor( const LatencyGovernor& );             // forbidden
+  LatencyGovernor& operator=( const LatencyGovernor& );  // forbidden
+};
+
+
+// Everything owned by one device: its Prime context and scene, its batch slots, and timing for the report.
+struct DeviceWorker {
+  int device;
+  optix::prime::Context context;
+  PrimeSceneData psd;
+  optix::prime::Model scene_model;
+  DeviceSamplerData* sampler;  // for the sample set being traced, if placed on the device
+
+  // Opacity volume of the occluders for far field AO, if the context has one
+  Buffer<unsigned char> far_field_opacity;
+  bake::DeviceFarField  far_field;
+
+  // Batch slots and their queries, kept for later sample sets while they fit
+  std::vector<BatchSlot*> slots;
+  size_t slot_capacity;
+  size_t slot_passes_per_query;
+  bool   slot_device_sampling;
+  bool   slot_adaptive;
+  size_t slot_num_radii;
+  size_t slot_num_channels;
+  bool   slot_low_priority;  // streams at the device's lowest priority, for the latency governor
+
+  LatencyGovernor latency;
+
+  size_t max_batch_size;  // what fits on this device after the accel build
+  size_t num_batches;     // how many batches this device ended up tracing
+
+  // Adaptive sampling instrumentation: rays traced, and samples left after each pass group
+  size_t num_rays_traced;
+  size_t bytes_to_device;
+  size_t bytes_to_host;
+  std::vector<size_t> active_after_pass;
+
+  Timer setup_timer;
+  Timer accel_timer;      // part of setup spent building accels
+  Timer provide_timer;    // part of setup spent in the sample provider
+  Timer far_field_timer;  // part of setup spent voxelizing the occluders
+  Timer raygen_timer;
+  Timer query_timer;
+  Timer updateao_timer;
+  Timer copyao_timer;
+
+  DeviceWorker() : device( 0 ), sampler( NULL ), slot_capacity( 0 ), slot_passes_per_query( 0 ), slot_device_sampling( false ), 
+    slot_adaptive( false ), slot_num_radii( 0 ), slot_num_channels( 0 ), slot_low_priority( false ), max_batch_size( 0 ), num_batches( 0 ), num_rays_traced( 0 ), bytes_to_device( 0 ), bytes_to_host( 0 ) {}
+
+  ~DeviceWorker() {
+    // Prime objects are released below, on the device that owns them
+    cudaSetDevice( device );
+    releaseSlots();
+    delete sampler;
+  }
+
+  // Whether the slots we have can trace batches of this size and layout.  Host samples need the staging buffers 
+  // that device sampling skips.  Multi radius AO needs closest hit queries, the others any hit queries.
+  bool slotsFit( size_t capacity, size_t passes_per_query, bool device_sampling, bool adaptive, size_t num_radii, size_t num_channels ) const {
+    return !slots.empty() && capacity <= slot_capacity && passes_per_query == slot_passes_per_query &&
+      ( device_sampling || !slot_device_sampling ) && ( adaptive || !slot_adaptive ) && num_radii == slot_num_radii && 
+      num_channels <= slot_num_channels;
+  }
+
+  void releaseSlots() {
+    for (size_t i = 0; i < slots.size(); ++i) delete slots[i];
+    slots.clear();
+  }
+
+  // Make at least num_slots slots available, reallocating them all if the current ones don't fit
+  void reserveSlots( size_t num_slots, size_t capacity, size_t passes_per_query, bool device_sampling, bool adaptive, size_t num_radii, 
+                     size_t num_channels, bool cpu_mode, bool low_priority = false ) {
+    if ( !slotsFit( capacity, passes_per_query, device_sampling, adaptive, num_radii, num_channels ) || low_priority != slot_low_priority ) {
+      releaseSlots();
+      slot_capacity = capacity;
+      slot_passes_per_query = passes_per_query;
+      slot_device_sampling = device_sampling;
+      slot_adaptive = adaptive;
+      slot_num_radii = num_radii;
+      slot_num_channels = num_channels;
+      slot_low_priority = low_priority;
+    }
+    while ( slots.size() < num_slots ) {
+      BatchSlot* slot = new BatchSlot;
+      slot->alloc( slot_capacity, slot_passes_per_query, slot_device_sampling, slot_adaptive, slot_num_radii, slot_num_channels );
+      if ( slot_low_priority ) {
+        int least_priority = 0, greatest_priority = 0;
+        CHK_CUDA( cudaDeviceGetStreamPriorityRange( &least_priority, &greatest_priority ) );
+        CHK_CUDA( cudaStreamCreateWithPriority( &slot->stream, cudaStreamDefault, least_priority ) );
+      } else {
+        CHK_CUDA( cudaStreamCreate( &slot->stream ) );
+      }
+      slot->query = scene_model->createQuery( slot_num_radii > 0 ? RTP_QUERY_TYPE_CLOSEST : RTP_QUERY_TYPE_ANY );
+      if ( !cpu_mode ) slot->query->setCudaStream( slot->stream );
+      slots.push_back( slot );
+    }
+  }
+
+  // Per sample set counters, reported after each computeAO
+  void resetStats() {
+    num_batches = 0;
+    num_rays_traced = 0;
+    bytes_to_device = 0;
+    bytes_to_host = 0;
+    active_after_pass.clear();
+    setup_timer.reset();
+    accel_timer.reset();
+    provide_timer.reset();
+    far_field_timer.reset();
+    raygen_timer.reset();
+    query_timer.reset();
+    updateao_timer.reset();
+    copyao_timer.reset();
+    latency.num_submissions = 0;
+    latency.device_ms = 0.0;
+    for (size_t i = 0; i < slots.size(); ++i) {
+      for (int p = 0; p < NUM_GPU_PHASES; ++p) slots[i]->gpu_timers[p].elapsed = 0.0;
+    }
+  }
+
+  // Device time of a phase, over all slots
+  double gpuTime( const GpuPhase phase ) const {
+    double seconds = 0.0;
+    for (size_t i = 0; i < slots.size(); ++i) seconds += slots[i]->gpu_timers[phase].elapsed;
+    return seconds;
+  }
+};
+
+
+// Host and device times of the sample set a worker traced, printed and recorded as metrics
+void reportWorker( DeviceWorker& worker, const bool cpu_mode )
+{
+  std::cerr << "\tsetup ...           ";  printTimeElapsed( worker.setup_timer );
+  std::cerr << "\t  build accels ...  ";  printTimeElapsed( worker.accel_timer );
+  if ( worker.provide_timer.elapsed > 0.0 ) {
+    std::cerr << "\t  provide samples . ";  printTimeElapsed( worker.provide_timer );
+    recordTime( "ao.provide_samples", worker.provide_timer );
+  }
+  if ( worker.far_field_timer.elapsed > 0.0 ) {
+    std::cerr << "\t  far field ...     ";  printTimeElapsed( worker.far_field_timer );
+    recordTime( "ao.far_field_build", worker.far_field_timer );
+  }
+  std::cerr << "\taccum raygen ...    ";  printTimeElapsed( worker.raygen_timer );
+  std::cerr << "\taccum query ...     ";  printTimeElapsed( worker.query_timer );
+  std::cerr << "\taccum update AO ... ";  printTimeElapsed( worker.updateao_timer );
+  std::cerr << "\tcopy AO out ...     ";  printTimeElapsed( worker.copyao_timer );
+
+  // Host timers around async launches mostly measure the launch; these are the device's own times
+  for (int p = 0; p < NUM_GPU_PHASES; ++p) {
+    if ( p == GPU_QUERY && cpu_mode ) continue;
+    Timer gpu_timer;
+    gpu_timer.elapsed = worker.gpuTime( GpuPhase( p ) );
+    std::cerr << GPU_PHASE_LABELS[p];  printTimeElapsed( gpu_timer );
+    recordTime( GPU_PHASE_METRICS[p], gpu_timer );
+  }
+
+  recordTime( "ao.setup",     worker.setup_timer );
+  recordTime( "ao.accel_build", worker.accel_timer );
+  recordTime( "ao.raygen",    worker.raygen_timer );
+  recordTime( "ao.query",     worker.query_timer );
+  recordTime( "ao.update_ao", worker.updateao_timer );
+  recordTime( "ao.copy_ao",   worker.copyao_timer );
+  if ( worker.latency.num_submissions > 0 ) {
+    std::cerr << "\tlatency governor .. " << worker.latency.num_submissions << " submissions, " << std::fixed << std::setprecision( 2 )
+              << worker.latency.device_ms / worker.latency.num_submissions << " ms on average, " << std::setprecision( 0 )
+              << worker.latency.rays_per_ms << " rays/ms\n";
+    recordCount( "ao.latency_submissions", worker.latency.num_submissions );
+  }
+  recordCount( "ao.batches",  worker.num_batches );
+  recordCount( "ao.rays",     worker.num_rays_traced );
+  recordCount( "ao.bytes_to_device", worker.bytes_to_device );
+  recordCount( "ao.bytes_to_host",   worker.bytes_to_host );
+
+  std::vector<std::string> kernel_names;
+  std::vector<int> block_sizes;
+  bake::kernelLaunchConfigs( worker.device, kernel_names, block_sizes );
+  for (size_t k = 0; k < kernel_names.size(); ++k) {
+    std::ostringstream name;
+    name << "kernel." << kernel_names[k] << ".device" << worker.device << ".block_size";
+    recordGauge( name.str().c_str(), block_sizes[k] );
+  }
+}
+
+
+} // end namespace
+
+
+namespace bake {
+
+// Prime scenes of the occluders, one per device, shared by all sample sets traced against them
+struct PrimeAOContext {
+  bool cpu_mode;
+  int  caller_device;
+  bool conserve_memory;     // builder settings, for meshes built after the context
+  bake::AccelPreset accel_preset;
+  bool managed_geometry;
+  DeviceGroundPlane ground_plane;  // axis < 0 if none
+  std::vector<DeviceWorker*> workers;
+
+  // Finished batches go to files in this directory, and are restored from there, when set
+  std::string checkpoint_dir;
+  uint64_t    checkpoint_hash;
+
+  // Batch slots per device, i.e. queries in flight at once
+  size_t      batch_slots;
+
+  // Device time per submission the latency governor keeps to, in milliseconds; 0 if off
+  double      latency_budget_ms;
+
+  // Rays are traced this fraction of their length, and the rest cone-marched through the workers' far field
+  // volumes; 0 if off
+  float       far_field_fraction;
+};
+
+}
+
+
+namespace {
+
+// Prime contexts created ahead of the AO contexts that take them, with the CUDA context of their device
+struct PreparedContext {
+  int device;
+  RTPcontexttype type;
+  optix::prime::Context context;
+};
+
+struct PreparedContexts {
+  std::vector<PreparedContext> contexts;
+  Mutex mutex;
+};
+
+PreparedContexts& preparedContexts()
+{
+  static PreparedContexts prepared;
+  return prepared;
+}
+
+// A prepared context of the device, or a new one
+optix::prime::Context takeContext( const int device, const RTPcontexttype type )
+{
+  PreparedContexts& prepared = preparedContexts();
+  {
+    ScopedLock lock( prepared.mutex );
+    for (size_t i = 0; i < prepared.contexts.size(); ++i) {
+      if ( prepared.contexts[i].device == device && prepared.contexts[i].type == type ) {
+        optix::prime::Context context = prepared.contexts[i].context;
+        prepared.contexts.erase( prepared.contexts.begin() + i );
+        return context;
+      }
+    }
+  }
+  optix::prime::Context context = optix::prime::Context::create( type );
+  if ( type == RTP_CONTEXT_TYPE_CUDA ) {
+    const unsigned device_number = static_cast<unsigned>( device );
+    context->setCudaDeviceNumbers( 1, &device_number );
+  }
+  return context;
+}
+
+// The mesh library of a device, with its CUDA context, made the first time a context of the device asks
+DeviceMeshLibrary* deviceMeshLibrary( const int device )
+{
+  MeshLibrary& library = meshLibrary();
+  ScopedLock lock( library.mutex );
+  for (size_t i = 0; i < library.devices.size(); ++i) {
+    if ( library.devices[i]->device == device ) return library.devices[i];
+  }
+  DeviceMeshLibrary* device_library = new DeviceMeshLibrary;
+  device_library->device = device;
+  device_library->context = takeContext( device, RTP_CONTEXT_TYPE_CUDA );
+  library.devices.push_back( device_library );
+  return device_library;
+}
+
+// Devices a context traces on.  A CPU context traces on the host, so it only needs the caller's device for ray generation.
+std::vector<int> contextDevices( const bool cpu_mode, const int caller_device, const int* requested_devices, const size_t num_requested_devices )
+{
+  std::vector<int> devices;
+  if ( cpu_mode ) {
+    devices.push_back( caller_device );
+  } else if ( num_requested_devices > 0 ) {
+    devices.assign( requested_devices, requested_devices + num_requested_devices );
+  } else {
+    int device_count = 0;
+    CHK_CUDA( cudaGetDeviceCount( &device_count ) );
+    for (int i = 0; i < device_count; ++i) devices.push_back( i );
+  }
+  return devices;
+}
+
+// Lets every device of the context read the memory of every other one.  False, with nothing changed that matters,
+// if some pair of them can't, e.g. GPUs without NVLink or a PCIe switch between them.
+bool enablePeerAccess( const std::vector<DeviceWorker*>& workers )
+{
+  for (size_t a = 0; a < workers.size(); ++a) {
+    for (size_t b = 0; b < workers.size(); ++b) {
+      int can_access = 0;
+      if ( a == b ) continue;
+      CHK_CUDA( cudaDeviceCanAccessPeer( &can_access, workers[a]->device, workers[b]->device ) );
+      if ( !can_access ) {
+        std::cerr << "Device " << workers[a]->device << " can't read the memory of device " << workers[b]->device 
+                  << ", copying the geometry to every device" << std::endl;
+        return false;
+      }
+    }
+  }
+  for (size_t a = 0; a < workers.size(); ++a) {
+    CHK_CUDA( cudaSetDevice( workers[a]->device ) );
+    for (size_t b = 0; b < workers.size(); ++b) {
+      if ( a == b ) continue;
+      const cudaError_t result = cudaDeviceEnablePeerAccess( workers[b]->device, 0 );
+      if ( result == cudaErrorPeerAccessAlreadyEnabled ) {
+        cudaGetLastError();  // not an error for us; clear it
+      } else {
+        CHK_CUDA( result );
+      }
+    }
+  }
+  return true;
+}
+
+// Upload each unique mesh's vertices and indices to one device of the context: the one with the fewest bytes so
+// far, so the geometry is spread evenly over the devices whatever the mesh sizes.  Buffers shared between meshes
+// stay shared, and identical meshes reuse the buffers of the first.
+void createPeerGeometry( const bake::Scene& occluders, const std::vector<DeviceWorker*>& workers, const bool managed, PeerGeometry& peer )
+{
+  const size_t num_meshes = occluders.num_meshes;
+  const size_t num_devices = workers.size();
+  std::vector<size_t> source_mesh;
+  findSourceMeshes( occluders.meshes, num_meshes, source_mesh );
+
+  // Owner of each buffer, by host pointer; each device uploads its own in parallel below
+  std::map<const void*, size_t> vertex_owner, index_owner;
+  std::vector< std::vector<size_t> > owned_vertices( num_devices ), owned_indices( num_devices );
+  std::vector<size_t> device_bytes( num_devices, 0 );
+  for (size_t meshIdx = 0; meshIdx < num_meshes; ++meshIdx) {
+    if ( source_mesh[meshIdx] != meshIdx ) continue;
+    const bake::Mesh& mesh = occluders.meshes[meshIdx];
+    const size_t owner = std::min_element( device_bytes.begin(), device_bytes.end() ) - device_bytes.begin();
+    if ( vertex_owner.insert( std::make_pair( (const void*)mesh.vertices, owner ) ).second ) {
+      owned_vertices[owner].push_back( meshIdx );
+      device_bytes[owner] += mesh.num_vertices*sizeof(float3);
+    }
+    if ( index_owner.insert( std::make_pair( (const void*)mesh.tri_vertex_indices, owner ) ).second ) {
+      owned_indices[owner].push_back( meshIdx );
+      device_bytes[owner] += mesh.num_triangles*sizeof(int3);
+    }
+  }
+
+  std::vector< std::map<const void*, const void*> > uploaded( num_devices );
+#pragma omp parallel for num_threads( (int)num_devices ) schedule( static, 1 )
+  for (ptrdiff_t d = 0; d < ptrdiff_t(num_devices); ++d) {
+    DeviceWorker& worker = *workers[d];
+    CHK_CUDA( cudaSetDevice( worker.device ) );
+    size_t free_bytes = 0, total_bytes = 0;
+    CHK_CUDA( cudaMemGetInfo( &free_bytes, &total_bytes ) );
+    std::vector<float> packed_vertices;
+    for (size_t k = 0; k < owned_vertices[d].size(); ++k) {
+      const bake::Mesh& mesh = occluders.meshes[owned_vertices[d][k]];
+      const float* vertices = mesh.vertices;
+      if ( !packedMeshVertices( mesh ) ) {
+        packed_vertices.resize( 3*mesh.num_vertices );
+        packMeshVertices( mesh, &packed_vertices[0] );
+        vertices = &packed_vertices[0];
+      }
+      Buffer<float3>* vertex_buffer = uploadGeometry<float3>( vertices, mesh.num_vertices, managed, 0, worker.psd );
+      worker.psd.vertex_buffers.push_back( vertex_buffer );
+      CHK_CUDA( cudaStreamSynchronize( 0 ) );
+      uploaded[d][mesh.vertices] = vertex_buffer->ptr();
+    }
+    for (size_t k = 0; k < owned_indices[d].size(); ++k) {
+      const bake::Mesh& mesh = occluders.meshes[owned_indices[d][k]];
+      Buffer<int3>* index_buffer = uploadGeometry<int3>( mesh.tri_vertex_indices, mesh.num_triangles, managed, 0, worker.psd );
+      worker.psd.index_buffers.push_back( index_buffer );
+      uploaded[d][mesh.tri_vertex_indices] = index_buffer->ptr();
+    }
+    CHK_CUDA( cudaStreamSynchronize( 0 ) );
+    countOversubscription( worker.psd, free_bytes );
+  }
+
+  peer.mesh_vertices.resize( num_meshes );
+  peer.mesh_indices.resize( num_meshes );
+  for (size_t meshIdx = 0; meshIdx < num_meshes; ++meshIdx) {
+    const bake::Mesh& mesh = occluders.meshes[source_mesh[meshIdx]];
+    peer.mesh_vertices[meshIdx] = static_cast<const float3*>( uploaded[vertex_owner[mesh.vertices]][mesh.vertices] );
+    peer.mesh_indices[meshIdx] = static_cast<const int3*>( uploaded[index_owner[mesh.tri_vertex_indices]][mesh.tri_vertex_indices] );
+  }
+
+  size_t total_bytes = 0;
+  for (size_t d = 0; d < num_devices; ++d) total_bytes += device_bytes[d];
+  std::cerr << "Peer geometry: " << total_bytes / (1024*1024) << " MB over " << num_devices << " devices, at most " 
+            << *std::max_element( device_bytes.begin(), device_bytes.end() ) / (1024*1024) << " MB on one" << std::endl;
+}
+
+// True if no mesh of the samples has normals, so every sample's normal is its face normal and rays can be generated
+// from one normal per sample
+bool flatSampleNormals( const bake::Scene& scene )
+{
+  for (size_t i = 0; i < scene.num_instances; ++i) {
+    if ( scene.meshes[scene.instances[i].mesh_index].normals ) return false;
+  }
+  return true;
+}
+
+} // end namespace
+
+
+void bake::ao_optix_prime_prepare_devices( const bool cpu_mode, const int* requested_devices, const size_t num_requested_devices )
+{
+  int caller_device = 0;
+  if ( cudaGetDevice( &caller_device ) != cudaSuccess ) return;
+  const std::vector<int> devices = contextDevices( cpu_mode, caller_device, requested_devices, num_requested_devices );
+  const ptrdiff_t num_devices = static_cast<ptrdiff_t>( devices.size() );
+  const RTPcontexttype context_type = cpu_mode ? RTP_CONTEXT_TYPE_CPU : RTP_CONTEXT_TYPE_CUDA;
+  PreparedContexts& prepared = preparedContexts();
+
+  // Best effort: a device that fails here fails again, with a message, when an AO context is created for it
+#pragma omp parallel for num_threads( (int)std::max( num_devices, ptrdiff_t(1) ) ) schedule( static, 1 )
+  for (ptrdiff_t d = 0; d < num_devices; ++d) {
+    if ( cudaSetDevice( devices[d] ) != cudaSuccess || cudaFree( 0 ) != cudaSuccess ) continue;
+    {
+      ScopedLock lock( prepared.mutex );
+      bool found = false;
+      for (size_t i = 0; i < prepared.contexts.size() && !found; ++i) {
+        found = prepared.contexts[i].device == devices[d] && prepared.contexts[i].type == context_type;
+      }
+      if ( found ) continue;
+    }
+    PreparedContext context;
+    context.device = devices[d];
+    context.type = context_type;
+    try {
+      context.context = takeContext( devices[d], context_type );
+    } catch ( const optix::prime::Exception& ) {
+      continue;
+    }
+    ScopedLock lock( prepared.mutex );
+    prepared.contexts.push_back( context );
+  }
+  cudaSetDevice( caller_device );
+}
+
+
+void bake::ao_optix_prime_release_prepared_devices()
+{
+  PreparedContexts& prepared = preparedContexts();
+  ScopedLock lock( prepared.mutex );
+  prepared.contexts.clear();
+}
+
+
+void bake::ao_optix_prime_set_mesh_library_budget( const size_t device_bytes )
+{
+  MeshLibrary& library = meshLibrary();
+  int caller_device = 0;
+  ScopedLock lock( library.mutex );
+  library.budget_bytes = device_bytes;
+  if ( library.devices.empty() || cudaGetDevice( &caller_device ) != cudaSuccess ) return;
+
+  // Libraries left empty go, with their contexts; those with meshes in use stay until a later call
+  std::vector<DeviceMeshLibrary*> kept;
+  for (size_t i = 0; i < library.devices.size(); ++i) {
+    DeviceMeshLibrary* device_library = library.devices[i];
+    CHK_CUDA( cudaSetDevice( device_library->device ) );
+    bool empty = false;
+    {
+      ScopedLock device_lock( device_library->mutex );
+      trimMeshLibrary( *device_library, device_bytes );
+      empty = device_library->meshes.empty();
+    }
+    if ( empty && device_bytes == 0 ) {
+      delete device_library;
+    } else {
+      kept.push_back( device_library );
+    }
+  }
+  library.devices.swap( kept );
+  trimDevicePool();
+  CHK_CUDA( cudaSetDevice( caller_device ) );
+}
+
+
+bake::PrimeAOContext* bake::ao_optix_prime_create_context(
+    const Scene& occluders,
+    const bool   cpu_mode,
+    const bool   conserve_memory,
+    const int*   requested_devices,
+    const size_t num_requested_devices,
+    const AccelPreset accel_preset,
+    const GroundPlane* ground_plane,
+    const bool   peer_geometry,
+    const bool   managed_geometry
+    )
+{
+  PrimeAOContext* ctx = new PrimeAOContext;
+  ctx->cpu_mode = cpu_mode;
+  ctx->conserve_memory = conserve_memory;
+  ctx->accel_preset = accel_preset;
+  ctx->managed_geometry = managed_geometry;
+  ctx->checkpoint_hash = 0;
+  ctx->batch_slots = DEFAULT_BATCH_SLOTS;
+  ctx->latency_budget_ms = 0.0;
+  ctx->far_field_fraction = 0.0f;
+  ctx->ground_plane.axis = ground_plane ? ground_plane->axis : -1;
+  if ( ground_plane ) {
+    ctx->ground_plane.bbox_min = make_float3( ground_plane->bbox_min[0], ground_plane->bbox_min[1], ground_plane->bbox_min[2] );
+    ctx->ground_plane.bbox_max = make_float3( ground_plane->bbox_max[0], ground_plane->bbox_max[1], ground_plane->bbox_max[2] );
+  }
+  CHK_CUDA( cudaGetDevice( &ctx->caller_device ) );
+
+  // Devices to spread batches over
+  const std::vector<int> devices = contextDevices( cpu_mode, ctx->caller_device, requested_devices, num_requested_devices );
+  const ptrdiff_t num_devices = static_cast<ptrdiff_t>( devices.size() );
+
+  const RTPcontexttype context_type = cpu_mode ? RTP_CONTEXT_TYPE_CPU : RTP_CONTEXT_TYPE_CUDA;
+
+  std::vector<DeviceWorker*>& workers = ctx->workers;
+  workers.resize( num_devices );
+  for (ptrdiff_t d = 0; d < num_devices; ++d) {
+    workers[d] = new DeviceWorker;
+    workers[d]->device = devices[d];
+  }
+
+  // Geometry spread over the devices, for the accels of all of them to be built over
+  PeerGeometry peer;
+  // Caller owned device geometry is read in place by all devices instead
+  const bool share_geometry = peer_geometry && !cpu_mode && num_devices > 1 && !hasDeviceGeometry( occluders ) && 
+                              enablePeerAccess( workers );
+  if ( share_geometry ) {
+    createPeerGeometry( occluders, workers, managed_geometry, peer );
+  }
+
+  // Meshes of earlier contexts are kept in the library, if there is one, for device copies of the geometry
+  const bool use_library = meshLibrary().budget_bytes > 0 && !cpu_mode && !share_geometry && !managed_geometry;
+
+  // Build the scene on every device in parallel.  The build counts as setup time of the first computeAO.
+#pragma omp parallel for num_threads( (int)num_devices ) schedule( static, 1 )
+  for (ptrdiff_t d = 0; d < num_devices; ++d) {
+    DeviceWorker& worker = *workers[d];
+    CHK_CUDA( cudaSetDevice( worker.device ) );
+    worker.setup_timer.start();
+    ProfileRange range( "build accels", PROFILE_COLOR_ACCEL, uint64_t( worker.device ) );
+
+    // Prepared while the scene loaded, if the caller asked for it, or the library's
+    DeviceMeshLibrary* library = use_library ? deviceMeshLibrary( worker.device ) : NULL;
+    worker.context = library ? library->context : takeContext( worker.device, context_type );
+    worker.accel_timer.start();
+    if ( library ) {
+      ScopedLock lock( library->mutex );
+      worker.scene_model = createPrimeScene( worker.context, context_type, occluders.meshes, occluders.num_meshes, occluders.instances, 
+        occluders.num_instances, conserve_memory, accel_preset, NULL, false, library, worker.psd );
+    } else {
+      worker.scene_model = createPrimeScene( worker.context, context_type, occluders.meshes, occluders.num_meshes, occluders.instances, 
+        occluders.num_instances, conserve_memory, accel_preset, share_geometry ? &peer : NULL, managed_geometry, NULL, worker.psd );
+    }
+    worker.accel_timer.stop();
+
+    worker.setup_timer.stop();
+  }
+
+  // Geometry in unified memory, and how much of it is left to demand paging
+  if ( managed_geometry && !cpu_mode ) {
+    size_t managed_bytes = 0, oversubscribed_bytes = 0;
+    for (ptrdiff_t d = 0; d < num_devices; ++d) {
+      managed_bytes += workers[d]->psd.managed_bytes;
+      oversubscribed_bytes += workers[d]->psd.oversubscribed_bytes;
+    }
+    recordCount( "ao.managed_geometry_bytes", managed_bytes );
+    recordCount( "ao.oversubscribed_geometry_bytes", oversubscribed_bytes );
+    if ( oversubscribed_bytes > 0 ) {
+      std::cerr << "Managed geometry: " << oversubscribed_bytes / (1024*1024) << " of " << managed_bytes / (1024*1024) 
+                << " MB didn't fit in device memory and are paged in by the queries" << std::endl;
+    }
+  }
+
+  CHK_CUDA( cudaSetDevice( ctx->caller_device ) );
+  return ctx;
+}
+
+
+void bake::ao_optix_prime_set_occluders( PrimeAOContext* ctx, const Scene& occluders )
+{
+  // New mesh models go under the scene model the context has, so the queries of kept batch slots stay valid, and the
+  // old ones are released once the top level no longer refers to them.  Peer geometry isn't kept: each device gets
+  // a copy.  Like the initial build, this counts as setup time of the next computeAO.
+  std::vector<DeviceWorker*>& workers = ctx->workers;
+  const ptrdiff_t num_devices = static_cast<ptrdiff_t>( workers.size() );
+  const RTPcontexttype context_type = ctx->cpu_mode ? RTP_CONTEXT_TYPE_CPU : RTP_CONTEXT_TYPE_CUDA;
+#pragma omp parallel for num_threads( (int)num_devices ) schedule( static, 1 )
+  for (ptrdiff_t d = 0; d < num_devices; ++d) {
+    DeviceWorker& worker = *workers[d];
+    CHK_CUDA( cudaSetDevice( worker.device ) );
+    worker.setup_timer.start();
+    ProfileRange range( "set occluders", PROFILE_COLOR_ACCEL, uint64_t( worker.device ) );
+    worker.accel_timer.start();
+    PrimeSceneData psd;
+    DeviceMeshLibrary* library = worker.psd.library;
+    if ( library ) {
+      ScopedLock lock( library->mutex );
+      buildPrimeMeshes( worker.context, context_type, occluders.meshes, occluders.num_meshes, ctx->conserve_memory, ctx->accel_preset, 
+        NULL, false, library, psd );
+    } else {
+      buildPrimeMeshes( worker.context, context_type, occluders.meshes, occluders.num_meshes, ctx->conserve_memory, ctx->accel_preset, 
+        NULL, ctx->managed_geometry, NULL, psd );
+    }
+    setPrimeInstances( worker.scene_model, psd, occluders.instances, occluders.num_instances );
+    worker.psd.swap( psd );
+    worker.accel_timer.stop();
+    worker.setup_timer.stop();
+  }
+  CHK_CUDA( cudaSetDevice( ctx->caller_device ) );
+}
+
+
+void bake::ao_optix_prime_update_instances( PrimeAOContext* ctx, const Instance* instances, const size_t num_instances )
+{
+  // Only the top level is rebuilt; the model keeps its identity, so the queries of kept batch slots stay valid.
+  // Like the initial build, this counts as setup time of the next computeAO.
+  std::vector<DeviceWorker*>& workers = ctx->workers;
+  const ptrdiff_t num_devices = static_cast<ptrdiff_t>( workers.size() );
+#pragma omp parallel for num_threads( (int)num_devices ) schedule( static, 1 )
+  for (ptrdiff_t d = 0; d < num_devices; ++d) {
+    DeviceWorker& worker = *workers[d];
+    CHK_CUDA( cudaSetDevice( worker.device ) );
+    worker.setup_timer.start();
+    ProfileRange range( "update instances", PROFILE_COLOR_ACCEL, uint64_t( worker.device ) );
+    setPrimeInstances( worker.scene_model, worker.psd, instances, num_instances );
+    worker.setup_timer.stop();
+  }
+  CHK_CUDA( cudaSetDevice( ctx->caller_device ) );
+}
+
+
+void bake::ao_optix_prime_set_checkpoint( PrimeAOContext* ctx, const char* checkpoint_dir, const uint64_t bake_hash )
+{
+  ctx->checkpoint_dir = checkpoint_dir ? checkpoint_dir : "";
+  ctx->checkpoint_hash = bake_hash;
+}
+
+
+void bake::ao_optix_prime_set_queries_in_flight( PrimeAOContext* ctx, const size_t num_queries )
+{
+  ctx->batch_slots = num_queries > 0 ? std::min( num_queries, MAX_QUERIES_IN_FLIGHT ) : DEFAULT_BATCH_SLOTS;
+}
+
+
+void bake::ao_optix_prime_set_latency_budget( PrimeAOContext* ctx, const double milliseconds )
+{
+  ctx->latency_budget_ms = std::max( milliseconds, 0.0 );
+}
+
+
+void bake::ao_optix_prime_set_far_field( PrimeAOContext* ctx, const Scene& occluders, const float near_fraction, const int resolution )
+{
+  std::vector<DeviceWorker*>& workers = ctx->workers;
+  const ptrdiff_t num_devices = static_cast<ptrdiff_t>( workers.size() );
+  ctx->far_field_fraction = near_fraction > 0.0f && near_fraction < 1.0f && occluders.num_instances > 0 ? near_fraction : 0.0f;
+  if ( ctx->far_field_fraction == 0.0f ) {
+    for (ptrdiff_t d = 0; d < num_devices; ++d) {
+      CHK_CUDA( cudaSetDevice( workers[d]->device ) );
+      workers[d]->far_field_opacity.free();
+    }
+    CHK_CUDA( cudaSetDevice( ctx->caller_device ) );
+    return;
+  }
+
+  // A cube around the instances, with a voxel of margin, at a power of two resolution for the mip levels
+  float bbox_min[3], bbox_max[3];
+  for (int k = 0; k < 3; ++k) {
+    bbox_min[k] = occluders.instances[0].bbox_min[k];
+    bbox_max[k] = occluders.instances[0].bbox_max[k];
+  }
+  for (size_t i = 1; i < occluders.num_instances; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      bbox_min[k] = std::min( bbox_min[k], occluders.instances[i].bbox_min[k] );
+      bbox_max[k] = std::max( bbox_max[k], occluders.instances[i].bbox_max[k] );
+    }
+  }
+  int res = MIN_FAR_FIELD_RESOLUTION;
+  while ( res < resolution && res < MAX_FAR_FIELD_RESOLUTION ) res *= 2;
+  const float extent = std::max( std::max( bbox_max[0] - bbox_min[0], bbox_max[1] - bbox_min[1] ), 
+                                 std::max( bbox_max[2] - bbox_min[2], 1.0e-6f ) );
+  DeviceFarField volume;
+  volume.voxel_size = extent / float( res - 2 );
+  volume.origin = make_float3( bbox_min[0] - volume.voxel_size, bbox_min[1] - volume.voxel_size, bbox_min[2] - volume.voxel_size );
+  volume.resolution = res;
+  volume.num_levels = 0;
+  size_t num_voxels = 0;
+  for (int level_res = res; level_res > 0 && volume.num_levels < MAX_FAR_FIELD_LEVELS; level_res /= 2) {
+    volume.level_offsets[volume.num_levels++] = num_voxels;
+    num_voxels += size_t( level_res )*level_res*level_res;
+  }
+
+  // Instances by mesh, to voxelize each mesh's instances in one launch
+  std::vector<std::vector<unsigned> > mesh_instances( occluders.num_meshes );
+  for (size_t i = 0; i < occluders.num_instances; ++i) {
+    mesh_instances[occluders.instances[i].mesh_index].push_back( unsigned( i ) );
+  }
+
+  // Every device voxelizes its own copy, like it builds its own accel
+#pragma omp parallel for num_threads( (int)num_devices ) schedule( static, 1 )
+  for (ptrdiff_t d = 0; d < num_devices; ++d) {
+    DeviceWorker& worker = *workers[d];
+    CHK_CUDA( cudaSetDevice( worker.device ) );
+    worker.setup_timer.start();
+    worker.far_field_timer.start();
+    ProfileRange range( "voxelize far field", PROFILE_COLOR_ACCEL, uint64_t( worker.device ) );
+    DeviceSamplerData geometry;
+    createDeviceSampler( occluders, occluders.num_instances, worker.psd, geometry );
+    worker.far_field_opacity.alloc( num_voxels, RTP_BUFFER_TYPE_CUDA_LINEAR );
+    worker.far_field = volume;
+    worker.far_field.opacity = worker.far_field_opacity.ptr();
+    CHK_CUDA( cudaMemset( worker.far_field.opacity, 0, size_t( res )*res*res ) );
+    for (size_t m = 0; m < occluders.num_meshes; ++m) {
+      if ( mesh_instances[m].empty() ) continue;
+      Buffer<unsigned> instance_list( mesh_instances[m].size(), RTP_BUFFER_TYPE_CUDA_LINEAR );
+      cudaMemcpy( instance_list.ptr(), &mesh_instances[m][0], instance_list.sizeInBytes(), cudaMemcpyHostToDevice );
+      voxelizeFarFieldDevice( occluders.meshes[m].num_triangles, mesh_instances[m].size(), instance_list.ptr(), geometry.instances.ptr(), 
+                              geometry.meshes.ptr(), worker.far_field );
+      CHK_CUDA( cudaDeviceSynchronize() );
+    }
+    buildFarFieldMipsDevice( worker.far_field );
+    CHK_CUDA( cudaDeviceSynchronize() );
+    worker.far_field_timer.stop();
+    worker.setup_timer.stop();
+  }
+  recordGauge( "ao.far_field_bytes", double( num_voxels ) );
+  CHK_CUDA( cudaSetDevice( ctx->caller_device ) );
+}
+
+
+size_t bake::batchBytesPerSample( const int passes_per_query, const bool adaptive, const size_t num_channels, const size_t num_radii, 
+                                  const size_t queries_in_flight )
+{
+  const size_t passes = size_t( passes_per_query > 0 ? passes_per_query : DEFAULT_PASSES_PER_QUERY );
+  const size_t num_slots = queries_in_flight > 0 ? std::min( queries_in_flight, MAX_QUERIES_IN_FLIGHT ) : DEFAULT_BATCH_SLOTS;
+  return num_slots * bytesPerBatchSample( passes, adaptive, num_radii, num_radii > 0 ? num_radii : num_channels );
+}
+
+
+void bake::ao_optix_prime_destroy_context( PrimeAOContext* ctx )
+{
+  if ( !ctx ) return;
+  for (size_t d = 0; d < ctx->workers.size(); ++d) {
+    delete ctx->workers[d];
+  }
+  trimDevicePool();
+  CHK_CUDA( cudaSetDevice( ctx->caller_device ) );
+  delete ctx;
+}
+
+
+void bake::ao_optix_prime(
+    PrimeAOContext* ctx,
+    const Scene& scene,
+    const bake::AOSamples& ao_samples,
+    const int rays_per_sample,
+    const float  scene_offset,
+    const float  scene_maxdistance,
+    const size_t requested_batch_size,
+    const int    requested_passes_per_query,
+    const float  adaptive_tolerance,
+    float* ao_values,
+    float** vertex_ao,
+    const float* radii,
+    const size_t num_radii,
+    const bool   two_sided,
+    BatchCursor* shared_batches,
+    const OpenDirections open_directions,
+    AOSampleProvider sample_provider,
+    void* provider_data,
+    AOBatchCallback batch_callback,
+    void* batch_data,
+    const unsigned vertex_ao_bits,
+    unsigned char* packed_vertex_ao
+    )
+{
+  Timer trace_timer;
+  trace_timer.start();
+  ProfileRange range( "trace samples", PROFILE_COLOR_TRACE, uint64_t( ao_samples.num_samples ) );
+
+  const bool cpu_mode = ctx->cpu_mode;
+  std::vector<DeviceWorker*>& workers = ctx->workers;
+  const ptrdiff_t num_devices = static_cast<ptrdiff_t>( workers.size() );
+
+  // Without host positions and normals, samples are placed on the device from the per-triangle counts, unless a 
+  // provider makes them on the host batch by batch
+  const bool provided_samples = sample_provider != NULL;
+  assert( !provided_samples || ( ao_samples.sample_positions == NULL && ao_samples.sample_memory == MEMORY_SPACE_HOST ) );
+  const bool device_sampling = !provided_samples && ao_samples.sample_positions == NULL;
+
+  // Samples the caller has in device memory are packed into the device layout where they are
+  const bool device_samples = !device_sampling && ao_samples.sample_memory == MEMORY_SPACE_DEVICE;
+  const int samples_device = device_samples ? pointerDevice( ao_samples.sample_positions ) : -1;
+
+  // Host samples with their instances are uploaded as locations and rebuilt on the device, for half the bytes
+  const bool reconstructed_samples = !device_sampling && !device_samples && !provided_samples && !cpu_mode && 
+                                     ao_samples.sample_instances && ( ao_samples.sample_infos || ao_samples.compact_sample_infos );
+  if ( reconstructed_samples ) recordCount( "ao.reconstructed_samples", ao_samples.num_samples );
+  assert( !device_sampling || ao_samples.tri_sample_counts );
+  SamplePlacement placement;
+  if ( device_sampling ) {
+    createSamplePlacement( scene, ao_samples, placement );
+  }
+
+  // Vertex AO is splatted on the device as batches finish, so per-sample AO only goes back if asked for
+  const bool splat_vertices = vertex_ao != NULL || packed_vertex_ao != NULL;
+  assert( !packed_vertex_ao || vertex_ao_bits == 8 || vertex_ao_bits == 16 );
+  assert( !splat_vertices || device_sampling );
+  assert( ao_values || splat_vertices || batch_callback );
+  std::vector<unsigned> vertex_offsets;
+  if ( splat_vertices ) {
+    vertex_offsets.push_back( 0 );
+    for (size_t i = 0; i < placement.num_instances; ++i) {
+      vertex_offsets.push_back( vertex_offsets.back() + (unsigned)scene.meshes[scene.instances[i].mesh_index].num_vertices );
+    }
+  }
+
+  // One ray per sample per pass; Sobol directions work for any ray count
+  const int num_passes = std::max( rays_per_sample, 1 );
+  const bool flat_normals = flatSampleNormals( scene );
+
+  // Several passes can be traced by one query, which means fewer kernel launches and larger queries 
+  // for Prime, at the cost of a ray and hit buffer per pass.  Small batches would otherwise be dominated 
+  // by the host overhead of launching raygen, query and update once per pass group, so they get enough 
+  // passes per query for MIN_RAYS_PER_QUERY rays.  Adaptive sampling keeps the default, so that samples
+  // can retire between pass groups.
+  const size_t samples_per_batch = requested_batch_size > 0 ? std::min( requested_batch_size, ao_samples.num_samples ) : ao_samples.num_samples;
+  int default_passes_per_query = DEFAULT_PASSES_PER_QUERY;
+  if ( adaptive_tolerance <= 0.0f && samples_per_batch > 0 ) {
+    default_passes_per_query = (int)std::min( std::max( idivCeil( MIN_RAYS_PER_QUERY, samples_per_batch ), size_t( default_passes_per_query ) ), 
+                                              size_t( num_passes ) );
+  }
+  const int passes_per_query = std::max( 1, std::min( requested_passes_per_query > 0 ? requested_passes_per_query : default_passes_per_query, num_passes ) );
+
+  // Pipeline batches through a few stream-bound slots, whose queries trace at the same time when one batch can't fill 
+  // the device.  A CPU context executes queries on the host, so there is nothing to overlap there and one synchronous
+  // slot is enough.  So is one for the latency governor, which waits for each submission anyway.
+  const bool governed = !cpu_mode && ctx->latency_budget_ms > 0.0;
+  const double latency_budget_ms = ctx->latency_budget_ms;
+  const size_t max_batch_slots = cpu_mode || governed ? 1 : ctx->batch_slots;
+
+  // Multi radius AO bins closest hit distances of forward rays, for all samples of the batch
+  const bool multi_radius = num_radii > 0;
+  assert( !multi_radius || ( ao_values && !splat_vertices && ctx->ground_plane.axis < 0 ) );
+  assert( num_radii <= size_t( MAX_DEVICE_AO_RADII ) );
+  DeviceAORadii device_radii;
+  device_radii.count = (int)num_radii;
+  for (size_t r = 0; r < num_radii; ++r) device_radii.radii[r] = radii[r];
+
+  // Two-sided AO traces every batch a second time with flipped normals, into a second channel
+  assert( !two_sided || ( ao_values && !splat_vertices && !multi_radius ) );
+  const int num_sides = two_sided ? 2 : 1;
+
+  // Bent normals or SH visibility are summed from the open rays of each query in three channels after the AO
+  const bool bent_normals = open_directions != OPEN_DIRECTIONS_NONE;
+  assert( !bent_normals || ( ao_values && !splat_vertices && !multi_radius && !two_sided ) );
+  const size_t num_ao_channels = multi_radius ? num_radii : size_t( num_sides );
+  const size_t num_channels = num_ao_channels + ( bent_normals ? 3 : 0 );
+
+  // With a far field volume, rays are traced to the near radius only, and the rest of each ray that hit nothing is 
+  // cone-marched through the volume.  Multi radius AO and bent normals need every ray traced in full.
+  float far_field_near = scene_maxdistance;
+  if ( ctx->far_field_fraction > 0.0f && !multi_radius && !bent_normals && !ctx->workers.empty() ) {
+    far_field_near = std::max( ctx->far_field_fraction*scene_maxdistance, MIN_FAR_FIELD_NEAR_VOXELS*ctx->workers[0]->far_field.voxel_size );
+  }
+  const bool far_field = far_field_near > scene_offset && far_field_near < scene_maxdistance;
+  const float ray_maxdistance = far_field ? far_field_near : scene_maxdistance;
+
+  // Adaptive sampling retires samples whose AO estimate has converged, after each pass group
+  const bool adaptive = adaptive_tolerance > 0.0f && num_passes > ADAPTIVE_MIN_RAYS && !multi_radius && !two_sided && !bent_normals;
+  const unsigned query_hint = cpu_mode ? RTP_QUERY_HINT_NONE : RTP_QUERY_HINT_ASYNC;
+
+  // AO goes straight from the device into device or pinned memory of the caller, and only pageable memory needs the 
+  // staging copy.  A batch callback gets its AO from staging.
+  const bool direct_ao = ao_values && !batch_callback && ( ao_samples.ao_memory == MEMORY_SPACE_DEVICE || isPinnedHostMemory( ao_values ) );
+  float* staged_ao_values = direct_ao ? NULL : ao_values;
+
+  // Samples of this set are placed from the context's device copies of their meshes where possible
+#pragma omp parallel for num_threads( (int)num_devices ) schedule( static, 1 )
+  for (ptrdiff_t d = 0; d < num_devices; ++d) {
+    DeviceWorker& worker = *workers[d];
+    CHK_CUDA( cudaSetDevice( worker.device ) );
+    worker.setup_timer.start();
+    if ( device_sampling ) {
+      worker.sampler = new DeviceSamplerData;
+      createDeviceSampler( scene, placement.num_instances, worker.psd, *worker.sampler );
+      if ( splat_vertices ) createVertexAccumulators( vertex_offsets, *worker.sampler );
+    } else if ( reconstructed_samples ) {
+      worker.sampler = new DeviceSamplerData;
+      createDeviceSampler( scene, scene.num_instances, worker.psd, *worker.sampler );
+    }
+    // Slots kept from an earlier sample set hold device memory that autoBatchSize can't see
+    worker.max_batch_size = autoBatchSize( max_batch_slots, passes_per_query, adaptive, num_radii, num_channels );
+    if ( worker.slotsFit( 0, passes_per_query, device_sampling, adaptive, num_radii, num_channels ) ) {
+      worker.max_batch_size = std::max( worker.max_batch_size, worker.slot_capacity );
+    }
+    worker.active_after_pass.assign( num_passes + 1, 0 );
+    worker.setup_timer.stop();
+  }
+
+  // Split sample points into batches to help limit device memory usage.  Unless the caller asks for
+  // a specific size, use whatever device memory is left after the accel build on the smallest device.
+  // All devices share one batch size.  Batches shared with another tracer come with their size.
+  size_t batch_size = MAX_RAYS_PER_QUERY / passes_per_query;
+  if ( shared_batches ) {
+    assert( shared_batches->batch_size <= batch_size );
+    batch_size = shared_batches->batch_size;
+  } else if ( requested_batch_size > 0 ) {
+    batch_size = std::min( requested_batch_size, batch_size );
+  } else {
+    for (ptrdiff_t d = 0; d < num_devices; ++d) batch_size = std::min( batch_size, workers[d]->max_batch_size );
+  }
+  if ( governed && !shared_batches ) {
+    // One pass over a batch is the least a submission traces
+    for (ptrdiff_t d = 0; d < num_devices; ++d) batch_size = std::min( batch_size, workers[d]->latency.maxRays( latency_budget_ms ) );
+  }
+
+  // Batches are checkpointed once their AO is on the host.  A resumed run keeps the batches of the run it resumes,
+  // if they fit.  Batches shared with another tracer, AO splatted on the device and batches handed to a callback, which
+  // would never see the restored ones, are not checkpointed.
+  const bool checkpointed = !ctx->checkpoint_dir.empty() && ao_values && ao_samples.ao_memory != MEMORY_SPACE_DEVICE && 
+                            !splat_vertices && !shared_batches && !batch_callback && ao_samples.num_samples > 0;
+  CheckpointHeader checkpoint_key;
+  std::string checkpoint_filename;
+  if ( checkpointed ) {
+    std::memset( &checkpoint_key, 0, sizeof(checkpoint_key) );
+    checkpoint_key.bake_hash = ctx->checkpoint_hash;
+    checkpoint_key.first_sample_index = ao_samples.first_sample_index;
+    checkpoint_key.num_samples = ao_samples.num_samples;
+    checkpoint_key.num_channels = num_channels;
+    checkpoint_filename = BatchCheckpoint::path( ctx->checkpoint_dir, ctx->checkpoint_hash, ao_samples.first_sample_index );
+    const size_t saved_batch_size = BatchCheckpoint::savedBatchSize( checkpoint_filename, checkpoint_key );
+    if ( saved_batch_size > 0 && saved_batch_size <= batch_size ) batch_size = saved_batch_size;
+    checkpoint_key.batch_size = batch_size;
+  }
+  const size_t slot_capacity = std::min( batch_size, ao_samples.num_samples );
+
+  // Devices pull batches from a shared cursor, so faster devices trace more of them
+  BatchCursor local_batches( batch_size, std::max( ao_samples.num_samples, size_t(1) ) );
+  BatchCursor& batches = shared_batches ? *shared_batches : local_batches;
+  const size_t num_batches = batches.num_batches;
+
+  // Batches shared with another tracer are only a part of the samples this call sees done
+  ProgressCounter progress( "trace", ao_samples.num_samples, num_passes );
+  ProgressCounter* batch_progress = shared_batches ? NULL : &progress;
+
+  BatchCheckpoint checkpoint;
+  size_t num_restored_batches = 0;
+  if ( checkpointed ) {
+    std::vector<bool> done( num_batches, false );
+    num_restored_batches = checkpoint.open( checkpoint_filename, checkpoint_key, ao_values, done );
+    batches.skip( done );
+    for (size_t b = 0; b < num_batches; ++b) {
+      if ( done[b] ) progress.skip( std::min( batch_size, ao_samples.num_samples - b*batch_size ) );
+    }
+  }
+  BatchCheckpoint* batch_checkpoint = checkpointed ? &checkpoint : NULL;
+
+#pragma omp parallel for num_threads( (int)num_devices ) schedule( static, 1 )
+  for (ptrdiff_t d = 0; d < num_devices; ++d) {
+    DeviceWorker& worker = *workers[d];
+    CHK_CUDA( cudaSetDevice( worker.device ) );
+
+    worker.setup_timer.start();
+    const size_t num_slots = std::min( max_batch_slots, num_batches );
+    worker.reserveSlots( num_slots, slot_capacity, passes_per_query, device_sampling, adaptive, num_radii, num_channels, cpu_mode, governed );
+    std::vector<BatchSlot*>& slots = worker.slots;
+    recordMemoryUsage();
+    worker.setup_timer.stop();
+
+    // Note: kernels and queries are launched asynchronously, so the timers below measure submission time 
+    // on the host, and waiting for the device is attributed to "copy AO out".
+
+    std::vector<bake::TriangleSampleRange> sample_ranges;
+
+    // Provided samples of the batch being staged: positions, normals, then face normals
+    std::vector<float> batch_samples( provided_samples ? 9*std::max( slot_capacity, size_t(1) ) : 0 );
+
+    for (;;) {
+
+      size_t batch_idx;
+      if ( !batches.take( batch_idx ) ) break;
+
+      ProfileRange batch_range( "batch", PROFILE_COLOR_TRACE, uint64_t( batch_idx ) );
+      worker.num_batches++;
+      BatchSlot& slot = *slots[nextSlot( slots, num_slots )];
+
+      // Retire the previous batch that used this slot before reusing its buffers
+      ACCUM_TIME( worker.copyao_timer, finishBatch( slot, staged_ao_values, ao_samples.num_samples, num_channels, batch_checkpoint, 
+                                                    batch_callback, batch_data, batch_progress ) );
+
+      worker.setup_timer.start();
+      slot.timer.reset();
+      slot.timer.start();
+      const size_t sample_offset = batch_idx*batch_size;
+      const size_t num_samples = std::min(batch_size, ao_samples.num_samples - sample_offset);
+      const unsigned long long first_sample_index = ao_samples.first_sample_index + sample_offset;
+
+      if ( device_sampling ) {
+
+        // Only the triangle ranges of the batch go to the device
+        buildSampleRanges( placement, sample_offset, num_samples, sample_ranges );
+        if ( slot.sample_ranges.count() < sample_ranges.size() ) {
+          slot.sample_ranges.alloc( sample_ranges.size(), RTP_BUFFER_TYPE_CUDA_LINEAR );
+          slot.staging_sample_ranges.alloc( sample_ranges.size(), RTP_BUFFER_TYPE_HOST, LOCKED );
+        }
+        std::copy( sample_ranges.begin(), sample_ranges.end(), slot.staging_sample_ranges.ptr() );
+        slot.gpu_timers[GPU_UPLOAD].start( slot.stream );
+        cudaMemcpyAsync( slot.sample_ranges.ptr(), slot.staging_sample_ranges.ptr(), sample_ranges.size()*sizeof(bake::TriangleSampleRange), 
+                         cudaMemcpyHostToDevice, slot.stream );
+        worker.bytes_to_device += sample_ranges.size()*sizeof(bake::TriangleSampleRange);
+        generateSamplesDevice( num_samples, sample_ranges.size(), slot.sample_ranges.ptr(), worker.sampler->instances.ptr(), 
+                               worker.sampler->meshes.ptr(), slot.sample_positions.ptr(), slot.sample_normals.ptr(), slot.stream );
+
+      } else if ( device_samples ) {
+
+        const float3* normals      = reinterpret_cast<const float3*>( ao_samples.sample_normals )      + sample_offset;
+        const float3* face_normals = reinterpret_cast<const float3*>( ao_samples.sample_face_normals ) + sample_offset;
+        const float3* positions    = reinterpret_cast<const float3*>( ao_samples.sample_positions )    + sample_offset;
+        slot.gpu_timers[GPU_UPLOAD].start( slot.stream );
+        if ( samples_device != worker.device ) {
+          if ( slot.peer_samples.count() < 3*slot_capacity ) slot.peer_samples.alloc( 3*slot_capacity, RTP_BUFFER_TYPE_CUDA_LINEAR );
+          float3* peer = slot.peer_samples.ptr();
+          cudaMemcpyAsync( peer,                 positions,    num_samples*sizeof(float3), cudaMemcpyDefault, slot.stream );
+          cudaMemcpyAsync( peer + num_samples,   normals,      num_samples*sizeof(float3), cudaMemcpyDefault, slot.stream );
+          cudaMemcpyAsync( peer + 2*num_samples, face_normals, num_samples*sizeof(float3), cudaMemcpyDefault, slot.stream );
+          positions = peer;
+          normals = peer + num_samples;
+          face_normals = peer + 2*num_samples;
+        }
+        packSamplesDevice( num_samples, positions, normals, face_normals, slot.sample_positions.ptr(), slot.sample_normals.ptr(), 
+                           slot.stream );
+
+      } else if ( reconstructed_samples ) {
+
+        if ( slot.sample_locations.count() < num_samples ) {
+          slot.sample_locations.alloc( slot_capacity, RTP_BUFFER_TYPE_CUDA_LINEAR );
+          slot.staging_sample_locations.alloc( slot_capacity, RTP_BUFFER_TYPE_HOST, LOCKED );
+        }
+        stageSampleLocations( ao_samples, sample_offset, num_samples, slot );
+        slot.gpu_timers[GPU_UPLOAD].start( slot.stream );
+        cudaMemcpyAsync( slot.sample_locations.ptr(), slot.staging_sample_locations.ptr(), num_samples*sizeof(bake::SampleLocation), 
+                         cudaMemcpyHostToDevice, slot.stream );
+        worker.bytes_to_device += num_samples*sizeof(bake::SampleLocation);
+        reconstructSamplesDevice( num_samples, slot.sample_locations.ptr(), worker.sampler->instances.ptr(), worker.sampler->meshes.ptr(),
+                                  slot.sample_positions.ptr(), slot.sample_normals.ptr(), slot.stream );
+
+      } else {
+
+        // Pack sample points into the device layout while copying them to page-locked staging.  Provided samples
+        // are made now, while the devices trace the batches before.
+        if ( provided_samples ) {
+          bake::AOSamples batch = ao_samples;
+          batch.num_samples         = num_samples;
+          batch.sample_positions    = &batch_samples[0];
+          batch.sample_normals      = &batch_samples[3*num_samples];
+          batch.sample_face_normals = &batch_samples[6*num_samples];
+          ACCUM_TIME( worker.provide_timer, sample_provider( provider_data, sample_offset, num_samples, batch.sample_positions, 
+                                                             batch.sample_normals, batch.sample_face_normals ) );
+          stageHostSamples( batch, 0, num_samples, slot );
+        } else {
+          stageHostSamples( ao_samples, sample_offset, num_samples, slot );
+        }
+        slot.gpu_timers[GPU_UPLOAD].start( slot.stream );
+        cudaMemcpyAsync( slot.sample_positions.ptr(), slot.staging_positions.ptr(), num_samples*sizeof(float4), cudaMemcpyHostToDevice, slot.stream );
+        cudaMemcpyAsync( slot.sample_normals.ptr(),   slot.staging_normals.ptr(),   num_samples*sizeof(uint2),  cudaMemcpyHostToDevice, slot.stream );
+        worker.bytes_to_device += num_samples*( sizeof(float4) + sizeof(uint2) );
+      }
+      bake::DeviceSamples samples_device;
+      samples_device.num_samples = num_samples;
+      samples_device.positions   = slot.sample_positions.ptr();
+      samples_device.normals     = slot.sample_normals.ptr();
+      samples_device.flat_normals = flat_normals;
+
+      cudaMemsetAsync( slot.ao.ptr(), 0, num_channels*num_samples*sizeof(float), slot.stream );
+      slot.gpu_timers[GPU_UPLOAD].stop( slot.stream );
+      
+      worker.setup_timer.stop();
+
+      // All samples start out active; without adaptive sampling they stay that way
+      size_t num_active = num_samples;
+      const int* active_samples = NULL;
+      int next_list = 0;
+
+      for( int side = 0; side < num_sides; ++side )
+      {
+        float* side_ao = slot.ao.ptr() + side*num_samples;
+        for( int pass = 0; pass < num_passes && num_active > 0; )
+        {
+          int query_passes = std::min( passes_per_query, num_passes - pass );
+          if ( governed && !adaptive ) {
+            // Fewer passes per query when the budget doesn't allow all; adaptive sampling keeps its pass groups
+            const size_t budget_passes = worker.latency.maxRays( latency_budget_ms ) / num_active;
+            query_passes = std::max( 1, int( std::min( size_t( query_passes ), budget_passes ) ) );
+          }
+
+          // Buffers are persistent, so the query only needs rebinding for a different size, i.e. the last batch or pass group, 
+          // or when samples retire
+          const size_t query_count = num_active*query_passes;
+          if ( slot.query_count != query_count ) {
+            slot.query->setRays( query_count, Ray::format,             slot.rays.type(), slot.rays.ptr() );
+            if ( multi_radius ) {
+              slot.query->setHits( query_count, RTP_BUFFER_FORMAT_HIT_T, slot.hit_t.type(), slot.hit_t.ptr() );
+            } else {
+              slot.query->setHits( query_count, RTP_BUFFER_FORMAT_HIT_BITMASK, slot.hits.type(), slot.hits.ptr() );
+            }
+            slot.query_count = query_count;
+          }
+
+          if ( governed ) worker.latency.begin( slot.stream );
+          unsigned* plane_hits = NULL;
+          if ( ctx->ground_plane.axis >= 0 ) {
+            plane_hits = slot.plane_hits.ptr();
+            cudaMemsetAsync( plane_hits, 0, idivCeil( query_count, size_t(32) )*sizeof(unsigned), slot.stream );
+          }
+          ACCUM_GPU_TIME(worker.raygen_timer, slot.gpu_timers[GPU_RAYGEN], slot.stream, generateRaysDevice(first_sample_index, pass, query_passes, scene_offset, ray_maxdistance, samples_device, 
+                                                                num_active, active_samples, ctx->ground_plane, plane_hits, multi_radius, 
+                                                                side == 1, slot.rays.ptr(), slot.stream));
+
+          // Host or device, depending on Prime context type.  For a host context, which we assume is rare, Prime will copy the rays from device to host.
+          // A host context does not run on the slot's stream, so only the host timer applies
+          if ( cpu_mode ) {
+            ACCUM_TIME( worker.query_timer, slot.query->execute( query_hint ) );
+          } else {
+            ACCUM_GPU_TIME( worker.query_timer, slot.gpu_timers[GPU_QUERY], slot.stream, slot.query->execute( query_hint ) );
+          }
+
+          if ( multi_radius ) {
+            ACCUM_GPU_TIME(worker.updateao_timer, slot.gpu_timers[GPU_UPDATE_AO], slot.stream, updateAOMultiRadiusDevice(num_active, query_passes, slot.hit_t.ptr(), device_radii, slot.ao.ptr(), slot.stream));
+          } else if ( far_field ) {
+            ACCUM_GPU_TIME(worker.updateao_timer, slot.gpu_timers[GPU_UPDATE_AO], slot.stream, updateAOFarFieldDevice(num_active, active_samples, query_passes, slot.hits.ptr(), plane_hits, 
+                                                                 slot.rays.ptr(), samples_device, ctx->ground_plane, worker.far_field, far_field_near, 
+                                                                 scene_maxdistance, num_passes, side_ao, slot.stream));
+          } else {
+            ACCUM_GPU_TIME(worker.updateao_timer, slot.gpu_timers[GPU_UPDATE_AO], slot.stream, updateAODevice(num_active, active_samples, query_passes, slot.hits.ptr(), plane_hits, side_ao, slot.stream, 
+                                                                 slot.rays.ptr(), false, bent_normals ? slot.ao.ptr() + num_samples : NULL));
+          }
+          if ( governed ) worker.latency.end( slot.stream, query_count, latency_budget_ms );
+          worker.num_rays_traced += query_count;
+
+          const int num_rays = pass + query_passes;
+          if ( adaptive && num_rays >= ADAPTIVE_MIN_RAYS && num_rays < num_passes ) {
+            // The next pass group traces only the samples that have not converged.  The host needs their count to size 
+            // the query, so this waits for the slot's stream.
+            worker.updateao_timer.start();
+            slot.gpu_timers[GPU_UPDATE_AO].start( slot.stream );
+            int* next_active_samples = slot.active_samples[next_list].ptr();
+            num_active = retireConvergedDevice( num_active, active_samples, num_rays, adaptive_tolerance, slot.ao.ptr(), 
+                                                slot.keep_flags.ptr(), next_active_samples, slot.stream );
+            slot.gpu_timers[GPU_UPDATE_AO].stop( slot.stream );
+            active_samples = next_active_samples;
+            next_list = 1 - next_list;
+            worker.updateao_timer.stop();
+          }
+          worker.active_after_pass[num_rays] += num_active;
+          pass = num_rays;
+        }
+      }
+
+      // Samples still active traced every pass
+      if ( adaptive ) {
+        ACCUM_GPU_TIME(worker.updateao_timer, slot.gpu_timers[GPU_UPDATE_AO], slot.stream, normalizeAODevice(num_active, active_samples, slot.ao.ptr(), num_passes, slot.stream));
+      } else {
+        ACCUM_GPU_TIME(worker.updateao_timer, slot.gpu_timers[GPU_UPDATE_AO], slot.stream, normalizeAODevice(num_ao_channels*num_samples, NULL, slot.ao.ptr(), num_passes, slot.stream,
+                                                            bent_normals ? slot.ao.ptr() + num_samples : NULL, slot.sample_normals.ptr(),
+                                                            open_directions == OPEN_DIRECTIONS_SH_L1));
+      }
+      if ( splat_vertices ) {
+        ACCUM_GPU_TIME(worker.updateao_timer, slot.gpu_timers[GPU_UPDATE_AO], slot.stream, splatVertexAODevice(num_samples, sample_ranges.size(), slot.sample_ranges.ptr(), 
+                                                              worker.sampler->instances.ptr(), worker.sampler->meshes.ptr(),
+                                                              worker.sampler->instance_vertex_offsets.ptr(), slot.ao.ptr(), 
+                                                              worker.sampler->vertex_accum.ptr(), slot.stream));
+      }
+
+      // Start copying AO values back to host; the batch is retired when its slot comes around again
+      worker.copyao_timer.start();
+      if ( ao_values || batch_callback ) {
+        slot.gpu_timers[GPU_COPY_AO].start( slot.stream );
+        if ( direct_ao ) {
+          for (size_t c = 0; c < num_channels; ++c) {
+            cudaMemcpyAsync( ao_values + c*ao_samples.num_samples + sample_offset, slot.ao.ptr() + c*num_samples, num_samples*sizeof(float), 
+                             cudaMemcpyDefault, slot.stream );
+          }
+        } else {
+          cudaMemcpyAsync( slot.staging_ao.ptr(), slot.ao.ptr(), num_channels*num_samples*sizeof(float), cudaMemcpyDeviceToHost, slot.stream ); 
+        }
+        slot.gpu_timers[GPU_COPY_AO].stop( slot.stream );
+        worker.bytes_to_host += num_channels*num_samples*sizeof(float);
+      }
+      slot.sample_offset = sample_offset;
+      slot.num_samples = num_samples;
+      slot.sequence = worker.num_batches;
+      slot.busy = true;
+      worker.copyao_timer.stop();
+    }
+
+    worker.copyao_timer.start();
+    for (size_t i = 0; i < num_slots; ++i) {
+      finishBatch( *slots[i], staged_ao_values, ao_samples.num_samples, num_channels, batch_checkpoint, batch_callback, batch_data, 
+                   batch_progress );
+    }
+    worker.copyao_timer.stop();
+  }
+
+  if ( splat_vertices ) {
+    ProfileRange vertex_range( "vertex AO" );
+    const size_t num_vertices = vertex_offsets.back();
+    const size_t packed_bytes = packed_vertex_ao ? vertex_ao_bits/8 : 0;
+    const bool device_vertex_ao = ao_samples.ao_memory == MEMORY_SPACE_DEVICE;
+    std::vector<float> all_vertex_ao;
+    bool copied_vertex_ao = false;
+    if ( num_devices == 1 && packed_vertex_ao && !vertex_ao ) {
+      // Normalize and quantize on the device, and bring back one or two bytes per vertex
+      DeviceWorker& worker = *workers[0];
+      CHK_CUDA( cudaSetDevice( worker.device ) );
+      worker.copyao_timer.start();
+      if ( num_vertices > 0 ) {
+        Buffer<unsigned char> packed_device( num_vertices*packed_bytes, RTP_BUFFER_TYPE_CUDA_LINEAR );
+        packVertexAODevice( num_vertices, worker.sampler->vertex_accum.ptr(), vertex_ao_bits, packed_device.ptr() );
+        CHK_CUDA( cudaMemcpy( packed_vertex_ao, packed_device.ptr(), num_vertices*packed_bytes, cudaMemcpyDeviceToHost ) );
+      }
+      worker.bytes_to_host += num_vertices*packed_bytes;
+      worker.copyao_timer.stop();
+    } else if ( num_devices == 1 && !packed_vertex_ao ) {
+      // Normalize on the device and copy each instance's vertex AO straight to the caller's array, host or device
+      DeviceWorker& worker = *workers[0];
+      CHK_CUDA( cudaSetDevice( worker.device ) );
+      worker.copyao_timer.start();
+      if ( num_vertices > 0 ) {
+        Buffer<float> vertex_ao_device( num_vertices, RTP_BUFFER_TYPE_CUDA_LINEAR );
+        normalizeVertexAODevice( num_vertices, worker.sampler->vertex_accum.ptr(), vertex_ao_device.ptr() );
+        for (size_t i = 0; i < placement.num_instances; ++i) {
+          const size_t n = vertex_offsets[i+1] - vertex_offsets[i];
+          if ( n == 0 ) continue;
+          CHK_CUDA( cudaMemcpy( vertex_ao[i], vertex_ao_device.ptr() + vertex_offsets[i], n*sizeof(float), cudaMemcpyDefault ) );
+        }
+      }
+      if ( !device_vertex_ao ) worker.bytes_to_host += num_vertices*sizeof(float);
+      worker.copyao_timer.stop();
+      copied_vertex_ao = true;
+    } else if ( num_devices == 1 ) {
+      // Normalize on the device and bring back one float per vertex
+      all_vertex_ao.assign( num_vertices, 0.0f );
+      DeviceWorker& worker = *workers[0];
+      CHK_CUDA( cudaSetDevice( worker.device ) );
+      worker.copyao_timer.start();
+      if ( num_vertices > 0 ) {
+        Buffer<float> vertex_ao_device( num_vertices, RTP_BUFFER_TYPE_CUDA_LINEAR );
+        normalizeVertexAODevice( num_vertices, worker.sampler->vertex_accum.ptr(), vertex_ao_device.ptr() );
+        CHK_CUDA( cudaMemcpy( &all_vertex_ao[0], vertex_ao_device.ptr(), num_vertices*sizeof(float), cudaMemcpyDeviceToHost ) );
+      }
+      worker.bytes_to_host += num_vertices*sizeof(float);
+      worker.copyao_timer.stop();
+    } else {
+      // Each device has the sums of the batches it traced
+      all_vertex_ao.assign( num_vertices, 0.0f );
+      std::vector<float2> device_accum( num_vertices );
+      std::vector<double> sums( num_vertices, 0.0 ), weights( num_vertices, 0.0 );
+      for (ptrdiff_t d = 0; d < num_devices; ++d) {
+        DeviceWorker& worker = *workers[d];
+        if ( num_vertices == 0 ) break;
+        CHK_CUDA( cudaSetDevice( worker.device ) );
+        worker.copyao_timer.start();
+        CHK_CUDA( cudaMemcpy( &device_accum[0], worker.sampler->vertex_accum.ptr(), num_vertices*sizeof(float2), cudaMemcpyDeviceToHost ) );
+        worker.bytes_to_host += num_vertices*sizeof(float2);
+        for (size_t k = 0; k < num_vertices; ++k) {
+          sums[k]    += device_accum[k].x;
+          weights[k] += device_accum[k].y;
+        }
+        worker.copyao_timer.stop();
+      }
+      for (size_t k = 0; k < num_vertices; ++k) {
+        if ( weights[k] > 0.0 ) all_vertex_ao[k] = static_cast<float>( sums[k] / weights[k] );
+      }
+    }
+
+    if ( packed_vertex_ao && !all_vertex_ao.empty() ) {
+      quantizeVertexAO( &all_vertex_ao[0], num_vertices, vertex_ao_bits, packed_vertex_ao );
+    }
+
+    // Instances without samples get no AO, as with the host filter
+    size_t unplaced_vertices = 0;
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      const size_t n = scene.meshes[scene.instances[i].mesh_index].num_vertices;
+      if ( i >= placement.num_instances ) unplaced_vertices += n;
+      if ( !vertex_ao || ( copied_vertex_ao && i < placement.num_instances ) ) continue;
+      if ( device_vertex_ao && i < placement.num_instances ) {
+        CHK_CUDA( cudaMemcpy( vertex_ao[i], &all_vertex_ao[vertex_offsets[i]], n*sizeof(float), cudaMemcpyHostToDevice ) );
+      } else if ( device_vertex_ao ) {
+        CHK_CUDA( cudaMemset( vertex_ao[i], 0, n*sizeof(float) ) );
+      } else if ( i < placement.num_instances ) {
+        std::copy( all_vertex_ao.begin() + vertex_offsets[i], all_vertex_ao.begin() + vertex_offsets[i+1], vertex_ao[i] );
+      } else {
+        std::fill( vertex_ao[i], vertex_ao[i] + n, 0.0f );
+      }
+    }
+    if ( packed_vertex_ao ) {
+      std::fill( packed_vertex_ao + num_vertices*packed_bytes, packed_vertex_ao + (num_vertices + unplaced_vertices)*packed_bytes, 
+                 (unsigned char)0 );
+    }
+  }
+  
+  size_t total_rays_traced = 0;
+
+  // Tracers that share batches finish together; keep their reports apart
+#pragma omp critical( bake_report )
+  {
+    std::cerr << "\n\tbatch size ...      " << batch_size << (requested_batch_size > 0 ? "" : " (auto)") << ", " << num_batches << " batches\n";
+    std::cerr << "\tpasses per query .. " << passes_per_query << "\n";
+    if ( num_restored_batches > 0 ) {
+      std::cerr << "\tcheckpoint ...      " << num_restored_batches << " batches restored from " << checkpoint_filename << "\n";
+    }
+    if ( adaptive ) {
+      // Samples still tracing after each pass group, summed over devices
+      size_t num_rays_traced = 0;
+      std::vector<size_t> active_after_pass( num_passes + 1, 0 );
+      for (ptrdiff_t d = 0; d < num_devices; ++d) {
+        num_rays_traced += workers[d]->num_rays_traced;
+        for (int k = 0; k <= num_passes; ++k) active_after_pass[k] += workers[d]->active_after_pass[k];
+      }
+      std::cerr << "\tadaptive tolerance  " << adaptive_tolerance << ", " << num_rays_traced << " rays traced ("
+                << 100.0 * double(num_rays_traced) / (double(ao_samples.num_samples) * num_passes) << "% of " << num_passes << " per sample)\n";
+      std::cerr << "\tactive samples ...  ";
+      for (int pass = 0; pass < num_passes; pass += passes_per_query) {
+        const int num_rays = std::min( pass + passes_per_query, num_passes );
+        std::cerr << " " << num_rays << ":" << active_after_pass[num_rays];
+        if ( active_after_pass[num_rays] == 0 ) break;
+      }
+      std::cerr << "\n";
+    }
+    for (ptrdiff_t d = 0; d < num_devices; ++d) {
+      DeviceWorker& worker = *workers[d];
+      if ( num_devices > 1 || shared_batches ) {
+        std::cerr << "\tdevice " << worker.device << ": " << worker.num_batches << " batches\n";
+      }
+      reportWorker( worker, cpu_mode );
+      total_rays_traced += worker.num_rays_traced;
+
+      // Device sample tables are specific to this sample set
+      CHK_CUDA( cudaSetDevice( worker.device ) );
+      delete worker.sampler;
+      worker.sampler = NULL;
+      worker.resetStats();
+    }
+  }
+
+  trace_timer.stop();
+  recordTime( "ao.trace", trace_timer );
+  recordCount( "ao.samples", ao_samples.num_samples );
+  if ( trace_timer.elapsed > 0.0 ) {
+    recordGauge( "ao.rays_per_second", double( total_rays_traced ) / trace_timer.elapsed );
+  }
+
+  CHK_CUDA( cudaSetDevice( ctx->caller_device ) );
+}
+
+
+
+
+
+int bake::ao_optix_prime_progressive(
+    PrimeAOContext* ctx,
+    const Scene& scene,
+    const bake::AOSamples& ao_samples,
+    const int    rays_per_sample,
+    const float  scene_offset,
+    const float  scene_maxdistance,
+    const size_t requested_batch_size,
+    const int    requested_passes_per_query,
+    const double time_budget,
+    float* ao_values,
+    AOSnapshotCallback snapshot,
+    void*  snapshot_data,
+    AOPriorityCallback priority,
+    void*  priority_data
+    )
+{
+  Timer trace_timer;
+  trace_timer.start();
+  Timer budget_timer;  // running total, stopped and restarted after each pass group
+  budget_timer.start();
+  ProfileRange range( "trace samples progressively", PROFILE_COLOR_TRACE, uint64_t( ao_samples.num_samples ) );
+
+  assert( ao_samples.sample_positions && ao_samples.sample_memory == MEMORY_SPACE_HOST );
+  assert( ao_values && ao_samples.ao_memory == MEMORY_SPACE_HOST );
+  const bool cpu_mode = ctx->cpu_mode;
+  std::vector<DeviceWorker*>& workers = ctx->workers;
+  const ptrdiff_t num_devices = static_cast<ptrdiff_t>( workers.size() );
+  const size_t num_samples = ao_samples.num_samples;
+
+  // A pass group is the unit of progress: every sample gets passes_per_query more rays before any gets more again
+  const int num_passes = std::max( rays_per_sample, 1 );
+  const bool flat_normals = flatSampleNormals( scene );
+  const int passes_per_query = std::max( 1, std::min( requested_passes_per_query > 0 ? requested_passes_per_query : DEFAULT_PASSES_PER_QUERY, 
+                                                      num_passes ) );
+  const size_t max_batch_slots = cpu_mode ? 1 : ctx->batch_slots;
+
+  // Each device keeps the occlusion counts of its batches between pass groups, about 1/num_devices of the samples,
+  // and the batch slots get what is left
+  const size_t accum_bytes = idivCeil( std::max( num_samples, size_t(1) ), size_t( num_devices ) )*sizeof(float);
+  size_t batch_size = MAX_RAYS_PER_QUERY / passes_per_query;
+  if ( requested_batch_size > 0 ) {
+    batch_size = std::min( requested_batch_size, batch_size );
+  } else {
+    for (ptrdiff_t d = 0; d < num_devices; ++d) {
+      DeviceWorker& worker = *workers[d];
+      CHK_CUDA( cudaSetDevice( worker.device ) );
+      size_t max_batch_size = autoBatchSize( max_batch_slots, passes_per_query, false, 0, 1, accum_bytes );
+      if ( worker.slotsFit( 0, passes_per_query, false, false, 0, 1 ) ) max_batch_size = std::max( max_batch_size, worker.slot_capacity );
+      batch_size = std::min( batch_size, max_batch_size );
+    }
+  }
+  const size_t slot_capacity = std::max( std::min( batch_size, num_samples ), size_t(1) );
+  const size_t num_batches = idivCeil( std::max( num_samples, size_t(1) ), batch_size );
+
+  // Batches stay with one device, round robin, since their counts live there.  A device with no more batches than 
+  // slots uploads its samples once; otherwise every pass group uploads them again.
+  std::vector< Buffer<float>* > accum( num_devices, (Buffer<float>*)NULL );
+  std::vector< std::vector<size_t> > slot_batches( num_devices );  // batch whose samples each slot holds
+#pragma omp parallel for num_threads( (int)num_devices ) schedule( static, 1 )
+  for (ptrdiff_t d = 0; d < num_devices; ++d) {
+    DeviceWorker& worker = *workers[d];
+    CHK_CUDA( cudaSetDevice( worker.device ) );
+    worker.setup_timer.start();
+    const size_t num_owned = idivCeil( num_batches - std::min( num_batches, size_t(d) ), size_t( num_devices ) );
+    accum[d] = new Buffer<float>( std::max( num_owned*batch_size, size_t(1) ), RTP_BUFFER_TYPE_CUDA_LINEAR );
+    CHK_CUDA( cudaMemset( accum[d]->ptr(), 0, accum[d]->count()*sizeof(float) ) );
+    const size_t num_slots = std::min( max_batch_slots, num_owned );
+    if ( num_slots > 0 ) worker.reserveSlots( num_slots, slot_capacity, passes_per_query, false, false, 0, 1, cpu_mode );
+    slot_batches[d].assign( num_slots, size_t(-1) );
+    recordMemoryUsage();
+    worker.setup_timer.stop();
+  }
+
+  // Rays traced so far by each batch; they differ only when a priority picks the batches of a group
+  std::vector<int> batch_rays( num_batches, 0 );
+  std::vector<float> sample_weights( priority ? num_samples : 0 );
+  std::vector<float> batch_weights( num_batches, 0.0f );
+  int rays_traced = 0;  // the fewest of any batch
+  int num_groups = 0;
+  int num_prioritized_groups = 0;
+  bool stopped = false;
+  while ( rays_traced < num_passes && !stopped && num_samples > 0 ) {
+    ProfileRange group_range( "pass group", PROFILE_COLOR_TRACE, uint64_t( rays_traced ) );
+    Timer group_timer;
+    group_timer.start();
+
+    // The batches of this group, highest mean weight first: those with weighted samples while any need rays, else all
+    std::vector< std::vector< std::pair<float, size_t> > > group_batches( num_devices );
+    bool prioritized = false;
+    if ( priority ) {
+      priority( priority_data, &sample_weights[0] );
+#pragma omp parallel for if( num_batches > 1 )
+      for (ptrdiff_t b = 0; b < ptrdiff_t(num_batches); ++b) {
+        const size_t first = size_t(b)*batch_size;
+        const size_t count = std::min( batch_size, num_samples - first );
+        double sum = 0.0;
+        for (size_t i = first; i < first + count; ++i) sum += sample_weights[i];
+        batch_weights[b] = float( sum / double( count ) );
+      }
+      for (size_t b = 0; b < num_batches && !prioritized; ++b) prioritized = batch_rays[b] < num_passes && batch_weights[b] > 0.0f;
+    }
+    for (size_t b = 0; b < num_batches; ++b) {
+      if ( batch_rays[b] >= num_passes || (prioritized && !(batch_weights[b] > 0.0f)) ) continue;
+      group_batches[b % size_t(num_devices)].push_back( std::make_pair( -batch_weights[b], b ) );
+    }
+    for (ptrdiff_t d = 0; d < num_devices; ++d) std::stable_sort( group_batches[d].begin(), group_batches[d].end() );
+    if ( prioritized ) ++num_prioritized_groups;
+
+#pragma omp parallel for num_threads( (int)num_devices ) schedule( static, 1 )
+    for (ptrdiff_t d = 0; d < num_devices; ++d) {
+      DeviceWorker& worker = *workers[d];
+      CHK_CUDA( cudaSetDevice( worker.device ) );
+      std::vector<BatchSlot*>& slots = worker.slots;
+      const size_t num_slots = slot_batches[d].size();
+
+      for (size_t g = 0; g < group_batches[d].size(); ++g) {
+        const size_t batch_idx = group_batches[d][g].second;
+        const size_t k = batch_idx / size_t(num_devices);  // index of the batch among this device's
+        const int query_passes = std::min( passes_per_query, num_passes - batch_rays[batch_idx] );
+        ProfileRange batch_range( "batch", PROFILE_COLOR_TRACE, uint64_t( batch_idx ) );
+        if ( batch_rays[batch_idx] == 0 ) worker.num_batches++;
+        const size_t slot_idx = k % num_slots;
+        BatchSlot& slot = *slots[slot_idx];
+        const size_t sample_offset = batch_idx*batch_size;
+        const size_t batch_samples = std::min( batch_size, num_samples - sample_offset );
+        float* batch_accum = accum[d]->ptr() + k*batch_size;
+
+        if ( slot_batches[d][slot_idx] != batch_idx ) {
+          // The slot's last upload may still be reading the staging buffers; everything else is ordered by its stream
+          worker.setup_timer.start();
+          CHK_CUDA( cudaStreamSynchronize( slot.stream ) );
+          stageHostSamples( ao_samples, sample_offset, batch_samples, slot );
+          slot.gpu_timers[GPU_UPLOAD].start( slot.stream );
+          cudaMemcpyAsync( slot.sample_positions.ptr(), slot.staging_positions.ptr(), batch_samples*sizeof(float4), cudaMemcpyHostToDevice, slot.stream );
+          cudaMemcpyAsync( slot.sample_normals.ptr(),   slot.staging_normals.ptr(),   batch_samples*sizeof(uint2),  cudaMemcpyHostToDevice, slot.stream );
+          slot.gpu_timers[GPU_UPLOAD].stop( slot.stream );
+          worker.bytes_to_device += batch_samples*( sizeof(float4) + sizeof(uint2) );
+          slot_batches[d][slot_idx] = batch_idx;
+          worker.setup_timer.stop();
+        }
+        bake::DeviceSamples samples_device;
+        samples_device.num_samples = batch_samples;
+        samples_device.positions   = slot.sample_positions.ptr();
+        samples_device.normals     = slot.sample_normals.ptr();
+        samples_device.flat_normals = flat_normals;
+
+        const size_t query_count = batch_samples*query_passes;
+        if ( slot.query_count != query_count ) {
+          slot.query->setRays( query_count, Ray::format,                  slot.rays.type(), slot.rays.ptr() );
+          slot.query->setHits( query_count, RTP_BUFFER_FORMAT_HIT_BITMASK, slot.hits.type(), slot.hits.ptr() );
+          slot.query_count = query_count;
+        }
+        unsigned* plane_hits = NULL;
+        if ( ctx->ground_plane.axis >= 0 ) {
+          plane_hits = slot.plane_hits.ptr();
+          cudaMemsetAsync( plane_hits, 0, idivCeil( query_count, size_t(32) )*sizeof(unsigned), slot.stream );
+        }
+        // Rays depend only on the global sample index and the pass, so the passes come out as in a batch-major trace
+        ACCUM_GPU_TIME(worker.raygen_timer, slot.gpu_timers[GPU_RAYGEN], slot.stream, generateRaysDevice(ao_samples.first_sample_index + sample_offset, 
+                                                              batch_rays[batch_idx], query_passes, scene_offset, scene_maxdistance, samples_device, 
+                                                              batch_samples, NULL, ctx->ground_plane, plane_hits, false, false, slot.rays.ptr(), 
+                                                              slot.stream));
+        if ( cpu_mode ) {
+          ACCUM_TIME( worker.query_timer, slot.query->execute( RTP_QUERY_HINT_NONE ) );
+        } else {
+          ACCUM_GPU_TIME( worker.query_timer, slot.gpu_timers[GPU_QUERY], slot.stream, slot.query->execute( RTP_QUERY_HINT_ASYNC ) );
+        }
+        ACCUM_GPU_TIME(worker.updateao_timer, slot.gpu_timers[GPU_UPDATE_AO], slot.stream, updateAODevice(batch_samples, NULL, query_passes, slot.hits.ptr(), 
+                                                              plane_hits, batch_accum, slot.stream));
+        worker.num_rays_traced += query_count;
+        batch_rays[batch_idx] += query_passes;
+      }
+
+      worker.copyao_timer.start();
+      for (size_t i = 0; i < num_slots; ++i) {
+        CHK_CUDA( cudaStreamSynchronize( slots[i]->stream ) );
+        for (int p = 0; p < NUM_GPU_PHASES; ++p) slots[i]->gpu_timers[p].resolve();
+      }
+      worker.copyao_timer.stop();
+    }
+
+    group_timer.stop();
+    budget_timer.stop();
+    rays_traced = *std::min_element( batch_rays.begin(), batch_rays.end() );
+    ++num_groups;
+
+    // Stop before a pass group that would not finish within the budget, judging by the last one
+    stopped = time_budget > 0.0 && rays_traced < num_passes && budget_timer.elapsed + group_timer.elapsed > time_budget;
+    budget_timer.start();
+    if ( !snapshot && rays_traced < num_passes && !stopped ) continue;
+
+    // The estimate so far, from the counts of all batches
+#pragma omp parallel for num_threads( (int)num_devices ) schedule( static, 1 )
+    for (ptrdiff_t d = 0; d < num_devices; ++d) {
+      DeviceWorker& worker = *workers[d];
+      CHK_CUDA( cudaSetDevice( worker.device ) );
+      worker.copyao_timer.start();
+      size_t k = 0;
+      for (size_t batch_idx = size_t(d); batch_idx < num_batches; batch_idx += size_t(num_devices), ++k) {
+        const size_t sample_offset = batch_idx*batch_size;
+        const size_t batch_samples = std::min( batch_size, num_samples - sample_offset );
+        CHK_CUDA( cudaMemcpy( ao_values + sample_offset, accum[d]->ptr() + k*batch_size, batch_samples*sizeof(float), cudaMemcpyDeviceToHost ) );
+        worker.bytes_to_host += batch_samples*sizeof(float);
+      }
+      worker.copyao_timer.stop();
+    }
+    // Batches not traced yet show as unoccluded
+#pragma omp parallel for if( num_samples >= (1 << 16) )
+    for (ptrdiff_t i = 0; i < ptrdiff_t(num_samples); ++i) {
+      const int rays = batch_rays[size_t(i) / batch_size];
+      ao_values[i] = rays > 0 ? 1.0f - ao_values[i] / float( rays ) : 1.0f;
+    }
+    CHK_CUDA( cudaSetDevice( ctx->caller_device ) );
+    if ( snapshot && !snapshot( snapshot_data, ao_values, rays_traced ) ) stopped = true;
+  }
+  if ( num_samples == 0 ) rays_traced = num_passes;
+
+  size_t total_rays_traced = 0;
+#pragma omp critical( bake_report )
+  {
+    std::cerr << "\n\tbatch size ...      " << batch_size << (requested_batch_size > 0 ? "" : " (auto)") << ", " << num_batches << " batches\n";
+    std::cerr << "\tpasses per query .. " << passes_per_query << "\n";
+    std::cerr << "\tprogressive ...     " << rays_traced << " of " << num_passes << " rays per sample in " << num_groups << " pass groups"
+              << (rays_traced < num_passes ? ", stopped early" : "") << "\n";
+    if ( priority ) std::cerr << "\tprioritized ...     " << num_prioritized_groups << " of " << num_groups << " pass groups by view\n";
+    for (ptrdiff_t d = 0; d < num_devices; ++d) {
+      DeviceWorker& worker = *workers[d];
+      if ( num_devices > 1 ) {
+        std::cerr << "\tdevice " << worker.device << ": " << worker.num_batches << " batches\n";
+      }
+      reportWorker( worker, cpu_mode );
+      total_rays_traced += worker.num_rays_traced;
+      CHK_CUDA( cudaSetDevice( worker.device ) );
+      delete accum[d];
+      worker.resetStats();
+    }
+  }
+
+  trace_timer.stop();
+  recordTime( "ao.trace", trace_timer );
+  recordCount( "ao.samples", num_samples );
+  recordCount( "ao.pass_groups", num_groups );
+  if ( priority ) recordCount( "ao.prioritized_pass_groups", num_prioritized_groups );
+  recordGauge( "ao.progressive_rays", double( rays_traced ) );
+  if ( trace_timer.elapsed > 0.0 ) {
+    recordGauge( "ao.rays_per_second", double( total_rays_traced ) / trace_timer.elapsed );
+  }
+
+  CHK_CUDA( cudaSetDevice( ctx->caller_device ) );
+  return rays_traced;
+}
@@ -23,20 +23,120 @@
 
 #include "bake_api.h"
 
+struct BatchCursor;
+
 namespace bake
 {
 
+// Outputs summed from the directions of the rays that hit nothing, in three channels after the AO
+enum OpenDirections
+{
+  OPEN_DIRECTIONS_NONE,
+  OPEN_DIRECTIONS_BENT_NORMAL,  // see computeAOBentNormals
+  OPEN_DIRECTIONS_SH_L1         // see computeAOSHVisibility
+};
+
+// Prime scenes of the occluders, one per device
+struct PrimeAOContext;
+
+// With peer_geometry, the occluders' vertices and indices are stored once over the devices, which read each
+// other's through peer access; without it, or if some pair of devices can't, every device gets a copy.
+// managed_geometry puts them in unified memory, so they may exceed device memory and are paged in as needed.
+PrimeAOContext* ao_optix_prime_create_context(
+    const Scene& occluders,
+    const bool   cpu_mode,
+    const bool   conserve_memory,
+    const int*   devices,
+    const size_t num_devices,
+    const AccelPreset accel_preset = ACCEL_PRESET_BALANCED,
+    const GroundPlane* ground_plane = NULL,
+    const bool   peer_geometry = false,
+    const bool   managed_geometry = false
+    );
+
+// Initialize the CUDA contexts of the devices and create their Prime contexts, for create_context to take
+void ao_optix_prime_prepare_devices( const bool cpu_mode, const int* devices, const size_t num_devices );
+
+// Release prepared contexts that no AO context took
+void ao_optix_prime_release_prepared_devices();
+
+// Keep the models of meshes built by later contexts for the contexts after them, up to device_bytes of geometry per
+// device; 0 drops the library.  See setMeshLibraryBudget.
+void ao_optix_prime_set_mesh_library_budget( const size_t device_bytes );
+
+// Checkpoint the batches of later ao_optix_prime calls in checkpoint_dir, or stop with NULL.  See setAOCheckpoint.
+void ao_optix_prime_set_checkpoint( PrimeAOContext* context, const char* checkpoint_dir, const uint64_t bake_hash );
+
+// Batch slots, each with a query in flight on a stream of its own, per device for later ao_optix_prime calls; 0 is the
+// default.  See setAOQueriesInFlight.
+void ao_optix_prime_set_queries_in_flight( PrimeAOContext* context, const size_t num_queries );
+
+// Device time per submission for later ao_optix_prime calls, in milliseconds, or 0 for no limit.  See setAOLatencyBudget.
+void ao_optix_prime_set_latency_budget( PrimeAOContext* context, const double milliseconds );
+
+// Voxelize occluders, the context's with their current instances, into a far field volume of about resolution voxels
+// along each axis on every device, for later ao_optix_prime calls to trace rays near_fraction of their length and 
+// cone-march the rest; 0 drops the volume.  See setAOFarField.
+void ao_optix_prime_set_far_field( PrimeAOContext* context, const Scene& occluders, const float near_fraction, const int resolution );
+
 void ao_optix_prime(
-    const Scene&    scene,
+    PrimeAOContext* context,
+    const Scene& scene,
     const AOSamples& ao_samples,
     const int    rays_per_sample,
     const float  scene_offset,
     const float  scene_maxdistance,
-    const bool   cpu_mode,
-    const bool   conserve_memory,
-    float*  ao_values
+    const size_t batch_size,
+    const int    passes_per_query,
+    const float  adaptive_tolerance,
+    float*  ao_values,           // may be NULL if vertex_ao or batch_callback is set
+    float** vertex_ao = NULL,    // area based vertex AO per instance, splatted on the device; needs device sampling
+    const float* radii = NULL,   // hit distances for multi radius AO, ascending, the last one scene_maxdistance; then
+    const size_t num_radii = 0,  // ao_values has one channel of num_samples per radius
+    const bool   two_sided = false, // trace with flipped normals too, into a second channel of ao_values
+    BatchCursor* shared_batches = NULL, // batches to take turns at with another tracer, instead of batch_size
+    const OpenDirections open_directions = OPEN_DIRECTIONS_NONE,  // into channels 1-3 of ao_values
+    AOSampleProvider sample_provider = NULL,  // makes host samples per batch, for ao_samples without sample arrays
+    void*   provider_data = NULL,
+    AOBatchCallback batch_callback = NULL,    // gets the AO of each batch as it finishes; ao_values may then be NULL
+    void*   batch_data = NULL,
+    const unsigned vertex_ao_bits = 32,        // with 8 or 16, packed_vertex_ao gets the splatted vertex AO quantized
+    unsigned char* packed_vertex_ao = NULL     // on the device, all instances back to back; vertex_ao may then be NULL
+    );
+
+// Pass-major version of ao_optix_prime for host samples and AO values, one channel; see computeAOProgressive
+int ao_optix_prime_progressive(
+    PrimeAOContext* context,
+    const Scene& scene,
+    const AOSamples& ao_samples,
+    const int    rays_per_sample,
+    const float  scene_offset,
+    const float  scene_maxdistance,
+    const size_t batch_size,
+    const int    passes_per_query,
+    const double time_budget,
+    float*  ao_values,
+    AOSnapshotCallback snapshot,
+    void*   snapshot_data,
+    AOPriorityCallback priority,
+    void*   priority_data
+    );
+
+// Replace the occluders, meshes and all, keeping the devices' contexts, batch slots and queries: only the new mesh
+// accels, from the mesh library where it has them, and the top level are built
+void ao_optix_prime_set_occluders(
+    PrimeAOContext* context,
+    const Scene&    occluders
     );
 
+void ao_optix_prime_update_instances(
+    PrimeAOContext* context,
+    const Instance* instances,
+    const size_t    num_instances
+    );
+
+void ao_optix_prime_destroy_context( PrimeAOContext* context );
+
 }
 
 
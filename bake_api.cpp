@@ -22,17 +22,201 @@
 -----------------------------------------------------------------------*/
 
 #include "bake_api.h"
+#include "bake_ao_cache.h"
+#include "bake_ao_embree.h"
+#include "bake_ao_optix.h"
 #include "bake_ao_optix_prime.h"
+#include "bake_clean.h"
 #include "bake_filter.h"
 #include "bake_filter_least_squares.h"
+#include "bake_kernels.h"
+#include "bake_reorder.h"
 #include "bake_sample.h"
+#include "bake_simplify.h"
+#include "bake_spill.h"
+#include "bake_util.h"
+#include "bake_weld.h"
+#include "Buffer.h"
 #include <optixu/optixu_math_namespace.h>
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
 
 
 using namespace optix;
 
 
+namespace bake {
+
+// The backend contexts of an AOContext.  An OptiX or Embree context creates a Prime one the first time a call 
+// needs what only Prime does, from the saved creation arguments.
+struct AOContext {
+  AOBackend         backend;
+  OptixAOContext*   optix;
+  EmbreeAOContext*  embree;
+  PrimeAOContext*   prime;
+
+  Scene             occluders;   // the caller's meshes, or those below, with the instances below
+  std::vector<Mesh> meshes;      // copies of the caller's meshes after updateAOContextGeometry; the geometry is the caller's
+  std::vector<Instance> instances;
+  std::vector<unsigned char> occluder_mask;  // per instance, 0 for hidden ones; empty when all are visible
+  bool              cpu_mode;
+  bool              conserve_memory;
+  std::vector<int>  devices;
+  bool              peer_geometry;
+  bool              managed_geometry;
+  AccelPreset       accel_preset;
+  bool              has_ground_plane;
+  GroundPlane       ground_plane;
+  std::string       checkpoint_dir;  // for the Prime context, also when it is created later
+  uint64_t          checkpoint_hash;
+  size_t            queries_in_flight;  // same
+  float             latency_budget_ms;  // same
+  float             far_field_fraction;  // same
+  int               far_field_resolution;
+};
+
+// A Prime context kept for one object after another, with the host sample arrays of the last one
+struct ObjectBakeSession {
+  int               device;
+  AccelPreset       accel_preset;
+  AOContext*        context;  // NULL until the first object
+  Mesh              mesh;
+  Instance          instance;
+  std::vector<unsigned>   tri_sample_counts;
+  std::vector<SampleInfo> sample_infos;
+};
+
+}
+
+namespace {
+
+// The context's meshes with its visible instances, copied to visible_instances when some are hidden
+bake::Scene visibleOccluders( const bake::AOContext* ctx, std::vector<bake::Instance>& visible_instances )
+{
+  bake::Scene scene = ctx->occluders;
+  if ( ctx->occluder_mask.empty() ) return scene;
+  visible_instances.clear();
+  for (size_t i = 0; i < ctx->instances.size(); ++i) {
+    if ( ctx->occluder_mask[i] ) visible_instances.push_back( ctx->instances[i] );
+  }
+  scene.instances = visible_instances.empty() ? NULL : &visible_instances[0];
+  scene.num_instances = visible_instances.size();
+  return scene;
+}
+
+// Rebuilds the top level of each backend over the visible instances; the mesh accels are kept.  OptiX keeps all the
+// instances and masks the hidden ones, Embree and Prime get the visible ones only.
+void updateTopLevel( bake::AOContext* ctx, const bool prime_only )
+{
+  std::vector<bake::Instance> visible_instances;
+  const bake::Scene visible = visibleOccluders( ctx, visible_instances );
+  if ( ctx->optix && !prime_only ) {
+    bake::ao_optix_update_instances( ctx->optix, ctx->occluders.instances, ctx->occluders.num_instances, 
+      ctx->occluder_mask.empty() ? NULL : &ctx->occluder_mask[0] );
+  }
+  if ( ctx->embree && !prime_only ) bake::ao_embree_update_instances( ctx->embree, visible.instances, visible.num_instances );
+  if ( ctx->prime ) {
+    bake::ao_optix_prime_update_instances( ctx->prime, visible.instances, visible.num_instances );
+    // The far field volume is of the instances, so it is voxelized again
+    if ( ctx->far_field_fraction > 0.0f ) {
+      bake::ao_optix_prime_set_far_field( ctx->prime, visible, ctx->far_field_fraction, ctx->far_field_resolution );
+    }
+  }
+}
+
+bake::PrimeAOContext* primeContext( bake::AOContext* ctx )
+{
+  if ( !ctx->prime ) {
+    ctx->occluders.instances = ctx->instances.empty() ? NULL : &ctx->instances[0];
+    ctx->prime = bake::ao_optix_prime_create_context( ctx->occluders, ctx->cpu_mode, ctx->conserve_memory, 
+      ctx->devices.empty() ? NULL : &ctx->devices[0], ctx->devices.size(), ctx->accel_preset, 
+      ctx->has_ground_plane ? &ctx->ground_plane : NULL, ctx->peer_geometry, 
+      ctx->managed_geometry );
+    bake::ao_optix_prime_set_checkpoint( ctx->prime, ctx->checkpoint_dir.c_str(), ctx->checkpoint_hash );
+    bake::ao_optix_prime_set_queries_in_flight( ctx->prime, ctx->queries_in_flight );
+    bake::ao_optix_prime_set_latency_budget( ctx->prime, ctx->latency_budget_ms );
+    // Models are built for all the meshes, hidden instances or not, so a mask is only a top level update
+    if ( !ctx->occluder_mask.empty() ) {
+      updateTopLevel( ctx, true );
+    } else if ( ctx->far_field_fraction > 0.0f ) {
+      bake::ao_optix_prime_set_far_field( ctx->prime, ctx->occluders, ctx->far_field_fraction, ctx->far_field_resolution );
+    }
+  }
+  return ctx->prime;
+}
+
+// Samples traced per batch by hybrid contexts when the caller doesn't pick a size: enough for the devices to 
+// stay busy, few enough that neither tracer is left with a long last batch when the other one runs out of work.
+const size_t HYBRID_BATCH_SIZE = size_t(1) << 16;
+
+// Embree and the device tracer take batches from one cursor, each in a thread of its own, until none are left.
+// Both write their batches of ao_values in place.
+void traceHybrid( bake::AOContext* ctx, const bake::Scene& scene, const bake::AOSamples& ao_samples, const int rays_per_sample, 
+                  const float scene_offset, const float scene_maxdistance, const size_t batch_size, const int passes_per_query, 
+                  const float adaptive_tolerance, float* ao_values, const float* radii, const size_t num_radii, const bool two_sided )
+{
+  BatchCursor batches( batch_size > 0 ? batch_size : HYBRID_BATCH_SIZE, ao_samples.num_samples );
+  bake::PrimeAOContext* prime = ctx->optix ? NULL : primeContext( ctx );
+
+  // Each tracer runs parallel loops of its own
+  ScopedNestedParallelism nested;
+#pragma omp parallel sections num_threads( 2 )
+  {
+#pragma omp section
+    {
+      if ( ctx->optix ) {
+        bake::ao_optix( ctx->optix, scene, ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batches.batch_size, 
+                        adaptive_tolerance, ao_values, radii, num_radii, two_sided, &batches );
+      } else {
+        bake::ao_optix_prime( prime, scene, ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batches.batch_size, 
+                              passes_per_query, adaptive_tolerance, ao_values, NULL, radii, num_radii, two_sided, &batches );
+      }
+    }
+#pragma omp section
+    {
+      bake::ao_embree( ctx->embree, scene, ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batches.batch_size, 
+                       adaptive_tolerance, ao_values, radii, num_radii, two_sided, &batches );
+    }
+  }
+}
+
+// OptiX and Embree, together in hybrid contexts, trace samples with positions and normals.  Returns false, 
+// having traced nothing, if the samples are left to Prime.
+bool traceHostSamples( bake::AOContext* ctx, const bake::Scene& scene, const bake::AOSamples& ao_samples, const int rays_per_sample, 
+                       const float scene_offset, const float scene_maxdistance, const size_t batch_size, const int passes_per_query, 
+                       const float adaptive_tolerance, float* ao_values, const float* radii = NULL, const size_t num_radii = 0, 
+                       const bool two_sided = false )
+{
+  if ( !ao_samples.sample_positions ) return false;
+
+  // Embree only reads and writes host memory
+  const bool host_memory = ao_samples.sample_memory == bake::MEMORY_SPACE_HOST && ao_samples.ao_memory == bake::MEMORY_SPACE_HOST;
+  if ( ctx->backend == bake::AO_BACKEND_HYBRID && host_memory ) {
+    traceHybrid( ctx, scene, ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batch_size, passes_per_query, 
+                 adaptive_tolerance, ao_values, radii, num_radii, two_sided );
+    return true;
+  }
+  if ( ctx->optix ) {
+    bake::ao_optix( ctx->optix, scene, ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batch_size, adaptive_tolerance, 
+                    ao_values, radii, num_radii, two_sided );
+    return true;
+  }
+  if ( ctx->embree && host_memory ) {
+    bake::ao_embree( ctx->embree, scene, ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batch_size, adaptive_tolerance, 
+                     ao_values, radii, num_radii, two_sided );
+    return true;
+  }
+  return false;
+}
+
+}
+
+
 void bake::computeAO( 
     const Scene&      scene,
     const AOSamples&  ao_samples,
@@ -41,24 +225,822 @@ void bake::computeAO(
     const float       scene_maxdistance,
     const bool        cpu_mode,
     const bool        conserve_memory,
+    const size_t      batch_size,
+    const int         passes_per_query,
+    const float       adaptive_tolerance,
+    const int*        devices,
+    const size_t      num_devices,
     float*            ao_values 
     )
 {
-  bake::ao_optix_prime( scene,
-    ao_samples, rays_per_sample, scene_offset, scene_maxdistance, cpu_mode, conserve_memory, ao_values);
+  AOContext* context = bake::createAOContext( scene, cpu_mode, conserve_memory, devices, num_devices );
+  bake::computeAO( context, scene,
+    ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batch_size, passes_per_query, adaptive_tolerance, ao_values);
+  bake::destroyAOContext( context );
+}
+
+
+bake::AOContext* bake::createAOContext(
+    const Scene&      occluders,
+    const bool        cpu_mode,
+    const bool        conserve_memory,
+    const int*        devices,
+    const size_t      num_devices,
+    const AccelPreset accel_preset,
+    const GroundPlane* ground_plane,
+    const AOBackend   backend,
+    const bool        peer_geometry,
+    const bool        managed_geometry
+    )
+{
+  AOContext* ctx = new AOContext;
+  ctx->optix = NULL;
+  ctx->embree = NULL;
+  ctx->prime = NULL;
+  ctx->occluders = occluders;
+  ctx->instances.assign( occluders.instances, occluders.instances + occluders.num_instances );
+  ctx->cpu_mode = cpu_mode;
+  ctx->conserve_memory = conserve_memory;
+  if ( num_devices > 0 ) ctx->devices.assign( devices, devices + num_devices );
+  ctx->peer_geometry = peer_geometry;
+  ctx->managed_geometry = managed_geometry;
+  ctx->accel_preset = accel_preset;
+  ctx->checkpoint_hash = 0;
+  ctx->queries_in_flight = 0;
+  ctx->latency_budget_ms = 0.0f;
+  ctx->far_field_fraction = 0.0f;
+  ctx->far_field_resolution = 0;
+  ctx->has_ground_plane = ground_plane != NULL;
+  if ( ground_plane ) ctx->ground_plane = *ground_plane;
+
+  // Occluders in caller owned device memory are built over in place, which only the Prime tracer on the devices does
+  bool device_geometry = false;
+  for (size_t i = 0; i < occluders.num_meshes; ++i) {
+    if ( occluders.meshes[i].geometry_memory == MEMORY_SPACE_DEVICE ) device_geometry = true;
+  }
+  if ( device_geometry ) {
+    if ( cpu_mode || backend != AO_BACKEND_OPTIX_PRIME ) {
+      std::cerr << "Occluder geometry is in device memory, tracing with OptiX Prime on the devices" << std::endl;
+    }
+    ctx->cpu_mode = false;
+    ctx->backend = AO_BACKEND_OPTIX_PRIME;
+    primeContext( ctx );
+    return ctx;
+  }
+
+  // Auto only takes OptiX where it has hardware to run on; asked for explicitly, it runs on any device it supports.
+  // Without devices, hybrid is the same as auto.
+  const bool hybrid = backend == AO_BACKEND_HYBRID && !cpu_mode;
+  if ( !cpu_mode && ( backend == AO_BACKEND_AUTO || backend == AO_BACKEND_OPTIX || hybrid ) ) {
+    ctx->optix = bake::ao_optix_create_context( occluders, conserve_memory, devices, num_devices, accel_preset, ground_plane, 
+                                                backend != AO_BACKEND_OPTIX );
+    if ( !ctx->optix && backend == AO_BACKEND_OPTIX ) {
+      std::cerr << "OptiX backend not available, tracing with OptiX Prime" << std::endl;
+    }
+  }
+
+  // Embree is the host tracer of choice, and also runs when asked for with cpu_mode off
+  if ( ( cpu_mode && ( backend == AO_BACKEND_AUTO || backend == AO_BACKEND_HYBRID ) ) || backend == AO_BACKEND_EMBREE || hybrid ) {
+    ctx->embree = bake::ao_embree_create_context( occluders, conserve_memory, accel_preset, ground_plane );
+    if ( !ctx->embree && backend == AO_BACKEND_EMBREE ) {
+      std::cerr << "Embree backend not available, tracing with OptiX Prime" << std::endl;
+    } else if ( !ctx->embree && hybrid ) {
+      std::cerr << "Embree backend not available, tracing on the devices only" << std::endl;
+    }
+  }
+  if ( hybrid && ctx->embree ) {
+    ctx->backend = AO_BACKEND_HYBRID;
+  } else {
+    ctx->backend = ctx->optix ? AO_BACKEND_OPTIX : ctx->embree ? AO_BACKEND_EMBREE : AO_BACKEND_OPTIX_PRIME;
+  }
+  if ( !ctx->optix && ( !ctx->embree || ctx->backend == AO_BACKEND_HYBRID ) ) primeContext( ctx );
+  return ctx;
+}
+
+
+void bake::prepareDevices( const bool cpu_mode, const int* devices, const size_t num_devices )
+{
+  bake::ao_optix_prime_prepare_devices( cpu_mode, devices, num_devices );
+}
+
+
+void bake::releasePreparedDevices()
+{
+  bake::ao_optix_prime_release_prepared_devices();
+}
+
+
+void bake::setMeshLibraryBudget( const size_t device_bytes )
+{
+  bake::ao_optix_prime_set_mesh_library_budget( device_bytes );
+}
+
+
+bake::AOBackend bake::getAOBackend( const AOContext* context )
+{
+  return context->backend;
+}
+
+
+void bake::computeAO(
+    AOContext*        context,
+    const Scene&      scene,
+    const AOSamples&  ao_samples,
+    const int         rays_per_sample,
+    const float       scene_offset,
+    const float       scene_maxdistance,
+    const size_t      batch_size,
+    const int         passes_per_query,
+    const float       adaptive_tolerance,
+    float*            ao_values
+    )
+{
+  if ( traceHostSamples( context, scene,
+      ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batch_size, passes_per_query, adaptive_tolerance, ao_values) ) {
+    return;
+  }
+  bake::ao_optix_prime( primeContext( context ), scene,
+    ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batch_size, passes_per_query, adaptive_tolerance, ao_values);
+}
+
+
+void bake::computeAOPerInstance(
+    AOContext*        context,
+    const Scene&      scene,
+    const AOSamples&  ao_samples,
+    const size_t*     num_samples_per_instance,
+    const int*        rays_per_instance,
+    const float       scene_offset,
+    const float       scene_maxdistance,
+    const size_t      batch_size,
+    const int         passes_per_query,
+    const float       adaptive_tolerance,
+    float*            ao_values
+    )
+{
+  assert( ao_samples.sample_positions && !ao_samples.tri_sample_counts );
+  size_t first_sample = 0;
+  size_t first_triangle = 0;
+  size_t begin = 0;
+  while ( begin < scene.num_instances ) {
+    // A run of instances with the same rays is one call, as a chunk of the whole bake
+    size_t end = begin;
+    size_t num_samples = 0;
+    size_t num_triangles = 0;
+    while ( end < scene.num_instances && rays_per_instance[end] == rays_per_instance[begin] ) {
+      num_samples += num_samples_per_instance[end];
+      num_triangles += scene.meshes[scene.instances[end].mesh_index].num_triangles;
+      ++end;
+    }
+    if ( num_samples > 0 ) {
+      const Scene run_scene = { scene.meshes, scene.num_meshes, scene.instances + begin, end - begin };
+      AOSamples run = ao_samples;
+      run.num_samples = num_samples;
+      run.sample_positions    += 3*first_sample;
+      run.sample_normals      += 3*first_sample;
+      run.sample_face_normals += 3*first_sample;
+      if ( run.sample_infos ) run.sample_infos += first_sample;
+      if ( run.compact_sample_infos ) run.compact_sample_infos += first_sample;
+      if ( run.sample_instances ) run.sample_instances += first_sample;
+      if ( run.tri_sample_dA ) run.tri_sample_dA += first_triangle;
+      run.first_sample_index = ao_samples.first_sample_index + first_sample;
+      bake::computeAO( context, run_scene, run, rays_per_instance[begin], scene_offset, scene_maxdistance, batch_size, 
+        passes_per_query, adaptive_tolerance, ao_values + first_sample );
+    }
+    first_sample += num_samples;
+    first_triangle += num_triangles;
+    begin = end;
+  }
+}
+
+
+void bake::computeAO(
+    AOContext*        context,
+    const Scene&      scene,
+    const AOSamples&  ao_samples,
+    AOSampleProvider  provider,
+    void*             provider_data,
+    const int         rays_per_sample,
+    const float       scene_offset,
+    const float       scene_maxdistance,
+    const size_t      batch_size,
+    const int         passes_per_query,
+    const float       adaptive_tolerance,
+    float*            ao_values,
+    AOBatchCallback   batch_callback,
+    void*             batch_data
+    )
+{
+  assert( provider && !ao_samples.sample_positions && !ao_samples.sample_normals && !ao_samples.tri_sample_counts );
+  assert( ao_samples.sample_memory == MEMORY_SPACE_HOST );
+
+  // The provider runs in the thread of a device; its parallel loops may use the cores the other threads leave
+  ScopedNestedParallelism nested;
+  bake::ao_optix_prime( primeContext( context ), scene,
+    ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batch_size, passes_per_query, adaptive_tolerance, ao_values, NULL, 
+    NULL, 0, false, NULL, OPEN_DIRECTIONS_NONE, provider, provider_data, batch_callback, batch_data );
+}
+
+
+bake::SampleSpill* bake::createSampleSpill(
+    const char*       directory,
+    const size_t      num_samples,
+    const size_t      block_size
+    )
+{
+  return bake::create_sample_spill( directory, num_samples, block_size );
+}
+
+
+void bake::destroySampleSpill( SampleSpill* spill )
+{
+  bake::destroy_sample_spill( spill );
+}
+
+
+bool bake::spillSamples(
+    SampleSpill*      spill,
+    const AOSamples&  ao_samples,
+    const size_t      first_sample
+    )
+{
+  return bake::spill_samples( spill, ao_samples, first_sample );
+}
+
+
+bool bake::computeAOSpilled(
+    AOContext*        context,
+    const Scene&      scene,
+    SampleSpill*      spill,
+    const size_t      first_sample_index,
+    const int         rays_per_sample,
+    const float       scene_offset,
+    const float       scene_maxdistance,
+    const size_t      batch_size,
+    const int         passes_per_query,
+    const float       adaptive_tolerance
+    )
+{
+  AOSamples ao_samples = AOSamples();
+  ao_samples.num_samples = bake::spilled_sample_count( spill );
+  ao_samples.sample_memory = MEMORY_SPACE_HOST;
+  ao_samples.ao_memory = MEMORY_SPACE_HOST;
+  ao_samples.first_sample_index = first_sample_index;
+
+  bake::begin_spilled_trace( spill );
+  bake::computeAO( context, scene, ao_samples, bake::provide_spilled_samples, spill, rays_per_sample, scene_offset, scene_maxdistance,
+    batch_size > 0 ? batch_size : bake::spill_block_size( spill ), passes_per_query, adaptive_tolerance, NULL, 
+    bake::write_back_spilled_ao, spill );
+  return bake::end_spilled_trace( spill );
+}
+
+
+bool bake::readSpilledSamples(
+    SampleSpill*      spill,
+    const size_t      first_sample,
+    const size_t      num_samples,
+    SampleInfo*       sample_infos,
+    float*            ao_values
+    )
+{
+  return bake::read_spilled_samples( spill, first_sample, num_samples, sample_infos, ao_values );
+}
+
+
+void bake::computeAO(
+    AOContext*        context,
+    const Scene&      scene,
+    const AOSamples&  ao_samples,
+    const int         rays_per_sample,
+    const float       scene_offset,
+    const float       scene_maxdistance,
+    const size_t      batch_size,
+    const int         passes_per_query,
+    const float       adaptive_tolerance,
+    float*            ao_values,
+    AOBatchCallback   batch_callback,
+    void*             batch_data
+    )
+{
+  assert( batch_callback );
+  bake::ao_optix_prime( primeContext( context ), scene,
+    ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batch_size, passes_per_query, adaptive_tolerance, ao_values, NULL, 
+    NULL, 0, false, NULL, OPEN_DIRECTIONS_NONE, NULL, NULL, batch_callback, batch_data );
+}
+
+
+void bake::computeAOToVertices(
+    AOContext*        context,
+    const Scene&      scene,
+    const AOSamples&  ao_samples,
+    const int         rays_per_sample,
+    const float       scene_offset,
+    const float       scene_maxdistance,
+    const size_t      batch_size,
+    const int         passes_per_query,
+    const float       adaptive_tolerance,
+    float*            ao_values,
+    float**           vertex_ao
+    )
+{
+  // Splatting onto vertices is Prime only
+  bake::ao_optix_prime( primeContext( context ), scene,
+    ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batch_size, passes_per_query, adaptive_tolerance, ao_values, vertex_ao);
+}
+
+
+void bake::computeAOToPackedVertices(
+    AOContext*        context,
+    const Scene&      scene,
+    const AOSamples&  ao_samples,
+    const int         rays_per_sample,
+    const float       scene_offset,
+    const float       scene_maxdistance,
+    const size_t      batch_size,
+    const int         passes_per_query,
+    const float       adaptive_tolerance,
+    const unsigned    bits,
+    unsigned char*    packed_vertex_ao
+    )
+{
+  bake::ao_optix_prime( primeContext( context ), scene,
+    ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batch_size, passes_per_query, adaptive_tolerance, NULL, NULL,
+    NULL, 0, false, NULL, OPEN_DIRECTIONS_NONE, NULL, NULL, NULL, NULL, bits, packed_vertex_ao );
+}
+
+
+int bake::computeAOProgressive(
+    AOContext*        context,
+    const Scene&      scene,
+    const AOSamples&  ao_samples,
+    const int         rays_per_sample,
+    const float       scene_offset,
+    const float       scene_maxdistance,
+    const size_t      batch_size,
+    const int         passes_per_query,
+    const double      time_budget,
+    float*            ao_values,
+    AOSnapshotCallback snapshot,
+    void*             snapshot_data,
+    AOPriorityCallback priority,
+    void*             priority_data
+    )
+{
+  // Progressive tracing keeps per-batch state on the devices, which only the Prime tracer has
+  return bake::ao_optix_prime_progressive( primeContext( context ), scene,
+    ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batch_size, passes_per_query, time_budget, ao_values, snapshot, snapshot_data,
+    priority, priority_data );
+}
+
+
+void bake::computeAOTwoSided(
+    AOContext*        context,
+    const Scene&      scene,
+    const AOSamples&  ao_samples,
+    const int         rays_per_sample,
+    const float       scene_offset,
+    const float       scene_maxdistance,
+    const size_t      batch_size,
+    const int         passes_per_query,
+    float*            ao_values
+    )
+{
+  if ( traceHostSamples( context, scene,
+      ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batch_size, passes_per_query, 0.0f, ao_values, NULL, 0, true) ) {
+    return;
+  }
+  bake::ao_optix_prime( primeContext( context ), scene,
+    ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batch_size, passes_per_query, 0.0f, ao_values, NULL, NULL, 0, true);
+}
+
+
+void bake::computeAOMultiRadius(
+    AOContext*        context,
+    const Scene&      scene,
+    const AOSamples&  ao_samples,
+    const int         rays_per_sample,
+    const float       scene_offset,
+    const float*      radii,
+    const size_t      num_radii,
+    const size_t      batch_size,
+    const int         passes_per_query,
+    float*            ao_values
+    )
+{
+  assert( num_radii > 0 && num_radii <= MAX_AO_RADII );
+  if ( traceHostSamples( context, scene,
+      ao_samples, rays_per_sample, scene_offset, radii[num_radii-1], batch_size, passes_per_query, 0.0f, ao_values, radii, num_radii) ) {
+    return;
+  }
+  bake::ao_optix_prime( primeContext( context ), scene,
+    ao_samples, rays_per_sample, scene_offset, radii[num_radii-1], batch_size, passes_per_query, 0.0f, ao_values, NULL, radii, num_radii);
+}
+
+
+void bake::computeAOBentNormals(
+    AOContext*        context,
+    const Scene&      scene,
+    const AOSamples&  ao_samples,
+    const int         rays_per_sample,
+    const float       scene_offset,
+    const float       scene_maxdistance,
+    const size_t      batch_size,
+    const int         passes_per_query,
+    float*            ao_values
+    )
+{
+  bake::ao_optix_prime( primeContext( context ), scene,
+    ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batch_size, passes_per_query, 0.0f, ao_values, NULL, NULL, 0, false, NULL, 
+    OPEN_DIRECTIONS_BENT_NORMAL);
+}
+
+
+void bake::computeAOSHVisibility(
+    AOContext*        context,
+    const Scene&      scene,
+    const AOSamples&  ao_samples,
+    const int         rays_per_sample,
+    const float       scene_offset,
+    const float       scene_maxdistance,
+    const size_t      batch_size,
+    const int         passes_per_query,
+    float*            sh_values
+    )
+{
+  bake::ao_optix_prime( primeContext( context ), scene,
+    ao_samples, rays_per_sample, scene_offset, scene_maxdistance, batch_size, passes_per_query, 0.0f, sh_values, NULL, NULL, 0, false, NULL, 
+    OPEN_DIRECTIONS_SH_L1);
+}
+
+
+void bake::updateAOContextInstances( AOContext* context, const Instance* instances, const size_t num_instances )
+{
+  context->instances.assign( instances, instances + num_instances );
+  context->occluders.num_instances = num_instances;
+  context->occluders.instances = context->instances.empty() ? NULL : &context->instances[0];
+  // A mask of another number of instances is of another layout
+  if ( context->occluder_mask.size() != num_instances ) context->occluder_mask.clear();
+  updateTopLevel( context, false );
+}
+
+
+void bake::updateAOContextGeometry( AOContext* context, const Mesh* meshes, const size_t num_meshes )
+{
+  assert( num_meshes == context->occluders.num_meshes );
+  for (size_t i = 0; i < num_meshes; ++i) {
+    assert( meshes[i].num_vertices == context->occluders.meshes[i].num_vertices );
+    assert( meshes[i].num_triangles == context->occluders.meshes[i].num_triangles );
+  }
+  Timer timer;
+  timer.start();
+  context->meshes.assign( meshes, meshes + num_meshes );
+  context->occluders.meshes = context->meshes.empty() ? NULL : &context->meshes[0];
+  context->occluders.instances = context->instances.empty() ? NULL : &context->instances[0];
+  std::vector<Instance> visible_instances;
+  const Scene visible = visibleOccluders( context, visible_instances );
+  if ( context->optix ) {
+    bake::ao_optix_update_geometry( context->optix, context->occluders.meshes, num_meshes, context->occluders.instances, 
+      context->occluders.num_instances, context->occluder_mask.empty() ? NULL : &context->occluder_mask[0] );
+  }
+  if ( context->embree ) {
+    bake::ao_embree_update_geometry( context->embree, context->occluders.meshes, num_meshes, visible.instances, visible.num_instances );
+  }
+  if ( context->prime ) {
+    // Prime can't refit, so its mesh models are built again, under the scene model and with the batch slots it keeps
+    bake::ao_optix_prime_set_occluders( context->prime, visible );
+    if ( context->far_field_fraction > 0.0f ) {
+      bake::ao_optix_prime_set_far_field( context->prime, visible, context->far_field_fraction, context->far_field_resolution );
+    }
+  }
+  timer.stop();
+  recordTime( "ao.geometry_update", timer );
+  recordCount( "ao.geometry_updates", 1 );
+}
+
+
+void bake::setAOOccluderMask( AOContext* context, const unsigned char* visible, const size_t num_instances )
+{
+  assert( !visible || num_instances == context->instances.size() );
+  if ( visible && std::count( visible, visible + num_instances, 0 ) > 0 ) {
+    context->occluder_mask.assign( visible, visible + num_instances );
+  } else if ( context->occluder_mask.empty() ) {
+    return;  // all visible already
+  } else {
+    context->occluder_mask.clear();
+  }
+  Timer timer;
+  timer.start();
+  updateTopLevel( context, false );
+  timer.stop();
+  recordTime( "ao.occluder_mask", timer );
+  recordCount( "ao.occluder_masks", 1 );
+}
+
+
+void bake::setAOCheckpoint( AOContext* context, const char* checkpoint_dir, const uint64_t bake_hash )
+{
+  context->checkpoint_dir = checkpoint_dir ? checkpoint_dir : "";
+  context->checkpoint_hash = bake_hash;
+  if ( context->prime ) bake::ao_optix_prime_set_checkpoint( context->prime, checkpoint_dir, bake_hash );
+}
+
+
+void bake::setAOQueriesInFlight( AOContext* context, const size_t num_queries )
+{
+  context->queries_in_flight = num_queries;
+  if ( context->prime ) bake::ao_optix_prime_set_queries_in_flight( context->prime, num_queries );
+}
+
+
+void bake::setAOLatencyBudget( AOContext* context, const float milliseconds )
+{
+  context->latency_budget_ms = milliseconds;
+  if ( context->prime ) bake::ao_optix_prime_set_latency_budget( context->prime, milliseconds );
+}
+
+
+void bake::setAOFarField( AOContext* context, const float near_fraction, const int resolution )
+{
+  context->far_field_fraction = near_fraction;
+  context->far_field_resolution = resolution;
+  if ( context->prime ) {
+    context->occluders.instances = context->instances.empty() ? NULL : &context->instances[0];
+    bake::ao_optix_prime_set_far_field( context->prime, context->occluders, near_fraction, resolution );
+  }
+}
+
+
+void bake::setProgressCallback( ProgressCallback callback, void* progress_data )
+{
+  setProgressFunction( callback, progress_data );
+}
+
+
+void bake::setKernelTuning( const bool tune )
+{
+  tuneKernelLaunches( tune );
+}
+
+
+void bake::destroyAOContext( AOContext* context )
+{
+  if ( !context ) return;
+  bake::ao_optix_destroy_context( context->optix );
+  bake::ao_embree_destroy_context( context->embree );
+  bake::ao_optix_prime_destroy_context( context->prime );
+  delete context;
+}
+
+
+bake::ObjectBakeSession* bake::createObjectBakeSession( const int device, const AccelPreset accel_preset )
+{
+  ObjectBakeSession* session = new ObjectBakeSession;
+  session->device = device;
+  session->accel_preset = accel_preset;
+  session->context = NULL;
+  bake::prepareDevices( false, &device, 1 );
+  return session;
+}
+
+
+void bake::bakeObjectAO(
+    ObjectBakeSession* session,
+    const Mesh&       mesh,
+    const float       min_samples_per_triangle,
+    const int         rays_per_sample,
+    const float       scene_offset,
+    const float       scene_maxdistance,
+    float*            vertex_ao,
+    const MemorySpace vertex_ao_memory
+    )
+{
+  Timer timer;
+  timer.start();
+  session->mesh = mesh;
+  Instance& instance = session->instance;
+  std::fill( instance.xform, instance.xform + 16, 0.0f );
+  for (int k = 0; k < 4; ++k) instance.xform[5*k] = 1.0f;
+  instance.storage_identifier = 0;
+  instance.mesh_index = 0;
+  std::copy( mesh.bbox_min, mesh.bbox_min + 3, instance.bbox_min );
+  std::copy( mesh.bbox_max, mesh.bbox_max + 3, instance.bbox_max );
+  const Scene scene = { &session->mesh, 1, &session->instance, 1 };
+
+  // The first object makes the context; the others only build their own accel under its scene model
+  AOContext* context = session->context;
+  if ( !context ) {
+    context = session->context = bake::createAOContext( scene, false, false, &session->device, 1, session->accel_preset, NULL, 
+                                                        AO_BACKEND_OPTIX_PRIME );
+    bake::setAOQueriesInFlight( context, 1 );  // one batch per object
+  } else {
+    context->occluders = scene;
+    context->instances.assign( scene.instances, scene.instances + 1 );
+    context->occluders.instances = &context->instances[0];
+    bake::ao_optix_prime_set_occluders( context->prime, context->occluders );
+  }
+
+  size_t num_samples = 0;
+  SamplingPlan plan;
+  const size_t total_samples = bake::distributeSamples( scene, min_samples_per_triangle, 0, &num_samples, &plan );
+  session->tri_sample_counts.resize( std::max( mesh.num_triangles, size_t(1) ) );
+  session->sample_infos.resize( std::max( total_samples, size_t(1) ) );
+  AOSamples ao_samples;
+  std::memset( &ao_samples, 0, sizeof( ao_samples ) );
+  ao_samples.num_samples = total_samples;
+  ao_samples.sample_infos = &session->sample_infos[0];
+  ao_samples.tri_sample_counts = &session->tri_sample_counts[0];
+  ao_samples.sample_memory = MEMORY_SPACE_HOST;
+  ao_samples.ao_memory = vertex_ao_memory;
+  bake::sampleInstances( scene, &num_samples, min_samples_per_triangle, ao_samples, &plan );
+
+  // All the passes in one query, and the filter's sums normalized straight into vertex_ao
+  float* vertex_ao_ptrs[] = { vertex_ao };
+  bake::computeAOToVertices( context, scene, ao_samples, rays_per_sample, scene_offset, scene_maxdistance, 0, rays_per_sample, 0.0f, 
+                             NULL, vertex_ao_ptrs );
+  timer.stop();
+  recordTime( "ao.object_bake", timer );
+  recordCount( "ao.object_bakes", 1 );
+}
+
+
+void bake::destroyObjectBakeSession( ObjectBakeSession* session )
+{
+  if ( !session ) return;
+  bake::destroyAOContext( session->context );
+  delete session;
+}
+
+
+namespace {
+
+// Traces a host sample set with just the given samples of ao_samples, and puts their AO back into ao_values
+void traceSampleSubset( bake::AOContext* context, const bake::Scene& scene, const bake::AOSamples& ao_samples, 
+  const std::vector<size_t>& indices, const int rays_per_sample, const float scene_offset, const float scene_maxdistance, 
+  const size_t batch_size, const int passes_per_query, const float adaptive_tolerance, float* ao_values )
+{
+  const size_t n = indices.size();
+  if ( n == 0 ) return;
+  std::vector<float> positions( 3*n ), normals( 3*n ), face_normals( 3*n ), subset_ao( n, 0.0f );
+#pragma omp parallel for if( n >= (1 << 16) )
+  for (ptrdiff_t i = 0; i < ptrdiff_t(n); ++i) {
+    const size_t src = indices[i];
+    std::copy( ao_samples.sample_positions + 3*src,    ao_samples.sample_positions + 3*src + 3,    &positions[3*i] );
+    std::copy( ao_samples.sample_normals + 3*src,      ao_samples.sample_normals + 3*src + 3,      &normals[3*i] );
+    std::copy( ao_samples.sample_face_normals + 3*src, ao_samples.sample_face_normals + 3*src + 3, &face_normals[3*i] );
+  }
+
+  bake::AOSamples subset = bake::AOSamples();
+  subset.num_samples         = n;
+  subset.sample_positions    = &positions[0];
+  subset.sample_normals      = &normals[0];
+  subset.sample_face_normals = &face_normals[0];
+  bake::computeAO( context, scene, subset, rays_per_sample, scene_offset, scene_maxdistance, batch_size, passes_per_query, 
+    adaptive_tolerance, &subset_ao[0] );
+
+  for (size_t i = 0; i < n; ++i) {
+    ao_values[indices[i]] = subset_ao[i];
+  }
+}
+
+}
+
+
+size_t bake::recomputeAONearBoxes(
+    AOContext*        context,
+    const Scene&      scene,
+    const AOSamples&  ao_samples,
+    const float*      box_mins,
+    const float*      box_maxs,
+    const size_t      num_boxes,
+    const int         rays_per_sample,
+    const float       scene_offset,
+    const float       scene_maxdistance,
+    const size_t      batch_size,
+    const int         passes_per_query,
+    const float       adaptive_tolerance,
+    float*            ao_values
+    )
+{
+  assert( ao_samples.sample_positions && ao_samples.sample_normals && ao_samples.sample_face_normals );
+  assert( ao_samples.sample_memory == MEMORY_SPACE_HOST && ao_samples.ao_memory == MEMORY_SPACE_HOST );
+
+  // Rays start at most scene_offset from the sample and hits only count up to scene_maxdistance past that
+  const float reach = scene_offset + scene_maxdistance;
+  const float reach_sq = reach*reach;
+
+  std::vector<unsigned char> near_box( ao_samples.num_samples, 0 );
+#pragma omp parallel for if( ao_samples.num_samples >= (1 << 16) )
+  for (ptrdiff_t i = 0; i < ptrdiff_t(ao_samples.num_samples); ++i) {
+    const float* p = ao_samples.sample_positions + 3*i;
+    for (size_t b = 0; b < num_boxes; ++b) {
+      float dist_sq = 0.0f;
+      for (int k = 0; k < 3; ++k) {
+        const float d = std::max( std::max( box_mins[3*b+k] - p[k], p[k] - box_maxs[3*b+k] ), 0.0f );
+        dist_sq += d*d;
+      }
+      if ( dist_sq <= reach_sq ) {
+        near_box[i] = 1;
+        break;
+      }
+    }
+  }
+
+  std::vector<size_t> indices;
+  for (size_t i = 0; i < ao_samples.num_samples; ++i) {
+    if ( near_box[i] ) indices.push_back( i );
+  }
+  traceSampleSubset( context, scene, ao_samples, indices, rays_per_sample, scene_offset, scene_maxdistance, batch_size, 
+    passes_per_query, adaptive_tolerance, ao_values );
+  return indices.size();
+}
+
+
+size_t bake::computeAOCached(
+    AOContext*        context,
+    const Scene&      scene,
+    const AOSamples&  ao_samples,
+    const int         rays_per_sample,
+    const float       scene_offset,
+    const float       scene_maxdistance,
+    const size_t      batch_size,
+    const int         passes_per_query,
+    const float       adaptive_tolerance,
+    const float       cell_size,
+    const float       error_threshold,
+    float*            ao_values
+    )
+{
+  assert( ao_samples.sample_positions && ao_samples.sample_normals && ao_samples.sample_face_normals );
+  assert( ao_samples.sample_memory == MEMORY_SPACE_HOST && ao_samples.ao_memory == MEMORY_SPACE_HOST );
+  assert( cell_size > 0.0f );
+  ProfileRange range( "cached ao", PROFILE_COLOR_TRACE, uint64_t( ao_samples.num_samples ) );
+  Timer timer;
+  timer.start();
+
+  AOCacheCells cells;
+  bake::ao_cache_cells( ao_samples, cell_size, cells );
+  traceSampleSubset( context, scene, ao_samples, cells.records, rays_per_sample, scene_offset, scene_maxdistance, batch_size, 
+    passes_per_query, adaptive_tolerance, ao_values );
+
+  std::vector<size_t> refine_samples;
+  bake::ao_cache_interpolate( ao_samples, cells, error_threshold, ao_values, refine_samples );
+  traceSampleSubset( context, scene, ao_samples, refine_samples, rays_per_sample, scene_offset, scene_maxdistance, batch_size, 
+    passes_per_query, adaptive_tolerance, ao_values );
 
+  timer.stop();
+  const size_t num_traced = cells.records.size() + refine_samples.size();
+  std::cerr << "\tao cache: " << cells.records.size() << " records, " << refine_samples.size() << " refined, " 
+            << ao_samples.num_samples - num_traced << " of " << ao_samples.num_samples << " samples interpolated ... ";
+  recordCount( "ao.cache_records", cells.records.size() );
+  recordCount( "ao.cache_refined", refine_samples.size() );
+  recordCount( "ao.cache_interpolated", ao_samples.num_samples - num_traced );
+  recordTime( "ao.cache", timer );
+  return num_traced;
+}
+
+
+void* bake::allocateHostMemory( const size_t bytes, const bool pinned )
+{
+  void* ptr = NULL;
+  if ( bytes >= LARGE_HOST_ALLOCATION && ( ptr = allocateLargeHostMemory( bytes, pinned ) ) != NULL ) {
+    return ptr;
+  }
+  // Portable, so that every device can copy to and from it
+  if ( pinned && cudaHostAlloc( &ptr, std::max( bytes, size_t(1) ), cudaHostAllocPortable ) == cudaSuccess ) {
+    return ptr;
+  }
+  cudaGetLastError();
+  return std::malloc( std::max( bytes, size_t(1) ) );
+}
+
+
+void bake::freeHostMemory( void* ptr )
+{
+  if ( freeLargeHostMemory( ptr ) ) return;
+  if ( isPinnedHostMemory( ptr ) ) {
+    CHK_CUDA( cudaFreeHost( ptr ) );
+  } else {
+    std::free( ptr );
+  }
 }
 
 
 size_t bake::distributeSamples(
     const Scene&    scene,
-    const size_t    min_samples_per_triangle,
+    const float     min_samples_per_triangle,
     const size_t    requested_num_samples,
-    size_t*         num_samples_per_instance
+    size_t*         num_samples_per_instance,
+    SamplingPlan*   plan
     )
 {
 
-  return bake::distribute_samples( scene, min_samples_per_triangle, requested_num_samples, num_samples_per_instance );
+  ProfileRange range( "distribute samples", PROFILE_COLOR_SAMPLE, uint64_t( scene.num_instances ) );
+  Timer timer;
+  timer.start();
+  const size_t num_samples = bake::distribute_samples( scene, min_samples_per_triangle, requested_num_samples, num_samples_per_instance, plan );
+  timer.stop();
+  recordTime( "sample.distribute", timer );
+  return num_samples;
 
 }
 
@@ -66,15 +1048,330 @@ size_t bake::distributeSamples(
 void bake::sampleInstances(
     const Scene&  scene,
     const size_t* num_samples_per_instance,
-    const size_t  min_samples_per_triangle,
+    const float   min_samples_per_triangle,
+    AOSamples&    ao_samples,
+    const SamplingPlan* plan,
+    const bool    sample_templates
+    )
+{
+
+  ProfileRange range( "sample instances", PROFILE_COLOR_SAMPLE, uint64_t( ao_samples.num_samples ) );
+  bake::sample_instances( scene, num_samples_per_instance, min_samples_per_triangle, ao_samples, plan, sample_templates );
+
+}
+
+
+void bake::sampleInstanceRange(
+    const Scene&  scene,
+    const size_t* num_samples_per_instance,
+    const float   min_samples_per_triangle,
+    const SamplingPlan* plan,
+    const size_t  first_sample,
+    AOSamples&    range_samples
+    )
+{
+
+  assert( range_samples.sample_memory == MEMORY_SPACE_HOST );
+  bake::sample_instance_range( scene, num_samples_per_instance, min_samples_per_triangle, plan, first_sample, range_samples );
+
+}
+
+
+void bake::weighSamplesByVariance(
+    const Scene&     scene,
+    const size_t*    num_samples_per_instance,
+    const AOSamples& pilot_samples,
+    const float*     pilot_ao,
+    SamplingPlan&    plan
+    )
+{
+
+  assert( pilot_samples.sample_infos );
+  ProfileRange range( "weigh samples", PROFILE_COLOR_SAMPLE, uint64_t( pilot_samples.num_samples ) );
+  Timer timer;
+  timer.start();
+  bake::weigh_samples_by_variance( scene, num_samples_per_instance, pilot_samples, pilot_ao, plan );
+  timer.stop();
+  recordTime( "sample.weigh", timer );
+
+}
+
+
+void bake::sampleVertices(
+    const Scene&  scene,
     AOSamples&    ao_samples
     )
 {
 
-  bake::sample_instances( scene, num_samples_per_instance, min_samples_per_triangle, ao_samples );
+  assert( ao_samples.sample_positions && ao_samples.sample_normals && ao_samples.sample_face_normals );
+  assert( ao_samples.sample_memory == MEMORY_SPACE_HOST );
+  ProfileRange range( "sample vertices", PROFILE_COLOR_SAMPLE, uint64_t( ao_samples.num_samples ) );
+  bake::sample_vertices( scene, ao_samples );
 
 }
 
+
+void bake::placeSamples(
+    const Scene&  scene,
+    const size_t* num_samples_per_instance,
+    AOSamples&    ao_samples
+    )
+{
+  assert( ao_samples.sample_infos || ( ao_samples.compact_sample_infos && ao_samples.tri_sample_dA ) );
+  assert( ao_samples.sample_memory == MEMORY_SPACE_HOST );
+  ProfileRange range( "place samples", PROFILE_COLOR_SAMPLE, uint64_t( ao_samples.num_samples ) );
+  bake::place_samples( scene, num_samples_per_instance, ao_samples );
+}
+
+
+void bake::sortSamples(
+    AOSamples&    ao_samples,
+    const float   bbox_min[3],
+    const float   bbox_max[3],
+    size_t*       sorted_order
+    )
+{
+
+  assert( ao_samples.sample_positions && ao_samples.sample_normals );
+  assert( ao_samples.sample_memory == MEMORY_SPACE_HOST );
+  ProfileRange range( "sort samples", PROFILE_COLOR_SAMPLE, uint64_t( ao_samples.num_samples ) );
+  Timer timer;
+  timer.start();
+  bake::sort_samples( ao_samples, bbox_min, bbox_max, sorted_order );
+  timer.stop();
+  recordTime( "sample.sort", timer );
+
+}
+
+
+void bake::tileSamples(
+    AOSamples&    ao_samples,
+    const float   bbox_min[3],
+    const float   bbox_max[3],
+    const float   tile_size,
+    size_t*       sorted_order,
+    std::vector<SampleTile>& tiles
+    )
+{
+
+  assert( ao_samples.sample_positions && ao_samples.sample_normals );
+  assert( ao_samples.sample_memory == MEMORY_SPACE_HOST );
+  ProfileRange range( "tile samples", PROFILE_COLOR_SAMPLE, uint64_t( ao_samples.num_samples ) );
+  Timer timer;
+  timer.start();
+  bake::tile_samples( ao_samples, bbox_min, bbox_max, tile_size, sorted_order, tiles );
+  timer.stop();
+  recordTime( "sample.tile", timer );
+
+}
+
+
+void bake::unsortSamples(
+    AOSamples&    ao_samples,
+    const size_t* sorted_order,
+    float*        ao_values,
+    const size_t  num_ao_channels
+    )
+{
+
+  assert( ao_samples.sample_memory == MEMORY_SPACE_HOST && ( !ao_values || ao_samples.ao_memory == MEMORY_SPACE_HOST ) );
+  Timer timer;
+  timer.start();
+  bake::unsort_samples( ao_samples, sorted_order, ao_values, num_ao_channels );
+  timer.stop();
+  recordTime( "sample.unsort", timer );
+
+}
+
+namespace {
+
+// Host samples in the device layout of the tracers; the float3 copies are dropped before returning.  Only ray 
+// generation reads face normals, so the sample grid kernels get the shading normals in both lanes, and a third less 
+// to upload.
+void uploadHostSamples( const bake::AOSamples& ao_samples, Buffer<float4>& positions, Buffer<uint2>& normals )
+{
+  const size_t n = ao_samples.num_samples;
+  positions.alloc( n, RTP_BUFFER_TYPE_CUDA_LINEAR );
+  normals.alloc( n, RTP_BUFFER_TYPE_CUDA_LINEAR );
+  if ( n == 0 ) return;
+  Buffer<float3> geometry( 2*n, RTP_BUFFER_TYPE_CUDA_LINEAR );
+  float3* ptr = geometry.ptr();
+  CHK_CUDA( cudaMemcpy( ptr, ao_samples.sample_positions, n*sizeof(float3), cudaMemcpyHostToDevice ) );
+  CHK_CUDA( cudaMemcpy( ptr + n, ao_samples.sample_normals, n*sizeof(float3), cudaMemcpyHostToDevice ) );
+  bake::packSamplesDevice( n, ptr, ptr + n, ptr + n, positions.ptr(), normals.ptr() );
+}
+
+// Square root of the mean area per sample
+float meanSampleSpacing( const bake::AOSamples& ao_samples )
+{
+  const size_t n = ao_samples.num_samples;
+  double area = 0.0;
+#pragma omp parallel for reduction(+:area)
+  for ( ptrdiff_t i = 0; i < ptrdiff_t( n ); ++i ) {
+    area += bake::get_sample_info( ao_samples, size_t( i ) ).dA;
+  }
+  return static_cast<float>( std::sqrt( area / std::max( n, size_t(1) ) ) );
+}
+
+}
+
+void bake::denoiseAO(
+    const AOSamples& ao_samples,
+    const float      radius_scale,
+    float*           ao_values,
+    const size_t     num_ao_channels
+    )
+{
+
+  assert( ao_samples.sample_positions && ao_samples.sample_normals );
+  assert( ao_samples.sample_memory == MEMORY_SPACE_HOST && ao_samples.ao_memory == MEMORY_SPACE_HOST );
+  const size_t n = ao_samples.num_samples;
+  if ( n == 0 || radius_scale <= 0.0f ) return;
+  assert( n < ( size_t(1) << 32 ) );
+  ProfileRange range( "denoise ao", PROFILE_COLOR_FILTER, uint64_t( n ) );
+  Timer timer;
+  timer.start();
+
+  const float radius = radius_scale * meanSampleSpacing( ao_samples );
+
+  // Pack the samples as the tracers do, then drop the float3 copies before the grid is built
+  Buffer<float4> positions;
+  Buffer<uint2> normals;
+  uploadHostSamples( ao_samples, positions, normals );
+  DeviceSamples samples;
+  samples.num_samples = n;
+  samples.positions = positions.ptr();
+  samples.normals = normals.ptr();
+  samples.flat_normals = false;
+
+  Buffer<float> ao( 2*n, RTP_BUFFER_TYPE_CUDA_LINEAR );
+  for ( size_t channel = 0; channel < num_ao_channels; ++channel ) {
+    float* values = ao_values + channel*n;
+    CHK_CUDA( cudaMemcpy( ao.ptr(), values, n*sizeof(float), cudaMemcpyHostToDevice ) );
+    bake::denoiseAODevice( samples, radius, ao.ptr(), ao.ptr() + n );
+    CHK_CUDA( cudaMemcpy( values, ao.ptr() + n, n*sizeof(float), cudaMemcpyDeviceToHost ) );
+  }
+
+  timer.stop();
+  std::cerr << "\tdenoise (radius " << radius << ") ... "; printTimeElapsed( timer );
+  recordTime( "ao.denoise", timer );
+
+}
+
+
+namespace bake {
+
+struct AOTransfer {
+  Buffer<float4>   positions;
+  Buffer<uint2>    normals;
+  Buffer<float>    ao;
+  DeviceSampleGrid grid;
+  float            radius;
+  int              device;
+};
+
+}
+
+bake::AOTransfer* bake::createAOTransfer(
+    const AOSamples& ao_samples,
+    const float*     ao_values,
+    const float      radius_scale
+    )
+{
+  assert( ao_samples.sample_positions && ao_samples.sample_normals );
+  assert( ao_samples.sample_memory == MEMORY_SPACE_HOST && ao_samples.ao_memory == MEMORY_SPACE_HOST );
+  assert( ao_samples.num_samples < ( size_t(1) << 32 ) );
+  ProfileRange range( "build ao transfer", PROFILE_COLOR_FILTER, uint64_t( ao_samples.num_samples ) );
+  const size_t n = ao_samples.num_samples;
+
+  AOTransfer* transfer = new AOTransfer;
+  CHK_CUDA( cudaGetDevice( &transfer->device ) );
+  transfer->radius = radius_scale * meanSampleSpacing( ao_samples );
+  uploadHostSamples( ao_samples, transfer->positions, transfer->normals );
+  transfer->ao.alloc( n, RTP_BUFFER_TYPE_CUDA_LINEAR );
+  if ( n > 0 ) CHK_CUDA( cudaMemcpy( transfer->ao.ptr(), ao_values, n*sizeof(float), cudaMemcpyHostToDevice ) );
+
+  DeviceSamples samples;
+  samples.num_samples = n;
+  samples.positions = transfer->positions.ptr();
+  samples.normals = transfer->normals.ptr();
+  samples.flat_normals = false;
+  bake::buildSampleGridDevice( samples, transfer->radius, transfer->grid );
+  CHK_CUDA( cudaDeviceSynchronize() );
+  return transfer;
+}
+
+void bake::transferAO(
+    const AOTransfer* transfer,
+    const AOSamples&  target_samples,
+    float*            target_ao
+    )
+{
+  assert( target_samples.sample_positions && target_samples.sample_normals );
+  assert( target_samples.sample_memory == MEMORY_SPACE_HOST && target_samples.ao_memory == MEMORY_SPACE_HOST );
+  const size_t n = target_samples.num_samples;
+  if ( n == 0 ) return;
+  ProfileRange range( "transfer ao", PROFILE_COLOR_FILTER, uint64_t( n ) );
+  CHK_CUDA( cudaSetDevice( transfer->device ) );
+
+  Buffer<float4> positions;
+  Buffer<uint2> normals;
+  uploadHostSamples( target_samples, positions, normals );
+  DeviceSamples targets;
+  targets.num_samples = n;
+  targets.positions = positions.ptr();
+  targets.normals = normals.ptr();
+  targets.flat_normals = false;
+  DeviceSamples samples;
+  samples.num_samples = transfer->positions.count();
+  samples.positions = transfer->positions.ptr();
+  samples.normals = transfer->normals.ptr();
+  samples.flat_normals = false;
+
+  Buffer<float> ao( n, RTP_BUFFER_TYPE_CUDA_LINEAR );
+  bake::transferAODevice( samples, transfer->grid, transfer->radius, transfer->ao.ptr(), targets, ao.ptr() );
+  CHK_CUDA( cudaMemcpy( target_ao, ao.ptr(), n*sizeof(float), cudaMemcpyDeviceToHost ) );
+}
+
+void bake::destroyAOTransfer( AOTransfer* transfer )
+{
+  if ( !transfer ) return;
+  CHK_CUDA( cudaSetDevice( transfer->device ) );
+  bake::freeSampleGridDevice( transfer->grid );
+  delete transfer;
+}
+
+
+bool bake::leastSquaresSolverAvailable( const LeastSquaresSolver solver )
+{
+  switch (solver) {
+    case LEAST_SQUARES_SOLVER_SIMPLICIAL: return true;
+#ifdef BAKE_WITH_CHOLMOD
+    case LEAST_SQUARES_SOLVER_CHOLMOD:    return true;
+#endif
+#ifdef BAKE_WITH_PARDISO
+    case LEAST_SQUARES_SOLVER_PARDISO:    return true;
+#endif
+    default:                              return false;
+  }
+}
+
+
+bool bake::leastSquaresOrderingAvailable( const LeastSquaresOrdering ordering )
+{
+  switch (ordering) {
+    case LEAST_SQUARES_ORDERING_AMD:
+    case LEAST_SQUARES_ORDERING_COLAMD:
+    case LEAST_SQUARES_ORDERING_GEOMETRIC:
+    case LEAST_SQUARES_ORDERING_AUTO:     return true;
+#ifdef BAKE_WITH_METIS
+    case LEAST_SQUARES_ORDERING_METIS:    return true;
+#endif
+    default:                              return false;
+  }
+}
+
+
 void bake::mapAOToVertices(
     const Scene&            scene,
     const size_t*           num_samples_per_instance,
@@ -82,22 +1379,298 @@ void bake::mapAOToVertices(
     const float*            ao_values,
     const VertexFilterMode  mode,
     const float             regularization_weight,
-    float**                 vertex_ao
+    float**                 vertex_ao,
+    const char*             cache_dir,
+    const float             analytic_mass_weight,
+    const LeastSquaresSolver ls_solver,
+    const size_t            ls_patch_vertices,
+    const size_t            num_channels,
+    const float             weld_tolerance,
+    const LeastSquaresOrdering ls_ordering,
+    const float*            regularization_weights,
+    const size_t            num_regularization_weights,
+    const float* const*     initial_vertex_ao
     )
 {
+    const size_t num_weights = num_regularization_weights > 0 ? num_regularization_weights : 1;
+    const float* weights = num_regularization_weights > 0 ? regularization_weights : &regularization_weight;
+    // Channels of every weight
+    const size_t num_outputs = num_weights*num_channels;
+
+    ProfileRange range( "map AO to vertices", PROFILE_COLOR_FILTER, uint64_t( ao_samples.num_samples ) );
+    Timer timer;
+    timer.start();
+
+    // Welded meshes stand in for those of the scene, and their instances filter into vertex AO of their own
+    Scene filter_scene = scene;
+    float** filter_vertex_ao = vertex_ao;
+    std::vector<WeldedMesh> welded;
+    std::vector<Mesh> welded_meshes;
+    std::vector< std::vector<float> > welded_ao;
+    std::vector<float*> welded_ao_ptrs;
+    const float* const* filter_initial_ao = initial_vertex_ao;
+    std::vector< std::vector<float> > welded_initial_ao;
+    std::vector<const float*> welded_initial_ptrs;
+    if (weld_tolerance >= 0.0f) {
+      Timer weld_timer;
+      weld_timer.start();
+      welded.resize( scene.num_meshes );
+      welded_meshes.resize( scene.num_meshes );
+      size_t num_vertices = 0, num_welded_vertices = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:num_vertices, num_welded_vertices) if(scene.num_meshes > 1)
+      for (ptrdiff_t m = 0; m < ptrdiff_t(scene.num_meshes); ++m) {
+        weld_mesh( scene.meshes[m], weld_tolerance, welded[m] );
+        welded_meshes[m] = welded[m].mesh;
+        num_vertices += scene.meshes[m].num_vertices;
+        num_welded_vertices += welded[m].mesh.num_vertices;
+      }
+      filter_scene.meshes = welded_meshes.empty() ? NULL : &welded_meshes[0];
+
+      welded_ao.resize( scene.num_instances );
+      welded_ao_ptrs.resize( scene.num_instances );
+      for (size_t i = 0; i < scene.num_instances; ++i) {
+        welded_ao[i].resize( num_outputs*welded_meshes[scene.instances[i].mesh_index].num_vertices );
+        welded_ao_ptrs[i] = welded_ao[i].empty() ? NULL : &welded_ao[i][0];
+      }
+      filter_vertex_ao = welded_ao_ptrs.empty() ? vertex_ao : &welded_ao_ptrs[0];
+
+      // Priors go to the welded vertices too; the copies of a vertex had the same AO
+      if (initial_vertex_ao) {
+        welded_initial_ao.resize( scene.num_instances );
+        welded_initial_ptrs.assign( scene.num_instances, NULL );
+        for (size_t i = 0; i < scene.num_instances; ++i) {
+          if (!initial_vertex_ao[i]) continue;
+          const size_t m = scene.instances[i].mesh_index;
+          welded_initial_ao[i].resize( welded_meshes[m].num_vertices );
+          for (size_t v = 0; v < scene.meshes[m].num_vertices; ++v) welded_initial_ao[i][welded[m].remap[v]] = initial_vertex_ao[i][v];
+          welded_initial_ptrs[i] = welded_initial_ao[i].empty() ? NULL : &welded_initial_ao[i][0];
+        }
+        filter_initial_ao = welded_initial_ptrs.empty() ? NULL : &welded_initial_ptrs[0];
+      }
+      weld_timer.stop();
+      std::cerr << "\n\tweld " << num_vertices << " vertices to " << num_welded_vertices << " ...   ";  printTimeElapsed( weld_timer );
+      recordTime( "filter.weld", weld_timer );
+    }
+
     if (mode == VERTEX_FILTER_AREA_BASED) {
-      bake::filter( scene, num_samples_per_instance, ao_samples, ao_values, vertex_ao ); 
-    } else if (mode == VERTEX_FILTER_LEAST_SQUARES) {
-      bake::filter_least_squares( scene, num_samples_per_instance, ao_samples, ao_values, regularization_weight, vertex_ao ); 
+      std::vector<float*> channel_ao( scene.num_instances );
+      for (size_t c = 0; c < num_channels; ++c) {
+        for (size_t i = 0; i < scene.num_instances; ++i) {
+          channel_ao[i] = filter_vertex_ao[i] + c*filter_scene.meshes[scene.instances[i].mesh_index].num_vertices;
+        }
+        bake::filter( filter_scene, num_samples_per_instance, ao_samples, ao_values + c*ao_samples.num_samples, 
+          channel_ao.empty() ? filter_vertex_ao : &channel_ao[0] ); 
+      }
+      // Nothing to regularize: every weight gets the same result
+      for (size_t i = 0; i < scene.num_instances && num_weights > 1; ++i) {
+        const size_t n = num_channels*filter_scene.meshes[scene.instances[i].mesh_index].num_vertices;
+        for (size_t k = 1; k < num_weights; ++k) std::copy( filter_vertex_ao[i], filter_vertex_ao[i] + n, filter_vertex_ao[i] + k*n );
+      }
+    } else if (mode == VERTEX_FILTER_LEAST_SQUARES || mode == VERTEX_FILTER_LEAST_SQUARES_CG || mode == VERTEX_FILTER_LEAST_SQUARES_MATRIX_FREE ||
+               mode == VERTEX_FILTER_LEAST_SQUARES_FLOAT || mode == VERTEX_FILTER_LEAST_SQUARES_HOST_CG) {
+      bake::filter_least_squares( filter_scene, num_samples_per_instance, ao_samples, ao_values, weights, num_weights, mode, cache_dir, 
+        analytic_mass_weight, ls_solver, ls_ordering, ls_patch_vertices, num_channels, filter_vertex_ao, filter_initial_ao ); 
     } else {
       assert(0 && "invalid vertex filter mode");
     }
+
+    // Every copy of a welded vertex gets its AO
+    if (weld_tolerance >= 0.0f) {
+#pragma omp parallel for schedule(dynamic, 1) if(scene.num_instances > 1)
+      for (ptrdiff_t i = 0; i < ptrdiff_t(scene.num_instances); ++i) {
+        const size_t m = scene.instances[i].mesh_index;
+        const size_t n = scene.meshes[m].num_vertices;
+        const size_t welded_n = welded_meshes[m].num_vertices;
+        const unsigned* remap = welded[m].remap.empty() ? NULL : &welded[m].remap[0];
+        for (size_t c = 0; c < num_outputs; ++c) {
+          for (size_t v = 0; v < n; ++v) vertex_ao[i][c*n + v] = welded_ao[i][c*welded_n + remap[v]];
+        }
+      }
+    }
+    timer.stop();
+    recordTime( "filter.total", timer );
+}
+
+
+void bake::setFilterFrameReuse( const float rigid_tolerance )
+{
+  bake::filter_least_squares_keep_systems( rigid_tolerance );
+}
+
+
+void bake::setFilterConjugateGradient( const float tolerance, const CGPreconditioner preconditioner )
+{
+  bake::filter_least_squares_set_cg( tolerance, preconditioner );
+}
+
+
+size_t bake::vertexAOOffsets( const Scene& scene, const size_t values_per_vertex, size_t* offsets )
+{
+  offsets[0] = 0;
+  for (size_t i = 0; i < scene.num_instances; ++i) {
+    offsets[i+1] = offsets[i] + values_per_vertex*scene.meshes[scene.instances[i].mesh_index].num_vertices;
+  }
+  return offsets[scene.num_instances];
+}
+
+
+void bake::mapAOToVertexArray(
+    const Scene&            scene,
+    const size_t*           num_samples_per_instance,
+    const AOSamples&        ao_samples,
+    const float*            ao_values,
+    const VertexFilterMode  mode,
+    const float             regularization_weight,
+    float*                  vertex_ao,
+    const size_t*           vertex_ao_offsets,
+    const char*             cache_dir,
+    const float             analytic_mass_weight,
+    const LeastSquaresSolver ls_solver,
+    const size_t            ls_patch_vertices,
+    const size_t            num_channels,
+    const float             weld_tolerance,
+    const LeastSquaresOrdering ls_ordering,
+    const float*            regularization_weights,
+    const size_t            num_regularization_weights,
+    const float* const*     initial_vertex_ao
+    )
+{
+  // The filters take a pointer per instance; these point into the one array
+  std::vector<float*> instance_ao( std::max( scene.num_instances, size_t(1) ), (float*)NULL );
+  for (size_t i = 0; i < scene.num_instances; ++i) instance_ao[i] = vertex_ao + vertex_ao_offsets[i];
+  mapAOToVertices( scene, num_samples_per_instance, ao_samples, ao_values, mode, regularization_weight, &instance_ao[0], cache_dir, 
+                   analytic_mass_weight, ls_solver, ls_patch_vertices, num_channels, weld_tolerance, ls_ordering, regularization_weights,
+                   num_regularization_weights, initial_vertex_ao );
+}
+
+
+bake::AOSamples bake::TexelSamples::aoSamples()
+{
+  AOSamples ao_samples;
+  ao_samples.num_samples = size();
+  ao_samples.sample_positions    = positions.empty() ? NULL : &positions[0];
+  ao_samples.sample_normals      = normals.empty() ? NULL : &normals[0];
+  ao_samples.sample_face_normals = face_normals.empty() ? NULL : &face_normals[0];
+  ao_samples.sample_infos = NULL;
+  ao_samples.tri_sample_counts = NULL;
+  ao_samples.compact_sample_infos = NULL;
+  ao_samples.tri_sample_dA = NULL;
+  ao_samples.sample_instances = NULL;
+  ao_samples.sample_memory = MEMORY_SPACE_HOST;
+  ao_samples.ao_memory = MEMORY_SPACE_HOST;
+  ao_samples.first_sample_index = 0;
+  return ao_samples;
+}
+
+
+void bake::sampleTexels(
+    const Scene&    scene,
+    const size_t    instance_index,
+    const unsigned  width,
+    const unsigned  height,
+    const unsigned  first_row,
+    const unsigned  num_rows,
+    TexelSamples&   texel_samples
+    )
+{
+  bake::sample_texels( scene, instance_index, width, height, first_row, num_rows, texel_samples );
 }
 
 
 void bake::mapAOToTextures(
+    const TexelSamples& texel_samples,
+    const float*        ao_values,
+    float*              texture
     )
 {
+  const unsigned* texels = texel_samples.texels.empty() ? NULL : &texel_samples.texels[0];
+#pragma omp parallel for if(texel_samples.size() >= (1 << 16))
+  for (ptrdiff_t i = 0; i < ptrdiff_t(texel_samples.size()); ++i) {
+    texture[texels[i]] = ao_values[i];
+  }
 }
 
 
+void bake::dilateTexture(
+    const unsigned  width,
+    const unsigned  height,
+    const unsigned  dilation,
+    float*          texture
+    )
+{
+  const size_t num_texels = size_t(width)*height;
+  if ( num_texels == 0 ) return;
+
+  if ( dilation > 0 ) {
+    Buffer<float> buffers[2];
+    buffers[0].alloc( num_texels, RTP_BUFFER_TYPE_CUDA_LINEAR );
+    buffers[1].alloc( num_texels, RTP_BUFFER_TYPE_CUDA_LINEAR );
+    CHK_CUDA( cudaMemcpy( buffers[0].ptr(), texture, num_texels*sizeof(float), cudaMemcpyHostToDevice ) );
+    for (unsigned pass = 0; pass < dilation; ++pass) {
+      bake::dilateTextureDevice( (int)width, (int)height, buffers[pass % 2].ptr(), buffers[1 - pass % 2].ptr() );
+    }
+    CHK_CUDA( cudaMemcpy( texture, buffers[dilation % 2].ptr(), num_texels*sizeof(float), cudaMemcpyDeviceToHost ) );
+  }
+
+  // Texels too far from any chart count as unoccluded
+#pragma omp parallel for if(num_texels >= (1 << 16))
+  for (ptrdiff_t i = 0; i < ptrdiff_t(num_texels); ++i) {
+    if ( texture[i] < 0.0f ) texture[i] = 1.0f;
+  }
+}
+
+
+void bake::simplifyMesh(
+    const Mesh&   mesh,
+    const size_t  target_triangles,
+    ProxyMesh&    proxy,
+    const char*   cache_dir
+    )
+{
+  uint64_t key = 0;
+  if ( cache_dir ) {
+    const uint64_t target = target_triangles;
+    key = hashBytes( &target, sizeof(target), hashMeshGeometry( mesh ) );
+    if ( load_proxy_mesh( cache_dir, key, proxy ) ) {
+      recordCount( "simplify.cache_hits", 1 );
+      return;
+    }
+  }
+  Timer timer;
+  timer.start();
+  bake::simplify_mesh( mesh, target_triangles, proxy );
+  timer.stop();
+  recordTime( "simplify", timer );
+  if ( cache_dir && !save_proxy_mesh( cache_dir, key, proxy ) ) {
+    std::cerr << "Failed to write proxy cache in: " << cache_dir << std::endl;
+  }
+}
+
+
+void bake::reorderMesh(
+    const Mesh&     mesh,
+    ReorderedMesh&  reordered
+    )
+{
+  bake::reorder_mesh( mesh, reordered );
+}
+
+
+void bake::cleanMesh(
+    const Mesh&   mesh,
+    CleanedMesh&  cleaned
+    )
+{
+  bake::clean_mesh( mesh, cleaned );
+}
+
+
+void bake::fillCleanedVertexAO(
+    const CleanedMesh& cleaned,
+    float*             vertex_ao
+    )
+{
+  for (size_t i = 0; i < cleaned.filled_vertices.size(); ++i) {
+    vertex_ao[cleaned.filled_vertices[i]] = vertex_ao[cleaned.fill_sources[i]];
+  }
+}
@@ -24,6 +24,7 @@
 #pragma once
 
 #include <cstddef>
+#include <vector>
 
 // Note: cstdint would require building with c++11 on gcc
 #if defined(_WIN32)
@@ -44,6 +45,21 @@ struct SampleInfo
   float     dA;
 };
 
+// Compact alternative to SampleInfo (8 bytes instead of 20): the first two barycentrics as 16 bit unorm,
+// the third is implied, and dA is stored once per triangle in AOSamples::tri_sample_dA.
+struct CompactSampleInfo
+{
+  unsigned  tri_idx;
+  uint16_t  bary[2];
+};
+
+
+// Where the sample arrays of an AOSamples, the AO values traced for them, or the geometry of a Mesh are
+enum MemorySpace
+{
+  MEMORY_SPACE_HOST = 0,
+  MEMORY_SPACE_DEVICE     // CUDA device memory, of any device with unified addressing
+};
 
 struct Mesh
 {
@@ -52,10 +68,19 @@ struct Mesh
   unsigned  vertex_stride_bytes;
   float*    normals;
   unsigned  normal_stride_bytes;
+  float*    texcoords;          // optional float2 per vertex, for texture baking
+  unsigned  texcoord_stride_bytes;
   size_t    num_triangles;
   unsigned int* tri_vertex_indices;
   float     bbox_min[3];
   float     bbox_max[3];
+
+  // Device: vertices, normals and tri_vertex_indices are CUDA buffers the caller owns, e.g. engine buffers registered
+  // with CUDA, and the Prime tracer builds its accels over them in place instead of over copies.  They must stay
+  // valid, unchanged, for the lifetime of the AO contexts built over them, and be readable by all of their devices.
+  // Such meshes can only be occluders: sampling and filtering read geometry on the host.  The bbox is still set by
+  // the caller.
+  MemorySpace geometry_memory;
 };
 
 struct Instance
@@ -85,31 +110,215 @@ struct AOSamples
   float*        sample_normals;
   float*        sample_face_normals;
   SampleInfo*   sample_infos;
+
+  // Optional: number of samples on each triangle of each instance, concatenated in instance order.
+  // If set, sampleInstances fills it, and the positions and normals may be NULL: computeAO then places
+  // the samples on the device instead of uploading them.
+  unsigned*     tri_sample_counts;
+
+  // Optional compact layout: if set, sample_infos may be NULL, and tri_sample_dA holds the area per sample 
+  // of each triangle of each instance, concatenated in instance order.
+  CompactSampleInfo* compact_sample_infos;
+  float*             tri_sample_dA;
+
+  // Optional: instance index of each sample, filled by sampleInstances and permuted by sortSamples.  With sample 
+  // infos, the Prime tracer then uploads only the instance, triangle and 16 bit barycentrics of host samples, 12 
+  // bytes instead of 24 for the packed position and normals, and rebuilds the samples on the device from its copies
+  // of the meshes.  Positions and normals are still needed on the host, by the other tracers and host side sorting.
+  unsigned*          sample_instances;
+
+  // Memory of sample_positions, sample_normals and sample_face_normals, and of the ao_values computeAO writes.  
+  // Device arrays, e.g. from the caller's own sampling, are read and written on the device, without copies to or 
+  // from the host; only the device tracers take them, so Embree contexts trace them with Prime.  Host side 
+  // sorting and filtering need host arrays.
+  MemorySpace        sample_memory;
+  MemorySpace        ao_memory;
+
+  // Index of the first sample in the whole bake, when these are part of it, e.g. a chunk of its instances.  Ray 
+  // directions only depend on this index plus the index in the set, so parts trace the rays of the whole.
+  size_t             first_sample_index;
+};
+
+// Triangle areas computed by distributeSamples, so sampleInstances does not compute them again.
+// Areas are kept in mesh space per mesh and scaled per instance when the instance xform is a similarity
+// (rigid motion with uniform scale); other instances keep their own world space areas.
+struct SamplingPlan
+{
+  std::vector< std::vector<double> > mesh_tri_areas;        // empty for meshes without similarity instances
+  std::vector< std::vector<double> > instance_tri_areas;    // empty for similarity instances
+  std::vector<double>                instance_area_scales;  // world area = mesh area * scale; 0 if not a similarity
+
+  // Optional input: sample density weight of each triangle of each instance, e.g. from weighSamplesByVariance.
+  // Extra samples then go by area times weight instead of area; empty for instances sampled by area.
+  std::vector< std::vector<float> >  instance_tri_weights;
 };
 
 enum VertexFilterMode
 {
   VERTEX_FILTER_AREA_BASED=0,
   VERTEX_FILTER_LEAST_SQUARES,
+  VERTEX_FILTER_LEAST_SQUARES_CG,  // same system, solved by conjugate gradients on the device
+  VERTEX_FILTER_LEAST_SQUARES_MATRIX_FREE,  // same system, solved on the host without assembling it
+  VERTEX_FILTER_LEAST_SQUARES_FLOAT,        // same system, factorized in float, redone in double if inaccurate
+  VERTEX_FILTER_LEAST_SQUARES_HOST_CG,      // same system, assembled and solved by preconditioned CG on the host, in parallel
   VERTEX_FILTER_INVALID
 };
 
+// Preconditioner of VERTEX_FILTER_LEAST_SQUARES_HOST_CG.  Incomplete Cholesky takes fewer iterations than Jacobi,
+// but its triangular solves run on one thread, so Jacobi can be faster on large meshes with many cores.
+enum CGPreconditioner
+{
+  CG_PRECONDITIONER_JACOBI=0,             // inverse of the diagonal
+  CG_PRECONDITIONER_INCOMPLETE_CHOLESKY,  // zero fill-in, falls back to Jacobi where it breaks down
+  CG_PRECONDITIONER_INVALID
+};
+
+// Sparse factorization for VERTEX_FILTER_LEAST_SQUARES.  The supernodal solvers use all cores inside one
+// factorization, which pays off for meshes of hundreds of thousands of vertices and more; smaller meshes always
+// use the simplicial solver, in parallel over instances.  Supernodal solvers are only available if the build found
+// their libraries.
+enum LeastSquaresSolver
+{
+  LEAST_SQUARES_SOLVER_SIMPLICIAL=0,  // Eigen's SimplicialLDLT
+  LEAST_SQUARES_SOLVER_CHOLMOD,       // CHOLMOD supernodal LLT, from SuiteSparse
+  LEAST_SQUARES_SOLVER_PARDISO,       // Pardiso LDLT, from MKL
+  LEAST_SQUARES_SOLVER_INVALID
+};
+
+bool leastSquaresSolverAvailable( const LeastSquaresSolver solver );
+
+// Fill reducing ordering of the simplicial least squares factorization, which sets the nonzeros of the factor and so
+// its memory and time.  Minimum degree orderings suit compact meshes; long thin parts and scan strips fill in less 
+// with nested dissection.  The supernodal solvers order with their own libraries.
+enum LeastSquaresOrdering
+{
+  LEAST_SQUARES_ORDERING_AMD=0,       // approximate minimum degree, Eigen's default
+  LEAST_SQUARES_ORDERING_COLAMD,      // column approximate minimum degree
+  LEAST_SQUARES_ORDERING_METIS,       // METIS nested dissection, if the build found METIS
+  LEAST_SQUARES_ORDERING_GEOMETRIC,   // nested dissection by bisecting the vertex positions
+  LEAST_SQUARES_ORDERING_AUTO,        // per mesh, whichever of AMD, geometric and METIS gives the fewest factor nonzeros
+  LEAST_SQUARES_ORDERING_INVALID
+};
+
+bool leastSquaresOrderingAvailable( const LeastSquaresOrdering ordering );
+
+
+// Host memory for the sample arrays of AOSamples and for AO values.  The tracers copy AO from the device straight 
+// into pinned (page locked) ao_values as batches finish, rather than through a staging buffer.  Pinned memory is 
+// slow to allocate and can't be paged out, so it's opt-in; without a CUDA device it is plain memory.  Arrays of 
+// LARGE_HOST_ALLOCATION bytes and more are huge page backed and spread over NUMA nodes.  Free with freeHostMemory, 
+// pinned or not.
+void* allocateHostMemory( const size_t bytes, const bool pinned = true );
+void  freeHostMemory( void* ptr );
+
 
 size_t distributeSamples(
     const Scene&    scene,
-    const size_t    min_samples_per_triangle,
+    const float     min_samples_per_triangle,
     const size_t    requested_num_samples,
-    size_t*         num_samples_per_instance // output
+    size_t*         num_samples_per_instance, // output
+    SamplingPlan*   plan = NULL               // optional output, for sampleInstances
     );
 
 
+// With sample_templates, the instances of a mesh whose xform is a similarity and which get the same number of
+// samples share one mesh space sample pattern, placed by each xform, instead of each being sampled on its own.
+// Requires host sample positions.
 void sampleInstances(
     const Scene&  scene,
     const size_t* num_samples_per_instance,
-    const size_t  min_samples_per_triangle,
+    const float   min_samples_per_triangle,
+    AOSamples&    ao_samples,
+    const SamplingPlan* plan = NULL,  // from distributeSamples, or NULL
+    const bool    sample_templates = false
+    );
+
+// Samples [first_sample, first_sample + range_samples.num_samples) of the sample set sampleInstances would make, the
+// same samples in the same order, into host arrays of range_samples that hold only those: positions and normals,
+// face normals and full sample infos if set.  Only the triangles with samples in the range are placed, so a range
+// costs about what its samples do, plus planning the instances it touches.  E.g. for an AOSampleProvider.
+void sampleInstanceRange(
+    const Scene&  scene,
+    const size_t* num_samples_per_instance,
+    const float   min_samples_per_triangle,
+    const SamplingPlan* plan,         // from distributeSamples, or NULL
+    const size_t  first_sample,
+    AOSamples&    range_samples
+    );
+
+// Sets plan.instance_tri_weights from a cheap pilot trace, so that distributeSamples and sampleInstances put the
+// extra samples of the real bake where AO varies: pilot_samples are host samples with sample infos from
+// sampleInstances, and pilot_ao their AO, e.g. traced with few rays.  The weight of a triangle is the variance of
+// the pilot AO on it, averaged over the triangles around its vertices, plus a small share of the mean variance so
+// flat open regions keep some extra samples.
+void weighSamplesByVariance(
+    const Scene&     scene,
+    const size_t*    num_samples_per_instance,  // of the pilot samples
+    const AOSamples& pilot_samples,
+    const float*     pilot_ao,
+    SamplingPlan&    plan
+    );
+
+// One sample at each vertex of each instance, for AO traced directly at the vertices: sample v of an instance is
+// vertex v of its mesh, so the AO values of the instance are its vertex AO and need no filter.  num_samples must
+// be the sum of the vertex counts of the instances.  Normals are the mesh's vertex normals, or without them the
+// area weighted normals of the adjacent triangles, which are the face normals and which the vertex normals are
+// turned to face.  Fills host positions and normals only; sample infos are not needed.
+void sampleVertices(
+    const Scene&  scene,
+    AOSamples&    ao_samples
+    );
+
+// Place samples taken by sampleInstances on moved vertices of the same meshes, e.g. the next frame of an animation,
+// so every frame is sampled at the same points of the surface: host positions, normals and face normals, if set, 
+// are computed again from the sample infos, and the area each sample stands for from its triangle's new area.
+// Samples must be in instance order.
+void placeSamples(
+    const Scene&  scene,
+    const size_t* num_samples_per_instance,
     AOSamples&    ao_samples
     );
 
+// Reorder samples with host positions by a Morton code of position and the octant of their normal, so consecutive 
+// rays of a query are spatially coherent.  sorted_order[i] (num_samples entries) is the original index of sorted 
+// sample i.  The filters expect samples in instance order, so restore it with unsortSamples after tracing.
+void sortSamples(
+    AOSamples&    ao_samples,
+    const float   bbox_min[3],
+    const float   bbox_max[3],
+    size_t*       sorted_order  // output
+    );
+
+// A range of samples in one cube of a grid over the scene, with the bounds of their positions
+struct SampleTile
+{
+  size_t first_sample;
+  size_t num_samples;
+  float  bbox_min[3];
+  float  bbox_max[3];
+};
+
+// Reorder samples with host positions by the cube of edge tile_size they lie in, on a grid from bbox_min, and 
+// within a cube as sortSamples does.  tiles gets the nonempty cubes in order.  The edge grows if the grid would
+// have more than 2^31 cubes.  Restore the order with unsortSamples.
+void tileSamples(
+    AOSamples&    ao_samples,
+    const float   bbox_min[3],
+    const float   bbox_max[3],
+    const float   tile_size,
+    size_t*       sorted_order,  // output
+    std::vector<SampleTile>& tiles  // output
+    );
+
+// Undo sortSamples, for the samples and for the AO traced in sorted order (may be NULL), which has num_ao_channels
+// channels of num_samples values, as from computeAOMultiRadius.
+void unsortSamples(
+    AOSamples&    ao_samples,
+    const size_t* sorted_order,
+    float*        ao_values,
+    const size_t  num_ao_channels = 1
+    );
+
 
 void computeAO( 
     const Scene&     scene,
@@ -119,10 +328,599 @@ void computeAO(
     const float      scene_maxdistance,
     const bool       cpu_mode,
     const bool       conserve_memory,
+    const size_t     batch_size,       // samples traced per batch; 0 picks a size from free device memory
+    const int        passes_per_query, // ray passes traced together in one query; 0 picks a default
+    const float      adaptive_tolerance, // stop tracing a sample once the standard error of its AO is below this; 0 traces all rays
+    const int*       devices,          // CUDA devices to trace on; NULL/0 uses all visible devices
+    const size_t     num_devices,
     float*           ao_values 
     );
 
 
+// Occluder geometry with its accel structures built once, on every device, for several computeAO calls.
+// Any number of sample sets can be traced against it, e.g. vertex samples, then lightmap texels, or a scene 
+// baked in chunks of instances.  Queries and batch buffers are also kept between calls while they fit.
+struct AOContext;
+
+// Axis aligned rectangle that blocks rays like occluder geometry, e.g. a ground plane.  It is tested 
+// analytically during ray generation instead of being traced, and lies at bbox_min[axis] == bbox_max[axis].
+struct GroundPlane
+{
+  int    axis;  // 0, 1 or 2
+  float  bbox_min[3];
+  float  bbox_max[3];
+};
+
+// Trade accel build time against query speed.  Fast skips the triangle copy of large meshes into Prime's own 
+// layout, which makes builds quicker and queries slower; quality always keeps the copy.
+enum AccelPreset
+{
+  ACCEL_PRESET_FAST,
+  ACCEL_PRESET_BALANCED,
+  ACCEL_PRESET_QUALITY
+};
+
+// Ray tracer behind an AOContext.  OptiX (7 or later) builds its accels for and traces on the ray tracing cores 
+// of RTX devices, and is only there in builds with an OptiX 7 SDK.  Prime runs on any device or on the host, and 
+// is the fallback: an OptiX context still traces with Prime where OptiX can't, i.e. device placed samples and 
+// vertex AO.  Embree traces on the host without any CUDA device, and is only there in builds with Embree 3; it 
+// falls back to Prime the same way.  Auto picks OptiX for CUDA contexts when every device has ray tracing cores, 
+// and Embree for CPU mode contexts.  Hybrid traces host samples with Embree and the devices (OptiX where auto 
+// would take it, else Prime) at the same time, each taking batches from a shared cursor as it finishes the last.
+enum AOBackend
+{
+  AO_BACKEND_AUTO,
+  AO_BACKEND_OPTIX_PRIME,
+  AO_BACKEND_OPTIX,
+  AO_BACKEND_EMBREE,
+  AO_BACKEND_HYBRID
+};
+
+// The occluder meshes must outlive a context with the OptiX or Embree backend, for its Prime fallback.
+// peer_geometry stores the occluders' vertices and indices of a Prime context once, spread over its devices, 
+// which read each other's through peer access (e.g. over NVLink); each device still builds its own accels.
+// managed_geometry puts them in unified memory, so geometry larger than device memory is paged in by the 
+// queries at reduced speed rather than failing to allocate.
+AOContext* createAOContext(
+    const Scene&     occluders,
+    const bool       cpu_mode,
+    const bool       conserve_memory,
+    const int*       devices,          // CUDA devices to trace on; NULL/0 uses all visible devices
+    const size_t     num_devices,
+    const AccelPreset accel_preset = ACCEL_PRESET_BALANCED,
+    const GroundPlane* ground_plane = NULL,  // optional analytic blocker, in addition to the occluders
+    const AOBackend  backend = AO_BACKEND_AUTO,  // OptiX and Embree fall back to Prime if they aren't available
+    const bool       peer_geometry = false,
+    const bool       managed_geometry = false
+    );
+
+// Initialize CUDA and create the Prime contexts of the devices ahead of createAOContext, e.g. on a second thread 
+// while the scene loads, so the first context doesn't wait for them.  Contexts created later for the same devices 
+// take the prepared ones; releasePreparedDevices drops those that none took.
+void prepareDevices( const bool cpu_mode, const int* devices, const size_t num_devices );
+void releasePreparedDevices();
+
+// Process wide: the Prime tracer keeps the mesh accels it builds, and the device copies of their geometry, after
+// their contexts are destroyed, up to device_bytes of geometry per device, dropping the least recently used beyond
+// that.  Later contexts on the same devices take the accels of meshes with the same positions, triangles and accel
+// settings instead of uploading and building them again, so batch jobs that share parts or buildings build them
+// once.  Library meshes don't share buffers with each other.  Contexts with peer or managed geometry, and CPU
+// contexts, don't use it.  0, the default, drops the library; meshes still in use go with their contexts.
+void setMeshLibraryBudget( const size_t device_bytes );
+
+// The backend a context traces with, never AO_BACKEND_AUTO
+AOBackend getAOBackend( const AOContext* context );
+
+// Device bytes the Prime tracer needs per sample of batch_size, over all batch slots of a device, for sizing 
+// batches against a memory budget before any context exists.  passes_per_query 0 is the default; num_channels is 
+// 2 for two-sided AO, 4 for AO with bent normals, num_radii the hit distances of multi radius AO, queries_in_flight
+// as for setAOQueriesInFlight.  The OptiX tracer needs no more than this.
+size_t batchBytesPerSample( const int passes_per_query, const bool adaptive, const size_t num_channels = 1, 
+                            const size_t num_radii = 0, const size_t queries_in_flight = 0 );
+
+// Same as above, with the samples of 'scene' traced against the context's occluders.
+void computeAO(
+    AOContext*       context,
+    const Scene&     scene,
+    const AOSamples& ao_samples,
+    const int        rays_per_sample,
+    const float      scene_offset,
+    const float      scene_maxdistance,
+    const size_t     batch_size,
+    const int        passes_per_query,
+    const float      adaptive_tolerance,
+    float*           ao_values
+    );
+
+// Same as above, with a number of rays for each instance of the scene, e.g. more for hero assets than for background
+// clutter.  Consecutive instances with the same count are traced by one computeAO call, so every batch traces
+// the same rays per sample; ray seeds are those of a single call.  Needs samples in instance order with host or 
+// device positions, as sampleInstances writes them, not sorted or placed on the device.
+void computeAOPerInstance(
+    AOContext*       context,
+    const Scene&     scene,
+    const AOSamples& ao_samples,
+    const size_t*    num_samples_per_instance,
+    const int*       rays_per_instance,
+    const float      scene_offset,
+    const float      scene_maxdistance,
+    const size_t     batch_size,
+    const int        passes_per_query,
+    const float      adaptive_tolerance,
+    float*           ao_values
+    );
+
+// Called as each batch of computeAO finishes, with the AO of samples [first_sample, first_sample + num_samples) of
+// the set in host memory: num_channels channels of num_samples values, valid for the call only.  Called from the
+// tracer's thread of each device, so calls for different batches can run at the same time, in any order.
+typedef void (*AOBatchCallback)( void* batch_data, const size_t first_sample, const size_t num_samples, const float* ao, 
+                                 const size_t num_channels );
+
+// Same as computeAO, with batch_callback called with the AO of each batch as it comes back, so later stages can start
+// on it while the rest traces.  ao_values may be NULL, if the batches are all the caller needs.  Traced with Prime.
+void computeAO(
+    AOContext*       context,
+    const Scene&     scene,
+    const AOSamples& ao_samples,
+    const int        rays_per_sample,
+    const float      scene_offset,
+    const float      scene_maxdistance,
+    const size_t     batch_size,
+    const int        passes_per_query,
+    const float      adaptive_tolerance,
+    float*           ao_values,
+    AOBatchCallback  batch_callback,
+    void*            batch_data
+    );
+
+// Makes the host samples [first_sample, first_sample + num_samples) of a sample set, for computeAO with a provider: 
+// positions, normals and face normals, 3 floats each, laid out as in AOSamples.  Called from the tracer's thread of 
+// each device, so calls for different batches can run at the same time.
+typedef void (*AOSampleProvider)( void* provider_data, const size_t first_sample, const size_t num_samples, 
+                                  float* positions, float* normals, float* face_normals );
+
+// Same as computeAO, with the samples made a batch at a time by provider, just before the batch is traced, instead
+// of all up front: host memory for samples is one batch per device, not the whole set, and making the next batch
+// overlaps tracing the ones before it on the device.  ao_samples gives num_samples, first_sample_index and
+// ao_memory; its sample arrays must be NULL.  With a batch_callback as well, ao_values may be NULL, and nothing
+// the size of the set is kept.  Traced with Prime.
+void computeAO(
+    AOContext*       context,
+    const Scene&     scene,
+    const AOSamples& ao_samples,
+    AOSampleProvider provider,
+    void*            provider_data,
+    const int        rays_per_sample,
+    const float      scene_offset,
+    const float      scene_maxdistance,
+    const size_t     batch_size,
+    const int        passes_per_query,
+    const float      adaptive_tolerance,
+    float*           ao_values,
+    AOBatchCallback  batch_callback = NULL,
+    void*            batch_data = NULL
+    );
+
+// A sample set kept in a scratch file instead of host memory, for bakes whose samples and AO don't fit there: sample
+// geometry in blocks of block_size samples, sample infos, and AO of one channel.  Samples are written a chunk at a 
+// time, traced from the file with the next blocks read ahead of the devices, and their AO written back as batches
+// finish, for the filters to read a chunk at a time.  Transfers are asynchronous, POSIX AIO or overlapped I/O on
+// Windows.  The file goes away with the spill.
+struct SampleSpill;
+
+// Spill for num_samples samples, in a new file in directory; NULL if the file can't be made
+SampleSpill* createSampleSpill(
+    const char*      directory,
+    const size_t     num_samples,
+    const size_t     block_size
+    );
+
+void destroySampleSpill( SampleSpill* spill );
+
+// Writes the host positions, normals, face normals and sample infos of ao_samples as samples [first_sample, 
+// first_sample + ao_samples.num_samples) of the spill.  False on I/O errors.
+bool spillSamples(
+    SampleSpill*     spill,
+    const AOSamples& ao_samples,
+    const size_t     first_sample
+    );
+
+// computeAO of all spilled samples, with a provider reading them back a block at a time, and a batch callback 
+// writing their AO to the spill.  first_sample_index seeds the rays as in AOSamples.  A batch_size of 0 traces a 
+// block per batch.  Traced with Prime.  False on I/O errors.
+bool computeAOSpilled(
+    AOContext*       context,
+    const Scene&     scene,
+    SampleSpill*     spill,
+    const size_t     first_sample_index,
+    const int        rays_per_sample,
+    const float      scene_offset,
+    const float      scene_maxdistance,
+    const size_t     batch_size,
+    const int        passes_per_query,
+    const float      adaptive_tolerance
+    );
+
+// Reads the sample infos and traced AO of samples [first_sample, first_sample + num_samples) of the spill, e.g. for
+// mapAOToVertices of the instances they belong to.  False on I/O errors.
+bool readSpilledSamples(
+    SampleSpill*     spill,
+    const size_t     first_sample,
+    const size_t     num_samples,
+    SampleInfo*      sample_infos,
+    float*           ao_values
+    );
+
+// Same as computeAO, with AO mapped to vertex_ao by the area based filter on the device, as each batch finishes, so 
+// that only vertex AO comes back to the host.  Samples must be placed on the device (tri_sample_counts set, NULL
+// positions).  ao_values may be NULL.  With ao_samples.ao_memory MEMORY_SPACE_DEVICE, the vertex_ao arrays are device
+// memory too; on one device, each is copied to straight from the filter's sums, pinned host arrays included.  Results
+// match mapAOToVertices with VERTEX_FILTER_AREA_BASED up to float rounding of the sums.
+void computeAOToVertices(
+    AOContext*       context,
+    const Scene&     scene,
+    const AOSamples& ao_samples,
+    const int        rays_per_sample,
+    const float      scene_offset,
+    const float      scene_maxdistance,
+    const size_t     batch_size,
+    const int        passes_per_query,
+    const float      adaptive_tolerance,
+    float*           ao_values,
+    float**          vertex_ao
+    );
+
+// Low latency bakes of one object after another, e.g. for a DCC plug-in that bakes the selected object on demand.  A
+// session keeps a Prime context on one device warm between objects: its CUDA and Prime contexts, scene model, batch
+// slots and queries stay, so an object only builds its mesh accel and the top level, from the mesh library if it
+// has the mesh (see setMeshLibraryBudget).  Samples are placed on the device, all rays of a sample trace in one
+// query, and the area based filter runs on the device as the batch finishes, so only vertex AO crosses the bus.
+struct ObjectBakeSession;
+
+ObjectBakeSession* createObjectBakeSession(
+    const int         device,           // CUDA device to trace on
+    const AccelPreset accel_preset = ACCEL_PRESET_FAST
+    );
+
+// Bake the AO of the mesh, alone in its scene with an identity xform, into vertex_ao, one float per vertex in host 
+// memory, best pinned from allocateHostMemory, or device memory of the session's device.  The mesh's arrays need only
+// stay valid for the call, and be host memory.  Samples are distributed as distributeSamples does with num_samples 0.
+void bakeObjectAO(
+    ObjectBakeSession* session,
+    const Mesh&       mesh,
+    const float       min_samples_per_triangle,
+    const int         rays_per_sample,
+    const float       scene_offset,
+    const float       scene_maxdistance,
+    float*            vertex_ao,
+    const MemorySpace vertex_ao_memory
+    );
+
+void destroyObjectBakeSession( ObjectBakeSession* session );
+
+// Same as computeAOToVertices, with vertex AO quantized to 8 or 16 bits on the device before it comes back, as quantizeVertexAO does, so that
+// a quarter or half of the bytes cross the bus: packed_vertex_ao gets bits/8 bytes per vertex, all instances back to
+// back in scene order, e.g. for VertexAOWriter::appendPacked.  With several devices the sums come back and are
+// quantized on the host.
+void computeAOToPackedVertices(
+    AOContext*       context,
+    const Scene&     scene,
+    const AOSamples& ao_samples,
+    const int        rays_per_sample,
+    const float      scene_offset,
+    const float      scene_maxdistance,
+    const size_t     batch_size,
+    const int        passes_per_query,
+    const float      adaptive_tolerance,
+    const unsigned   bits,
+    unsigned char*   packed_vertex_ao
+    );
+
+// Called by computeAOProgressive after a pass group, with the AO of all samples from the rays traced so far.
+// Returning false stops the bake with this estimate.
+typedef bool (*AOSnapshotCallback)( void* snapshot_data, const float* ao_values, const int rays_per_sample );
+
+// Called by computeAOProgressive before each pass group to rank the samples, e.g. by the share of the view their
+// instance covers: fills sample_weights with a weight >= 0 for each of the num_samples samples.
+typedef void (*AOPriorityCallback)( void* priority_data, float* sample_weights );
+
+// Progressive computeAO, for previews that improve until a deadline: rays are traced a pass group (passes_per_query
+// rays per sample) at a time over all batches, instead of all rays of a batch before the next batch, and the
+// occlusion of every batch stays on the device in between.  After each group, ao_values holds the estimate from
+// all rays so far, and snapshot, if given, is called with it.  With time_budget > 0 seconds, tracing stops before
+// a group that would not finish within the budget, judging by the last group; at least one group is traced.  With
+// all rays traced, the result is the same as computeAO's.  Returns the rays per sample traced.  Host samples and
+// one channel only; traced with Prime.
+// With priority, each group traces only the batches that still need rays and have samples of positive mean weight,
+// highest first, until none do; the others follow.  Batches then hold different ray counts, the estimate of each is
+// from its own, and the rays per sample passed to snapshot and returned are the fewest of any batch.
+int computeAOProgressive(
+    AOContext*       context,
+    const Scene&     scene,
+    const AOSamples& ao_samples,
+    const int        rays_per_sample,
+    const float      scene_offset,
+    const float      scene_maxdistance,
+    const size_t     batch_size,
+    const int        passes_per_query,
+    const double     time_budget,
+    float*           ao_values,
+    AOSnapshotCallback snapshot = NULL,
+    void*            snapshot_data = NULL,
+    AOPriorityCallback priority = NULL,
+    void*            priority_data = NULL
+    );
+
+// AO of both sides of the surface from one set of samples and accels: each batch is traced as usual, then again 
+// with sample normals flipped.  ao_values holds two channels of num_samples values, front side first.  There is
+// no adaptive sampling.
+void computeAOTwoSided(
+    AOContext*       context,
+    const Scene&     scene,
+    const AOSamples& ao_samples,
+    const int        rays_per_sample,
+    const float      scene_offset,
+    const float      scene_maxdistance,
+    const size_t     batch_size,
+    const int        passes_per_query,
+    float*           ao_values
+    );
+
+// Most hit distances computeAOMultiRadius traces at once
+const size_t MAX_AO_RADII = 4;
+
+// AO at several hit distances from one trace: closest hit queries at the largest radius, and each hit counts 
+// as occlusion for all radii it falls within.  Radii must be ascending.  ao_values holds num_radii channels of 
+// num_samples values, in the order of the radii.  There is no adaptive sampling, and the context can't have 
+// an analytic ground plane.
+void computeAOMultiRadius(
+    AOContext*       context,
+    const Scene&     scene,
+    const AOSamples& ao_samples,
+    const int        rays_per_sample,
+    const float      scene_offset,
+    const float*     radii,
+    const size_t     num_radii,
+    const size_t     batch_size,
+    const int        passes_per_query,
+    float*           ao_values
+    );
+
+// AO and bent normals from one trace: the bent normal of a sample is the mean world space direction of its rays
+// that hit nothing, summed on the device next to the occlusion count, or the sample normal if every ray hit.
+// ao_values holds four channels of num_samples values: AO, then x, y and z of the bent normal.  There is no
+// adaptive sampling.  Traced with Prime.
+void computeAOBentNormals(
+    AOContext*       context,
+    const Scene&     scene,
+    const AOSamples& ao_samples,
+    const int        rays_per_sample,
+    const float      scene_offset,
+    const float      scene_maxdistance,
+    const size_t     batch_size,
+    const int        passes_per_query,
+    float*           ao_values
+    );
+
+// The constant SH basis function
+const float SH_Y00 = 0.282094792f;
+
+// L0 and L1 SH coefficients of visibility from one trace, for directional occlusion: each is the average of its
+// basis function over the directions of the rays that hit nothing, in world space, with a hit counting as 0.  The
+// rays are cosine distributed, so this projects visibility times the clamped cosine over pi.  sh_values holds four
+// channels of num_samples values in the usual order, the L0 coefficient, which is AO times SH_Y00, then those of
+// y, z and x.  There is no adaptive sampling.  Traced with Prime.
+void computeAOSHVisibility(
+    AOContext*       context,
+    const Scene&     scene,
+    const AOSamples& ao_samples,
+    const int        rays_per_sample,
+    const float      scene_offset,
+    const float      scene_maxdistance,
+    const size_t     batch_size,
+    const int        passes_per_query,
+    float*           sh_values
+    );
+
+void destroyAOContext( AOContext* context );
+
+// Replace the instances of the context's occluders, e.g. to bake another layout of the same meshes.  The 
+// per-mesh accels are kept and only the top level is rebuilt, so instances must index the meshes the context
+// was created with.
+void updateAOContextInstances(
+    AOContext*       context,
+    const Instance*  instances,
+    const size_t     num_instances
+    );
+
+// Move the vertices of the context's meshes, e.g. to bake the frames of an animation: meshes are the context's with
+// new positions, the same number of them, each with the vertices and triangles it had, and like those the context was 
+// created with they must stay valid as long as it is used.  The instances, any mask and the batch slots are kept.  
+// Embree refits the mesh accels in place.  OptiX does too, once the first update has built them again to allow it,
+// and builds them again after a few refits.  Prime can't refit, so its mesh accels are built again.  A far field 
+// volume is voxelized again.
+void updateAOContextGeometry(
+    AOContext*       context,
+    const Mesh*      meshes,
+    const size_t     num_meshes
+    );
+
+// Hide some of the context's instances from later traces, e.g. to bake variants of a scene without its fixtures or
+// glass, with visible[i] 0 for each hidden instance of num_instances, the context's.  The accels of the meshes are kept
+// and only the top level is rebuilt: OptiX masks the hidden instances, Embree and Prime leave them out.  At least
+// one instance stays visible.  NULL shows them all again; updateAOContextInstances with another number of instances
+// does too.  An analytic ground plane isn't an instance, so it stays.
+void setAOOccluderMask(
+    AOContext*           context,
+    const unsigned char* visible,
+    const size_t         num_instances
+    );
+
+// Checkpoint the vertex AO traced by later computeAO calls of the Prime tracer: each finished batch goes to a file 
+// in checkpoint_dir, an existing directory, named after bake_hash and the sample set's first_sample_index.  A later
+// call for the same sample set and hash, e.g. after the process died, restores the batches found there and only 
+// traces the others.  bake_hash must identify everything the AO depends on: geometry, samples and trace options.
+// A NULL directory stops checkpointing.  OptiX, Embree, hybrid and device splatting calls trace without checkpoints.
+void setAOCheckpoint(
+    AOContext*       context,
+    const char*      checkpoint_dir,
+    const uint64_t   bake_hash
+    );
+
+// Most queries setAOQueriesInFlight keeps in flight on a device
+const size_t MAX_QUERIES_IN_FLIGHT = 8;
+
+// Batches the Prime tracer keeps in flight on each device in later computeAO calls, each in a slot with its own
+// query, stream and buffers; 0 is the default, 2.  Small batches leave a large device idle with one query tracing,
+// so more of them at once keep it busy, at the cost of device memory per slot: automatic batch sizes shrink to fit.  
+// Slots are reused in the order their batches finish.  CPU contexts always trace one batch at a time.
+void setAOQueriesInFlight(
+    AOContext*       context,
+    const size_t     num_queries
+    );
+
+// Cooperative tracing for a device that also drives a display, e.g. an artist's workstation: later computeAO calls of 
+// the Prime tracer keep each submission to the device (ray generation, query and AO update for some rays of a batch)
+// within about milliseconds of device time, on streams of the lowest priority, and sleep briefly between submissions.
+// Rays per submission follow the throughput measured with events as the bake goes, so the bake slows down rather 
+// than holding the device for long.  Batches trace one at a time per device, and automatic batch sizes start small 
+// enough for one pass over a batch to fit.  0 turns it off.  Progressive, OptiX and Embree traces are not governed.
+void setAOLatencyBudget(
+    AOContext*       context,
+    const float      milliseconds
+    );
+
+// Hybrid far field AO for long hit distances, where most of each ray crosses empty space: the context's occluders
+// are voxelized on each device into a mipmapped opacity volume of about resolution voxels (rounded up to a power of 
+// two, at most 1024) along the longest side of their bounds, and later computeAO calls of the Prime tracer trace
+// rays only near_fraction of scene_maxdistance, or at least three voxels, out from the sample.  Rays that hit nothing
+// there get the occlusion of a cone marched through the volume from there to scene_maxdistance, as wide as the ray's
+// share of the hemisphere, so AO is no longer a whole number of hits.  Detail smaller than a voxel is lost beyond 
+// the near field.  Moving instances with updateAOContextInstances voxelizes them again.  0 turns it off.  Multi radius,
+// bent normal, SH, progressive, OptiX and Embree traces trace rays in full.
+void setAOFarField(
+    AOContext*       context,
+    const float      near_fraction,
+    const int        resolution
+    );
+
+// Progress of a long stage: "trace", with samples as the units of work and the rays per second of the trace so far at
+// the full rays per sample, or "filter", with vertices of the instances filtered and no rays.  Calls come from the
+// threads that finish the work, one at a time, so they should return quickly.
+typedef void (*ProgressCallback)( void* progress_data, const char* stage, const uint64_t done, const uint64_t total, 
+                                  const double rays_per_second );
+
+// Process wide receiver of progress reports: the Prime tracer reports as each batch of computeAO and its variants
+// finishes, and mapAOToVertices as each instance, or group of instances of a mesh, is filtered.  NULL stops the reports.
+// Traces that share their batches with another tracer, and OptiX, Embree and progressive traces, don't report.
+void setProgressCallback(
+    ProgressCallback callback,
+    void*            progress_data
+    );
+
+// Process wide: the Prime tracer's ray generation times a few block sizes at its first launch on each device, on the
+// first batch, and launches with the fastest from then on.  Off by default, when each kernel takes the block size of 
+// highest occupancy.  The block sizes in use are recorded as gauges "kernel.<name>.device<d>.block_size".
+void setKernelTuning(
+    const bool tune
+    );
+
+// Incremental rebake after instances of the context's occluders changed: retraces only the samples whose
+// rays can reach one of the boxes, e.g. the old and new bounds of moved instances, and merges their AO into
+// ao_values.  Needs host sample positions and normals.  Returns the number of samples retraced.
+size_t recomputeAONearBoxes(
+    AOContext*       context,
+    const Scene&     scene,
+    const AOSamples& ao_samples,
+    const float*     box_mins,         // 3 floats per box
+    const float*     box_maxs,
+    const size_t     num_boxes,
+    const int        rays_per_sample,
+    const float      scene_offset,
+    const float      scene_maxdistance,
+    const size_t     batch_size,
+    const int        passes_per_query,
+    const float      adaptive_tolerance,
+    float*           ao_values
+    );
+
+// Sparse AO, irradiance caching style: samples are binned by a spatial hash of their position, in cells cell_size 
+// across, and the dominant axis of their normal, and only the sample nearest the middle of each cell's is traced 
+// with the full ray set, as the cell's record.  Each record gets an AO gradient fit to the records of the cells 
+// around it, and where that fit predicts those records within error_threshold, the cell's other samples are 
+// interpolated from the records around them, weighted by distance and normal divergence.  The samples of the other 
+// cells are traced too, so smooth, open surfaces cost one ray set per cell and detail costs what it does without the
+// cache.  Needs host sample positions and normals.  ao_values gets the AO of every sample, as from computeAO.
+// Returns the number of samples traced.
+size_t computeAOCached(
+    AOContext*       context,
+    const Scene&     scene,
+    const AOSamples& ao_samples,
+    const int        rays_per_sample,
+    const float      scene_offset,
+    const float      scene_maxdistance,
+    const size_t     batch_size,
+    const int        passes_per_query,
+    const float      adaptive_tolerance,
+    const float      cell_size,
+    const float      error_threshold,
+    float*           ao_values
+    );
+
+// Smooths the noise of traced sample AO on the device, before it is mapped to vertices, by a joint bilateral filter
+// in sample space: each sample gets the weighted average AO of the samples within radius_scale times the mean sample
+// spacing (the square root of the mean area per sample), weighted by distance and by how well their normals and
+// tangent planes agree, so AO does not leak across creases or thin walls.  A radius of 2-3 spacings lets a bake
+// trace several times fewer rays, at the cost of detail finer than the radius.  Needs host sample positions,
+// normals and sample infos, and host AO, which is filtered in place, one channel of num_samples values at a time.
+void denoiseAO(
+    const AOSamples& ao_samples,
+    const float      radius_scale,
+    float*           ao_values,
+    const size_t     num_ao_channels = 1
+    );
+
+// Per-sample AO of a bake kept on the current device, for transfer to other geometry in the same place without
+// tracing it, e.g. the LODs of the baked meshes: the samples go into a spatial hash grid with cells the lookup radius
+// across, radius_scale times the mean sample spacing as in denoiseAO.  Needs host sample positions, normals and
+// sample infos, and host AO of one channel.
+struct AOTransfer;
+
+AOTransfer* createAOTransfer(
+    const AOSamples& ao_samples,
+    const float*     ao_values,
+    const float      radius_scale
+    );
+
+// AO of other samples from those of the transfer: the weighted average of the samples within the radius, weighted
+// by distance and by how well their normals and tangent planes agree, as in denoiseAO, so AO doesn't cross thin
+// walls.  A target sample with none in reach gets the AO of the nearest sample facing its way in the neighboring 
+// cells, or 1.  Map the result to vertices with mapAOToVertices, like traced AO.  Needs host positions and normals.
+void transferAO(
+    const AOTransfer* transfer,
+    const AOSamples&  target_samples,
+    float*            target_ao
+    );
+
+void destroyAOTransfer( AOTransfer* transfer );
+
+// With a cache_dir, least squares filtering keeps the regularization matrix and the symbolic factorization of each
+// mesh there, keyed by a hash of the mesh geometry, and reuses them on later bakes.  The directory must exist.
+// analytic_mass_weight blends the least squares mass matrix built from samples (0) with the exact per-triangle
+// integral of the basis functions (1); the latter costs one triangle instead of one sample per matrix block.
+// ao_values can hold num_channels channels of num_samples values, e.g. AO and bent normals, and vertex_ao[i] then
+// holds as many channels of the instance's vertex count; least squares filters solve all channels with one
+// factorization, as right hand sides.
+// A weld_tolerance of 0 or more filters each mesh with its copies of a vertex at UV and normal seams welded into
+// one, so the copies get the same AO and the filters solve for fewer vertices; positions in the same cell of a grid 
+// weld_tolerance times the bbox diagonal of the mesh across weld, 0 welds equal positions only.
+// With num_regularization_weights > 0, least squares filters solve for each of regularization_weights instead of 
+// regularization_weight, assembling each instance's system once, and vertex_ao[i] holds the num_channels channels of
+// each weight in turn.
+// initial_vertex_ao warm-starts the iterative least squares modes, device CG and matrix-free: instance i's solve of 
+// channel 0 starts from initial_vertex_ao[i], e.g. the vertex AO of an earlier bake of the same mesh, instead of the
+// area based result, and stops once the residual is within tolerance, after few iterations if the prior is close.  
+// Entries may be NULL for instances without a prior.  The factorized modes solve directly and ignore it.
 void mapAOToVertices(
     const Scene&            scene,
     const size_t*           num_samples_per_instance,
@@ -130,10 +928,168 @@ void mapAOToVertices(
     const float*            ao_values,
     const VertexFilterMode  mode,
     const float             regularization_weight,
-    float**                 vertex_ao
+    float**                 vertex_ao,
+    const char*             cache_dir = NULL,
+    const float             analytic_mass_weight = 0.0f,
+    const LeastSquaresSolver ls_solver = LEAST_SQUARES_SOLVER_SIMPLICIAL,
+    const size_t            ls_patch_vertices = 0,  // if not 0, split larger meshes into overlapping patches of about this many
+    const size_t            num_channels = 1,
+    const float             weld_tolerance = -1.0f,  // negative: no welding
+    const LeastSquaresOrdering ls_ordering = LEAST_SQUARES_ORDERING_AMD,
+    const float*            regularization_weights = NULL,
+    const size_t            num_regularization_weights = 0,
+    const float* const*     initial_vertex_ao = NULL  // per instance, see above
+    );
+
+// Process wide, for the frames of an animation, filtered one after another: the least squares filters keep the
+// per-mesh data they build, by mesh index, for the next call instead of releasing it.  A mesh with the same triangles,
+// vertex count and filter settings there takes it: the symbolic analysis of its system matrix, which only depends
+// on topology, is reused, and so is the regularizer while every edge stays within rigid_tolerance, relative, of its 
+// length when the regularizer was built, since the regularizer only depends on the shape of the triangles.  Past 
+// the tolerance the regularizer is built again, and the pattern is analyzed again only if degenerate triangles 
+// changed it.  Meshes filtered by patches keep nothing.  Negative, the default, keeps nothing and drops what was kept.
+void setFilterFrameReuse( const float rigid_tolerance );
+
+// Process wide: conjugate gradient solves of the least squares filters, on the device, on the host, and matrix-free,
+// stop once the residual is below tolerance relative to the right hand side; 1e-5 by default.  AO is a low precision
+// signal, so 1e-3 or 1e-4 is often enough, for fewer iterations.  preconditioner is the one of
+// VERTEX_FILTER_LEAST_SQUARES_HOST_CG, Jacobi by default.
+void setFilterConjugateGradient( const float tolerance, const CGPreconditioner preconditioner );
+
+// Vertex AO of all instances in one array instead of one per instance, instance after instance as in the raw output
+// file, so that a scene of a million instances takes one allocation, filters write to neighboring memory, and the
+// array goes to the writer or a viewer in one piece.  offsets gets num_instances + 1 entries: instance i's
+// values_per_vertex*num_vertices values start at offsets[i], and the last entry is the total.  Allocate the array with
+// allocateHostMemory, which aligns large ones to huge pages.
+size_t vertexAOOffsets( const Scene& scene, const size_t values_per_vertex, size_t* offsets );
+
+// Same as mapAOToVertices, into the array at the offsets from vertexAOOffsets, with values_per_vertex the
+// num_channels times num_regularization_weights it writes per vertex
+void mapAOToVertexArray(
+    const Scene&            scene,
+    const size_t*           num_samples_per_instance,
+    const AOSamples&        ao_samples,
+    const float*            ao_values,
+    const VertexFilterMode  mode,
+    const float             regularization_weight,
+    float*                  vertex_ao,
+    const size_t*           vertex_ao_offsets,
+    const char*             cache_dir = NULL,
+    const float             analytic_mass_weight = 0.0f,
+    const LeastSquaresSolver ls_solver = LEAST_SQUARES_SOLVER_SIMPLICIAL,
+    const size_t            ls_patch_vertices = 0,
+    const size_t            num_channels = 1,
+    const float             weld_tolerance = -1.0f,
+    const LeastSquaresOrdering ls_ordering = LEAST_SQUARES_ORDERING_AMD,
+    const float*            regularization_weights = NULL,
+    const size_t            num_regularization_weights = 0,
+    const float* const*     initial_vertex_ao = NULL
+    );
+
+// Samples at the centers of the texels covered by the UV layout of one instance, for texture baking.
+// Row y of the texture holds texel centers at v = (y + 0.5)/height.  Each covered texel gets one sample, 
+// from the first triangle covering it.
+struct TexelSamples
+{
+  std::vector<float>    positions;     // float3 per sample, world space
+  std::vector<float>    normals;       // float3 per sample
+  std::vector<float>    face_normals;  // float3 per sample
+  std::vector<unsigned> texels;        // y*width + x of each sample, in row major order
+
+  size_t size() const { return texels.size(); }
+
+  // For computeAO; the samples carry no SampleInfo
+  AOSamples aoSamples();
+};
+
+// Samples rows [first_row, first_row + num_rows) of the width x height texture of an instance with texcoords.
+// Baking a few rows at a time bounds the memory of large textures.
+void sampleTexels(
+    const Scene&    scene,
+    const size_t    instance_index,
+    const unsigned  width,
+    const unsigned  height,
+    const unsigned  first_row,
+    const unsigned  num_rows,
+    TexelSamples&   texel_samples  // output
     );
 
+// Writes the AO of texel samples into a width x height texture.  Texels no sample has written yet
+// should be negative, so mapping can be done in several parts and followed by dilateTexture.
 void mapAOToTextures(
+    const TexelSamples& texel_samples,
+    const float*        ao_values,
+    float*              texture
+    );
+
+// Grows the covered texels (>= 0) of a texture into the uncovered ones by up to 'dilation' texels on the device,
+// so filtering at chart borders does not pick up empty texels.  Texels still uncovered afterwards are set to 1.
+void dilateTexture(
+    const unsigned  width,
+    const unsigned  height,
+    const unsigned  dilation,
+    float*          texture
+    );
+
+// Simplified copy of a mesh, traced in its place as an occluder
+struct ProxyMesh
+{
+  std::vector<float>    vertices;   // float3 per vertex
+  std::vector<unsigned> indices;    // 3 per triangle
+  float                 max_error;  // square root of the largest quadric error of a collapse; a high estimate of the distance to the mesh
+};
+
+// Decimates a mesh to about target_triangles by quadric error edge collapses, keeping open borders in place.
+// Vertices at the same position are welded first.  With a cache_dir the proxy is kept there, keyed by a hash of
+// the mesh geometry and the target, and loaded on later bakes.  The directory must exist.
+void simplifyMesh(
+    const Mesh&   mesh,
+    const size_t  target_triangles,
+    ProxyMesh&    proxy,  // output
+    const char*   cache_dir = NULL
+    );
+
+// Copy of a mesh with its triangles in an order for the post-transform vertex cache (Forsyth's linear speed vertex
+// cache optimization) and its vertices in the order those triangles first fetch them, so loops over the triangles 
+// of a mesh, sampling, filters and drawing, walk its vertex arrays close to linearly.  Attributes are packed.
+struct ReorderedMesh
+{
+  std::vector<float>    vertices;      // float3 per vertex
+  std::vector<float>    normals;       // float3 per vertex, empty if the mesh has none
+  std::vector<float>    texcoords;     // float2 per vertex, empty if the mesh has none
+  std::vector<unsigned> indices;       // 3 per triangle
+  std::vector<unsigned> vertex_order;  // vertex of the original mesh for each vertex
+};
+
+void reorderMesh(
+    const Mesh&     mesh,
+    ReorderedMesh&  reordered  // output
+    );
+
+// Triangles of a mesh without those that only cost a bake samples, rays and filter entries: degenerate ones, with
+// two corners at the same position or no area to float precision, and copies of another triangle with the same 
+// orientation, by vertex index or by position, as unwelded CAD tessellations have.  The vertices stay as they are, 
+// so vertex AO keeps its order.  Vertices only dropped triangles used get no AO from the filters; those at the 
+// position of a vertex that kept its triangles take its AO, with fillCleanedVertexAO.
+struct CleanedMesh
+{
+  std::vector<unsigned> indices;          // 3 per triangle kept
+  std::vector<unsigned> triangle_order;   // triangle of the original mesh for each triangle kept
+  std::vector<unsigned> filled_vertices;  // vertices left without triangles ...
+  std::vector<unsigned> fill_sources;     // ... and the vertex at the same position each takes its AO from
+  size_t num_degenerate;
+  size_t num_duplicate;
+};
+
+void cleanMesh(
+    const Mesh&   mesh,
+    CleanedMesh&  cleaned  // output
+    );
+
+// Copies the AO of the vertices of a cleaned mesh to those left without triangles at their positions
+void fillCleanedVertexAO(
+    const CleanedMesh& cleaned,
+    float*             vertex_ao
     );
 
 
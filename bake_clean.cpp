@@ -0,0 +1,162 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+// Triangles that add nothing to a bake but samples, rays and filter entries: those of zero area, and copies of
+// another triangle, by vertex or by position, with the same orientation.
+
+#include "bake_clean.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+
+namespace {
+
+// A triangle whose area is below this share of its longest edge squared has no area to float precision
+const double DEGENERATE_AREA_RATIO = 1.0e-7;
+
+struct PositionLess {
+  const unsigned char* vertices;
+  unsigned stride;
+
+  const float* position( const unsigned v ) const { return reinterpret_cast<const float*>( vertices + size_t(v)*stride ); }
+
+  bool operator()( const unsigned a, const unsigned b ) const {
+    const float* pa = position( a );
+    const float* pb = position( b );
+    for (int k = 0; k < 3; ++k) {
+      if (pa[k] != pb[k]) return pa[k] < pb[k];
+    }
+    return a < b;
+  }
+};
+
+// Triangle corners as their first vertex at the same position, rotated to start at the smallest, which keeps the
+// orientation; the triangle breaks ties, so the first of a set of copies sorts first
+struct TriangleKey {
+  unsigned v[3];
+  unsigned triangle;
+
+  bool operator<( const TriangleKey& other ) const {
+    for (int k = 0; k < 3; ++k) {
+      if (v[k] != other.v[k]) return v[k] < other.v[k];
+    }
+    return triangle < other.triangle;
+  }
+  bool sameCorners( const TriangleKey& other ) const {
+    return v[0] == other.v[0] && v[1] == other.v[1] && v[2] == other.v[2];
+  }
+};
+
+} // end namespace
+
+
+void bake::clean_mesh( const Mesh& mesh, CleanedMesh& cleaned )
+{
+  const size_t nv = mesh.num_vertices;
+  const size_t nt = mesh.num_triangles;
+  PositionLess less = { reinterpret_cast<const unsigned char*>( mesh.vertices ), 
+                        mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : unsigned(3*sizeof(float)) };
+
+  // The first vertex of each position
+  std::vector<unsigned> by_position( nv );
+  for (size_t v = 0; v < nv; ++v) by_position[v] = unsigned( v );
+  std::sort( by_position.begin(), by_position.end(), less );
+  std::vector<unsigned> canonical( nv );
+  for (size_t i = 0; i < nv; ++i) {
+    const bool same = i > 0 && std::equal( less.position( by_position[i-1] ), less.position( by_position[i-1] ) + 3, 
+                                           less.position( by_position[i] ) );
+    canonical[by_position[i]] = same ? canonical[by_position[i-1]] : by_position[i];
+  }
+
+  // Degenerate triangles are dropped, the others sorted by their corners
+  std::vector<TriangleKey> keys;
+  keys.reserve( nt );
+  cleaned.num_degenerate = 0;
+  for (size_t t = 0; t < nt; ++t) {
+    const unsigned* tri = mesh.tri_vertex_indices + 3*t;
+    TriangleKey key;
+    for (int k = 0; k < 3; ++k) key.v[k] = canonical[tri[k]];
+    key.triangle = unsigned( t );
+    bool degenerate = key.v[0] == key.v[1] || key.v[1] == key.v[2] || key.v[2] == key.v[0];
+    if (!degenerate) {
+      const float* p0 = less.position( tri[0] );
+      const float* p1 = less.position( tri[1] );
+      const float* p2 = less.position( tri[2] );
+      double e0[3], e1[3], e2[3];
+      for (int k = 0; k < 3; ++k) {
+        e0[k] = double( p1[k] ) - p0[k];
+        e1[k] = double( p2[k] ) - p0[k];
+        e2[k] = double( p2[k] ) - p1[k];
+      }
+      const double c[3] = { e0[1]*e1[2] - e0[2]*e1[1], e0[2]*e1[0] - e0[0]*e1[2], e0[0]*e1[1] - e0[1]*e1[0] };
+      const double area = 0.5 * std::sqrt( c[0]*c[0] + c[1]*c[1] + c[2]*c[2] );
+      const double longest = std::max( std::max( e0[0]*e0[0] + e0[1]*e0[1] + e0[2]*e0[2], e1[0]*e1[0] + e1[1]*e1[1] + e1[2]*e1[2] ),
+                                       e2[0]*e2[0] + e2[1]*e2[1] + e2[2]*e2[2] );
+      degenerate = !(area > DEGENERATE_AREA_RATIO * longest);
+    }
+    if (degenerate) {
+      ++cleaned.num_degenerate;
+      continue;
+    }
+    const int first = int( std::min_element( key.v, key.v + 3 ) - key.v );
+    const unsigned v[3] = { key.v[0], key.v[1], key.v[2] };
+    for (int k = 0; k < 3; ++k) key.v[k] = v[(first + k) % 3];
+    keys.push_back( key );
+  }
+  std::sort( keys.begin(), keys.end() );
+
+  // The first triangle of each set of copies stays, in the order of the mesh
+  cleaned.triangle_order.clear();
+  cleaned.triangle_order.reserve( keys.size() );
+  for (size_t i = 0; i < keys.size(); ++i) {
+    if (i == 0 || !keys[i].sameCorners( keys[i-1] )) cleaned.triangle_order.push_back( keys[i].triangle );
+  }
+  std::sort( cleaned.triangle_order.begin(), cleaned.triangle_order.end() );
+  cleaned.num_duplicate = keys.size() - cleaned.triangle_order.size();
+  cleaned.indices.resize( 3*cleaned.triangle_order.size() );
+  std::vector<unsigned char> used( nv, 0 );
+  for (size_t t = 0; t < cleaned.triangle_order.size(); ++t) {
+    const unsigned* tri = mesh.tri_vertex_indices + 3*size_t( cleaned.triangle_order[t] );
+    for (int k = 0; k < 3; ++k) {
+      cleaned.indices[3*t + k] = tri[k];
+      used[tri[k]] = 1;
+    }
+  }
+
+  // Vertices only the dropped triangles used take the AO of a used vertex at their position, if there is one
+  const unsigned none = ~0u;
+  std::vector<unsigned> used_at( nv, none );
+  for (size_t v = 0; v < nv; ++v) {
+    if (used[v] && used_at[canonical[v]] == none) used_at[canonical[v]] = unsigned( v );
+  }
+  cleaned.filled_vertices.clear();
+  cleaned.fill_sources.clear();
+  for (size_t v = 0; v < nv; ++v) {
+    if (!used[v] && used_at[canonical[v]] != none) {
+      cleaned.filled_vertices.push_back( unsigned( v ) );
+      cleaned.fill_sources.push_back( used_at[canonical[v]] );
+    }
+  }
+}
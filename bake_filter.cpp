@@ -23,7 +23,10 @@
 
 #include "bake_filter.h"
 #include "bake_api.h"
+#include "bake_sample.h"
+#include "bake_util.h"
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <vector>
@@ -35,41 +38,230 @@ using namespace optix;
 
 namespace {
 
-// Splat area-weighted samples onto vertices
-void filter_mesh_area_weighted(
+// Bounds of the sample chunks filtered in parallel.  Only depends on sizes, not on the thread count, so
+// results are reproducible on any machine.
+const size_t MIN_SAMPLES_PER_CHUNK = 1 << 14;
+const size_t MAX_PARTIAL_CHUNKS    = 64;
+
+// Meshes up to this many vertices accumulate into one vertex array per chunk; larger ones with samples 
+// sorted by triangle accumulate per triangle corner and gather to vertices instead.
+const size_t MAX_PARTIAL_VERTICES  = 1 << 16;
+
+
+// Buffers of the filters of one thread, reused by the instances it filters
+struct AreaFilterScratch
+{
+  std::vector<size_t> bounds;
+  std::vector<double> partials;        // weighted AO and weight per vertex and chunk, or per triangle corner
+  std::vector<int>    corner_offsets;
+  std::vector<int>    vertex_corners;
+  std::vector<int>    fill;
+};
+
+
+bool samples_sorted_by_triangle( const bake::AOSamples& ao_samples )
+{
+  ptrdiff_t unsorted = 0;
+#pragma omp parallel for reduction(+:unsorted) if(ao_samples.num_samples > MIN_SAMPLES_PER_CHUNK)
+  for (ptrdiff_t i = 1; i < ptrdiff_t(ao_samples.num_samples); ++i) {
+    if (bake::get_sample_info(ao_samples, i).tri_idx < bake::get_sample_info(ao_samples, i-1).tri_idx) ++unsorted;
+  }
+  return unsorted == 0;
+}
+
+
+void split_samples( const size_t num_samples, const size_t num_chunks, std::vector<size_t>& bounds )
+{
+  bounds.resize(num_chunks + 1);
+  for (size_t c = 0; c <= num_chunks; ++c) bounds[c] = num_samples / num_chunks * c + std::min( c, num_samples % num_chunks );
+}
+
+
+// Each chunk splats into its own vertex arrays; chunks are then summed in order, per vertex
+void filter_mesh_area_weighted_partials(
     const bake::Mesh&       mesh,
     const bake::AOSamples&  ao_samples,
     const float*            ao_values,
+    const size_t            num_chunks,
+    AreaFilterScratch&      scratch,
     float*                  vertex_ao
     )
 {
-  std::vector<double> weights(mesh.num_vertices, 0.0);
-  std::fill(vertex_ao, vertex_ao + mesh.num_vertices, 0.0f);
+  const size_t n = mesh.num_vertices;
+  const int3* tri_vertex_indices  = reinterpret_cast<int3*>( mesh.tri_vertex_indices );
+  std::vector<size_t>& bounds = scratch.bounds;
+  split_samples(ao_samples.num_samples, num_chunks, bounds);
+
+  // Interleaved weighted AO and weight per vertex and chunk
+  std::vector<double>& partials = scratch.partials;
+  partials.assign(2*n*num_chunks, 0.0);
+
+#pragma omp parallel for schedule(dynamic, 1) if(num_chunks > 1)
+  for (ptrdiff_t c = 0; c < ptrdiff_t(num_chunks); ++c) {
+    double* accum = &partials[2*n*c];
+    for (size_t i = bounds[c]; i < bounds[c+1]; ++i) {
+      const bake::SampleInfo info = bake::get_sample_info(ao_samples, i);
+      const int3& tri = tri_vertex_indices[info.tri_idx];
+      const int verts[] = {tri.x, tri.y, tri.z};
+      for (int k = 0; k < 3; ++k) {
+        const double w = info.dA * info.bary[k];
+        accum[2*verts[k]]   += w * ao_values[i];
+        accum[2*verts[k]+1] += w;
+      }
+    }
+  }
+
+#pragma omp parallel for if(n > MIN_SAMPLES_PER_CHUNK)
+  for (ptrdiff_t k = 0; k < ptrdiff_t(n); ++k) {
+    double val = 0.0, weight = 0.0;
+    for (size_t c = 0; c < num_chunks; ++c) {
+      val    += partials[2*(n*c + k)];
+      weight += partials[2*(n*c + k)+1];
+    }
+    vertex_ao[k] = weight > 0.0 ? static_cast<float>(val / weight) : 0.0f;
+  }
+}
 
+
+// Samples sorted by triangle: chunks are aligned to triangle boundaries so every triangle is accumulated by a
+// single thread, then each vertex gathers its triangle corners through a vertex to triangle CSR.  No atomics, and
+// the summation order is fixed.
+void filter_mesh_area_weighted_sorted(
+    const bake::Mesh&       mesh,
+    const bake::AOSamples&  ao_samples,
+    const float*            ao_values,
+    AreaFilterScratch&      scratch,
+    float*                  vertex_ao
+    )
+{
+  const size_t n = mesh.num_vertices;
   const int3* tri_vertex_indices  = reinterpret_cast<int3*>( mesh.tri_vertex_indices );
 
-  for (size_t i = 0; i < ao_samples.num_samples; ++i) {
-    const bake::SampleInfo& info = ao_samples.sample_infos[i];
-    const int3& tri = tri_vertex_indices[info.tri_idx];
-
-    const float val = ao_values[i];
-    const float w[] = {info.dA * info.bary[0],
-      info.dA * info.bary[1],
-      info.dA * info.bary[2]};
-
-    vertex_ao[tri.x] += w[0] * val;
-    weights  [tri.x] += w[0];
-    vertex_ao[tri.y] += w[1] * val;
-    weights  [tri.y] += w[1];
-    vertex_ao[tri.z] += w[2] * val;
-    weights  [tri.z] += w[2];
+  const size_t num_chunks = std::max( size_t(1), ao_samples.num_samples / MIN_SAMPLES_PER_CHUNK );
+  std::vector<size_t>& bounds = scratch.bounds;
+  split_samples(ao_samples.num_samples, num_chunks, bounds);
+  for (size_t c = 1; c < num_chunks; ++c) {
+    size_t& b = bounds[c];
+    b = std::max( b, bounds[c-1] );
+    while (b > bounds[c-1] && b < ao_samples.num_samples &&
+           bake::get_sample_info(ao_samples, b).tri_idx == bake::get_sample_info(ao_samples, b-1).tri_idx) {
+      ++b;
+    }
+  }
+
+  // Weighted AO and weight per triangle corner
+  std::vector<double>& corners = scratch.partials;
+  corners.assign(6*mesh.num_triangles, 0.0);
+
+#pragma omp parallel for schedule(dynamic, 1) if(num_chunks > 1)
+  for (ptrdiff_t c = 0; c < ptrdiff_t(num_chunks); ++c) {
+    for (size_t i = bounds[c]; i < bounds[c+1]; ++i) {
+      const bake::SampleInfo info = bake::get_sample_info(ao_samples, i);
+      double* accum = &corners[6*info.tri_idx];
+      for (int k = 0; k < 3; ++k) {
+        const double w = info.dA * info.bary[k];
+        accum[2*k]   += w * ao_values[i];
+        accum[2*k+1] += w;
+      }
+    }
+  }
+
+  // Corners of each vertex, in triangle order
+  std::vector<int>& corner_offsets = scratch.corner_offsets;
+  corner_offsets.assign(n+1, 0);
+  for (size_t t = 0; t < mesh.num_triangles; ++t) {
+    const int3& tri = tri_vertex_indices[t];
+    ++corner_offsets[tri.x+1];
+    ++corner_offsets[tri.y+1];
+    ++corner_offsets[tri.z+1];
+  }
+  for (size_t k = 0; k < n; ++k) corner_offsets[k+1] += corner_offsets[k];
+  std::vector<int>& vertex_corners = scratch.vertex_corners;
+  vertex_corners.resize(corner_offsets[n]);
+  {
+    std::vector<int>& fill = scratch.fill;
+    fill.assign(corner_offsets.begin(), corner_offsets.end() - 1);
+    for (size_t t = 0; t < mesh.num_triangles; ++t) {
+      const int3& tri = tri_vertex_indices[t];
+      vertex_corners[fill[tri.x]++] = int(3*t);
+      vertex_corners[fill[tri.y]++] = int(3*t+1);
+      vertex_corners[fill[tri.z]++] = int(3*t+2);
+    }
   }
 
-  // Normalize
-  for (size_t k = 0; k < mesh.num_vertices; ++k) {
-    if (weights[k] > 0.0) vertex_ao[k] /= static_cast<float>(weights[k]);
+#pragma omp parallel for if(n > MIN_SAMPLES_PER_CHUNK)
+  for (ptrdiff_t k = 0; k < ptrdiff_t(n); ++k) {
+    double val = 0.0, weight = 0.0;
+    for (int j = corner_offsets[k]; j < corner_offsets[k+1]; ++j) {
+      val    += corners[2*vertex_corners[j]];
+      weight += corners[2*vertex_corners[j]+1];
+    }
+    vertex_ao[k] = weight > 0.0 ? static_cast<float>(val / weight) : 0.0f;
+  }
+}
+
+
+// Splat area-weighted samples onto vertices
+void filter_mesh_area_weighted(
+    const bake::Mesh&       mesh,
+    const bake::AOSamples&  ao_samples,
+    const float*            ao_values,
+    AreaFilterScratch&      scratch,
+    float*                  vertex_ao
+    )
+{
+  // Partial arrays are kept within the size of the samples themselves
+  const size_t num_chunks = std::max( size_t(1), std::min( std::min( MAX_PARTIAL_CHUNKS, ao_samples.num_samples / MIN_SAMPLES_PER_CHUNK ),
+                                                           ao_samples.num_samples / std::max( mesh.num_vertices, size_t(1) ) ) );
+  if (mesh.num_vertices > MAX_PARTIAL_VERTICES && samples_sorted_by_triangle(ao_samples)) {
+    filter_mesh_area_weighted_sorted(mesh, ao_samples, ao_values, scratch, vertex_ao);
+  } else {
+    filter_mesh_area_weighted_partials(mesh, ao_samples, ao_values, num_chunks, scratch, vertex_ao);
   }
+}
 
+// Filters instance i, whose samples start at sample_offset and per triangle arrays at tri_offset
+void filter_instance(
+    const bake::Scene&      scene,
+    const size_t            i,
+    const size_t            num_samples,
+    const size_t            sample_offset,
+    const size_t            tri_offset,
+    const bake::AOSamples&  ao_samples,
+    const float*            ao_values,
+    AreaFilterScratch&      scratch,
+    float*                  vertex_ao,
+    ParallelTimer&          filter_timer,
+    ProgressCounter&        progress
+    )
+{
+  ProfileRange range( "filter instance", PROFILE_COLOR_FILTER, uint64_t( i ) );
+  Timer timer;
+  timer.start();
+
+  // Point to samples for this instance
+  bake::AOSamples instance_ao_samples;
+  instance_ao_samples.num_samples = num_samples;
+  // Positions and normals stay NULL when samples were placed on the device; only infos are needed here
+  instance_ao_samples.sample_positions = ao_samples.sample_positions ? ao_samples.sample_positions + 3*sample_offset : NULL;
+  instance_ao_samples.sample_normals = ao_samples.sample_normals ? ao_samples.sample_normals + 3*sample_offset : NULL;
+  instance_ao_samples.sample_face_normals = ao_samples.sample_face_normals ? ao_samples.sample_face_normals + 3*sample_offset : NULL;
+  instance_ao_samples.sample_infos = ao_samples.sample_infos ? ao_samples.sample_infos + sample_offset : NULL;
+  instance_ao_samples.tri_sample_counts = NULL;
+  instance_ao_samples.compact_sample_infos = ao_samples.compact_sample_infos ? ao_samples.compact_sample_infos + sample_offset : NULL;
+  instance_ao_samples.tri_sample_dA = ao_samples.tri_sample_dA ? ao_samples.tri_sample_dA + tri_offset : NULL;
+  instance_ao_samples.sample_instances = NULL;
+  instance_ao_samples.sample_memory = ao_samples.sample_memory;
+  instance_ao_samples.ao_memory = ao_samples.ao_memory;
+  instance_ao_samples.first_sample_index = ao_samples.first_sample_index + sample_offset;
+
+  const float* instance_ao_values = ao_values + sample_offset;
+
+  filter_mesh_area_weighted(scene.meshes[scene.instances[i].mesh_index], instance_ao_samples, instance_ao_values, scratch, vertex_ao);
+  timer.stop();
+  filter_timer.add(timer);
+  recordMeshProfile(scene.instances[i].mesh_index, MESH_PROFILE_FILTER_ASSEMBLY_SECONDS, timer.elapsed);
+  progress.add(scene.meshes[scene.instances[i].mesh_index].num_vertices);
 }
 
 }  // namespace
@@ -83,30 +275,55 @@ void bake::filter(
     )
 {
   std::vector<size_t> sample_offset_per_instance(scene.num_instances);
+  std::vector<size_t> tri_offset_per_instance(scene.num_instances);
+  std::vector<size_t> costs(scene.num_instances);
+  uint64_t total_vertices = 0;
   {
     size_t sample_offset = 0;
+    size_t tri_offset = 0;
     for (size_t i = 0; i < scene.num_instances; ++i) {
       sample_offset_per_instance[i] = sample_offset;
       sample_offset += num_samples_per_instance[i];
+      tri_offset_per_instance[i] = tri_offset;
+      costs[i] = scene.meshes[scene.instances[i].mesh_index].num_triangles;
+      tri_offset += costs[i];
+      total_vertices += scene.meshes[scene.instances[i].mesh_index].num_vertices;
     }
   }
 
-#pragma omp parallel for
-  for (ptrdiff_t i = 0; i < ptrdiff_t(scene.num_instances); ++i) {
-    size_t sample_offset = sample_offset_per_instance[i];
+  ParallelTimer filter_timer;
+  ProgressCounter progress("filter", total_vertices);
+  ThreadScratch<AreaFilterScratch> scratch;
 
-    // Point to samples for this instance
-    AOSamples instance_ao_samples;
-    instance_ao_samples.num_samples = num_samples_per_instance[i];
-    instance_ao_samples.sample_positions = ao_samples.sample_positions + 3*sample_offset;
-    instance_ao_samples.sample_normals = ao_samples.sample_normals + 3*sample_offset;
-    instance_ao_samples.sample_face_normals = ao_samples.sample_face_normals + 3*sample_offset;
-    instance_ao_samples.sample_infos = ao_samples.sample_infos + sample_offset;
+  // Samples scatter to the vertices of their instance, so instances are not cut into ranges.  Those that the schedule
+  // would cut run one at a time, leaving the threads to the filter of their mesh; the rest run whole, largest first.
+  std::vector<WorkRange> ranges;
+  splitWork(costs, ranges);
+  std::vector<size_t> large_instances, small_instances;
+  for (size_t r = 0; r < ranges.size(); ++r) {
+    if (ranges[r].whole(costs[ranges[r].item])) {
+      small_instances.push_back(ranges[r].item);
+    } else if (ranges[r].begin == 0) {
+      large_instances.push_back(ranges[r].item);
+    }
+  }
 
-    const float* instance_ao_values = ao_values + sample_offset;
+  for (size_t k = 0; k < large_instances.size(); ++k) {
+    const size_t i = large_instances[k];
+    filter_instance(scene, i, num_samples_per_instance[i], sample_offset_per_instance[i], tri_offset_per_instance[i], 
+                    ao_samples, ao_values, scratch.local(), vertex_ao[i], filter_timer, progress);
+  }
 
-    filter_mesh_area_weighted(scene.meshes[scene.instances[i].mesh_index], instance_ao_samples, instance_ao_values, vertex_ao[i]);
+  // A single instance leaves the threads to the filter of its mesh
+#pragma omp parallel for schedule(dynamic, 1) if(small_instances.size() > 1)
+  for (ptrdiff_t k = 0; k < ptrdiff_t(small_instances.size()); ++k) {
+    const size_t i = small_instances[k];
+    filter_instance(scene, i, num_samples_per_instance[i], sample_offset_per_instance[i], tri_offset_per_instance[i], 
+                    ao_samples, ao_values, scratch.local(), vertex_ao[i], filter_timer, progress);
   }
+
+  std::cerr << "\n\tfilter instances ...   ";  printTimeElapsed( filter_timer );
+  recordTime( "filter.area_weighted", filter_timer );
 }
 
 
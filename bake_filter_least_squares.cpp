@@ -30,12 +30,18 @@
 
 #include "bake_api.h"
 #include "bake_filter_least_squares.h"
+#include "bake_kernels.h"
+#include "bake_sample.h"
 #include "bake_util.h"
+#include "Buffer.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <map>
-#include <utility>
+#include <string>
 #include <vector>
 #include <optixu/optixu_math_namespace.h>
 
@@ -45,6 +51,15 @@
 #include <Eigen/Core>
 #include <Eigen/Geometry>  // for cross product
 #include <Eigen/SparseCholesky>
+#ifdef BAKE_WITH_CHOLMOD
+#include <Eigen/CholmodSupport>
+#endif
+#ifdef BAKE_WITH_PARDISO
+#include <Eigen/PardisoSupport>
+#endif
+#ifdef BAKE_WITH_METIS
+#include <Eigen/MetisSupport>
+#endif
 
 using namespace optix;
 
@@ -57,11 +72,262 @@ typedef Eigen::Matrix<ScalarType, 4, 4> Matrix44;
 typedef Eigen::Triplet<ScalarType> Triplet;
 typedef Eigen::Matrix<ScalarType, 3, 1> Vector3;
 typedef Eigen::Matrix<ScalarType, 2, 1> Vector2;
-
-typedef std::map< std::pair<int, int>, ScalarType > TripletMap;
+typedef Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic, int> EliminationOrder;  // row eliminated k-th at k
 
 namespace {
 
+// Conjugate gradient solves stop at this residual relative to the right hand side, or iteration count.  The system is
+// well conditioned for the usual regularization weights, so this takes tens of iterations from the area based guess.
+const float CG_TOLERANCE      = 1e-5f;
+const int   CG_MAX_ITERATIONS = 1000;
+
+// Host conjugate gradients run their matrix and vector loops in parallel on systems of at least this many rows.
+// Meshes that large are filtered one at a time, like the supernodal ones, so that the loops get all threads.
+const size_t HOST_CG_MIN_PARALLEL_VERTICES = 1 << 16;
+
+// Incomplete Cholesky factorizations that break down on a pivot that is not positive are redone with the diagonal
+// scaled by 1 + shift, the shift doubling from the first one, before the solve falls back to Jacobi
+const double ICHOL_INITIAL_SHIFT = 1e-3;
+const int    ICHOL_MAX_SHIFTS    = 16;
+
+// Float factorizations whose solution leaves a larger residual, relative to the right hand side, are redone in double
+const double FLOAT_RESIDUAL_TOLERANCE = 1e-4;
+
+// Instances with the same sample pattern share one factorization, and are solved as one multi-column right hand
+// side in blocks of this many columns
+const size_t RHS_BLOCK_COLUMNS = 32;
+
+// Meshes with at least this many vertices are factorized by the selected supernodal solver, which uses all cores
+// inside one factorization, one mesh at a time.  Smaller meshes keep the simplicial solver with its shared analysis,
+// and run in parallel over instances.
+const size_t SUPERNODAL_MIN_VERTICES = 1 << 17;
+
+// Patches of a mesh filtered on its own overlap their neighbors by this many rings of triangles.  Solutions are 
+// blended across the overlap with weights that ramp up from the cut.
+const int PATCH_OVERLAP_RINGS = 3;
+
+// Geometric nested dissection stops splitting sets of this many vertices, and eliminates them in mesh order
+const size_t NESTED_DISSECTION_LEAF_VERTICES = 64;
+
+const char* const ORDERING_NAMES[bake::LEAST_SQUARES_ORDERING_INVALID] = { "amd", "colamd", "metis", "geometric", "auto" };
+
+// LDLT solver that can take over the symbolic analysis (ordering and elimination tree) of another solver,
+// so instances of a mesh only pay for the numeric factorization.  The analysis does not depend on the scalar 
+// type, so a float solver can also take it over from a double one, through exportPattern and importPattern.
+template <typename Scalar>
+class PatternLDLT : public Eigen::SimplicialLDLT< Eigen::SparseMatrix<Scalar> >
+{
+public:
+  void adoptPattern( const PatternLDLT& other )
+  {
+    assert( other.m_analysisIsOk );
+    this->m_P = other.m_P;
+    this->m_Pinv = other.m_Pinv;
+    this->m_parent = other.m_parent;
+    this->m_nonZerosPerCol = other.m_nonZerosPerCol;
+    this->m_matrix = other.m_matrix;  // column pointers of L
+    setAnalyzed();
+  }
+
+  // The symbolic analysis as plain arrays, for the filter cache: the permutation (empty for none), the elimination tree,
+  // nonzeros per column and column pointers of L.
+  void exportPattern( std::vector<int64_t>& perm, std::vector<int64_t>& parent, std::vector<int64_t>& nonzeros, std::vector<int64_t>& l_outer ) const
+  {
+    assert( this->m_analysisIsOk );
+    const size_t n = size_t( this->m_matrix.cols() );
+    perm.resize( size_t( this->m_P.size() ) );
+    for (size_t i = 0; i < perm.size(); ++i) perm[i] = this->m_P.indices()[i];
+    parent.assign( this->m_parent.data(), this->m_parent.data() + n );
+    nonzeros.assign( this->m_nonZerosPerCol.data(), this->m_nonZerosPerCol.data() + n );
+    l_outer.assign( this->m_matrix.outerIndexPtr(), this->m_matrix.outerIndexPtr() + n + 1 );
+  }
+
+  void importPattern( const size_t n, const std::vector<int64_t>& perm, const std::vector<int64_t>& parent, const std::vector<int64_t>& nonzeros,
+                      const std::vector<int64_t>& l_outer )
+  {
+    if ( perm.empty() ) {
+      this->m_P.resize( 0 );
+      this->m_Pinv.resize( 0 );
+    } else {
+      this->m_P.resize( (int)n );
+      for (size_t i = 0; i < n; ++i) this->m_P.indices()[i] = perm[i];
+      this->m_Pinv = this->m_P.inverse();
+    }
+    this->m_parent.resize( (int)n );
+    this->m_nonZerosPerCol.resize( (int)n );
+    for (size_t i = 0; i < n; ++i) {
+      this->m_parent[i] = (int)parent[i];
+      this->m_nonZerosPerCol[i] = (int)nonzeros[i];
+    }
+    this->m_matrix.resize( (int)n, (int)n );
+    this->m_matrix.resizeNonZeros( (int)l_outer[n] );
+    for (size_t i = 0; i <= n; ++i) this->m_matrix.outerIndexPtr()[i] = (int)l_outer[i];
+    setAnalyzed();
+  }
+
+  // Symbolic analysis of the symmetric matrix a, lower triangle, with rows eliminated in the given order, as the
+  // ordering functors of Eigen give it
+  void analyzePatternOrdered( const Eigen::SparseMatrix<Scalar>& a, const EliminationOrder& order )
+  {
+    this->m_Pinv = order;
+    this->m_P = order.inverse();
+    Eigen::SparseMatrix<Scalar> ap( a.rows(), a.cols() );
+    ap.template selfadjointView<Eigen::Upper>() = a.template selfadjointView<Eigen::Lower>().twistedBy( this->m_P );
+    this->analyzePattern_preordered( ap, true );
+  }
+
+  // Nonzeros of the factor L, counting its unit diagonal like the supernodal solvers count theirs
+  size_t factorNonZeros() const
+  {
+    assert( this->m_analysisIsOk );
+    const size_t n = size_t( this->m_matrix.cols() );
+    return size_t( this->m_matrix.outerIndexPtr()[n] ) + n;
+  }
+
+private:
+  void setAnalyzed()
+  {
+    this->m_isInitialized = true;
+    this->m_info = Eigen::Success;
+    this->m_analysisIsOk = true;
+    this->m_factorizationIsOk = false;
+  }
+};
+
+typedef PatternLDLT<ScalarType> SharedPatternLDLT;
+typedef PatternLDLT<float>      FloatLDLT;
+
+
+// On-disk cache of per-mesh filter data, so repeat bakes of the same geometry skip building it.  One file per
+// mesh and kind, named after a content hash of the mesh: a header, then index arrays as int64 and values as double.
+const char     FILTER_CACHE_MAGIC[8] = { 'B', 'A', 'K', 'E', 'F', 'L', 'T', '1' };
+const uint32_t FILTER_CACHE_REGULARIZER = 1;  // CSC regularization matrix: outer, inner, values
+const uint32_t FILTER_CACHE_PATTERN     = 2;  // symbolic LDLT analysis: perm, parent, nonzeros, L outer
+
+struct FilterCacheHeader
+{
+  char     magic[8];
+  uint32_t kind;
+  uint32_t reserved;
+  uint64_t key;
+  uint64_t rows;
+  uint64_t sizes[4];  // element counts of the arrays that follow
+};
+
+std::string filter_cache_filename( const char* dir, const uint32_t kind, const uint64_t key )
+{
+  char name[64];
+  sprintf( name, "%s_%016llx.bin", kind == FILTER_CACHE_REGULARIZER ? "regularizer" : "ldlt_pattern", (unsigned long long)key );
+  std::string filename( dir );
+  if ( !filename.empty() && filename[filename.size()-1] != '/' && filename[filename.size()-1] != '\\' ) filename += '/';
+  return filename + name;
+}
+
+bool write_cache_file( const std::string& filename, FilterCacheHeader& header, const std::vector<int64_t>* index_arrays, const size_t num_index_arrays,
+                       const std::vector<double>* values )
+{
+  memcpy( header.magic, FILTER_CACHE_MAGIC, sizeof(header.magic) );
+  for (size_t k = 0; k < num_index_arrays; ++k) header.sizes[k] = index_arrays[k].size();
+  if ( values ) header.sizes[num_index_arrays] = values->size();
+
+  // Write to a temporary name so an interrupted run never leaves a truncated file that looks valid.  Instances of
+  // identical meshes may be filtered at the same time, so the name is per thread.
+  char suffix[32];
+  sprintf( suffix, ".tmp%d", threadIndex() );
+  const std::string temp_filename = filename + suffix;
+  FILE* file = fopen( temp_filename.c_str(), "wb" );
+  if ( !file ) return false;
+  bool ok = fwrite( &header, sizeof(header), 1, file ) == 1;
+  for (size_t k = 0; ok && k < num_index_arrays; ++k) {
+    ok = index_arrays[k].empty() || fwrite( &index_arrays[k][0], sizeof(int64_t), index_arrays[k].size(), file ) == index_arrays[k].size();
+  }
+  if ( ok && values ) {
+    ok = values->empty() || fwrite( &(*values)[0], sizeof(double), values->size(), file ) == values->size();
+  }
+  ok = fclose( file ) == 0 && ok;
+  if ( ok ) {
+    remove( filename.c_str() );
+    ok = rename( temp_filename.c_str(), filename.c_str() ) == 0;
+  }
+  if ( !ok ) remove( temp_filename.c_str() );
+  return ok;
+}
+
+bool read_cache_file( const std::string& filename, const uint32_t kind, const uint64_t key, const uint64_t rows,
+                      std::vector<int64_t>* index_arrays, const size_t num_index_arrays, std::vector<double>* values )
+{
+  FILE* file = fopen( filename.c_str(), "rb" );
+  if ( !file ) return false;
+  FilterCacheHeader header;
+  bool ok = fread( &header, sizeof(header), 1, file ) == 1 && memcmp( header.magic, FILTER_CACHE_MAGIC, sizeof(header.magic) ) == 0 &&
+    header.kind == kind && header.key == key && header.rows == rows;
+  for (size_t k = 0; ok && k < num_index_arrays; ++k) {
+    index_arrays[k].resize( size_t( header.sizes[k] ) );
+    ok = index_arrays[k].empty() || fread( &index_arrays[k][0], sizeof(int64_t), index_arrays[k].size(), file ) == index_arrays[k].size();
+  }
+  if ( ok && values ) {
+    values->resize( size_t( header.sizes[num_index_arrays] ) );
+    ok = values->empty() || fread( &(*values)[0], sizeof(double), values->size(), file ) == values->size();
+  }
+  fclose( file );
+  return ok;
+}
+
+bool save_regularization_matrix( const char* dir, const uint64_t key, const SparseMatrix& R )
+{
+  assert( R.isCompressed() );
+  const size_t n = size_t( R.cols() );
+  const size_t nnz = size_t( R.nonZeros() );
+  std::vector<int64_t> arrays[2];
+  arrays[0].assign( R.outerIndexPtr(), R.outerIndexPtr() + n + 1 );
+  arrays[1].assign( R.innerIndexPtr(), R.innerIndexPtr() + nnz );
+  std::vector<double> values( R.valuePtr(), R.valuePtr() + nnz );
+  FilterCacheHeader header;
+  memset( &header, 0, sizeof(header) );
+  header.kind = FILTER_CACHE_REGULARIZER;
+  header.key = key;
+  header.rows = n;
+  return write_cache_file( filter_cache_filename( dir, FILTER_CACHE_REGULARIZER, key ), header, arrays, 2, &values );
+}
+
+bool load_regularization_matrix( const char* dir, const uint64_t key, const size_t n, SparseMatrix& R )
+{
+  std::vector<int64_t> arrays[2];
+  std::vector<double> values;
+  if ( !read_cache_file( filter_cache_filename( dir, FILTER_CACHE_REGULARIZER, key ), FILTER_CACHE_REGULARIZER, key, n, arrays, 2, &values ) ) return false;
+  const size_t nnz = values.size();
+  if ( arrays[0].size() != n + 1 || arrays[1].size() != nnz || size_t( arrays[0][n] ) != nnz ) return false;
+  R.resize( (int)n, (int)n );
+  R.resizeNonZeros( (int)nnz );
+  for (size_t i = 0; i <= n; ++i) R.outerIndexPtr()[i] = (int)arrays[0][i];
+  for (size_t k = 0; k < nnz; ++k) {
+    R.innerIndexPtr()[k] = (int)arrays[1][k];
+    R.valuePtr()[k] = values[k];
+  }
+  return true;
+}
+
+bool save_system_pattern( const char* dir, const uint64_t key, const SharedPatternLDLT& solver )
+{
+  std::vector<int64_t> arrays[4];
+  solver.exportPattern( arrays[0], arrays[1], arrays[2], arrays[3] );
+  FilterCacheHeader header;
+  memset( &header, 0, sizeof(header) );
+  header.kind = FILTER_CACHE_PATTERN;
+  header.key = key;
+  header.rows = arrays[1].size();
+  return write_cache_file( filter_cache_filename( dir, FILTER_CACHE_PATTERN, key ), header, arrays, 4, NULL );
+}
+
+bool load_system_pattern( const char* dir, const uint64_t key, const size_t n, SharedPatternLDLT& solver )
+{
+  std::vector<int64_t> arrays[4];
+  if ( !read_cache_file( filter_cache_filename( dir, FILTER_CACHE_PATTERN, key ), FILTER_CACHE_PATTERN, key, n, arrays, 4, NULL ) ) return false;
+  if ( ( !arrays[0].empty() && arrays[0].size() != n ) || arrays[1].size() != n || arrays[2].size() != n || arrays[3].size() != n + 1 ) return false;
+  solver.importPattern( n, arrays[0], arrays[1], arrays[2], arrays[3] );
+  return true;
+}
+
 ScalarType triangleArea(const Vector3 &a, const Vector3 &b, const Vector3 &c)
 {
 	Vector3 ba = b - a, ca = c - a;
@@ -152,94 +418,140 @@ bool butterflyGradDiff(const Vector3 v[4], Matrix24 &GD)
 	return true;
 }
 
-struct Butterfly {
-  std::pair<int, int> wingverts;
-  int count;
-  Butterfly() 
-    : wingverts(std::make_pair(-1, -1)), count(0)
-  {}
+// One side of an edge: the vertex opposite to it in a face, and whether the face runs from the lower to the higher
+// edge vertex (left side, ccw) or the other way (right side).  Sorted by edge, then side.
+struct HalfEdge {
+  uint64_t edge;      // lower vertex index in the high word, higher in the low word
+  int      side;      // 0 for left, 1 for right
+  int      opposite;
+
+  bool operator<( const HalfEdge& other ) const {
+    if ( edge != other.edge ) return edge < other.edge;
+    if ( side != other.side ) return side < other.side;
+    return opposite < other.opposite;
+  }
 };
 
-typedef std::map<std::pair<int, int>, Butterfly > EdgeMap;
-
 const float3* get_vertex(const float* v, unsigned stride_bytes, int index)
 {
   return reinterpret_cast<const float3*>(reinterpret_cast<const unsigned char*>(v) + index*stride_bytes);
 }
 
-void edgeBasedRegularizer(const float* verts, size_t num_verts, unsigned vertex_stride_bytes, const int3* faces, const size_t num_faces,
-  SparseMatrix &regularization_matrix)
-{
-  const unsigned stride_bytes = vertex_stride_bytes > 0 ? vertex_stride_bytes : 3*sizeof(float);
-
-  // Build edge map.  Each non-boundary edge stores the two opposite "butterfly" vertices that do not lie on the edge.
-  EdgeMap edges;
+// Vertices of the butterfly of an interior edge: the two edge vertices, then the wing vertices left and right of it
+struct ButterflyVerts {
+  int v[4];
+};
 
-  for (size_t i = 0; i < num_faces; ++i) {
+void findButterflies(const int3* faces, const size_t num_faces, std::vector<ButterflyVerts>& butterflies, size_t& num_edges)
+{
+  // Half edges sorted by edge put the two sides of every interior edge next to each other
+  std::vector<HalfEdge> half_edges(3*num_faces);
+#pragma omp parallel for if(num_faces >= (1 << 16))
+  for (ptrdiff_t i = 0; i < ptrdiff_t(num_faces); ++i) {
     const int indices[] = {faces[i].x, faces[i].y, faces[i].z};
     for (int k = 0; k < 3; ++k) {
       const int index0 = std::min(indices[k], indices[(k+1)%3]);
       const int index1 = std::max(indices[k], indices[(k+1)%3]);
-      const std::pair<int, int> edge = std::make_pair(index0, index1);
-      
-      if (index0 == indices[k]) {
-        edges[edge].wingverts.first = indices[(k+2)%3];  // butterfly vert on left side of edge, ccw
-        edges[edge].count++;
-      } else {
-        edges[edge].wingverts.second = indices[(k+2)%3];  // and right side 
-        edges[edge].count++;
-      }
-
+      HalfEdge& half_edge = half_edges[3*i + k];
+      half_edge.edge = (uint64_t(uint32_t(index0)) << 32) | uint32_t(index1);
+      half_edge.side = index0 == indices[k] ? 0 : 1;
+      half_edge.opposite = indices[(k+2)%3];
     }
   }
-  
-  size_t skipped = 0;
-
-  TripletMap triplet_map;
-  size_t edge_index = 0;
-  for (EdgeMap::const_iterator it = edges.begin(); it != edges.end(); ++it, ++edge_index) {
-    if (it->second.count != 2) {
-      continue;  // not an interior edge, ignore
+  parallelSort(half_edges);
+
+  // Each interior edge has exactly one half edge on either side.  Edges are visited in (lower, higher) vertex order.
+  butterflies.clear();
+  butterflies.reserve(half_edges.size() / 2);
+  num_edges = 0;
+  for (size_t i = 0; i < half_edges.size(); ) {
+    size_t end = i + 1;
+    while (end < half_edges.size() && half_edges[end].edge == half_edges[i].edge) ++end;
+    ++num_edges;
+    // A pair on the same side is a duplicate face, ignore; so are boundary and non-manifold edges
+    if (end - i == 2 && half_edges[i].side == 0 && half_edges[i+1].side == 1) {
+      const ButterflyVerts b = {{int(half_edges[i].edge >> 32), int(half_edges[i].edge & 0xffffffffu), 
+                                 half_edges[i].opposite, half_edges[i+1].opposite}};
+      butterflies.push_back(b);
     }
+    i = end;
+  }
+}
 
-    int vertIdx[4] = {it->first.first, it->first.second, it->second.wingverts.first, it->second.wingverts.second};
-    if (it->second.wingverts.first < 0 || it->second.wingverts.second < 0) {
-      continue;  // duplicate face, ignore
-    }
+// GD^T GD of a butterfly, in units of area; false for a degenerate butterfly
+bool butterflyBlock(const float* verts, const unsigned stride_bytes, const ButterflyVerts& butterfly, Matrix44& GDtGD)
+{
+  Vector3 butterfly_verts[4];
+  for (size_t i = 0; i < 4; ++i) {
+    const float3* v = get_vertex(verts, stride_bytes, butterfly.v[i]);
+    butterfly_verts[i] = Vector3(v->x, v->y, v->z);
+  }
 
-    Vector3 butterfly_verts[4];
-    for (size_t i = 0; i < 4; ++i) {
-      const float3* v = get_vertex(verts, stride_bytes, vertIdx[i]);
-      butterfly_verts[i] = Vector3(v->x, v->y, v->z);
-    }
+  Matrix24 GD;
+  if (!butterflyGradDiff(butterfly_verts, GD)) {
+    return false;
+  }
+  GDtGD = GD.transpose() * GD; // units will now be [m^2]
+  return true;
+}
 
-    Matrix24 GD;
-    if (!butterflyGradDiff(butterfly_verts, GD)) {
-      skipped++;
-      continue;
-    }
+void edgeBasedRegularizer(const float* verts, size_t num_verts, unsigned vertex_stride_bytes, const int3* faces, const size_t num_faces,
+  SparseMatrix &regularization_matrix)
+{
+  const unsigned stride_bytes = vertex_stride_bytes > 0 ? vertex_stride_bytes : 3*sizeof(float);
 
-    Matrix44 GDtGD = GD.transpose() * GD; // units will now be [m^2]
+  std::vector<ButterflyVerts> butterflies;
+  size_t num_edges = 0;
+  findButterflies(faces, num_faces, butterflies, num_edges);
+  
+  // Raw triplets, in one buffer per contiguous range of butterflies; setFromTriplets sums the duplicates.  Ranges are 
+  // concatenated in order, so the sums don't depend on the thread count.
+  const ptrdiff_t num_butterflies = ptrdiff_t(butterflies.size());
+  const ptrdiff_t num_ranges = num_butterflies >= (1 << 14) ? maxThreads() : 1;
+  std::vector< std::vector< Triplet > > range_triplets(num_ranges);
+  std::vector<size_t> range_skipped(num_ranges, 0);
+
+#pragma omp parallel for if(num_ranges > 1)
+  for (ptrdiff_t r = 0; r < num_ranges; ++r) {
+    const ptrdiff_t begin = num_butterflies * r / num_ranges;
+    const ptrdiff_t end = num_butterflies * (r+1) / num_ranges;
+    std::vector< Triplet >& triplets = range_triplets[r];
+    triplets.reserve(16*(end - begin));
+    for (ptrdiff_t b = begin; b < end; ++b) {
+      const int* vertIdx = butterflies[b].v;
+      Matrix44 GDtGD;
+      if (!butterflyBlock(verts, stride_bytes, butterflies[b], GDtGD)) {
+        range_skipped[r]++;
+        continue;
+      }
 
-    // scatter GDtGD:
-    for (int i=0; i < 4; i++) {
-      for (int j=0; j < 4; j++) {
-        triplet_map[ std::make_pair( vertIdx[i], vertIdx[j] ) ] += GDtGD(i, j);
+      // scatter GDtGD:
+      for (int i=0; i < 4; i++) {
+        for (int j=0; j < 4; j++) {
+          triplets.push_back( Triplet( vertIdx[i], vertIdx[j], GDtGD(i, j) ) );
+        }
       }
     }
   }
 
+  size_t skipped = 0;
   std::vector< Triplet > triplets;
-  triplets.reserve(triplet_map.size());
-  for ( TripletMap::const_iterator it = triplet_map.begin(); it != triplet_map.end(); ++it) {
-    triplets.push_back( Triplet( it->first.first, it->first.second, it->second ) );
+  {
+    size_t num_triplets = 0;
+    for (ptrdiff_t r = 0; r < num_ranges; ++r) num_triplets += range_triplets[r].size();
+    triplets.reserve(num_triplets);
+    for (ptrdiff_t r = 0; r < num_ranges; ++r) {
+      triplets.insert(triplets.end(), range_triplets[r].begin(), range_triplets[r].end());
+      std::vector< Triplet >().swap(range_triplets[r]);
+      skipped += range_skipped[r];
+    }
   }
 
 	regularization_matrix.resize((int)num_verts, (int)num_verts);
 	regularization_matrix.setFromTriplets(triplets.begin(), triplets.end());
 
   if (skipped > 0) {
-    std::cerr << "edgeBasedRegularizer: skipped " << skipped << " edges out of " << edges.size() << std::endl;
+    std::cerr << "edgeBasedRegularizer: skipped " << skipped << " edges out of " << num_edges << std::endl;
   }
 
 }
@@ -248,205 +560,2032 @@ void edgeBasedRegularizer(const float* verts, size_t num_verts, unsigned vertex_
 void build_regularization_matrix(
     const bake::Mesh& mesh,
     SparseMatrix& regularization_matrix,
-    Timer& timer
+    ParallelTimer& timer
   )
 {
 
-  timer.start();
+  Timer t;
+  t.start();
   const int3* tri_vertex_indices  = reinterpret_cast<int3*>( mesh.tri_vertex_indices );
   edgeBasedRegularizer(mesh.vertices, mesh.num_vertices, mesh.vertex_stride_bytes, tri_vertex_indices, mesh.num_triangles, regularization_matrix);
-  timer.stop();
+  t.stop();
+  timer.add(t);
 }
 
 
-void filter_mesh_least_squares(
-    const bake::Mesh&       mesh,
-    const bake::AOSamples&  ao_samples,
-    const float*            ao_values,
-    const float             regularization_weight,
-    const SparseMatrix&     regularization_matrix,
-    float*                  vertex_ao,
-    Timer&                  mass_matrix_timer,
-    Timer&                  decompose_timer,
-    Timer&                  solve_timer
-    )
-{
-  std::fill(vertex_ao, vertex_ao + mesh.num_vertices, 0.0f);
+// Regularizer block of one butterfly for the matrix-free solve: its vertices, and the upper triangle of GD^T GD row by row
+struct ButterflyBlock {
+  int   v[4];
+  float gtg[10];
+};
 
-  mass_matrix_timer.start();
+// Index into ButterflyBlock::gtg of entry (i, j)
+const int BLOCK_ENTRY[4][4] = { {0, 1, 2, 3}, {1, 4, 5, 6}, {2, 5, 7, 8}, {3, 6, 8, 9} };
 
-  const int3* tri_vertex_indices  = reinterpret_cast<int3*>( mesh.tri_vertex_indices );
+void build_butterfly_blocks(
+    const bake::Mesh& mesh,
+    std::vector<ButterflyBlock>& blocks,
+    ParallelTimer& timer
+  )
+{
+  Timer t;
+  t.start();
+  const unsigned stride_bytes = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+  std::vector<ButterflyVerts> butterflies;
+  size_t num_edges = 0;
+  findButterflies(reinterpret_cast<int3*>( mesh.tri_vertex_indices ), mesh.num_triangles, butterflies, num_edges);
+
+  // Degenerate butterflies are marked with a negative vertex and dropped afterwards
+  blocks.resize(butterflies.size());
+#pragma omp parallel for if(butterflies.size() >= (1 << 14))
+  for (ptrdiff_t b = 0; b < ptrdiff_t(butterflies.size()); ++b) {
+    ButterflyBlock& block = blocks[b];
+    Matrix44 GDtGD;
+    if (!butterflyBlock(mesh.vertices, stride_bytes, butterflies[b], GDtGD)) {
+      block.v[0] = -1;
+      continue;
+    }
+    for (int i = 0; i < 4; ++i) {
+      block.v[i] = butterflies[b].v[i];
+      for (int j = i; j < 4; ++j) block.gtg[BLOCK_ENTRY[i][j]] = static_cast<float>(GDtGD(i, j));
+    }
+  }
+  size_t num_blocks = 0;
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    if (blocks[b].v[0] >= 0) blocks[num_blocks++] = blocks[b];
+  }
+  blocks.resize(num_blocks);
+  t.stop();
+  timer.add(t);
+}
 
-  TripletMap triplet_map;
 
-  for (size_t i = 0; i < ao_samples.num_samples; ++i) {
-    const bake::SampleInfo& info = ao_samples.sample_infos[i];
-    const int3& tri = tri_vertex_indices[info.tri_idx];
+// All entries a sampled mass matrix can have, as explicit zeros: the diagonal and every pair of vertices that
+// share a triangle.  Adding this to a mass matrix makes its pattern independent of which triangles got samples.
+void build_mass_matrix_pattern(
+    const bake::Mesh& mesh,
+    SparseMatrix& mass_pattern
+  )
+{
+  const int3* tri_vertex_indices  = reinterpret_cast<int3*>( mesh.tri_vertex_indices );
+  std::vector< Triplet > triplets;
+  triplets.reserve(mesh.num_vertices + 6*mesh.num_triangles);
+  for (size_t i = 0; i < mesh.num_vertices; ++i) {
+    triplets.push_back( Triplet( (int)i, (int)i, 0.0 ) );
+  }
+  for (size_t i = 0; i < mesh.num_triangles; ++i) {
+    const int3& tri = tri_vertex_indices[i];
+    triplets.push_back( Triplet( tri.x, tri.y, 0.0 ) );
+    triplets.push_back( Triplet( tri.y, tri.x, 0.0 ) );
+    triplets.push_back( Triplet( tri.y, tri.z, 0.0 ) );
+    triplets.push_back( Triplet( tri.z, tri.y, 0.0 ) );
+    triplets.push_back( Triplet( tri.x, tri.z, 0.0 ) );
+    triplets.push_back( Triplet( tri.z, tri.x, 0.0 ) );
+  }
+  mass_pattern.resize( (int)mesh.num_vertices, (int)mesh.num_vertices );
+  mass_pattern.setFromTriplets( triplets.begin(), triplets.end() );
+}
 
-    const float val = ao_values[i] * info.dA;
 
-    vertex_ao[tri.x] += info.bary[0] * val;
-    vertex_ao[tri.y] += info.bary[1] * val;
-    vertex_ao[tri.z] += info.bary[2] * val;
+// Nonzeros of the system matrices solved for a mesh and of their factors, summed over its patches or groups, for
+// the mesh profile
+struct SystemNonZeros
+{
+  size_t matrix, factor;
+  SystemNonZeros() : matrix(0), factor(0) {}
 
-    // Note: the reference paper suggests computing the mass matrix analytically.
-    // Building it from samples gave smoother results for low numbers of samples per face.
-  
-    triplet_map[ std::make_pair( tri.x, tri.x ) ] += static_cast<ScalarType>( info.bary[0]*info.bary[0]*info.dA );
-    triplet_map[ std::make_pair( tri.y, tri.y ) ] += static_cast<ScalarType>( info.bary[1]*info.bary[1]*info.dA );
-    triplet_map[ std::make_pair( tri.z, tri.z ) ] += static_cast<ScalarType>( info.bary[2]*info.bary[2]*info.dA );
-    
+  // Thread safe; also records the filter's counters
+  void add(const size_t matrix_nonzeros, const size_t factor_nonzeros)
+  {
+    recordCount( "filter.least_squares.matrix_nonzeros", matrix_nonzeros );
+    recordCount( "filter.least_squares.factor_nonzeros", factor_nonzeros );
+#pragma omp atomic
+    matrix += matrix_nonzeros;
+#pragma omp atomic
+    factor += factor_nonzeros;
+  }
 
-    {
-      const double elem = static_cast<ScalarType>(info.bary[0]*info.bary[1]*info.dA);
-      triplet_map[ std::make_pair( tri.x, tri.y ) ] += elem;
-      triplet_map[ std::make_pair( tri.y, tri.x ) ] += elem;
-    }
+  // Adds the sums of another, e.g. of a group to those of the filter, without recording them again
+  void merge(const SystemNonZeros& other)
+  {
+#pragma omp atomic
+    matrix += other.matrix;
+#pragma omp atomic
+    factor += other.factor;
+  }
+};
 
-    {
-      const double elem = static_cast<ScalarType>(info.bary[1]*info.bary[2]*info.dA);
-      triplet_map[ std::make_pair( tri.y, tri.z ) ] += elem;
-      triplet_map[ std::make_pair( tri.z, tri.y ) ] += elem;
-    }
 
-    {
-      const double elem = static_cast<ScalarType>(info.bary[2]*info.bary[0]*info.dA);
-      triplet_map[ std::make_pair( tri.x, tri.z ) ] += elem;
-      triplet_map[ std::make_pair( tri.z, tri.x ) ] += elem;
-    }
+// Orders vertex indices by one coordinate of their positions
+struct AxisLess
+{
+  const std::vector<float3>& positions;
+  const int axis;
+  AxisLess(const std::vector<float3>& positions, const int axis) : positions(positions), axis(axis) {}
+  bool operator()(const int a, const int b) const { return (&positions[a].x)[axis] < (&positions[b].x)[axis]; }
+};
 
+// Nested dissection of the graph of the symmetric pattern C by vertex positions: the set is halved at the median of
+// its longest bbox axis, the vertices of the upper half with a neighbor in the lower half become the separator, and
+// the order is the lower half, then the rest of the upper half, each ordered the same way, then the separator.  The
+// separators of a surface are about the square root of its vertices, and cut long parts across.  part is scratch,
+// one entry per vertex.
+void nested_dissection_order(const SparseMatrix& C, const std::vector<float3>& positions, std::vector<int>& set, std::vector<int>& part,
+                             int& next_part, std::vector<int>& order)
+{
+  if (set.size() <= NESTED_DISSECTION_LEAF_VERTICES) {
+    order.insert(order.end(), set.begin(), set.end());
+    return;
+  }
+  float3 lo = positions[set[0]];
+  float3 hi = lo;
+  for (size_t k = 1; k < set.size(); ++k) {
+    lo = fminf(lo, positions[set[k]]);
+    hi = fmaxf(hi, positions[set[k]]);
+  }
+  const float3 extent = hi - lo;
+  const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+  const size_t mid = set.size() / 2;
+  std::nth_element(set.begin(), set.begin() + mid, set.end(), AxisLess(positions, axis));
+
+  const int lower = next_part++;
+  const int upper = next_part++;
+  for (size_t k = 0; k < mid; ++k) part[set[k]] = lower;
+  for (size_t k = mid; k < set.size(); ++k) part[set[k]] = upper;
+  std::vector<int> lower_set(set.begin(), set.begin() + mid);
+  std::vector<int> upper_set;
+  std::vector<int> separator;
+  upper_set.reserve(set.size() - mid);
+  for (size_t k = mid; k < set.size(); ++k) {
+    const int v = set[k];
+    bool cut = false;
+    for (SparseMatrix::InnerIterator it(C, v); it && !cut; ++it) cut = part[it.row()] == lower;
+    if (cut) separator.push_back(v);
+    else     upper_set.push_back(v);
   }
+  std::vector<int>().swap(set);
 
-  std::vector< Triplet > triplets;
-  triplets.reserve(triplet_map.size());
-  for ( TripletMap::const_iterator it = triplet_map.begin(); it != triplet_map.end(); ++it) {
-    triplets.push_back( Triplet( it->first.first, it->first.second, it->second ) );
+  nested_dissection_order(C, positions, lower_set, part, next_part, order);
+  nested_dissection_order(C, positions, upper_set, part, next_part, order);
+  order.insert(order.end(), separator.begin(), separator.end());
+}
+
+// Fill reducing elimination order of the system matrix A of a mesh
+void fill_reducing_order(const bake::Mesh& mesh, const SparseMatrix& A, const bake::LeastSquaresOrdering ordering, EliminationOrder& order)
+{
+  // Both triangles, as the solver orders them
+  SparseMatrix C;
+  C = A.selfadjointView<Eigen::Lower>();
+  C.makeCompressed();
+  switch (ordering) {
+    case bake::LEAST_SQUARES_ORDERING_COLAMD: {
+      Eigen::COLAMDOrdering<int> colamd;
+      colamd(C, order);
+      break;
+    }
+#ifdef BAKE_WITH_METIS
+    case bake::LEAST_SQUARES_ORDERING_METIS: {
+      Eigen::MetisOrdering<int> metis;
+      metis(C, order);
+      break;
+    }
+#endif
+    case bake::LEAST_SQUARES_ORDERING_GEOMETRIC: {
+      const size_t n = mesh.num_vertices;
+      const unsigned stride_bytes = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+      const unsigned char* vertices = reinterpret_cast<const unsigned char*>(mesh.vertices);
+      std::vector<float3> positions(n);
+      std::vector<int> set(n);
+      for (size_t v = 0; v < n; ++v) {
+        positions[v] = *reinterpret_cast<const float3*>(vertices + v*stride_bytes);
+        set[v] = int(v);
+      }
+      std::vector<int> part(n, -1);
+      std::vector<int> elimination;
+      elimination.reserve(n);
+      int next_part = 0;
+      nested_dissection_order(C, positions, set, part, next_part, elimination);
+      order.resize(int(n));
+      for (size_t k = 0; k < n; ++k) order.indices()[k] = elimination[k];
+      break;
+    }
+    default: {
+      Eigen::AMDOrdering<int> amd;
+      amd(C, order);
+      break;
+    }
   }
+}
 
-  // Mass matrix
-  SparseMatrix mass_matrix( (int)mesh.num_vertices, (int)mesh.num_vertices );
-  mass_matrix.setFromTriplets( triplets.begin(), triplets.end() );
 
-  // Fix missing data due to unreferenced verts
-  {
-    Eigen::VectorXd ones = Eigen::VectorXd::Constant(mesh.num_vertices, 1.0);
-    Eigen::VectorXd lumped = mass_matrix * ones;
-    for (int i = 0; i < mesh.num_vertices; ++i) {
-      if (lumped(i) <= 0.0) {  // all valid entries in mass matrix are > 0
-        mass_matrix.coeffRef(i, i) = 1.0;
+// Symbolic factorization of the system matrix, done once per mesh.  Automatic ordering analyzes with each candidate,
+// which counts the nonzeros of its factor exactly in a fraction of the time of the factorization, and keeps the fewest.
+void analyze_system_pattern(
+    const bake::Mesh&   mesh,
+    const SparseMatrix& mass_pattern,
+    const float         regularization_weight,
+    const SparseMatrix& regularization_matrix,
+    const bake::LeastSquaresOrdering ordering,
+    SharedPatternLDLT&  analyzed_solver,
+    ParallelTimer&      timer,
+    SystemNonZeros&     nonzeros
+  )
+{
+  Timer t;
+  t.start();
+  SparseMatrix regularized;
+  if (regularization_weight > 0.0f) regularized = mass_pattern + regularization_matrix;
+  const SparseMatrix& A = regularization_weight > 0.0f ? regularized : mass_pattern;
+  const size_t matrix_nonzeros = size_t( A.nonZeros() );
+
+  bake::LeastSquaresOrdering chosen = ordering;
+  if (ordering == bake::LEAST_SQUARES_ORDERING_AMD) {
+    analyzed_solver.analyzePattern(A);
+  } else if (ordering != bake::LEAST_SQUARES_ORDERING_AUTO) {
+    EliminationOrder order;
+    fill_reducing_order(mesh, A, ordering, order);
+    analyzed_solver.analyzePatternOrdered(A, order);
+  } else {
+    const bake::LeastSquaresOrdering candidates[] = { bake::LEAST_SQUARES_ORDERING_AMD, bake::LEAST_SQUARES_ORDERING_GEOMETRIC, 
+                                                      bake::LEAST_SQUARES_ORDERING_METIS };
+    EliminationOrder best_order;
+    size_t best_nonzeros = 0;
+    for (size_t k = 0; k < sizeof(candidates)/sizeof(candidates[0]); ++k) {
+      if (!bake::leastSquaresOrderingAvailable(candidates[k])) continue;
+      EliminationOrder order;
+      fill_reducing_order(mesh, A, candidates[k], order);
+      analyzed_solver.analyzePatternOrdered(A, order);
+      if (best_nonzeros == 0 || analyzed_solver.factorNonZeros() < best_nonzeros) {
+        best_nonzeros = analyzed_solver.factorNonZeros();
+        best_order = order;
+        chosen = candidates[k];
       }
     }
+    if (analyzed_solver.factorNonZeros() != best_nonzeros) analyzed_solver.analyzePatternOrdered(A, best_order);
   }
+  t.stop();
+  timer.add(t);
+  recordCount( (std::string("filter.least_squares.ordering.") + ORDERING_NAMES[chosen]).c_str(), 1 );
 
-  mass_matrix_timer.stop();
-  
-  Eigen::SimplicialLDLT<SparseMatrix> solver;	
+  // Lower triangle with the diagonal, which the system always has, against the factor for the fill-in
+  nonzeros.add( (matrix_nonzeros + size_t( mass_pattern.cols() ))/2, analyzed_solver.factorNonZeros() );
+}
 
-  // Optional edge-based regularization for smoother result, see paper for details
-  if (regularization_weight > 0.0f) {
 
-    decompose_timer.start();
-    SparseMatrix A = mass_matrix + regularization_weight*regularization_matrix;
-    solver.compute(A);
-    decompose_timer.stop();
+// Part of a mesh filtered as a mesh of its own: a run of triangles in Morton order, grown by PATCH_OVERLAP_RINGS 
+// rings of neighbors, with its own numbering of the vertices they use.
+struct MeshPatch
+{
+  std::vector<unsigned> triangles;   // mesh triangles, sorted
+  std::vector<unsigned> vertices;    // mesh vertex of each patch vertex, sorted
+  std::vector<int3>     tri_vertex_indices;  // per patch triangle, in patch vertices
+  std::vector<float3>   positions;   // per patch vertex
+  std::vector<float>    weights;     // partition of unity weight per patch vertex, divided by the sum over patches
+};
 
-  } else {
-    decompose_timer.start();
-    solver.compute(mass_matrix);
-    decompose_timer.stop();
+// Data shared by all instances of a mesh
+struct MeshSystemData
+{
+  SparseMatrix      regularization_matrix;
+  SparseMatrix      mass_pattern;
+  SharedPatternLDLT analyzed_solver;
+  std::vector<ButterflyBlock> butterfly_blocks;  // instead of the matrices, for the matrix-free solve
+  std::vector<MeshPatch> patches;    // instead of the matrices, for meshes filtered by patches
+  std::vector<float> edge_lengths;   // of the geometry the regularizer was built for, 3 per triangle, when it is kept
+};
+
+// Lazily built per-mesh data, and the number of instance groups still to be filtered before it can be released
+struct MeshSystem
+{
+  MeshSystemData* data;
+  size_t          remaining_groups;
+  uint64_t        kept_key;  // not 0 if the data is kept for the next call instead of released
+  Mutex           mutex;
+  MeshSystem() : data(NULL), remaining_groups(0), kept_key(0) {}
+  ~MeshSystem() { delete data; }
+};
+
+// Per-mesh data kept from one call to the next for frames of an animation, by mesh index, with the key of the
+// topology and settings it was built for
+struct KeptSystems
+{
+  Mutex    mutex;
+  float    rigid_tolerance;  // negative when nothing is kept
+  std::vector<uint64_t>        keys;
+  std::vector<MeshSystemData*> systems;
+  KeptSystems() : rigid_tolerance(-1.0f) {}
+  ~KeptSystems() { clear(); }
+  void clear() {
+    for (size_t i = 0; i < systems.size(); ++i) delete systems[i];
+    keys.clear();
+    systems.clear();
   }
+};
 
-  solve_timer.start();
+KeptSystems& kept_systems()
+{
+  static KeptSystems kept;
+  return kept;
+}
 
-  assert( solver.info() == Eigen::Success );
+// Conjugate gradient settings of a filter call, taken from the process wide ones when it starts
+struct CGOptions
+{
+  float                  tolerance;
+  bake::CGPreconditioner preconditioner;  // of the host solver
+};
 
-  Eigen::VectorXd b( mesh.num_vertices );
-  Eigen::VectorXd x( mesh.num_vertices );
-  for (size_t k = 0; k < mesh.num_vertices; ++k) {
-    b(k) = vertex_ao[k];
-    x(k) = 0.0;
-  }
+struct CGSettings
+{
+  Mutex     mutex;
+  CGOptions options;
+  CGSettings() { options.tolerance = CG_TOLERANCE; options.preconditioner = bake::CG_PRECONDITIONER_JACOBI; }
+};
 
-  x = solver.solve(b);
+CGSettings& cg_settings()
+{
+  static CGSettings settings;
+  return settings;
+}
 
-  solve_timer.stop();
+// Key of what the per-mesh data depends on besides vertex positions: the triangles and vertex count, and the settings
+// that decide which parts get built.  Never 0.
+uint64_t kept_system_key( const bake::Mesh& mesh, const float regularization_weight, const bake::LeastSquaresOrdering ordering, 
+                          const bool analyzed, const bool matrix_free )
+{
+  const uint64_t settings[] = { uint64_t(mesh.num_vertices), uint64_t(regularization_weight > 0.0f), uint64_t(ordering), 
+                                uint64_t(analyzed), uint64_t(matrix_free) };
+  const uint64_t key = hashBytes( mesh.tri_vertex_indices, 3*sizeof(unsigned)*mesh.num_triangles, hashBytes( settings, sizeof(settings) ) );
+  return key ? key : 1;
+}
 
-  assert( solver.info() == Eigen::Success ); // for debug build
-  if ( solver.info() == Eigen::Success ) {
-    for (size_t k = 0; k < mesh.num_vertices; ++k) {
-      vertex_ao[k] = static_cast<float>(x(k));  // Note: allow out-of-range values
+void triangle_edge_lengths( const bake::Mesh& mesh, std::vector<float>& lengths )
+{
+  const int3* tri_vertex_indices = reinterpret_cast<int3*>( mesh.tri_vertex_indices );
+  const unsigned stride_bytes = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+  lengths.resize( 3*mesh.num_triangles );
+  for (size_t t = 0; t < mesh.num_triangles; ++t) {
+    const int indices[] = { tri_vertex_indices[t].x, tri_vertex_indices[t].y, tri_vertex_indices[t].z };
+    for (int k = 0; k < 3; ++k) {
+      lengths[3*t + k] = optix::length( *get_vertex( mesh.vertices, stride_bytes, indices[(k+1)%3] ) - 
+                                        *get_vertex( mesh.vertices, stride_bytes, indices[k] ) );
     }
   }
 }
 
+// Whether every edge of the mesh is within tolerance, relative, of its length in lengths.  The regularizer only 
+// depends on the shape of the butterflies around each edge, so a nearly isometric deformation leaves it nearly as is.
+bool rigid_edges( const bake::Mesh& mesh, const std::vector<float>& lengths, const float tolerance )
+{
+  std::vector<float> current;
+  triangle_edge_lengths( mesh, current );
+  if (current.size() != lengths.size()) return false;
+  for (size_t e = 0; e < current.size(); ++e) {
+    if (std::abs( current[e] - lengths[e] ) > tolerance*lengths[e]) return false;
+  }
+  return true;
+}
 
-} //namespace
-
+bool same_pattern( const SparseMatrix& a, const SparseMatrix& b )
+{
+  return a.rows() == b.rows() && a.cols() == b.cols() && a.nonZeros() == b.nonZeros() &&
+         std::equal( a.outerIndexPtr(), a.outerIndexPtr() + a.outerSize() + 1, b.outerIndexPtr() ) &&
+         std::equal( a.innerIndexPtr(), a.innerIndexPtr() + a.nonZeros(), b.innerIndexPtr() );
+}
 
-void bake::filter_least_squares(
-    const Scene&        scene,
-    const size_t*       num_samples_per_instance,
-    const AOSamples&    ao_samples,
-    const float*        ao_values,
-    const float         regularization_weight,
-    float**             vertex_ao
-    )
+// Zero fill-in incomplete Cholesky factor of a system matrix: L L^T is close to A, with L on the pattern of the lower
+// triangle of A.  Rows of L are in CSR, each with its diagonal last.
+struct IncompleteCholesky
 {
+  std::vector<int>    row_offsets;
+  std::vector<int>    columns;
+  std::vector<double> values;
+};
 
-  Timer mass_matrix_timer;
-  Timer regularization_matrix_timer;
-  Timer decompose_timer;
-  Timer solve_timer;
+// Buffers of the filters of one thread, reused by the instance groups it filters, so that scenes of many small
+// meshes don't allocate per instance
+struct LeastSquaresScratch
+{
+  std::vector<double> tri_areas;
+  std::vector<double> lumped;
+  std::vector<double> b, x, r, z, p, Ap, inv_diag;  // host conjugate gradients; b also for the device ones
+  IncompleteCholesky  ichol;                        // preconditioner of the host solve of assembled systems
+  SparseMatrix        mass_matrix;                  // on the pattern of the mesh
+  SparseMatrix        system_matrix;
+  SharedPatternLDLT   solver;
+  FloatLDLT           float_solver;
+  std::vector<int64_t> pattern[4];                  // analysis handed from the double to the float solver
+  std::vector<const float*> group_ao_values;
+  std::vector<float*> group_vertex_ao;
+  std::vector<const float*> group_initial_ao;
+};
 
-  std::vector<size_t> sample_offset_per_instance(scene.num_instances);
-  {
-    size_t sample_offset = 0;
-    for (size_t i = 0; i < scene.num_instances; ++i) {
-      sample_offset_per_instance[i] = sample_offset;
-      sample_offset += num_samples_per_instance[i];
-    }
+// M + w R.  Once the regularizer is built, for any weight of the bake, its entries stay in the system, as zeros for a
+// weight of 0, so that every weight has the pattern that was analyzed.
+void build_system_matrix(const SparseMatrix& mass_matrix, const float regularization_weight, const SparseMatrix& regularization_matrix,
+                         SparseMatrix& A)
+{
+  if (regularization_matrix.nonZeros() > 0) {
+    A = mass_matrix + regularization_weight*regularization_matrix;
+  } else {
+    A = mass_matrix;
   }
+}
 
-#pragma omp parallel for
-  for (ptrdiff_t meshIdx = 0; meshIdx < ptrdiff_t(scene.num_meshes); meshIdx++) {
+// Largest of the weights of a bake: whether the regularizer is built and in the analyzed pattern
+float max_weight(const float* regularization_weights, const size_t num_weights)
+{
+  return num_weights > 0 ? *std::max_element(regularization_weights, regularization_weights + num_weights) : 0.0f;
+}
 
-    // Build reg. matrix once, it does not depend on rigid xform per instance
-    SparseMatrix regularization_matrix;
-    if (regularization_weight > 0.0f) {
-      build_regularization_matrix(scene.meshes[meshIdx], regularization_matrix, regularization_matrix_timer);
-    }
+// Adds value at (row, col) of a compressed matrix, which must have the entry
+inline void add_to_entry(SparseMatrix& m, const int row, const int col, const double value)
+{
+  const int* first = m.innerIndexPtr() + m.outerIndexPtr()[col];
+  const int* last = m.innerIndexPtr() + m.outerIndexPtr()[col + 1];
+  const int* it = std::lower_bound(first, last, row);
+  assert(it != last && *it == row);
+  m.valuePtr()[it - m.innerIndexPtr()] += value;
+}
 
-    // Filter all the instances that point to this mesh
-#pragma omp parallel for
-    for (ptrdiff_t i = 0; i < ptrdiff_t(scene.num_instances); ++i) {
-      if (scene.instances[i].mesh_index == meshIdx) {
-        size_t sample_offset = sample_offset_per_instance[i];
 
-        // Point to samples for this instance
-        AOSamples instance_ao_samples;
-        instance_ao_samples.num_samples = num_samples_per_instance[i];
-        instance_ao_samples.sample_positions = ao_samples.sample_positions + 3*sample_offset;
-        instance_ao_samples.sample_normals = ao_samples.sample_normals + 3*sample_offset;
-        instance_ao_samples.sample_face_normals = ao_samples.sample_face_normals + 3*sample_offset;
-        instance_ao_samples.sample_infos = ao_samples.sample_infos + sample_offset;
+// Solves A x = b on the device in float, with x holding the initial guess on input.  A is symmetric, so its
+// compressed column storage doubles as CSR.  Returns the number of iterations.
+int solve_conjugate_gradient(
+    const SparseMatrix&        A,
+    const std::vector<double>& b,
+    const float                tolerance,
+    float*                     x
+    )
+{
+  assert( A.isCompressed() );
+  const int n = (int)A.rows();
+  const int nnz = (int)A.nonZeros();
+  std::vector<float> values( A.valuePtr(), A.valuePtr() + nnz );
+  std::vector<float> rhs( b.begin(), b.begin() + n );
+
+  Buffer<int>   row_offsets( n+1, RTP_BUFFER_TYPE_CUDA_LINEAR );
+  Buffer<int>   columns( nnz, RTP_BUFFER_TYPE_CUDA_LINEAR );
+  Buffer<float> values_device( nnz, RTP_BUFFER_TYPE_CUDA_LINEAR );
+  Buffer<float> b_device( n, RTP_BUFFER_TYPE_CUDA_LINEAR );
+  Buffer<float> x_device( n, RTP_BUFFER_TYPE_CUDA_LINEAR );
+  CHK_CUDA( cudaMemcpy( row_offsets.ptr(),   A.outerIndexPtr(), (n+1)*sizeof(int),  cudaMemcpyHostToDevice ) );
+  CHK_CUDA( cudaMemcpy( columns.ptr(),       A.innerIndexPtr(), nnz*sizeof(int),    cudaMemcpyHostToDevice ) );
+  CHK_CUDA( cudaMemcpy( values_device.ptr(), &values[0],        nnz*sizeof(float),  cudaMemcpyHostToDevice ) );
+  CHK_CUDA( cudaMemcpy( b_device.ptr(),      &rhs[0],           n*sizeof(float),    cudaMemcpyHostToDevice ) );
+  CHK_CUDA( cudaMemcpy( x_device.ptr(),      x,                 n*sizeof(float),    cudaMemcpyHostToDevice ) );
+
+  const int iterations = bake::solveConjugateGradientDevice( n, row_offsets.ptr(), columns.ptr(), values_device.ptr(), b_device.ptr(),
+                                                             x_device.ptr(), CG_MAX_ITERATIONS, tolerance );
+  CHK_CUDA( cudaMemcpy( x, x_device.ptr(), n*sizeof(float), cudaMemcpyDeviceToHost ) );
+  return iterations;
+}
 
-        const float* instance_ao_values = ao_values + sample_offset;
+// Factorizes A, symmetric and compressed, into ichol without fill-in: row i of L takes, for each column k < i of the 
+// pattern, L_ik = (A_ik - sum_j L_ij L_kj) / L_kk over the columns j < k of both rows, then its diagonal.  False if
+// a row has no diagonal, or if no shift of the diagonal keeps the pivots positive.
+bool incomplete_cholesky(const SparseMatrix& A, IncompleteCholesky& ichol)
+{
+  assert( A.isCompressed() );
+  const int n = (int)A.rows();
+  const int* offsets = A.outerIndexPtr();
+  const int* rows = A.innerIndexPtr();
+  const double* values = A.valuePtr();
+
+  // A is symmetric, so column i holds row i, and its entries up to the diagonal are row i of the lower triangle
+  std::vector<int>& row_offsets = ichol.row_offsets;
+  std::vector<int>& columns = ichol.columns;
+  row_offsets.resize(n + 1);
+  columns.clear();
+  row_offsets[0] = 0;
+  for (int i = 0; i < n; ++i) {
+    int j = offsets[i];
+    for (; j < offsets[i + 1] && rows[j] <= i; ++j) columns.push_back(rows[j]);
+    if (columns.empty() || columns.back() != i) return false;
+    row_offsets[i + 1] = (int)columns.size();
+  }
 
-        filter_mesh_least_squares(scene.meshes[meshIdx], instance_ao_samples, instance_ao_values, regularization_weight, regularization_matrix,
-          vertex_ao[i], mass_matrix_timer, decompose_timer, solve_timer);
+  std::vector<double>& L = ichol.values;
+  L.resize(columns.size());
+  double shift = 0.0;
+  for (int attempt = 0; attempt <= ICHOL_MAX_SHIFTS; ++attempt) {
+    bool ok = true;
+    for (int i = 0; i < n && ok; ++i) {
+      const int row_begin = row_offsets[i];
+      const int diag = row_offsets[i + 1] - 1;
+      for (int e = row_begin, j = offsets[i]; e <= diag; ++e, ++j) L[e] = values[j];
+      L[diag] *= 1.0 + shift;
+      for (int e = row_begin; e <= diag; ++e) {
+        const int k = columns[e];
+        // Sparse dot product of rows i and k over the columns before k, merged in column order
+        double sum = 0.0;
+        int a = row_begin, c = row_offsets[k];
+        const int k_diag = row_offsets[k + 1] - 1;
+        while (a < e && c < k_diag) {
+          if (columns[a] < columns[c]) ++a;
+          else if (columns[a] > columns[c]) ++c;
+          else sum += L[a++] * L[c++];
+        }
+        if (e < diag) {
+          L[e] = (L[e] - sum) / L[k_diag];
+        } else if (L[e] - sum > 0.0) {
+          L[e] = std::sqrt(L[e] - sum);
+        } else {
+          ok = false;
+        }
       }
     }
+    if (ok) {
+      if (attempt > 0) recordCount( "filter.least_squares.ichol_shifts", attempt );
+      return true;
+    }
+    shift = attempt == 0 ? ICHOL_INITIAL_SHIFT : 2.0*shift;
   }
+  return false;
+}
 
-  std::cerr << "\n\tbuild mass matrices ...           ";  printTimeElapsed( mass_matrix_timer );
-  if (regularization_weight > 0.0f) {
-    std::cerr << "\tbuild regularization matrices ... ";  printTimeElapsed( regularization_matrix_timer );
+// z = (L L^T)^-1 r, by a forward solve with L and a backward one with L^T, which goes over the rows of L in reverse
+void apply_incomplete_cholesky(const IncompleteCholesky& ichol, const std::vector<double>& r, std::vector<double>& z)
+{
+  const int n = (int)ichol.row_offsets.size() - 1;
+  const int* row_offsets = &ichol.row_offsets[0];
+  const int* columns = &ichol.columns[0];
+  const double* L = &ichol.values[0];
+  for (int i = 0; i < n; ++i) {
+    double sum = r[i];
+    const int diag = row_offsets[i + 1] - 1;
+    for (int e = row_offsets[i]; e < diag; ++e) sum -= L[e] * z[columns[e]];
+    z[i] = sum / L[diag];
+  }
+  for (int i = n - 1; i >= 0; --i) {
+    const int diag = row_offsets[i + 1] - 1;
+    z[i] /= L[diag];
+    for (int e = row_offsets[i]; e < diag; ++e) z[columns[e]] -= L[e] * z[i];
   }
-  std::cerr << "\tdecompose matrices ...            ";  printTimeElapsed( decompose_timer );
-  std::cerr << "\tsolve linear systems ...         ";  printTimeElapsed( solve_timer );
 }
 
-#else
+// Inverse of the diagonal of A, with 1 for rows without a positive one
+void jacobi_preconditioner(const SparseMatrix& A, std::vector<double>& inv_diag)
+{
+  const int n = (int)A.rows();
+  inv_diag.assign(n, 1.0);
+  for (int i = 0; i < n; ++i) {
+    for (int j = A.outerIndexPtr()[i]; j < A.outerIndexPtr()[i + 1]; ++j) {
+      if (A.innerIndexPtr()[j] == i && A.valuePtr()[j] > 0.0) inv_diag[i] = 1.0 / A.valuePtr()[j];
+    }
+  }
+}
+
+// y = A x, in parallel over rows if asked.  A is symmetric, so its compressed columns are its rows.
+void multiply_system_matrix(const SparseMatrix& A, const std::vector<double>& x, std::vector<double>& y, const bool parallel)
+{
+  const int* offsets = A.outerIndexPtr();
+  const int* rows = A.innerIndexPtr();
+  const double* values = A.valuePtr();
+#pragma omp parallel for schedule(static) if(parallel)
+  for (ptrdiff_t i = 0; i < ptrdiff_t(A.rows()); ++i) {
+    double sum = 0.0;
+    for (int j = offsets[i]; j < offsets[i + 1]; ++j) sum += values[j] * x[rows[j]];
+    y[i] = sum;
+  }
+}
+
+// z = M^-1 r for the incomplete Cholesky factor, or Jacobi with scratch.inv_diag if ichol is NULL; returns r.z
+double apply_preconditioner(const IncompleteCholesky* ichol, LeastSquaresScratch& scratch, const bool parallel)
+{
+  const std::vector<double>& r = scratch.r;
+  std::vector<double>& z = scratch.z;
+  const std::vector<double>& inv_diag = scratch.inv_diag;
+  const ptrdiff_t n = ptrdiff_t(r.size());
+  double rz = 0.0;
+  if (ichol) {
+    // The triangular solves are sequential, row after row
+    apply_incomplete_cholesky(*ichol, r, z);
+#pragma omp parallel for schedule(static) reduction(+:rz) if(parallel)
+    for (ptrdiff_t k = 0; k < n; ++k) rz += r[k] * z[k];
+  } else {
+#pragma omp parallel for schedule(static) reduction(+:rz) if(parallel)
+    for (ptrdiff_t k = 0; k < n; ++k) {
+      z[k] = inv_diag[k] * r[k];
+      rz += r[k] * z[k];
+    }
+  }
+  return rz;
+}
+
+// Solves A x = b on the host in double by preconditioned conjugate gradients, with x holding the initial guess on
+// input, and the same stopping rule as the device solve.  The products by A and the vector loops run in parallel
+// on systems of HOST_CG_MIN_PARALLEL_VERTICES rows and more.  With ichol NULL the preconditioner is Jacobi, and
+// scratch.inv_diag must hold it.  Returns the number of iterations.
+int solve_conjugate_gradient_host(
+    const SparseMatrix&        A,
+    const std::vector<double>& b,
+    const IncompleteCholesky*  ichol,
+    const float                tolerance,
+    LeastSquaresScratch&       scratch,
+    float*                     x_out
+    )
+{
+  assert( A.isCompressed() );
+  const ptrdiff_t n = ptrdiff_t(A.rows());
+  const bool parallel = size_t(n) >= HOST_CG_MIN_PARALLEL_VERTICES;
+  std::vector<double>& x = scratch.x;
+  std::vector<double>& r = scratch.r;
+  std::vector<double>& p = scratch.p;
+  std::vector<double>& Ap = scratch.Ap;
+  x.assign(x_out, x_out + n);
+  r.resize(n);
+  scratch.z.resize(n);
+  p.resize(n);
+  Ap.resize(n);
+
+  multiply_system_matrix(A, x, Ap, parallel);
+  double b_norm2 = 0.0, r_norm2 = 0.0;
+#pragma omp parallel for schedule(static) reduction(+:b_norm2,r_norm2) if(parallel)
+  for (ptrdiff_t k = 0; k < n; ++k) {
+    r[k] = b[k] - Ap[k];
+    b_norm2 += b[k] * b[k];
+    r_norm2 += r[k] * r[k];
+  }
+  double rz = apply_preconditioner(ichol, scratch, parallel);
+  std::copy(scratch.z.begin(), scratch.z.end(), p.begin());
+  const double threshold = double(tolerance) * tolerance * (b_norm2 > 0.0 ? b_norm2 : 1.0);
+
+  int iteration = 0;
+  while (iteration < CG_MAX_ITERATIONS && r_norm2 > threshold) {
+    multiply_system_matrix(A, p, Ap, parallel);
+    double pAp = 0.0;
+#pragma omp parallel for schedule(static) reduction(+:pAp) if(parallel)
+    for (ptrdiff_t k = 0; k < n; ++k) pAp += p[k] * Ap[k];
+    if (pAp <= 0.0) break;
+    const double alpha = rz / pAp;
+    r_norm2 = 0.0;
+#pragma omp parallel for schedule(static) reduction(+:r_norm2) if(parallel)
+    for (ptrdiff_t k = 0; k < n; ++k) {
+      x[k] += alpha * p[k];
+      r[k] -= alpha * Ap[k];
+      r_norm2 += r[k] * r[k];
+    }
+    const double rz_next = apply_preconditioner(ichol, scratch, parallel);
+    const double beta = rz_next / rz;
+    rz = rz_next;
+    const std::vector<double>& z = scratch.z;
+#pragma omp parallel for schedule(static) if(parallel)
+    for (ptrdiff_t k = 0; k < n; ++k) p[k] = z[k] + beta * p[k];
+    ++iteration;
+  }
+
+  for (ptrdiff_t k = 0; k < n; ++k) x_out[k] = static_cast<float>(x[k]);
+  return iteration;
+}
+
+
+// y = (M + w R) x, streaming over samples and/or triangles for the mass matrix M and over butterfly blocks for the
+// regularizer R.  Vertices without samples have unit mass, as in the assembled system.
+void apply_system_matrix_free(
+    const bake::Mesh&                   mesh,
+    const bake::AOSamples&              ao_samples,
+    const std::vector<ButterflyBlock>&  blocks,
+    const float                         regularization_weight,
+    const std::vector<double>&          tri_areas,
+    const float                         analytic_mass_weight,
+    const std::vector<double>&          lumped,
+    const std::vector<double>&          x,
+    std::vector<double>&                y
+    )
+{
+  const int3* tri_vertex_indices  = reinterpret_cast<int3*>( mesh.tri_vertex_indices );
+  for (size_t k = 0; k < mesh.num_vertices; ++k) {
+    y[k] = lumped[k] > 0.0 ? 0.0 : x[k];
+  }
+  if (analytic_mass_weight < 1.0f) {
+    const double sampled_weight = 1.0 - analytic_mass_weight;
+    for (size_t i = 0; i < ao_samples.num_samples; ++i) {
+      const bake::SampleInfo info = bake::get_sample_info(ao_samples, i);
+      const int3& tri = tri_vertex_indices[info.tri_idx];
+      const double s = sampled_weight * info.dA * ( info.bary[0]*x[tri.x] + info.bary[1]*x[tri.y] + info.bary[2]*x[tri.z] );
+      y[tri.x] += info.bary[0] * s;
+      y[tri.y] += info.bary[1] * s;
+      y[tri.z] += info.bary[2] * s;
+    }
+  }
+  // area/12 * [2 1 1; 1 2 1; 1 1 2] x adds area/12 * (x_i + x_a + x_b + x_c) to each corner i
+  for (size_t t = 0; t < tri_areas.size(); ++t) {
+    const int3& tri = tri_vertex_indices[t];
+    const double scale = analytic_mass_weight * tri_areas[t] / 12.0;
+    const double sum = x[tri.x] + x[tri.y] + x[tri.z];
+    y[tri.x] += scale * (sum + x[tri.x]);
+    y[tri.y] += scale * (sum + x[tri.y]);
+    y[tri.z] += scale * (sum + x[tri.z]);
+  }
+  if (regularization_weight > 0.0f) {
+    for (size_t b = 0; b < blocks.size(); ++b) {
+      const ButterflyBlock& block = blocks[b];
+      for (int i = 0; i < 4; ++i) {
+        double sum = 0.0;
+        for (int j = 0; j < 4; ++j) sum += block.gtg[BLOCK_ENTRY[i][j]] * x[block.v[j]];
+        y[block.v[i]] += regularization_weight * sum;
+      }
+    }
+  }
+}
+
+
+// Least squares filter solved by Jacobi preconditioned conjugate gradients on the host, without assembling
+// or factorizing any matrix: memory is linear in vertices, samples and butterflies.
+void filter_mesh_matrix_free(
+    const bake::Mesh&                   mesh,
+    const bake::AOSamples&              ao_samples,
+    const float*                        ao_values,
+    const float                         regularization_weight,
+    const std::vector<ButterflyBlock>&  blocks,
+    const float                         analytic_mass_weight,
+    LeastSquaresScratch&                scratch,
+    float*                              vertex_ao,
+    const float*                        initial_ao,  // may be NULL
+    const float                         tolerance,
+    ParallelTimer&                      setup_timer_total,
+    ParallelTimer&                      solve_timer_total
+    )
+{
+  Timer setup_timer;
+  Timer solve_timer;
+  setup_timer.start();
+
+  const size_t n = mesh.num_vertices;
+  const int3* tri_vertex_indices  = reinterpret_cast<int3*>( mesh.tri_vertex_indices );
+
+  // Right hand side, row sums and diagonal of the mass matrix
+  const double sampled_weight = 1.0 - analytic_mass_weight;
+  std::vector<double>& b = scratch.b;
+  std::vector<double>& lumped = scratch.lumped;
+  std::vector<double>& inv_diag = scratch.inv_diag;
+  b.assign(n, 0.0);
+  lumped.assign(n, 0.0);
+  inv_diag.assign(n, 0.0);
+  std::vector<double>& tri_areas = scratch.tri_areas;
+  tri_areas.assign(analytic_mass_weight > 0.0f ? mesh.num_triangles : 0, 0.0);
+  for (size_t i = 0; i < ao_samples.num_samples; ++i) {
+    const bake::SampleInfo info = bake::get_sample_info(ao_samples, i);
+    const int3& tri = tri_vertex_indices[info.tri_idx];
+    const int verts[] = {tri.x, tri.y, tri.z};
+    const double val = ao_values[i] * info.dA;
+    const double dA = sampled_weight * info.dA;
+    const double bary_sum = double(info.bary[0]) + info.bary[1] + info.bary[2];
+    for (int k = 0; k < 3; ++k) {
+      b[verts[k]]        += info.bary[k] * val;
+      lumped[verts[k]]   += info.bary[k] * dA * bary_sum;
+      inv_diag[verts[k]] += info.bary[k] * info.bary[k] * dA;
+    }
+    if (!tri_areas.empty()) tri_areas[info.tri_idx] += info.dA;
+  }
+  for (size_t t = 0; t < tri_areas.size(); ++t) {
+    const int3& tri = tri_vertex_indices[t];
+    const int verts[] = {tri.x, tri.y, tri.z};
+    for (int k = 0; k < 3; ++k) {
+      lumped[verts[k]]   += analytic_mass_weight * tri_areas[t] / 3.0;
+      inv_diag[verts[k]] += analytic_mass_weight * tri_areas[t] / 6.0;
+    }
+  }
+  if (regularization_weight > 0.0f) {
+    for (size_t k = 0; k < blocks.size(); ++k) {
+      for (int i = 0; i < 4; ++i) inv_diag[blocks[k].v[i]] += regularization_weight * blocks[k].gtg[BLOCK_ENTRY[i][i]];
+    }
+  }
+
+  // Start from the prior result if there is one, else from the area based filter result
+  std::vector<double>& x = scratch.x;
+  x.assign(n, 0.0);
+  for (size_t k = 0; k < n; ++k) {
+    if (lumped[k] <= 0.0) inv_diag[k] += 1.0;
+    inv_diag[k] = inv_diag[k] > 0.0 ? 1.0 / inv_diag[k] : 1.0;
+    x[k] = initial_ao ? initial_ao[k] : lumped[k] > 0.0 ? b[k] / lumped[k] : 0.0;
+  }
+  if (initial_ao) recordCount( "filter.least_squares.warm_starts", 1 );
+
+  setup_timer.stop();
+  setup_timer_total.add(setup_timer);
+  solve_timer.start();
+
+  std::vector<double>& r = scratch.r;
+  std::vector<double>& z = scratch.z;
+  std::vector<double>& p = scratch.p;
+  std::vector<double>& Ap = scratch.Ap;
+  r.resize(n);
+  z.resize(n);
+  p.resize(n);
+  Ap.resize(n);
+  apply_system_matrix_free(mesh, ao_samples, blocks, regularization_weight, tri_areas, analytic_mass_weight, lumped, x, Ap);
+  double b_norm2 = 0.0, r_norm2 = 0.0, rz = 0.0;
+  for (size_t k = 0; k < n; ++k) {
+    r[k] = b[k] - Ap[k];
+    z[k] = inv_diag[k] * r[k];
+    p[k] = z[k];
+    b_norm2 += b[k] * b[k];
+    r_norm2 += r[k] * r[k];
+    rz      += r[k] * z[k];
+  }
+  const double threshold = double(tolerance) * tolerance * (b_norm2 > 0.0 ? b_norm2 : 1.0);
+
+  int iteration = 0;
+  while (iteration < CG_MAX_ITERATIONS && r_norm2 > threshold) {
+    apply_system_matrix_free(mesh, ao_samples, blocks, regularization_weight, tri_areas, analytic_mass_weight, lumped, p, Ap);
+    double pAp = 0.0;
+    for (size_t k = 0; k < n; ++k) pAp += p[k] * Ap[k];
+    if (pAp <= 0.0) break;
+    const double alpha = rz / pAp;
+    double rz_next = 0.0;
+    r_norm2 = 0.0;
+    for (size_t k = 0; k < n; ++k) {
+      x[k] += alpha * p[k];
+      r[k] -= alpha * Ap[k];
+      z[k]  = inv_diag[k] * r[k];
+      r_norm2 += r[k] * r[k];
+      rz_next += r[k] * z[k];
+    }
+    const double beta = rz_next / rz;
+    rz = rz_next;
+    for (size_t k = 0; k < n; ++k) p[k] = z[k] + beta * p[k];
+    ++iteration;
+  }
+  recordCount( "filter.least_squares.matrix_free_iterations", iteration );
+
+  for (size_t k = 0; k < n; ++k) {
+    vertex_ao[k] = static_cast<float>(x[k]);  // Note: allow out-of-range values
+  }
+
+  solve_timer.stop();
+  solve_timer_total.add(solve_timer);
+}
+
+
+// Orders mesh indices by decreasing vertex count
+struct LargerMesh
+{
+  const bake::Mesh* meshes;
+  explicit LargerMesh(const bake::Mesh* m) : meshes(m) {}
+  bool operator()(size_t a, size_t b) const { return meshes[a].num_vertices > meshes[b].num_vertices; }
+};
+
+
+// Solves A X = B in blocks of columns, in parallel over blocks if the solver allows it and this is not called from
+// a parallel region.  Columns of B are the right hand sides in vertex_ao, which receive the solutions.  With 
+// check_residual, blocks whose solution leaves too large a residual keep their right hand sides, and their columns
+// are appended to unsolved.
+template <typename Solver, typename Scalar>
+void solve_rhs_blocks(
+    const Solver&        solver,
+    const SparseMatrix&  A,
+    const bool           check_residual,
+    const bool           parallel,
+    float* const*        vertex_ao,
+    const size_t         num_rhs,
+    const size_t         num_vertices,
+    std::vector<float*>& unsolved
+    )
+{
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> Block;
+  const ptrdiff_t num_blocks = ptrdiff_t( (num_rhs + RHS_BLOCK_COLUMNS - 1) / RHS_BLOCK_COLUMNS );
+  std::vector<char> block_ok( size_t(num_blocks), 1 );
+#pragma omp parallel for schedule(dynamic, 1) if(parallel && num_blocks > 1)
+  for (ptrdiff_t blk = 0; blk < num_blocks; ++blk) {
+    const size_t first = size_t(blk) * RHS_BLOCK_COLUMNS;
+    const size_t cols = std::min( RHS_BLOCK_COLUMNS, num_rhs - first );
+    Eigen::MatrixXd B( num_vertices, cols );
+    for (size_t c = 0; c < cols; ++c) {
+      for (size_t k = 0; k < num_vertices; ++k) B(k, c) = vertex_ao[first + c][k];
+    }
+    const Block Bs = B.cast<Scalar>();
+    const Block X = solver.solve( Bs );
+    if (solver.info() != Eigen::Success) {
+      block_ok[blk] = 0;
+      continue;
+    }
+    const Eigen::MatrixXd Xd = X.template cast<double>();
+    if (check_residual) {
+      const Eigen::MatrixXd R = B - A*Xd;
+      for (size_t c = 0; c < cols; ++c) {
+        const double b_norm = B.col(c).norm();
+        if (R.col(c).norm() > FLOAT_RESIDUAL_TOLERANCE * (b_norm > 0.0 ? b_norm : 1.0)) block_ok[blk] = 0;
+      }
+      if (!block_ok[blk]) continue;
+    }
+    for (size_t c = 0; c < cols; ++c) {
+      for (size_t k = 0; k < num_vertices; ++k) {
+        vertex_ao[first + c][k] = static_cast<float>(Xd(k, c));  // Note: allow out-of-range values
+      }
+    }
+  }
+  for (ptrdiff_t blk = 0; blk < num_blocks; ++blk) {
+    if (block_ok[blk]) continue;
+    const size_t first = size_t(blk) * RHS_BLOCK_COLUMNS;
+    unsolved.insert( unsolved.end(), vertex_ao + first, vertex_ao + std::min( first + RHS_BLOCK_COLUMNS, num_rhs ) );
+  }
+}
+
+
+#ifdef BAKE_WITH_CHOLMOD
+size_t supernodal_factor_nonzeros( Eigen::CholmodSupernodalLLT<SparseMatrix>& solver )
+{
+  return size_t( solver.cholmod().lnz );
+}
+#endif
+#ifdef BAKE_WITH_PARDISO
+size_t supernodal_factor_nonzeros( Eigen::PardisoLDLT<SparseMatrix>& solver )
+{
+  return size_t( solver.pardisoParameterArray()[17] );
+}
+#endif
+
+// Factorizes A with a supernodal solver and solves the right hand sides in vertex_ao.  The solver parallelizes
+// inside, and its solve is not reentrant, so blocks go one at a time.  Returns false if the factorization failed,
+// leaving the right hand sides as they were.
+template <typename Solver>
+bool solve_supernodal(
+    const SparseMatrix&  A,
+    float* const*        vertex_ao,
+    const size_t         num_rhs,
+    const size_t         num_vertices,
+    Timer&               decompose_timer,
+    Timer&               solve_timer,
+    SystemNonZeros&      nonzeros
+    )
+{
+  Solver solver;
+  decompose_timer.start();
+  solver.compute(A);
+  decompose_timer.stop();
+  if (solver.info() != Eigen::Success) return false;
+  nonzeros.add( (size_t( A.nonZeros() ) + num_vertices)/2, supernodal_factor_nonzeros( solver ) );
+
+  solve_timer.start();
+  std::vector<float*> unsolved;
+  solve_rhs_blocks<Solver, double>(solver, A, false, false, vertex_ao, num_rhs, num_vertices, unsolved);
+  solve_timer.stop();
+  return unsolved.empty();
+}
+
+
+// Filters a group of instances of a mesh with the same samples: the mass matrix is built and factorized once,
+// and the AO of each instance is one column of the right hand side.
+// Solves (M + w R) x = b for each right hand side, with M and the b in vertex_ao assembled by filter_mesh_least_squares
+void solve_mesh_least_squares(
+    const bake::Mesh&       mesh,
+    const float             regularization_weight,
+    const SparseMatrix&     regularization_matrix,
+    const SharedPatternLDLT& analyzed_solver,
+    const bool              use_cg,
+    const bool              cg_on_host,
+    const CGOptions&        cg,
+    const bool              use_float,
+    const bake::LeastSquaresSolver backend,
+    LeastSquaresScratch&    scratch,
+    float* const*           vertex_ao,
+    const size_t            num_rhs,
+    const float* const*     initial_ao,  // per right hand side, NULL or with NULL entries for none; CG only
+    ParallelTimer&          decompose_timer_total,
+    ParallelTimer&          solve_timer_total,
+    SystemNonZeros&         nonzeros
+    )
+{
+  Timer decompose_timer;
+  Timer solve_timer;
+  const SparseMatrix& mass_matrix = scratch.mass_matrix;
+  const std::vector<double>& lumped = scratch.lumped;
+
+  if (use_cg) {
+
+    // Nothing to factorize; the system matrix goes to the device as is, or gets its preconditioner for the host solve.
+    // The right hand sides of the group share the preconditioner.
+    decompose_timer.start();
+    SparseMatrix& A = scratch.system_matrix;
+    build_system_matrix(mass_matrix, regularization_weight, regularization_matrix, A);
+    A.makeCompressed();
+    bool use_ichol = false;
+    if (cg_on_host) {
+      if (cg.preconditioner == bake::CG_PRECONDITIONER_INCOMPLETE_CHOLESKY) {
+        use_ichol = incomplete_cholesky(A, scratch.ichol);
+        if (!use_ichol) recordCount( "filter.least_squares.ichol_fallbacks", 1 );
+      }
+      if (!use_ichol) jacobi_preconditioner(A, scratch.inv_diag);
+    }
+    decompose_timer.stop();
+    decompose_timer_total.add(decompose_timer);
+
+    solve_timer.start();
+
+    // Start from the prior result where there is one, e.g. of an earlier bake, and from the area based filter result
+    // otherwise: the lumped mass of a vertex is the sum of its sample weights.  CG stops at the residual tolerance, 
+    // so a close prior takes few iterations, or none.
+    std::vector<double>& b = scratch.b;
+    b.resize( mesh.num_vertices );
+    for (size_t c = 0; c < num_rhs; ++c) {
+      const float* initial = initial_ao ? initial_ao[c] : NULL;
+      for (size_t k = 0; k < mesh.num_vertices; ++k) {
+        b[k] = vertex_ao[c][k];
+        vertex_ao[c][k] = initial ? initial[k] : lumped[k] > 0.0 ? static_cast<float>(b[k] / lumped[k]) : 0.0f;
+      }
+      if ( initial ) recordCount( "filter.least_squares.warm_starts", 1 );
+      // Note: allow out-of-range values
+      if (cg_on_host) {
+        const int iterations = solve_conjugate_gradient_host(A, b, use_ichol ? &scratch.ichol : NULL, cg.tolerance, scratch, vertex_ao[c]);
+        recordCount( "filter.least_squares.host_cg_iterations", iterations );
+      } else {
+        const int iterations = solve_conjugate_gradient(A, b, cg.tolerance, vertex_ao[c]);
+        recordCount( "filter.least_squares.cg_iterations", iterations );
+      }
+    }
+
+    solve_timer.stop();
+    solve_timer_total.add(solve_timer);
+    return;
+  }
+  
+  std::vector<float*> double_rhs;
+  if (use_float) {
+    // Half the memory and twice the SIMD width for the factor.  AO is a low precision signal, but the system can 
+    // still be too ill conditioned for float, e.g. with tiny triangles, so check the residual in double.
+    decompose_timer.start();
+    FloatLDLT& float_solver = scratch.float_solver;
+    {
+      std::vector<int64_t>* pattern = scratch.pattern;
+      analyzed_solver.exportPattern(pattern[0], pattern[1], pattern[2], pattern[3]);
+      float_solver.importPattern(mesh.num_vertices, pattern[0], pattern[1], pattern[2], pattern[3]);
+    }
+    SparseMatrix& A = scratch.system_matrix;
+    build_system_matrix(mass_matrix, regularization_weight, regularization_matrix, A);
+    float_solver.factorize(A.cast<float>());
+    decompose_timer.stop();
+    decompose_timer_total.add(decompose_timer);
+
+    // Right hand sides are only overwritten by blocks that pass, so the fallback solves the others in double
+    solve_timer.start();
+    std::vector<float*> unsolved;
+    if (float_solver.info() == Eigen::Success) {
+      solve_rhs_blocks<FloatLDLT, float>(float_solver, A, true, true, vertex_ao, num_rhs, mesh.num_vertices, unsolved);
+    } else {
+      unsolved.assign(vertex_ao, vertex_ao + num_rhs);
+    }
+    solve_timer.stop();
+    solve_timer_total.add(solve_timer);
+
+    if (unsolved.empty()) return;
+    recordCount( "filter.least_squares.float_fallbacks", 1 );
+    decompose_timer.reset();
+    solve_timer.reset();
+    double_rhs.swap(unsolved);
+  }
+  float* const* double_ao = use_float ? &double_rhs[0] : vertex_ao;
+  const size_t num_double_rhs = use_float ? double_rhs.size() : num_rhs;
+
+  // Optional edge-based regularization for smoother result, see paper for details.  The float path left the same 
+  // matrix in the scratch.
+  SparseMatrix& A = scratch.system_matrix;
+  if (!use_float) {
+    build_system_matrix(mass_matrix, regularization_weight, regularization_matrix, A);
+  }
+
+  bool supernodal_ok = false;
+#ifdef BAKE_WITH_CHOLMOD
+  if (backend == bake::LEAST_SQUARES_SOLVER_CHOLMOD) {
+    supernodal_ok = solve_supernodal< Eigen::CholmodSupernodalLLT<SparseMatrix> >(A, double_ao, num_double_rhs, mesh.num_vertices, 
+                                                                                  decompose_timer, solve_timer, nonzeros);
+  }
+#endif
+#ifdef BAKE_WITH_PARDISO
+  if (backend == bake::LEAST_SQUARES_SOLVER_PARDISO) {
+    supernodal_ok = solve_supernodal< Eigen::PardisoLDLT<SparseMatrix> >(A, double_ao, num_double_rhs, mesh.num_vertices, 
+                                                                         decompose_timer, solve_timer, nonzeros);
+  }
+#endif
+  if (supernodal_ok) {
+    decompose_timer_total.add(decompose_timer);
+    solve_timer_total.add(solve_timer);
+    return;
+  }
+
+  SharedPatternLDLT& solver = scratch.solver;
+  decompose_timer.reset();
+  solve_timer.reset();
+  decompose_timer.start();
+  if (backend != bake::LEAST_SQUARES_SOLVER_SIMPLICIAL) {
+    recordCount( "filter.least_squares.supernodal_fallbacks", 1 );
+    solver.analyzePattern(A);
+  } else {
+    solver.adoptPattern(analyzed_solver);
+  }
+  solver.factorize(A);
+  decompose_timer.stop();
+
+  decompose_timer_total.add(decompose_timer);
+
+  solve_timer.start();
+
+  assert( solver.info() == Eigen::Success );
+
+  std::vector<float*> unsolved;
+  if ( solver.info() == Eigen::Success ) {
+    solve_rhs_blocks<SharedPatternLDLT, double>(solver, A, false, true, double_ao, num_double_rhs, mesh.num_vertices, unsolved);
+  }
+  assert( unsolved.empty() ); // for debug build
+
+  solve_timer.stop();
+  solve_timer_total.add(solve_timer);
+}
+
+
+// Assembles the mass matrix and the right hand sides of a group of instances once, and solves them for each weight:
+// vertex_ao holds num_rhs pointers per weight, in the order of the weights
+void filter_mesh_least_squares(
+    const bake::Mesh&       mesh,
+    const bake::AOSamples&  ao_samples,
+    const float* const*     ao_values,   // per instance of the group
+    const size_t            num_rhs,
+    const float*            regularization_weights,
+    const size_t            num_weights,
+    const SparseMatrix&     regularization_matrix,
+    const SparseMatrix&     mass_pattern,
+    const SharedPatternLDLT& analyzed_solver,
+    const bool              use_cg,
+    const bool              cg_on_host,  // CG solves on the host instead of the device
+    const CGOptions&        cg,
+    const bool              use_float,
+    const bake::LeastSquaresSolver backend,  // for the double factorization; others than simplicial have no analyzed_solver
+    const float             analytic_mass_weight,
+    LeastSquaresScratch&    scratch,
+    float* const*           vertex_ao,   // per weight, per instance of the group
+    const float* const*     initial_ao,  // per instance of the group, see solve_mesh_least_squares
+    ParallelTimer&          mass_matrix_timer_total,
+    ParallelTimer&          decompose_timer_total,
+    ParallelTimer&          solve_timer_total,
+    SystemNonZeros&         nonzeros
+    )
+{
+  for (size_t c = 0; c < num_rhs; ++c) {
+    std::fill(vertex_ao[c], vertex_ao[c] + mesh.num_vertices, 0.0f);
+  }
+
+  Timer mass_matrix_timer;
+  mass_matrix_timer.start();
+
+  const int3* tri_vertex_indices  = reinterpret_cast<int3*>( mesh.tri_vertex_indices );
+
+  // Sample weights of a triangle add up to its area, so the analytic mass blocks need a single pass over samples
+  const double sampled_weight = 1.0 - analytic_mass_weight;
+  std::vector<double>& tri_areas = scratch.tri_areas;
+  tri_areas.assign(analytic_mass_weight > 0.0f ? mesh.num_triangles : 0, 0.0);
+
+  // Mass matrix, with the full per-mesh pattern so the shared symbolic factorization applies.  Samples and triangles
+  // add straight into the entries of the pattern, which holds every pair of vertices of a triangle, in the order
+  // they used to go through triplets, so the sums are the same.
+  SparseMatrix& mass_matrix = scratch.mass_matrix;
+  mass_matrix = mass_pattern;
+
+  for (size_t i = 0; i < ao_samples.num_samples; ++i) {
+    const bake::SampleInfo info = bake::get_sample_info(ao_samples, i);
+    const int3& tri = tri_vertex_indices[info.tri_idx];
+
+    for (size_t c = 0; c < num_rhs; ++c) {
+      const float val = ao_values[c][i] * info.dA;
+      vertex_ao[c][tri.x] += info.bary[0] * val;
+      vertex_ao[c][tri.y] += info.bary[1] * val;
+      vertex_ao[c][tri.z] += info.bary[2] * val;
+    }
+
+    if (!tri_areas.empty()) tri_areas[info.tri_idx] += info.dA;
+    if (analytic_mass_weight >= 1.0f) continue;
+
+    // Note: the reference paper suggests computing the mass matrix analytically.
+    // Building it from samples gave smoother results for low numbers of samples per face.
+  
+    add_to_entry( mass_matrix, tri.x, tri.x, sampled_weight*static_cast<ScalarType>( info.bary[0]*info.bary[0]*info.dA ) );
+    add_to_entry( mass_matrix, tri.y, tri.y, sampled_weight*static_cast<ScalarType>( info.bary[1]*info.bary[1]*info.dA ) );
+    add_to_entry( mass_matrix, tri.z, tri.z, sampled_weight*static_cast<ScalarType>( info.bary[2]*info.bary[2]*info.dA ) );
+    
+
+    {
+      const double elem = sampled_weight*static_cast<ScalarType>(info.bary[0]*info.bary[1]*info.dA);
+      add_to_entry( mass_matrix, tri.x, tri.y, elem );
+      add_to_entry( mass_matrix, tri.y, tri.x, elem );
+    }
+
+    {
+      const double elem = sampled_weight*static_cast<ScalarType>(info.bary[1]*info.bary[2]*info.dA);
+      add_to_entry( mass_matrix, tri.y, tri.z, elem );
+      add_to_entry( mass_matrix, tri.z, tri.y, elem );
+    }
+
+    {
+      const double elem = sampled_weight*static_cast<ScalarType>(info.bary[2]*info.bary[0]*info.dA);
+      add_to_entry( mass_matrix, tri.x, tri.z, elem );
+      add_to_entry( mass_matrix, tri.z, tri.x, elem );
+    }
+
+  }
+
+  // Exact integral of the linear basis functions over each triangle: area/12 * [2 1 1; 1 2 1; 1 1 2]
+  for (size_t t = 0; t < tri_areas.size(); ++t) {
+    if (tri_areas[t] <= 0.0) continue;
+    const int3& tri = tri_vertex_indices[t];
+    const int verts[] = {tri.x, tri.y, tri.z};
+    const ScalarType off_diag = static_cast<ScalarType>( analytic_mass_weight * tri_areas[t] / 12.0 );
+    for (int a = 0; a < 3; ++a) {
+      for (int c = 0; c < 3; ++c) {
+        add_to_entry( mass_matrix, verts[a], verts[c], a == c ? 2*off_diag : off_diag );
+      }
+    }
+  }
+
+  // Fix missing data due to unreferenced verts.  The matrix is symmetric, so column sums are the row sums.
+  std::vector<double>& lumped = scratch.lumped;
+  lumped.assign(mesh.num_vertices, 0.0);
+  for (int i = 0; i < (int)mesh.num_vertices; ++i) {
+    for (int j = mass_matrix.outerIndexPtr()[i]; j < mass_matrix.outerIndexPtr()[i + 1]; ++j) lumped[i] += mass_matrix.valuePtr()[j];
+  }
+  for (int i = 0; i < mesh.num_vertices; ++i) {
+    if (lumped[i] <= 0.0) {  // all valid entries in mass matrix are > 0
+      mass_matrix.coeffRef(i, i) = 1.0;
+    }
+  }
+
+  mass_matrix_timer.stop();
+  mass_matrix_timer_total.add(mass_matrix_timer);
+
+  // Every weight solves its own copy of the right hand sides
+  for (size_t k = 1; k < num_weights; ++k) {
+    for (size_t c = 0; c < num_rhs; ++c) {
+      std::copy(vertex_ao[c], vertex_ao[c] + mesh.num_vertices, vertex_ao[k*num_rhs + c]);
+    }
+  }
+  for (size_t k = 0; k < num_weights; ++k) {
+    solve_mesh_least_squares(mesh, regularization_weights[k], regularization_matrix, analyzed_solver, use_cg, cg_on_host, cg, use_float, backend, scratch,
+      vertex_ao + k*num_rhs, num_rhs, initial_ao, decompose_timer_total, solve_timer_total, nonzeros);
+  }
+}
+
+
+// Splits a mesh into patches of about patch_vertices vertices before the overlap.  Each patch vertex weighs in by 
+// its distance in edges from the cut, the patch vertices whose triangles are not all in the patch, capped at
+// PATCH_OVERLAP_RINGS+1.  The vertices of a patch's own triangles are at least one edge from the cut, so every
+// vertex used by a triangle gets a positive sum of weights.
+void build_mesh_patches(
+    const bake::Mesh&       mesh,
+    const size_t            patch_vertices,
+    std::vector<MeshPatch>& patches,
+    ParallelTimer&          timer
+    )
+{
+  Timer t;
+  t.start();
+  const int3* tri_vertex_indices = reinterpret_cast<int3*>( mesh.tri_vertex_indices );
+  const unsigned stride_bytes = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+
+  // Triangles in Morton order of their centroids, so runs of them are spatially coherent
+  std::vector< std::pair<unsigned, unsigned> > codes(mesh.num_triangles);
+  {
+    const float3 bbox_min = make_float3(mesh.bbox_min[0], mesh.bbox_min[1], mesh.bbox_min[2]);
+    const float3 extent = make_float3(mesh.bbox_max[0], mesh.bbox_max[1], mesh.bbox_max[2]) - bbox_min;
+    const float3 scale = make_float3(extent.x > 0.0f ? 1023.0f/extent.x : 0.0f, extent.y > 0.0f ? 1023.0f/extent.y : 0.0f, 
+                                     extent.z > 0.0f ? 1023.0f/extent.z : 0.0f);
+#pragma omp parallel for
+    for (ptrdiff_t i = 0; i < ptrdiff_t(mesh.num_triangles); ++i) {
+      const int3& tri = tri_vertex_indices[i];
+      const float3 c = (*get_vertex(mesh.vertices, stride_bytes, tri.x) + *get_vertex(mesh.vertices, stride_bytes, tri.y) + 
+                        *get_vertex(mesh.vertices, stride_bytes, tri.z)) / 3.0f;
+      const float3 cell = (c - bbox_min) * scale;
+      codes[i] = std::make_pair(mortonCode(unsigned(optix::clamp(cell.x, 0.0f, 1023.0f)), unsigned(optix::clamp(cell.y, 0.0f, 1023.0f)),
+                                           unsigned(optix::clamp(cell.z, 0.0f, 1023.0f))), unsigned(i));
+    }
+  }
+  std::sort(codes.begin(), codes.end());
+
+  // Triangles around each vertex
+  std::vector<unsigned> vertex_tri_offsets(mesh.num_vertices + 1, 0);
+  for (size_t i = 0; i < mesh.num_triangles; ++i) {
+    const int3& tri = tri_vertex_indices[i];
+    vertex_tri_offsets[tri.x + 1]++;
+    vertex_tri_offsets[tri.y + 1]++;
+    vertex_tri_offsets[tri.z + 1]++;
+  }
+  for (size_t v = 0; v < mesh.num_vertices; ++v) vertex_tri_offsets[v + 1] += vertex_tri_offsets[v];
+  std::vector<unsigned> vertex_tris(vertex_tri_offsets[mesh.num_vertices]);
+  {
+    std::vector<unsigned> next(vertex_tri_offsets.begin(), vertex_tri_offsets.end() - 1);
+    for (size_t i = 0; i < mesh.num_triangles; ++i) {
+      const int3& tri = tri_vertex_indices[i];
+      vertex_tris[next[tri.x]++] = unsigned(i);
+      vertex_tris[next[tri.y]++] = unsigned(i);
+      vertex_tris[next[tri.z]++] = unsigned(i);
+    }
+  }
+
+  // A closed mesh has about twice as many triangles as vertices
+  const size_t patch_triangles = std::max(size_t(1), 2*patch_vertices);
+  const size_t num_patches = (mesh.num_triangles + patch_triangles - 1) / patch_triangles;
+  patches.assign(num_patches, MeshPatch());
+  const float max_weight = float(PATCH_OVERLAP_RINGS + 1);
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (ptrdiff_t p = 0; p < ptrdiff_t(num_patches); ++p) {
+    MeshPatch& patch = patches[p];
+    const size_t first = size_t(p) * patch_triangles;
+    const size_t last = std::min(first + patch_triangles, size_t(mesh.num_triangles));
+    for (size_t k = first; k < last; ++k) patch.triangles.push_back(codes[k].second);
+    std::sort(patch.triangles.begin(), patch.triangles.end());
+
+    // Grow by rings of triangles around the vertices so far
+    for (int ring = 0; ring <= PATCH_OVERLAP_RINGS; ++ring) {
+      patch.vertices.clear();
+      for (size_t k = 0; k < patch.triangles.size(); ++k) {
+        const int3& tri = tri_vertex_indices[patch.triangles[k]];
+        patch.vertices.push_back(tri.x);
+        patch.vertices.push_back(tri.y);
+        patch.vertices.push_back(tri.z);
+      }
+      std::sort(patch.vertices.begin(), patch.vertices.end());
+      patch.vertices.erase(std::unique(patch.vertices.begin(), patch.vertices.end()), patch.vertices.end());
+      if (ring == PATCH_OVERLAP_RINGS) break;
+      for (size_t k = 0; k < patch.vertices.size(); ++k) {
+        const unsigned v = patch.vertices[k];
+        patch.triangles.insert(patch.triangles.end(), vertex_tris.begin() + vertex_tri_offsets[v], vertex_tris.begin() + vertex_tri_offsets[v + 1]);
+      }
+      std::sort(patch.triangles.begin(), patch.triangles.end());
+      patch.triangles.erase(std::unique(patch.triangles.begin(), patch.triangles.end()), patch.triangles.end());
+    }
+
+    // Renumber, and count the patch triangles around each patch vertex
+    const size_t nv = patch.vertices.size();
+    std::vector<unsigned> local_valence(nv, 0);
+    patch.tri_vertex_indices.resize(patch.triangles.size());
+    for (size_t k = 0; k < patch.triangles.size(); ++k) {
+      const int3& tri = tri_vertex_indices[patch.triangles[k]];
+      const int local[] = { int(std::lower_bound(patch.vertices.begin(), patch.vertices.end(), unsigned(tri.x)) - patch.vertices.begin()),
+                            int(std::lower_bound(patch.vertices.begin(), patch.vertices.end(), unsigned(tri.y)) - patch.vertices.begin()),
+                            int(std::lower_bound(patch.vertices.begin(), patch.vertices.end(), unsigned(tri.z)) - patch.vertices.begin()) };
+      patch.tri_vertex_indices[k] = make_int3(local[0], local[1], local[2]);
+      for (int c = 0; c < 3; ++c) local_valence[local[c]]++;
+    }
+    patch.positions.resize(nv);
+    for (size_t v = 0; v < nv; ++v) patch.positions[v] = *get_vertex(mesh.vertices, stride_bytes, int(patch.vertices[v]));
+
+    // Distances from the cut by breadth first search over triangles, one level per ring
+    patch.weights.assign(nv, max_weight);
+    std::vector<size_t> frontier;
+    for (size_t v = 0; v < nv; ++v) {
+      const unsigned g = patch.vertices[v];
+      if (local_valence[v] < vertex_tri_offsets[g + 1] - vertex_tri_offsets[g]) {
+        patch.weights[v] = 0.0f;
+        frontier.push_back(v);
+      }
+    }
+    for (int level = 1; level <= PATCH_OVERLAP_RINGS && !frontier.empty(); ++level) {
+      std::vector<char> in_frontier(nv, 0);
+      for (size_t k = 0; k < frontier.size(); ++k) in_frontier[frontier[k]] = 1;
+      std::vector<size_t> next;
+      for (size_t k = 0; k < patch.tri_vertex_indices.size(); ++k) {
+        const int3& tri = patch.tri_vertex_indices[k];
+        const int verts[] = { tri.x, tri.y, tri.z };
+        if (!in_frontier[verts[0]] && !in_frontier[verts[1]] && !in_frontier[verts[2]]) continue;
+        for (int c = 0; c < 3; ++c) {
+          if (patch.weights[verts[c]] > float(level)) {
+            patch.weights[verts[c]] = float(level);
+            next.push_back(verts[c]);
+          }
+        }
+      }
+      frontier.swap(next);
+    }
+  }
+
+  // Normalize, so the weights of each vertex add up to one over the patches
+  std::vector<float> weight_sums(mesh.num_vertices, 0.0f);
+  for (size_t p = 0; p < num_patches; ++p) {
+    const MeshPatch& patch = patches[p];
+    for (size_t v = 0; v < patch.vertices.size(); ++v) weight_sums[patch.vertices[v]] += patch.weights[v];
+  }
+#pragma omp parallel for schedule(dynamic, 1)
+  for (ptrdiff_t p = 0; p < ptrdiff_t(num_patches); ++p) {
+    MeshPatch& patch = patches[p];
+    for (size_t v = 0; v < patch.vertices.size(); ++v) {
+      const float sum = weight_sums[patch.vertices[v]];
+      patch.weights[v] = sum > 0.0f ? patch.weights[v] / sum : 0.0f;
+    }
+  }
+  t.stop();
+  timer.add(t);
+}
+
+
+// Filters a group of instances of a mesh patch by patch, in parallel over patches, and blends the patch solutions.
+// Each patch is a least squares system of its own, so memory per solve is bounded by the patch size.
+void filter_mesh_patches(
+    const bake::Mesh&       mesh,
+    const std::vector<MeshPatch>& patches,
+    const bake::AOSamples&  ao_samples,
+    const float* const*     ao_values,   // per instance of the group
+    const size_t            num_rhs,
+    const float*            regularization_weights,
+    const size_t            num_weights,
+    const bool              use_float,
+    const float             analytic_mass_weight,
+    const bake::LeastSquaresOrdering ordering,
+    float* const*           vertex_ao,   // per weight, per instance of the group
+    ParallelTimer&          mass_matrix_timer,
+    ParallelTimer&          regularization_matrix_timer,
+    ParallelTimer&          analyze_timer,
+    ParallelTimer&          decompose_timer,
+    ParallelTimer&          solve_timer,
+    SystemNonZeros&         nonzeros
+    )
+{
+  const size_t num_outputs = num_weights*num_rhs;
+  for (size_t c = 0; c < num_outputs; ++c) {
+    std::fill(vertex_ao[c], vertex_ao[c] + mesh.num_vertices, 0.0f);
+  }
+  const float regularization_weight = max_weight(regularization_weights, num_weights);
+
+  // Samples by triangle
+  std::vector<size_t> tri_sample_offsets(mesh.num_triangles + 1, 0);
+  for (size_t i = 0; i < ao_samples.num_samples; ++i) tri_sample_offsets[bake::get_sample_info(ao_samples, i).tri_idx + 1]++;
+  for (size_t t = 0; t < mesh.num_triangles; ++t) tri_sample_offsets[t + 1] += tri_sample_offsets[t];
+  std::vector<size_t> tri_samples(ao_samples.num_samples);
+  {
+    std::vector<size_t> next(tri_sample_offsets.begin(), tri_sample_offsets.end() - 1);
+    for (size_t i = 0; i < ao_samples.num_samples; ++i) tri_samples[next[bake::get_sample_info(ao_samples, i).tri_idx]++] = i;
+  }
+
+  ThreadScratch<LeastSquaresScratch> scratch;
+#pragma omp parallel for schedule(dynamic, 1)
+  for (ptrdiff_t p = 0; p < ptrdiff_t(patches.size()); ++p) {
+    const MeshPatch& patch = patches[p];
+    const size_t nv = patch.vertices.size();
+
+    bake::Mesh patch_mesh;
+    std::memset(&patch_mesh, 0, sizeof(patch_mesh));
+    patch_mesh.num_vertices = nv;
+    patch_mesh.vertices = const_cast<float*>( &patch.positions[0].x );
+    patch_mesh.vertex_stride_bytes = sizeof(float3);
+    patch_mesh.num_triangles = patch.triangles.size();
+    patch_mesh.tri_vertex_indices = reinterpret_cast<unsigned*>( const_cast<int3*>( &patch.tri_vertex_indices[0] ) );
+
+    // Samples of the patch triangles, renumbered, and their AO per instance
+    size_t num_patch_samples = 0;
+    for (size_t k = 0; k < patch.triangles.size(); ++k) {
+      num_patch_samples += tri_sample_offsets[patch.triangles[k] + 1] - tri_sample_offsets[patch.triangles[k]];
+    }
+    std::vector<bake::SampleInfo> infos(num_patch_samples);
+    std::vector<float> patch_ao(num_rhs * num_patch_samples);
+    {
+      size_t n = 0;
+      for (size_t k = 0; k < patch.triangles.size(); ++k) {
+        const unsigned t = patch.triangles[k];
+        for (size_t j = tri_sample_offsets[t]; j < tri_sample_offsets[t + 1]; ++j, ++n) {
+          const size_t i = tri_samples[j];
+          infos[n] = bake::get_sample_info(ao_samples, i);
+          infos[n].tri_idx = unsigned(k);
+          for (size_t c = 0; c < num_rhs; ++c) patch_ao[c*num_patch_samples + n] = ao_values[c][i];
+        }
+      }
+    }
+    bake::AOSamples patch_samples;
+    std::memset(&patch_samples, 0, sizeof(patch_samples));
+    patch_samples.num_samples = num_patch_samples;
+    patch_samples.sample_infos = infos.empty() ? NULL : &infos[0];
+    patch_samples.sample_memory = bake::MEMORY_SPACE_HOST;
+    patch_samples.ao_memory = bake::MEMORY_SPACE_HOST;
+
+    SparseMatrix regularization_matrix;
+    SparseMatrix mass_pattern;
+    SharedPatternLDLT analyzed_solver;
+    if (regularization_weight > 0.0f) {
+      build_regularization_matrix(patch_mesh, regularization_matrix, regularization_matrix_timer);
+    }
+    build_mass_matrix_pattern(patch_mesh, mass_pattern);
+    analyze_system_pattern(patch_mesh, mass_pattern, regularization_weight, regularization_matrix, ordering, analyzed_solver, analyze_timer, 
+                           nonzeros);
+
+    std::vector<float> patch_vertex_ao(num_outputs * nv);
+    std::vector<const float*> patch_ao_ptrs(num_rhs);
+    std::vector<float*> patch_vertex_ao_ptrs(num_outputs);
+    for (size_t c = 0; c < num_rhs; ++c) {
+      patch_ao_ptrs[c] = patch_ao.empty() ? NULL : &patch_ao[c*num_patch_samples];
+    }
+    for (size_t c = 0; c < num_outputs; ++c) patch_vertex_ao_ptrs[c] = &patch_vertex_ao[c*nv];
+    const CGOptions no_cg = { CG_TOLERANCE, bake::CG_PRECONDITIONER_JACOBI };  // patches are factorized
+    filter_mesh_least_squares(patch_mesh, patch_samples, &patch_ao_ptrs[0], num_rhs, regularization_weights, num_weights, regularization_matrix, mass_pattern,
+      analyzed_solver, false, false, no_cg, use_float, bake::LEAST_SQUARES_SOLVER_SIMPLICIAL, analytic_mass_weight, scratch.local(), 
+      &patch_vertex_ao_ptrs[0], NULL, mass_matrix_timer, decompose_timer, solve_timer, nonzeros);
+
+    // Blend into the mesh; neighboring patches share the overlap
+    for (size_t v = 0; v < nv; ++v) {
+      const float w = patch.weights[v];
+      if (w <= 0.0f) continue;
+      const unsigned g = patch.vertices[v];
+      for (size_t c = 0; c < num_outputs; ++c) {
+        const float val = w * patch_vertex_ao[c*nv + v];
+#pragma omp atomic
+        vertex_ao[c][g] += val;
+      }
+    }
+  }
+}
+
+
+// Samples of instance i as a byte range: the sample infos, or the compact infos followed by the area per sample
+// of each triangle
+struct SamplePatternBytes
+{
+  const void* infos;
+  size_t      info_bytes;
+  const void* tri_dA;
+  size_t      tri_dA_bytes;
+};
+
+SamplePatternBytes sample_pattern_bytes(
+    const bake::Scene&              scene,
+    const bake::AOSamples&          ao_samples,
+    const size_t*                   num_samples_per_instance,
+    const std::vector<size_t>&      sample_offset_per_instance,
+    const std::vector<size_t>&      tri_offset_per_instance,
+    const size_t                    i
+    )
+{
+  SamplePatternBytes bytes;
+  if (ao_samples.sample_infos) {
+    bytes.infos = ao_samples.sample_infos + sample_offset_per_instance[i];
+    bytes.info_bytes = num_samples_per_instance[i] * sizeof(bake::SampleInfo);
+    bytes.tri_dA = NULL;
+    bytes.tri_dA_bytes = 0;
+  } else {
+    bytes.infos = ao_samples.compact_sample_infos + sample_offset_per_instance[i];
+    bytes.info_bytes = num_samples_per_instance[i] * sizeof(bake::CompactSampleInfo);
+    bytes.tri_dA = ao_samples.tri_sample_dA + tri_offset_per_instance[i];
+    bytes.tri_dA_bytes = scene.meshes[scene.instances[i].mesh_index].num_triangles * sizeof(float);
+  }
+  return bytes;
+}
+
+uint64_t sample_pattern_hash(
+    const bake::Scene&              scene,
+    const bake::AOSamples&          ao_samples,
+    const size_t*                   num_samples_per_instance,
+    const std::vector<size_t>&      sample_offset_per_instance,
+    const std::vector<size_t>&      tri_offset_per_instance,
+    const size_t                    i
+    )
+{
+  const SamplePatternBytes bytes = sample_pattern_bytes(scene, ao_samples, num_samples_per_instance, sample_offset_per_instance, 
+                                                        tri_offset_per_instance, i);
+  const uint64_t hash = hashBytes(bytes.infos, bytes.info_bytes);
+  return bytes.tri_dA ? hashBytes(bytes.tri_dA, bytes.tri_dA_bytes, hash) : hash;
+}
+
+bool same_sample_pattern(
+    const bake::Scene&              scene,
+    const bake::AOSamples&          ao_samples,
+    const size_t*                   num_samples_per_instance,
+    const std::vector<size_t>&      sample_offset_per_instance,
+    const std::vector<size_t>&      tri_offset_per_instance,
+    const size_t                    a,
+    const size_t                    b
+    )
+{
+  if (num_samples_per_instance[a] != num_samples_per_instance[b]) return false;
+  const SamplePatternBytes pa = sample_pattern_bytes(scene, ao_samples, num_samples_per_instance, sample_offset_per_instance, 
+                                                     tri_offset_per_instance, a);
+  const SamplePatternBytes pb = sample_pattern_bytes(scene, ao_samples, num_samples_per_instance, sample_offset_per_instance, 
+                                                     tri_offset_per_instance, b);
+  return std::memcmp(pa.infos, pb.infos, pa.info_bytes) == 0 && 
+         (!pa.tri_dA || std::memcmp(pa.tri_dA, pb.tri_dA, pa.tri_dA_bytes) == 0);
+}
+
+
+} //namespace
+
+
+void bake::filter_least_squares(
+    const Scene&        scene,
+    const size_t*       num_samples_per_instance,
+    const AOSamples&    ao_samples,
+    const float*        ao_values,
+    const float*        regularization_weights,
+    const size_t        num_weights,
+    const VertexFilterMode mode,
+    const char*         cache_dir,
+    const float         analytic_mass_weight,
+    const LeastSquaresSolver solver,
+    const LeastSquaresOrdering ordering,
+    const size_t        patch_vertices,
+    const size_t        num_channels,
+    float**             vertex_ao,
+    const float* const* initial_vertex_ao
+    )
+{
+  // The regularizer and the analyzed pattern are built for the largest weight, and serve all of them
+  const float regularization_weight = max_weight(regularization_weights, num_weights);
+  const bool host_cg = mode == VERTEX_FILTER_LEAST_SQUARES_HOST_CG;
+  const bool use_cg = mode == VERTEX_FILTER_LEAST_SQUARES_CG || host_cg;
+  const bool use_float = mode == VERTEX_FILTER_LEAST_SQUARES_FLOAT;
+  const bool matrix_free = mode == VERTEX_FILTER_LEAST_SQUARES_MATRIX_FREE;
+
+  ParallelTimer mass_matrix_timer;
+  ParallelTimer regularization_matrix_timer;
+  ParallelTimer analyze_timer;
+  ParallelTimer decompose_timer;
+  ParallelTimer solve_timer;
+  SystemNonZeros total_nonzeros;
+
+  CGOptions cg;
+  {
+    CGSettings& settings = cg_settings();
+    ScopedLock lock(settings.mutex);
+    cg = settings.options;
+  }
+
+  float rigid_tolerance = -1.0f;
+  {
+    KeptSystems& kept = kept_systems();
+    ScopedLock lock(kept.mutex);
+    rigid_tolerance = kept.rigid_tolerance;
+    if (rigid_tolerance >= 0.0f && kept.systems.size() < scene.num_meshes) {
+      kept.keys.resize(scene.num_meshes, 0);
+      kept.systems.resize(scene.num_meshes, NULL);
+    }
+  }
+  size_t num_kept_regularizers = 0;
+  size_t num_kept_patterns = 0;
+
+  std::vector<size_t> sample_offset_per_instance(scene.num_instances);
+  std::vector<size_t> tri_offset_per_instance(scene.num_instances);
+  {
+    size_t sample_offset = 0;
+    size_t tri_offset = 0;
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      sample_offset_per_instance[i] = sample_offset;
+      sample_offset += num_samples_per_instance[i];
+      tri_offset_per_instance[i] = tri_offset;
+      tri_offset += scene.meshes[scene.instances[i].mesh_index].num_triangles;
+    }
+  }
+
+  // Index instances by mesh once, instead of scanning all instances per mesh
+  std::vector< std::vector<size_t> > instances_per_mesh(scene.num_meshes);
+  uint64_t total_vertices = 0;
+  for (size_t i = 0; i < scene.num_instances; ++i) {
+    instances_per_mesh[scene.instances[i].mesh_index].push_back(i);
+    total_vertices += scene.meshes[scene.instances[i].mesh_index].num_vertices;
+  }
+  ProgressCounter progress("filter", total_vertices);
+
+  // Work is scheduled largest mesh first, since solve cost grows with vertex count
+  std::vector<size_t> mesh_order;
+  mesh_order.reserve(scene.num_meshes);
+  for (size_t meshIdx = 0; meshIdx < scene.num_meshes; ++meshIdx) {
+    if (!instances_per_mesh[meshIdx].empty()) mesh_order.push_back(meshIdx);
+  }
+  std::stable_sort(mesh_order.begin(), mesh_order.end(), LargerMesh(scene.meshes));
+
+  // Instances with identical samples, e.g. from shared sample templates, have the same mass matrix, so the
+  // factorized solves group them.  The matrix-free solve has nothing to share.
+  std::vector<uint64_t> pattern_hashes(scene.num_instances, 0);
+  if (!matrix_free) {
+#pragma omp parallel for schedule(dynamic, 16)
+    for (ptrdiff_t i = 0; i < ptrdiff_t(scene.num_instances); ++i) {
+      if (instances_per_mesh[scene.instances[i].mesh_index].size() > 1) {
+        pattern_hashes[i] = sample_pattern_hash(scene, ao_samples, num_samples_per_instance, sample_offset_per_instance, tri_offset_per_instance, i);
+      }
+    }
+  }
+
+  // Flat list of instance groups, grouped by mesh in the same order.  Per-mesh data is built by the first
+  // group that needs it and released by the last, so only a few meshes hold it at any time.
+  std::vector< std::vector<size_t> > groups;
+  groups.reserve(scene.num_instances);
+  std::vector<MeshSystem> mesh_systems(scene.num_meshes);
+  size_t shared_instances = 0;
+  for (size_t k = 0; k < mesh_order.size(); ++k) {
+    const std::vector<size_t>& mesh_instances = instances_per_mesh[mesh_order[k]];
+    const size_t first_group = groups.size();
+    std::multimap<uint64_t, size_t> groups_by_hash;
+    for (size_t j = 0; j < mesh_instances.size(); ++j) {
+      const size_t i = mesh_instances[j];
+      size_t g = groups.size();
+      if (!matrix_free) {
+        typedef std::multimap<uint64_t, size_t>::const_iterator GroupIter;
+        const std::pair<GroupIter, GroupIter> range = groups_by_hash.equal_range(pattern_hashes[i]);
+        for (GroupIter it = range.first; it != range.second; ++it) {
+          if (same_sample_pattern(scene, ao_samples, num_samples_per_instance, sample_offset_per_instance, tri_offset_per_instance, groups[it->second][0], i)) {
+            g = it->second;
+            break;
+          }
+        }
+      }
+      if (g == groups.size()) {
+        groups_by_hash.insert(std::make_pair(pattern_hashes[i], g));
+        groups.push_back(std::vector<size_t>());
+      } else {
+        ++shared_instances;
+      }
+      groups[g].push_back(i);
+    }
+    mesh_systems[mesh_order[k]].remaining_groups = groups.size() - first_group;
+  }
+  if (shared_instances > 0) {
+    recordCount( "filter.least_squares.shared_patterns", shared_instances );
+  }
+
+  // Groups of meshes large enough for the supernodal solver, to be split into patches, or for the parallel loops of
+  // the host CG solve come first, since meshes are sorted by size, and are filtered one at a time with all threads
+  // inside.  The rest run in parallel over groups.
+  const bool supernodal = mode == VERTEX_FILTER_LEAST_SQUARES && solver != LEAST_SQUARES_SOLVER_SIMPLICIAL;
+  const bool patched = (mode == VERTEX_FILTER_LEAST_SQUARES || use_float) && patch_vertices > 0;
+  const size_t min_patched_vertices = 2*patch_vertices + 1;
+  size_t min_large_vertices = supernodal ? SUPERNODAL_MIN_VERTICES : size_t(-1);
+  if (patched) min_large_vertices = std::min(min_large_vertices, min_patched_vertices);
+  if (host_cg) min_large_vertices = std::min(min_large_vertices, HOST_CG_MIN_PARALLEL_VERTICES);
+  size_t num_large_groups = 0;
+  while (num_large_groups < groups.size() && 
+         scene.meshes[scene.instances[groups[num_large_groups][0]].mesh_index].num_vertices >= min_large_vertices) {
+    ++num_large_groups;
+  }
+
+  ThreadScratch<LeastSquaresScratch> scratch;
+  for (int phase = 0; phase < 2; ++phase) {
+    const ptrdiff_t phase_begin = phase == 0 ? 0 : ptrdiff_t(num_large_groups);
+    const ptrdiff_t phase_end = phase == 0 ? ptrdiff_t(num_large_groups) : ptrdiff_t(groups.size());
+
+    // A single group leaves the threads to the per-mesh setup, e.g. the regularizer, and to its solve
+#pragma omp parallel for schedule(dynamic, 1) if(phase == 1 && phase_end - phase_begin > 1)
+    for (ptrdiff_t k = phase_begin; k < phase_end; ++k) {
+      const std::vector<size_t>& group = groups[k];
+      const size_t i = group[0];
+      const size_t meshIdx = scene.instances[i].mesh_index;
+      MeshSystem& system = mesh_systems[meshIdx];
+      ProfileRange range( "filter instance", PROFILE_COLOR_FILTER, uint64_t( i ) );
+      // The group times into timers of its own, added to the totals after, so that its mesh gets its share in the profile
+      ParallelTimer group_mass_matrix_timer;
+      ParallelTimer group_regularization_matrix_timer;
+      ParallelTimer group_analyze_timer;
+      ParallelTimer group_decompose_timer;
+      ParallelTimer group_solve_timer;
+      SystemNonZeros nonzeros;
+      const bool by_patches = patched && scene.meshes[meshIdx].num_vertices >= min_patched_vertices;
+      const LeastSquaresSolver backend = phase == 0 && !by_patches && scene.meshes[meshIdx].num_vertices >= SUPERNODAL_MIN_VERTICES ? 
+                                         solver : LEAST_SQUARES_SOLVER_SIMPLICIAL;
+
+      {
+        ScopedLock lock(system.mutex);
+        if (!system.data) {
+          // Per-mesh data does not depend on rigid xform per instance.  Frames of an animation take the data of the
+          // previous frame, and rebuild only what the new positions change.
+          const bake::Mesh& mesh = scene.meshes[meshIdx];
+          const bool analyzed = !matrix_free && !use_cg && backend == LEAST_SQUARES_SOLVER_SIMPLICIAL;
+          MeshSystemData* data = NULL;
+          if (rigid_tolerance >= 0.0f && !by_patches) {
+            system.kept_key = kept_system_key(mesh, regularization_weight, ordering, analyzed, matrix_free);
+            KeptSystems& kept = kept_systems();
+            ScopedLock kept_lock(kept.mutex);
+            if (meshIdx < kept.systems.size() && kept.systems[meshIdx] && kept.keys[meshIdx] == system.kept_key) {
+              std::swap(data, kept.systems[meshIdx]);
+            }
+          }
+          if (data) {
+            if (regularization_weight > 0.0f && rigid_edges(mesh, data->edge_lengths, rigid_tolerance)) {
+#pragma omp atomic
+              ++num_kept_regularizers;
+              if (analyzed) {
+#pragma omp atomic
+                ++num_kept_patterns;
+              }
+            } else if (matrix_free) {
+              if (regularization_weight > 0.0f) {
+                build_butterfly_blocks(mesh, data->butterfly_blocks, group_regularization_matrix_timer);
+              }
+              triangle_edge_lengths(mesh, data->edge_lengths);
+            } else {
+              // Butterflies that turn degenerate, or stop being so, change the pattern, and only then is it analyzed again
+              SparseMatrix previous;
+              previous.swap(data->regularization_matrix);
+              if (regularization_weight > 0.0f) {
+                build_regularization_matrix(mesh, data->regularization_matrix, group_regularization_matrix_timer);
+              }
+              if (analyzed && !same_pattern(previous, data->regularization_matrix)) {
+                analyze_system_pattern(mesh, data->mass_pattern, regularization_weight, data->regularization_matrix, ordering, 
+                                       data->analyzed_solver, group_analyze_timer, nonzeros);
+              } else if (analyzed) {
+#pragma omp atomic
+                ++num_kept_patterns;
+              }
+              triangle_edge_lengths(mesh, data->edge_lengths);
+            }
+          } else {
+            data = new MeshSystemData;
+            if (matrix_free) {
+              if (regularization_weight > 0.0f) {
+                build_butterfly_blocks(scene.meshes[meshIdx], data->butterfly_blocks, group_regularization_matrix_timer);
+              }
+            } else if (by_patches) {
+              // Each patch builds its own matrices when it is solved
+              build_mesh_patches(scene.meshes[meshIdx], patch_vertices, data->patches, group_analyze_timer);
+            } else {
+              // Both the regularizer and the analyzed pattern can come from the cache of an earlier bake.  Degenerate
+              // butterflies drop out of the regularizer, so the pattern is keyed on geometry too, not just topology.
+              const uint64_t geometry_key = cache_dir ? hashMeshGeometry(mesh) : 0;
+              // AMD patterns keep the keys they had before the ordering could be chosen
+              const unsigned char pattern_settings[2] = { (unsigned char)(regularization_weight > 0.0f ? 1 : 0), (unsigned char)ordering };
+              const uint64_t pattern_key = hashBytes(pattern_settings, ordering == LEAST_SQUARES_ORDERING_AMD ? 1 : 2, geometry_key);
+
+              if (regularization_weight > 0.0f) {
+                Timer t;
+                t.start();
+                if (cache_dir && load_regularization_matrix(cache_dir, geometry_key, mesh.num_vertices, data->regularization_matrix)) {
+                  t.stop();
+                  group_regularization_matrix_timer.add(t);
+                  recordCount( "filter.least_squares.cache_hits", 1 );
+                } else {
+                  build_regularization_matrix(mesh, data->regularization_matrix, group_regularization_matrix_timer);
+                  if (cache_dir && !save_regularization_matrix(cache_dir, geometry_key, data->regularization_matrix)) {
+                    std::cerr << "Failed to write filter cache in: " << cache_dir << std::endl;
+                  }
+                }
+              }
+
+              // Likewise the pattern of the system matrix only depends on topology, so analyze it once.  Supernodal
+              // solvers do their own analysis.
+              build_mass_matrix_pattern(mesh, data->mass_pattern);
+              if (!use_cg && backend == LEAST_SQUARES_SOLVER_SIMPLICIAL) {
+                Timer t;
+                t.start();
+                if (cache_dir && load_system_pattern(cache_dir, pattern_key, mesh.num_vertices, data->analyzed_solver)) {
+                  t.stop();
+                  group_analyze_timer.add(t);
+                  recordCount( "filter.least_squares.cache_hits", 1 );
+                } else {
+                  analyze_system_pattern(mesh, data->mass_pattern, regularization_weight, data->regularization_matrix, ordering, data->analyzed_solver, 
+                                         group_analyze_timer, nonzeros);
+                  if (cache_dir && !save_system_pattern(cache_dir, pattern_key, data->analyzed_solver)) {
+                    std::cerr << "Failed to write filter cache in: " << cache_dir << std::endl;
+                  }
+                }
+              }
+            }
+            if (system.kept_key) triangle_edge_lengths(mesh, data->edge_lengths);
+          }
+          system.data = data;
+        }
+      }
+
+      size_t sample_offset = sample_offset_per_instance[i];
+
+      // Point to samples for this instance
+      AOSamples instance_ao_samples;
+      instance_ao_samples.num_samples = num_samples_per_instance[i];
+      // Positions and normals stay NULL when samples were placed on the device; only infos are needed here
+      instance_ao_samples.sample_positions = ao_samples.sample_positions ? ao_samples.sample_positions + 3*sample_offset : NULL;
+      instance_ao_samples.sample_normals = ao_samples.sample_normals ? ao_samples.sample_normals + 3*sample_offset : NULL;
+      instance_ao_samples.sample_face_normals = ao_samples.sample_face_normals ? ao_samples.sample_face_normals + 3*sample_offset : NULL;
+      instance_ao_samples.sample_infos = ao_samples.sample_infos ? ao_samples.sample_infos + sample_offset : NULL;
+      instance_ao_samples.tri_sample_counts = NULL;
+      instance_ao_samples.compact_sample_infos = ao_samples.compact_sample_infos ? ao_samples.compact_sample_infos + sample_offset : NULL;
+      instance_ao_samples.tri_sample_dA = ao_samples.tri_sample_dA ? ao_samples.tri_sample_dA + tri_offset_per_instance[i] : NULL;
+      instance_ao_samples.sample_instances = NULL;
+      instance_ao_samples.sample_memory = ao_samples.sample_memory;
+      instance_ao_samples.ao_memory = ao_samples.ao_memory;
+      instance_ao_samples.first_sample_index = ao_samples.first_sample_index + sample_offset;
+
+      const size_t num_vertices = scene.meshes[meshIdx].num_vertices;
+      LeastSquaresScratch& thread_scratch = scratch.local();
+      if (matrix_free) {
+        for (size_t k = 0; k < num_weights; ++k) {
+          for (size_t c = 0; c < num_channels; ++c) {
+            filter_mesh_matrix_free(scene.meshes[meshIdx], instance_ao_samples, ao_values + c*ao_samples.num_samples + sample_offset, 
+              regularization_weights[k], system.data->butterfly_blocks, analytic_mass_weight, thread_scratch, 
+              vertex_ao[i] + (k*num_channels + c)*num_vertices, c == 0 && initial_vertex_ao ? initial_vertex_ao[i] : NULL,
+              cg.tolerance, group_mass_matrix_timer, group_solve_timer);
+          }
+        }
+      } else {
+        // The samples of the first instance stand for the group; each instance brings its AO, and every channel of it
+        // is one more right hand side of the same solve.  Each weight solves them into a block of channels of its own.
+        const size_t num_rhs = group.size()*num_channels;
+        std::vector<const float*>& group_ao_values = thread_scratch.group_ao_values;
+        std::vector<float*>& group_vertex_ao = thread_scratch.group_vertex_ao;
+        std::vector<const float*>& group_initial_ao = thread_scratch.group_initial_ao;
+        group_ao_values.resize(num_rhs);
+        group_vertex_ao.resize(num_weights*num_rhs);
+        group_initial_ao.assign(use_cg && initial_vertex_ao ? num_rhs : 0, NULL);
+        for (size_t j = 0; j < group.size(); ++j) {
+          if (!group_initial_ao.empty()) group_initial_ao[j*num_channels] = initial_vertex_ao[group[j]];
+          for (size_t c = 0; c < num_channels; ++c) {
+            group_ao_values[j*num_channels + c] = ao_values + c*ao_samples.num_samples + sample_offset_per_instance[group[j]];
+            for (size_t k = 0; k < num_weights; ++k) {
+              group_vertex_ao[k*num_rhs + j*num_channels + c] = vertex_ao[group[j]] + (k*num_channels + c)*num_vertices;
+            }
+          }
+        }
+        if (by_patches) {
+          filter_mesh_patches(scene.meshes[meshIdx], system.data->patches, instance_ao_samples, &group_ao_values[0], num_rhs, 
+            regularization_weights, num_weights, use_float, analytic_mass_weight, ordering, &group_vertex_ao[0], group_mass_matrix_timer, 
+            group_regularization_matrix_timer, group_analyze_timer, group_decompose_timer, group_solve_timer, nonzeros);
+        } else {
+            filter_mesh_least_squares(scene.meshes[meshIdx], instance_ao_samples, &group_ao_values[0], num_rhs, regularization_weights, num_weights,
+            system.data->regularization_matrix, system.data->mass_pattern, system.data->analyzed_solver, use_cg, host_cg, cg, use_float, 
+            backend, analytic_mass_weight, thread_scratch, &group_vertex_ao[0], group_initial_ao.empty() ? NULL : &group_initial_ao[0], 
+            group_mass_matrix_timer, group_decompose_timer, group_solve_timer, nonzeros);
+        }
+      }
+
+      mass_matrix_timer.add(group_mass_matrix_timer);
+      regularization_matrix_timer.add(group_regularization_matrix_timer);
+      analyze_timer.add(group_analyze_timer);
+      decompose_timer.add(group_decompose_timer);
+      solve_timer.add(group_solve_timer);
+      total_nonzeros.merge(nonzeros);
+      recordMeshProfile(meshIdx, MESH_PROFILE_FILTER_ASSEMBLY_SECONDS, group_mass_matrix_timer.total + group_regularization_matrix_timer.total);
+      recordMeshProfile(meshIdx, MESH_PROFILE_FILTER_FACTOR_SECONDS, group_analyze_timer.total + group_decompose_timer.total);
+      recordMeshProfile(meshIdx, MESH_PROFILE_FILTER_SOLVE_SECONDS, group_solve_timer.total);
+      recordMeshProfile(meshIdx, MESH_PROFILE_MATRIX_NONZEROS, double(nonzeros.matrix));
+      recordMeshProfile(meshIdx, MESH_PROFILE_FACTOR_NONZEROS, double(nonzeros.factor));
+      progress.add(group.size()*scene.meshes[meshIdx].num_vertices);
+
+      // Last group of the mesh releases the per-mesh data, or keeps it for the next frame
+      {
+        ScopedLock lock(system.mutex);
+        if (--system.remaining_groups == 0) {
+          if (system.kept_key) {
+            KeptSystems& kept = kept_systems();
+            ScopedLock kept_lock(kept.mutex);
+            std::swap(system.data, kept.systems[meshIdx]);
+            kept.keys[meshIdx] = system.kept_key;
+          }
+          delete system.data;
+          system.data = NULL;
+        }
+      }
+    }
+  }
+
+  if (matrix_free) {
+    std::cerr << "\n\tbuild right hand sides ...        ";  printTimeElapsed( mass_matrix_timer );
+    if (regularization_weight > 0.0f) {
+      std::cerr << "\tbuild butterfly blocks ...        ";  printTimeElapsed( regularization_matrix_timer );
+    }
+    std::cerr << "\tsolve linear systems (CG) ...     ";  printTimeElapsed( solve_timer );
+  } else {
+    std::cerr << "\n\tbuild mass matrices ...           ";  printTimeElapsed( mass_matrix_timer );
+    if (regularization_weight > 0.0f) {
+      std::cerr << "\tbuild regularization matrices ... ";  printTimeElapsed( regularization_matrix_timer );
+    }
+    if (use_cg) {
+      std::cerr << (host_cg ? "\tbuild systems, preconditioners ... " : "\tbuild system matrices ...         ");
+      printTimeElapsed( decompose_timer );
+      std::cerr << "\tsolve linear systems (CG) ...     ";  printTimeElapsed( solve_timer );
+    } else {
+      std::cerr << "\tanalyze matrix patterns ...       ";  printTimeElapsed( analyze_timer );
+      if (total_nonzeros.matrix > 0) {
+        std::cerr << "\tfill-in ...                       " << double(total_nonzeros.factor) / double(total_nonzeros.matrix) << "x, " 
+                  << total_nonzeros.factor << " factor nonzeros (" << ORDERING_NAMES[ordering] << " ordering)\n";
+      }
+      std::cerr << "\tdecompose matrices ...            ";  printTimeElapsed( decompose_timer );
+      std::cerr << "\tsolve linear systems ...         ";  printTimeElapsed( solve_timer );
+    }
+  }
+
+  recordTime( "filter.least_squares.mass_matrices", mass_matrix_timer );
+  if (regularization_weight > 0.0f) {
+    recordTime( "filter.least_squares.regularization_matrices", regularization_matrix_timer );
+  }
+  if (!use_cg && !matrix_free) {
+    recordTime( "filter.least_squares.analyze", analyze_timer );
+  }
+  if (!matrix_free) {
+    recordTime( "filter.least_squares.decompose", decompose_timer );
+  }
+  recordTime( "filter.least_squares.solve", solve_timer );
+  if (rigid_tolerance >= 0.0f) {
+    recordCount( "filter.least_squares.kept_regularizers", num_kept_regularizers );
+    recordCount( "filter.least_squares.kept_patterns", num_kept_patterns );
+  }
+}
+
+
+void bake::filter_least_squares_keep_systems( const float rigid_tolerance )
+{
+  KeptSystems& kept = kept_systems();
+  ScopedLock lock(kept.mutex);
+  kept.rigid_tolerance = rigid_tolerance;
+  if (rigid_tolerance < 0.0f) kept.clear();
+}
+
+void bake::filter_least_squares_set_cg( const float tolerance, const CGPreconditioner preconditioner )
+{
+  CGSettings& settings = cg_settings();
+  ScopedLock lock(settings.mutex);
+  settings.options.tolerance = tolerance;
+  settings.options.preconditioner = preconditioner;
+}
+
+#else
 
 #include <stdexcept>
 
@@ -455,13 +2594,30 @@ void bake::filter_least_squares(
   const size_t*,
   const AOSamples&,
   const float*,
+  const float*,
+  const size_t,
+  const VertexFilterMode,
+  const char*,
   const float,
-  float**
+  const LeastSquaresSolver,
+  const LeastSquaresOrdering,
+  const size_t,
+  const size_t,
+  float**,
+  const float* const*
   )
 {
   throw std::runtime_error( "filter_least_squares called without Eigen3 support");
 }
 
+void bake::filter_least_squares_keep_systems( const float )
+{
+}
+
+void bake::filter_least_squares_set_cg( const float, const CGPreconditioner )
+{
+}
+
 #endif
 
 
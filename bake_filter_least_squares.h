@@ -30,9 +30,24 @@ void filter_least_squares(
     const size_t*       num_samples_per_instance,
     const AOSamples&    ao_samples,
     const float*        ao_values,
-    const float         regularization_weight,
-    float**             vertex_ao
+    const float*        regularization_weights,  // one solve per weight of the same assembled system
+    const size_t        num_weights,
+    const VertexFilterMode mode,  // one of the least squares modes
+    const char*         cache_dir,  // optional directory for per-mesh data kept between runs
+    const float         analytic_mass_weight,  // 0 builds the mass matrix from samples, 1 analytically per triangle
+    const LeastSquaresSolver solver,  // factorization of large meshes in VERTEX_FILTER_LEAST_SQUARES mode
+    const LeastSquaresOrdering ordering,  // of the simplicial factorizations
+    const size_t        patch_vertices,  // if not 0, factorized modes filter meshes of more than twice this many vertices by patches
+    const size_t        num_channels,  // channels of num_samples values in ao_values, and of num_vertices in each vertex_ao per weight
+    float**             vertex_ao,
+    const float* const* initial_vertex_ao = NULL  // per instance, or NULL: first guess of channel 0 for the CG modes
     );
 
+// Process wide, as setFilterFrameReuse: keep the per-mesh data between calls, negative rigid_tolerance to drop it
+void filter_least_squares_keep_systems( const float rigid_tolerance );
+
+// Process wide, as setFilterConjugateGradient: stopping tolerance of every CG solve, and preconditioner of the host one
+void filter_least_squares_set_cg( const float tolerance, const CGPreconditioner preconditioner );
+
 }
 
@@ -25,103 +25,270 @@
 
 #include "bake_kernels.h"
 #include "bake_api.h"
+#include "bake_ray_sampling.h"
+#include "Preprocessor.h"
 #include "random.h"
 
 #include <optixu/optixu_math_namespace.h>
+#include <thrust/copy.h>
+#include <thrust/execution_policy.h>
+#include <thrust/inner_product.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/sort.h>
+#include <algorithm>
+#include <vector>
 using optix::float3;
 
 
 
-inline int idivCeil( int x, int y )                                              
+inline size_t idivCeil( size_t x, size_t y )                                              
 {                                                                                
     return (x + y-1)/y;                                                            
 }
 
+// Blocks of a 1D launch over n items.  Kernels loop over the items with a grid stride, so the grid is capped and 
+// counts beyond 2^31 need neither larger grids nor 32 bit indices.
+const size_t MAX_GRID_BLOCKS = 1 << 16;
+inline unsigned gridBlocks( size_t n, int block_size )
+{
+    return static_cast<unsigned>( std::max( std::min( idivCeil( n, size_t( block_size ) ), MAX_GRID_BLOCKS ), size_t(1) ) );
+}
+
+#define GRID_STRIDE_LOOP( idx, n ) \
+  for ( size_t idx = threadIdx.x + size_t( blockIdx.x )*blockDim.x; idx < (n); idx += size_t( blockDim.x )*gridDim.x )
+
+//------------------------------------------------------------------------------
+//
+// Launch configuration of the trace kernels
+//
+// Each kernel gets the block size cudaOccupancyMaxPotentialBlockSize suggests for it on a device, found at its
+// first launch there, or with tuning on, the fastest of a few candidates at its first launch, for kernels that
+// can be launched again with the same result.  A device launches from its worker's thread, so entries are 
+// written by one thread each, and a race of two threads on a first launch would write the same values.
+//
+//------------------------------------------------------------------------------
+
+const int DEFAULT_BLOCK_SIZE = 512;
+const int MAX_LAUNCH_DEVICES = 16;
+const int TUNING_BLOCK_SIZES[] = { 128, 256, 512, 1024 };
+
+enum LaunchKernel
+{
+  LAUNCH_RAYGEN = 0,         // four variants: reversed, reversed flat, forward, forward flat
+  LAUNCH_UPDATE_AO = 4,
+  LAUNCH_NORMALIZE_AO,
+  NUM_LAUNCH_KERNELS
+};
+
+const char* const LAUNCH_KERNEL_NAMES[NUM_LAUNCH_KERNELS] = {
+  "raygen", "raygen_flat", "raygen_forward", "raygen_forward_flat", "update_ao", "normalize_ao"
+};
+
+struct LaunchConfig
+{
+  int  block_size[MAX_LAUNCH_DEVICES];   // 0 until the first launch on the device
+  bool tuned[MAX_LAUNCH_DEVICES];
+};
+
+LaunchConfig g_launch_configs[NUM_LAUNCH_KERNELS];
+bool g_tune_kernels = false;
+
+inline int currentDevice()
+{
+  int device = 0;
+  cudaGetDevice( &device );
+  return device;
+}
+
+// Block size of a kernel on the current device
+template <typename Kernel>
+int launchBlockSize( const int kind, Kernel kernel )
+{
+  const int device = currentDevice();
+  if ( device < 0 || device >= MAX_LAUNCH_DEVICES ) return DEFAULT_BLOCK_SIZE;
+  int& block_size = g_launch_configs[kind].block_size[device];
+  if ( block_size == 0 ) {
+    int min_grid_size = 0, suggested = 0;
+    const bool ok = cudaOccupancyMaxPotentialBlockSize( &min_grid_size, &suggested, kernel, 0, 0 ) == cudaSuccess && suggested > 0;
+    block_size = ok ? suggested : DEFAULT_BLOCK_SIZE;
+  }
+  return block_size;
+}
+
+// Whether the next launch of a kernel on the current device is the one to tune it
+inline bool tuneLaunch( const int kind )
+{
+  const int device = currentDevice();
+  return g_tune_kernels && device >= 0 && device < MAX_LAUNCH_DEVICES && !g_launch_configs[kind].tuned[device];
+}
+
+// Keeps the fastest of the block sizes timed for a kernel on the current device
+inline void finishTuning( const int kind, const int block_size )
+{
+  const int device = currentDevice();
+  g_launch_configs[kind].block_size[device] = block_size;
+  g_launch_configs[kind].tuned[device] = true;
+}
 
 //------------------------------------------------------------------------------
 //
 // Ray generation kernel
+//
+// Generates rays for num_passes consecutive passes, starting at first_pass.  Rays are
+// laid out pass-major: rays[k*num_active + j] belongs to active sample j in pass first_pass+k.
+// Active sample j is sample active_samples[j], or sample j if there is no active list.
+// Pass k of a sample uses point k of a 2D Sobol sequence, Owen scrambled per sample.  Any number of 
+// passes is well stratified, and so is every power of two prefix, which adaptive sampling relies on.
+// Specialized on the ray direction, and on flat samples, which read and decode only the first normal of
+// each pair and need no mirroring of directions below the surface.
 // 
 //------------------------------------------------------------------------------
+template <bool FORWARD_RAYS, bool FLAT_NORMALS>
 __global__
 void generateRaysKernel( 
-    const unsigned int base_seed,
-    const int px,
-    const int py,
-    const int sqrt_passes,
+    const unsigned long long first_sample_index,
+    const int first_pass,
+    const int num_passes,
     const float scene_offset,
     const float scene_maxdistance,
-    const int num_samples,
-    const float3* sample_normals,
-    const float3* sample_face_normals,
-    const float3* sample_positions,
+    const size_t num_active,
+    const int* active_samples,
+    const float4* sample_positions,
+    const uint2* sample_normals,
+    const bake::DeviceGroundPlane ground_plane,
+    unsigned* plane_hits,
+    const bool flip_normals,
     Ray* rays
     )
 {
-  int idx = threadIdx.x + blockIdx.x*blockDim.x;                                 
-  if( idx >= num_samples )                                                             
-    return;
+  GRID_STRIDE_LOOP( idx, num_active*num_passes ) {
+    const size_t active_idx = idx % num_active;
+    const size_t sample_idx = active_samples ? size_t( active_samples[active_idx] ) : active_idx;
+    const int pass = first_pass + int( idx / num_active );
+
+    const unsigned int scramble_seed = bake::aoScrambleSeed( first_sample_index + sample_idx );
 
-  const unsigned int tea_seed = (base_seed << 16) | (px*sqrt_passes+py);
-  unsigned seed = tea<2>( tea_seed, idx );
-
-  const float3 sample_norm      = sample_normals[idx]; 
-  const float3 sample_face_norm = sample_face_normals[idx];
-  const float3 sample_pos       = sample_positions[idx];
-  const float3 ray_origin       = sample_pos;
-  optix::Onb onb( sample_norm );
-
-  float3 ray_dir;
-  float u0 = ( static_cast<float>( px ) + rnd( seed ) ) / static_cast<float>( sqrt_passes );
-  float u1 = ( static_cast<float>( py ) + rnd( seed ) ) / static_cast<float>( sqrt_passes );
-  int j = 0;
-  do
-  {
-    optix::cosine_sample_hemisphere( u0, u1, ray_dir );
-
-    onb.inverse_transform( ray_dir );
-    ++j;
-    u0 = rnd( seed );
-    u1 = rnd( seed );
-  }
-  while( j < 5 && optix::dot( ray_dir, sample_face_norm ) <= 0.0f );
+    const float  side             = flip_normals ? -1.0f : 1.0f;
+    const float4 sample_pos       = sample_positions[sample_idx];
+    const float3 ray_origin       = optix::make_float3( sample_pos.x, sample_pos.y, sample_pos.z );
+    float3 ray_dir;
+    if ( FLAT_NORMALS ) {
+      const unsigned packed_normal = reinterpret_cast<const unsigned*>( sample_normals )[2*sample_idx];
+      ray_dir = bake::sampleAODirection( pass, scramble_seed, side * bake::decodeOctahedral( packed_normal ) );
+    } else {
+      const uint2  packed_normals   = sample_normals[sample_idx];
+      const float3 sample_norm      = side * bake::decodeOctahedral( packed_normals.x ); 
+      const float3 sample_face_norm = side * bake::decodeOctahedral( packed_normals.y );
+      ray_dir = bake::sampleAODirection( pass, scramble_seed, sample_norm, sample_face_norm );
+    }
     
-#if 1
-  // Reverse shadow rays for better performance
-  rays[idx].origin    = ray_origin + scene_maxdistance * ray_dir;
-  rays[idx].tmin      = 0.0f;
-  rays[idx].direction = -ray_dir;
-  rays[idx].tmax      = scene_maxdistance - scene_offset;  // possible loss of precision here (bignum - smallnum)
+    // The ground plane is tested here rather than traced.  A blocked ray keeps its slot in the query, with 
+    // nothing to hit.
+    bool blocked = false;
+    if ( plane_hits ) {
+      blocked = bake::groundPlaneDistance( ground_plane, ray_origin, ray_dir, scene_offset, scene_maxdistance ) >= 0.0f;
+      if ( blocked ) atomicOr( &plane_hits[idx >> 5], 1u << ( idx & 31 ) );
+    }
 
-#else
-  // Forward shadow rays for better precision
-  rays[idx].origin    = ray_origin;
-  rays[idx].tmin      = scene_offset;
-  rays[idx].direction = ray_dir;
-  rays[idx].tmax      = scene_maxdistance;
-#endif
+    // Rays are written as two float4 stores
+    float4* ray = reinterpret_cast<float4*>( rays + idx );
+    if ( !FORWARD_RAYS ) {
+      // Reverse shadow rays for better performance
+      const float3 origin = ray_origin + scene_maxdistance * ray_dir;
+      ray[0] = make_float4( origin.x, origin.y, origin.z, 0.0f );
+      ray[1] = make_float4( -ray_dir.x, -ray_dir.y, -ray_dir.z, blocked ? -1.0f : scene_maxdistance - scene_offset );  // possible loss of precision here (bignum - smallnum)
+    } else {
+      // Forward rays for better precision, and for hit distances from the sample
+      ray[0] = make_float4( ray_origin.x, ray_origin.y, ray_origin.z, scene_offset );
+      ray[1] = make_float4( ray_dir.x, ray_dir.y, ray_dir.z, blocked ? -1.0f : scene_maxdistance );
+    }
+  }
+}
 
+// Rays only depend on the arguments, so a tuning launch times each candidate block size on the same rays, with the
+// stream synchronized, and the last one leaves them written
+template <bool FORWARD_RAYS, bool FLAT_NORMALS>
+void launchGenerateRays(unsigned long long first_sample_index, int first_pass, int num_passes, float scene_offset, float scene_maxdistance, 
+                        const bake::DeviceSamples& samples, size_t num_active, const int* active_samples, const bake::DeviceGroundPlane& ground_plane, 
+                        unsigned* plane_hits, bool flip_normals, Ray* rays, cudaStream_t stream )
+{
+  const int kind = LAUNCH_RAYGEN + ( FORWARD_RAYS ? 2 : 0 ) + ( FLAT_NORMALS ? 1 : 0 );
+  const size_t n = num_active*num_passes;
+  const int block_size = launchBlockSize( kind, generateRaysKernel<FORWARD_RAYS, FLAT_NORMALS> );
+  if ( !tuneLaunch( kind ) ) {
+    generateRaysKernel<FORWARD_RAYS, FLAT_NORMALS><<<gridBlocks( n, block_size ),block_size,0,stream>>>( first_sample_index, first_pass, 
+      num_passes, scene_offset, scene_maxdistance, num_active, active_samples, samples.positions, samples.normals, ground_plane, 
+      plane_hits, flip_normals, rays );
+    return;
+  }
+
+  cudaFuncAttributes attributes;
+  const int max_block_size = cudaFuncGetAttributes( &attributes, generateRaysKernel<FORWARD_RAYS, FLAT_NORMALS> ) == cudaSuccess ? 
+                             attributes.maxThreadsPerBlock : DEFAULT_BLOCK_SIZE;
+  std::vector<int> candidates( 1, block_size );
+  for (size_t k = 0; k < sizeof( TUNING_BLOCK_SIZES )/sizeof( TUNING_BLOCK_SIZES[0] ); ++k) {
+    if ( TUNING_BLOCK_SIZES[k] != block_size && TUNING_BLOCK_SIZES[k] <= max_block_size ) candidates.push_back( TUNING_BLOCK_SIZES[k] );
+  }
+  cudaEvent_t start, stop;
+  cudaEventCreate( &start );
+  cudaEventCreate( &stop );
+  int best_block_size = block_size;
+  float best_ms = -1.0f;
+  for (size_t k = 0; k < candidates.size(); ++k) {
+    const int candidate = candidates[k];
+    cudaEventRecord( start, stream );
+    generateRaysKernel<FORWARD_RAYS, FLAT_NORMALS><<<gridBlocks( n, candidate ),candidate,0,stream>>>( first_sample_index, first_pass, 
+      num_passes, scene_offset, scene_maxdistance, num_active, active_samples, samples.positions, samples.normals, ground_plane, 
+      plane_hits, flip_normals, rays );
+    cudaEventRecord( stop, stream );
+    float ms = 0.0f;
+    if ( cudaEventSynchronize( stop ) != cudaSuccess || cudaEventElapsedTime( &ms, start, stop ) != cudaSuccess ) continue;
+    if ( best_ms < 0.0f || ms < best_ms ) {
+      best_ms = ms;
+      best_block_size = candidate;
+    }
+  }
+  cudaEventDestroy( start );
+  cudaEventDestroy( stop );
+  finishTuning( kind, best_block_size );
 }
 
 __host__
-void bake::generateRaysDevice(unsigned int seed, int px, int py, int sqrt_passes, float scene_offset, float scene_maxdistance, const bake::AOSamples& ao_samples, Ray* rays )
+void bake::generateRaysDevice(unsigned long long first_sample_index, int first_pass, int num_passes, float scene_offset, float scene_maxdistance, const bake::DeviceSamples& samples, 
+                              size_t num_active, const int* active_samples, const bake::DeviceGroundPlane& ground_plane, unsigned* plane_hits, 
+                              bool forward_rays, bool flip_normals, Ray* rays, cudaStream_t stream )
 {
-  const int block_size  = 512;                                                           
-  const int block_count = idivCeil( (int)ao_samples.num_samples, block_size );                              
+#define GENERATE_RAYS( FORWARD_RAYS, FLAT_NORMALS ) \
+  launchGenerateRays<FORWARD_RAYS, FLAT_NORMALS>( first_sample_index, first_pass, num_passes, scene_offset, scene_maxdistance, samples, \
+      num_active, active_samples, ground_plane, ground_plane.axis >= 0 ? plane_hits : NULL, flip_normals, rays, stream )
 
-  generateRaysKernel<<<block_count,block_size>>>( 
-      seed,
-      px,
-      py,
-      sqrt_passes,
-      scene_offset,
-      scene_maxdistance,
-      (int)ao_samples.num_samples,
-      (float3*)ao_samples.sample_normals,
-      (float3*)ao_samples.sample_face_normals,
-      (float3*)ao_samples.sample_positions,
-      rays
-      );
+  if ( forward_rays ) {
+    if ( samples.flat_normals ) GENERATE_RAYS( true, true );
+    else                        GENERATE_RAYS( true, false );
+  } else {
+    if ( samples.flat_normals ) GENERATE_RAYS( false, true );
+    else                        GENERATE_RAYS( false, false );
+  }
+#undef GENERATE_RAYS
+}
+
+__host__
+void bake::tuneKernelLaunches( bool tune )
+{
+  g_tune_kernels = tune;
+}
+
+__host__
+void bake::kernelLaunchConfigs( int device, std::vector<std::string>& names, std::vector<int>& block_sizes )
+{
+  names.clear();
+  block_sizes.clear();
+  if ( device < 0 || device >= MAX_LAUNCH_DEVICES ) return;
+  for (int k = 0; k < NUM_LAUNCH_KERNELS; ++k) {
+    if ( g_launch_configs[k].block_size[device] == 0 ) continue;
+    names.push_back( LAUNCH_KERNEL_NAMES[k] );
+    block_sizes.push_back( g_launch_configs[k].block_size[device] );
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -130,25 +297,123 @@ void bake::generateRaysDevice(unsigned int seed, int px, int py, int sqrt_passes
 // 
 //------------------------------------------------------------------------------
 
+// Reduces the hits of all passes in one query.  Hits are one bit per ray, in the same order as the rays;
+// neighbouring threads read the same words, so the loads are shared within a warp.  With bent normals, the 
+// directions of the rays that got through are summed too, read back from the rays of the query.
 __global__
-void updateAOKernel(int num_samples, const float* hit_data, float* ao_data)
+void updateAOKernel(size_t num_active, const int* active_samples, int num_passes, const unsigned* hit_bits, const unsigned* plane_hit_bits, float* ao_data,
+                    const Ray* rays, float ray_sign, float* bent_data)
 {
-  int idx = threadIdx.x + blockIdx.x*blockDim.x;                                 
-  if( idx >= num_samples )                                                             
-    return;
-
-  float distance = hit_data[idx];
-  ao_data[idx] += distance > 0.0 ? 1.0f : 0.0f;
+  GRID_STRIDE_LOOP( idx, num_active ) {
+    int occluded = 0;
+    float3 open = optix::make_float3( 0.0f );
+    for ( int k = 0; k < num_passes; ++k ) {
+      const size_t r = k*num_active + idx;
+      const unsigned bits = hit_bits[r >> 5] | ( plane_hit_bits ? plane_hit_bits[r >> 5] : 0u );
+      const int hit = ( bits >> ( r & 31 ) ) & 1;
+      occluded += hit;
+      if ( bent_data && !hit ) {
+        const float4 dir = reinterpret_cast<const float4*>( rays + r )[1];
+        open += optix::make_float3( dir.x, dir.y, dir.z );
+      }
+    }
+    ao_data[active_samples ? size_t( active_samples[idx] ) : idx] += static_cast<float>( occluded );
+    if ( bent_data ) {
+      bent_data[idx]                += ray_sign * open.x;
+      bent_data[num_active + idx]   += ray_sign * open.y;
+      bent_data[2*num_active + idx] += ray_sign * open.z;
+    }
+  }
 }
 
 // Precondition: ao output initialized to 0 before first pass
 __host__
-void bake::updateAODevice( int num_samples, const float* hits, float* ao )
+void bake::updateAODevice( size_t num_active, const int* active_samples, int num_passes, const unsigned* hits, const unsigned* plane_hits, float* ao, 
+                           cudaStream_t stream, const Ray* rays, bool forward_rays, float* bent_normals )
+{
+  int block_size  = launchBlockSize( LAUNCH_UPDATE_AO, updateAOKernel );
+  unsigned block_count = gridBlocks( num_active, block_size );                              
+
+  updateAOKernel <<<block_count, block_size, 0, stream >>>(num_active, active_samples, num_passes, hits, plane_hits, ao, 
+                                                           rays, forward_rays ? 1.0f : -1.0f, bent_normals);
+}
+
+// One sample per thread, like updateAOKernel.  Radii are ascending, so a hit counts for a suffix of them.
+__global__
+void updateAOMultiRadiusKernel(size_t num_samples, int num_passes, const float* hit_t, const bake::DeviceAORadii radii, float* ao_data)
+{
+  GRID_STRIDE_LOOP( idx, num_samples ) {
+    int occluded[bake::MAX_DEVICE_AO_RADII] = {};
+    for ( int k = 0; k < num_passes; ++k ) {
+      const float t = hit_t[k*num_samples + idx];
+      if ( t < 0.0f ) continue;
+      for ( int r = 0; r < radii.count; ++r ) {
+        occluded[r] += t <= radii.radii[r] ? 1 : 0;
+      }
+    }
+    for ( int r = 0; r < radii.count; ++r ) {
+      ao_data[r*num_samples + idx] += static_cast<float>( occluded[r] );
+    }
+  }
+}
+
+__host__
+void bake::updateAOMultiRadiusDevice( size_t num_samples, int num_passes, const float* hit_t, const bake::DeviceAORadii& radii, float* ao, 
+                                      cudaStream_t stream )
+{
+  int block_size  = 512;                                                           
+  unsigned block_count = gridBlocks( num_samples, block_size );                              
+
+  updateAOMultiRadiusKernel <<<block_count, block_size, 0, stream >>>(num_samples, num_passes, hit_t, radii, ao);
+}
+
+//------------------------------------------------------------------------------
+//
+// Adaptive sampling: retire converged samples
+// 
+//------------------------------------------------------------------------------
+
+// Every active sample has traced num_rays rays so far.  A sample whose occlusion estimate has a standard
+// error within tolerance gets its final AO value; the others are flagged to stay active.
+__global__
+void retireConvergedKernel(size_t num_active, const int* active_samples, int num_rays, float tolerance, float* ao_data,
+                           unsigned char* keep)
+{
+  GRID_STRIDE_LOOP( idx, num_active ) {
+    const size_t sample_idx = active_samples ? size_t( active_samples[idx] ) : idx;
+    const float p = ao_data[sample_idx] / num_rays;
+    const float std_error = sqrtf( p*(1.0f - p) / num_rays );
+    const bool converged = std_error <= tolerance;
+    if ( converged ) {
+      ao_data[sample_idx] = 1.0f - p;
+    }
+    keep[idx] = converged ? 0 : 1;
+  }
+}
+
+struct IsKept
+{
+  __host__ __device__ bool operator()( const unsigned char k ) const { return k != 0; }
+};
+
+__host__
+size_t bake::retireConvergedDevice( size_t num_active, const int* active_samples, int num_rays, float tolerance, float* ao,
+                                    unsigned char* keep, int* next_active_samples, cudaStream_t stream )
 {
   int block_size  = 512;                                                           
-  int block_count = idivCeil( num_samples, block_size );                              
+  unsigned block_count = gridBlocks( num_active, block_size );                              
+
+  retireConvergedKernel <<<block_count, block_size, 0, stream >>>(num_active, active_samples, num_rays, tolerance, ao, keep);
 
-  updateAOKernel <<<block_count, block_size >>>(num_samples, hits, ao);
+  // Stable stream compaction keeps the active list in sample order, so rays of neighbouring samples stay together
+  int* next_end;
+  if ( active_samples ) {
+    next_end = thrust::copy_if( thrust::cuda::par.on( stream ), active_samples, active_samples + num_active, keep, next_active_samples, IsKept() );
+  } else {
+    next_end = thrust::copy_if( thrust::cuda::par.on( stream ), thrust::counting_iterator<int>( 0 ), thrust::counting_iterator<int>( int( num_active ) ), 
+                                keep, next_active_samples, IsKept() );
+  }
+  return static_cast<size_t>( next_end - next_active_samples );
 }
 
 //------------------------------------------------------------------------------
@@ -158,21 +423,897 @@ void bake::updateAODevice( int num_samples, const float* hits, float* ao )
 //------------------------------------------------------------------------------
 
 __global__
-void normalizeAOKernel(int num_samples, float* ao_data, int rays_per_sample)
+void normalizeAOKernel(size_t num_active, const int* active_samples, float* ao_data, int rays_per_sample)
+{
+  GRID_STRIDE_LOOP( idx, num_active ) {
+    const size_t sample_idx = active_samples ? size_t( active_samples[idx] ) : idx;
+    ao_data[sample_idx] = 1.0f - ao_data[sample_idx] / rays_per_sample;
+  }
+}
+
+// A sample that no ray got out of keeps its normal
+__global__
+void normalizeBentNormalsKernel(size_t num_samples, const uint2* sample_normals, float* bent_data)
 {
-  int idx = threadIdx.x + blockIdx.x*blockDim.x;                                 
-  if( idx >= num_samples )                                                             
+  GRID_STRIDE_LOOP( idx, num_samples ) {
+    float3 bent = optix::make_float3( bent_data[idx], bent_data[num_samples + idx], bent_data[2*num_samples + idx] );
+    const float len = optix::length( bent );
+    bent = len > 0.0f ? bent / len : bake::decodeOctahedral( sample_normals[idx].x );
+    bent_data[idx]                 = bent.x;
+    bent_data[num_samples + idx]   = bent.y;
+    bent_data[2*num_samples + idx] = bent.z;
+  }
+}
+
+// Band 1 real SH basis functions are this times y, z and x
+const float SH_Y1 = 0.488602512f;
+
+// Averages Y_lm over the rays, with a miss counting as 1: ao is the open fraction already, and the sums of 
+// open directions go to the coefficients of y, z and x, in the usual order of band 1
+__global__
+void normalizeSHKernel(size_t num_samples, int rays_per_sample, float* ao_data, float* sum_data)
+{
+  GRID_STRIDE_LOOP( idx, num_samples ) {
+    const float scale = SH_Y1 / rays_per_sample;
+    const float x = sum_data[idx], y = sum_data[num_samples + idx], z = sum_data[2*num_samples + idx];
+    ao_data[idx] *= bake::SH_Y00;
+    sum_data[idx]                 = scale * y;
+    sum_data[num_samples + idx]   = scale * z;
+    sum_data[2*num_samples + idx] = scale * x;
+  }
+}
+
+__host__
+void bake::normalizeAODevice( size_t num_active, const int* active_samples, float* ao, int rays_per_sample, cudaStream_t stream,
+                              float* bent_normals, const uint2* sample_normals, bool sh_l1 )
+{
+  int block_size  = launchBlockSize( LAUNCH_NORMALIZE_AO, normalizeAOKernel );
+  unsigned block_count = gridBlocks( num_active, block_size );                              
+
+  normalizeAOKernel <<<block_count, block_size, 0, stream >>>(num_active, active_samples, ao, rays_per_sample);
+  if ( bent_normals && sh_l1 ) {
+    normalizeSHKernel <<<block_count, block_size, 0, stream >>>(num_active, rays_per_sample, ao, bent_normals);
+  } else if ( bent_normals ) {
+    normalizeBentNormalsKernel <<<block_count, block_size, 0, stream >>>(num_active, sample_normals, bent_normals);
+  }
+}
+
+
+//------------------------------------------------------------------------------
+//
+// Sample placement kernel, mirrors sample_triangle in bake_sample.cpp
+// 
+//------------------------------------------------------------------------------
+
+template <unsigned int BASE>
+__device__ __inline__ float halton(const unsigned int index)
+{
+  float result = 0.0f;
+  const float invBase = 1.0f / BASE;
+  float f = invBase;
+  unsigned int i = index;
+  while( i > 0 ) {
+    result += f*( i % BASE );
+    i = i / BASE;
+    f *= invBase;
+  }
+  return result;
+}
+
+__device__ __inline__ float3 xformPoint( const float* m, const float3& v )
+{
+  return optix::make_float3( m[0]*v.x + m[1]*v.y + m[2]*v.z  + m[3],
+                             m[4]*v.x + m[5]*v.y + m[6]*v.z  + m[7],
+                             m[8]*v.x + m[9]*v.y + m[10]*v.z + m[11] );
+}
+
+__device__ __inline__ const float3& getVertex( const float* v, unsigned stride_bytes, int index )
+{
+  return *reinterpret_cast<const float3*>( reinterpret_cast<const unsigned char*>( v ) + index*stride_bytes );
+}
+
+__device__ __inline__ float3 faceforwardDevice( const float3& normal, const float3& geom_normal )
+{
+  if ( optix::dot( normal, geom_normal ) > 0.0f ) return normal;
+  return -normal;
+}
+
+// Last range starting at or before a sample
+__device__ __inline__ size_t findSampleRange( const size_t num_ranges, const bake::TriangleSampleRange* ranges, const size_t idx )
+{
+  size_t lo = 0, hi = num_ranges - 1;
+  while ( lo < hi ) {
+    const size_t mid = (lo + hi + 1) / 2;
+    if ( ranges[mid].first_sample <= idx ) lo = mid;
+    else hi = mid - 1;
+  }
+  return lo;
+}
+
+// Barycentrics of sample 'index' on the triangle of a range
+__device__ __inline__ void sampleBarycentrics( const bake::TriangleSampleRange& range, const unsigned index, float& bx, float& by, float& bz )
+{
+  // Random offset per triangle, to shift Halton points
+  unsigned seed = tea<4>( range.instance_index, range.tri_idx );
+  const float offset_x = rnd( seed );
+  const float offset_y = rnd( seed );
+
+  float r1 = offset_x + halton<2>( index+1 );
+  r1 = r1 - (int)r1;
+  float r2 = offset_y + halton<3>( index+1 );
+  r2 = r2 - (int)r2;
+
+  const float sqrt_r1 = sqrtf( r1 );
+  bx = 1.0f - sqrt_r1;
+  by = r2*sqrt_r1;
+  bz = 1.0f - bx - by;
+}
+
+// Position and normals of the point with the given barycentrics on a triangle of an instance, in the DeviceSamples layout
+__device__ __inline__ void placeSample( const bake::DeviceInstance& instance, const bake::DeviceMesh& mesh, const unsigned tri_idx,
+                                        const float bx, const float by, const float bz, float4& sample_position, uint2& sample_normal )
+{
+  const unsigned vertex_stride_bytes = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+  const unsigned normal_stride_bytes = mesh.normal_stride_bytes > 0 ? mesh.normal_stride_bytes : 3*sizeof(float);
+
+  const int3 tri = mesh.tri_vertex_indices[tri_idx];
+  const float3 v0 = getVertex( mesh.vertices, vertex_stride_bytes, tri.x );
+  const float3 v1 = getVertex( mesh.vertices, vertex_stride_bytes, tri.y );
+  const float3 v2 = getVertex( mesh.vertices, vertex_stride_bytes, tri.z );
+
+  const float3 face_normal = optix::normalize( optix::cross( v1-v0, v2-v0 ) );
+  float3 n0 = face_normal, n1 = face_normal, n2 = face_normal;
+  if ( mesh.normals ) {
+    n0 = faceforwardDevice( getVertex( mesh.normals, normal_stride_bytes, tri.x ), face_normal );
+    n1 = faceforwardDevice( getVertex( mesh.normals, normal_stride_bytes, tri.y ), face_normal );
+    n2 = faceforwardDevice( getVertex( mesh.normals, normal_stride_bytes, tri.z ), face_normal );
+  }
+
+  const float3 position    = xformPoint( instance.xform, bx*v0 + by*v1 + bz*v2 );
+  const float3 normal      = optix::normalize( xformPoint( instance.xform_invtrans, bx*n0 + by*n1 + bz*n2 ) );
+  const float3 face_normal_world = optix::normalize( xformPoint( instance.xform_invtrans, face_normal ) );
+  sample_position = make_float4( position.x, position.y, position.z, 0.0f );
+  sample_normal   = make_uint2( bake::encodeOctahedral( normal.x, normal.y, normal.z ), 
+                                bake::encodeOctahedral( face_normal_world.x, face_normal_world.y, face_normal_world.z ) );
+}
+
+__global__
+void generateSamplesKernel(
+    const size_t num_samples,
+    const size_t num_ranges,
+    const bake::TriangleSampleRange* ranges,
+    const bake::DeviceInstance* instances,
+    const bake::DeviceMesh* meshes,
+    float4* sample_positions,
+    uint2* sample_normals
+    )
+{
+  GRID_STRIDE_LOOP( idx, num_samples ) {
+    const bake::TriangleSampleRange range = ranges[findSampleRange( num_ranges, ranges, idx )];
+    const unsigned index = range.first_index + unsigned( idx - range.first_sample );
+    const bake::DeviceInstance& instance = instances[range.instance_index];
+
+    float bx, by, bz;
+    sampleBarycentrics( range, index, bx, by, bz );
+    placeSample( instance, meshes[instance.mesh_index], range.tri_idx, bx, by, bz, sample_positions[idx], sample_normals[idx] );
+  }
+}
+
+__host__
+void bake::generateSamplesDevice( size_t num_samples, size_t num_ranges, const bake::TriangleSampleRange* ranges, const bake::DeviceInstance* instances, 
+                                  const bake::DeviceMesh* meshes, float4* sample_positions, uint2* sample_normals, cudaStream_t stream )
+{
+  int block_size  = 512;                                                           
+  unsigned block_count = gridBlocks( num_samples, block_size );                              
+
+  generateSamplesKernel <<<block_count, block_size, 0, stream >>>( num_samples, num_ranges, ranges, instances, meshes, 
+                                                                   sample_positions, sample_normals );
+}
+
+
+__global__
+void reconstructSamplesKernel( const size_t num_samples, const bake::SampleLocation* locations, const bake::DeviceInstance* instances,
+                               const bake::DeviceMesh* meshes, float4* sample_positions, uint2* sample_normals )
+{
+  GRID_STRIDE_LOOP( idx, num_samples ) {
+    const bake::SampleLocation location = locations[idx];
+    const bake::DeviceInstance& instance = instances[location.instance_index];
+    const float bx = location.bary[0] / 65535.0f;
+    const float by = location.bary[1] / 65535.0f;
+    const float bz = fmaxf( 0.0f, 1.0f - bx - by );
+    placeSample( instance, meshes[instance.mesh_index], location.tri_idx, bx, by, bz, sample_positions[idx], sample_normals[idx] );
+  }
+}
+
+__host__
+void bake::reconstructSamplesDevice( size_t num_samples, const bake::SampleLocation* locations, const bake::DeviceInstance* instances, 
+                                     const bake::DeviceMesh* meshes, float4* sample_positions, uint2* sample_normals, cudaStream_t stream )
+{
+  int block_size  = 512;                                                           
+  unsigned block_count = gridBlocks( num_samples, block_size );                              
+
+  reconstructSamplesKernel <<<block_count, block_size, 0, stream >>>( num_samples, locations, instances, meshes, 
+                                                                      sample_positions, sample_normals );
+}
+
+
+__global__
+void packSamplesKernel( const size_t num_samples, const float3* positions, const float3* normals, const float3* face_normals,
+                        float4* sample_positions, uint2* sample_normals )
+{
+  GRID_STRIDE_LOOP( idx, num_samples ) {
+    const float3 position    = positions[idx];
+    const float3 normal      = normals[idx];
+    const float3 face_normal = face_normals[idx];
+    sample_positions[idx] = make_float4( position.x, position.y, position.z, 0.0f );
+    sample_normals[idx]   = make_uint2( bake::encodeOctahedral( normal.x, normal.y, normal.z ), 
+                                        bake::encodeOctahedral( face_normal.x, face_normal.y, face_normal.z ) );
+  }
+}
+
+__host__
+void bake::packSamplesDevice( size_t num_samples, const float3* positions, const float3* normals, const float3* face_normals,
+                              float4* sample_positions, uint2* sample_normals, cudaStream_t stream )
+{
+  int block_size  = 512;                                                           
+  unsigned block_count = gridBlocks( num_samples, block_size );                              
+
+  packSamplesKernel <<<block_count, block_size, 0, stream >>>( num_samples, positions, normals, face_normals, sample_positions, sample_normals );
+}
+
+
+__global__
+void splatVertexAOKernel(
+    const size_t num_samples,
+    const size_t num_ranges,
+    const bake::TriangleSampleRange* ranges,
+    const bake::DeviceInstance* instances,
+    const bake::DeviceMesh* meshes,
+    const unsigned* instance_vertex_offsets,
+    const float* ao,
+    float2* vertex_accum
+    )
+{
+  GRID_STRIDE_LOOP( idx, num_samples ) {
+    const bake::TriangleSampleRange range = ranges[findSampleRange( num_ranges, ranges, idx )];
+    const unsigned index = range.first_index + unsigned( idx - range.first_sample );
+
+    float bx, by, bz;
+    sampleBarycentrics( range, index, bx, by, bz );
+
+    const bake::DeviceMesh& mesh = meshes[instances[range.instance_index].mesh_index];
+    const int3 tri = mesh.tri_vertex_indices[range.tri_idx];
+    float2* accum = vertex_accum + instance_vertex_offsets[range.instance_index];
+    const float val = ao[idx];
+
+    // Same weights as the host area based filter
+    atomicAdd( &accum[tri.x].x, range.dA*bx*val );
+    atomicAdd( &accum[tri.x].y, range.dA*bx );
+    atomicAdd( &accum[tri.y].x, range.dA*by*val );
+    atomicAdd( &accum[tri.y].y, range.dA*by );
+    atomicAdd( &accum[tri.z].x, range.dA*bz*val );
+    atomicAdd( &accum[tri.z].y, range.dA*bz );
+  }
+}
+
+__host__
+void bake::splatVertexAODevice( size_t num_samples, size_t num_ranges, const bake::TriangleSampleRange* ranges, const bake::DeviceInstance* instances, 
+                                const bake::DeviceMesh* meshes, const unsigned* instance_vertex_offsets, const float* ao, float2* vertex_accum, 
+                                cudaStream_t stream )
+{
+  int block_size  = 512;                                                           
+  unsigned block_count = gridBlocks( num_samples, block_size );                              
+
+  splatVertexAOKernel <<<block_count, block_size, 0, stream >>>( num_samples, num_ranges, ranges, instances, meshes, 
+                                                                 instance_vertex_offsets, ao, vertex_accum );
+}
+
+
+__global__
+void normalizeVertexAOKernel( const size_t num_vertices, const float2* vertex_accum, float* vertex_ao )
+{
+  GRID_STRIDE_LOOP( idx, num_vertices ) {
+    const float2 accum = vertex_accum[idx];
+    vertex_ao[idx] = accum.y > 0.0f ? accum.x / accum.y : 0.0f;
+  }
+}
+
+__host__
+void bake::normalizeVertexAODevice( size_t num_vertices, const float2* vertex_accum, float* vertex_ao, cudaStream_t stream )
+{
+  int block_size  = 512;                                                           
+  unsigned block_count = gridBlocks( num_vertices, block_size );                              
+
+  normalizeVertexAOKernel <<<block_count, block_size, 0, stream >>>( num_vertices, vertex_accum, vertex_ao );
+}
+
+
+// Rounded as on the host, without contracting to an FMA, so that values match quantizeVertexAO
+template <typename T>
+__global__
+void packVertexAOKernel( const size_t num_vertices, const float2* vertex_accum, T* packed )
+{
+  const float scale = float( T(~T(0)) );
+  GRID_STRIDE_LOOP( idx, num_vertices ) {
+    const float2 accum = vertex_accum[idx];
+    const float ao = accum.y > 0.0f ? accum.x / accum.y : 0.0f;
+    const float v = fminf( fmaxf( ao, 0.0f ), 1.0f );
+    packed[idx] = T( __fadd_rn( __fmul_rn( v, scale ), 0.5f ) );
+  }
+}
+
+__host__
+void bake::packVertexAODevice( size_t num_vertices, const float2* vertex_accum, unsigned bits, void* packed, cudaStream_t stream )
+{
+  int block_size  = 512;                                                           
+  unsigned block_count = gridBlocks( num_vertices, block_size );                              
+
+  if ( bits == 8 ) {
+    packVertexAOKernel<unsigned char> <<<block_count, block_size, 0, stream >>>( num_vertices, vertex_accum, static_cast<unsigned char*>( packed ) );
+  } else {
+    packVertexAOKernel<unsigned short> <<<block_count, block_size, 0, stream >>>( num_vertices, vertex_accum, static_cast<unsigned short*>( packed ) );
+  }
+}
+
+
+__global__
+void dilateTextureKernel( int width, int height, const float* src, float* dst )
+{
+  const int x = blockIdx.x*blockDim.x + threadIdx.x;
+  const int y = blockIdx.y*blockDim.y + threadIdx.y;
+  if ( x >= width || y >= height ) return;
+
+  const float value = src[y*width + x];
+  if ( value >= 0.0f ) {
+    dst[y*width + x] = value;
+    return;
+  }
+
+  float sum = 0.0f;
+  int count = 0;
+  for ( int dy = -1; dy <= 1; ++dy ) {
+    const int ny = y + dy;
+    if ( ny < 0 || ny >= height ) continue;
+    for ( int dx = -1; dx <= 1; ++dx ) {
+      const int nx = x + dx;
+      if ( nx < 0 || nx >= width ) continue;
+      const float neighbor = src[ny*width + nx];
+      if ( neighbor >= 0.0f ) {
+        sum += neighbor;
+        count++;
+      }
+    }
+  }
+  dst[y*width + x] = count > 0 ? sum / count : value;
+}
+
+__host__
+void bake::dilateTextureDevice( int width, int height, const float* src, float* dst, cudaStream_t stream )
+{
+  const dim3 block_size( 16, 16 );
+  const dim3 block_count( idivCeil( width, block_size.x ), idivCeil( height, block_size.y ) );
+  dilateTextureKernel <<<block_count, block_size, 0, stream >>>( width, height, src, dst );
+}
+
+
+//------------------------------------------------------------------------------
+//
+// Sample space denoiser
+//
+//------------------------------------------------------------------------------
+
+const unsigned EMPTY_CELL = 0xffffffffu;
+const float DENOISE_NORMAL_POWER = 8.0f;   // exponent of the normal cosine in the weight
+const float DENOISE_PLANE_SCALE = 0.25f;   // tangent plane distance of one standard deviation, in radii
+
+__device__ __inline__ unsigned hashCell( int x, int y, int z, unsigned mask )
+{
+  return ( unsigned( x )*73856093u ^ unsigned( y )*19349663u ^ unsigned( z )*83492791u ) & mask;
+}
+
+__device__ __inline__ int cellCoord( float x, float inv_cell )
+{
+  return int( floorf( x*inv_cell ) );
+}
+
+__global__
+void hashSamplesKernel( size_t num_samples, const float4* positions, float inv_cell, unsigned mask, unsigned* keys, unsigned* order )
+{
+  GRID_STRIDE_LOOP( idx, num_samples ) {
+    const float4 p = positions[idx];
+    keys[idx] = hashCell( cellCoord( p.x, inv_cell ), cellCoord( p.y, inv_cell ), cellCoord( p.z, inv_cell ), mask );
+    order[idx] = unsigned( idx );
+  }
+}
+
+// Range of the sorted samples in each occupied hash bucket
+__global__
+void findCellRangesKernel( size_t num_samples, const unsigned* sorted_keys, unsigned* cell_start, unsigned* cell_end )
+{
+  GRID_STRIDE_LOOP( idx, num_samples ) {
+    const unsigned key = sorted_keys[idx];
+    if ( idx == 0 || sorted_keys[idx-1] != key ) cell_start[key] = unsigned( idx );
+    if ( idx+1 == num_samples || sorted_keys[idx+1] != key ) cell_end[key] = unsigned( idx+1 );
+  }
+}
+
+// Weight of sample j for a point at distance d from it, by the Gaussian of d, of the distances from both tangent planes,
+// and a power of the cosine between the normals; 0 beyond the radius or for normals that face apart
+__device__ __inline__ float neighborWeight( const float3& d, const float3& ni, const float3& nj, float radius2, float inv_two_sigma2, 
+                                            float inv_two_plane_sigma2 )
+{
+  const float d2 = optix::dot( d, d );
+  if ( d2 > radius2 ) return 0.0f;
+  const float cosine = optix::dot( ni, nj );
+  if ( cosine <= 0.0f ) return 0.0f;
+  const float plane_i = optix::dot( ni, d );
+  const float plane_j = optix::dot( nj, d );
+  return __expf( -d2*inv_two_sigma2 - ( plane_i*plane_i + plane_j*plane_j )*inv_two_plane_sigma2 ) * __powf( cosine, DENOISE_NORMAL_POWER );
+}
+
+// One thread per sample, in sorted order so neighboring threads read the same buckets
+__global__
+void denoiseAOKernel( size_t num_samples, const float4* positions, const uint2* normals, const bake::DeviceSampleGrid grid, float radius, 
+                      const float* ao_in, float* ao_out )
+{
+  const float radius2 = radius*radius;
+  const float inv_two_sigma2 = 2.0f / radius2;  // sigma = radius/2
+  const float plane_sigma = DENOISE_PLANE_SCALE*radius;
+  const float inv_two_plane_sigma2 = 0.5f / ( plane_sigma*plane_sigma );
+
+  GRID_STRIDE_LOOP( idx, num_samples ) {
+    const unsigned i = grid.order[idx];
+    const float4 pi = positions[i];
+    const float3 ni = bake::decodeOctahedral( normals[i].x );
+    const int cx = cellCoord( pi.x, grid.inv_cell );
+    const int cy = cellCoord( pi.y, grid.inv_cell );
+    const int cz = cellCoord( pi.z, grid.inv_cell );
+
+    // Neighbor cells can share a bucket; each bucket is visited once
+    unsigned visited[27];
+    int num_visited = 0;
+    float sum = 0.0f;
+    float weight_sum = 0.0f;
+    for ( int dz = -1; dz <= 1; ++dz )
+    for ( int dy = -1; dy <= 1; ++dy )
+    for ( int dx = -1; dx <= 1; ++dx ) {
+      const unsigned key = hashCell( cx+dx, cy+dy, cz+dz, grid.mask );
+      bool seen = false;
+      for ( int k = 0; k < num_visited; ++k ) seen = seen || visited[k] == key;
+      if ( seen ) continue;
+      visited[num_visited++] = key;
+      const unsigned start = grid.cell_start[key];
+      if ( start == EMPTY_CELL ) continue;
+      const unsigned end = grid.cell_end[key];
+      for ( unsigned m = start; m < end; ++m ) {
+        const unsigned j = grid.order[m];
+        const float4 pj = positions[j];
+        const float3 d = optix::make_float3( pj.x - pi.x, pj.y - pi.y, pj.z - pi.z );
+        const float w = neighborWeight( d, ni, bake::decodeOctahedral( normals[j].x ), radius2, inv_two_sigma2, inv_two_plane_sigma2 );
+        sum += w*ao_in[j];
+        weight_sum += w;
+      }
+    }
+    // The sample itself has weight 1
+    ao_out[i] = weight_sum > 0.0f ? sum / weight_sum : ao_in[i];
+  }
+}
+
+__host__
+void bake::buildSampleGridDevice( const DeviceSamples& samples, float cell_size, DeviceSampleGrid& grid, cudaStream_t stream )
+{
+  const size_t n = samples.num_samples;
+
+  // Buckets: the next power of two from the sample count
+  size_t num_buckets = 1 << 10;
+  while ( num_buckets < n && num_buckets < ( size_t(1) << 30 ) ) num_buckets <<= 1;
+  grid.mask = unsigned( num_buckets - 1 );
+  grid.inv_cell = 1.0f / cell_size;
+
+  CHK_CUDA( cudaMalloc( &grid.scratch, ( 2*n + 2*num_buckets )*sizeof(unsigned) ) );
+  unsigned* keys = grid.scratch;
+  grid.order = grid.scratch + n;
+  grid.cell_start = grid.scratch + 2*n;
+  grid.cell_end = grid.cell_start + num_buckets;
+  CHK_CUDA( cudaMemsetAsync( grid.cell_start, 0xff, num_buckets*sizeof(unsigned), stream ) );
+  if ( n == 0 ) return;
+
+  const int block_size  = 512;
+  const unsigned block_count = gridBlocks( n, block_size );
+  hashSamplesKernel <<<block_count, block_size, 0, stream >>>( n, samples.positions, grid.inv_cell, grid.mask, keys, grid.order );
+  thrust::sort_by_key( thrust::cuda::par.on( stream ), keys, keys + n, grid.order );
+  findCellRangesKernel <<<block_count, block_size, 0, stream >>>( n, keys, grid.cell_start, grid.cell_end );
+}
+
+__host__
+void bake::freeSampleGridDevice( DeviceSampleGrid& grid )
+{
+  CHK_CUDA( cudaFree( grid.scratch ) );
+  grid.scratch = grid.order = grid.cell_start = grid.cell_end = NULL;
+}
+
+__host__
+void bake::denoiseAODevice( const DeviceSamples& samples, float radius, const float* ao_in, float* ao_out, cudaStream_t stream )
+{
+  const size_t n = samples.num_samples;
+  if ( n == 0 ) return;
+
+  DeviceSampleGrid grid;
+  buildSampleGridDevice( samples, radius, grid, stream );
+
+  const int block_size = 128;
+  const unsigned block_count = gridBlocks( n, block_size );
+  denoiseAOKernel <<<block_count, block_size, 0, stream >>>( n, samples.positions, samples.normals, grid, radius, ao_in, ao_out );
+  CHK_CUDA( cudaStreamSynchronize( stream ) );
+  freeSampleGridDevice( grid );
+}
+
+// One thread per target point.  Like denoiseAOKernel, with the point's own normal and without the point among the
+// samples; the nearest sample that faces the same way stands in when none is within the radius.
+__global__
+void transferAOKernel( size_t num_samples, const float4* positions, const uint2* normals, const bake::DeviceSampleGrid grid, float radius, 
+                       const float* ao, size_t num_targets, const float4* target_positions, const uint2* target_normals, float* target_ao )
+{
+  const float radius2 = radius*radius;
+  const float inv_two_sigma2 = 2.0f / radius2;
+  const float plane_sigma = DENOISE_PLANE_SCALE*radius;
+  const float inv_two_plane_sigma2 = 0.5f / ( plane_sigma*plane_sigma );
+
+  GRID_STRIDE_LOOP( idx, num_targets ) {
+    const float4 pi = target_positions[idx];
+    const float3 ni = bake::decodeOctahedral( target_normals[idx].x );
+    const int cx = cellCoord( pi.x, grid.inv_cell );
+    const int cy = cellCoord( pi.y, grid.inv_cell );
+    const int cz = cellCoord( pi.z, grid.inv_cell );
+
+    unsigned visited[27];
+    int num_visited = 0;
+    float sum = 0.0f;
+    float weight_sum = 0.0f;
+    float nearest_d2 = 3.4e38f;
+    float nearest_ao = 1.0f;
+    for ( int dz = -1; dz <= 1; ++dz )
+    for ( int dy = -1; dy <= 1; ++dy )
+    for ( int dx = -1; dx <= 1; ++dx ) {
+      const unsigned key = hashCell( cx+dx, cy+dy, cz+dz, grid.mask );
+      bool seen = false;
+      for ( int k = 0; k < num_visited; ++k ) seen = seen || visited[k] == key;
+      if ( seen ) continue;
+      visited[num_visited++] = key;
+      const unsigned start = grid.cell_start[key];
+      if ( start == EMPTY_CELL ) continue;
+      const unsigned end = grid.cell_end[key];
+      for ( unsigned m = start; m < end; ++m ) {
+        const unsigned j = grid.order[m];
+        const float4 pj = positions[j];
+        const float3 d = optix::make_float3( pj.x - pi.x, pj.y - pi.y, pj.z - pi.z );
+        const float3 nj = bake::decodeOctahedral( normals[j].x );
+        const float w = neighborWeight( d, ni, nj, radius2, inv_two_sigma2, inv_two_plane_sigma2 );
+        sum += w*ao[j];
+        weight_sum += w;
+        const float d2 = optix::dot( d, d );
+        if ( d2 < nearest_d2 && optix::dot( ni, nj ) > 0.0f ) {
+          nearest_d2 = d2;
+          nearest_ao = ao[j];
+        }
+      }
+    }
+    target_ao[idx] = weight_sum > 0.0f ? sum / weight_sum : nearest_ao;
+  }
+}
+
+__host__
+void bake::transferAODevice( const DeviceSamples& samples, const DeviceSampleGrid& grid, float radius, const float* ao, 
+                             const DeviceSamples& targets, float* target_ao, cudaStream_t stream )
+{
+  const size_t n = targets.num_samples;
+  if ( n == 0 ) return;
+  const int block_size = 128;
+  const unsigned block_count = gridBlocks( n, block_size );
+  transferAOKernel <<<block_count, block_size, 0, stream >>>( samples.num_samples, samples.positions, samples.normals, grid, radius, ao, 
+                                                              n, targets.positions, targets.normals, target_ao );
+}
+
+
+//------------------------------------------------------------------------------
+//
+// Conjugate gradient solver
+//
+//------------------------------------------------------------------------------
+
+// y = A*x, one thread per row of a CSR matrix
+__global__
+void spmvKernel( const int n, const int* row_offsets, const int* columns, const float* values, const float* x, float* y )
+{
+  int row = threadIdx.x + blockIdx.x*blockDim.x;                                 
+  if( row >= n )                                                             
+    return;
+  float sum = 0.0f;
+  for ( int k = row_offsets[row]; k < row_offsets[row+1]; ++k ) {
+    sum += values[k]*x[columns[k]];
+  }
+  y[row] = sum;
+}
+
+// Inverse diagonal of A for the Jacobi preconditioner, the initial residual r = b - A*x, and z = M^-1 r
+__global__
+void cgSetupKernel( const int n, const int* row_offsets, const int* columns, const float* values, const float* b, const float* x, 
+                    float* inv_diag, float* r, float* z )
+{
+  int row = threadIdx.x + blockIdx.x*blockDim.x;                                 
+  if( row >= n )                                                             
     return;
+  float sum = 0.0f;
+  float diag = 0.0f;
+  for ( int k = row_offsets[row]; k < row_offsets[row+1]; ++k ) {
+    sum += values[k]*x[columns[k]];
+    if ( columns[k] == row ) diag = values[k];
+  }
+  const float inv = diag > 0.0f ? 1.0f / diag : 1.0f;
+  inv_diag[row] = inv;
+  r[row] = b[row] - sum;
+  z[row] = inv*r[row];
+}
 
-  ao_data[idx] = 1.0f - ao_data[idx] / rays_per_sample;
+// x += alpha*p, r -= alpha*Ap, z = M^-1 r
+__global__
+void cgStepKernel( const int n, const float alpha, const float* p, const float* Ap, const float* inv_diag, float* x, float* r, float* z )
+{
+  int i = threadIdx.x + blockIdx.x*blockDim.x;                                 
+  if( i >= n )                                                             
+    return;
+  x[i] += alpha*p[i];
+  const float ri = r[i] - alpha*Ap[i];
+  r[i] = ri;
+  z[i] = inv_diag[i]*ri;
+}
+
+// p = z + beta*p
+__global__
+void cgDirectionKernel( const int n, const float beta, const float* z, float* p )
+{
+  int i = threadIdx.x + blockIdx.x*blockDim.x;                                 
+  if( i >= n )                                                             
+    return;
+  p[i] = z[i] + beta*p[i];
+}
+
+inline double dotDevice( const int n, const float* a, const float* b, cudaStream_t stream )
+{
+  // Accumulate in double; vectors can have millions of entries
+  return thrust::inner_product( thrust::cuda::par.on( stream ), a, a + n, b, 0.0 );
 }
 
 __host__
-void bake::normalizeAODevice( int num_samples, float* ao, int rays_per_sample )
+int bake::solveConjugateGradientDevice( int n, const int* row_offsets, const int* columns, const float* values, const float* b, float* x, 
+                                        int max_iterations, float tolerance, float* residual, cudaStream_t stream )
 {
+  if ( residual ) *residual = 0.0f;
+  if ( n <= 0 ) return 0;
+
   int block_size  = 512;                                                           
-  int block_count = idivCeil( num_samples, block_size );                              
+  int block_count = (int)idivCeil( n, block_size );                              
+
+  float* scratch = NULL;
+  CHK_CUDA( cudaMalloc( &scratch, 5*size_t(n)*sizeof(float) ) );
+  float* inv_diag = scratch;
+  float* r  = scratch + n;
+  float* z  = scratch + 2*size_t(n);
+  float* p  = scratch + 3*size_t(n);
+  float* Ap = scratch + 4*size_t(n);
+
+  cgSetupKernel <<<block_count, block_size, 0, stream >>>( n, row_offsets, columns, values, b, x, inv_diag, r, z );
+  CHK_CUDA( cudaMemcpyAsync( p, z, n*sizeof(float), cudaMemcpyDeviceToDevice, stream ) );
+
+  const double b_norm2 = dotDevice( n, b, b, stream );
+  const double threshold = double( tolerance )*double( tolerance )*( b_norm2 > 0.0 ? b_norm2 : 1.0 );
+  double r_norm2 = dotDevice( n, r, r, stream );
+  double rz = dotDevice( n, r, z, stream );
+
+  int iteration = 0;
+  while ( iteration < max_iterations && r_norm2 > threshold ) {
+    spmvKernel <<<block_count, block_size, 0, stream >>>( n, row_offsets, columns, values, p, Ap );
+    const double pAp = dotDevice( n, p, Ap, stream );
+    if ( pAp <= 0.0 ) break;  // lost positive definiteness to rounding
+    const float alpha = float( rz / pAp );
+    cgStepKernel <<<block_count, block_size, 0, stream >>>( n, alpha, p, Ap, inv_diag, x, r, z );
+    ++iteration;
 
-  normalizeAOKernel <<<block_count, block_size >>>(num_samples, ao, rays_per_sample);
+    r_norm2 = dotDevice( n, r, r, stream );
+    const double rz_next = dotDevice( n, r, z, stream );
+    const float beta = float( rz_next / rz );
+    rz = rz_next;
+    cgDirectionKernel <<<block_count, block_size, 0, stream >>>( n, beta, z, p );
+  }
+
+  CHK_CUDA( cudaFree( scratch ) );
+  if ( residual ) *residual = float( sqrt( r_norm2 / ( b_norm2 > 0.0 ? b_norm2 : 1.0 ) ) );
+  return iteration;
+}
+
+//------------------------------------------------------------------------------
+//
+// Far field volume
+//
+// The occluders as a mipmapped opacity volume: level 0 marks every voxel a triangle's plane passes through, 
+// within the triangle's bounds, and each level above averages 8 voxels of the one below.  Rays that leave the 
+// near field march a cone through it instead of being traced.
+//
+//------------------------------------------------------------------------------
+
+__global__
+void voxelizeFarFieldKernel( const size_t num_triangles, const size_t num_mesh_instances, const unsigned* mesh_instances, 
+                             const bake::DeviceInstance* instances, const bake::DeviceMesh* meshes, const bake::DeviceFarField volume )
+{
+  GRID_STRIDE_LOOP( idx, num_triangles*num_mesh_instances ) {
+    const size_t tri_idx = idx % num_triangles;
+    const bake::DeviceInstance& instance = instances[mesh_instances[idx / num_triangles]];
+    const bake::DeviceMesh& mesh = meshes[instance.mesh_index];
+    const unsigned vertex_stride_bytes = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+
+    // Triangle in voxel units of level 0
+    const int3 tri = mesh.tri_vertex_indices[tri_idx];
+    const float inv_voxel_size = 1.0f / volume.voxel_size;
+    const float3 p0 = ( xformPoint( instance.xform, getVertex( mesh.vertices, vertex_stride_bytes, tri.x ) ) - volume.origin ) * inv_voxel_size;
+    const float3 p1 = ( xformPoint( instance.xform, getVertex( mesh.vertices, vertex_stride_bytes, tri.y ) ) - volume.origin ) * inv_voxel_size;
+    const float3 p2 = ( xformPoint( instance.xform, getVertex( mesh.vertices, vertex_stride_bytes, tri.z ) ) - volume.origin ) * inv_voxel_size;
+    float3 n = optix::cross( p1 - p0, p2 - p0 );
+    const float len = optix::length( n );
+    if ( !( len > 0.0f ) ) continue;
+    n /= len;
+    const float d = optix::dot( n, p0 );
+    // Half the extent of a voxel along the normal
+    const float r = 0.5f*( fabsf( n.x ) + fabsf( n.y ) + fabsf( n.z ) );
+
+    const int res = volume.resolution;
+    const float3 lo = optix::fminf( optix::fminf( p0, p1 ), p2 );
+    const float3 hi = optix::fmaxf( optix::fmaxf( p0, p1 ), p2 );
+    const int x0 = max( int( floorf( lo.x ) ), 0 ), x1 = min( int( floorf( hi.x ) ), res-1 );
+    const int y0 = max( int( floorf( lo.y ) ), 0 ), y1 = min( int( floorf( hi.y ) ), res-1 );
+    const int z0 = max( int( floorf( lo.z ) ), 0 ), z1 = min( int( floorf( hi.z ) ), res-1 );
+    for ( int z = z0; z <= z1; ++z ) {
+      for ( int y = y0; y <= y1; ++y ) {
+        for ( int x = x0; x <= x1; ++x ) {
+          const float3 c = optix::make_float3( x + 0.5f, y + 0.5f, z + 0.5f );
+          // Threads only ever store 255, so racing stores agree
+          if ( fabsf( optix::dot( n, c ) - d ) <= r ) volume.opacity[( size_t( z )*res + y )*res + x] = 255;
+        }
+      }
+    }
+  }
+}
+
+__global__
+void downsampleFarFieldKernel( const int dst_res, const unsigned char* src, unsigned char* dst )
+{
+  const size_t n = size_t( dst_res )*dst_res*dst_res;
+  const size_t src_res = 2*size_t( dst_res );
+  GRID_STRIDE_LOOP( idx, n ) {
+    const size_t x = idx % dst_res;
+    const size_t y = ( idx / dst_res ) % dst_res;
+    const size_t z = idx / ( size_t( dst_res )*dst_res );
+    unsigned sum = 0;
+    for ( int k = 0; k < 8; ++k ) {
+      sum += src[( ( 2*z + ( k >> 2 ) )*src_res + 2*y + ( ( k >> 1 ) & 1 ) )*src_res + 2*x + ( k & 1 )];
+    }
+    dst[idx] = (unsigned char)( ( sum + 4 ) / 8 );
+  }
+}
+
+__host__
+void bake::voxelizeFarFieldDevice( size_t num_triangles, size_t num_mesh_instances, const unsigned* mesh_instances, const DeviceInstance* instances, 
+                                   const DeviceMesh* meshes, const DeviceFarField& volume, cudaStream_t stream )
+{
+  const size_t n = num_triangles*num_mesh_instances;
+  if ( n == 0 ) return;
+  int block_size = 256;
+  voxelizeFarFieldKernel <<<gridBlocks( n, block_size ), block_size, 0, stream >>>( num_triangles, num_mesh_instances, mesh_instances, 
+                                                                                 instances, meshes, volume );
+}
+
+__host__
+void bake::buildFarFieldMipsDevice( const DeviceFarField& volume, cudaStream_t stream )
+{
+  int block_size = 512;
+  for ( int level = 1; level < volume.num_levels; ++level ) {
+    const int res = volume.resolution >> level;
+    const size_t n = size_t( res )*res*res;
+    downsampleFarFieldKernel <<<gridBlocks( n, block_size ), block_size, 0, stream >>>( res, volume.opacity + volume.level_offsets[level-1], 
+                                                                                     volume.opacity + volume.level_offsets[level] );
+  }
 }
 
+// Opacity of a level, trilinear between voxel centers, at p in voxel units of level 0; 0 outside the volume
+__device__ __inline__ float farFieldOpacity( const bake::DeviceFarField& volume, const int level, const float3& p )
+{
+  const int res = volume.resolution >> level;
+  const unsigned char* opacity = volume.opacity + volume.level_offsets[level];
+  const float3 q = p * ( 1.0f / float( 1 << level ) ) - optix::make_float3( 0.5f );
+  const int x = int( floorf( q.x ) ), y = int( floorf( q.y ) ), z = int( floorf( q.z ) );
+  const float fx = q.x - x, fy = q.y - y, fz = q.z - z;
+  float sum = 0.0f;
+  for ( int k = 0; k < 8; ++k ) {
+    const int vx = x + ( k & 1 ), vy = y + ( ( k >> 1 ) & 1 ), vz = z + ( k >> 2 );
+    if ( vx < 0 || vy < 0 || vz < 0 || vx >= res || vy >= res || vz >= res ) continue;
+    const float w = ( k & 1 ? fx : 1.0f - fx ) * ( ( k >> 1 ) & 1 ? fy : 1.0f - fy ) * ( k >> 2 ? fz : 1.0f - fz );
+    sum += w * opacity[( size_t( vz )*res + vy )*res + vx];
+  }
+  return sum * ( 1.0f / 255.0f );
+}
+
+// Occlusion a cone of half angle atan(cone_tan) gathers along the ray over [tmin, tmax], front to back: each step 
+// samples the level whose voxels are about as wide as the cone there, and steps half that width.
+__device__ __inline__ float coneOcclusion( const bake::DeviceFarField& volume, const float3& origin, const float3& dir, 
+                                           float tmin, float tmax, const float cone_tan )
+{
+  // Clip to the volume's cube
+  const float extent = volume.voxel_size * volume.resolution;
+  const float3 inv_dir = optix::make_float3( 1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z );
+  const float3 ta = ( volume.origin - origin ) * inv_dir;
+  const float3 tb = ( volume.origin + optix::make_float3( extent ) - origin ) * inv_dir;
+  const float3 t_near = optix::fminf( ta, tb ), t_far = optix::fmaxf( ta, tb );
+  tmin = fmaxf( tmin, fmaxf( fmaxf( t_near.x, t_near.y ), t_near.z ) );
+  tmax = fminf( tmax, fminf( fminf( t_far.x, t_far.y ), t_far.z ) );
+
+  const float inv_voxel_size = 1.0f / volume.voxel_size;
+  float occlusion = 0.0f;
+  for ( float t = tmin; t < tmax && occlusion < 0.99f; ) {
+    const float width = fmaxf( 2.0f*cone_tan*t, volume.voxel_size );
+    const int level = min( int( log2f( width * inv_voxel_size ) + 0.5f ), volume.num_levels - 1 );
+    const float step = 0.5f*width;
+    const float alpha = farFieldOpacity( volume, level, ( origin + t*dir - volume.origin ) * inv_voxel_size );
+    if ( alpha > 0.0f ) {
+      // Opacity is per voxel of the level; correct it for the length of the step
+      const float level_size = volume.voxel_size * float( 1 << level );
+      occlusion += ( 1.0f - occlusion ) * ( 1.0f - powf( 1.0f - fminf( alpha, 0.999f ), step / level_size ) );
+    }
+    t += step;
+  }
+  return occlusion;
+}
+
+// updateAOKernel for rays traced to the near radius only: rays that hit nothing there get the occlusion of the far
+// field instead, from the ground plane or the cone marched from near to far.  Rays are shadow rays, whose 
+// directions point back at the sample.
+__global__
+void updateAOFarFieldKernel( size_t num_active, const int* active_samples, int num_passes, const unsigned* hit_bits, const unsigned* plane_hit_bits,
+                             const Ray* rays, const float4* sample_positions, const bake::DeviceGroundPlane ground_plane, 
+                             const bake::DeviceFarField volume, const float near_distance, const float far_distance, const float cone_tan, 
+                             float* ao_data )
+{
+  GRID_STRIDE_LOOP( idx, num_active ) {
+    const size_t sample_idx = active_samples ? size_t( active_samples[idx] ) : idx;
+    const float4 sample_pos = sample_positions[sample_idx];
+    const float3 origin = optix::make_float3( sample_pos.x, sample_pos.y, sample_pos.z );
+    float occluded = 0.0f;
+    for ( int k = 0; k < num_passes; ++k ) {
+      const size_t r = k*num_active + idx;
+      const unsigned bits = hit_bits[r >> 5] | ( plane_hit_bits ? plane_hit_bits[r >> 5] : 0u );
+      if ( ( bits >> ( r & 31 ) ) & 1 ) {
+        occluded += 1.0f;
+        continue;
+      }
+      const float4 reversed = reinterpret_cast<const float4*>( rays + r )[1];
+      const float3 dir = optix::make_float3( -reversed.x, -reversed.y, -reversed.z );
+      if ( ground_plane.axis >= 0 && bake::groundPlaneDistance( ground_plane, origin, dir, near_distance, far_distance ) >= 0.0f ) {
+        occluded += 1.0f;
+        continue;
+      }
+      occluded += coneOcclusion( volume, origin, dir, near_distance, far_distance, cone_tan );
+    }
+    ao_data[sample_idx] += occluded;
+  }
+}
+
+__host__
+void bake::updateAOFarFieldDevice( size_t num_active, const int* active_samples, int num_passes, const unsigned* hits, const unsigned* plane_hits, 
+                                   const Ray* rays, const DeviceSamples& samples, const DeviceGroundPlane& ground_plane, const DeviceFarField& volume, 
+                                   float near_distance, float far_distance, int rays_per_sample, float* ao, cudaStream_t stream )
+{
+  // Each ray stands for the cone of 1/rays_per_sample of the hemisphere's solid angle, at most 60 degrees wide
+  const float cos_angle = std::max( 1.0f - 1.0f / float( std::max( rays_per_sample, 1 ) ), 0.5f );
+  const float cone_tan = sqrtf( 1.0f - cos_angle*cos_angle ) / cos_angle;
+  int block_size = 256;
+  updateAOFarFieldKernel <<<gridBlocks( num_active, block_size ), block_size, 0, stream >>>( num_active, active_samples, num_passes, hits, 
+    ground_plane.axis >= 0 ? plane_hits : NULL, rays, samples.positions, ground_plane, volume, near_distance, far_distance, cone_tan, ao );
+}
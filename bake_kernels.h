@@ -24,15 +24,237 @@
 #pragma once
 
 #include "bake_util.h"
+#include <cuda_runtime.h>
+#include <math.h>
+#include <string>
+#include <vector>
 
 
 namespace bake
 {
 
-struct AOSamples;
+// Device layout of a batch of samples, for coalesced loads in ray generation: positions padded to 
+// float4 (w unused), and the normal (x) and face normal (y) of each sample octahedral encoded.
+struct DeviceSamples
+{
+  size_t        num_samples;
+  const float4* positions;
+  const uint2*  normals;
+  bool          flat_normals;  // every sample's normal is its face normal, e.g. of meshes without normals
+};
+
+// Unit vector to two 16 bit snorm octahedral coordinates, packed into one word
+__host__ __device__ inline unsigned encodeOctahedral( float x, float y, float z )
+{
+  const float inv_l1 = 1.0f / ( fabsf( x ) + fabsf( y ) + fabsf( z ) );
+  x *= inv_l1;
+  y *= inv_l1;
+  if ( z < 0.0f ) {
+    const float ox = ( 1.0f - fabsf( y ) ) * ( x >= 0.0f ? 1.0f : -1.0f );
+    const float oy = ( 1.0f - fabsf( x ) ) * ( y >= 0.0f ? 1.0f : -1.0f );
+    x = ox;
+    y = oy;
+  }
+  const int ix = (int)floorf( fminf( fmaxf( x, -1.0f ), 1.0f ) * 32767.0f + 0.5f );
+  const int iy = (int)floorf( fminf( fmaxf( y, -1.0f ), 1.0f ) * 32767.0f + 0.5f );
+  return ( unsigned( ix ) & 0xffffu ) | ( unsigned( iy ) << 16 );
+}
+
+__host__ __device__ inline float3 decodeOctahedral( const unsigned e )
+{
+  float x = (float)(short)( e & 0xffffu ) / 32767.0f;
+  float y = (float)(short)( e >> 16 ) / 32767.0f;
+  const float z = 1.0f - fabsf( x ) - fabsf( y );
+  if ( z < 0.0f ) {
+    const float ox = ( 1.0f - fabsf( y ) ) * ( x >= 0.0f ? 1.0f : -1.0f );
+    const float oy = ( 1.0f - fabsf( x ) ) * ( y >= 0.0f ? 1.0f : -1.0f );
+    x = ox;
+    y = oy;
+  }
+  const float inv_l = 1.0f / sqrtf( x*x + y*y + z*z );
+  float3 n;
+  n.x = x*inv_l;
+  n.y = y*inv_l;
+  n.z = z*inv_l;
+  return n;
+}
+
+// Device-side geometry for placing samples, see generateSamplesDevice
+struct DeviceMesh
+{
+  const float*    vertices;
+  unsigned        vertex_stride_bytes;
+  const float*    normals;  // optional
+  unsigned        normal_stride_bytes;
+  const int3*     tri_vertex_indices;
+};
+
+struct DeviceInstance
+{
+  float     xform[12];           // top 3 rows of the 4x4 row major xform
+  float     xform_invtrans[12];  // same for the inverse transpose
+  unsigned  mesh_index;
+};
+
+// Ray generation, AO update and AO normalization launch with the block size cudaOccupancyMaxPotentialBlockSize suggests 
+// for each kernel on a device, found at its first launch there and kept.  With tuning on, ray generation instead times a
+// few block sizes at its first launch on a device, synchronizing the stream, and keeps the fastest.
+void tuneKernelLaunches( bool tune );
+// Kernels launched so far on a device and the block size each uses
+void kernelLaunchConfigs( int device, std::vector<std::string>& names, std::vector<int>& block_sizes );
+
+// Axis aligned rectangle that occludes rays in generateRaysDevice, from both sides.  It lies at 
+// bbox_min[axis] == bbox_max[axis]; axis < 0 means there is none.
+struct DeviceGroundPlane
+{
+  int       axis;
+  float3    bbox_min;
+  float3    bbox_max;
+};
+
+// Hit distances of multi radius AO, see updateAOMultiRadiusDevice
+const int MAX_DEVICE_AO_RADII = 4;
+struct DeviceAORadii
+{
+  int       count;
+  float     radii[MAX_DEVICE_AO_RADII];
+};
+
+// Adaptive sampling only tests a sample for convergence once it has traced this many rays
+const int ADAPTIVE_MIN_RAYS = 16;
+
+// Run of samples on one triangle of one instance, within a batch
+struct TriangleSampleRange
+{
+  unsigned  instance_index;
+  unsigned  tri_idx;
+  unsigned  first_sample;  // batch-relative index of the first sample in the run
+  unsigned  first_index;   // index of that sample among the triangle's samples
+  float     dA;            // area per sample on the triangle, for splatVertexAODevice
+};
+
+// Where a host sample is, for rebuilding it on the device: 12 bytes instead of the 24 of its DeviceSamples entries
+struct SampleLocation
+{
+  unsigned        instance_index;
+  unsigned        tri_idx;
+  unsigned short  bary[2];  // first two barycentrics as 16 bit unorm, the third implied
+};
+
+// All launches are asynchronous on the given stream, and counts are 64 bit.  Active sample lists hold batch-relative
+// indices, and a batch has fewer samples than a query has rays.
+// Rays and hits for num_passes passes are stored pass-major, num_active entries per pass.  Kernels work on
+// the samples listed in active_samples, or on the first num_active samples if the list is NULL.
+// Rays that cross the ground plane get an empty interval, so Prime skips them, and their bits set in plane_hits,
+// which must be zero before.  plane_hits may be NULL if there is no ground plane.  Shadow rays are traced from 
+// their far end for speed; forward rays start at the sample, so that closest hits give the distance from it.  Flipped normals
+// trace the other side of the surface.  Sample i of the batch is sample first_sample_index + i of the bake, for seeding.
+void generateRaysDevice(unsigned long long first_sample_index, int first_pass, int num_passes, float scene_offset, float scene_maxdistance, const DeviceSamples& samples, 
+                        size_t num_active, const int* active_samples, const DeviceGroundPlane& ground_plane, unsigned* plane_hits, bool forward_rays,
+                        bool flip_normals, Ray* rays, cudaStream_t stream = 0 );
+// Hits are in RTP_BUFFER_FORMAT_HIT_BITMASK format: bit r of the buffer is set if ray r hit anything.  Bits of 
+// plane_hits, if not NULL, count as hits too.  With bent_normals, the directions of the rays that hit nothing, from 
+// generateRaysDevice with the same forward_rays, are summed into three channels (x, y, z) of num_active values; 
+// there must be no active list then.
+void updateAODevice( size_t num_active, const int* active_samples, int num_passes, const unsigned* hits, const unsigned* plane_hits, float* ao, 
+                     cudaStream_t stream = 0, const Ray* rays = NULL, bool forward_rays = false, float* bent_normals = NULL );
+// Multi radius version of updateAODevice for all num_samples samples, with hits in RTP_BUFFER_FORMAT_HIT_T format from 
+// forward rays (negative for a miss).  A hit counts for every radius it is within.  AO of radius r is at ao[r*num_samples].
+void updateAOMultiRadiusDevice( size_t num_samples, int num_passes, const float* hit_t, const DeviceAORadii& radii, float* ao, 
+                                cudaStream_t stream = 0 );
+// Finalizes AO of the active samples whose standard error is within tolerance after num_rays rays, and
+// compacts the others, in order, into next_active_samples.  keep is scratch space for num_active flags.
+// Returns the new number of active samples, so this waits for the stream.
+size_t retireConvergedDevice( size_t num_active, const int* active_samples, int num_rays, float tolerance, float* ao,
+                              unsigned char* keep, int* next_active_samples, cudaStream_t stream = 0 );
+// Places samples with the same Halton scheme as the host sampler.  Ranges are sorted by first_sample and cover the batch.
+// Output is in the DeviceSamples layout.
+void generateSamplesDevice( size_t num_samples, size_t num_ranges, const TriangleSampleRange* ranges, const DeviceInstance* instances, 
+                            const DeviceMesh* meshes, float4* sample_positions, uint2* sample_normals, cudaStream_t stream = 0 );
+// Rebuilds samples placed on the host from their locations, into the DeviceSamples layout
+void reconstructSamplesDevice( size_t num_samples, const SampleLocation* locations, const DeviceInstance* instances, 
+                               const DeviceMesh* meshes, float4* sample_positions, uint2* sample_normals, cudaStream_t stream = 0 );
+// Packs samples given as float3 arrays in device memory, as in AOSamples, into the DeviceSamples layout
+void packSamplesDevice( size_t num_samples, const float3* positions, const float3* normals, const float3* face_normals,
+                        float4* sample_positions, uint2* sample_normals, cudaStream_t stream = 0 );
+// Adds the AO of placed samples onto the vertices of their triangles, with the weights of the area based filter:
+// vertex_accum[v].x sums dA*bary*ao and .y sums dA*bary, where vertices of instance i start at instance_vertex_offsets[i].
+void splatVertexAODevice( size_t num_samples, size_t num_ranges, const TriangleSampleRange* ranges, const DeviceInstance* instances, 
+                          const DeviceMesh* meshes, const unsigned* instance_vertex_offsets, const float* ao, float2* vertex_accum, 
+                          cudaStream_t stream = 0 );
+// vertex_ao = sum / weight of splatted AO, or 0 for vertices without weight
+void normalizeVertexAODevice( size_t num_vertices, const float2* vertex_accum, float* vertex_ao, cudaStream_t stream = 0 );
+// Same, quantized to 8 or 16 bits per vertex into packed as quantizeVertexAO does, so that only those come back
+void packVertexAODevice( size_t num_vertices, const float2* vertex_accum, unsigned bits, void* packed, cudaStream_t stream = 0 );
+// Turns occlusion counts into AO, and bent normal sums from updateAODevice, if given, into unit vectors; a sample
+// without open directions gets its normal from sample_normals, in the DeviceSamples layout.  With sh_l1, AO and sums
+// become the L0 and L1 SH coefficients of visibility instead, averaged over the rays: ao gets Y00, bent_normals the
+// coefficients of y, z and x.
+void normalizeAODevice( size_t num_active, const int* active_samples, float* ao, int rays_per_sample, cudaStream_t stream = 0,
+                        float* bent_normals = NULL, const uint2* sample_normals = NULL, bool sh_l1 = false );
+// One pass of texture dilation: every uncovered texel (negative) of src with covered 8-neighbors gets their
+// average in dst, other texels are copied.
+void dilateTextureDevice( int width, int height, const float* src, float* dst, cudaStream_t stream = 0 );
+
+// Joint bilateral filter of sample AO over a spatial hash grid with cells radius across: every sample gets the weighted
+// average AO of the samples within radius of it, by a Gaussian of their distance and of the distance of each from the
+// other's tangent plane, times a power of the cosine between their normals (zero for opposite normals).  AO then does not
+// leak across creases, thin walls or stacked surfaces.  ao_out must not alias ao_in.  Allocates the grid, and waits for
+// the stream.
+void denoiseAODevice( const DeviceSamples& samples, float radius, const float* ao_in, float* ao_out, cudaStream_t stream = 0 );
+
+// Spatial hash grid of samples: order lists the samples by bucket, and bucket k holds order[cell_start[k], cell_end[k]),
+// with cell_start 0xffffffff for an empty bucket.  Cells of any number of hashed cubes can share a bucket.
+struct DeviceSampleGrid
+{
+  float     inv_cell;
+  unsigned  mask;
+  unsigned* order;
+  unsigned* cell_start;
+  unsigned* cell_end;
+  unsigned* scratch;  // the one allocation behind the arrays
+};
+
+// Builds the grid of samples with cubes cell_size across, as denoiseAODevice does.  Free with freeSampleGridDevice.
+void buildSampleGridDevice( const DeviceSamples& samples, float cell_size, DeviceSampleGrid& grid, cudaStream_t stream = 0 );
+void freeSampleGridDevice( DeviceSampleGrid& grid );
+
+// AO at other points, e.g. samples of a LOD, from the AO of samples in a grid with cells radius across: each point gets
+// the weighted average of the samples within radius, with the weights of denoiseAODevice, or the AO of the nearest 
+// sample in the neighboring cells that faces its way, or 1 without any.
+void transferAODevice( const DeviceSamples& samples, const DeviceSampleGrid& grid, float radius, const float* ao, 
+                       const DeviceSamples& targets, float* target_ao, cudaStream_t stream = 0 );
+
+// Mipmapped opacity volume of the occluders for far field AO, over a cube of resolution voxels along each axis at 
+// level 0.  Level l has resolution >> l voxels along each axis, 0 to 255 each, at level_offsets[l] of opacity.
+const int MAX_FAR_FIELD_LEVELS = 11;
+struct DeviceFarField
+{
+  float3          origin;       // min corner of the cube
+  float           voxel_size;   // at level 0
+  int             resolution;   // a power of two
+  int             num_levels;
+  unsigned char*  opacity;
+  size_t          level_offsets[MAX_FAR_FIELD_LEVELS];
+};
+
+// Marks the voxels of level 0 that the triangles of num_mesh_instances instances of one mesh pass through, listed by 
+// index into instances.  Level 0 must be cleared before the first mesh.
+void voxelizeFarFieldDevice( size_t num_triangles, size_t num_mesh_instances, const unsigned* mesh_instances, const DeviceInstance* instances, 
+                             const DeviceMesh* meshes, const DeviceFarField& volume, cudaStream_t stream = 0 );
+// Fills the levels above 0, each from the one below
+void buildFarFieldMipsDevice( const DeviceFarField& volume, cudaStream_t stream = 0 );
+// updateAODevice for shadow rays generated to near_distance: a ray that hits nothing there is occluded by the ground 
+// plane, if it crosses it before far_distance, or else by what a cone around it gathers from the volume between 
+// near_distance and far_distance, a fraction.  Cones are as wide as 1/rays_per_sample of the hemisphere.
+void updateAOFarFieldDevice( size_t num_active, const int* active_samples, int num_passes, const unsigned* hits, const unsigned* plane_hits, 
+                             const Ray* rays, const DeviceSamples& samples, const DeviceGroundPlane& ground_plane, const DeviceFarField& volume, 
+                             float near_distance, float far_distance, int rays_per_sample, float* ao, cudaStream_t stream = 0 );
 
-void generateRaysDevice(unsigned int seed, int px, int py, int sqrt_passes, float scene_offset, float scene_maxdistance, const bake::AOSamples& ao_samples, Ray* rays );
-void updateAODevice( int num_samples, const float* hits, float* ao );
-void normalizeAODevice( int num_samples, float* ao, int rays_per_sample );
+// Jacobi preconditioned conjugate gradients for A x = b, with A symmetric positive definite in CSR form.  All arrays
+// are on the device, and x holds the initial guess.  Iterates until |b - A x| <= tolerance*|b| or for max_iterations,
+// and returns the number of iterations, with the final relative residual in *residual if given.  Waits for the stream.
+int solveConjugateGradientDevice( int n, const int* row_offsets, const int* columns, const float* values, const float* b, float* x, 
+                                  int max_iterations, float tolerance, float* residual = NULL, cudaStream_t stream = 0 );
 
 }
@@ -0,0 +1,129 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#pragma once
+
+// AO ray sampling, shared by the ray generation of all backends so that they trace the same directions: 
+// the Prime kernel and the OptiX program on the device, and the Embree backend on the host.
+
+#include "bake_kernels.h"
+#include "random.h"
+#include <optixu/optixu_math_namespace.h>
+
+
+namespace bake
+{
+
+// Point index of the first two Sobol dimensions.  The generator matrix columns follow from the first one: 
+// dimension 0 is the van der Corput sequence, and each column of dimension 1 is the previous one xor itself 
+// shifted by one.
+__host__ __device__ __inline__ unsigned int sobol( const int dim, unsigned int index )
+{
+  unsigned int result = 0;
+  for ( unsigned int v = 0x80000000u; index != 0; index >>= 1, v = dim == 0 ? v >> 1 : v ^ ( v >> 1 ) ) {
+    if ( index & 1 ) result ^= v;
+  }
+  return result;
+}
+
+__host__ __device__ __inline__ unsigned int reverseBits( unsigned int x )
+{
+#if defined( __CUDA_ARCH__ )
+  return __brev( x );
+#else
+  x = ( ( x >> 1 ) & 0x55555555u ) | ( ( x & 0x55555555u ) << 1 );
+  x = ( ( x >> 2 ) & 0x33333333u ) | ( ( x & 0x33333333u ) << 2 );
+  x = ( ( x >> 4 ) & 0x0f0f0f0fu ) | ( ( x & 0x0f0f0f0fu ) << 4 );
+  x = ( ( x >> 8 ) & 0x00ff00ffu ) | ( ( x & 0x00ff00ffu ) << 8 );
+  return ( x >> 16 ) | ( x << 16 );
+#endif
+}
+
+// Owen scrambling via the Laine-Karras hash: permutes digits of x, each one depending only on the 
+// more significant ones, so the stratification of every prefix of the sequence is kept.
+__host__ __device__ __inline__ unsigned int owenScramble( unsigned int x, const unsigned int seed )
+{
+  x = reverseBits( x );
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverseBits( x );
+}
+
+// Per-sample scramble of the Sobol sequence, from the index of the sample in the whole bake.  Rays don't depend on
+// how samples are split into batches, devices or chunks, so every partition gives bit-identical AO.
+__host__ __device__ __inline__ unsigned int aoScrambleSeed( const unsigned long long sample_index )
+{
+  return tea<2>( unsigned( sample_index ), unsigned( sample_index >> 32 ) );
+}
+
+// Cosine weighted direction of pass k about the normal: point k of a 2D Sobol sequence, Owen scrambled per 
+// sample.  Any number of passes is well stratified, and so is every power of two prefix, which adaptive 
+// sampling relies on.  For a normal that is the geometric one, so no direction is below the surface.
+__host__ __device__ __inline__ float3 sampleAODirection( const int pass, const unsigned int scramble_seed, const float3& normal )
+{
+  optix::Onb onb( normal );
+
+  const float u0 = owenScramble( sobol( 0, (unsigned)pass ), scramble_seed ) * 2.3283064365386963e-10f;  // 2^-32
+  const float u1 = owenScramble( sobol( 1, (unsigned)pass ), scramble_seed * 0x9e3779b9u + 1u ) * 2.3283064365386963e-10f;
+
+  float3 ray_dir;
+  optix::cosine_sample_hemisphere( u0, u1, ray_dir );
+  onb.inverse_transform( ray_dir );
+  return ray_dir;
+}
+
+// Same about a shading normal.  Directions below the geometric surface are mirrored above it rather than 
+// resampled, so threads stay converged.
+__host__ __device__ __inline__ float3 sampleAODirection( const int pass, const unsigned int scramble_seed, const float3& normal, 
+                                                const float3& face_normal )
+{
+  float3 ray_dir = sampleAODirection( pass, scramble_seed, normal );
+
+  const float below = optix::dot( ray_dir, face_normal );
+  if ( below <= 0.0f ) {
+    ray_dir = optix::normalize( ray_dir - 2.0f*below*face_normal );
+  }
+  return ray_dir;
+}
+
+// Distance along the ray at which it crosses the ground plane, or -1 if it doesn't within [tmin, tmax]
+__host__ __device__ __inline__ float groundPlaneDistance( const DeviceGroundPlane& ground_plane, const float3& ray_origin, const float3& ray_dir,
+                                                 const float tmin, const float tmax )
+{
+  const int a = ground_plane.axis;
+  const float o = a == 0 ? ray_origin.x : a == 1 ? ray_origin.y : ray_origin.z;
+  const float d = a == 0 ? ray_dir.x : a == 1 ? ray_dir.y : ray_dir.z;
+  const float h = a == 0 ? ground_plane.bbox_min.x : a == 1 ? ground_plane.bbox_min.y : ground_plane.bbox_min.z;
+  const float t = ( h - o ) / d;
+  if ( !( t >= tmin && t <= tmax ) ) return -1.0f;
+  const float3 p = ray_origin + t * ray_dir;
+  const bool inside = ( a == 0 || ( p.x >= ground_plane.bbox_min.x && p.x <= ground_plane.bbox_max.x ) ) &&
+                      ( a == 1 || ( p.y >= ground_plane.bbox_min.y && p.y <= ground_plane.bbox_max.y ) ) &&
+                      ( a == 2 || ( p.z >= ground_plane.bbox_min.z && p.z <= ground_plane.bbox_max.z ) );
+  return inside ? t : -1.0f;
+}
+
+} // namespace bake
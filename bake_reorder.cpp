@@ -0,0 +1,193 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+// Triangle order for the post-transform vertex cache, from the linear speed vertex cache optimization of
+// T. Forsyth, 2006 (https://tomforsyth1000.github.io/papers/fast_vert_cache_opt.html), then vertices in the
+// order the triangles first use them.
+
+#include "bake_reorder.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+
+namespace {
+
+const int   CACHE_SIZE          = 32;
+const float CACHE_DECAY_POWER   = 1.5f;
+const float LAST_TRIANGLE_SCORE = 0.75f;
+const float VALENCE_BOOST_SCALE = 2.0f;
+const float VALENCE_BOOST_POWER = 0.5f;
+
+float vertex_score( const int cache_position, const unsigned remaining_valence )
+{
+  if (remaining_valence == 0) return -1.0f;  // no triangles left to use it
+
+  float score = 0.0f;
+  if (cache_position >= 0) {
+    // The three vertices of the last triangle score the same, whichever order they went in
+    if (cache_position < 3) {
+      score = LAST_TRIANGLE_SCORE;
+    } else {
+      score = std::pow( 1.0f - float(cache_position - 3) / float(CACHE_SIZE - 3), CACHE_DECAY_POWER );
+    }
+  }
+  // Vertices with few triangles left are worth finishing, so they don't come back later
+  return score + VALENCE_BOOST_SCALE * std::pow( float(remaining_valence), -VALENCE_BOOST_POWER );
+}
+
+// Triangles in cache friendly order, as indices into the triangles of the mesh
+void forsyth_order( const unsigned* indices, const size_t num_triangles, const size_t num_vertices, std::vector<unsigned>& order )
+{
+  // Triangles of each vertex; the first valence[v] are the ones not emitted yet
+  std::vector<unsigned> offsets( num_vertices + 1, 0 );
+  for (size_t i = 0; i < 3*num_triangles; ++i) ++offsets[indices[i] + 1];
+  for (size_t v = 0; v < num_vertices; ++v) offsets[v + 1] += offsets[v];
+  std::vector<unsigned> vertex_triangles( offsets[num_vertices] );
+  std::vector<unsigned> valence( num_vertices, 0 );
+  for (size_t t = 0; t < num_triangles; ++t) {
+    for (int k = 0; k < 3; ++k) {
+      const unsigned v = indices[3*t + k];
+      vertex_triangles[offsets[v] + valence[v]++] = unsigned( t );
+    }
+  }
+
+  std::vector<int> cache_position( num_vertices, -1 );
+  std::vector<float> score( num_vertices );
+  for (size_t v = 0; v < num_vertices; ++v) score[v] = vertex_score( -1, valence[v] );
+  std::vector<float> triangle_score( num_triangles );
+  for (size_t t = 0; t < num_triangles; ++t) {
+    triangle_score[t] = score[indices[3*t]] + score[indices[3*t + 1]] + score[indices[3*t + 2]];
+  }
+  std::vector<bool> emitted( num_triangles, false );
+
+  order.clear();
+  order.reserve( num_triangles );
+  std::vector<unsigned> cache, next_cache;
+  cache.reserve( CACHE_SIZE + 3 );
+  next_cache.reserve( CACHE_SIZE + 3 );
+  size_t cursor = 0;  // triangles before it are all emitted
+  ptrdiff_t best = -1;
+
+  while (order.size() < num_triangles) {
+    // With no triangle in the cache left, start again from the first one not emitted
+    if (best < 0) {
+      while (emitted[cursor]) ++cursor;
+      best = ptrdiff_t( cursor );
+    }
+    const unsigned* tri = indices + 3*best;
+    order.push_back( unsigned( best ) );
+    emitted[best] = true;
+
+    // Its vertices go to the front of the cache, and the triangle out of their lists
+    next_cache.clear();
+    for (int k = 0; k < 3; ++k) {
+      const unsigned v = tri[k];
+      unsigned* first = &vertex_triangles[offsets[v]];
+      unsigned* last = first + valence[v];
+      unsigned* it = std::find( first, last, unsigned( best ) );
+      if (it != last) {
+        std::swap( *it, *(last - 1) );
+        --valence[v];
+      }
+      if (std::find( next_cache.begin(), next_cache.end(), v ) == next_cache.end()) next_cache.push_back( v );
+    }
+    for (size_t k = 0; k < cache.size(); ++k) {
+      if (std::find( next_cache.begin(), next_cache.end(), cache[k] ) == next_cache.end()) next_cache.push_back( cache[k] );
+    }
+
+    // Rescore the vertices in the cache, and those that fell out of it, then their triangles
+    for (size_t k = 0; k < next_cache.size(); ++k) {
+      const unsigned v = next_cache[k];
+      cache_position[v] = k < size_t(CACHE_SIZE) ? int(k) : -1;
+      score[v] = vertex_score( cache_position[v], valence[v] );
+    }
+    best = -1;
+    float best_score = -1.0f;
+    for (size_t k = 0; k < next_cache.size(); ++k) {
+      const unsigned v = next_cache[k];
+      for (unsigned j = offsets[v]; j < offsets[v] + valence[v]; ++j) {
+        const unsigned t = vertex_triangles[j];
+        triangle_score[t] = score[indices[3*t]] + score[indices[3*t + 1]] + score[indices[3*t + 2]];
+        if (triangle_score[t] > best_score) {
+          best_score = triangle_score[t];
+          best = ptrdiff_t( t );
+        }
+      }
+    }
+    next_cache.resize( std::min( next_cache.size(), size_t(CACHE_SIZE) ) );
+    cache.swap( next_cache );
+  }
+}
+
+}  // namespace
+
+
+void bake::reorder_mesh( const Mesh& mesh, ReorderedMesh& reordered )
+{
+  const size_t nv = mesh.num_vertices;
+  const size_t nt = mesh.num_triangles;
+  std::vector<unsigned> triangle_order;
+  forsyth_order( mesh.tri_vertex_indices, nt, nv, triangle_order );
+
+  // Vertices numbered as the triangles first fetch them; any unused ones go last, in their order
+  const unsigned unused = ~0u;
+  std::vector<unsigned> new_index( nv, unused );
+  reordered.vertex_order.clear();
+  reordered.vertex_order.reserve( nv );
+  reordered.indices.resize( 3*nt );
+  for (size_t t = 0; t < nt; ++t) {
+    for (int k = 0; k < 3; ++k) {
+      const unsigned v = mesh.tri_vertex_indices[3*triangle_order[t] + k];
+      if (new_index[v] == unused) {
+        new_index[v] = unsigned( reordered.vertex_order.size() );
+        reordered.vertex_order.push_back( v );
+      }
+      reordered.indices[3*t + k] = new_index[v];
+    }
+  }
+  for (size_t v = 0; v < nv; ++v) {
+    if (new_index[v] == unused) reordered.vertex_order.push_back( unsigned( v ) );
+  }
+
+  const unsigned vertex_stride = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+  const unsigned normal_stride = mesh.normal_stride_bytes > 0 ? mesh.normal_stride_bytes : 3*sizeof(float);
+  const unsigned texcoord_stride = mesh.texcoord_stride_bytes > 0 ? mesh.texcoord_stride_bytes : 2*sizeof(float);
+  reordered.vertices.resize( 3*nv );
+  reordered.normals.resize( mesh.normals ? 3*nv : 0 );
+  reordered.texcoords.resize( mesh.texcoords ? 2*nv : 0 );
+  for (size_t k = 0; k < nv; ++k) {
+    const size_t v = reordered.vertex_order[k];
+    const float* p = reinterpret_cast<const float*>( reinterpret_cast<const unsigned char*>( mesh.vertices ) + v*vertex_stride );
+    std::copy( p, p + 3, &reordered.vertices[3*k] );
+    if (mesh.normals) {
+      const float* n = reinterpret_cast<const float*>( reinterpret_cast<const unsigned char*>( mesh.normals ) + v*normal_stride );
+      std::copy( n, n + 3, &reordered.normals[3*k] );
+    }
+    if (mesh.texcoords) {
+      const float* uv = reinterpret_cast<const float*>( reinterpret_cast<const unsigned char*>( mesh.texcoords ) + v*texcoord_stride );
+      std::copy( uv, uv + 2, &reordered.texcoords[2*k] );
+    }
+  }
+}
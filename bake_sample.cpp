@@ -24,15 +24,25 @@
 #include "bake_api.h"
 #include "bake_sample.h"
 #include "bake_sample_internal.h"  // templates
+#include "bake_util.h"
 #include <optixu/optixu_math_namespace.h>
 #include <optixu/optixu_matrix_namespace.h>
 #include "random.h"
 
 #include <algorithm>
 #include <cassert>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <map>
 #include <vector>
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define SAMPLE_USE_SSE
+#include <xmmintrin.h>
+#endif
+
 using namespace optix;
 
 // Ref: https://en.wikipedia.org/wiki/Halton_sequence
@@ -51,6 +61,24 @@ float halton(const unsigned int index)
   return result;
 }
 
+// Halton points of the first samples of each triangle, which are all of them for most triangles.  Built before main.
+const unsigned HALTON_TABLE_SIZE = 4096;
+
+struct HaltonTables
+{
+  float base2[HALTON_TABLE_SIZE];  // halton<2>(index+1)
+  float base3[HALTON_TABLE_SIZE];  // halton<3>(index+1)
+  HaltonTables()
+  {
+    for (unsigned i = 0; i < HALTON_TABLE_SIZE; ++i) {
+      base2[i] = halton<2>(i+1);
+      base3[i] = halton<3>(i+1);
+    }
+  }
+};
+
+const HaltonTables halton_tables;
+
 float3 faceforward( const float3& normal, const float3& geom_normal )
 {
   if ( optix::dot( normal, geom_normal ) > 0.0f ) return normal;
@@ -63,11 +91,39 @@ float3 operator*(const optix::Matrix4x4& mat, const float3& v)
 }
 
 
+#ifdef SAMPLE_USE_SSE
+// a*x + b*y + c*z, 4 lanes at a time
+inline __m128 madd3(const __m128 a, const __m128 x, const __m128 b, const __m128 y, const __m128 c, const __m128 z)
+{
+  return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, x), _mm_mul_ps(b, y)), _mm_mul_ps(c, z));
+}
+
+// Row 'row' of xform times (x, y, z, 1), as in operator* above
+inline __m128 xform_row(const float* m, const int row, const __m128 x, const __m128 y, const __m128 z)
+{
+  return _mm_add_ps(madd3(_mm_set1_ps(m[4*row]), x, _mm_set1_ps(m[4*row+1]), y, _mm_set1_ps(m[4*row+2]), z), _mm_set1_ps(m[4*row+3]));
+}
+
+// Interpolates three float3 by barycentrics and transforms the result, into lanes x, y, z
+inline void interpolate_xform(const float* m, const float3& a, const float3& b, const float3& c, const __m128 bx, const __m128 by, 
+                              const __m128 bz, __m128& x, __m128& y, __m128& z)
+{
+  const __m128 px = madd3(bx, _mm_set1_ps(a.x), by, _mm_set1_ps(b.x), bz, _mm_set1_ps(c.x));
+  const __m128 py = madd3(bx, _mm_set1_ps(a.y), by, _mm_set1_ps(b.y), bz, _mm_set1_ps(c.y));
+  const __m128 pz = madd3(bx, _mm_set1_ps(a.z), by, _mm_set1_ps(b.z), bz, _mm_set1_ps(c.z));
+  x = xform_row(m, 0, px, py, pz);
+  y = xform_row(m, 1, px, py, pz);
+  z = xform_row(m, 2, px, py, pz);
+}
+#endif
+
+
 void sample_triangle(const optix::Matrix4x4& xform, const optix::Matrix4x4& xform_invtrans,
                      const float3** verts, const float3** normals,
                      const size_t tri_idx, const size_t tri_sample_count, const double tri_area,
                      const unsigned base_seed,
-                     float3* sample_positions, float3* sample_norms, float3* sample_face_norms, bake::SampleInfo* sample_infos)
+                     float3* sample_positions, float3* sample_norms, float3* sample_face_norms, bake::SampleInfo* sample_infos,
+                     bake::CompactSampleInfo* compact_sample_infos)
 {
   const float3& v0 = *verts[0];
   const float3& v1 = *verts[1];
@@ -86,33 +142,105 @@ void sample_triangle(const optix::Matrix4x4& xform, const optix::Matrix4x4& xfor
     n2 = face_normal;
   }
 
+  // Same for all samples of the triangle
+  const float3 face_normal_world = sample_positions ? optix::normalize(xform_invtrans*face_normal) : face_normal;
+  const float dA = static_cast<float>(tri_area / tri_sample_count);
+
   // Random offset per triangle, to shift Halton points
   unsigned seed = tea<4>( base_seed, (unsigned)tri_idx );
   const float2 offset = make_float2( rnd(seed), rnd(seed) );
 
-  for ( size_t index = 0; index < tri_sample_count; ++index )
+  size_t index = 0;
+
+#ifdef SAMPLE_USE_SSE
+  // Four samples at a time from the tables, with the same arithmetic as the scalar loop below
+  const size_t vector_end = std::min( tri_sample_count, size_t(HALTON_TABLE_SIZE) ) & ~size_t(3);
+  const __m128 one = _mm_set1_ps(1.0f);
+  for ( ; index < vector_end; index += 4 )
   {
-    sample_infos[index].tri_idx = (unsigned)tri_idx;
-    sample_infos[index].dA = static_cast<float>(tri_area / tri_sample_count);
+    __m128 r1 = _mm_add_ps(_mm_set1_ps(offset.x), _mm_loadu_ps(halton_tables.base2 + index));
+    r1 = _mm_sub_ps(r1, _mm_and_ps(_mm_cmpge_ps(r1, one), one));
+    __m128 r2 = _mm_add_ps(_mm_set1_ps(offset.y), _mm_loadu_ps(halton_tables.base3 + index));
+    r2 = _mm_sub_ps(r2, _mm_and_ps(_mm_cmpge_ps(r2, one), one));
+
+    const __m128 sqrt_r1 = _mm_sqrt_ps(r1);
+    const __m128 bx = _mm_sub_ps(one, sqrt_r1);
+    const __m128 by = _mm_mul_ps(r2, sqrt_r1);
+    const __m128 bz = _mm_sub_ps(_mm_sub_ps(one, bx), by);
 
+    float bary[3][4];
+    _mm_storeu_ps(bary[0], bx);
+    _mm_storeu_ps(bary[1], by);
+    _mm_storeu_ps(bary[2], bz);
+    for (int k = 0; k < 4; ++k) {
+      if (sample_infos) {
+        sample_infos[index+k].tri_idx = (unsigned)tri_idx;
+        sample_infos[index+k].dA = dA;
+        sample_infos[index+k].bary[0] = bary[0][k];
+        sample_infos[index+k].bary[1] = bary[1][k];
+        sample_infos[index+k].bary[2] = bary[2][k];
+      } else {
+        compact_sample_infos[index+k].tri_idx = (unsigned)tri_idx;
+        compact_sample_infos[index+k].bary[0] = bake::encode_bary(bary[0][k]);
+        compact_sample_infos[index+k].bary[1] = bake::encode_bary(bary[1][k]);
+      }
+    }
+
+    if (sample_positions) {
+      float lanes[6][4];
+      __m128 x, y, z;
+      interpolate_xform(xform.getData(), v0, v1, v2, bx, by, bz, x, y, z);
+      _mm_storeu_ps(lanes[0], x);
+      _mm_storeu_ps(lanes[1], y);
+      _mm_storeu_ps(lanes[2], z);
+      interpolate_xform(xform_invtrans.getData(), n0, n1, n2, bx, by, bz, x, y, z);
+      const __m128 inv_len = _mm_div_ps(one, _mm_sqrt_ps(madd3(x, x, y, y, z, z)));
+      _mm_storeu_ps(lanes[3], _mm_mul_ps(x, inv_len));
+      _mm_storeu_ps(lanes[4], _mm_mul_ps(y, inv_len));
+      _mm_storeu_ps(lanes[5], _mm_mul_ps(z, inv_len));
+      for (int k = 0; k < 4; ++k) {
+        sample_positions[index+k] = make_float3(lanes[0][k], lanes[1][k], lanes[2][k]);
+        sample_norms[index+k] = make_float3(lanes[3][k], lanes[4][k], lanes[5][k]);
+        sample_face_norms[index+k] = face_normal_world;
+      }
+    }
+  }
+#endif
+
+  for ( ; index < tri_sample_count; ++index )
+  {
     // Random point in unit square
-    float r1 = offset.x + halton<2>((unsigned)index+1);
+    const bool tabulated = index < HALTON_TABLE_SIZE;
+    float r1 = offset.x + (tabulated ? halton_tables.base2[index] : halton<2>((unsigned)index+1));
     r1 = r1 - (int)r1;
-    float r2 = offset.y + halton<3>((unsigned)index+1);
+    float r2 = offset.y + (tabulated ? halton_tables.base3[index] : halton<3>((unsigned)index+1));
     r2 = r2 - (int)r2;
     assert(r1 >= 0 && r1 <= 1);
     assert(r2 >= 0 && r2 <= 1);
 
     // Map to triangle. Ref: PBRT 2nd edition, section 13.6.4
-    float3& bary = *reinterpret_cast<float3*>(sample_infos[index].bary);
+    float3 bary;
     const float sqrt_r1 = sqrt(r1);
     bary.x = 1.0f - sqrt_r1;
     bary.y = r2*sqrt_r1;
     bary.z = 1.0f - bary.x - bary.y;
 
-    sample_positions[index] = xform*(bary.x*v0 + bary.y*v1 + bary.z*v2);
-    sample_norms[index] = optix::normalize(xform_invtrans*( bary.x*n0 + bary.y*n1 + bary.z*n2 ));
-    sample_face_norms[index] = optix::normalize(xform_invtrans*face_normal);
+    if (sample_infos) {
+      sample_infos[index].tri_idx = (unsigned)tri_idx;
+      sample_infos[index].dA = dA;
+      *reinterpret_cast<float3*>(sample_infos[index].bary) = bary;
+    } else {
+      compact_sample_infos[index].tri_idx = (unsigned)tri_idx;
+      compact_sample_infos[index].bary[0] = bake::encode_bary(bary.x);
+      compact_sample_infos[index].bary[1] = bake::encode_bary(bary.y);
+    }
+
+    // Positions and normals are optional, when samples get placed on the device instead
+    if (sample_positions) {
+      sample_positions[index] = xform*(bary.x*v0 + bary.y*v1 + bary.z*v2);
+      sample_norms[index] = optix::normalize(xform_invtrans*( bary.x*n0 + bary.y*n1 + bary.z*n2 ));
+      sample_face_norms[index] = face_normal_world;
+    }
 
   }
 }
@@ -128,25 +256,84 @@ double triangle_area(const float3& v0, const float3& v1, const float3& v2)
 }
 
 
+// If xform is a similarity, returns true and the factor from mesh space to world space triangle area: 
+// |det|^(2/3) of the upper 3x3.
+bool similarity_area_scale(const optix::Matrix4x4& xform, double& scale)
+{
+  const float3 c[] = {make_float3(xform[0], xform[4], xform[8]),
+                      make_float3(xform[1], xform[5], xform[9]),
+                      make_float3(xform[2], xform[6], xform[10])};
+  const double len2[] = {dot(c[0], c[0]), dot(c[1], c[1]), dot(c[2], c[2])};
+  const double tol = 1e-5 * std::max(len2[0], std::max(len2[1], len2[2]));
+  if (std::abs(len2[0] - len2[1]) > tol || std::abs(len2[0] - len2[2]) > tol ||
+      std::abs(dot(c[0], c[1])) > tol || std::abs(dot(c[1], c[2])) > tol || std::abs(dot(c[0], c[2])) > tol) {
+    return false;
+  }
+  const double det = dot(c[0], cross(c[1], c[2]));
+  scale = std::pow(std::abs(det), 2.0/3.0);
+  return true;
+}
+
+
+// Minimum samples of triangle tri_idx for a minimum per triangle that may be fractional.  The fraction is spread over
+// consecutive triangles, so that any run of n triangles gets n*min_samples of them, rounded; a whole minimum is the same
+// for every triangle.
+unsigned int triangle_min_samples(const double min_samples, const size_t tri_idx)
+{
+  return (unsigned int)(std::floor(min_samples*double(tri_idx+1) + 0.5) - std::floor(min_samples*double(tri_idx) + 0.5));
+}
+
+// Sum of triangle_min_samples over the triangles of a mesh
+size_t mesh_min_samples(const double min_samples, const size_t num_triangles)
+{
+  return size_t(std::floor(min_samples*double(num_triangles) + 0.5));
+}
+
+
 class TriangleSamplerCallback
 {
 public:
-  TriangleSamplerCallback(const unsigned int minSamplesPerTriangle,
+  TriangleSamplerCallback(const double minSamplesPerTriangle,
                   const double* areaPerTriangle)
   : m_minSamplesPerTriangle(minSamplesPerTriangle), 
     m_areaPerTriangle(areaPerTriangle)
     {}
           
   unsigned int minSamples(size_t i) const {
-    return m_minSamplesPerTriangle;  // same for every triangle
+    return triangle_min_samples(m_minSamplesPerTriangle, i);
   }
   double area(size_t i) const {
     return m_areaPerTriangle[i];
   }
 
 private:
-  const unsigned int m_minSamplesPerTriangle;
+  const double m_minSamplesPerTriangle;
+  const double* m_areaPerTriangle;
+};
+
+
+// Places extra samples by area times a weight per triangle, e.g. the AO variance of a pilot trace
+class WeightedTriangleSamplerCallback
+{
+public:
+  WeightedTriangleSamplerCallback(const double minSamplesPerTriangle,
+                  const double* areaPerTriangle, const float* weightPerTriangle)
+  : m_minSamplesPerTriangle(minSamplesPerTriangle), 
+    m_areaPerTriangle(areaPerTriangle),
+    m_weightPerTriangle(weightPerTriangle)
+    {}
+          
+  unsigned int minSamples(size_t i) const {
+    return triangle_min_samples(m_minSamplesPerTriangle, i);
+  }
+  double area(size_t i) const {
+    return m_areaPerTriangle[i] * m_weightPerTriangle[i];
+  }
+
+private:
+  const double m_minSamplesPerTriangle;
   const double* m_areaPerTriangle;
+  const float* m_weightPerTriangle;
 };
 
 
@@ -155,52 +342,124 @@ const float3* get_vertex(const float* v, unsigned stride_bytes, int index)
   return reinterpret_cast<const float3*>(reinterpret_cast<const unsigned char*>(v) + index*stride_bytes);
 }
 
-void sample_instance(
+// Area of triangles [tri_begin, tri_end) of mesh after xform, in parallel over triangles
+void compute_tri_areas(const bake::Mesh& mesh, const optix::Matrix4x4& xform, const size_t tri_begin, const size_t tri_end, double* tri_areas)
+{
+  const int3* tri_vertex_indices  = reinterpret_cast<int3*>( mesh.tri_vertex_indices );
+  const unsigned vertex_stride_bytes = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+#pragma omp parallel for
+  for ( ptrdiff_t tri_idx = ptrdiff_t(tri_begin); tri_idx < ptrdiff_t(tri_end); tri_idx++ ) {
+    const int3& tri = tri_vertex_indices[tri_idx];
+    const float3* verts[] = {get_vertex(mesh.vertices, vertex_stride_bytes, tri.x),
+                             get_vertex(mesh.vertices, vertex_stride_bytes, tri.y),
+                             get_vertex(mesh.vertices, vertex_stride_bytes, tri.z)};
+    tri_areas[tri_idx] = triangle_area(xform*verts[0][0], xform*verts[1][0], xform*verts[2][0]);
+  }
+}
+
+// Areas and sample counts of the triangles of an instance, and the first sample of each, so that ranges of its
+// triangles can be placed independently
+struct InstanceSamplePlan
+{
+  std::vector<double> tri_areas;
+  std::vector<size_t> tri_sample_counts;
+  std::vector<size_t> tri_sample_offsets;
+};
+
+void plan_instance_samples(
+    const bake::Mesh& mesh,
+    const optix::Matrix4x4& xform,
+    const size_t num_samples,
+    const float min_samples_per_triangle,
+    const double* cached_tri_areas,  // optional, scaled by area_scale
+    const double area_scale,
+    const float* tri_weights,        // optional sample density weights
+    InstanceSamplePlan& plan
+    )
+{
+  assert( num_samples >= mesh_min_samples(min_samples_per_triangle, mesh.num_triangles) );
+
+  // Triangle areas, from the sampling plan if there is one
+  std::vector<double>& tri_areas = plan.tri_areas;
+  tri_areas.assign(mesh.num_triangles, 0.0);
+  if (cached_tri_areas) {
+#pragma omp parallel for
+    for ( ptrdiff_t tri_idx = 0; tri_idx < ptrdiff_t(mesh.num_triangles); tri_idx++ ) {
+      tri_areas[tri_idx] = cached_tri_areas[tri_idx] * area_scale;
+    }
+  } else if (mesh.num_triangles > 0) {
+    compute_tri_areas(mesh, xform, 0, mesh.num_triangles, &tri_areas[0]);
+  }
+
+  // Get sample counts
+  std::vector<size_t>& tri_sample_counts = plan.tri_sample_counts;
+  tri_sample_counts.assign(mesh.num_triangles, 0);
+  if (tri_weights) {
+    WeightedTriangleSamplerCallback cb(min_samples_per_triangle, &tri_areas[0], tri_weights);
+    distribute_samples_generic(cb, num_samples, mesh.num_triangles, &tri_sample_counts[0]);
+  } else {
+    TriangleSamplerCallback cb(min_samples_per_triangle, &tri_areas[0]);
+    distribute_samples_generic(cb, num_samples, mesh.num_triangles, &tri_sample_counts[0]);
+  }
+
+  // First sample of each triangle
+  std::vector<size_t>& tri_sample_offsets = plan.tri_sample_offsets;
+  tri_sample_offsets.resize(mesh.num_triangles+1);
+  tri_sample_offsets[0] = 0;
+  for (size_t tri_idx = 0; tri_idx < mesh.num_triangles; tri_idx++) {
+    tri_sample_offsets[tri_idx+1] = tri_sample_offsets[tri_idx] + tri_sample_counts[tri_idx];
+  }
+  assert( tri_sample_offsets[mesh.num_triangles] == num_samples );
+}
+
+// Places the samples of triangles [tri_begin, tri_end) of a planned instance.  The sample arrays of ao_samples start at
+// sample sample_base of the instance; the per triangle arrays at its first triangle.
+void place_instance_samples(
     const bake::Mesh& mesh,
     const optix::Matrix4x4& xform,
+    const optix::Matrix4x4& xform_invtrans,
     const unsigned int seed,
-    const size_t min_samples_per_triangle,
+    const InstanceSamplePlan& plan,
+    const size_t tri_begin,
+    const size_t tri_end,
+    const size_t sample_base,
     bake::AOSamples&  ao_samples
     )
 {
 
   // Setup access to mesh data
-  const optix::Matrix4x4 xform_invtrans = xform.inverse().transpose();
-  assert( ao_samples.num_samples >= mesh.num_triangles*min_samples_per_triangle );
   assert( mesh.vertices               );
   assert( mesh.num_vertices           );
-  assert( ao_samples.sample_positions );
-  assert( ao_samples.sample_normals   );
-  assert( ao_samples.sample_infos     );
+  assert( ao_samples.sample_positions || ao_samples.tri_sample_counts );
+  assert( !ao_samples.sample_positions || ao_samples.sample_normals );
+  assert( ao_samples.sample_infos || (ao_samples.compact_sample_infos && ao_samples.tri_sample_dA) );
 
   const int3*   tri_vertex_indices  = reinterpret_cast<int3*>( mesh.tri_vertex_indices );
   float3* sample_positions  = reinterpret_cast<float3*>( ao_samples.sample_positions );   
   float3* sample_norms      = reinterpret_cast<float3*>( ao_samples.sample_normals   );   
   float3* sample_face_norms = reinterpret_cast<float3*>( ao_samples.sample_face_normals );
   bake::SampleInfo* sample_infos = ao_samples.sample_infos;
+  bake::CompactSampleInfo* compact_sample_infos = ao_samples.compact_sample_infos;
 
   const unsigned vertex_stride_bytes = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
   const unsigned normal_stride_bytes = mesh.normal_stride_bytes > 0 ? mesh.normal_stride_bytes : 3*sizeof(float);
 
-  // Compute triangle areas
-  std::vector<double> tri_areas(mesh.num_triangles, 0.0);
-  for ( size_t tri_idx = 0; tri_idx < mesh.num_triangles; tri_idx++ ) {
-    const int3& tri = tri_vertex_indices[tri_idx];
-    const float3* verts[] = {get_vertex(mesh.vertices, vertex_stride_bytes, tri.x),
-                             get_vertex(mesh.vertices, vertex_stride_bytes, tri.y),
-                             get_vertex(mesh.vertices, vertex_stride_bytes, tri.z)};
-    const double area = triangle_area(xform*verts[0][0], xform*verts[1][0], xform*verts[2][0]);
-    tri_areas[tri_idx] = area;
-  }
-
-  // Get sample counts
-  std::vector<size_t> tri_sample_counts(mesh.num_triangles, 0);
-  TriangleSamplerCallback cb((unsigned)min_samples_per_triangle, &tri_areas[0]);
-  distribute_samples_generic(cb, ao_samples.num_samples, mesh.num_triangles, &tri_sample_counts[0]);
+  const std::vector<double>& tri_areas = plan.tri_areas;
+  const std::vector<size_t>& tri_sample_counts = plan.tri_sample_counts;
+  const std::vector<size_t>& tri_sample_offsets = plan.tri_sample_offsets;
 
   // Place samples
-  size_t sample_idx = 0;
-  for (size_t tri_idx = 0; tri_idx < mesh.num_triangles; tri_idx++) {
+#pragma omp parallel for
+  for (ptrdiff_t tri_idx = ptrdiff_t(tri_begin); tri_idx < ptrdiff_t(tri_end); tri_idx++) {
+    if (ao_samples.tri_sample_counts) {
+      ao_samples.tri_sample_counts[tri_idx] = (unsigned)tri_sample_counts[tri_idx];
+    }
+    if (!sample_infos) {
+      // Compact layout keeps dA per triangle
+      ao_samples.tri_sample_dA[tri_idx] = tri_sample_counts[tri_idx] > 0 ? static_cast<float>(tri_areas[tri_idx] / tri_sample_counts[tri_idx]) : 0.0f;
+    }
+
+    const size_t sample_idx = tri_sample_offsets[tri_idx] - sample_base;
     const int3& tri = tri_vertex_indices[tri_idx];
     const float3* verts[] = {get_vertex(mesh.vertices, vertex_stride_bytes, tri.x),
                              get_vertex(mesh.vertices, vertex_stride_bytes, tri.y),
@@ -216,15 +475,32 @@ void sample_instance(
     sample_triangle(xform, xform_invtrans, verts, normals, 
       tri_idx, tri_sample_counts[tri_idx], tri_areas[tri_idx],
       seed,
-      sample_positions+sample_idx, sample_norms+sample_idx, sample_face_norms+sample_idx, sample_infos+sample_idx);
-    sample_idx += tri_sample_counts[tri_idx];
+      sample_positions ? sample_positions+sample_idx : NULL, 
+      sample_norms ? sample_norms+sample_idx : NULL, 
+      sample_face_norms ? sample_face_norms+sample_idx : NULL, 
+      sample_infos ? sample_infos+sample_idx : NULL,
+      compact_sample_infos ? compact_sample_infos+sample_idx : NULL);
   }
+}
 
-  assert( sample_idx == ao_samples.num_samples );
+void sample_instance(
+    const bake::Mesh& mesh,
+    const optix::Matrix4x4& xform,
+    const unsigned int seed,
+    const float min_samples_per_triangle,
+    const double* cached_tri_areas,  // optional, scaled by area_scale
+    const double area_scale,
+    const float* tri_weights,        // optional sample density weights
+    bake::AOSamples&  ao_samples
+    )
+{
+  InstanceSamplePlan plan;
+  plan_instance_samples(mesh, xform, ao_samples.num_samples, min_samples_per_triangle, cached_tri_areas, area_scale, tri_weights, plan);
+  place_instance_samples(mesh, xform, xform.inverse().transpose(), seed, plan, 0, mesh.num_triangles, 0, ao_samples);
 
 #ifdef DEBUG_MESH_SAMPLES
   for (size_t i = 0; i < ao_samples.num_samples; ++i ) {
-    const SampleInfo& info = sample_infos[i];
+    const bake::SampleInfo info = bake::get_sample_info(ao_samples, i);
     std::cerr << "sample info (" << i << "): " << info.tri_idx << ", (" << info.bary[0] << ", " << info.bary[1] << ", " << info.bary[2] << "), " << info.dA << std::endl;
   }
 #endif
@@ -232,37 +508,603 @@ void sample_instance(
 }
 
 
+// Mesh space samples of a mesh, shared by its similarity instances with the same sample count
+struct SampleTemplate
+{
+  std::vector<float3>                  positions;
+  std::vector<float3>                  normals;
+  std::vector<float3>                  face_normals;
+  std::vector<bake::SampleInfo>        infos;
+  std::vector<bake::CompactSampleInfo> compact_infos;
+  std::vector<unsigned>                tri_sample_counts;
+  std::vector<float>                   tri_sample_dA;
+};
+
+// Samples a mesh in mesh space, into arrays laid out like those of ao_samples.  Seeded by the mesh index, so the
+// pattern is the same for all instances that share it.
+void make_sample_template(
+    const bake::Mesh& mesh,
+    const unsigned mesh_index,
+    const size_t num_samples,
+    const float min_samples_per_triangle,
+    const double* cached_tri_areas,  // optional, mesh space
+    const bake::AOSamples& layout,
+    SampleTemplate& t
+    )
+{
+  t.positions.resize(num_samples);
+  t.normals.resize(num_samples);
+  t.face_normals.resize(num_samples);
+  bake::AOSamples samples;
+  std::memset(&samples, 0, sizeof(samples));
+  samples.num_samples = num_samples;
+  samples.sample_positions = num_samples ? &t.positions[0].x : NULL;
+  samples.sample_normals = num_samples ? &t.normals[0].x : NULL;
+  samples.sample_face_normals = num_samples ? &t.face_normals[0].x : NULL;
+  if (layout.sample_infos) {
+    t.infos.resize(num_samples);
+    samples.sample_infos = num_samples ? &t.infos[0] : NULL;
+  } else {
+    t.compact_infos.resize(num_samples);
+    t.tri_sample_dA.resize(mesh.num_triangles);
+    samples.compact_sample_infos = num_samples ? &t.compact_infos[0] : NULL;
+    samples.tri_sample_dA = mesh.num_triangles ? &t.tri_sample_dA[0] : NULL;
+  }
+  if (layout.tri_sample_counts) {
+    t.tri_sample_counts.resize(mesh.num_triangles);
+    samples.tri_sample_counts = mesh.num_triangles ? &t.tri_sample_counts[0] : NULL;
+  }
+  sample_instance(mesh, optix::Matrix4x4::identity(), mesh_index, min_samples_per_triangle, cached_tri_areas, 1.0, NULL, samples);
+}
+
+// Samples [sample_begin, sample_end) of a similarity instance from the template of its mesh: positions through the
+// xform, normals through its upper 3x3, which for a similarity has the direction of the inverse transpose, and areas
+// scaled by area_scale.  The range that starts at 0 also fills in the per triangle arrays.
+void instance_sample_template(
+    const SampleTemplate& t,
+    const optix::Matrix4x4& xform,
+    const double area_scale,
+    const size_t sample_begin,
+    const size_t sample_end,
+    bake::AOSamples& ao_samples
+    )
+{
+  const float* m = xform.getData();
+  float3* positions = reinterpret_cast<float3*>( ao_samples.sample_positions );
+  float3* normals = reinterpret_cast<float3*>( ao_samples.sample_normals );
+  float3* face_normals = reinterpret_cast<float3*>( ao_samples.sample_face_normals );
+  const float scale = static_cast<float>( area_scale );
+#pragma omp parallel for if(sample_end - sample_begin >= (1 << 16))
+  for (ptrdiff_t i = ptrdiff_t(sample_begin); i < ptrdiff_t(sample_end); ++i) {
+    const float3 p = t.positions[i];
+    const float3 n = t.normals[i];
+    positions[i] = make_float3(m[0]*p.x + m[1]*p.y + m[2]*p.z + m[3],
+                               m[4]*p.x + m[5]*p.y + m[6]*p.z + m[7],
+                               m[8]*p.x + m[9]*p.y + m[10]*p.z + m[11]);
+    normals[i] = optix::normalize(make_float3(m[0]*n.x + m[1]*n.y + m[2]*n.z,
+                                              m[4]*n.x + m[5]*n.y + m[6]*n.z,
+                                              m[8]*n.x + m[9]*n.y + m[10]*n.z));
+    if (face_normals) {
+      const float3 f = t.face_normals[i];
+      face_normals[i] = optix::normalize(make_float3(m[0]*f.x + m[1]*f.y + m[2]*f.z,
+                                                     m[4]*f.x + m[5]*f.y + m[6]*f.z,
+                                                     m[8]*f.x + m[9]*f.y + m[10]*f.z));
+    }
+    if (ao_samples.sample_infos) {
+      bake::SampleInfo info = t.infos[i];
+      info.dA *= scale;
+      ao_samples.sample_infos[i] = info;
+    } else {
+      ao_samples.compact_sample_infos[i] = t.compact_infos[i];
+    }
+  }
+  if (sample_begin > 0) return;
+  for (size_t tri_idx = 0; tri_idx < t.tri_sample_dA.size(); ++tri_idx) {
+    ao_samples.tri_sample_dA[tri_idx] = t.tri_sample_dA[tri_idx] * scale;
+  }
+  if (ao_samples.tri_sample_counts) {
+    std::copy(t.tri_sample_counts.begin(), t.tri_sample_counts.end(), ao_samples.tri_sample_counts);
+  }
+}
+
+
+// Cached triangle areas of an instance from the sampling plan, if it has them, and the scale they take
+void instance_plan_areas(const bake::SamplingPlan* plan, const size_t i, const unsigned mesh_index, const double*& cached_tri_areas, 
+                         double& area_scale)
+{
+  if (plan && plan->instance_area_scales[i] > 0.0) {
+    cached_tri_areas = &plan->mesh_tri_areas[mesh_index][0];
+    area_scale = plan->instance_area_scales[i];
+  } else if (plan && !plan->instance_tri_areas[i].empty()) {
+    cached_tri_areas = &plan->instance_tri_areas[i][0];
+  }
+}
+
+// Sample density weights of an instance's triangles from the sampling plan, or NULL
+const float* instance_plan_weights(const bake::SamplingPlan* plan, const size_t i)
+{
+  if (plan && i < plan->instance_tri_weights.size() && !plan->instance_tri_weights[i].empty()) {
+    return &plan->instance_tri_weights[i][0];
+  }
+  return NULL;
+}
+
+
 void bake::sample_instances(
     const Scene& scene,
     const size_t* num_samples_per_instance,
-    const size_t min_samples_per_triangle,
-    bake::AOSamples&  ao_samples
+    const float min_samples_per_triangle,
+    bake::AOSamples&  ao_samples,
+    const SamplingPlan* plan,
+    const bool sample_templates
     )
 {
 
   std::vector<size_t> sample_offsets(scene.num_instances);
+  std::vector<size_t> tri_offsets(scene.num_instances);
   {
     size_t sample_offset = 0;
+    size_t tri_offset = 0;
     for (size_t i = 0; i < scene.num_instances; ++i) {
       sample_offsets[i] = sample_offset;
       sample_offset += num_samples_per_instance[i];
+      tri_offsets[i] = tri_offset;
+      tri_offset += scene.meshes[scene.instances[i].mesh_index].num_triangles;
     }
   }
   
-#pragma omp parallel for
-  for (ptrdiff_t i = 0; i < ptrdiff_t(scene.num_instances); ++i) {
+  ParallelTimer sample_timer;
+
+  // Similarity instances of a mesh with the same sample count share one template, made in parallel over templates.
+  // Instances with their own triangle weights are sampled as usual.
+  std::vector<size_t> instance_template(scene.num_instances, size_t(-1));
+  std::vector<double> template_area_scales(scene.num_instances, 0.0);
+  std::vector<SampleTemplate> templates;
+  if (sample_templates) {
+    assert( ao_samples.sample_positions );
+    std::map< std::pair<unsigned, size_t>, size_t > template_index;
+    std::vector< std::pair<unsigned, size_t> > template_keys;
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      const bool weighted = plan && i < plan->instance_tri_weights.size() && !plan->instance_tri_weights[i].empty();
+      double scale = 0.0;
+      if (weighted || !similarity_area_scale(optix::Matrix4x4(scene.instances[i].xform), scale) || scale <= 0.0) continue;
+      const std::pair<unsigned, size_t> key(scene.instances[i].mesh_index, num_samples_per_instance[i]);
+      std::map< std::pair<unsigned, size_t>, size_t >::const_iterator it = template_index.find(key);
+      if (it == template_index.end()) {
+        it = template_index.insert(std::make_pair(key, template_keys.size())).first;
+        template_keys.push_back(key);
+      }
+      instance_template[i] = it->second;
+      template_area_scales[i] = scale;
+    }
+    templates.resize(template_keys.size());
+#pragma omp parallel for schedule(dynamic) if(templates.size() >= size_t(maxThreads()))
+    for (ptrdiff_t k = 0; k < ptrdiff_t(templates.size()); ++k) {
+      Timer timer;
+      timer.start();
+      const unsigned mesh_index = template_keys[k].first;
+      const double* cached_tri_areas = plan && mesh_index < plan->mesh_tri_areas.size() && !plan->mesh_tri_areas[mesh_index].empty() ? 
+                                       &plan->mesh_tri_areas[mesh_index][0] : NULL;
+      make_sample_template(scene.meshes[mesh_index], mesh_index, template_keys[k].second, min_samples_per_triangle, cached_tri_areas, 
+                           ao_samples, templates[k]);
+      timer.stop();
+      recordMeshProfile(mesh_index, MESH_PROFILE_SAMPLE_SECONDS, timer.elapsed);
+    }
+  }
+
+  // Instances are cut into ranges of triangles, or of samples for instances from a template, and placed largest
+  // range first.  Instances cut into several ranges are planned up front, so any thread can place any of their ranges.
+  std::vector<size_t> costs(scene.num_instances);
+  for (size_t i = 0; i < scene.num_instances; ++i) {
+    costs[i] = instance_template[i] != size_t(-1) ? num_samples_per_instance[i] : scene.meshes[scene.instances[i].mesh_index].num_triangles;
+  }
+  std::vector<WorkRange> ranges;
+  splitWork(costs, ranges);
+
+  std::vector<size_t> instance_plan(scene.num_instances, size_t(-1));
+  std::vector<size_t> planned_instances;
+  for (size_t r = 0; r < ranges.size(); ++r) {
+    const size_t i = ranges[r].item;
+    if (!ranges[r].whole(costs[i]) && instance_template[i] == size_t(-1) && instance_plan[i] == size_t(-1)) {
+      instance_plan[i] = planned_instances.size();
+      planned_instances.push_back(i);
+    }
+  }
+  std::vector<InstanceSamplePlan> plans(planned_instances.size());
+
+#pragma omp parallel for schedule(dynamic) if(planned_instances.size() > 1)
+  for (ptrdiff_t k = 0; k < ptrdiff_t(planned_instances.size()); ++k) {
+    Timer timer;
+    timer.start();
+    const size_t i = planned_instances[k];
+    const unsigned mesh_index = scene.instances[i].mesh_index;
+    const double* cached_tri_areas = NULL;
+    double area_scale = 1.0;
+    instance_plan_areas(plan, i, mesh_index, cached_tri_areas, area_scale);
+    plan_instance_samples(scene.meshes[mesh_index], optix::Matrix4x4(scene.instances[i].xform), num_samples_per_instance[i], 
+      min_samples_per_triangle, cached_tri_areas, area_scale, instance_plan_weights(plan, i), plans[k]);
+    timer.stop();
+    sample_timer.add(timer);
+    recordMeshProfile(mesh_index, MESH_PROFILE_SAMPLE_SECONDS, timer.elapsed);
+  }
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (ptrdiff_t r = 0; r < ptrdiff_t(ranges.size()); ++r) {
+    Timer timer;
+    timer.start();
+    const WorkRange& range = ranges[r];
+    const size_t i = range.item;
     size_t sample_offset = sample_offsets[i];
     // Point to samples for this instance
     AOSamples instance_ao_samples;
     instance_ao_samples.num_samples = num_samples_per_instance[i];
-    instance_ao_samples.sample_positions = ao_samples.sample_positions + 3*sample_offset;
-    instance_ao_samples.sample_normals = ao_samples.sample_normals + 3*sample_offset;
-    instance_ao_samples.sample_face_normals = ao_samples.sample_face_normals + 3*sample_offset;
-    instance_ao_samples.sample_infos = ao_samples.sample_infos + sample_offset;
+    instance_ao_samples.sample_positions = ao_samples.sample_positions ? ao_samples.sample_positions + 3*sample_offset : NULL;
+    instance_ao_samples.sample_normals = ao_samples.sample_normals ? ao_samples.sample_normals + 3*sample_offset : NULL;
+    instance_ao_samples.sample_face_normals = ao_samples.sample_face_normals ? ao_samples.sample_face_normals + 3*sample_offset : NULL;
+    instance_ao_samples.sample_infos = ao_samples.sample_infos ? ao_samples.sample_infos + sample_offset : NULL;
+    instance_ao_samples.tri_sample_counts = ao_samples.tri_sample_counts ? ao_samples.tri_sample_counts + tri_offsets[i] : NULL;
+    instance_ao_samples.compact_sample_infos = ao_samples.compact_sample_infos ? ao_samples.compact_sample_infos + sample_offset : NULL;
+    instance_ao_samples.tri_sample_dA = ao_samples.tri_sample_dA ? ao_samples.tri_sample_dA + tri_offsets[i] : NULL;
+    instance_ao_samples.sample_instances = NULL;
+    instance_ao_samples.sample_memory = ao_samples.sample_memory;
+    instance_ao_samples.ao_memory = ao_samples.ao_memory;
+    instance_ao_samples.first_sample_index = ao_samples.first_sample_index + sample_offset;
 
+    const unsigned mesh_index = scene.instances[i].mesh_index;
     optix::Matrix4x4 xform(scene.instances[i].xform);
-    sample_instance(scene.meshes[scene.instances[i].mesh_index], xform, (unsigned int)i, min_samples_per_triangle, instance_ao_samples);
+    if (instance_template[i] != size_t(-1)) {
+      instance_sample_template(templates[instance_template[i]], xform, template_area_scales[i], range.begin, range.end, instance_ao_samples);
+    } else if (instance_plan[i] != size_t(-1)) {
+      place_instance_samples(scene.meshes[mesh_index], xform, xform.inverse().transpose(), (unsigned int)i, plans[instance_plan[i]], 
+        range.begin, range.end, 0, instance_ao_samples);
+    } else {
+      const double* cached_tri_areas = NULL;
+      double area_scale = 1.0;
+      instance_plan_areas(plan, i, mesh_index, cached_tri_areas, area_scale);
+      sample_instance(scene.meshes[mesh_index], xform, (unsigned int)i, min_samples_per_triangle, cached_tri_areas, area_scale, 
+        instance_plan_weights(plan, i), instance_ao_samples);
+    }
+    timer.stop();
+    sample_timer.add(timer);
+    recordMeshProfile(mesh_index, MESH_PROFILE_SAMPLE_SECONDS, timer.elapsed);
+  }
+
+  // Instance of each sample, for tracers that rebuild the samples from their triangles
+  if (ao_samples.sample_instances) {
+#pragma omp parallel for if(scene.num_instances > 1)
+    for (ptrdiff_t i = 0; i < ptrdiff_t(scene.num_instances); ++i) {
+      std::fill(ao_samples.sample_instances + sample_offsets[i], ao_samples.sample_instances + sample_offsets[i] + num_samples_per_instance[i], 
+                unsigned(i));
+    }
+  }
+
+  std::cerr << "\tsample instances ...   ";  printTimeElapsed( sample_timer );
+  if (!templates.empty()) {
+    std::cerr << "\tsample templates: " << templates.size() << std::endl;
+    recordCount( "sample.templates", templates.size() );
+  }
+  recordTime( "sample.instances", sample_timer );
+  recordCount( "sample.samples", ao_samples.num_samples );
+}
+
+
+void bake::sample_instance_range(
+    const Scene& scene,
+    const size_t* num_samples_per_instance,
+    const float min_samples_per_triangle,
+    const SamplingPlan* plan,
+    const size_t first_sample,
+    AOSamples& range_samples
+    )
+{
+  assert( range_samples.sample_positions && range_samples.sample_normals );
+  const size_t end_sample = first_sample + range_samples.num_samples;
+
+  // Only the triangles whose samples overlap the range are placed, into scratch arrays of their samples
+  std::vector<float3> positions;
+  std::vector<float3> normals;
+  std::vector<float3> face_normals;
+  std::vector<bake::SampleInfo> infos;
+  InstanceSamplePlan instance_plan;
+
+  size_t instance_begin = 0;
+  for (size_t i = 0; i < scene.num_instances && instance_begin < end_sample; ++i) {
+    const size_t instance_end = instance_begin + num_samples_per_instance[i];
+    if (instance_end <= first_sample || instance_end == instance_begin) {
+      instance_begin = instance_end;
+      continue;
+    }
+    const size_t begin = std::max(first_sample, instance_begin) - instance_begin;
+    const size_t end = std::min(end_sample, instance_end) - instance_begin;
+
+    const unsigned mesh_index = scene.instances[i].mesh_index;
+    const bake::Mesh& mesh = scene.meshes[mesh_index];
+    const optix::Matrix4x4 xform(scene.instances[i].xform);
+    const double* cached_tri_areas = NULL;
+    double area_scale = 1.0;
+    instance_plan_areas(plan, i, mesh_index, cached_tri_areas, area_scale);
+    plan_instance_samples(mesh, xform, num_samples_per_instance[i], min_samples_per_triangle, cached_tri_areas, area_scale, 
+      instance_plan_weights(plan, i), instance_plan);
+
+    // Triangles with a sample in [begin, end)
+    const std::vector<size_t>& offsets = instance_plan.tri_sample_offsets;
+    const size_t tri_begin = std::upper_bound(offsets.begin() + 1, offsets.end(), begin) - (offsets.begin() + 1);
+    const size_t tri_end = std::lower_bound(offsets.begin(), offsets.begin() + mesh.num_triangles, end) - offsets.begin();
+    const size_t span_begin = offsets[tri_begin];
+    const size_t span_samples = offsets[tri_end] - span_begin;
+
+    positions.resize(span_samples);
+    normals.resize(span_samples);
+    face_normals.resize(span_samples);
+    infos.resize(span_samples);
+    bake::AOSamples span;
+    std::memset(&span, 0, sizeof(span));
+    span.num_samples = span_samples;
+    span.sample_positions = &positions[0].x;
+    span.sample_normals = &normals[0].x;
+    span.sample_face_normals = range_samples.sample_face_normals ? &face_normals[0].x : NULL;
+    span.sample_infos = &infos[0];
+    place_instance_samples(mesh, xform, xform.inverse().transpose(), (unsigned int)i, instance_plan, tri_begin, tri_end, span_begin, span);
+
+    const size_t src = begin - span_begin;
+    const size_t dst = instance_begin + begin - first_sample;
+    const size_t count = end - begin;
+    std::copy(positions.begin() + src, positions.begin() + src + count, reinterpret_cast<float3*>(range_samples.sample_positions) + dst);
+    std::copy(normals.begin() + src, normals.begin() + src + count, reinterpret_cast<float3*>(range_samples.sample_normals) + dst);
+    if (range_samples.sample_face_normals) {
+      std::copy(face_normals.begin() + src, face_normals.begin() + src + count, 
+                reinterpret_cast<float3*>(range_samples.sample_face_normals) + dst);
+    }
+    if (range_samples.sample_infos) {
+      std::copy(infos.begin() + src, infos.begin() + src + count, range_samples.sample_infos + dst);
+    }
+    instance_begin = instance_end;
+  }
+}
+
+
+// Share of the mean pilot variance added to every triangle's weight, so flat open regions keep some extra samples
+const double VARIANCE_WEIGHT_FLOOR = 0.1;
+
+void bake::weigh_samples_by_variance(
+    const Scene& scene,
+    const size_t* num_samples_per_instance,
+    const AOSamples& pilot_samples,
+    const float* pilot_ao,
+    SamplingPlan& plan
+    )
+{
+
+  std::vector<size_t> sample_offsets(scene.num_instances+1, 0);
+  for (size_t i = 0; i < scene.num_instances; ++i) {
+    sample_offsets[i+1] = sample_offsets[i] + num_samples_per_instance[i];
+  }
+  assert( sample_offsets[scene.num_instances] == pilot_samples.num_samples );
+
+  // Variance of the pilot AO over the samples of each triangle, smoothed over the triangles around its vertices:
+  // a pilot has few samples per triangle, and occlusion that changes at a triangle usually changes next to it.
+  plan.instance_tri_weights.assign(scene.num_instances, std::vector<float>());
+  double variance_sum = 0.0;
+  size_t num_triangles = 0;
+#pragma omp parallel for reduction(+:variance_sum, num_triangles) schedule(dynamic)
+  for (ptrdiff_t i = 0; i < ptrdiff_t(scene.num_instances); ++i) {
+    const bake::Mesh& mesh = scene.meshes[scene.instances[i].mesh_index];
+    std::vector<double> sums(mesh.num_triangles, 0.0);
+    std::vector<double> squares(mesh.num_triangles, 0.0);
+    std::vector<unsigned> counts(mesh.num_triangles, 0);
+    for (size_t k = sample_offsets[i]; k < sample_offsets[i+1]; ++k) {
+      const unsigned tri_idx = pilot_samples.sample_infos[k].tri_idx;
+      sums[tri_idx] += pilot_ao[k];
+      squares[tri_idx] += double(pilot_ao[k])*pilot_ao[k];
+      counts[tri_idx]++;
+    }
+
+    std::vector<double> vertex_variance(mesh.num_vertices, 0.0);
+    std::vector<unsigned> vertex_count(mesh.num_vertices, 0);
+    const int3* tri_vertex_indices = reinterpret_cast<int3*>( mesh.tri_vertex_indices );
+    for (size_t tri_idx = 0; tri_idx < mesh.num_triangles; ++tri_idx) {
+      const unsigned n = counts[tri_idx];
+      const double variance = n > 1 ? std::max( 0.0, (squares[tri_idx] - sums[tri_idx]*sums[tri_idx]/n) / (n-1) ) : 0.0;
+      const int3& tri = tri_vertex_indices[tri_idx];
+      const int v[] = {tri.x, tri.y, tri.z};
+      for (int j = 0; j < 3; ++j) {
+        vertex_variance[v[j]] += variance;
+        vertex_count[v[j]]++;
+      }
+    }
+
+    std::vector<float>& weights = plan.instance_tri_weights[i];
+    weights.resize(mesh.num_triangles);
+    for (size_t tri_idx = 0; tri_idx < mesh.num_triangles; ++tri_idx) {
+      const int3& tri = tri_vertex_indices[tri_idx];
+      const int v[] = {tri.x, tri.y, tri.z};
+      double variance = 0.0;
+      for (int j = 0; j < 3; ++j) variance += vertex_variance[v[j]] / vertex_count[v[j]];
+      weights[tri_idx] = static_cast<float>(variance / 3.0);
+      variance_sum += weights[tri_idx];
+    }
+    num_triangles += mesh.num_triangles;
+  }
+
+  // Without any variance, e.g. an open scene, the weights fall back to area only
+  const double floor = num_triangles > 0 && variance_sum > 0.0 ? VARIANCE_WEIGHT_FLOOR * variance_sum / num_triangles : 1.0;
+#pragma omp parallel for schedule(dynamic)
+  for (ptrdiff_t i = 0; i < ptrdiff_t(scene.num_instances); ++i) {
+    std::vector<float>& weights = plan.instance_tri_weights[i];
+    for (size_t tri_idx = 0; tri_idx < weights.size(); ++tri_idx) {
+      weights[tri_idx] = static_cast<float>(weights[tri_idx] + floor);
+    }
+  }
+
+}
+
+
+// Area weighted sum of the face normals around each vertex of a mesh, in mesh space
+void vertex_face_normals( const bake::Mesh& mesh, std::vector<float3>& normals )
+{
+  const int3* tri_vertex_indices = reinterpret_cast<int3*>( mesh.tri_vertex_indices );
+  const unsigned vertex_stride_bytes = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+  normals.assign( mesh.num_vertices, make_float3( 0.0f ) );
+  for ( size_t tri_idx = 0; tri_idx < mesh.num_triangles; tri_idx++ ) {
+    const int3& tri = tri_vertex_indices[tri_idx];
+    const float3& v0 = *get_vertex(mesh.vertices, vertex_stride_bytes, tri.x);
+    const float3& v1 = *get_vertex(mesh.vertices, vertex_stride_bytes, tri.y);
+    const float3& v2 = *get_vertex(mesh.vertices, vertex_stride_bytes, tri.z);
+    const float3 n = optix::cross( v1-v0, v2-v0 );  // twice the area
+    normals[tri.x] += n;
+    normals[tri.y] += n;
+    normals[tri.z] += n;
+  }
+}
+
+
+void bake::sample_vertices(
+    const Scene& scene,
+    AOSamples& ao_samples
+    )
+{
+  ParallelTimer sample_timer;
+
+  std::vector<size_t> sample_offsets(scene.num_instances);
+  std::vector< std::vector<size_t> > mesh_instances(scene.num_meshes);
+  {
+    size_t sample_offset = 0;
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      sample_offsets[i] = sample_offset;
+      sample_offset += scene.meshes[scene.instances[i].mesh_index].num_vertices;
+      mesh_instances[scene.instances[i].mesh_index].push_back(i);
+    }
+    assert( sample_offset == ao_samples.num_samples );
+  }
+
+  // Meshes in parallel, each building its face normals once for all of its instances
+  float3* sample_positions  = reinterpret_cast<float3*>( ao_samples.sample_positions );
+  float3* sample_norms      = reinterpret_cast<float3*>( ao_samples.sample_normals );
+  float3* sample_face_norms = reinterpret_cast<float3*>( ao_samples.sample_face_normals );
+#pragma omp parallel for schedule(dynamic)
+  for (ptrdiff_t m = 0; m < ptrdiff_t(scene.num_meshes); ++m) {
+    if (mesh_instances[m].empty()) continue;
+    Timer timer;
+    timer.start();
+    const Mesh& mesh = scene.meshes[m];
+    const unsigned vertex_stride_bytes = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+    const unsigned normal_stride_bytes = mesh.normal_stride_bytes > 0 ? mesh.normal_stride_bytes : 3*sizeof(float);
+    std::vector<float3> face_normals;
+    vertex_face_normals( mesh, face_normals );
+
+    for (size_t k = 0; k < mesh_instances[m].size(); ++k) {
+      const size_t i = mesh_instances[m][k];
+      const optix::Matrix4x4 xform( scene.instances[i].xform );
+      const optix::Matrix4x4 xform_invtrans = xform.inverse().transpose();
+      const size_t sample_idx = sample_offsets[i];
+      for (size_t v = 0; v < mesh.num_vertices; ++v) {
+        // Vertices of no triangle, or only degenerate ones, keep whatever normal they have
+        float3 face_normal = face_normals[v];
+        float3 normal = mesh.normals ? *get_vertex(mesh.normals, normal_stride_bytes, (int)v) : face_normal;
+        if ( optix::dot( face_normal, face_normal ) > 0.0f ) {
+          normal = faceforward( normal, face_normal );
+        } else {
+          face_normal = normal;
+        }
+        if ( !( optix::dot( normal, normal ) > 0.0f ) ) {
+          normal = face_normal = make_float3( 0.0f, 0.0f, 1.0f );
+        }
+        sample_positions[sample_idx + v] = xform*(*get_vertex(mesh.vertices, vertex_stride_bytes, (int)v));
+        sample_norms[sample_idx + v] = optix::normalize(xform_invtrans*normal);
+        sample_face_norms[sample_idx + v] = optix::normalize(xform_invtrans*face_normal);
+      }
+    }
+    timer.stop();
+    sample_timer.add(timer);
+    recordMeshProfile(size_t(m), MESH_PROFILE_SAMPLE_SECONDS, timer.elapsed);
   }
+
+  std::cerr << "\tsample vertices ...    ";  printTimeElapsed( sample_timer );
+  recordTime( "sample.vertices", sample_timer );
+  recordCount( "sample.samples", ao_samples.num_samples );
+}
+
+
+void bake::place_samples(
+    const Scene&  scene,
+    const size_t* num_samples_per_instance,
+    AOSamples&    ao_samples
+    )
+{
+  ParallelTimer place_timer;
+
+  std::vector<size_t> sample_offsets(scene.num_instances);
+  std::vector<size_t> tri_offsets(scene.num_instances);
+  {
+    size_t sample_offset = 0;
+    size_t tri_offset = 0;
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      sample_offsets[i] = sample_offset;
+      sample_offset += num_samples_per_instance[i];
+      tri_offsets[i] = tri_offset;
+      tri_offset += scene.meshes[scene.instances[i].mesh_index].num_triangles;
+    }
+    assert( sample_offset == ao_samples.num_samples );
+  }
+
+  float3* sample_positions  = reinterpret_cast<float3*>( ao_samples.sample_positions );
+  float3* sample_norms      = reinterpret_cast<float3*>( ao_samples.sample_normals );
+  float3* sample_face_norms = reinterpret_cast<float3*>( ao_samples.sample_face_normals );
+#pragma omp parallel for schedule(dynamic)
+  for (ptrdiff_t i = 0; i < ptrdiff_t(scene.num_instances); ++i) {
+    Timer timer;
+    timer.start();
+    const Mesh& mesh = scene.meshes[scene.instances[i].mesh_index];
+    const optix::Matrix4x4 xform( scene.instances[i].xform );
+    const optix::Matrix4x4 xform_invtrans = xform.inverse().transpose();
+    const int3* tri_vertex_indices = reinterpret_cast<int3*>( mesh.tri_vertex_indices );
+    const unsigned vertex_stride_bytes = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+    const unsigned normal_stride_bytes = mesh.normal_stride_bytes > 0 ? mesh.normal_stride_bytes : 3*sizeof(float);
+    const size_t first = sample_offsets[i];
+    const size_t end = first + num_samples_per_instance[i];
+
+    // Samples of a triangle share its area, so count them first
+    std::vector<unsigned> tri_sample_counts(mesh.num_triangles, 0);
+    for (size_t s = first; s < end; ++s) ++tri_sample_counts[get_sample_info(ao_samples, s).tri_idx];
+    std::vector<double> tri_areas(mesh.num_triangles, 0.0);
+    for (size_t t = 0; t < mesh.num_triangles; ++t) {
+      if (tri_sample_counts[t] == 0) continue;
+      const int3& tri = tri_vertex_indices[t];
+      tri_areas[t] = triangle_area(xform*(*get_vertex(mesh.vertices, vertex_stride_bytes, tri.x)), 
+                                   xform*(*get_vertex(mesh.vertices, vertex_stride_bytes, tri.y)),
+                                   xform*(*get_vertex(mesh.vertices, vertex_stride_bytes, tri.z)));
+      if (ao_samples.tri_sample_dA) {
+        ao_samples.tri_sample_dA[tri_offsets[i] + t] = static_cast<float>(tri_areas[t] / tri_sample_counts[t]);
+      }
+    }
+
+    for (size_t s = first; s < end; ++s) {
+      const SampleInfo info = get_sample_info(ao_samples, s);
+      if (ao_samples.sample_infos) {
+        ao_samples.sample_infos[s].dA = static_cast<float>(tri_areas[info.tri_idx] / tri_sample_counts[info.tri_idx]);
+      }
+      if (!sample_positions) continue;
+      const int3& tri = tri_vertex_indices[info.tri_idx];
+      const float3& v0 = *get_vertex(mesh.vertices, vertex_stride_bytes, tri.x);
+      const float3& v1 = *get_vertex(mesh.vertices, vertex_stride_bytes, tri.y);
+      const float3& v2 = *get_vertex(mesh.vertices, vertex_stride_bytes, tri.z);
+      const float3 face_normal = optix::normalize( optix::cross( v1-v0, v2-v0 ) );
+      float3 normal = face_normal;
+      if (mesh.normals) {
+        normal = info.bary[0]*faceforward( *get_vertex(mesh.normals, normal_stride_bytes, tri.x), face_normal ) +
+                 info.bary[1]*faceforward( *get_vertex(mesh.normals, normal_stride_bytes, tri.y), face_normal ) +
+                 info.bary[2]*faceforward( *get_vertex(mesh.normals, normal_stride_bytes, tri.z), face_normal );
+      }
+      sample_positions[s] = xform*(info.bary[0]*v0 + info.bary[1]*v1 + info.bary[2]*v2);
+      sample_norms[s] = optix::normalize(xform_invtrans*normal);
+      sample_face_norms[s] = optix::normalize(xform_invtrans*face_normal);
+    }
+    timer.stop();
+    place_timer.add(timer);
+  }
+
+  std::cerr << "\tplace samples ...      ";  printTimeElapsed( place_timer );
+  recordTime( "sample.place", place_timer );
 }
 
 
@@ -290,41 +1132,93 @@ private:
 
 size_t bake::distribute_samples(
     const Scene& scene,
-    const size_t min_samples_per_triangle,
+    const float min_samples_per_triangle,
     const size_t requested_num_samples,
-    size_t* num_samples_per_instance
+    size_t* num_samples_per_instance,
+    SamplingPlan* plan
     )
 {
 
-  // Compute min samples per instance
+  // Compute min samples per instance.  A fractional minimum per triangle still gives every instance a sample.
   std::vector<unsigned int> min_samples_per_instance(scene.num_instances);
-  size_t num_triangles = 0;
+  size_t min_num_samples = 0;
   for (size_t i = 0; i < scene.num_instances; ++i) {
     const bake::Mesh& mesh = scene.meshes[scene.instances[i].mesh_index];
-    min_samples_per_instance[i] = (unsigned int)(min_samples_per_triangle * mesh.num_triangles); 
-    num_triangles += mesh.num_triangles;
+    size_t min_samples = mesh_min_samples(min_samples_per_triangle, mesh.num_triangles);
+    if (min_samples == 0 && min_samples_per_triangle > 0.0f && mesh.num_triangles > 0) min_samples = 1;
+    min_samples_per_instance[i] = (unsigned int)min_samples; 
+    min_num_samples += min_samples;
   }
-  const size_t min_num_samples = min_samples_per_triangle*num_triangles;
   size_t num_samples = std::max(min_num_samples, requested_num_samples);
 
-  // Compute surface area per instance.
-  // Note: for many xforms, we could compute surface area per mesh instead of per instance.
+  // Compute surface area per instance, through triangle areas that sampling can reuse.
+  // Similarity instances share the mesh space areas of their mesh.
   std::vector<double> area_per_instance(scene.num_instances, 0.0);
-  if (num_samples > min_num_samples) {
-
-    #pragma omp parallel for
-    for (ptrdiff_t idx = 0; idx < ptrdiff_t(scene.num_instances); ++idx) {
-      const bake::Mesh& mesh = scene.meshes[scene.instances[idx].mesh_index];
-      const optix::Matrix4x4 xform(scene.instances[idx].xform);
-      const int3* tri_vertex_indices  = reinterpret_cast<int3*>( mesh.tri_vertex_indices );
-      const unsigned vertex_stride_bytes = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
-      for (size_t tri_idx = 0; tri_idx < mesh.num_triangles; ++tri_idx) {
-        const int3& tri = tri_vertex_indices[tri_idx];
-        const float3* verts[] = {get_vertex(mesh.vertices, vertex_stride_bytes, tri.x),
-                                 get_vertex(mesh.vertices, vertex_stride_bytes, tri.y),
-                                 get_vertex(mesh.vertices, vertex_stride_bytes, tri.z)};
-        double area = triangle_area(xform*verts[0][0], xform*verts[1][0], xform*verts[2][0]);
-        area_per_instance[idx] += area;
+  SamplingPlan local_plan;
+  if (num_samples > min_num_samples && !plan) plan = &local_plan;
+  if (plan) {
+
+    plan->mesh_tri_areas.assign(scene.num_meshes, std::vector<double>());
+    plan->instance_tri_areas.assign(scene.num_instances, std::vector<double>());
+    plan->instance_area_scales.assign(scene.num_instances, 0.0);
+
+    // Triangle areas of instances that are not similarities, and mesh space areas of meshes with similarity
+    // instances, computed in triangle ranges of one schedule
+    std::vector<size_t> area_costs(scene.num_instances + scene.num_meshes, 0);
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      const optix::Matrix4x4 xform(scene.instances[i].xform);
+      const bake::Mesh& mesh = scene.meshes[scene.instances[i].mesh_index];
+      double scale = 0.0;
+      if (!similarity_area_scale(xform, scale) || scale <= 0.0) {
+        plan->instance_tri_areas[i].resize(mesh.num_triangles);
+        area_costs[i] = mesh.num_triangles;
+        scale = 0.0;
+      } else {
+        area_costs[scene.num_instances + scene.instances[i].mesh_index] = mesh.num_triangles;
+      }
+      plan->instance_area_scales[i] = scale;
+    }
+    for (size_t meshIdx = 0; meshIdx < scene.num_meshes; ++meshIdx) {
+      plan->mesh_tri_areas[meshIdx].resize(area_costs[scene.num_instances + meshIdx]);
+    }
+
+    std::vector<WorkRange> area_ranges;
+    splitWork(area_costs, area_ranges);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (ptrdiff_t r = 0; r < ptrdiff_t(area_ranges.size()); ++r) {
+      const WorkRange& range = area_ranges[r];
+      if (range.begin == range.end) continue;
+      if (range.item < scene.num_instances) {
+        const bake::Mesh& mesh = scene.meshes[scene.instances[range.item].mesh_index];
+        compute_tri_areas(mesh, optix::Matrix4x4(scene.instances[range.item].xform), range.begin, range.end, 
+                          &plan->instance_tri_areas[range.item][0]);
+      } else {
+        const size_t meshIdx = range.item - scene.num_instances;
+        compute_tri_areas(scene.meshes[meshIdx], optix::Matrix4x4::identity(), range.begin, range.end, &plan->mesh_tri_areas[meshIdx][0]);
+      }
+    }
+
+    std::vector<double> mesh_areas(scene.num_meshes, 0.0);
+    for (size_t meshIdx = 0; meshIdx < scene.num_meshes; ++meshIdx) {
+      const std::vector<double>& tri_areas = plan->mesh_tri_areas[meshIdx];
+      for (size_t tri_idx = 0; tri_idx < tri_areas.size(); ++tri_idx) mesh_areas[meshIdx] += tri_areas[tri_idx];
+    }
+
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      const bool weighted = i < plan->instance_tri_weights.size() && !plan->instance_tri_weights[i].empty();
+      if (weighted) {
+        // Weighted area, as the instance's triangles will place their samples
+        const double scale = plan->instance_area_scales[i];
+        const std::vector<double>& tri_areas = scale > 0.0 ? plan->mesh_tri_areas[scene.instances[i].mesh_index] : plan->instance_tri_areas[i];
+        const std::vector<float>& tri_weights = plan->instance_tri_weights[i];
+        assert( tri_weights.size() == tri_areas.size() );
+        for (size_t tri_idx = 0; tri_idx < tri_areas.size(); ++tri_idx) area_per_instance[i] += tri_areas[tri_idx] * tri_weights[tri_idx];
+        if (scale > 0.0) area_per_instance[i] *= scale;
+      } else if (plan->instance_area_scales[i] > 0.0) {
+        area_per_instance[i] = mesh_areas[scene.instances[i].mesh_index] * plan->instance_area_scales[i];
+      } else {
+        const std::vector<double>& tri_areas = plan->instance_tri_areas[i];
+        for (size_t tri_idx = 0; tri_idx < tri_areas.size(); ++tri_idx) area_per_instance[i] += tri_areas[tri_idx];
       }
     }
 
@@ -339,3 +1233,314 @@ size_t bake::distribute_samples(
 }
 
 
+namespace {
+
+const unsigned TEXEL_ROWS_PER_BLOCK = 16;
+
+struct TexelHit
+{
+  unsigned  x;
+  unsigned  tri_idx;
+  float     bary[3];
+
+  bool operator<( const TexelHit& other ) const { return x < other.x; }
+};
+
+const float2& get_texcoord(const float* t, unsigned stride_bytes, int index)
+{
+  return *reinterpret_cast<const float2*>(reinterpret_cast<const unsigned char*>(t) + index*stride_bytes);
+}
+
+// Twice the signed area of (a, b, p)
+float edge_function(const float2& a, const float2& b, const float2& p)
+{
+  return (b.x - a.x)*(p.y - a.y) - (b.y - a.y)*(p.x - a.x);
+}
+
+}
+
+
+void bake::sample_texels(
+    const Scene& scene,
+    const size_t instance_index,
+    const unsigned width, const unsigned height,
+    const unsigned first_row, const unsigned num_rows,
+    TexelSamples& texel_samples
+    )
+{
+  texel_samples.positions.clear();
+  texel_samples.normals.clear();
+  texel_samples.face_normals.clear();
+  texel_samples.texels.clear();
+
+  const bake::Instance& instance = scene.instances[instance_index];
+  const bake::Mesh& mesh = scene.meshes[instance.mesh_index];
+  if (!mesh.texcoords || mesh.num_triangles == 0 || num_rows == 0 || width == 0) return;
+  assert( first_row + num_rows <= height );
+
+  const optix::Matrix4x4 xform( instance.xform );
+  const optix::Matrix4x4 xform_invtrans = xform.inverse().transpose();
+  const int3* tri_vertex_indices = reinterpret_cast<const int3*>( mesh.tri_vertex_indices );
+  const unsigned vertex_stride_bytes   = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+  const unsigned normal_stride_bytes   = mesh.normal_stride_bytes > 0 ? mesh.normal_stride_bytes : 3*sizeof(float);
+  const unsigned texcoord_stride_bytes = mesh.texcoord_stride_bytes > 0 ? mesh.texcoord_stride_bytes : 2*sizeof(float);
+
+  // Bucket triangles by the blocks of rows their UV bounds touch.  Texel (x, y) has its center at 
+  // ((x + 0.5)/width, (y + 0.5)/height) in UV space.
+  const unsigned num_blocks = (num_rows + TEXEL_ROWS_PER_BLOCK - 1) / TEXEL_ROWS_PER_BLOCK;
+  std::vector< std::vector<unsigned> > block_tris(num_blocks);
+  for (size_t tri_idx = 0; tri_idx < mesh.num_triangles; ++tri_idx) {
+    const int3& tri = tri_vertex_indices[tri_idx];
+    const float v0 = get_texcoord(mesh.texcoords, texcoord_stride_bytes, tri.x).y;
+    const float v1 = get_texcoord(mesh.texcoords, texcoord_stride_bytes, tri.y).y;
+    const float v2 = get_texcoord(mesh.texcoords, texcoord_stride_bytes, tri.z).y;
+    const float ymin = std::ceil( std::min(v0, std::min(v1, v2))*height - 0.5f );
+    const float ymax = std::floor( std::max(v0, std::max(v1, v2))*height - 0.5f );
+    if (!(ymin <= ymax) || ymax < float(first_row) || ymin >= float(first_row + num_rows)) continue;
+    const unsigned row_begin = unsigned( std::max(ymin, float(first_row)) ) - first_row;
+    const unsigned row_end   = unsigned( std::min(ymax, float(first_row + num_rows - 1)) ) - first_row;
+    for (unsigned b = row_begin / TEXEL_ROWS_PER_BLOCK; b <= row_end / TEXEL_ROWS_PER_BLOCK; ++b) {
+      block_tris[b].push_back( (unsigned)tri_idx );
+    }
+  }
+
+  // Cover each row independently; the first triangle covering a texel owns it
+  std::vector< std::vector<TexelHit> > row_hits(num_rows);
+#pragma omp parallel for schedule(dynamic)
+  for (ptrdiff_t r = 0; r < ptrdiff_t(num_rows); ++r) {
+    const std::vector<unsigned>& tris = block_tris[size_t(r) / TEXEL_ROWS_PER_BLOCK];
+    if (tris.empty()) continue;
+    std::vector<bool> covered(width, false);
+    std::vector<TexelHit>& hits = row_hits[r];
+    const float py = (float(first_row + r) + 0.5f) / height;
+
+    for (size_t t = 0; t < tris.size(); ++t) {
+      const int3& tri = tri_vertex_indices[tris[t]];
+      const float2& t0 = get_texcoord(mesh.texcoords, texcoord_stride_bytes, tri.x);
+      const float2& t1 = get_texcoord(mesh.texcoords, texcoord_stride_bytes, tri.y);
+      const float2& t2 = get_texcoord(mesh.texcoords, texcoord_stride_bytes, tri.z);
+      const float area = edge_function(t0, t1, t2);
+      if (area == 0.0f) continue;
+
+      const float xmin = std::ceil( std::min(t0.x, std::min(t1.x, t2.x))*width - 0.5f );
+      const float xmax = std::floor( std::max(t0.x, std::max(t1.x, t2.x))*width - 0.5f );
+      if (!(xmin <= xmax) || xmax < 0.0f || xmin >= float(width)) continue;
+      const unsigned x_begin = unsigned( std::max(xmin, 0.0f) );
+      const unsigned x_end   = unsigned( std::min(xmax, float(width - 1)) );
+
+      const float inv_area = 1.0f / area;
+      for (unsigned x = x_begin; x <= x_end; ++x) {
+        if (covered[x]) continue;
+        const float2 p = optix::make_float2( (float(x) + 0.5f) / width, py );
+        const float b0 = edge_function(t1, t2, p) * inv_area;
+        const float b1 = edge_function(t2, t0, p) * inv_area;
+        const float b2 = edge_function(t0, t1, p) * inv_area;
+        if (b0 < 0.0f || b1 < 0.0f || b2 < 0.0f) continue;
+        covered[x] = true;
+        TexelHit hit;
+        hit.x = x;
+        hit.tri_idx = tris[t];
+        hit.bary[0] = b0;
+        hit.bary[1] = b1;
+        hit.bary[2] = b2;
+        hits.push_back(hit);
+      }
+    }
+    std::sort(hits.begin(), hits.end());
+  }
+
+  std::vector<size_t> row_offsets(num_rows + 1, 0);
+  for (unsigned r = 0; r < num_rows; ++r) {
+    row_offsets[r+1] = row_offsets[r] + row_hits[r].size();
+  }
+  const size_t num_samples = row_offsets[num_rows];
+  texel_samples.positions.resize(3*num_samples);
+  texel_samples.normals.resize(3*num_samples);
+  texel_samples.face_normals.resize(3*num_samples);
+  texel_samples.texels.resize(num_samples);
+  float3* sample_positions  = reinterpret_cast<float3*>( num_samples ? &texel_samples.positions[0] : NULL );
+  float3* sample_norms      = reinterpret_cast<float3*>( num_samples ? &texel_samples.normals[0] : NULL );
+  float3* sample_face_norms = reinterpret_cast<float3*>( num_samples ? &texel_samples.face_normals[0] : NULL );
+
+  // Same interpolation as sample_triangle, at the texel center
+#pragma omp parallel for schedule(dynamic)
+  for (ptrdiff_t r = 0; r < ptrdiff_t(num_rows); ++r) {
+    const std::vector<TexelHit>& hits = row_hits[r];
+    for (size_t h = 0; h < hits.size(); ++h) {
+      const TexelHit& hit = hits[h];
+      const size_t idx = row_offsets[r] + h;
+      const int3& tri = tri_vertex_indices[hit.tri_idx];
+      const float3& v0 = *get_vertex(mesh.vertices, vertex_stride_bytes, tri.x);
+      const float3& v1 = *get_vertex(mesh.vertices, vertex_stride_bytes, tri.y);
+      const float3& v2 = *get_vertex(mesh.vertices, vertex_stride_bytes, tri.z);
+      const float3 face_normal = optix::normalize( optix::cross( v1-v0, v2-v0 ) );
+      float3 n0 = face_normal, n1 = face_normal, n2 = face_normal;
+      if (mesh.normals) {
+        n0 = faceforward( *get_vertex(mesh.normals, normal_stride_bytes, tri.x), face_normal );
+        n1 = faceforward( *get_vertex(mesh.normals, normal_stride_bytes, tri.y), face_normal );
+        n2 = faceforward( *get_vertex(mesh.normals, normal_stride_bytes, tri.z), face_normal );
+      }
+      sample_positions[idx]  = xform*(hit.bary[0]*v0 + hit.bary[1]*v1 + hit.bary[2]*v2);
+      sample_norms[idx]      = optix::normalize(xform_invtrans*( hit.bary[0]*n0 + hit.bary[1]*n1 + hit.bary[2]*n2 ));
+      sample_face_norms[idx] = optix::normalize(xform_invtrans*face_normal);
+      texel_samples.texels[idx] = (first_row + unsigned(r))*width + hit.x;
+    }
+  }
+}
+
+
+namespace
+{
+
+// dst[i] = src[order[i]] for arrays of n elements of 'width' values each.  Undone by unsort == true.
+template <typename T>
+void permute_samples( T* values, const size_t width, const size_t* order, const size_t n, const bool unsort )
+{
+  if ( !values ) return;
+  std::vector<T> permuted( width*n );
+#pragma omp parallel for if(n > (1<<16))
+  for (ptrdiff_t i = 0; i < ptrdiff_t(n); ++i) {
+    const size_t src = unsort ? size_t(i) : order[i];
+    const size_t dst = unsort ? order[i] : size_t(i);
+    for (size_t k = 0; k < width; ++k) permuted[width*dst + k] = values[width*src + k];
+  }
+  std::copy( permuted.begin(), permuted.end(), values );
+}
+
+// Sort samples by key, ties keeping the original order, and permute them into that order
+void order_samples( bake::AOSamples& ao_samples, std::vector< std::pair<uint64_t, size_t> >& keys, size_t* sorted_order )
+{
+  const size_t n = ao_samples.num_samples;
+  parallelSort( keys );
+  for (size_t i = 0; i < n; ++i) sorted_order[i] = keys[i].second;
+
+  permute_samples( ao_samples.sample_positions, 3, sorted_order, n, false );
+  permute_samples( ao_samples.sample_normals, 3, sorted_order, n, false );
+  permute_samples( ao_samples.sample_face_normals, 3, sorted_order, n, false );
+  permute_samples( ao_samples.sample_infos, 1, sorted_order, n, false );
+  permute_samples( ao_samples.compact_sample_infos, 1, sorted_order, n, false );
+  permute_samples( ao_samples.sample_instances, 1, sorted_order, n, false );
+}
+
+// Morton code of a position in the box, 10 bits per axis, above the octant of the normal in the low 3 bits
+inline uint64_t coherence_key( const float* p, const float* nrm, const float box_min[3], const float extent[3] )
+{
+  unsigned cell[3];
+  unsigned octant = 0;
+  for (int k = 0; k < 3; ++k) {
+    const float t = ( p[k] - box_min[k] ) / extent[k];
+    cell[k] = unsigned( std::min( std::max( t, 0.0f ), 1.0f ) * 1023.0f );
+    if ( nrm[k] < 0.0f ) octant |= 1u << k;
+  }
+  return ( uint64_t( mortonCode( cell[0], cell[1], cell[2] ) ) << 3 ) | octant;
+}
+
+}
+
+
+void bake::sort_samples(
+    AOSamples& ao_samples,
+    const float bbox_min[3], const float bbox_max[3],
+    size_t* sorted_order
+    )
+{
+  const size_t n = ao_samples.num_samples;
+  float extent[3];
+  for (int k = 0; k < 3; ++k) extent[k] = std::max( bbox_max[k] - bbox_min[k], FLT_MIN );
+
+  // Position in the high bits, normal octant in the low bits, so neighbors facing the same way trace 
+  // their rays together.  Ties keep the original order.
+  std::vector< std::pair<uint64_t, size_t> > keys( n );
+#pragma omp parallel for if(n > (1<<16))
+  for (ptrdiff_t i = 0; i < ptrdiff_t(n); ++i) {
+    keys[i] = std::make_pair( coherence_key( &ao_samples.sample_positions[3*i], &ao_samples.sample_normals[3*i], bbox_min, extent ), size_t(i) );
+  }
+  order_samples( ao_samples, keys, sorted_order );
+}
+
+
+void bake::tile_samples(
+    AOSamples& ao_samples,
+    const float bbox_min[3], const float bbox_max[3],
+    const float tile_size,
+    size_t* sorted_order,
+    std::vector<SampleTile>& tiles
+    )
+{
+  const size_t n = ao_samples.num_samples;
+
+  // Tiles are numbered in 31 bits; larger tiles keep the grid within that
+  const uint64_t MAX_TILES = uint64_t(1) << 31;
+  float size = std::max( tile_size, FLT_MIN );
+  uint64_t dims[3];
+  for (;;) {
+    for (int k = 0; k < 3; ++k) dims[k] = std::max( uint64_t( std::ceil( ( bbox_max[k] - bbox_min[k] ) / size ) ), uint64_t(1) );
+    if ( dims[0]*dims[1]*dims[2] < MAX_TILES ) break;
+    size *= 2.0f;
+  }
+  const float extent[3] = { size, size, size };
+
+  // Tile in the high bits, then the order of sort_samples within the tile
+  std::vector< std::pair<uint64_t, size_t> > keys( n );
+#pragma omp parallel for if(n > (1<<16))
+  for (ptrdiff_t i = 0; i < ptrdiff_t(n); ++i) {
+    const float* p = &ao_samples.sample_positions[3*i];
+    uint64_t cell[3];
+    float cell_min[3];
+    for (int k = 0; k < 3; ++k) {
+      cell[k] = std::min( uint64_t( std::max( ( p[k] - bbox_min[k] ) / size, 0.0f ) ), dims[k] - 1 );
+      cell_min[k] = bbox_min[k] + float( cell[k] )*size;
+    }
+    const uint64_t tile = ( cell[2]*dims[1] + cell[1] )*dims[0] + cell[0];
+    keys[i] = std::make_pair( ( tile << 33 ) | coherence_key( p, &ao_samples.sample_normals[3*i], cell_min, extent ), size_t(i) );
+  }
+  order_samples( ao_samples, keys, sorted_order );
+
+  tiles.clear();
+  for (size_t i = 0; i < n; ++i) {
+    if ( i == 0 || ( keys[i].first >> 33 ) != ( keys[i-1].first >> 33 ) ) {
+      SampleTile tile;
+      tile.first_sample = i;
+      tile.num_samples = 0;
+      tiles.push_back( tile );
+    }
+    tiles.back().num_samples++;
+  }
+
+  // Bounds of the samples of each tile
+#pragma omp parallel for schedule(dynamic)
+  for (ptrdiff_t t = 0; t < ptrdiff_t(tiles.size()); ++t) {
+    SampleTile& tile = tiles[t];
+    for (int k = 0; k < 3; ++k) {
+      tile.bbox_min[k] = FLT_MAX;
+      tile.bbox_max[k] = -FLT_MAX;
+    }
+    for (size_t i = tile.first_sample; i < tile.first_sample + tile.num_samples; ++i) {
+      const float* p = &ao_samples.sample_positions[3*i];
+      for (int k = 0; k < 3; ++k) {
+        tile.bbox_min[k] = std::min( tile.bbox_min[k], p[k] );
+        tile.bbox_max[k] = std::max( tile.bbox_max[k], p[k] );
+      }
+    }
+  }
+}
+
+
+void bake::unsort_samples(
+    AOSamples& ao_samples,
+    const size_t* sorted_order,
+    float* ao_values,
+    const size_t num_ao_channels
+    )
+{
+  const size_t n = ao_samples.num_samples;
+  permute_samples( ao_samples.sample_positions, 3, sorted_order, n, true );
+  permute_samples( ao_samples.sample_normals, 3, sorted_order, n, true );
+  permute_samples( ao_samples.sample_face_normals, 3, sorted_order, n, true );
+  permute_samples( ao_samples.sample_infos, 1, sorted_order, n, true );
+  permute_samples( ao_samples.compact_sample_infos, 1, sorted_order, n, true );
+  permute_samples( ao_samples.sample_instances, 1, sorted_order, n, true );
+  for (size_t c = 0; c < num_ao_channels && ao_values; ++c) {
+    permute_samples( ao_values + c*n, 1, sorted_order, n, true );
+  }
+}
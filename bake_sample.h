@@ -23,18 +23,90 @@
 
 #include "bake_api.h"
 
+#include <algorithm>
+
 namespace bake
 {
 
+// Sample info in either layout of AOSamples
+inline SampleInfo get_sample_info( const AOSamples& ao_samples, const size_t i )
+{
+  if ( ao_samples.sample_infos ) return ao_samples.sample_infos[i];
+
+  const CompactSampleInfo& compact = ao_samples.compact_sample_infos[i];
+  SampleInfo info;
+  info.tri_idx = compact.tri_idx;
+  info.bary[0] = compact.bary[0] / 65535.0f;
+  info.bary[1] = compact.bary[1] / 65535.0f;
+  info.bary[2] = std::max( 0.0f, 1.0f - info.bary[0] - info.bary[1] );
+  info.dA = ao_samples.tri_sample_dA[compact.tri_idx];
+  return info;
+}
+
+inline uint16_t encode_bary( const float b )
+{
+  return static_cast<uint16_t>( std::min( std::max( b, 0.0f ), 1.0f ) * 65535.0f + 0.5f );
+}
+
+
 size_t distribute_samples( 
   const Scene& scene,
-  const size_t min_samples_per_triangle, 
-  const size_t requested_num_samples, size_t* num_samples_per_instance );
+  const float min_samples_per_triangle, 
+  const size_t requested_num_samples, size_t* num_samples_per_instance,
+  SamplingPlan* plan );
 
 void sample_instances(
   const Scene& scene,
   const size_t* num_samples_per_instance, 
-  const size_t min_samples_per_triangle, AOSamples& ao_samples);
+  const float min_samples_per_triangle, AOSamples& ao_samples,
+  const SamplingPlan* plan, bool sample_templates );
+
+void sample_instance_range(
+  const Scene& scene,
+  const size_t* num_samples_per_instance,
+  const float min_samples_per_triangle,
+  const SamplingPlan* plan,
+  const size_t first_sample,
+  AOSamples& range_samples );
+
+void weigh_samples_by_variance(
+  const Scene& scene,
+  const size_t* num_samples_per_instance,
+  const AOSamples& pilot_samples, const float* pilot_ao,
+  SamplingPlan& plan );
+
+void sample_vertices(
+  const Scene& scene,
+  AOSamples& ao_samples );
+
+void place_samples(
+  const Scene& scene,
+  const size_t* num_samples_per_instance,
+  AOSamples& ao_samples );
+
+void sort_samples(
+  AOSamples& ao_samples,
+  const float bbox_min[3], const float bbox_max[3],
+  size_t* sorted_order );
+
+void tile_samples(
+  AOSamples& ao_samples,
+  const float bbox_min[3], const float bbox_max[3],
+  const float tile_size,
+  size_t* sorted_order,
+  std::vector<SampleTile>& tiles );
+
+void unsort_samples(
+  AOSamples& ao_samples,
+  const size_t* sorted_order,
+  float* ao_values, const size_t num_ao_channels );
+
+void sample_texels(
+  const Scene& scene,
+  const size_t instance_index,
+  const unsigned width, const unsigned height,
+  const unsigned first_row, const unsigned num_rows,
+  TexelSamples& texel_samples );
 
 }
 
@@ -25,12 +25,20 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstddef>
+#include <vector>
+
+// Elements per block for the area sum in distribute_samples_generic; smaller inputs run serially.
+const size_t DISTRIBUTE_SAMPLES_BLOCK_SIZE = 4096;
 
 // Distributes samples per element (instance, triangle, ...), satisfying two constraints:
 //  * total samples add up to num_samples
 //  * minimum number of samples per element
 // Any extra samples are placed according to area ratios.
-// The template param is for specifying area per element, and min samples per element.
+// The template param is for specifying area per element, and min samples per element; its methods
+// are called from multiple threads.
+// Runs in parallel over elements.  The result does not depend on the number of threads: areas are 
+// summed in fixed blocks, and leftover samples go to the first elements.
 template <class T> 
 void distribute_samples_generic(
   const T& callback,
@@ -39,10 +47,14 @@ void distribute_samples_generic(
   size_t* num_samples_per_element
   )
 {
+  const ptrdiff_t n = ptrdiff_t(num_elements);
+  const bool parallel = num_elements >= DISTRIBUTE_SAMPLES_BLOCK_SIZE;
+
   // First place minimum samples per element
   size_t sample_count = 0;  // For all elements
-  for (size_t i = 0; i < num_elements; ++i) {
-    num_samples_per_element[i] = callback.minSamples(i);
+#pragma omp parallel for if(parallel) reduction(+:sample_count)
+  for (ptrdiff_t i = 0; i < n; ++i) {
+    num_samples_per_element[i] = callback.minSamples(size_t(i));
     sample_count += num_samples_per_element[i];
   }
   
@@ -54,28 +66,54 @@ void distribute_samples_generic(
 
     const size_t num_area_based_samples = num_samples - sample_count;
 
-    // Compute surface area of each element
+    // Compute surface area of each element, as a fixed order sum of block sums
+    const ptrdiff_t num_blocks = ptrdiff_t( (num_elements + DISTRIBUTE_SAMPLES_BLOCK_SIZE - 1) / DISTRIBUTE_SAMPLES_BLOCK_SIZE );
+    std::vector<double> block_areas(num_blocks, 0.0);
+#pragma omp parallel for if(parallel)
+    for (ptrdiff_t b = 0; b < num_blocks; ++b) {
+      const size_t end = std::min( num_elements, size_t(b+1)*DISTRIBUTE_SAMPLES_BLOCK_SIZE );
+      double area = 0.0;
+      for (size_t i = size_t(b)*DISTRIBUTE_SAMPLES_BLOCK_SIZE; i < end; ++i) {
+        area += callback.area(i);
+      }
+      block_areas[b] = area;
+    }
     double total_area = 0.0;
-    for (size_t i = 0; i < num_elements; ++i) {
-      total_area += callback.area(i);
+    for (ptrdiff_t b = 0; b < num_blocks; ++b) {
+      total_area += block_areas[b];
     }
     
     // Distribute
-    for (size_t i = 0; i < num_elements && sample_count < num_samples; ++i) {
-      const size_t n = std::min(num_samples - sample_count, static_cast<size_t>(num_area_based_samples * callback.area(i) / total_area));
-      num_samples_per_element[i] += n;
-      sample_count += n;
+    size_t area_sample_count = 0;
+#pragma omp parallel for if(parallel) reduction(+:area_sample_count)
+    for (ptrdiff_t i = 0; i < n; ++i) {
+      const size_t k = static_cast<size_t>(num_area_based_samples * callback.area(size_t(i)) / total_area);
+      num_samples_per_element[i] += k;
+      area_sample_count += k;
     }
 
+    if (area_sample_count > num_area_based_samples) {
+      // Rounding overshoot; take the excess back from the last elements
+      size_t excess = area_sample_count - num_area_based_samples;
+      for (size_t i = num_elements; i > 0 && excess > 0; --i) {
+        const size_t k = std::min( excess, num_samples_per_element[i-1] - callback.minSamples(i-1) );
+        num_samples_per_element[i-1] -= k;
+        excess -= k;
+      }
+      area_sample_count = num_area_based_samples;
+    }
+    sample_count += area_sample_count;
+
     // There could be a few samples left over. Place one sample per element until target sample count is reached.
-    assert( num_samples - sample_count <= num_elements );
-    for (size_t i = 0; i < num_elements && sample_count < num_samples; ++i) {
+    const size_t num_leftover = num_samples - sample_count;
+    assert( num_leftover <= num_elements );
+#pragma omp parallel for if(parallel)
+    for (ptrdiff_t i = 0; i < ptrdiff_t(num_leftover); ++i) {
       num_samples_per_element[i] += 1;
-      sample_count += 1;
     }
+    sample_count += num_leftover;
   }
 
   assert(sample_count == num_samples);
 
 }
-
@@ -0,0 +1,502 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+// Mesh simplification by iterative edge collapses ordered by quadric error:
+// Surface Simplification Using Quadric Error Metrics, M. Garland, P. S. Heckbert, SIGGRAPH 1997
+
+
+#include "bake_api.h"
+#include "bake_simplify.h"
+#include "bake_util.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <queue>
+#include <string>
+#include <vector>
+
+
+namespace {
+
+const float  BOUNDARY_WEIGHT = 10.0f;     // weight of the planes that keep open borders in place
+const float  MIN_NORMAL_COSINE = 0.2f;    // collapses that turn a triangle further than this are rejected
+
+// Symmetric 4x4 matrix of a sum of squared distances to planes, upper triangle by rows
+struct Quadric
+{
+  double a[10];
+
+  Quadric() { std::fill( a, a+10, 0.0 ); }
+
+  void addPlane( const double n[3], const double d, const double w )
+  {
+    const double p[4] = { n[0], n[1], n[2], d };
+    int k = 0;
+    for (int i = 0; i < 4; ++i) {
+      for (int j = i; j < 4; ++j) a[k++] += w*p[i]*p[j];
+    }
+  }
+
+  Quadric& operator+=( const Quadric& q )
+  {
+    for (int k = 0; k < 10; ++k) a[k] += q.a[k];
+    return *this;
+  }
+
+  double error( const double v[3] ) const
+  {
+    const double x = v[0], y = v[1], z = v[2];
+    const double e = a[0]*x*x + 2*a[1]*x*y + 2*a[2]*x*z + 2*a[3]*x
+                   + a[4]*y*y + 2*a[5]*y*z + 2*a[6]*y
+                   + a[7]*z*z + 2*a[8]*z
+                   + a[9];
+    return std::max( e, 0.0 );
+  }
+
+  // The point of least error, if the quadric is well conditioned
+  bool minimum( double v[3] ) const
+  {
+    const double m00 = a[0], m01 = a[1], m02 = a[2];
+    const double m11 = a[4], m12 = a[5], m22 = a[7];
+    const double c00 = m11*m22 - m12*m12;
+    const double c01 = m02*m12 - m01*m22;
+    const double c02 = m01*m12 - m02*m11;
+    const double det = m00*c00 + m01*c01 + m02*c02;
+    const double scale = m00 + m11 + m22;
+    if ( !( std::fabs( det ) > 1e-12*scale*scale*scale ) ) return false;
+    const double c11 = m00*m22 - m02*m02;
+    const double c12 = m01*m02 - m00*m12;
+    const double c22 = m00*m11 - m01*m01;
+    const double b[3] = { -a[3], -a[6], -a[8] };
+    v[0] = ( c00*b[0] + c01*b[1] + c02*b[2] ) / det;
+    v[1] = ( c01*b[0] + c11*b[1] + c12*b[2] ) / det;
+    v[2] = ( c02*b[0] + c12*b[1] + c22*b[2] ) / det;
+    return true;
+  }
+};
+
+struct Collapse
+{
+  double   cost;
+  unsigned v0, v1;
+  unsigned stamp0, stamp1;  // vertex stamps when queued; the entry is stale once either changed
+
+  bool operator<( const Collapse& c ) const { return cost > c.cost; }  // least cost first in a priority_queue
+};
+
+class Simplifier
+{
+public:
+  Simplifier( const bake::Mesh& mesh );
+  void run( const size_t target_triangles );
+  void output( bake::ProxyMesh& proxy ) const;
+
+private:
+  void weld( const bake::Mesh& mesh );
+  void initQuadrics();
+  void queueEdge( const unsigned v0, const unsigned v1 );
+  void target( const unsigned v0, const unsigned v1, double p[3], double& cost ) const;
+  bool canCollapse( const unsigned v0, const unsigned v1, const double p[3] ) const;
+  void collapse( const unsigned v0, const unsigned v1, const double p[3] );
+  void neighbors( const unsigned v, std::vector<unsigned>& out ) const;
+  bool triangleNormal( const unsigned t, const unsigned moved, const double* p, double n[3] ) const;
+
+  std::vector<double>   m_positions;   // welded, 3 per vertex
+  std::vector<unsigned> m_triangles;   // 3 per triangle, into the welded vertices
+  std::vector<bool>     m_live;        // per triangle
+  std::vector< std::vector<unsigned> > m_vertex_triangles;  // may hold dead triangles
+  std::vector<Quadric>  m_quadrics;
+  std::vector<unsigned> m_stamps;
+  std::priority_queue<Collapse> m_queue;
+  size_t m_num_live;
+  double m_max_cost;
+};
+
+Simplifier::Simplifier( const bake::Mesh& mesh )
+  : m_num_live( 0 ), m_max_cost( 0.0 )
+{
+  weld( mesh );
+  initQuadrics();
+}
+
+// Vertices at the same position become one, so seams of normals or texcoords do not stop collapses
+void Simplifier::weld( const bake::Mesh& mesh )
+{
+  const unsigned stride = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+  const unsigned char* vertices = reinterpret_cast<const unsigned char*>( mesh.vertices );
+  std::vector< std::pair< std::pair<float, std::pair<float, float> >, unsigned > > keyed( mesh.num_vertices );
+  for (size_t v = 0; v < mesh.num_vertices; ++v) {
+    const float* p = reinterpret_cast<const float*>( vertices + v*stride );
+    keyed[v] = std::make_pair( std::make_pair( p[0], std::make_pair( p[1], p[2] ) ), unsigned( v ) );
+  }
+  std::sort( keyed.begin(), keyed.end() );
+  std::vector<unsigned> remap( mesh.num_vertices );
+  for (size_t k = 0; k < keyed.size(); ++k) {
+    if ( k == 0 || keyed[k].first != keyed[k-1].first ) {
+      m_positions.push_back( keyed[k].first.first );
+      m_positions.push_back( keyed[k].first.second.first );
+      m_positions.push_back( keyed[k].first.second.second );
+    }
+    remap[keyed[k].second] = unsigned( m_positions.size()/3 - 1 );
+  }
+
+  m_triangles.reserve( 3*mesh.num_triangles );
+  for (size_t t = 0; t < mesh.num_triangles; ++t) {
+    const unsigned a = remap[mesh.tri_vertex_indices[3*t]];
+    const unsigned b = remap[mesh.tri_vertex_indices[3*t+1]];
+    const unsigned c = remap[mesh.tri_vertex_indices[3*t+2]];
+    if ( a == b || b == c || c == a ) continue;
+    m_triangles.push_back( a );
+    m_triangles.push_back( b );
+    m_triangles.push_back( c );
+  }
+  m_num_live = m_triangles.size()/3;
+  m_live.assign( m_num_live, true );
+}
+
+void Simplifier::initQuadrics()
+{
+  const size_t num_vertices = m_positions.size()/3;
+  m_quadrics.assign( num_vertices, Quadric() );
+  m_stamps.assign( num_vertices, 0 );
+  m_vertex_triangles.assign( num_vertices, std::vector<unsigned>() );
+
+  // Directed edges, to find the borders: an edge without its twin has a single triangle
+  std::vector< std::pair< std::pair<unsigned, unsigned>, unsigned > > edges;  // (min, max), triangle
+  edges.reserve( m_triangles.size() );
+  for (size_t t = 0; t < m_num_live; ++t) {
+    double n[3];
+    const unsigned* tri = &m_triangles[3*t];
+    for (int k = 0; k < 3; ++k) m_vertex_triangles[tri[k]].push_back( unsigned( t ) );
+    if ( triangleNormal( unsigned( t ), unsigned(-1), NULL, n ) ) {
+      const double* p = &m_positions[3*tri[0]];
+      const double d = -( n[0]*p[0] + n[1]*p[1] + n[2]*p[2] );
+      for (int k = 0; k < 3; ++k) m_quadrics[tri[k]].addPlane( n, d, 1.0 );
+    }
+    for (int k = 0; k < 3; ++k) {
+      const unsigned a = tri[k], b = tri[(k+1)%3];
+      edges.push_back( std::make_pair( std::make_pair( std::min( a, b ), std::max( a, b ) ), unsigned( t ) ) );
+    }
+  }
+  std::sort( edges.begin(), edges.end() );
+
+  for (size_t e = 0; e < edges.size(); ) {
+    size_t end = e + 1;
+    while ( end < edges.size() && edges[end].first == edges[e].first ) ++end;
+    const unsigned a = edges[e].first.first, b = edges[e].first.second;
+    double n[3];
+    if ( end - e == 1 && triangleNormal( edges[e].second, unsigned(-1), NULL, n ) ) {
+      // A plane through the border edge, perpendicular to its triangle
+      const double* pa = &m_positions[3*a];
+      const double* pb = &m_positions[3*b];
+      const double u[3] = { pb[0]-pa[0], pb[1]-pa[1], pb[2]-pa[2] };
+      double m[3] = { u[1]*n[2] - u[2]*n[1], u[2]*n[0] - u[0]*n[2], u[0]*n[1] - u[1]*n[0] };
+      const double len = std::sqrt( m[0]*m[0] + m[1]*m[1] + m[2]*m[2] );
+      if ( len > 0.0 ) {
+        for (int k = 0; k < 3; ++k) m[k] /= len;
+        const double d = -( m[0]*pa[0] + m[1]*pa[1] + m[2]*pa[2] );
+        m_quadrics[a].addPlane( m, d, BOUNDARY_WEIGHT );
+        m_quadrics[b].addPlane( m, d, BOUNDARY_WEIGHT );
+      }
+    }
+    e = end;
+  }
+
+  for (size_t e = 0; e < edges.size(); ++e) {
+    if ( e > 0 && edges[e].first == edges[e-1].first ) continue;
+    queueEdge( edges[e].first.first, edges[e].first.second );
+  }
+}
+
+// Unit normal of triangle t, optionally with vertex 'moved' at p; false if degenerate
+bool Simplifier::triangleNormal( const unsigned t, const unsigned moved, const double* p, double n[3] ) const
+{
+  const double* q[3];
+  for (int k = 0; k < 3; ++k) {
+    const unsigned v = m_triangles[3*t+k];
+    q[k] = v == moved ? p : &m_positions[3*v];
+  }
+  const double e1[3] = { q[1][0]-q[0][0], q[1][1]-q[0][1], q[1][2]-q[0][2] };
+  const double e2[3] = { q[2][0]-q[0][0], q[2][1]-q[0][1], q[2][2]-q[0][2] };
+  n[0] = e1[1]*e2[2] - e1[2]*e2[1];
+  n[1] = e1[2]*e2[0] - e1[0]*e2[2];
+  n[2] = e1[0]*e2[1] - e1[1]*e2[0];
+  const double len = std::sqrt( n[0]*n[0] + n[1]*n[1] + n[2]*n[2] );
+  if ( !( len > 0.0 ) ) return false;
+  for (int k = 0; k < 3; ++k) n[k] /= len;
+  return true;
+}
+
+// Where the merged vertex goes: the minimum of the summed quadric when it lies near the edge, otherwise the
+// best of the end points and the midpoint
+void Simplifier::target( const unsigned v0, const unsigned v1, double p[3], double& cost ) const
+{
+  Quadric q = m_quadrics[v0];
+  q += m_quadrics[v1];
+  const double* a = &m_positions[3*v0];
+  const double* b = &m_positions[3*v1];
+  const double mid[3] = { 0.5*(a[0]+b[0]), 0.5*(a[1]+b[1]), 0.5*(a[2]+b[2]) };
+  const double len2 = (b[0]-a[0])*(b[0]-a[0]) + (b[1]-a[1])*(b[1]-a[1]) + (b[2]-a[2])*(b[2]-a[2]);
+  double v[3];
+  if ( q.minimum( v ) ) {
+    const double d2 = (v[0]-mid[0])*(v[0]-mid[0]) + (v[1]-mid[1])*(v[1]-mid[1]) + (v[2]-mid[2])*(v[2]-mid[2]);
+    if ( d2 <= len2 ) {
+      std::copy( v, v+3, p );
+      cost = q.error( p );
+      return;
+    }
+  }
+  const double* candidates[3] = { a, b, mid };
+  cost = -1.0;
+  for (int k = 0; k < 3; ++k) {
+    const double e = q.error( candidates[k] );
+    if ( cost < 0.0 || e < cost ) {
+      cost = e;
+      std::copy( candidates[k], candidates[k]+3, p );
+    }
+  }
+}
+
+void Simplifier::queueEdge( const unsigned v0, const unsigned v1 )
+{
+  double p[3];
+  Collapse c;
+  target( v0, v1, p, c.cost );
+  c.v0 = v0;
+  c.v1 = v1;
+  c.stamp0 = m_stamps[v0];
+  c.stamp1 = m_stamps[v1];
+  m_queue.push( c );
+}
+
+void Simplifier::neighbors( const unsigned v, std::vector<unsigned>& out ) const
+{
+  out.clear();
+  const std::vector<unsigned>& tris = m_vertex_triangles[v];
+  for (size_t i = 0; i < tris.size(); ++i) {
+    if ( !m_live[tris[i]] ) continue;
+    for (int k = 0; k < 3; ++k) {
+      const unsigned w = m_triangles[3*tris[i]+k];
+      if ( w != v ) out.push_back( w );
+    }
+  }
+  std::sort( out.begin(), out.end() );
+  out.erase( std::unique( out.begin(), out.end() ), out.end() );
+}
+
+// Rejects collapses that would make the surface non-manifold or fold triangles over
+bool Simplifier::canCollapse( const unsigned v0, const unsigned v1, const double p[3] ) const
+{
+  // The vertices adjacent to both must be the opposite corners of the triangles on the edge
+  std::vector<unsigned> n0, n1, common;
+  neighbors( v0, n0 );
+  neighbors( v1, n1 );
+  std::set_intersection( n0.begin(), n0.end(), n1.begin(), n1.end(), std::back_inserter( common ) );
+  size_t shared = 0;
+  const std::vector<unsigned>& tris0 = m_vertex_triangles[v0];
+  for (size_t i = 0; i < tris0.size(); ++i) {
+    const unsigned t = tris0[i];
+    if ( m_live[t] && ( m_triangles[3*t] == v1 || m_triangles[3*t+1] == v1 || m_triangles[3*t+2] == v1 ) ) ++shared;
+  }
+  if ( common.size() > shared ) return false;
+
+  const unsigned ends[2] = { v0, v1 };
+  for (int e = 0; e < 2; ++e) {
+    const std::vector<unsigned>& tris = m_vertex_triangles[ends[e]];
+    for (size_t i = 0; i < tris.size(); ++i) {
+      const unsigned t = tris[i];
+      if ( !m_live[t] ) continue;
+      const unsigned* tri = &m_triangles[3*t];
+      if ( tri[0] == ends[1-e] || tri[1] == ends[1-e] || tri[2] == ends[1-e] ) continue;  // removed by the collapse
+      double before[3], after[3];
+      if ( !triangleNormal( t, unsigned(-1), NULL, before ) ) continue;
+      if ( !triangleNormal( t, ends[e], p, after ) ) return false;
+      if ( before[0]*after[0] + before[1]*after[1] + before[2]*after[2] < MIN_NORMAL_COSINE ) return false;
+    }
+  }
+  return true;
+}
+
+// Merges v1 into v0, at p
+void Simplifier::collapse( const unsigned v0, const unsigned v1, const double p[3] )
+{
+  std::copy( p, p+3, &m_positions[3*v0] );
+  m_quadrics[v0] += m_quadrics[v1];
+  ++m_stamps[v0];
+  ++m_stamps[v1];
+
+  std::vector<unsigned> tris;
+  const std::vector<unsigned>& tris0 = m_vertex_triangles[v0];
+  for (size_t i = 0; i < tris0.size(); ++i) {
+    if ( m_live[tris0[i]] ) tris.push_back( tris0[i] );
+  }
+  const std::vector<unsigned>& tris1 = m_vertex_triangles[v1];
+  for (size_t i = 0; i < tris1.size(); ++i) {
+    const unsigned t = tris1[i];
+    if ( !m_live[t] ) continue;
+    unsigned* tri = &m_triangles[3*t];
+    if ( tri[0] == v0 || tri[1] == v0 || tri[2] == v0 ) {
+      m_live[t] = false;
+      --m_num_live;
+      continue;
+    }
+    for (int k = 0; k < 3; ++k) {
+      if ( tri[k] == v1 ) tri[k] = v0;
+    }
+    tris.push_back( t );
+  }
+  // Triangles of v0 on the collapsed edge are dead now
+  size_t out = 0;
+  for (size_t i = 0; i < tris.size(); ++i) {
+    if ( m_live[tris[i]] ) tris[out++] = tris[i];
+  }
+  tris.resize( out );
+  m_vertex_triangles[v0].swap( tris );
+  std::vector<unsigned>().swap( m_vertex_triangles[v1] );
+
+  std::vector<unsigned> adjacent;
+  neighbors( v0, adjacent );
+  for (size_t i = 0; i < adjacent.size(); ++i) queueEdge( v0, adjacent[i] );
+}
+
+void Simplifier::run( const size_t target_triangles )
+{
+  while ( m_num_live > target_triangles && !m_queue.empty() ) {
+    const Collapse c = m_queue.top();
+    m_queue.pop();
+    if ( c.stamp0 != m_stamps[c.v0] || c.stamp1 != m_stamps[c.v1] ) continue;
+    double p[3], cost;
+    target( c.v0, c.v1, p, cost );
+    if ( !canCollapse( c.v0, c.v1, p ) ) continue;  // queued again when a collapse at either end changes it
+    collapse( c.v0, c.v1, p );
+    m_max_cost = std::max( m_max_cost, cost );
+  }
+}
+
+void Simplifier::output( bake::ProxyMesh& proxy ) const
+{
+  std::vector<unsigned> remap( m_positions.size()/3, unsigned(-1) );
+  proxy.vertices.clear();
+  proxy.indices.clear();
+  proxy.indices.reserve( 3*m_num_live );
+  for (size_t t = 0; t < m_live.size(); ++t) {
+    if ( !m_live[t] ) continue;
+    for (int k = 0; k < 3; ++k) {
+      const unsigned v = m_triangles[3*t+k];
+      if ( remap[v] == unsigned(-1) ) {
+        remap[v] = unsigned( proxy.vertices.size()/3 );
+        for (int j = 0; j < 3; ++j) proxy.vertices.push_back( float( m_positions[3*v+j] ) );
+      }
+      proxy.indices.push_back( remap[v] );
+    }
+  }
+  proxy.max_error = float( std::sqrt( m_max_cost ) );
+}
+
+
+// One file per proxy: a header, the float3 vertices, then the triangle indices
+const char PROXY_CACHE_MAGIC[8] = { 'B', 'A', 'K', 'E', 'P', 'R', 'X', '1' };
+
+struct ProxyCacheHeader
+{
+  char     magic[8];
+  uint64_t key;
+  uint64_t num_vertices;
+  uint64_t num_triangles;
+  float    max_error;
+  uint32_t reserved;
+};
+
+std::string proxy_cache_filename( const char* dir, const uint64_t key )
+{
+  char name[64];
+  sprintf( name, "proxy_%016llx.bin", (unsigned long long)key );
+  std::string filename( dir );
+  if ( !filename.empty() && filename[filename.size()-1] != '/' && filename[filename.size()-1] != '\\' ) filename += '/';
+  return filename + name;
+}
+
+} // namespace
+
+
+void bake::simplify_mesh( const Mesh& mesh, const size_t target_triangles, ProxyMesh& proxy )
+{
+  Simplifier simplifier( mesh );
+  simplifier.run( target_triangles );
+  simplifier.output( proxy );
+}
+
+bool bake::load_proxy_mesh( const char* cache_dir, const uint64_t key, ProxyMesh& proxy )
+{
+  FILE* file = fopen( proxy_cache_filename( cache_dir, key ).c_str(), "rb" );
+  if ( !file ) return false;
+  ProxyCacheHeader header;
+  bool ok = fread( &header, sizeof(header), 1, file ) == 1 && memcmp( header.magic, PROXY_CACHE_MAGIC, sizeof(header.magic) ) == 0 &&
+    header.key == key && header.num_triangles > 0;
+  if ( ok ) {
+    proxy.vertices.resize( size_t( 3*header.num_vertices ) );
+    proxy.indices.resize( size_t( 3*header.num_triangles ) );
+    proxy.max_error = header.max_error;
+    ok = fread( &proxy.vertices[0], sizeof(float), proxy.vertices.size(), file ) == proxy.vertices.size() &&
+         fread( &proxy.indices[0], sizeof(unsigned), proxy.indices.size(), file ) == proxy.indices.size();
+  }
+  for (size_t i = 0; ok && i < proxy.indices.size(); ++i) {
+    ok = proxy.indices[i] < header.num_vertices;
+  }
+  fclose( file );
+  return ok;
+}
+
+bool bake::save_proxy_mesh( const char* cache_dir, const uint64_t key, const ProxyMesh& proxy )
+{
+  if ( proxy.indices.empty() ) return false;
+  ProxyCacheHeader header;
+  memset( &header, 0, sizeof(header) );
+  memcpy( header.magic, PROXY_CACHE_MAGIC, sizeof(header.magic) );
+  header.key = key;
+  header.num_vertices = proxy.vertices.size()/3;
+  header.num_triangles = proxy.indices.size()/3;
+  header.max_error = proxy.max_error;
+
+  // Write to a temporary name so an interrupted run never leaves a truncated file that looks valid
+  const std::string filename = proxy_cache_filename( cache_dir, key );
+  char suffix[32];
+  sprintf( suffix, ".tmp%d", threadIndex() );
+  const std::string temp_filename = filename + suffix;
+  FILE* file = fopen( temp_filename.c_str(), "wb" );
+  if ( !file ) return false;
+  bool ok = fwrite( &header, sizeof(header), 1, file ) == 1 &&
+    fwrite( &proxy.vertices[0], sizeof(float), proxy.vertices.size(), file ) == proxy.vertices.size() &&
+    fwrite( &proxy.indices[0], sizeof(unsigned), proxy.indices.size(), file ) == proxy.indices.size();
+  ok = fclose( file ) == 0 && ok;
+  if ( ok ) {
+    remove( filename.c_str() );
+    ok = rename( temp_filename.c_str(), filename.c_str() ) == 0;
+  }
+  if ( !ok ) remove( temp_filename.c_str() );
+  return ok;
+}
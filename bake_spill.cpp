@@ -0,0 +1,588 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+// Sample sets kept in a scratch file instead of host memory.  The file holds the sample geometry in blocks of
+// block_size samples, with the positions, normals and face normals of a block one after the other, then the sample
+// infos and the AO of all samples.  Transfers are asynchronous, with POSIX AIO or overlapped I/O on Windows, so 
+// reads of the next blocks and writes of finished AO overlap the trace.
+
+#include "bake_spill.h"
+#include "bake_util.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <aio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+
+namespace {
+
+// Blocks read ahead of the last one a batch asked for, and buffers besides those for the batches of several devices
+const size_t READ_AHEAD_BLOCKS = 4;
+const size_t STAGED_BLOCKS = 4;
+// Writes in flight before the oldest is waited for
+const size_t MAX_WRITES_IN_FLIGHT = 16;
+// Largest single transfer; longer ones are split, as overlapped I/O counts bytes in 32 bits
+const size_t MAX_TRANSFER_BYTES = size_t(1) << 30;
+// Positions, normals and face normals
+const size_t GEOMETRY_FLOATS_PER_SAMPLE = 9;
+
+// One read or write of the scratch file.  Writes of data the caller doesn't keep go from buffer.
+struct Transfer
+{
+#if defined(_WIN32)
+  OVERLAPPED         overlapped;
+#else
+  aiocb              cb;
+#endif
+  char*              data;
+  size_t             bytes;
+  uint64_t           offset;
+  bool               write;
+  bool               pending;
+  std::vector<char>  buffer;
+
+  Transfer() : data( NULL ), bytes( 0 ), offset( 0 ), write( false ), pending( false ) {}
+  Transfer( const uint64_t offset_, void* data_, const size_t bytes_, const bool write_ ) 
+    : data( static_cast<char*>( data_ ) ), bytes( bytes_ ), offset( offset_ ), write( write_ ), pending( false ) {}
+};
+
+// Scratch file that goes away when closed
+class ScratchFile
+{
+public:
+  // Blocking transfer of any size, in pieces
+  bool transfer( uint64_t offset, void* data, size_t bytes, const bool write )
+  {
+    char* p = static_cast<char*>( data );
+    while ( bytes > 0 ) {
+      Transfer t( offset, p, std::min( bytes, MAX_TRANSFER_BYTES ), write );
+      if ( !begin( t ) || !finish( t ) ) return false;
+      p += t.bytes;
+      offset += t.bytes;
+      bytes -= t.bytes;
+    }
+    return true;
+  }
+
+#if defined(_WIN32)
+  ScratchFile() : m_handle( INVALID_HANDLE_VALUE ) {}
+  ~ScratchFile() { close(); }
+
+  bool open( const char* directory, const uint64_t bytes )
+  {
+    char filename[MAX_PATH];
+    if ( !GetTempFileNameA( directory, "bks", 0, filename ) ) return false;
+    m_handle = CreateFileA( filename, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 
+                            FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE | FILE_FLAG_OVERLAPPED, NULL );
+    if ( m_handle == INVALID_HANDLE_VALUE ) {
+      DeleteFileA( filename );
+      return false;
+    }
+    LARGE_INTEGER size;
+    size.QuadPart = (LONGLONG)bytes;
+    return SetFilePointerEx( m_handle, size, NULL, FILE_BEGIN ) && SetEndOfFile( m_handle );
+  }
+
+  void close()
+  {
+    if ( m_handle != INVALID_HANDLE_VALUE ) CloseHandle( m_handle );
+    m_handle = INVALID_HANDLE_VALUE;
+  }
+
+  bool begin( Transfer& t )
+  {
+    assert( t.bytes <= MAX_TRANSFER_BYTES );
+    std::memset( &t.overlapped, 0, sizeof( t.overlapped ) );
+    t.overlapped.Offset = DWORD( t.offset );
+    t.overlapped.OffsetHigh = DWORD( t.offset >> 32 );
+    t.overlapped.hEvent = CreateEventA( NULL, TRUE, FALSE, NULL );
+    if ( !t.overlapped.hEvent ) return false;
+    const BOOL started = t.write ? WriteFile( m_handle, t.data, DWORD( t.bytes ), NULL, &t.overlapped ) :
+                                   ReadFile( m_handle, t.data, DWORD( t.bytes ), NULL, &t.overlapped );
+    if ( !started && GetLastError() != ERROR_IO_PENDING ) {
+      CloseHandle( t.overlapped.hEvent );
+      return false;
+    }
+    t.pending = true;
+    return true;
+  }
+
+  bool done( Transfer& t ) const { return !t.pending || HasOverlappedIoCompleted( &t.overlapped ); }
+
+  bool finish( Transfer& t )
+  {
+    if ( !t.pending ) return true;
+    DWORD n = 0;
+    const bool ok = GetOverlappedResult( m_handle, &t.overlapped, &n, TRUE ) && size_t( n ) == t.bytes;
+    CloseHandle( t.overlapped.hEvent );
+    t.pending = false;
+    return ok;
+  }
+
+private:
+  HANDLE m_handle;
+#else
+  ScratchFile() : m_fd( -1 ) {}
+  ~ScratchFile() { close(); }
+
+  bool open( const char* directory, const uint64_t bytes )
+  {
+    const std::string pattern = std::string( directory ) + "/bake_spill_XXXXXX";
+    std::vector<char> filename( pattern.begin(), pattern.end() );
+    filename.push_back( '\0' );
+    m_fd = mkstemp( &filename[0] );
+    if ( m_fd < 0 ) return false;
+    // Unlinked right away, so the blocks go when the file is closed, however the bake ends
+    unlink( &filename[0] );
+    return ftruncate( m_fd, (off_t)bytes ) == 0;
+  }
+
+  void close()
+  {
+    if ( m_fd >= 0 ) ::close( m_fd );
+    m_fd = -1;
+  }
+
+  bool begin( Transfer& t )
+  {
+    std::memset( &t.cb, 0, sizeof( t.cb ) );
+    t.cb.aio_fildes = m_fd;
+    t.cb.aio_offset = (off_t)t.offset;
+    t.cb.aio_buf = t.data;
+    t.cb.aio_nbytes = t.bytes;
+    t.cb.aio_sigevent.sigev_notify = SIGEV_NONE;
+    if ( (t.write ? aio_write( &t.cb ) : aio_read( &t.cb )) != 0 ) {
+      // Out of AIO resources; transfer now instead
+      t.pending = false;
+      return transferNow( t.data, t.bytes, t.offset, t.write );
+    }
+    t.pending = true;
+    return true;
+  }
+
+  bool done( Transfer& t ) const { return !t.pending || aio_error( &t.cb ) != EINPROGRESS; }
+
+  bool finish( Transfer& t )
+  {
+    if ( !t.pending ) return true;
+    int error;
+    while ( (error = aio_error( &t.cb )) == EINPROGRESS ) {
+      const aiocb* list[1] = { &t.cb };
+      aio_suspend( list, 1, NULL );
+    }
+    const ssize_t n = aio_return( &t.cb );
+    t.pending = false;
+    if ( error != 0 || n < 0 ) return false;
+    // The rest of a short transfer goes synchronously
+    return size_t( n ) == t.bytes || transferNow( t.data + n, t.bytes - size_t( n ), t.offset + uint64_t( n ), t.write );
+  }
+
+private:
+  bool transferNow( char* data, size_t bytes, uint64_t offset, const bool write )
+  {
+    while ( bytes > 0 ) {
+      const ssize_t n = write ? pwrite( m_fd, data, bytes, (off_t)offset ) : pread( m_fd, data, bytes, (off_t)offset );
+      if ( n < 0 && errno == EINTR ) continue;
+      if ( n <= 0 ) return false;
+      data += n;
+      bytes -= size_t( n );
+      offset += uint64_t( n );
+    }
+    return true;
+  }
+
+  int m_fd;
+#endif
+  ScratchFile( const ScratchFile& );            // forbidden
+  ScratchFile& operator=( const ScratchFile& ); // forbidden
+};
+
+// Transfers in flight, finished oldest first, at most max_in_flight of them
+class TransferQueue
+{
+public:
+  TransferQueue( ScratchFile& file, const size_t max_in_flight ) : m_file( file ), m_max_in_flight( max_in_flight ), m_ok( true ) {}
+  ~TransferQueue() { drain(); }
+
+  // Takes ownership of t
+  void push( Transfer* t )
+  {
+    while ( !m_pending.empty() && (m_pending.size() >= m_max_in_flight || m_file.done( *m_pending.front() )) ) {
+      finishOldest();
+    }
+    if ( m_file.begin( *t ) ) {
+      m_pending.push_back( t );
+    } else {
+      m_ok = false;
+      delete t;
+    }
+  }
+
+  // False if any transfer failed
+  bool drain()
+  {
+    while ( !m_pending.empty() ) finishOldest();
+    return m_ok;
+  }
+
+private:
+  void finishOldest()
+  {
+    Transfer* t = m_pending.front();
+    m_pending.pop_front();
+    if ( !m_file.finish( *t ) ) m_ok = false;
+    delete t;
+  }
+
+  ScratchFile&          m_file;
+  const size_t          m_max_in_flight;
+  std::deque<Transfer*> m_pending;
+  bool                  m_ok;
+
+  TransferQueue& operator=( const TransferQueue& ); // forbidden
+};
+
+// Buffer of a block of sample geometry during a trace
+struct BlockSlot
+{
+  size_t    block;    // SIZE_MAX when empty
+  float*    data;
+  Transfer  read;
+  bool      reading;  // read started and not yet waited for
+  int       users;    // batches copying from it, or waiting for its read
+  Mutex     wait;     // held by the user that waits for the read
+
+  BlockSlot() : block( SIZE_MAX ), data( NULL ), reading( false ), users( 0 ) {}
+};
+
+} // end namespace
+
+
+namespace bake {
+
+struct SampleSpill
+{
+  ScratchFile  file;
+  size_t       num_samples;
+  size_t       block_size;
+  size_t       num_blocks;
+  size_t       block_bytes;
+  uint64_t     infos_offset;
+  uint64_t     ao_offset;
+
+  // A trace in progress
+  Mutex                    slot_lock;
+  std::vector<BlockSlot*>  slots;
+  bool                     read_ok;
+  uint64_t                 bytes_read;
+  double                   read_wait_seconds;
+  Mutex                    write_lock;
+  TransferQueue*           ao_writes;
+  uint64_t                 bytes_written;
+
+  SampleSpill() : num_samples( 0 ), block_size( 0 ), num_blocks( 0 ), block_bytes( 0 ), infos_offset( 0 ), ao_offset( 0 ),
+    read_ok( true ), bytes_read( 0 ), read_wait_seconds( 0.0 ), ao_writes( NULL ), bytes_written( 0 ) {}
+};
+
+}
+
+
+namespace {
+
+BlockSlot* find_block( bake::SampleSpill& spill, const size_t block )
+{
+  for (size_t i = 0; i < spill.slots.size(); ++i) {
+    if ( spill.slots[i]->block == block ) return spill.slots[i];
+  }
+  return NULL;
+}
+
+// Unused buffer for another block: an empty one, else the one of the earliest block below evict_below.  A read ahead
+// still in flight is waited for.  NULL if there is none.
+BlockSlot* free_slot( bake::SampleSpill& spill, const size_t evict_below )
+{
+  BlockSlot* best = NULL;
+  for (size_t i = 0; i < spill.slots.size(); ++i) {
+    BlockSlot* slot = spill.slots[i];
+    if ( slot->users > 0 ) continue;
+    if ( slot->block == SIZE_MAX ) return slot;
+    if ( slot->block < evict_below && (!best || slot->block < best->block) ) best = slot;
+  }
+  if ( best && best->reading ) {
+    if ( !spill.file.finish( best->read ) ) spill.read_ok = false;
+    best->reading = false;
+  }
+  return best;
+}
+
+void start_read( bake::SampleSpill& spill, BlockSlot& slot, const size_t block )
+{
+  slot.block = block;
+  slot.read = Transfer( uint64_t( block )*spill.block_bytes, slot.data, spill.block_bytes, false );
+  slot.reading = spill.file.begin( slot.read );
+  if ( !slot.reading ) spill.read_ok = false;
+  spill.bytes_read += spill.block_bytes;
+}
+
+// The buffer of a block, read if it isn't already, and waited for
+BlockSlot* acquire_block( bake::SampleSpill& spill, const size_t block )
+{
+  BlockSlot* slot = NULL;
+  for (;;) {
+    {
+      ScopedLock lock( spill.slot_lock );
+      slot = find_block( spill, block );
+      if ( !slot && (slot = free_slot( spill, SIZE_MAX )) != NULL ) start_read( spill, *slot, block );
+      if ( slot ) slot->users++;
+    }
+    if ( slot ) break;
+    // Every buffer holds a block other devices are staging
+    sleepMilliseconds( 0.1 );
+  }
+
+  Timer timer;
+  timer.start();
+  slot->wait.lock();
+  if ( slot->reading ) {
+    const bool ok = spill.file.finish( slot->read );
+    slot->reading = false;
+    if ( !ok ) {
+      std::fill( slot->data, slot->data + spill.block_bytes/sizeof(float), 0.0f );
+      ScopedLock lock( spill.slot_lock );
+      spill.read_ok = false;
+    }
+  }
+  slot->wait.unlock();
+  timer.stop();
+  ScopedLock lock( spill.slot_lock );
+  spill.read_wait_seconds += timer.elapsed;
+  return slot;
+}
+
+// Done with the block; the blocks after it are read ahead into buffers of earlier ones
+void release_block( bake::SampleSpill& spill, BlockSlot* slot )
+{
+  ScopedLock lock( spill.slot_lock );
+  slot->users--;
+  const size_t block = slot->block;
+  const size_t end = std::min( block + 1 + READ_AHEAD_BLOCKS, spill.num_blocks );
+  for (size_t ahead = block + 1; ahead < end; ++ahead) {
+    if ( find_block( spill, ahead ) ) continue;
+    BlockSlot* free = free_slot( spill, block );
+    if ( !free ) break;
+    start_read( spill, *free, ahead );
+  }
+}
+
+} // end namespace
+
+
+bake::SampleSpill* bake::create_sample_spill(
+    const char*   directory,
+    const size_t  num_samples,
+    const size_t  block_size
+    )
+{
+  SampleSpill* spill = new SampleSpill;
+  spill->num_samples = num_samples;
+  spill->block_size = std::max( std::min( block_size, MAX_TRANSFER_BYTES / (GEOMETRY_FLOATS_PER_SAMPLE*sizeof(float)) ), size_t(1) );
+  spill->num_blocks = ( num_samples + spill->block_size - 1 ) / spill->block_size;
+  spill->block_bytes = spill->block_size*GEOMETRY_FLOATS_PER_SAMPLE*sizeof(float);
+  spill->infos_offset = uint64_t( spill->num_blocks )*spill->block_bytes;
+  spill->ao_offset = spill->infos_offset + uint64_t( num_samples )*sizeof(SampleInfo);
+  if ( !spill->file.open( directory, spill->ao_offset + uint64_t( num_samples )*sizeof(float) ) ) {
+    delete spill;
+    return NULL;
+  }
+  return spill;
+}
+
+
+void bake::destroy_sample_spill( SampleSpill* spill )
+{
+  if ( !spill ) return;
+  assert( spill->slots.empty() && !spill->ao_writes );
+  delete spill;
+}
+
+
+size_t bake::spilled_sample_count( const SampleSpill* spill )
+{
+  return spill->num_samples;
+}
+
+
+size_t bake::spill_block_size( const SampleSpill* spill )
+{
+  return spill->block_size;
+}
+
+
+bool bake::spill_samples(
+    SampleSpill*      spill,
+    const AOSamples&  ao_samples,
+    const size_t      first_sample
+    )
+{
+  assert( ao_samples.sample_positions && ao_samples.sample_normals && ao_samples.sample_face_normals && ao_samples.sample_infos );
+  assert( ao_samples.sample_memory == MEMORY_SPACE_HOST );
+  assert( first_sample + ao_samples.num_samples <= spill->num_samples );
+  ProfileRange range( "spill samples", PROFILE_COLOR_SAMPLE, uint64_t( ao_samples.num_samples ) );
+
+  // Each array goes to its part of each block the samples touch
+  const size_t n = ao_samples.num_samples;
+  const size_t block_size = spill->block_size;
+  float* arrays[3] = { ao_samples.sample_positions, ao_samples.sample_normals, ao_samples.sample_face_normals };
+  TransferQueue writes( spill->file, MAX_WRITES_IN_FLIGHT );
+  for (size_t s = 0; s < n; ) {
+    const size_t block = (first_sample + s) / block_size;
+    const size_t in_block = (first_sample + s) % block_size;
+    const size_t count = std::min( block_size - in_block, n - s );
+    for (int k = 0; k < 3; ++k) {
+      const uint64_t offset = uint64_t( block )*spill->block_bytes + (k*block_size + in_block)*3*sizeof(float);
+      writes.push( new Transfer( offset, arrays[k] + 3*s, count*3*sizeof(float), true ) );
+    }
+    s += count;
+  }
+  const bool ok = writes.drain() && 
+    spill->file.transfer( spill->infos_offset + uint64_t( first_sample )*sizeof(SampleInfo), ao_samples.sample_infos, 
+                          n*sizeof(SampleInfo), true );
+  recordCount( "spill.bytes_written", uint64_t( n )*( GEOMETRY_FLOATS_PER_SAMPLE*sizeof(float) + sizeof(SampleInfo) ) );
+  return ok;
+}
+
+
+bool bake::read_spilled_samples(
+    SampleSpill*  spill,
+    const size_t  first_sample,
+    const size_t  num_samples,
+    SampleInfo*   sample_infos,
+    float*        ao_values
+    )
+{
+  assert( first_sample + num_samples <= spill->num_samples );
+  ProfileRange range( "read spilled samples", PROFILE_COLOR_FILTER, uint64_t( num_samples ) );
+  recordCount( "spill.bytes_read", uint64_t( num_samples )*( sizeof(SampleInfo) + sizeof(float) ) );
+  return spill->file.transfer( spill->infos_offset + uint64_t( first_sample )*sizeof(SampleInfo), sample_infos, 
+                               num_samples*sizeof(SampleInfo), false ) &&
+         spill->file.transfer( spill->ao_offset + uint64_t( first_sample )*sizeof(float), ao_values, num_samples*sizeof(float), false );
+}
+
+
+void bake::begin_spilled_trace( SampleSpill* spill )
+{
+  assert( spill->slots.empty() && !spill->ao_writes );
+  const size_t num_slots = std::min( READ_AHEAD_BLOCKS + STAGED_BLOCKS, std::max( spill->num_blocks, size_t(1) ) );
+  for (size_t i = 0; i < num_slots; ++i) {
+    BlockSlot* slot = new BlockSlot;
+    slot->data = static_cast<float*>( allocateHostMemory( spill->block_bytes, false ) );
+    spill->slots.push_back( slot );
+  }
+  spill->read_ok = true;
+  spill->bytes_read = 0;
+  spill->read_wait_seconds = 0.0;
+  spill->ao_writes = new TransferQueue( spill->file, MAX_WRITES_IN_FLIGHT );
+  spill->bytes_written = 0;
+
+  // The first blocks are on their way before the tracer asks
+  for (size_t b = 0; b < std::min( READ_AHEAD_BLOCKS, spill->num_blocks ); ++b) {
+    start_read( *spill, *spill->slots[b], b );
+  }
+}
+
+
+bool bake::end_spilled_trace( SampleSpill* spill )
+{
+  bool ok = spill->ao_writes->drain() && spill->read_ok;
+  delete spill->ao_writes;
+  spill->ao_writes = NULL;
+  for (size_t i = 0; i < spill->slots.size(); ++i) {
+    BlockSlot* slot = spill->slots[i];
+    if ( slot->reading ) spill->file.finish( slot->read );
+    freeHostMemory( slot->data );
+    delete slot;
+  }
+  spill->slots.clear();
+
+  recordCount( "spill.bytes_read", spill->bytes_read );
+  recordCount( "spill.bytes_written", spill->bytes_written );
+  recordTime( "spill.read_wait", spill->read_wait_seconds );
+  return ok;
+}
+
+
+void bake::provide_spilled_samples( void* data, const size_t first_sample, const size_t num_samples, 
+                                    float* positions, float* normals, float* face_normals )
+{
+  SampleSpill& spill = *static_cast<SampleSpill*>( data );
+  const size_t block_size = spill.block_size;
+  float* arrays[3] = { positions, normals, face_normals };
+  for (size_t s = 0; s < num_samples; ) {
+    const size_t block = (first_sample + s) / block_size;
+    const size_t in_block = (first_sample + s) % block_size;
+    const size_t count = std::min( block_size - in_block, num_samples - s );
+    BlockSlot* slot = acquire_block( spill, block );
+    for (int k = 0; k < 3; ++k) {
+      const float* from = slot->data + 3*(k*block_size + in_block);
+      std::copy( from, from + 3*count, arrays[k] + 3*s );
+    }
+    release_block( spill, slot );
+    s += count;
+  }
+}
+
+
+void bake::write_back_spilled_ao( void* data, const size_t first_sample, const size_t num_samples, const float* ao,
+                                  const size_t num_channels )
+{
+  // Only the first channel is spilled; ao is only valid for the call, so the write goes from a copy
+  (void)num_channels;
+  if ( num_samples == 0 ) return;
+  SampleSpill& spill = *static_cast<SampleSpill*>( data );
+  Transfer* t = new Transfer;
+  t->buffer.assign( reinterpret_cast<const char*>( ao ), reinterpret_cast<const char*>( ao + num_samples ) );
+  t->data = &t->buffer[0];
+  t->bytes = num_samples*sizeof(float);
+  t->offset = spill.ao_offset + uint64_t( first_sample )*sizeof(float);
+  t->write = true;
+  ScopedLock lock( spill.write_lock );
+  spill.bytes_written += t->bytes;
+  spill.ao_writes->push( t );
+}
@@ -0,0 +1,63 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#include "bake_api.h"
+
+namespace bake {
+
+SampleSpill* create_sample_spill(
+    const char*   directory,
+    const size_t  num_samples,
+    const size_t  block_size
+    );
+
+void destroy_sample_spill( SampleSpill* spill );
+
+size_t spilled_sample_count( const SampleSpill* spill );
+size_t spill_block_size( const SampleSpill* spill );
+
+bool spill_samples(
+    SampleSpill*      spill,
+    const AOSamples&  ao_samples,
+    const size_t      first_sample
+    );
+
+bool read_spilled_samples(
+    SampleSpill*  spill,
+    const size_t  first_sample,
+    const size_t  num_samples,
+    SampleInfo*   sample_infos,  // output
+    float*        ao_values      // output
+    );
+
+// A trace of the spilled samples: the provider reads blocks ahead of the batch asked for, and the batch callback 
+// writes AO back without waiting for it.  end_spilled_trace waits for the I/O still in flight.
+void begin_spilled_trace( SampleSpill* spill );
+bool end_spilled_trace( SampleSpill* spill );
+
+void provide_spilled_samples( void* spill, const size_t first_sample, const size_t num_samples, 
+                              float* positions, float* normals, float* face_normals );
+void write_back_spilled_ao( void* spill, const size_t first_sample, const size_t num_samples, const float* ao,
+                            const size_t num_channels );
+
+}
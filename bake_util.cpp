@@ -22,8 +22,17 @@
 -----------------------------------------------------------------------*/
 
 #include "bake_util.h"
+#include "bake_api.h"
+#include "Buffer.h"
+#include <cuda_runtime.h>
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <string>
 
 // System timing code copied from OptiX SDK
 #if defined(_WIN32)
@@ -32,8 +41,14 @@
 #    include<mmsystem.h>
 #else /*Apple and Linux both use this */
 #    include<sys/time.h>
+#    include <sys/resource.h>
 #    include <unistd.h>
 #    include <dirent.h>
+#    include <sys/mman.h>
+#endif
+#if defined(__linux__)
+#    include <sched.h>
+#    include <sstream>
 #endif
 
 #if defined(_WIN32)
@@ -90,6 +105,15 @@ double Timer::stop( )
   sutilCurrentTime( &t1 ); elapsed += t1-t0; return t1;
 }
 
+void sleepMilliseconds( const double ms )
+{
+#if defined(_WIN32)
+  Sleep( DWORD( ms + 0.5 ) );
+#else
+  usleep( useconds_t( ms*1000.0 ) );
+#endif
+}
+
 void printTimeElapsed( Timer& t )
 {
   if (t.t1 < t.t0) t.stop();
@@ -98,3 +122,814 @@ void printTimeElapsed( Timer& t )
             << std::setprecision( 2 ) 
             << t.elapsed * 1000.0 << " ms" << std::endl;
 }
+
+
+void ParallelTimer::add( const Timer& t )
+{
+  const double item = t.t1 - t.t0;
+  ScopedLock lock( mutex );
+  if ( num_items == 0 || t.t0 < first_start ) first_start = t.t0;
+  if ( num_items == 0 || t.t1 > last_stop ) last_stop = t.t1;
+  total += item;
+  max_item = std::max( max_item, item );
+  num_items++;
+}
+
+void ParallelTimer::add( const ParallelTimer& t )
+{
+  if ( t.num_items == 0 ) return;
+  ScopedLock lock( mutex );
+  if ( num_items == 0 || t.first_start < first_start ) first_start = t.first_start;
+  if ( num_items == 0 || t.last_stop > last_stop ) last_stop = t.last_stop;
+  total += t.total;
+  max_item = std::max( max_item, t.max_item );
+  num_items += t.num_items;
+}
+
+namespace {
+// Larger first; ties in item and range order, so the schedule doesn't depend on the sort
+bool largerRange( const WorkRange& a, const WorkRange& b )
+{
+  const size_t na = a.end - a.begin, nb = b.end - b.begin;
+  if ( na != nb ) return na > nb;
+  return a.item != b.item ? a.item < b.item : a.begin < b.begin;
+}
+}
+
+void splitWork( const std::vector<size_t>& costs, std::vector<WorkRange>& ranges, size_t min_range )
+{
+  size_t total = 0;
+  for ( size_t i = 0; i < costs.size(); ++i ) total += costs[i];
+  const size_t range_size = std::max( std::max( min_range, size_t(1) ), total / ( WORK_RANGES_PER_THREAD * size_t( maxThreads() ) ) );
+
+  ranges.clear();
+  for ( size_t i = 0; i < costs.size(); ++i ) {
+    const size_t num_ranges = std::max( size_t(1), ( costs[i] + range_size - 1 ) / range_size );
+    for ( size_t r = 0; r < num_ranges; ++r ) {
+      WorkRange range;
+      range.item = i;
+      range.begin = costs[i] / num_ranges * r + std::min( r, costs[i] % num_ranges );
+      range.end = costs[i] / num_ranges * (r+1) + std::min( r+1, costs[i] % num_ranges );
+      ranges.push_back( range );
+    }
+  }
+  std::sort( ranges.begin(), ranges.end(), largerRange );
+}
+
+void printTimeElapsed( ParallelTimer& t )
+{
+  std::cerr << std::setw( 8 ) 
+            << std::fixed 
+            << std::setprecision( 2 ) 
+            << t.wall() * 1000.0 << " ms"
+            << "  (total " << t.total * 1000.0 << " ms, max item " << t.max_item * 1000.0 << " ms, " << t.num_items << " items)" << std::endl;
+}
+
+
+namespace {
+
+struct TimerMetric {
+  size_t calls;
+  double total, max_call;
+  TimerMetric() : calls( 0 ), total( 0.0 ), max_call( 0.0 ) {}
+};
+
+struct GaugeMetric {
+  double value, max_value;
+  GaugeMetric() : value( 0.0 ), max_value( -DBL_MAX ) {}
+};
+
+// Names are kept sorted, so reports of different runs line up
+struct Metrics {
+  std::map<std::string, TimerMetric> timers;
+  std::map<std::string, uint64_t>    counters;
+  std::map<std::string, GaugeMetric> gauges;
+  std::string memory_phase;
+  std::vector<double> mesh_profile;  // NUM_MESH_PROFILE_ENTRIES per mesh
+  Mutex mutex;
+};
+
+Metrics& metrics()
+{
+  static Metrics m;
+  return m;
+}
+
+void writeJsonName( std::ostream& out, const std::string& name )
+{
+  out << '"';
+  for (size_t i = 0; i < name.size(); ++i) {
+    if ( name[i] == '"' || name[i] == '\\' ) out << '\\';
+    out << name[i];
+  }
+  out << '"';
+}
+
+} // end namespace
+
+void recordTime( const char* name, double seconds, size_t calls, double max_seconds )
+{
+  Metrics& m = metrics();
+  ScopedLock lock( m.mutex );
+  TimerMetric& t = m.timers[name];
+  t.calls += calls;
+  t.total += seconds;
+  t.max_call = std::max( t.max_call, max_seconds >= 0.0 ? max_seconds : seconds );
+}
+
+void recordTime( const char* name, const ParallelTimer& t )
+{
+  recordTime( name, t.wall() );
+  recordTime( ( std::string( name ) + ".items" ).c_str(), t.total, t.num_items, t.max_item );
+}
+
+void recordCount( const char* name, uint64_t count )
+{
+  Metrics& m = metrics();
+  ScopedLock lock( m.mutex );
+  m.counters[name] += count;
+}
+
+void recordGauge( const char* name, double value )
+{
+  Metrics& m = metrics();
+  ScopedLock lock( m.mutex );
+  GaugeMetric& g = m.gauges[name];
+  g.value = value;
+  g.max_value = std::max( g.max_value, value );
+}
+
+namespace {
+
+// Resident set size right now, or 0 where we don't know how to ask
+double currentRss()
+{
+#if defined(__linux__)
+  std::ifstream statm( "/proc/self/statm" );
+  size_t total_pages = 0, resident_pages = 0;
+  if ( statm >> total_pages >> resident_pages ) {
+    return double( resident_pages ) * double( sysconf( _SC_PAGESIZE ) );
+  }
+#endif
+  return 0.0;
+}
+
+} // namespace
+
+void recordMemoryUsage()
+{
+  std::string phase;
+  {
+    Metrics& m = metrics();
+    ScopedLock lock( m.mutex );
+    phase = m.memory_phase;
+  }
+  size_t free_bytes = 0, total_bytes = 0;
+  if ( cudaMemGetInfo( &free_bytes, &total_bytes ) == cudaSuccess ) {
+    const double used_bytes = double( total_bytes - free_bytes );
+    recordGauge( "device.memory_used_bytes", used_bytes );
+    if ( !phase.empty() ) {
+      recordGauge( ( "phase." + phase + ".device_memory_used_bytes" ).c_str(), used_bytes );
+    }
+  }
+  int device = 0;
+  if ( cudaGetDevice( &device ) == cudaSuccess ) {
+    recordGauge( "device.pool_cached_bytes", double( devicePoolCachedBytes( device ) ) );
+  }
+  const double rss_bytes = currentRss();
+  if ( rss_bytes > 0.0 ) {
+    recordGauge( "host.rss_bytes", rss_bytes );
+    if ( !phase.empty() ) {
+      recordGauge( ( "phase." + phase + ".host_rss_bytes" ).c_str(), rss_bytes );
+    }
+  }
+#if !defined(_WIN32)
+  struct rusage usage;
+  if ( getrusage( RUSAGE_SELF, &usage ) == 0 ) {
+#if defined(__APPLE__)
+    recordGauge( "host.peak_rss_bytes", double( usage.ru_maxrss ) );
+#else
+    recordGauge( "host.peak_rss_bytes", double( usage.ru_maxrss ) * 1024.0 );
+#endif
+  }
+#endif
+}
+
+void beginMemoryPhase( const char* name )
+{
+  // Close the previous phase with its final usage, then open the new one with what it starts from
+  recordMemoryUsage();
+  {
+    Metrics& m = metrics();
+    ScopedLock lock( m.mutex );
+    m.memory_phase = name ? name : "";
+  }
+  recordMemoryUsage();
+}
+
+namespace {
+
+// Cores of each placement, set once by placeThreads
+struct PlacementCores
+{
+  std::vector<int> host;
+  std::vector<int> submit;
+  bool pinned;
+  PlacementCores() : pinned( false ) {}
+};
+
+PlacementCores& placementCores()
+{
+  static PlacementCores cores;
+  return cores;
+}
+
+#if defined(__linux__)
+
+// Cores listed as e.g. "0-3,8,10-11"
+void parseCoreList( const std::string& list, std::vector<int>& cores )
+{
+  std::stringstream ss( list );
+  std::string range;
+  while ( std::getline( ss, range, ',' ) ) {
+    int first = 0, last = 0;
+    const int n = sscanf( range.c_str(), "%d-%d", &first, &last );
+    if ( n < 1 ) continue;
+    if ( n == 1 ) last = first;
+    for (int c = first; c <= last; ++c) cores.push_back( c );
+  }
+}
+
+// Cores the process may run on, ordered by NUMA node, with the node of each (-1 where sysfs doesn't say)
+bool allowedCores( std::vector<int>& cores, std::vector<int>& nodes )
+{
+  cpu_set_t set;
+  CPU_ZERO( &set );
+  if ( sched_getaffinity( 0, sizeof( set ), &set ) != 0 ) return false;
+  std::vector<int> core_nodes( CPU_SETSIZE, -1 );
+  for (int node = 0; node < CPU_SETSIZE; ++node) {
+    std::ostringstream path;
+    path << "/sys/devices/system/node/node" << node << "/cpulist";
+    std::ifstream file( path.str().c_str() );
+    if ( !file ) {
+      if ( node > 0 ) break;
+      continue;
+    }
+    std::string list;
+    std::getline( file, list );
+    std::vector<int> node_cores;
+    parseCoreList( list, node_cores );
+    for (size_t i = 0; i < node_cores.size(); ++i) {
+      if ( node_cores[i] >= 0 && node_cores[i] < CPU_SETSIZE ) core_nodes[node_cores[i]] = node;
+    }
+  }
+  std::vector<std::pair<int, int> > by_node;
+  for (int c = 0; c < CPU_SETSIZE; ++c) {
+    if ( CPU_ISSET( c, &set ) ) by_node.push_back( std::make_pair( core_nodes[c], c ) );
+  }
+  std::sort( by_node.begin(), by_node.end() );
+  cores.clear();
+  nodes.clear();
+  for (size_t i = 0; i < by_node.size(); ++i) {
+    cores.push_back( by_node[i].second );
+    nodes.push_back( by_node[i].first );
+  }
+  return !cores.empty();
+}
+
+bool pinThread( const std::vector<int>& cores )
+{
+  if ( cores.empty() ) return false;
+  cpu_set_t set;
+  CPU_ZERO( &set );
+  for (size_t i = 0; i < cores.size(); ++i) CPU_SET( cores[i], &set );
+  return sched_setaffinity( 0, sizeof( set ), &set ) == 0;
+}
+
+#else
+
+bool allowedCores( std::vector<int>&, std::vector<int>& )
+{
+  return false;
+}
+
+bool pinThread( const std::vector<int>& )
+{
+  return false;
+}
+
+#endif
+
+} // namespace
+
+ThreadPlacement placeThreads( int num_threads, int submit_cores, bool pin )
+{
+  std::vector<int> cores, nodes;
+  const bool known = allowedCores( cores, nodes );
+  const int num_cores = known ? int( cores.size() ) : maxThreads();
+
+  // At least one core is left to the host stages
+  ThreadPlacement placement;
+  placement.submit_cores = std::max( std::min( submit_cores, num_cores - 1 ), 0 );
+  const int host_cores = num_cores - placement.submit_cores;
+  placement.host_threads = num_threads > 0 ? num_threads : host_cores;
+  placement.pinned = false;
+  placement.numa_nodes = 0;
+  setMaxThreads( placement.host_threads );
+
+  // The reserved cores are the last ones, on the last node
+  PlacementCores& placed = placementCores();
+  if ( known ) {
+    placed.host.assign( cores.begin(), cores.begin() + host_cores );
+    placed.submit.assign( cores.begin() + host_cores, cores.end() );
+    int last_node = -2;
+    for (int i = 0; i < host_cores; ++i) {
+      if ( nodes[i] != last_node && nodes[i] >= 0 ) placement.numa_nodes += 1;
+      last_node = nodes[i];
+    }
+  }
+  if ( pin ) {
+    placement.pinned = known && pinThread( placed.host );
+    if ( !placement.pinned ) std::cerr << "Can't pin threads on this platform, leaving them to the scheduler" << std::endl;
+  }
+  placed.pinned = placement.pinned && !placed.submit.empty();
+
+  recordGauge( "threads.host", placement.host_threads );
+  recordGauge( "threads.submit_cores", placement.submit_cores );
+  recordGauge( "threads.numa_nodes", placement.numa_nodes );
+  recordGauge( "threads.pinned", placement.pinned ? 1.0 : 0.0 );
+  return placement;
+}
+
+ScopedSubmitThread::ScopedSubmitThread()
+  : m_moved( placementCores().pinned && pinThread( placementCores().submit ) )
+{
+}
+
+ScopedSubmitThread::~ScopedSubmitThread()
+{
+  if ( m_moved ) pinThread( placementCores().host );
+}
+
+bool isPinnedHostMemory( const void* ptr )
+{
+  if ( !ptr ) return false;
+  cudaPointerAttributes attributes;
+  if ( cudaPointerGetAttributes( &attributes, ptr ) != cudaSuccess ) {
+    // Older runtimes fail on pageable memory; clear the error
+    cudaGetLastError();
+    return false;
+  }
+#if CUDART_VERSION >= 10000
+  return attributes.type == cudaMemoryTypeHost;
+#else
+  return attributes.memoryType == cudaMemoryTypeHost;
+#endif
+}
+
+int pointerDevice( const void* ptr )
+{
+  if ( !ptr ) return -1;
+  cudaPointerAttributes attributes;
+  if ( cudaPointerGetAttributes( &attributes, ptr ) != cudaSuccess ) {
+    cudaGetLastError();
+    return -1;
+  }
+#if CUDART_VERSION >= 10000
+  const bool on_device = attributes.type == cudaMemoryTypeDevice || attributes.type == cudaMemoryTypeManaged;
+#else
+  const bool on_device = attributes.memoryType == cudaMemoryTypeDevice;
+#endif
+  return on_device ? attributes.device : -1;
+}
+
+namespace {
+
+struct LargeHostBlock
+{
+  void*  base;    // of the mapping, which may start before the block to align it
+  size_t bytes;   // of the mapping
+  bool   pinned;
+};
+
+// Blocks from allocateLargeHostMemory, keyed by the pointer handed out
+struct LargeHostBlocks
+{
+  std::map< void*, LargeHostBlock > blocks;
+  Mutex mutex;
+};
+
+LargeHostBlocks& largeHostBlocks()
+{
+  static LargeHostBlocks blocks;
+  return blocks;
+}
+
+// Transparent huge pages are 2 MB on the platforms we run on
+const size_t HUGE_PAGE_BYTES = size_t(1) << 21;
+const size_t SMALL_PAGE_BYTES = size_t(1) << 12;
+
+void unmapHostBlock( const LargeHostBlock& block )
+{
+#if defined(_WIN32)
+  VirtualFree( block.base, 0, MEM_RELEASE );
+#else
+  munmap( block.base, block.bytes );
+#endif
+}
+
+} // namespace
+
+void* allocateLargeHostMemory( const size_t bytes, const bool pinned )
+{
+  LargeHostBlock block;
+  block.pinned = false;
+  char* ptr = NULL;
+#if defined(_WIN32)
+  // Large pages need the lock pages privilege, and are committed on the spot; plain pages otherwise
+  const size_t large_page = GetLargePageMinimum();
+  block.base = NULL;
+  if ( large_page > 0 ) {
+    block.bytes = ( bytes + large_page - 1 ) / large_page * large_page;
+    block.base = VirtualAlloc( NULL, block.bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE );
+  }
+  if ( !block.base ) {
+    block.bytes = bytes;
+    block.base = VirtualAlloc( NULL, block.bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+  }
+  if ( !block.base ) return NULL;
+  ptr = static_cast<char*>( block.base );
+#else
+  // Over-map by a huge page, so the block can start on a huge page boundary
+  block.bytes = bytes + HUGE_PAGE_BYTES;
+  block.base = mmap( NULL, block.bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0 );
+  if ( block.base == MAP_FAILED ) return NULL;
+  ptr = reinterpret_cast<char*>( ( reinterpret_cast<uintptr_t>( block.base ) + HUGE_PAGE_BYTES - 1 ) & ~uintptr_t( HUGE_PAGE_BYTES - 1 ) );
+#ifdef MADV_HUGEPAGE
+  madvise( ptr, bytes, MADV_HUGEPAGE );
+#endif
+#endif
+
+  // The pages are zero; writing that zero once per page, from a static partition over all threads, places each
+  // page on the node of the thread that touched it
+  const ptrdiff_t num_pages = ptrdiff_t( ( bytes + SMALL_PAGE_BYTES - 1 ) / SMALL_PAGE_BYTES );
+#pragma omp parallel for schedule(static)
+  for ( ptrdiff_t page = 0; page < num_pages; ++page ) {
+    ptr[page * SMALL_PAGE_BYTES] = 0;
+  }
+
+  if ( pinned ) {
+    block.pinned = cudaHostRegister( ptr, bytes, cudaHostRegisterPortable ) == cudaSuccess;
+    if ( !block.pinned ) cudaGetLastError();
+  }
+
+  LargeHostBlocks& blocks = largeHostBlocks();
+  {
+    ScopedLock lock( blocks.mutex );
+    blocks.blocks[ptr] = block;
+  }
+  recordCount( "host_memory.large_blocks", 1 );
+  return ptr;
+}
+
+bool freeLargeHostMemory( void* ptr )
+{
+  if ( !ptr ) return false;
+  LargeHostBlock block;
+  LargeHostBlocks& blocks = largeHostBlocks();
+  {
+    ScopedLock lock( blocks.mutex );
+    std::map< void*, LargeHostBlock >::iterator it = blocks.blocks.find( ptr );
+    if ( it == blocks.blocks.end() ) return false;
+    block = it->second;
+    blocks.blocks.erase( it );
+  }
+  if ( block.pinned ) CHK_CUDA( cudaHostUnregister( ptr ) );
+  unmapHostBlock( block );
+  return true;
+}
+
+namespace {
+
+// Free device blocks, keyed by (device, block size)
+struct DevicePool
+{
+  typedef std::pair<int, size_t> Key;
+  std::map< Key, std::vector<void*> > free_blocks;
+  std::map< int, size_t > cached_bytes;
+  Mutex mutex;
+};
+
+DevicePool& devicePool()
+{
+  static DevicePool pool;
+  return pool;
+}
+
+// Round up to an eighth of the enclosing power of two, so blocks of nearby sizes
+// (e.g. batches of slightly different lengths) share a size class, with at most 1/8 slack.
+size_t poolBlockSize( const size_t bytes )
+{
+  const size_t min_block = 256;
+  if ( bytes <= min_block ) return min_block;
+  size_t range = min_block;
+  while ( range <= bytes / 2 ) range *= 2;
+  const size_t step = range / 8;
+  return ( bytes + step - 1 ) / step * step;
+}
+
+// Frees cached blocks of one device, or of all devices if device < 0.  Caller holds the pool lock.
+void releaseCachedBlocks( DevicePool& pool, const int device )
+{
+  int old_device = 0;
+  CHK_CUDA( cudaGetDevice( &old_device ) );
+  std::map< DevicePool::Key, std::vector<void*> >::iterator it = pool.free_blocks.begin();
+  while ( it != pool.free_blocks.end() ) {
+    if ( device >= 0 && it->first.first != device ) {
+      ++it;
+      continue;
+    }
+    CHK_CUDA( cudaSetDevice( it->first.first ) );
+    for ( size_t i = 0; i < it->second.size(); ++i ) {
+      CHK_CUDA( cudaFree( it->second[i] ) );
+    }
+    pool.cached_bytes[it->first.first] -= it->first.second * it->second.size();
+    pool.free_blocks.erase( it++ );
+  }
+  CHK_CUDA( cudaSetDevice( old_device ) );
+}
+
+} // namespace
+
+void* devicePoolAlloc( const size_t bytes )
+{
+  int device = 0;
+  CHK_CUDA( cudaGetDevice( &device ) );
+  const size_t block_size = poolBlockSize( bytes );
+  DevicePool& pool = devicePool();
+  {
+    ScopedLock lock( pool.mutex );
+    std::map< DevicePool::Key, std::vector<void*> >::iterator it = pool.free_blocks.find( DevicePool::Key( device, block_size ) );
+    if ( it != pool.free_blocks.end() && !it->second.empty() ) {
+      void* ptr = it->second.back();
+      it->second.pop_back();
+      pool.cached_bytes[device] -= block_size;
+      recordCount( "device_pool.hits", 1 );
+      return ptr;
+    }
+  }
+
+  recordCount( "device_pool.misses", 1 );
+  void* ptr = NULL;
+  if ( cudaMalloc( &ptr, block_size ) != cudaSuccess ) {
+    // Out of memory: give the cached blocks of this device back and retry once
+    cudaGetLastError();
+    {
+      ScopedLock lock( pool.mutex );
+      releaseCachedBlocks( pool, device );
+    }
+    CHK_CUDA( cudaMalloc( &ptr, block_size ) );
+  }
+  return ptr;
+}
+
+void devicePoolFree( void* ptr, const size_t bytes, const int device )
+{
+  if ( !ptr ) return;
+  const size_t block_size = poolBlockSize( bytes );
+  DevicePool& pool = devicePool();
+  ScopedLock lock( pool.mutex );
+  pool.free_blocks[DevicePool::Key( device, block_size )].push_back( ptr );
+  pool.cached_bytes[device] += block_size;
+}
+
+size_t devicePoolCachedBytes( const int device )
+{
+  DevicePool& pool = devicePool();
+  ScopedLock lock( pool.mutex );
+  std::map< int, size_t >::const_iterator it = pool.cached_bytes.find( device );
+  return it != pool.cached_bytes.end() ? it->second : 0;
+}
+
+void trimDevicePool()
+{
+  DevicePool& pool = devicePool();
+  ScopedLock lock( pool.mutex );
+  releaseCachedBlocks( pool, -1 );
+}
+
+void resetMetrics()
+{
+  Metrics& m = metrics();
+  ScopedLock lock( m.mutex );
+  m.timers.clear();
+  m.counters.clear();
+  m.gauges.clear();
+  m.memory_phase.clear();
+}
+
+double metricTime( const char* name )
+{
+  Metrics& m = metrics();
+  ScopedLock lock( m.mutex );
+  std::map<std::string, TimerMetric>::const_iterator it = m.timers.find( name );
+  return it != m.timers.end() ? it->second.total : 0.0;
+}
+
+uint64_t metricCount( const char* name )
+{
+  Metrics& m = metrics();
+  ScopedLock lock( m.mutex );
+  std::map<std::string, uint64_t>::const_iterator it = m.counters.find( name );
+  return it != m.counters.end() ? it->second : 0;
+}
+
+double metricGaugeMax( const char* name )
+{
+  Metrics& m = metrics();
+  ScopedLock lock( m.mutex );
+  std::map<std::string, GaugeMetric>::const_iterator it = m.gauges.find( name );
+  return it != m.gauges.end() ? it->second.max_value : 0.0;
+}
+
+void enableMeshProfile( size_t num_meshes )
+{
+  Metrics& m = metrics();
+  ScopedLock lock( m.mutex );
+  m.mesh_profile.assign( num_meshes*NUM_MESH_PROFILE_ENTRIES, 0.0 );
+}
+
+bool meshProfileEnabled()
+{
+  Metrics& m = metrics();
+  ScopedLock lock( m.mutex );
+  return !m.mesh_profile.empty();
+}
+
+void recordMeshProfile( size_t mesh, MeshProfileEntry entry, double value )
+{
+  Metrics& m = metrics();
+  ScopedLock lock( m.mutex );
+  const size_t k = mesh*NUM_MESH_PROFILE_ENTRIES + entry;
+  if ( k < m.mesh_profile.size() ) m.mesh_profile[k] += value;
+}
+
+double meshProfile( size_t mesh, MeshProfileEntry entry )
+{
+  Metrics& m = metrics();
+  ScopedLock lock( m.mutex );
+  const size_t k = mesh*NUM_MESH_PROFILE_ENTRIES + entry;
+  return k < m.mesh_profile.size() ? m.mesh_profile[k] : 0.0;
+}
+
+namespace {
+
+struct ProgressReceiver {
+  ProgressFunction function;
+  void* data;
+  Mutex mutex;
+  ProgressReceiver() : function( NULL ), data( NULL ) {}
+};
+
+ProgressReceiver& progressReceiver()
+{
+  static ProgressReceiver r;
+  return r;
+}
+
+} // end namespace
+
+void setProgressFunction( ProgressFunction function, void* progress_data )
+{
+  ProgressReceiver& r = progressReceiver();
+  ScopedLock lock( r.mutex );
+  r.function = function;
+  r.data = progress_data;
+}
+
+void reportProgress( const char* stage, uint64_t done, uint64_t total, double rays_per_second )
+{
+  ProgressReceiver& r = progressReceiver();
+  ScopedLock lock( r.mutex );
+  if ( r.function ) r.function( r.data, stage, done, total, rays_per_second );
+}
+
+ProgressCounter::ProgressCounter( const char* stage, uint64_t total, int rays_per_unit )
+  : m_stage( stage ), m_total( total ), m_done( 0 ), m_skipped( 0 ), m_rays_per_unit( rays_per_unit )
+{
+  m_timer.start();
+}
+
+// Reports under the counter's lock, so that totals arrive in order
+void ProgressCounter::add( uint64_t units )
+{
+  ScopedLock lock( m_mutex );
+  m_done += units;
+  Timer now = m_timer;
+  now.stop();
+  const double rays_per_second = m_rays_per_unit > 0 && now.elapsed > 0.0 ? double( m_done - m_skipped ) * m_rays_per_unit / now.elapsed : 0.0;
+  reportProgress( m_stage, m_done, m_total, rays_per_second );
+}
+
+void ProgressCounter::skip( uint64_t units )
+{
+  ScopedLock lock( m_mutex );
+  m_done += units;
+  m_skipped += units;
+}
+
+bool saveMetrics( const char* filename )
+{
+  recordMemoryUsage();
+
+  Metrics& m = metrics();
+  ScopedLock lock( m.mutex );
+  std::ofstream out( filename );
+  if ( !out ) return false;
+  out << std::fixed << std::setprecision( 3 );
+
+  out << "{\n  \"timers\": {";
+  for (std::map<std::string, TimerMetric>::const_iterator it = m.timers.begin(); it != m.timers.end(); ++it) {
+    out << (it == m.timers.begin() ? "\n    " : ",\n    ");
+    writeJsonName( out, it->first );
+    out << ": {\"calls\": " << it->second.calls << ", \"total_ms\": " << it->second.total * 1000.0 
+        << ", \"max_ms\": " << it->second.max_call * 1000.0 << "}";
+  }
+  out << "\n  },\n  \"counters\": {";
+  for (std::map<std::string, uint64_t>::const_iterator it = m.counters.begin(); it != m.counters.end(); ++it) {
+    out << (it == m.counters.begin() ? "\n    " : ",\n    ");
+    writeJsonName( out, it->first );
+    out << ": " << it->second;
+  }
+  out << "\n  },\n  \"gauges\": {";
+  for (std::map<std::string, GaugeMetric>::const_iterator it = m.gauges.begin(); it != m.gauges.end(); ++it) {
+    out << (it == m.gauges.begin() ? "\n    " : ",\n    ");
+    writeJsonName( out, it->first );
+    out << ": {\"value\": " << it->second.value << ", \"max\": " << it->second.max_value << "}";
+  }
+  out << "\n  }\n}\n";
+  return bool( out );
+}
+
+
+uint64_t hashBytes( const void* data, size_t num_bytes, uint64_t hash )
+{
+  const unsigned char* bytes = static_cast<const unsigned char*>( data );
+  for (size_t i = 0; i < num_bytes; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+uint64_t hashMeshGeometry( const bake::Mesh& mesh, uint64_t hash )
+{
+  hash = hashBytes( &mesh.num_vertices, sizeof(mesh.num_vertices), hash );
+  hash = hashBytes( &mesh.num_triangles, sizeof(mesh.num_triangles), hash );
+  const unsigned vertex_stride = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+  if ( vertex_stride == 3*sizeof(float) ) {
+    hash = hashBytes( mesh.vertices, mesh.num_vertices*3*sizeof(float), hash );
+  } else {
+    const unsigned char* v = reinterpret_cast<const unsigned char*>( mesh.vertices );
+    for (size_t i = 0; i < mesh.num_vertices; ++i) {
+      hash = hashBytes( v + i*vertex_stride, 3*sizeof(float), hash );
+    }
+  }
+  return hashBytes( mesh.tri_vertex_indices, mesh.num_triangles*3*sizeof(unsigned int), hash );
+}
+
+bool sameMeshGeometry( const bake::Mesh& a, const bake::Mesh& b )
+{
+  if ( a.num_vertices != b.num_vertices || a.num_triangles != b.num_triangles ) return false;
+
+  if ( a.tri_vertex_indices != b.tri_vertex_indices &&
+       memcmp( a.tri_vertex_indices, b.tri_vertex_indices, a.num_triangles*3*sizeof(unsigned int) ) != 0 ) return false;
+
+  if ( a.vertices == b.vertices && a.vertex_stride_bytes == b.vertex_stride_bytes ) return true;
+  const unsigned a_stride = a.vertex_stride_bytes > 0 ? a.vertex_stride_bytes : 3*sizeof(float);
+  const unsigned b_stride = b.vertex_stride_bytes > 0 ? b.vertex_stride_bytes : 3*sizeof(float);
+  const unsigned char* av = reinterpret_cast<const unsigned char*>( a.vertices );
+  const unsigned char* bv = reinterpret_cast<const unsigned char*>( b.vertices );
+  for (size_t i = 0; i < a.num_vertices; ++i) {
+    if ( memcmp( av + i*a_stride, bv + i*b_stride, 3*sizeof(float) ) != 0 ) return false;
+  }
+  return true;
+}
+
+bool packedMeshVertices( const bake::Mesh& mesh )
+{
+  return mesh.vertex_stride_bytes == 0 || mesh.vertex_stride_bytes == 3*sizeof(float);
+}
+
+void packMeshVertices( const bake::Mesh& mesh, float* vertices )
+{
+  const unsigned stride = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+  const unsigned char* src = reinterpret_cast<const unsigned char*>( mesh.vertices );
+#pragma omp parallel for if(mesh.num_vertices >= (1 << 16))
+  for (ptrdiff_t i = 0; i < ptrdiff_t( mesh.num_vertices ); ++i) {
+    const float* v = reinterpret_cast<const float*>( src + i*stride );
+    vertices[3*i+0] = v[0];
+    vertices[3*i+1] = v[1];
+    vertices[3*i+2] = v[2];
+  }
+}
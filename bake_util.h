@@ -26,6 +26,24 @@
 #include <vector_types.h>
 #include <optix_prime/optix_prime.h>
 
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef SUPPORT_NVTOOLSEXT
+#include <nvToolsExt.h>
+#endif
+#if defined(_WIN32)
+#include <cstdint>
+#else
+#include <stdint.h>
+#endif
+
+namespace bake { struct Mesh; }
+
 struct Timer
 {
   Timer() : elapsed( 0.0 ), t0(0.0), t1(0.0) {} 
@@ -43,6 +61,402 @@ struct Timer
 
 void printTimeElapsed( Timer& t );
 
+// Gives up the calling thread's time slice for about ms milliseconds
+void sleepMilliseconds( const double ms );
+
+
+// Thin wrapper around an OpenMP lock; does nothing in builds without OpenMP.
+class Mutex
+{
+public:
+#ifdef _OPENMP
+  Mutex()       { omp_init_lock( &m_lock ); }
+  ~Mutex()      { omp_destroy_lock( &m_lock ); }
+  void lock()   { omp_set_lock( &m_lock ); }
+  void unlock() { omp_unset_lock( &m_lock ); }
+  bool tryLock() { return omp_test_lock( &m_lock ) != 0; }
+private:
+  omp_lock_t m_lock;
+#else
+  Mutex()       {}
+  void lock()   {}
+  void unlock() {}
+  bool tryLock() { return true; }
+#endif
+private:
+  Mutex( const Mutex& );            // forbidden
+  Mutex& operator=( const Mutex& ); // forbidden
+};
+
+// Threads available to a parallel loop; 1 in builds without OpenMP
+inline int maxThreads()
+{
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+// Index of the calling thread within its parallel region; 0 in builds without OpenMP
+inline int threadIndex()
+{
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+// Threads in the current parallel region; 1 in builds without OpenMP
+inline int numThreads()
+{
+#ifdef _OPENMP
+  return omp_get_num_threads();
+#else
+  return 1;
+#endif
+}
+
+// Threads of the parallel regions the calling thread starts from now on; does nothing in builds without OpenMP
+inline void setMaxThreads( const int n )
+{
+#ifdef _OPENMP
+  omp_set_num_threads( n );
+#endif
+}
+
+// Lets parallel regions started inside a parallel region have threads of their own, up to 'levels' deep.  Returns 
+// the previous setting; does nothing in builds without OpenMP.
+inline int setMaxActiveLevels( const int levels )
+{
+#ifdef _OPENMP
+  const int previous = omp_get_max_active_levels();
+  omp_set_max_active_levels( levels );
+  return previous;
+#else
+  return levels;
+#endif
+}
+
+// Where the threads of the bake run.  host_threads is the OpenMP thread budget of the sampling, filtering and loading
+// stages; submit_cores are kept free of them for the threads feeding the devices.  When pinned, host stage threads
+// run on the other allowed cores, filled NUMA node by node, and ScopedSubmitThread moves a device feeding thread to
+// the reserved ones.
+struct ThreadPlacement
+{
+  int  host_threads;
+  int  submit_cores;
+  int  numa_nodes;     // nodes the host threads span; 0 if unknown
+  bool pinned;
+};
+
+// Sets the thread budget of parallel regions started from the calling thread, and with 'pin' restricts the calling
+// thread to the host cores, so the threads it starts inherit them.  num_threads 0 takes every allowed core not
+// reserved.  Pinning needs Linux; elsewhere it is skipped with a message.  Records the placement as threads.* gauges.
+ThreadPlacement placeThreads( int num_threads, int submit_cores, bool pin );
+
+// Runs the calling thread on the reserved submission cores for its lifetime when placeThreads pinned, and on the
+// host cores again afterwards
+class ScopedSubmitThread
+{
+public:
+  ScopedSubmitThread();
+  ~ScopedSubmitThread();
+private:
+  bool m_moved;
+  ScopedSubmitThread( const ScopedSubmitThread& );            // forbidden
+  ScopedSubmitThread& operator=( const ScopedSubmitThread& ); // forbidden
+};
+
+struct ScopedLock
+{
+  explicit ScopedLock( Mutex& m ) : mutex( m ) { mutex.lock(); }
+  ~ScopedLock() { mutex.unlock(); }
+  Mutex& mutex;
+private:
+  ScopedLock& operator=( const ScopedLock& ); // forbidden
+};
+
+// Batches of a sample set, handed out in order to whichever tracer asks next.  Tracers that share one trace 
+// the set together, each taking work in proportion to its speed.
+struct BatchCursor
+{
+  BatchCursor( const size_t batch_size_, const size_t num_samples ) 
+    : batch_size( batch_size_ ), num_batches( ( num_samples + batch_size_ - 1 ) / batch_size_ ), next( 0 ) {}
+
+  // Index of the next batch, or false once all are taken
+  bool take( size_t& batch_idx ) {
+    ScopedLock lock( mutex );
+    while ( next < done.size() && done[next] ) ++next;
+    batch_idx = next++;
+    return batch_idx < num_batches;
+  }
+
+  // Batches finished before, e.g. restored from a checkpoint, are not handed out
+  void skip( const std::vector<bool>& done_ ) {
+    ScopedLock lock( mutex );
+    done = done_;
+  }
+
+  const size_t batch_size;
+  const size_t num_batches;
+private:
+  size_t next;
+  std::vector<bool> done;
+  Mutex  mutex;
+  BatchCursor( const BatchCursor& );             // forbidden
+  BatchCursor& operator=( const BatchCursor& );  // forbidden
+};
+
+// Lets parallel loops run in parallel within a parallel region, for as long as it lives
+struct ScopedNestedParallelism
+{
+#ifdef _OPENMP
+  ScopedNestedParallelism() : was_nested( omp_get_nested() ) { omp_set_nested( 1 ); }
+  ~ScopedNestedParallelism() { omp_set_nested( was_nested ); }
+private:
+  int was_nested;
+#endif
+};
+
+// One T per thread of the parallel loops the creating thread starts, kept across their iterations, so loops over many
+// small items reuse the buffers of the largest item a thread has had so far instead of allocating for each.  Create 
+// it just outside the loop; local() is the calling thread's T.  Threads of regions nested in the loop must not call it.
+template <typename T>
+class ThreadScratch
+{
+public:
+  ThreadScratch() : m_items( size_t( std::max( maxThreads(), 1 ) ) ) {}
+  T& local()
+  {
+    assert( size_t( threadIndex() ) < m_items.size() );
+    return m_items[threadIndex()];
+  }
+private:
+  std::vector<T> m_items;
+  ThreadScratch( const ThreadScratch& );            // forbidden
+  ThreadScratch& operator=( const ThreadScratch& ); // forbidden
+};
+
+// std::sort of one chunk per thread, then rounds of pairwise merges of neighboring chunks.  The result only
+// depends on the thread count for elements that compare equivalent.
+template <typename T>
+void parallelSort( std::vector<T>& v )
+{
+  const ptrdiff_t n = ptrdiff_t( v.size() );
+  const ptrdiff_t min_chunk_size = 1 << 14;
+  const ptrdiff_t num_chunks = std::max( ptrdiff_t(1), std::min( ptrdiff_t( maxThreads() ), n / min_chunk_size ) );
+  std::vector<ptrdiff_t> bounds( num_chunks + 1 );
+  for (ptrdiff_t c = 0; c <= num_chunks; ++c) bounds[c] = n / num_chunks * c + std::min( c, n % num_chunks );
+
+#pragma omp parallel for if(num_chunks > 1)
+  for (ptrdiff_t c = 0; c < num_chunks; ++c) {
+    std::sort( v.begin() + bounds[c], v.begin() + bounds[c+1] );
+  }
+  for (ptrdiff_t width = 1; width < num_chunks; width *= 2) {
+    const ptrdiff_t num_merges = ( num_chunks - width + 2*width - 1 ) / ( 2*width );
+#pragma omp parallel for if(num_merges > 1)
+    for (ptrdiff_t m = 0; m < num_merges; ++m) {
+      const ptrdiff_t c = 2*width*m;
+      std::inplace_merge( v.begin() + bounds[c], v.begin() + bounds[c + width], v.begin() + bounds[std::min( c + 2*width, num_chunks )] );
+    }
+  }
+}
+
+// Interleaves the bits of three 10 bit coordinates into a 30 bit Morton code
+inline unsigned mortonCode( const unsigned x, const unsigned y, const unsigned z )
+{
+  unsigned code = 0;
+  for (unsigned b = 0; b < 10; ++b) {
+    code |= ((x >> b) & 1u) << (3*b) | ((y >> b) & 1u) << (3*b + 1) | ((z >> b) & 1u) << (3*b + 2);
+  }
+  return code;
+}
+
+// A range [begin, end) of the work units (e.g. triangles) of one item (e.g. an instance)
+struct WorkRange
+{
+  size_t item;
+  size_t begin, end;
+  bool whole( const size_t cost ) const { return begin == 0 && end == cost; }
+};
+
+// Smallest range worth a task of its own
+const size_t WORK_MIN_RANGE = 1 << 12;
+// Ranges per thread that items are cut into, so threads that finish early find more work
+const size_t WORK_RANGES_PER_THREAD = 4;
+
+// Cuts items of the given costs, in work units, into ranges of about total / (WORK_RANGES_PER_THREAD * threads)
+// units, at least min_range; smaller items stay whole.  Ranges come largest first, so that a loop over them with
+// schedule(dynamic, 1) starts the long ones early and fills in with short ones, whatever the spread of item sizes.
+void splitWork( const std::vector<size_t>& costs, std::vector<WorkRange>& ranges, size_t min_range = WORK_MIN_RANGE );
+
+
+// Accumulates a phase whose work items are timed on many threads at once.  Each item is timed with 
+// its own Timer and then added here; reports wall time from the first start to the last stop, the 
+// summed time of all items, and the longest single item.
+struct ParallelTimer
+{
+  ParallelTimer() : first_start( 0.0 ), last_stop( 0.0 ), total( 0.0 ), max_item( 0.0 ), num_items( 0 ) {}
+
+  // Thread safe.  Records the last start/stop interval of t.
+  void add( const Timer& t );
+  // Thread safe.  Adds the items of another timer, e.g. one that timed a single mesh.
+  void add( const ParallelTimer& t );
+
+  double wall() const { return num_items > 0 ? last_stop - first_start : 0.0; }
+
+  double first_start, last_stop;
+  double total, max_item;
+  size_t num_items;
+  Mutex  mutex;
+};
+
+void printTimeElapsed( ParallelTimer& t );
+
+
+// ARGB colors of the pipeline phases in profiler timelines
+const uint32_t PROFILE_COLOR_LOAD   = 0xff4f81bd;
+const uint32_t PROFILE_COLOR_SAMPLE = 0xff9bbb59;
+const uint32_t PROFILE_COLOR_ACCEL  = 0xff8064a2;
+const uint32_t PROFILE_COLOR_TRACE  = 0xffc0504d;
+const uint32_t PROFILE_COLOR_FILTER = 0xfff79646;
+const uint32_t PROFILE_COLOR_SAVE   = 0xff4bacc6;
+
+// Scoped NVTX range, so phases show up by name in Nsight Systems, with an optional payload such as a batch 
+// index or sample count.  Compiles to nothing without SUPPORT_NVTOOLSEXT.
+class ProfileRange
+{
+public:
+#ifdef SUPPORT_NVTOOLSEXT
+  explicit ProfileRange( const char* name, uint32_t color = PROFILE_COLOR_TRACE ) { push( name, color, false, 0 ); }
+  ProfileRange( const char* name, uint32_t color, uint64_t payload )            { push( name, color, true, payload ); }
+  ~ProfileRange() { nvtxRangePop(); }
+#else
+  explicit ProfileRange( const char*, uint32_t = 0 ) {}
+  ProfileRange( const char*, uint32_t, uint64_t ) {}
+#endif
+private:
+#ifdef SUPPORT_NVTOOLSEXT
+  static void push( const char* name, uint32_t color, bool has_payload, uint64_t payload ) {
+    nvtxEventAttributes_t attributes = nvtxEventAttributes_t();
+    attributes.version = NVTX_VERSION;
+    attributes.size = NVTX_EVENT_ATTRIB_STRUCT_SIZE;
+    attributes.colorType = NVTX_COLOR_ARGB;
+    attributes.color = color;
+    attributes.messageType = NVTX_MESSAGE_TYPE_ASCII;
+    attributes.message.ascii = name;
+    if ( has_payload ) {
+      attributes.payloadType = NVTX_PAYLOAD_TYPE_UNSIGNED_INT64;
+      attributes.payload.ullValue = payload;
+    }
+    nvtxRangePushEx( &attributes );
+  }
+#endif
+  ProfileRange( const ProfileRange& );            // forbidden
+  ProfileRange& operator=( const ProfileRange& ); // forbidden
+};
+
+
+// Process wide metrics for regression tracking, saved as JSON with --stats.  Timers keep the number of
+// calls, total and longest call; counters add up; gauges keep their last and highest value.  Thread safe.
+void recordTime( const char* name, double seconds, size_t calls = 1, double max_seconds = -1.0 );
+inline void recordTime( const char* name, const Timer& t ) { recordTime( name, t.elapsed ); }
+// Wall time as one call, and the items as calls of "<name>.items"
+void recordTime( const char* name, const ParallelTimer& t );
+void recordCount( const char* name, uint64_t count );
+void recordGauge( const char* name, double value );
+// Device memory in use on the current device, current and peak host RSS, as gauges.  Inside a memory phase
+// the usage is also recorded as "phase.<name>.*" gauges, whose max is the high-water mark of that phase.
+void recordMemoryUsage();
+// Attributes following memory usage records to a pipeline phase, e.g. "trace"; NULL ends phase tracking
+void beginMemoryPhase( const char* name );
+
+// True if ptr is page locked host memory that CUDA knows about, so device copies to and from it can be async
+bool isPinnedHostMemory( const void* ptr );
+
+// CUDA device that ptr is device memory of, or -1 for host memory
+int pointerDevice( const void* ptr );
+
+// Host arrays from this size up get a mapping of their own, backed by huge pages where the OS hands them out, and
+// are first touched by all threads in parallel, so that their pages spread over the NUMA nodes of the threads that
+// fill them rather than landing on the node of the allocating thread.
+const size_t LARGE_HOST_ALLOCATION = size_t(1) << 25;
+// Zeroed memory, page locked for CUDA if pinned and the runtime lets us; NULL if mapping fails
+void* allocateLargeHostMemory( size_t bytes, bool pinned );
+// False, and does nothing, if ptr is not from allocateLargeHostMemory
+bool  freeLargeHostMemory( void* ptr );
+void resetMetrics();
+bool saveMetrics( const char* filename );
+// What was recorded so far under a name, for other reports; 0 if nothing was
+double   metricTime( const char* name );       // total seconds
+uint64_t metricCount( const char* name );
+double   metricGaugeMax( const char* name );
+
+// Per mesh costs for --profile_meshes, off until enabled for the meshes of a scene.  The phases that work mesh by
+// mesh add to the entry of the mesh they work on; times are summed over threads and instances.  Thread safe.
+enum MeshProfileEntry
+{
+  MESH_PROFILE_SAMPLE_SECONDS = 0,
+  MESH_PROFILE_FILTER_ASSEMBLY_SECONDS,  // mass and regularization matrices, or the splat of the area based filter
+  MESH_PROFILE_FILTER_FACTOR_SECONDS,    // analysis and factorization
+  MESH_PROFILE_FILTER_SOLVE_SECONDS,
+  MESH_PROFILE_MATRIX_NONZEROS,          // lower triangle of the system matrices
+  MESH_PROFILE_FACTOR_NONZEROS,
+  NUM_MESH_PROFILE_ENTRIES
+};
+// Zeroes the entries of num_meshes meshes; 0 turns the profile off
+void   enableMeshProfile( size_t num_meshes );
+bool   meshProfileEnabled();
+// Does nothing while the profile is off, or for meshes past those it was enabled for
+void   recordMeshProfile( size_t mesh, MeshProfileEntry entry, double value );
+double meshProfile( size_t mesh, MeshProfileEntry entry );
+
+// Same as bake::ProgressCallback
+typedef void (*ProgressFunction)( void* progress_data, const char* stage, uint64_t done, uint64_t total, double rays_per_second );
+// Process wide receiver of progress reports, see bake::setProgressCallback; NULL for none
+void setProgressFunction( ProgressFunction function, void* progress_data );
+// Calls the receiver, if any, one call at a time
+void reportProgress( const char* stage, uint64_t done, uint64_t total, double rays_per_second = 0.0 );
+
+// Counts the work units of a stage, e.g. samples or vertices, as threads finish them, and reports the running total
+// with the rays per second since the counter was made, for stages that trace rays_per_unit rays per unit
+class ProgressCounter
+{
+public:
+  ProgressCounter( const char* stage, uint64_t total, int rays_per_unit = 0 );
+  // Thread safe
+  void add( uint64_t units );
+  // Units done before the stage started, e.g. restored from a checkpoint: they count as done, not towards the rate
+  void skip( uint64_t units );
+private:
+  const char* m_stage;
+  uint64_t    m_total, m_done, m_skipped;
+  int         m_rays_per_unit;
+  Timer       m_timer;
+  Mutex       m_mutex;
+  ProgressCounter( const ProgressCounter& );            // forbidden
+  ProgressCounter& operator=( const ProgressCounter& ); // forbidden
+};
+
+
+// 64-bit FNV-1a, chainable through 'hash'
+const uint64_t HASH_SEED = 14695981039346656037ULL;
+uint64_t hashBytes( const void* data, size_t num_bytes, uint64_t hash = HASH_SEED );
+
+// Content hash of mesh positions and triangle indices; strides and other attributes don't contribute.
+uint64_t hashMeshGeometry( const bake::Mesh& mesh, uint64_t hash = HASH_SEED );
+
+// True if both meshes have identical positions and triangle indices
+bool sameMeshGeometry( const bake::Mesh& a, const bake::Mesh& b );
+
+// True if the positions of the mesh are packed float3, with no other attributes interleaved
+bool packedMeshVertices( const bake::Mesh& mesh );
+
+// Gathers the positions of a mesh at its vertex stride into 3*num_vertices packed floats, in parallel for large meshes
+void packMeshVertices( const bake::Mesh& mesh, float* vertices );
+
 
 struct Ray
 {
@@ -22,33 +22,45 @@
 -----------------------------------------------------------------------*/
 
 #include <algorithm>
+#include <functional>
 #include <iostream>
+#include <map>
 
 #include <main.h>
 #include <nv_helpers_gl/WindowInertiaCamera.h>
 #include <nv_helpers_gl/GLSLProgram.h>
 
 #include "bake_api.h"
+#include "bake_util.h"
+#include "bake_view.h"
 
+// Instances come in through a per-instance attribute, offset by the base instance of each indirect draw.  Transforms,
+// per-instance AO offsets and the AO of all instances live in storage buffers, the AO as 8 bit values packed four
+// to a uint.
 const char* vertex_program = 
-"#version 330\n"
+"#version 430\n"
 "#extension GL_ARB_separate_shader_objects : enable\n"
-"uniform mat4 object2world;\n"
+"layout(std430, binding=0) readonly buffer Transforms { layout(row_major) mat4 object2world[]; };\n"
+"layout(std430, binding=1) readonly buffer Offsets { int ao_offsets[]; };\n"
+"layout(std430, binding=2) readonly buffer Occlusion { uint occlusion[]; };\n"
 "uniform mat4 world2screen;\n"
+"uniform float constant_occl;  // replaces baked values when >= 0, for edges\n"
 "layout(location=0) in vec3 P;\n"
-"layout(location=1) in float occl;\n"
+"layout(location=1) in uint instance;\n"
 "out gl_PerVertex {\n"
 "    vec4  gl_Position;\n"
 "};\n"
 "layout(location=0) out vec3 outColor;\n"
 "void main() {\n"
+"   uint i = uint(ao_offsets[instance] + gl_VertexID);\n"
+"   float occl = constant_occl >= 0.0 ? constant_occl : float((occlusion[i >> 2] >> (8u*(i & 3u))) & 255u) / 255.0;\n"
 "   outColor = vec3(occl, occl, occl);\n"
-"   gl_Position = world2screen * object2world * vec4(P, 1.0);\n"
+"   gl_Position = world2screen * object2world[instance] * vec4(P, 1.0);\n"
 "}\n"
 ;
 
 const char* fragment_program =
-"#version 330\n"
+"#version 430\n"
 "#extension GL_ARB_separate_shader_objects : enable\n"
 "layout(location=0) in vec3 color;\n"
 "layout(location=0) out vec4 outColor;\n"
@@ -61,6 +73,142 @@ const char* fragment_program =
 "}\n"
 ;
 
+// Frustum culling of instance bboxes: visible instances append themselves to the indirect draw of their mesh and
+// to its range of the instance attribute.  Boxes with all corners outside the same clip plane are culled, and so are
+// instances whose AO has not been streamed in yet.
+const char* cull_program =
+"#version 430\n"
+"layout(local_size_x = 256) in;\n"
+"layout(std430, binding=3) readonly buffer Bounds { vec4 bounds[]; };  // world min and max per instance\n"
+"layout(std430, binding=4) readonly buffer Draws { uint draws[]; };  // indirect draw per instance\n"
+"layout(std430, binding=5) buffer Commands { uint commands[]; };\n"
+"layout(std430, binding=6) writeonly buffer Visible { uint visible[]; };\n"
+"layout(std430, binding=7) readonly buffer OcclusionSlots { uint occl_slots[]; };  // AO array per instance\n"
+"uniform mat4 world2screen;\n"
+"uniform uint num_instances;\n"
+"uniform uint num_ready_slots;\n"
+"uniform bool cull;\n"
+"void main() {\n"
+"   uint instance = gl_GlobalInvocationID.x;\n"
+"   if (instance >= num_instances || occl_slots[instance] >= num_ready_slots) return;\n"
+"   if (cull) {\n"
+"     vec3 lo = bounds[2*instance].xyz;\n"
+"     vec3 hi = bounds[2*instance+1].xyz;\n"
+"     uint outside = 63u;\n"
+"     for (int c = 0; c < 8; ++c) {\n"
+"       vec4 p = world2screen * vec4((c & 1) != 0 ? hi.x : lo.x, (c & 2) != 0 ? hi.y : lo.y, (c & 4) != 0 ? hi.z : lo.z, 1.0);\n"
+"       uint planes = (p.x < -p.w ? 1u : 0u) | (p.x > p.w ? 2u : 0u) | (p.y < -p.w ? 4u : 0u) |\n"
+"                     (p.y > p.w ? 8u : 0u) | (p.z < -p.w ? 16u : 0u) | (p.z > p.w ? 32u : 0u);\n"
+"       outside &= planes;\n"
+"     }\n"
+"     if (outside != 0u) return;\n"
+"   }\n"
+"   uint draw = draws[instance];\n"
+"   uint k = atomicAdd(commands[5*draw + 1], 1u);\n"
+"   visible[commands[5*draw + 4] + k] = instance;\n"
+"}\n"
+;
+
+
+// GLSLProgram only links vertex, geometry and fragment stages
+GLuint compileComputeProgram(const char* source)
+{
+  const GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+  glShaderSource(shader, 1, &source, NULL);
+  glCompileShader(shader);
+  GLint ok = 0;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok) {
+    char log[4096];
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    std::cerr << "Failed to compile compute shader:\n" << log << std::endl;
+    glDeleteShader(shader);
+    return 0;
+  }
+  const GLuint program = glCreateProgram();
+  glAttachShader(program, shader);
+  glLinkProgram(program);
+  glDeleteShader(shader);
+  glGetProgramiv(program, GL_LINK_STATUS, &ok);
+  if (!ok) {
+    char log[4096];
+    glGetProgramInfoLog(program, sizeof(log), NULL, log);
+    std::cerr << "Failed to link compute program:\n" << log << std::endl;
+    glDeleteProgram(program);
+    return 0;
+  }
+  return program;
+}
+
+// 8 bit AO values quantized into the occlusion buffer per frame while it fills, about 4 MB
+const size_t OCCL_VALUES_PER_FRAME = size_t(1) << 22;
+
+// Ground plane offset change per key press of a live bake, in scene sizes
+const float GROUND_OFFSET_STEP = 0.01f;
+
+// A range of the position buffer.  Meshes whose vertex arrays overlap in memory at the same stride, such as bk3d
+// prim groups over windows of one vertex buffer, share one block and draw from their own base vertex in it.
+struct VertexBlock
+{
+  const char* begin;
+  const char* end;
+  unsigned stride_bytes;
+  GLuint base_vertex;
+
+  size_t numVertices() const { return size_t(end - begin - 3*sizeof(float)) / stride_bytes + 1; }
+};
+
+struct MeshVerticesLess
+{
+  const bake::Mesh* meshes;
+  explicit MeshVerticesLess(const bake::Mesh* m) : meshes(m) {}
+  bool operator()(size_t a, size_t b) const
+  {
+    const unsigned stride_a = meshes[a].vertex_stride_bytes ? meshes[a].vertex_stride_bytes : 3*sizeof(float);
+    const unsigned stride_b = meshes[b].vertex_stride_bytes ? meshes[b].vertex_stride_bytes : 3*sizeof(float);
+    if (stride_a != stride_b) return stride_a < stride_b;
+    return std::less<const float*>()(meshes[a].vertices, meshes[b].vertices);
+  }
+};
+
+// Splits the vertex arrays of all meshes into blocks, and sets the base vertex of each mesh in the packed buffer
+void shareVertexBlocks(const bake::Mesh* meshes, const size_t num_meshes, std::vector<VertexBlock>& blocks, std::vector<GLuint>& base_vertices)
+{
+  std::vector<size_t> order;
+  for (size_t meshIdx = 0; meshIdx < num_meshes; ++meshIdx) {
+    if (meshes[meshIdx].num_vertices > 0) order.push_back(meshIdx);
+  }
+  std::sort(order.begin(), order.end(), MeshVerticesLess(meshes));
+
+  std::vector<size_t> mesh_block(num_meshes, 0);
+  for (size_t k = 0; k < order.size(); ++k) {
+    const bake::Mesh& mesh = meshes[order[k]];
+    const unsigned stride_bytes = mesh.vertex_stride_bytes ? mesh.vertex_stride_bytes : 3*sizeof(float);
+    const char* begin = reinterpret_cast<const char*>(mesh.vertices);
+    const char* end = begin + (mesh.num_vertices - 1)*stride_bytes + 3*sizeof(float);
+    if (!blocks.empty() && blocks.back().stride_bytes == stride_bytes && begin < blocks.back().end &&
+        size_t(begin - blocks.back().begin) % stride_bytes == 0) {
+      blocks.back().end = std::max(blocks.back().end, end);
+    } else {
+      const VertexBlock block = { begin, end, stride_bytes, 0 };
+      blocks.push_back(block);
+    }
+    mesh_block[order[k]] = blocks.size() - 1;
+  }
+
+  size_t num_vertices = 0;
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    blocks[b].base_vertex = GLuint(num_vertices);
+    num_vertices += blocks[b].numVertices();
+  }
+  base_vertices.assign(num_meshes, 0);
+  for (size_t k = 0; k < order.size(); ++k) {
+    const VertexBlock& block = blocks[mesh_block[order[k]]];
+    const char* begin = reinterpret_cast<const char*>(meshes[order[k]].vertices);
+    base_vertices[order[k]] = block.base_vertex + GLuint(size_t(begin - block.begin) / block.stride_bytes);
+  }
+}
+
 
 class MyWindow: public WindowInertiaCamera
 {
@@ -70,12 +218,24 @@ private:
   const bake::Instance* m_instances;
   const size_t m_num_instances;
   float const* const* m_vertex_ao;
-  std::vector<GLuint> m_vaos;
+  bake::LiveView* m_live;              // NULL unless a bake refines m_vertex_ao while it is shown
+  unsigned m_live_version;
+  GLuint m_occl_buffer;
+  unsigned char* m_occl_mapped;          // persistent mapping of m_occl_buffer, NULL without buffer storage
+  std::vector<size_t> m_occl_instances;  // an instance with each distinct occlusion array, one per slot
+  std::vector<size_t> m_occl_offsets;    // where its values start in m_occl_buffer
+  size_t m_occl_ready;                   // slots streamed into m_occl_buffer so far
+  GLuint m_vao;
+  GLuint m_indirect_buffer;
+  GLsizei m_num_draws;
+  std::vector<GLuint> m_commands;  // indirect draws with no instances, reset every frame before culling
+  GLuint m_cull_program;
 
   const vec3f m_initial_eye;
   const vec3f m_initial_lookat;
 
   bool m_draw_edges;
+  bool m_cull;
 
 public:
   GLSLProgram m_prog;
@@ -85,6 +245,7 @@ public:
            const bake::Instance* instances,
            const size_t num_instances,
            float const* const* vertex_ao,
+           bake::LiveView* live,
            // Initial camera params
            const vec3f& eye,
            const vec3f& lookat,
@@ -97,75 +258,194 @@ public:
     m_instances(instances),
     m_num_instances(num_instances),
     m_vertex_ao(vertex_ao),
+    m_live(live),
+    m_live_version(0),
+    m_occl_buffer(0),
+    m_occl_mapped(NULL),
+    m_occl_ready(0),
+    m_vao(0),
+    m_indirect_buffer(0),
+    m_num_draws(0),
+    m_cull_program(0),
     m_initial_eye(eye),
     m_initial_lookat(lookat),
     m_draw_edges(false),
+    m_cull(true),
     m_prog("Mesh Program") {}
 
   virtual bool init()
   {
     if (!WindowInertiaCamera::init()) return false;
 
-    if (!m_prog.compileProgram(vertex_program, NULL, fragment_program)) return false;
-
-    // Per mesh data (shared by one or more instances)
-    std::vector<GLuint> mesh_vbos(m_num_meshes);
-    glGenBuffers((GLsizei)m_num_meshes, &mesh_vbos[0]);
-    std::vector<GLuint> mesh_ebos(m_num_meshes);
-    glGenBuffers((GLsizei)m_num_meshes, &mesh_ebos[0]);
+    GLint major_version = 0, minor_version = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major_version);
+    glGetIntegerv(GL_MINOR_VERSION, &minor_version);
+    if (major_version < 4 || (major_version == 4 && minor_version < 3)) {
+      std::cerr << "The viewer needs OpenGL 4.3 for storage buffers and indirect draws" << std::endl;
+      return false;
+    }
 
+    if (!m_prog.compileProgram(vertex_program, NULL, fragment_program)) return false;
+    m_cull_program = compileComputeProgram(cull_program);
+    if (!m_cull_program) return false;
+
+    // All meshes share one position and one index buffer, with positions packed whatever the stride of each mesh.
+    // Vertices shared by several meshes are uploaded once, as are index arrays; each mesh draws its own index range.
+    const unsigned vertex_stride_bytes = 3*sizeof(float);
+    std::vector<VertexBlock> vertex_blocks;
+    std::vector<GLuint> base_vertices;
+    shareVertexBlocks(m_meshes, m_num_meshes, vertex_blocks, base_vertices);
+    size_t num_vertices = 0;
+    for (size_t b = 0; b < vertex_blocks.size(); ++b) {
+      num_vertices += vertex_blocks[b].numVertices();
+    }
+    std::vector<GLuint> first_indices(m_num_meshes);
+    std::vector<size_t> unique_indices;  // first mesh with each index array
+    std::map<const unsigned int*, size_t> index_meshes;
+    size_t num_indices = 0;
     for (size_t meshIdx = 0; meshIdx < m_num_meshes; ++meshIdx) {
-
-      // Fill position buffer
-
-      glBindBuffer(GL_ARRAY_BUFFER, mesh_vbos[meshIdx]);
-
       const bake::Mesh& mesh = m_meshes[meshIdx];
-      const size_t vertex_count = mesh.num_vertices;
-      const float* positions = mesh.vertices;
-      const unsigned vertex_stride_bytes = mesh.vertex_stride_bytes > 0 ? 
-                                           mesh.vertex_stride_bytes :
-                                           3*sizeof(float);
-      glBufferData(GL_ARRAY_BUFFER, vertex_count*vertex_stride_bytes, positions, GL_STATIC_DRAW);
-
-      // Fill index buffer
-
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh_ebos[meshIdx]);
-      const size_t triangle_count = mesh.num_triangles;
-      const unsigned int* indices = mesh.tri_vertex_indices; 
-      glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int)*triangle_count*3, indices, GL_STATIC_DRAW);
+      std::map<const unsigned int*, size_t>::iterator it = index_meshes.find(mesh.tri_vertex_indices);
+      if (it != index_meshes.end() && m_meshes[it->second].num_triangles >= mesh.num_triangles) {
+        first_indices[meshIdx] = first_indices[it->second];
+        continue;
+      }
+      index_meshes[mesh.tri_vertex_indices] = meshIdx;
+      unique_indices.push_back(meshIdx);
+      first_indices[meshIdx] = GLuint(num_indices);
+      num_indices += 3*mesh.num_triangles;
     }
 
-    // Per instance data (vertex array objects, occlusion values)
-    m_vaos.resize(m_num_instances);
-    glGenVertexArrays((GLsizei)m_num_instances, &m_vaos[0]);
-    for (size_t instanceIdx = 0; instanceIdx < m_num_instances; ++instanceIdx) {
-
-      glBindVertexArray(m_vaos[instanceIdx]);
-      
-      // Bind existing position buffer to shader.
-      unsigned mesh_index = m_instances[instanceIdx].mesh_index;
-      glBindBuffer(GL_ARRAY_BUFFER, mesh_vbos[mesh_index]);
-
-      const bake::Mesh& mesh = m_meshes[mesh_index];
-      const unsigned vertex_stride_bytes = mesh.vertex_stride_bytes > 0 ? 
-                                           mesh.vertex_stride_bytes :
-                                           3*sizeof(float);
-      glVertexAttribPointer(/*slot*/ 0, /*components*/ 3, GL_FLOAT, GL_FALSE, vertex_stride_bytes, /*offset*/ 0);
-      glEnableVertexAttribArray(0);
-
-      // Fill occlusion buffer and bind to shader.  This buffer is per instance.
-      GLuint occl_vbo = 0;
-      glGenBuffers(1, &occl_vbo);
-      glBindBuffer(GL_ARRAY_BUFFER, occl_vbo);
-      glBufferData(GL_ARRAY_BUFFER, sizeof(float)*mesh.num_vertices, m_vertex_ao[instanceIdx], GL_STATIC_DRAW);
-      glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, /*stride*/ 0, /*offset*/ 0);
-      glEnableVertexAttribArray(1);
-      
-      // Bind existing index buffer
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh_ebos[mesh_index]);
+    glGenVertexArrays(1, &m_vao);
+    glBindVertexArray(m_vao);
+
+    GLuint buffers[10];
+    glGenBuffers(10, buffers);
+    const GLuint position_buffer = buffers[0];
+    const GLuint index_buffer    = buffers[1];
+    const GLuint visible_buffer  = buffers[2];
+    const GLuint xform_buffer    = buffers[3];
+    const GLuint offset_buffer   = buffers[4];
+    m_occl_buffer                = buffers[5];
+    const GLuint bounds_buffer   = buffers[6];
+    const GLuint draw_buffer     = buffers[7];
+    m_indirect_buffer            = buffers[8];
+    const GLuint slot_buffer     = buffers[9];
+
+    glBindBuffer(GL_ARRAY_BUFFER, position_buffer);
+    glBufferData(GL_ARRAY_BUFFER, num_vertices*vertex_stride_bytes, NULL, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, num_indices*sizeof(GLuint), NULL, GL_STATIC_DRAW);
+    std::vector<float> packed_vertices;
+    for (size_t b = 0; b < vertex_blocks.size(); ++b) {
+      const VertexBlock& block = vertex_blocks[b];
+      bake::Mesh block_mesh;
+      block_mesh.vertices = reinterpret_cast<float*>(const_cast<char*>(block.begin));
+      block_mesh.vertex_stride_bytes = block.stride_bytes;
+      block_mesh.num_vertices = block.numVertices();
+      const float* vertices = block_mesh.vertices;
+      if (!packedMeshVertices(block_mesh)) {
+        packed_vertices.resize(3*block_mesh.num_vertices);
+        packMeshVertices(block_mesh, &packed_vertices[0]);
+        vertices = &packed_vertices[0];
+      }
+      glBufferSubData(GL_ARRAY_BUFFER, size_t(block.base_vertex)*vertex_stride_bytes, block_mesh.num_vertices*vertex_stride_bytes, vertices);
+    }
+    for (size_t u = 0; u < unique_indices.size(); ++u) {
+      const bake::Mesh& mesh = m_meshes[unique_indices[u]];
+      glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, size_t(first_indices[unique_indices[u]])*sizeof(GLuint), 3*mesh.num_triangles*sizeof(GLuint), mesh.tri_vertex_indices);
+    }
+    glVertexAttribPointer(/*slot*/ 0, /*components*/ 3, GL_FLOAT, GL_FALSE, vertex_stride_bytes, /*offset*/ 0);
+    glEnableVertexAttribArray(0);
 
+    // Instances in mesh order, so the instances of a mesh are one indirect draw.  Occlusion arrays shared by several
+    // instances are stored once; offsets are relative to the base vertex of the mesh, which gl_VertexID includes.
+    std::vector<size_t> order(m_num_instances);
+    {
+      std::vector<size_t> mesh_offsets(m_num_meshes + 1, 0);
+      for (size_t i = 0; i < m_num_instances; ++i) mesh_offsets[m_instances[i].mesh_index + 1]++;
+      for (size_t meshIdx = 0; meshIdx < m_num_meshes; ++meshIdx) mesh_offsets[meshIdx + 1] += mesh_offsets[meshIdx];
+      for (size_t i = 0; i < m_num_instances; ++i) order[mesh_offsets[m_instances[i].mesh_index]++] = i;
     }
+    std::vector<float> bounds(8*m_num_instances, 1.0f);
+    std::vector<float> xforms(16*m_num_instances);
+    std::vector<GLint> ao_offsets(m_num_instances);
+    std::vector<GLuint> occl_slots(m_num_instances);
+    std::map<const float*, size_t> slot_of_occl;
+    size_t num_occl_values = 0;
+    for (size_t k = 0; k < m_num_instances; ++k) {
+      const bake::Instance& instance = m_instances[order[k]];
+      std::copy(instance.bbox_min, instance.bbox_min + 3, &bounds[8*k]);
+      std::copy(instance.bbox_max, instance.bbox_max + 3, &bounds[8*k + 4]);
+      std::copy(instance.xform, instance.xform + 16, &xforms[16*k]);
+      std::map<const float*, size_t>::iterator it = slot_of_occl.find(m_vertex_ao[order[k]]);
+      if (it == slot_of_occl.end()) {
+        it = slot_of_occl.insert(std::make_pair(m_vertex_ao[order[k]], m_occl_instances.size())).first;
+        m_occl_instances.push_back(order[k]);
+        m_occl_offsets.push_back(num_occl_values);
+        num_occl_values += m_meshes[instance.mesh_index].num_vertices;
+      }
+      occl_slots[k] = GLuint(it->second);
+      ao_offsets[k] = GLint(m_occl_offsets[it->second]) - GLint(base_vertices[instance.mesh_index]);
+    }
+
+    // Visible instances, written by the cull pass
+    glBindBuffer(GL_ARRAY_BUFFER, visible_buffer);
+    glBufferData(GL_ARRAY_BUFFER, m_num_instances*sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, visible_buffer);
+    glVertexAttribIPointer(1, 1, GL_UNSIGNED_INT, /*stride*/ 0, /*offset*/ 0);
+    glVertexAttribDivisor(1, 1);
+    glEnableVertexAttribArray(1);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, xform_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, xforms.size()*sizeof(float), xforms.empty() ? NULL : &xforms[0], GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, xform_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, offset_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, ao_offsets.size()*sizeof(GLint), ao_offsets.empty() ? NULL : &ao_offsets[0], GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, offset_buffer);
+
+    // One byte of AO per vertex.  The buffer stays mapped where buffer storage is available (GL 4.4), and is filled a
+    // few MB per frame from idle(), so the window responds from the first frame and instances appear as their AO lands.
+    const size_t occl_bytes = std::max((num_occl_values + 3) / 4 * 4, size_t(4));
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_occl_buffer);
+    if (major_version > 4 || minor_version >= 4) {
+      const GLbitfield map_flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_SHADER_STORAGE_BUFFER, occl_bytes, NULL, map_flags | GL_DYNAMIC_STORAGE_BIT);
+      m_occl_mapped = static_cast<unsigned char*>(glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, occl_bytes, map_flags));
+    } else {
+      glBufferData(GL_SHADER_STORAGE_BUFFER, occl_bytes, NULL, GL_DYNAMIC_DRAW);
+    }
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, m_occl_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, slot_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, occl_slots.size()*sizeof(GLuint), occl_slots.empty() ? NULL : &occl_slots[0], GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, slot_buffer);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, bounds_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, bounds.size()*sizeof(float), bounds.empty() ? NULL : &bounds[0], GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, bounds_buffer);
+
+    // One indirect draw per mesh, for the visible instances among its range of the instance order
+    std::vector<GLuint> draws(m_num_instances);
+    for (size_t k = 0; k < m_num_instances; ) {
+      const unsigned mesh_index = m_instances[order[k]].mesh_index;
+      size_t end = k;
+      while (end < m_num_instances && m_instances[order[end]].mesh_index == mesh_index) ++end;
+      const GLuint command[] = { GLuint(3*m_meshes[mesh_index].num_triangles),  // count
+                                 0,                                             // instance count, from culling
+                                 first_indices[mesh_index],
+                                 base_vertices[mesh_index],
+                                 GLuint(k) };                                   // base instance
+      std::fill(draws.begin() + k, draws.begin() + end, GLuint(m_commands.size() / 5));
+      m_commands.insert(m_commands.end(), command, command + 5);
+      k = end;
+    }
+    m_num_draws = GLsizei(m_commands.size() / 5);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, draw_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, draws.size()*sizeof(GLuint), draws.empty() ? NULL : &draws[0], GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, draw_buffer);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_indirect_buffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, m_commands.size()*sizeof(GLuint), m_commands.empty() ? NULL : &m_commands[0], GL_DYNAMIC_COPY);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, m_indirect_buffer);
 
     glEnable(GL_DEPTH_TEST);
 
@@ -178,49 +458,101 @@ public:
     return true;
   }
 
+  size_t numOcclValues(size_t slot) const
+  {
+    return m_meshes[m_instances[m_occl_instances[slot]].mesh_index].num_vertices;
+  }
+
+  // Quantizes the AO of slots [begin, end) into the occlusion buffer, through the mapping or a staging copy
+  void writeOcclusion(size_t begin, size_t end)
+  {
+    if (begin >= end) return;
+    const size_t first_value = m_occl_offsets[begin];
+    const size_t num_values = m_occl_offsets[end - 1] + numOcclValues(end - 1) - first_value;
+    if (num_values == 0) return;
+    std::vector<unsigned char> staging(m_occl_mapped ? 0 : num_values);
+    unsigned char* dst = m_occl_mapped ? m_occl_mapped + first_value : &staging[0];
+#pragma omp parallel for schedule(dynamic, 16) if(num_values >= (1 << 16))
+    for (long long u = (long long)begin; u < (long long)end; ++u) {
+      const float* ao = m_vertex_ao[m_occl_instances[u]];
+      unsigned char* q = dst + (m_occl_offsets[u] - first_value);
+      const size_t n = numOcclValues(size_t(u));
+      for (size_t v = 0; v < n; ++v) q[v] = (unsigned char)(std::min(std::max(ao[v], 0.0f), 1.0f)*255.0f + 0.5f);
+    }
+    if (!m_occl_mapped) {
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_occl_buffer);
+      glBufferSubData(GL_SHADER_STORAGE_BUFFER, first_value, num_values, &staging[0]);
+    }
+  }
+
+  // Streams the next slots, about OCCL_VALUES_PER_FRAME values.  Returns false once all are in.
+  bool streamOcclusion()
+  {
+    if (m_occl_ready == m_occl_instances.size()) return false;
+    size_t end = m_occl_ready;
+    size_t num_values = 0;
+    while (end < m_occl_instances.size() && num_values < OCCL_VALUES_PER_FRAME) num_values += numOcclValues(end++);
+    writeOcclusion(m_occl_ready, end);
+    m_occl_ready = end;
+    return true;
+  }
+
+  virtual void idle()
+  {
+    bool redraw = false;
+    if (!m_live) {
+      redraw = streamOcclusion();
+    } else if (m_live->tryRead()) {
+      // The bake is not writing: take its latest estimate for the slots in so far, then stream more
+      if (m_live->updatedSince(m_live_version)) {
+        writeOcclusion(0, m_occl_ready);
+        redraw = true;
+      }
+      redraw = streamOcclusion() || redraw;
+      m_live->endRead();
+    }
+    // Draw new AO with the camera still
+    if (redraw) postRedisplay();
+    WindowInertiaCamera::idle();
+  }
+
   virtual void display()
   {
     WindowInertiaCamera::display();
 
-    m_prog.enable();
     mat4f world2screen = m_projection * m_camera.m4_view;
+    if (m_live) m_live->setCamera(world2screen.mat_array);
+
+    // Cull on the device, so frame time follows visible instances without a read back
+    if (m_num_draws > 0) {
+      glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_indirect_buffer);
+      glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, m_commands.size()*sizeof(GLuint), &m_commands[0]);
+      glUseProgram(m_cull_program);
+      glUniformMatrix4fv(glGetUniformLocation(m_cull_program, "world2screen"), 1, GL_FALSE, world2screen.mat_array);
+      glUniform1ui(glGetUniformLocation(m_cull_program, "num_instances"), GLuint(m_num_instances));
+      glUniform1ui(glGetUniformLocation(m_cull_program, "num_ready_slots"), GLuint(m_occl_ready));
+      glUniform1i(glGetUniformLocation(m_cull_program, "cull"), m_cull ? 1 : 0);
+      glDispatchCompute(GLuint((m_num_instances + 255) / 256), 1, 1);
+      glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+    }
+
+    m_prog.enable();
     m_prog.setUniformMatrix4fv("world2screen", world2screen.mat_array, /*transpose*/ false);
 
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
+    glBindVertexArray(m_vao);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_indirect_buffer);
 
-    for (size_t i = 0; i < m_num_instances; ++i) {
-
-      // Note: optix matrix is transposed from opengl
-      m_prog.setUniformMatrix4fv("object2world", const_cast<GLfloat*>(m_instances[i].xform), /*transpose*/ true);
-      
-      glBindVertexArray(m_vaos[i]);
-      glEnableVertexAttribArray(1);  // occlusion attrib
-
-      const bake::Mesh& mesh = m_meshes[m_instances[i].mesh_index];
-      const size_t num_triangles = mesh.num_triangles;
-      const GLsizei num_indices = static_cast<GLsizei>(num_triangles*3);
-      glDrawElements(GL_TRIANGLES, num_indices, GL_UNSIGNED_INT, 0);
-    }
+    m_prog.setUniform1f("constant_occl", -1.0f);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, /*offset*/ 0, m_num_draws, /*stride*/ 0);
 
     if (m_draw_edges) {
 
       glPolygonMode ( GL_FRONT_AND_BACK, GL_LINE );	
-      for (size_t i = 0; i < m_num_instances; ++i) {
-
-        // Note: optix matrix is transposed from opengl
-        m_prog.setUniformMatrix4fv("object2world", const_cast<GLfloat*>(m_instances[i].xform), /*transpose*/ true);
-        
-        glBindVertexArray(m_vaos[i]);
-        // replace occlusion array with constant value for edges
-        glDisableVertexAttribArray(1);  
-        glVertexAttrib1f(1, 0.2f);
-
-        const bake::Mesh& mesh = m_meshes[m_instances[i].mesh_index];
-        const size_t num_triangles = mesh.num_triangles;
-        const GLsizei num_indices = static_cast<GLsizei>(num_triangles*3);
-        glDrawElements(GL_TRIANGLES, num_indices, GL_UNSIGNED_INT, 0);
-      }
+      // replace occlusion with constant value for edges
+      m_prog.setUniform1f("constant_occl", 0.2f);
+      glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, /*offset*/ 0, m_num_draws, /*stride*/ 0);
       glPolygonMode ( GL_FRONT_AND_BACK, GL_FILL );
 
     }
@@ -244,6 +576,10 @@ public:
         m_camera.look_at(vec3f(m_initial_lookat - initial_view_dist*current_view_vector), m_initial_lookat, /*reset*/ true);
         break;
       }
+      case 'c':  // toggle frustum culling
+      case 'C':
+        m_cull = !m_cull;
+        break;
       case 'e':  // toggle edges
       case 'E':
         m_draw_edges = !m_draw_edges;
@@ -253,8 +589,33 @@ public:
           glDisable( GL_POLYGON_OFFSET_FILL );
         }
         break;
+      default:
+        tweakLiveBake(key);
+        break;
     }
   }
+
+  // Keys that bake a live view again with other parameters: [ and ] the hit distance, - and + the rays per sample,
+  // , and . the ground plane offset.  The AO shown stays until the new bake's first estimate.
+  void tweakLiveBake( unsigned char key )
+  {
+    bake::LiveParameters parameters;
+    if (!m_live || !m_live->parameters(parameters)) return;
+    switch(key)
+    {
+      case '[': parameters.hit_distance *= 0.8f; break;
+      case ']': parameters.hit_distance *= 1.25f; break;
+      case '-': parameters.num_rays = std::max(parameters.num_rays / 2, 1); break;
+      case '+':
+      case '=': parameters.num_rays *= 2; break;
+      case ',': parameters.ground_offset -= GROUND_OFFSET_STEP; break;
+      case '.': parameters.ground_offset += GROUND_OFFSET_STEP; break;
+      default: return;
+    }
+    std::cerr << "Rebake with hit distance " << parameters.hit_distance << ", ground offset " << parameters.ground_offset 
+              << ", " << parameters.num_rays << " rays" << std::endl;
+    m_live->requestParameters(parameters);
+  }
   
 }; // MyWindow
 
@@ -264,7 +625,7 @@ namespace bake {
 
   void view( const Mesh* meshes, const size_t num_meshes, 
              const bake::Instance* instances, const size_t num_instances, float const* const* vertex_colors,
-             float scene_bbox_min[3], float scene_bbox_max[3])
+             float scene_bbox_min[3], float scene_bbox_max[3], LiveView* live)
   {
 
     vec3f bbox_min(scene_bbox_min);
@@ -280,11 +641,11 @@ namespace bake {
     const float clipnear = 0.01f*max_extent;
     const float clipfar = 10.0f*max_extent;
 
-    static MyWindow window(meshes, num_meshes, instances, num_instances, vertex_colors, eye, lookat, fov, clipnear, clipfar);
+    static MyWindow window(meshes, num_meshes, instances, num_instances, vertex_colors, live, eye, lookat, fov, clipnear, clipfar);
 
     NVPWindow::ContextFlags context(
-      1,      //major;
-      0,      //minor;
+      4,      //major;
+      3,      //minor;
       false,  //core;
       8,      //MSAA;
       24,     //depth bits
@@ -295,7 +656,10 @@ namespace bake {
       NULL    //share;
       );
 
-    if (!window.create("Baked AO Viewer", &context)) return;
+    if (!window.create(live ? "Baked AO Viewer (live)" : "Baked AO Viewer", &context)) {
+      if (live) live->close();
+      return;
+    }
 
     window.makeContextCurrent();
     window.swapInterval(0);
@@ -303,6 +667,7 @@ namespace bake {
     while(MyWindow::sysPollEvents(false)) {
       window.idle();
     }
+    if (live) live->close();
 
   }
 
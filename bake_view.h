@@ -24,10 +24,119 @@
 #pragma once
 
 #include "bake_api.h"
+#include "bake_util.h"
 
 namespace bake
 {
 
+  // Bake parameters the viewer's keys change while it shows a live bake, for the bake to trace again with
+  struct LiveParameters
+  {
+    float hit_distance;
+    float ground_offset;  // fraction of the scene size, as --ground_setup
+    int   num_rays;
+  };
+
+  // Vertex AO that a progressive bake refines while the viewer shows it.  The bake writes the arrays passed to view
+  // between beginUpdate and endUpdate; the viewer only reads them between a successful tryRead and endRead, and
+  // uploads them again after an update.  The viewer closes it when its window goes away.
+  class LiveView
+  {
+  public:
+    LiveView() : m_version( 0 ), m_closed( false ), m_has_camera( false ), m_tweakable( false ), m_request( 0 ) {}
+
+    void beginUpdate() { m_mutex.lock(); }
+    void endUpdate()   { ++m_version; m_mutex.unlock(); }
+
+    // False while an update is under way; otherwise the arrays stay locked until endRead
+    bool tryRead() { return m_mutex.tryLock(); }
+    void endRead() { m_mutex.unlock(); }
+    // Between tryRead and endRead: whether there was an update since 'version', which is advanced
+    bool updatedSince( unsigned& version )
+    {
+      const bool updated = m_version != version;
+      version = m_version;
+      return updated;
+    }
+
+    void close()  { m_mutex.lock(); m_closed = true; m_mutex.unlock(); }
+    bool closed() { m_mutex.lock(); const bool c = m_closed; m_mutex.unlock(); return c; }
+
+    // The viewer's world to clip space matrix (column major, as OpenGL), set every frame, for the bake to trace
+    // what is in view first.  Under a lock of its own, so a frame doesn't wait for an update.
+    void setCamera( const float world2clip[16] )
+    {
+      m_camera_mutex.lock();
+      std::copy( world2clip, world2clip + 16, m_world2clip );
+      m_has_camera = true;
+      m_camera_mutex.unlock();
+    }
+    // False until the first frame
+    bool camera( float world2clip[16] )
+    {
+      m_camera_mutex.lock();
+      const bool has_camera = m_has_camera;
+      if (has_camera) std::copy( m_world2clip, m_world2clip + 16, world2clip );
+      m_camera_mutex.unlock();
+      return has_camera;
+    }
+
+    // The bake offers its parameters once its first trace is done; from then on the viewer can request a bake with
+    // others, which restarts any bake under way
+    void setParameters( const LiveParameters& parameters )
+    {
+      m_parameter_mutex.lock();
+      m_parameters = parameters;
+      m_tweakable = true;
+      m_parameter_mutex.unlock();
+    }
+    // False until the bake offers them
+    bool parameters( LiveParameters& parameters )
+    {
+      m_parameter_mutex.lock();
+      const bool tweakable = m_tweakable;
+      parameters = m_parameters;
+      m_parameter_mutex.unlock();
+      return tweakable;
+    }
+    void requestParameters( const LiveParameters& parameters )
+    {
+      m_parameter_mutex.lock();
+      m_parameters = parameters;
+      ++m_request;
+      m_parameter_mutex.unlock();
+    }
+    // Whether the viewer requested parameters since 'request', which takeRequest advances
+    bool requestedSince( const unsigned request )
+    {
+      m_parameter_mutex.lock();
+      const bool requested = m_request != request;
+      m_parameter_mutex.unlock();
+      return requested;
+    }
+    bool takeRequest( unsigned& request, LiveParameters& parameters )
+    {
+      m_parameter_mutex.lock();
+      const bool requested = m_request != request;
+      request = m_request;
+      parameters = m_parameters;
+      m_parameter_mutex.unlock();
+      return requested;
+    }
+
+  private:
+    Mutex    m_mutex;
+    unsigned m_version;
+    bool     m_closed;
+    Mutex    m_camera_mutex;
+    float    m_world2clip[16];
+    bool     m_has_camera;
+    Mutex    m_parameter_mutex;
+    LiveParameters m_parameters;
+    bool     m_tweakable;
+    unsigned m_request;
+  };
+
   void view(
     const bake::Mesh* meshes,
     const size_t num_meshes,
@@ -35,6 +144,7 @@ namespace bake
     const size_t num_instances,
     float const* const* vertex_colors,
     float scene_bbox_min[3], 
-    float scene_bbox_max[3] );
+    float scene_bbox_max[3],
+    LiveView* live = NULL );
 
 }
@@ -0,0 +1,124 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#include "bake_weld.h"
+#include "bake_util.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+
+namespace {
+
+// Quantized position and index of a vertex; sorting puts the vertices of a cell next to each other, lowest index first
+struct WeldKey
+{
+  unsigned x, y, z;
+  unsigned vertex;
+
+  bool sameCell( const WeldKey& k ) const { return x == k.x && y == k.y && z == k.z; }
+  bool operator<( const WeldKey& k ) const
+  {
+    if (x != k.x) return x < k.x;
+    if (y != k.y) return y < k.y;
+    if (z != k.z) return z < k.z;
+    return vertex < k.vertex;
+  }
+};
+
+unsigned float_bits( const float f )
+{
+  const float g = f + 0.0f;  // -0 welds with +0
+  unsigned bits;
+  std::memcpy( &bits, &g, sizeof(bits) );
+  return bits;
+}
+
+}  // namespace
+
+
+void bake::weld_mesh( const Mesh& mesh, const float tolerance, WeldedMesh& welded )
+{
+  const size_t n = mesh.num_vertices;
+  const unsigned stride = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+  const unsigned char* vertices = reinterpret_cast<const unsigned char*>( mesh.vertices );
+
+  // Cells are kept to 2^30 along the largest axis, so quantized coordinates fit; a tolerance of 0, or a mesh with 
+  // no extent, keys by the float bits
+  float extent[3];
+  for (int k = 0; k < 3; ++k) extent[k] = std::max( mesh.bbox_max[k] - mesh.bbox_min[k], 0.0f );
+  const float diagonal = std::sqrt( extent[0]*extent[0] + extent[1]*extent[1] + extent[2]*extent[2] );
+  const float cell = tolerance > 0.0f && diagonal > 0.0f ? std::max( tolerance*diagonal, diagonal / float(1 << 30) ) : 0.0f;
+
+  std::vector<WeldKey> keys( n );
+#pragma omp parallel for if(n >= (1 << 16))
+  for (ptrdiff_t v = 0; v < ptrdiff_t(n); ++v) {
+    const float* p = reinterpret_cast<const float*>( vertices + v*stride );
+    unsigned q[3];
+    for (int k = 0; k < 3; ++k) {
+      q[k] = cell > 0.0f ? unsigned( std::max( std::floor( (p[k] - mesh.bbox_min[k]) / cell ), 0.0f ) ) : float_bits( p[k] );
+    }
+    const WeldKey key = { q[0], q[1], q[2], unsigned( v ) };
+    keys[v] = key;
+  }
+  parallelSort( keys );
+
+  // The lowest vertex of each cell stands for the others
+  std::vector<unsigned> first( n );
+  for (size_t k = 0, cell_first = 0; k < n; ++k) {
+    if (k == 0 || !keys[k].sameCell( keys[k-1] )) cell_first = keys[k].vertex;
+    first[keys[k].vertex] = unsigned( cell_first );
+  }
+  std::vector<WeldKey>().swap( keys );
+
+  welded.remap.resize( n );
+  welded.positions.clear();
+  for (size_t v = 0; v < n; ++v) {
+    if (first[v] == v) {
+      const float* p = reinterpret_cast<const float*>( vertices + v*stride );
+      welded.remap[v] = unsigned( welded.positions.size() / 3 );
+      welded.positions.insert( welded.positions.end(), p, p + 3 );
+    } else {
+      welded.remap[v] = welded.remap[first[v]];
+    }
+  }
+
+  welded.tri_vertex_indices.resize( 3*mesh.num_triangles );
+#pragma omp parallel for if(mesh.num_triangles >= (1 << 16))
+  for (ptrdiff_t i = 0; i < ptrdiff_t(3*mesh.num_triangles); ++i) {
+    welded.tri_vertex_indices[i] = welded.remap[mesh.tri_vertex_indices[i]];
+  }
+
+  welded.mesh = mesh;
+  welded.mesh.num_vertices = welded.positions.size() / 3;
+  welded.mesh.vertices = welded.positions.empty() ? NULL : &welded.positions[0];
+  welded.mesh.vertex_stride_bytes = 3*sizeof(float);
+  welded.mesh.normals = NULL;
+  welded.mesh.normal_stride_bytes = 0;
+  welded.mesh.texcoords = NULL;
+  welded.mesh.texcoord_stride_bytes = 0;
+  welded.mesh.geometry_memory = bake::MEMORY_SPACE_HOST;
+  welded.mesh.tri_vertex_indices = welded.tri_vertex_indices.empty() ? NULL : &welded.tri_vertex_indices[0];
+}
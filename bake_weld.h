@@ -0,0 +1,49 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#include "bake_api.h"
+
+#include <vector>
+
+namespace bake {
+
+// A mesh with its copies of a vertex at UV and normal seams merged into one, so that the filters see one unknown per
+// point of the surface.  Triangles keep their order, so the samples of the original mesh index the welded one.
+struct WeldedMesh
+{
+  Mesh mesh;                              // points into the arrays below; only positions and triangles are set
+  std::vector<unsigned> remap;            // welded vertex of each vertex of the original mesh
+  std::vector<float>    positions;        // float3 per welded vertex
+  std::vector<unsigned> tri_vertex_indices;
+};
+
+// Vertices whose positions fall in the same cell of a grid tolerance times the bbox diagonal of the mesh across are
+// welded; a tolerance of 0 welds bitwise equal positions only.  Welded vertices keep the order of the first vertex
+// of each, and its position.  welded must not be copied afterwards, its mesh points into it.
+void weld_mesh(
+    const Mesh&  mesh,
+    const float  tolerance,
+    WeldedMesh&  welded  // output
+    );
+
+}
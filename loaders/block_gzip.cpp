@@ -0,0 +1,253 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#include "block_gzip.h"
+
+#ifndef NOGZLIB
+
+#include "mapped_file.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+
+namespace {
+
+const unsigned BLOCK_INPUT_SIZE = 0xff00;  // leaves room for incompressible input within 64KB
+const size_t   BLOCKS_PER_BATCH = 256;
+
+const unsigned char GZIP_FEXTRA   = 4;
+const unsigned char GZIP_FNAME    = 8;
+const unsigned char GZIP_FCOMMENT = 16;
+const unsigned char GZIP_FHCRC    = 2;
+
+const size_t BLOCK_HEADER_SIZE  = 18;
+const size_t BLOCK_TRAILER_SIZE = 8;
+
+const unsigned char EOF_BLOCK[28] = {
+  0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 'B', 'C', 0x02, 0, 0x1b, 0,
+  0x03, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+inline unsigned read_le16(const unsigned char* p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+inline unsigned read_le32(const unsigned char* p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+inline void write_le16(unsigned char* p, unsigned v)
+{
+  p[0] = (unsigned char)(v & 0xff);
+  p[1] = (unsigned char)((v >> 8) & 0xff);
+}
+
+inline void write_le32(unsigned char* p, unsigned v)
+{
+  write_le16(p, v & 0xffff);
+  write_le16(p+2, v >> 16);
+}
+
+// Parses one member header at 'offset'. Returns the full member size, or 0 if
+// this is not a well-formed member with a 'BC' block size field.
+size_t parse_block_header(const unsigned char* data, size_t size, size_t offset, BlockGzipEntry& entry)
+{
+  const unsigned char* p = data + offset;
+  const size_t avail = size - offset;
+  if (avail < BLOCK_HEADER_SIZE + BLOCK_TRAILER_SIZE) return 0;
+  if (p[0] != 0x1f || p[1] != 0x8b || p[2] != Z_DEFLATED || !(p[3] & GZIP_FEXTRA)) return 0;
+
+  const size_t xlen = read_le16(p + 10);
+  size_t header_size = 12 + xlen;
+  if (header_size > avail) return 0;
+
+  size_t block_size = 0;
+  for (size_t x = 12; x + 4 <= 12 + xlen; ) {
+    const unsigned slen = read_le16(p + x + 2);
+    if (p[x] == 'B' && p[x+1] == 'C' && slen == 2) {
+      block_size = read_le16(p + x + 4) + 1;
+    }
+    x += 4 + slen;
+  }
+  if (block_size == 0 || block_size > avail) return 0;
+
+  // Optional fields are not written by bgzip, but are legal gzip.
+  if (p[3] & GZIP_FNAME)    { while (header_size < block_size && p[header_size]) ++header_size; ++header_size; }
+  if (p[3] & GZIP_FCOMMENT) { while (header_size < block_size && p[header_size]) ++header_size; ++header_size; }
+  if (p[3] & GZIP_FHCRC)    header_size += 2;
+  if (header_size + BLOCK_TRAILER_SIZE > block_size) return 0;
+
+  entry.data_offset = offset + header_size;
+  entry.data_size   = block_size - header_size - BLOCK_TRAILER_SIZE;
+  entry.crc         = read_le32(p + block_size - 8);
+  entry.out_size    = read_le32(p + block_size - 4);
+  return block_size;
+}
+
+bool compress_block(const unsigned char* in, unsigned in_size, int level, std::vector<unsigned char>& out)
+{
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+
+  out.resize(BLOCK_HEADER_SIZE + deflateBound(&zs, in_size) + BLOCK_TRAILER_SIZE);
+  zs.next_in   = (Bytef*)in;
+  zs.avail_in  = in_size;
+  zs.next_out  = &out[BLOCK_HEADER_SIZE];
+  zs.avail_out = (uInt)(out.size() - BLOCK_HEADER_SIZE - BLOCK_TRAILER_SIZE);
+  const int status = deflate(&zs, Z_FINISH);
+  const size_t compressed_size = zs.total_out;
+  deflateEnd(&zs);
+  if (status != Z_STREAM_END) return false;
+
+  const size_t block_size = BLOCK_HEADER_SIZE + compressed_size + BLOCK_TRAILER_SIZE;
+  if (block_size > 0x10000) return false;
+  out.resize(block_size);
+
+  memcpy(&out[0], EOF_BLOCK, BLOCK_HEADER_SIZE - 2);
+  write_le16(&out[16], (unsigned)(block_size - 1));
+  write_le32(&out[block_size - 8], (unsigned)crc32(0L, in, in_size));
+  write_le32(&out[block_size - 4], in_size);
+  return true;
+}
+
+} // namespace
+
+
+bool scan_block_gzip(const MappedFile& file, BlockGzipIndex& index)
+{
+  const unsigned char* data = (const unsigned char*)file.data();
+  const size_t size = file.size();
+
+  index.blocks.clear();
+  index.inflated_size = 0;
+
+  size_t offset = 0;
+  while (offset < size) {
+    BlockGzipEntry entry;
+    const size_t block_size = parse_block_header(data, size, offset, entry);
+    if (block_size == 0) {
+      index.blocks.clear();
+      return false;
+    }
+    if (entry.out_size > 0) {
+      entry.out_offset = index.inflated_size;
+      index.inflated_size += entry.out_size;
+      index.blocks.push_back(entry);
+    }
+    offset += block_size;
+  }
+  return !index.blocks.empty();
+}
+
+
+bool inflate_block_gzip(const MappedFile& file, const BlockGzipIndex& index, void* dst)
+{
+  const unsigned char* data = (const unsigned char*)file.data();
+  unsigned char* out = (unsigned char*)dst;
+  int failures = 0;
+
+#pragma omp parallel for reduction(+:failures) schedule(dynamic, 16)
+  for (ptrdiff_t i = 0; i < ptrdiff_t(index.blocks.size()); ++i) {
+    const BlockGzipEntry& entry = index.blocks[i];
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+      ++failures;
+      continue;
+    }
+    zs.next_in   = (Bytef*)(data + entry.data_offset);
+    zs.avail_in  = (uInt)entry.data_size;
+    zs.next_out  = out + entry.out_offset;
+    zs.avail_out = entry.out_size;
+    const int status = inflate(&zs, Z_FINISH);
+    const bool complete = status == Z_STREAM_END && zs.total_out == entry.out_size;
+    inflateEnd(&zs);
+    if (!complete || crc32(0L, out + entry.out_offset, entry.out_size) != entry.crc) {
+      ++failures;
+    }
+  }
+
+  return failures == 0;
+}
+
+
+bool write_block_gzip(const char* src_filename, const char* dst_filename, int level)
+{
+  // gzread passes uncompressed input through unchanged
+  gzFile src = gzopen(src_filename, "rb");
+  if (!src) {
+    std::cerr << "Could not open " << src_filename << std::endl;
+    return false;
+  }
+  FILE* dst = fopen(dst_filename, "wb");
+  if (!dst) {
+    std::cerr << "Could not open " << dst_filename << " for writing" << std::endl;
+    gzclose(src);
+    return false;
+  }
+
+  std::vector<unsigned char> input(BLOCKS_PER_BATCH*BLOCK_INPUT_SIZE);
+  std::vector< std::vector<unsigned char> > blocks(BLOCKS_PER_BATCH);
+  bool ok = true;
+
+  while (ok) {
+    const int n = gzread(src, &input[0], (unsigned)input.size());
+    if (n < 0) {
+      ok = false;
+      break;
+    }
+    if (n == 0) break;
+
+    const size_t num_blocks = (size_t(n) + BLOCK_INPUT_SIZE - 1) / BLOCK_INPUT_SIZE;
+    int failures = 0;
+#pragma omp parallel for reduction(+:failures)
+    for (ptrdiff_t i = 0; i < ptrdiff_t(num_blocks); ++i) {
+      const size_t begin = size_t(i)*BLOCK_INPUT_SIZE;
+      const unsigned in_size = (unsigned)std::min<size_t>(BLOCK_INPUT_SIZE, size_t(n) - begin);
+      if (!compress_block(&input[begin], in_size, level, blocks[i]) &&
+          !compress_block(&input[begin], in_size, 0, blocks[i])) {
+        ++failures;
+      }
+    }
+    ok = failures == 0;
+
+    for (size_t i = 0; ok && i < num_blocks; ++i) {
+      ok = fwrite(&blocks[i][0], 1, blocks[i].size(), dst) == blocks[i].size();
+    }
+  }
+
+  ok = ok && fwrite(EOF_BLOCK, 1, sizeof(EOF_BLOCK), dst) == sizeof(EOF_BLOCK);
+  gzclose(src);
+  ok = fclose(dst) == 0 && ok;
+  return ok;
+}
+
+#endif // NOGZLIB
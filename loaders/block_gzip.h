@@ -0,0 +1,66 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Block-compressed gzip container, the BGZF layout used by bgzip/htslib:
+// a series of independent gzip members of at most 64KB each, every member
+// carrying its compressed size in a 'BC' extra field, followed by an empty
+// end-of-file member. Any gzip reader can still inflate the file serially,
+// but the block table lets us inflate all members in parallel straight into
+// the destination buffer.
+
+struct BlockGzipEntry
+{
+  size_t   data_offset;   // start of the raw deflate stream in the file
+  size_t   data_size;
+  size_t   out_offset;    // start of the inflated bytes in the output
+  unsigned out_size;
+  unsigned crc;
+};
+
+struct BlockGzipIndex
+{
+  std::vector<BlockGzipEntry> blocks;
+  size_t inflated_size;
+};
+
+#ifndef NOGZLIB
+
+class MappedFile;
+
+// Scans the member headers of a mapped file. Returns false if the file is not
+// a block gzip container (e.g. a plain .gz), so callers can fall back to gzread.
+bool scan_block_gzip(const MappedFile& file, BlockGzipIndex& index);
+
+// Inflates all blocks in parallel into dst, which must hold
+// index.inflated_size bytes. Returns false on corrupt data.
+bool inflate_block_gzip(const MappedFile& file, const BlockGzipIndex& index, void* dst);
+
+// Recompresses any gzip or uncompressed file into a block gzip container.
+bool write_block_gzip(const char* src_filename, const char* dst_filename, int level);
+
+#endif
@@ -23,6 +23,8 @@
 /* Contact ckubisch@nvidia.com (Christoph Kubisch) for feedback */
 
 #include "cadscenefile.h"
+#include "mapped_file.h"
+#include "../bake_util.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -31,6 +33,7 @@
 #include <map>
 #if CSF_ZIP_SUPPORT
 #include <zlib.h>
+#include "block_gzip.h"
 #endif
 
 #include <string.h> // for memcpy
@@ -54,7 +57,8 @@
 
 struct CSFileMemory_s
 {
-  std::vector<void*>    m_allocations;
+  std::vector<void*>        m_allocations;
+  std::vector<MappedFile*>  m_mappings;
 
   void* alloc(size_t size, const void* indata=NULL)
   {
@@ -66,11 +70,27 @@ struct CSFileMemory_s
     return data;
   }
 
+  // copy-on-write view of the whole file, NULL if mapping is not available
+  void* map(const char* filename, size_t& size)
+  {
+    MappedFile* mapping = new MappedFile;
+    if (!mapping->open(filename)){
+      delete mapping;
+      return NULL;
+    }
+    m_mappings.push_back(mapping);
+    size = mapping->size();
+    return mapping->data();
+  }
+
   ~CSFileMemory_s()
   {
     for (size_t i = 0; i < m_allocations.size(); i++){
       free(m_allocations[i]);
     }
+    for (size_t i = 0; i < m_mappings.size(); i++){
+      delete m_mappings[i];
+    }
   }
 };
 
@@ -115,11 +135,15 @@ CSFAPI int     CSFile_loadRaw (CSFile** outcsf, size_t size, void* dataraw)
     csf->fileFlags = csf->fileFlags ? CADSCENEFILE_FLAG_UNIQUENODES : 0;
   }
 
+  Timer timer;
+  timer.start();
   csf->pointersOFFSET += (CSFoffset)csf;
   for (int i = 0; i < csf->numPointers; i++){
     CSFoffset* ptr = (CSFoffset*)(data + csf->pointers[i]);
     *(ptr) += (CSFoffset)csf;
   }
+  timer.stop();
+  recordTime("load.relocate", timer);
 
   if (csf->version < 4){
     for (int i = 0; i < csf->numNodes; i++){
@@ -140,7 +164,7 @@ CSFAPI int CSFile_load(CSFile** outcsf, const char* filename, CSFileMemoryPTR me
 #ifdef WIN32
   if (fopen_s(&file,filename,"rb"))
 #else
-  if (file = fopen(filename,"rb"))
+  if (!(file = fopen(filename,"rb")))
 #endif
   {
     *outcsf = 0;
@@ -167,7 +191,16 @@ CSFAPI int CSFile_load(CSFile** outcsf, const char* filename, CSFileMemoryPTR me
     *outcsf = 0;
     return CADSCENEFILE_ERROR_VERSION;
   }
-  
+
+  // Map the file rather than reading it: loadRaw only patches the pointer
+  // table and the structs it references, so geometry pages stay file-backed.
+  size_t mapsize = 0;
+  void*  mapped  = mem->map(filename, mapsize);
+  if (mapped && mapsize == size){
+    fclose(file);
+    return CSFile_loadRaw(outcsf,size,mapped);
+  }
+
   char* data  = (char*)mem->alloc(size);
   FREAD(data,size,size,1,file);
   fclose(file);
@@ -180,6 +213,25 @@ CSFAPI int CSFile_loadExt(CSFile** outcsf, const char* filename, CSFileMemoryPTR
 {
   size_t len = strlen(filename);
   if (strcmp(filename+len-3,".gz")==0) {
+    // block compressed files inflate in parallel, plain gzip falls through
+    {
+      MappedFile      mapping;
+      BlockGzipIndex  index;
+      if (mapping.open(filename) && scan_block_gzip(mapping, index)){
+        char* data = (char*)mem->alloc(index.inflated_size);
+        Timer timer;
+        timer.start();
+        const bool inflated = inflate_block_gzip(mapping, index, data);
+        timer.stop();
+        recordTime("load.inflate", timer);
+        if (!inflated){
+          *outcsf = 0;
+          return CADSCENEFILE_ERROR_VERSION;
+        }
+        return CSFile_loadRaw(outcsf,index.inflated_size,data);
+      }
+    }
+
     gzFile  filegz = gzopen(filename,"rb");
     if (!filegz){
       *outcsf = 0;
@@ -199,7 +251,12 @@ CSFAPI int CSFile_loadExt(CSFile** outcsf, const char* filename, CSFileMemoryPTR
 
     gzseek(filegz,0,SEEK_SET);
     char* data  = (char*)CSFileMemory_alloc(mem,sizeshould,0);
-    if (!gzread(filegz,data, (z_off_t)sizeshould)){
+    Timer timer;
+    timer.start();
+    const bool inflated = gzread(filegz,data, (z_off_t)sizeshould) != 0;
+    timer.stop();
+    recordTime("load.inflate", timer);
+    if (!inflated){
       gzclose(filegz);
       *outcsf = 0;
       return CADSCENEFILE_ERROR_VERSION;
@@ -528,27 +585,41 @@ static NV_FORCE_INLINE void Matrix44MultiplyFull( float* NV_RESTRICT clip, const
 
 }
 
-static void CSFile_transformHierarchy(CSFile *csf, CSFNode * NV_RESTRICT node, CSFNode * NV_RESTRICT parent)
-{
-  if (parent){
-    Matrix44MultiplyFull(node->worldTM, parent->worldTM, node->objectTM);
-  }
-  else{
-    Matrix44Copy(node->worldTM,node->objectTM);
-  }
-
-  for (int i = 0; i < node->numChildren; i++){
-    CSFNode* NV_RESTRICT child = csf->nodes + node->children[i];
-    CSFile_transformHierarchy(csf,child,node);
-  }
-}
-
+// Nodes of one depth only depend on their parents, so each level of the hierarchy
+// is transformed in parallel. Also avoids deep recursion on long node chains.
 CSFAPI int CSFile_transform( CSFile *csf )
 {
   if (!(csf->fileFlags & CADSCENEFILE_FLAG_UNIQUENODES))
     return CADSCENEFILE_ERROR_OPERATION;
 
-  CSFile_transformHierarchy(csf,csf->nodes + csf->rootIDX,NULL);
+  CSFNode* NV_RESTRICT root = csf->nodes + csf->rootIDX;
+  Matrix44Copy(root->worldTM,root->objectTM);
+
+  std::vector<int> parents(1, csf->rootIDX);
+  std::vector<int> children;
+  std::vector<size_t> offsets;
+  while (!parents.empty()){
+    // children of a parent are stored after those of the previous parents
+    offsets.resize(parents.size() + 1);
+    offsets[0] = 0;
+    for (size_t i = 0; i < parents.size(); i++){
+      offsets[i+1] = offsets[i] + csf->nodes[parents[i]].numChildren;
+    }
+    children.resize(offsets.back());
+
+    const ptrdiff_t numParents = ptrdiff_t(parents.size());
+#pragma omp parallel for schedule(dynamic, 64) if(children.size() > 4096)
+    for (ptrdiff_t i = 0; i < numParents; i++){
+      const CSFNode* NV_RESTRICT parent = csf->nodes + parents[i];
+      for (int c = 0; c < parent->numChildren; c++){
+        CSFNode* NV_RESTRICT child = csf->nodes + parent->children[c];
+        Matrix44MultiplyFull(child->worldTM, parent->worldTM, child->objectTM);
+        children[offsets[i] + c] = parent->children[c];
+      }
+    }
+    parents.swap(children);
+  }
+
   return CADSCENEFILE_NOERROR;
 }
 
@@ -24,13 +24,19 @@
 #include "load_scene.h"
 #include "load_scene_util.h"
 #include "../bake_api.h"
+#include "../bake_util.h"
 
 #include "bk3dEx.h"
+#include "block_gzip.h"
+#include "mapped_file.h"
 
 #include <vector_types.h>
 #include <optixu/optixu_matrix_namespace.h>
 
+#include <algorithm>
 #include <cfloat>
+#include <cstring>
+#include <deque>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
@@ -61,23 +67,95 @@ private:
 namespace {
   struct Bk3dSceneMemory : public SceneMemory
   {
-    Bk3dSceneMemory(bk3d::FileHeader* bk3dHeader, void* bk3dBuffer)
-      : bk3dHeader(bk3dHeader), bk3dBuffer(bk3dBuffer)
+    Bk3dSceneMemory(bk3d::FileHeader* bk3dHeader, void* bk3dBuffer, MappedFile* mapping)
+      : bk3dHeader(bk3dHeader), bk3dBuffer(bk3dBuffer), mapping(mapping)
     {
     }
     virtual ~Bk3dSceneMemory()
     {
-      free(bk3dHeader);
-      free(bk3dBuffer);
+      if (mapping) {
+        // header and buffer point into the mapping
+        delete mapping;
+      } else {
+        free(bk3dHeader);
+        free(bk3dBuffer);
+      }
     }
 
     bk3d::FileHeader *bk3dHeader;
     void* bk3dBuffer;
+    MappedFile* mapping;
   
     std::vector<bake::Mesh> meshes;
     std::vector<bake::Instance> instances;
+    std::deque< std::vector<unsigned int> > rebased_indices;  // prim groups that use part of their vertex buffer
   };
 
+  const void* offset_attribute(const void* data, unsigned stride_bytes, unsigned components, size_t first)
+  {
+    const size_t stride = stride_bytes ? stride_bytes : components*sizeof(float);
+    return data ? (const char*)data + first*stride : NULL;
+  }
+
+  // Resolves the relocation table of a complete bk3d image (header structs
+  // followed by the buffer area) in place. Returns NULL if the image is not a
+  // bk3d file of the version we were built against.
+  bk3d::FileHeader* resolve_bk3d(char* data, size_t size, void** pBufferMemory)
+  {
+    bk3d::FileHeader* header = (bk3d::FileHeader*)data;
+    if (size < sizeof(bk3d::FileHeader) ||
+        header->version != RAWMESHVERSION ||
+        header->nodeByteSize > size) {
+      return NULL;
+    }
+    char* buffer = data + header->nodeByteSize;
+    Timer timer;
+    timer.start();
+    header->resolvePointers(buffer);
+    timer.stop();
+    recordTime("load.relocate", timer);
+    *pBufferMemory = buffer;
+    return header;
+  }
+
+  bool is_gzip(const MappedFile& mapping)
+  {
+    const unsigned char* bytes = (const unsigned char*)mapping.data();
+    return mapping.size() >= 2 && bytes[0] == 0x1f && bytes[1] == 0x8b;
+  }
+
+  // Uncompressed bk3d files are used straight from a copy-on-write mapping:
+  // only the pages holding relocated pointers get copied.
+  bk3d::FileHeader* map_bk3d(MappedFile& mapping, void** pBufferMemory)
+  {
+    if (is_gzip(mapping)) return NULL;
+    return resolve_bk3d(mapping.data(), mapping.size(), pBufferMemory);
+  }
+
+#ifndef NOGZLIB
+  // Block-compressed files are inflated across all threads into a single
+  // allocation holding both the header structs and the buffer area.
+  bk3d::FileHeader* inflate_bk3d(const MappedFile& mapping, void** pBufferMemory)
+  {
+    BlockGzipIndex index;
+    if (!is_gzip(mapping) || !scan_block_gzip(mapping, index)) return NULL;
+
+    char* data = (char*)malloc(index.inflated_size);
+    if (!data) return NULL;
+    bk3d::FileHeader* header = NULL;
+    Timer timer;
+    timer.start();
+    const bool inflated = inflate_block_gzip(mapping, index, data);
+    timer.stop();
+    recordTime("load.inflate", timer);
+    if (inflated) {
+      header = resolve_bk3d(data, index.inflated_size, pBufferMemory);
+    }
+    if (!header) free(data);
+    return header;
+  }
+#endif
+
 }   //namespace
 
 
@@ -85,10 +163,32 @@ bool load_bk3d_scene( const char* filename, bake::Scene& scene, float scene_bbox
 {
   void * pBk3dBufferMemory = NULL;
   unsigned int bk3dBufferMemorySz = 0;
-  bk3d::FileHeader* bk3dData = bk3d::load(filename, &pBk3dBufferMemory, &bk3dBufferMemorySz);
+  MappedFile* mapping = new MappedFile;
+  bk3d::FileHeader* bk3dData = NULL;
+  if (mapping->open(filename)) {
+    bk3dData = map_bk3d(*mapping, &pBk3dBufferMemory);
+  }
+  if (!bk3dData) {
+#ifndef NOGZLIB
+    // The buffer area lives inside the inflated header allocation, so only
+    // the header is owned.
+    void* pInflatedBuffer = NULL;
+    if (mapping->data()) bk3dData = inflate_bk3d(*mapping, &pInflatedBuffer);
+#endif
+    delete mapping;
+    mapping = NULL;
+  }
+  if (!bk3dData) {
+    // plain gzip, read, inflated and relocated serially in one call
+    Timer timer;
+    timer.start();
+    bk3dData = bk3d::load(filename, &pBk3dBufferMemory, &bk3dBufferMemorySz);
+    timer.stop();
+    recordTime("load.inflate", timer);
+  }
   if (!bk3dData) return false;
 
-  Bk3dSceneMemory* memory = new Bk3dSceneMemory(bk3dData, pBk3dBufferMemory);
+  Bk3dSceneMemory* memory = new Bk3dSceneMemory(bk3dData, pBk3dBufferMemory, mapping);
 
   assert(bk3dData->pMeshes);
   memory->meshes.reserve(bk3dData->pMeshes->n);
@@ -142,6 +242,18 @@ bool load_bk3d_scene( const char* filename, bake::Scene& scene, float scene_bbox
       normal_stride_bytes = pNormalAttr->strideBytes;
     }
 
+    // Texcoords are optional and found by name
+    float* texcoords = NULL;
+    unsigned texcoord_stride_bytes = 0;
+    for (int a = 0; a < pMesh->pAttributes->n; ++a) {
+      bk3d::Attribute* pAttr = pMesh->pAttributes->p[a];
+      if (strcmp(pAttr->name, MESH_TEXCOORD0) == 0 && pAttr->formatGL == GL_FLOAT && pAttr->numComp >= 2) {
+        texcoords = (float*)pAttr->pAttributeBufferData;
+        texcoord_stride_bytes = pAttr->strideBytes;
+        break;
+      }
+    }
+
     optix::Matrix4x4 mesh_xform = optix::Matrix4x4::identity();
     if (pMesh->pTransforms && pMesh->pTransforms->n > 0) {
       // Note: OptiX matrices are transposed from OpenGL/bk3d
@@ -156,16 +268,45 @@ bool load_bk3d_scene( const char* filename, bake::Scene& scene, float scene_bbox
 
       bake::Mesh bake_mesh;
 
-      // Same vertex buffer for each primgroup. Prime can also share these.
-      bake_mesh.num_vertices  = num_vertices;
-      bake_mesh.vertices      = vertices;
+      // Each primgroup uses the window of the shared vertex buffer between its smallest and largest index, so
+      // filter systems and AO arrays are sized to the primgroup.  Indices are rebased into a copy when the window
+      // does not start at the first vertex.
+      unsigned int* indices = (unsigned int*)pPG->pIndexBufferData;
+      const size_t num_indices = 3*size_t(pPG->primitiveCount);
+      size_t first_vertex = 0;
+      size_t window_vertices = 0;
+      if (num_indices > 0) {
+        unsigned int min_index = indices[0];
+        unsigned int max_index = indices[0];
+        for (size_t i = 1; i < num_indices; ++i) {
+          min_index = std::min(min_index, indices[i]);
+          max_index = std::max(max_index, indices[i]);
+        }
+        first_vertex = min_index;
+        window_vertices = size_t(max_index) - first_vertex + 1;
+        RT_ASSERT( first_vertex + window_vertices <= num_vertices && "Index out of range of the vertex buffer" );
+      }
+      if (first_vertex > 0) {
+        memory->rebased_indices.push_back(std::vector<unsigned int>(num_indices));
+        std::vector<unsigned int>& rebased = memory->rebased_indices.back();
+        for (size_t i = 0; i < num_indices; ++i) rebased[i] = indices[i] - (unsigned int)first_vertex;
+        indices = &rebased[0];
+      }
+
+      // Prime can also share windows of the same vertex buffer
+      bake_mesh.num_vertices  = window_vertices;
+      bake_mesh.vertices      = (float*)offset_attribute(vertices, vertex_stride_bytes, 3, first_vertex);
       bake_mesh.vertex_stride_bytes = vertex_stride_bytes;
 
-      bake_mesh.normals       = normals;
+      bake_mesh.normals       = (float*)offset_attribute(normals, normal_stride_bytes, 3, first_vertex);
       bake_mesh.normal_stride_bytes = normal_stride_bytes;
 
+      bake_mesh.texcoords     = (float*)offset_attribute(texcoords, texcoord_stride_bytes, 2, first_vertex);
+      bake_mesh.texcoord_stride_bytes = texcoord_stride_bytes;
+      bake_mesh.geometry_memory = bake::MEMORY_SPACE_HOST;
+
       bake_mesh.num_triangles = pPG->primitiveCount;
-      bake_mesh.tri_vertex_indices = (unsigned int*)pPG->pIndexBufferData;
+      bake_mesh.tri_vertex_indices = indices;
 
       bool compute_bbox = false;
       for (int k = 0; k < 3; ++k) {
@@ -178,14 +319,9 @@ bool load_bk3d_scene( const char* filename, bake::Scene& scene, float scene_bbox
       }
 
       if (compute_bbox) {
-        // Bbox stored in file is empty, so compute from vertices.
+        // Bbox stored in file is empty, so leave it empty to be computed from vertices below.
         std::fill(bake_mesh.bbox_min, bake_mesh.bbox_min+3, FLT_MAX);
         std::fill(bake_mesh.bbox_max, bake_mesh.bbox_max+3, -FLT_MAX);
-        unsigned char* p = reinterpret_cast<unsigned char*>(bake_mesh.vertices);
-        for (size_t i = 0; i < bake_mesh.num_vertices; ++i) {
-          expand_bbox(bake_mesh.bbox_min, bake_mesh.bbox_max, reinterpret_cast<float*>(p));
-          p += bake_mesh.vertex_stride_bytes ? bake_mesh.vertex_stride_bytes : 3*sizeof(float);
-        }
       }
 
       bake::Instance instance;
@@ -198,16 +334,20 @@ bool load_bk3d_scene( const char* filename, bake::Scene& scene, float scene_bbox
       }
       optix::Matrix4x4 mat = mesh_xform * group_xform;
       std::copy(mat.getData(), mat.getData()+16, instance.xform);
-      xform_bbox(mat, bake_mesh.bbox_min, bake_mesh.bbox_max, instance.bbox_min, instance.bbox_max);
-
-      expand_bbox(scene_bbox_min, scene_bbox_max, instance.bbox_min);
-      expand_bbox(scene_bbox_min, scene_bbox_max, instance.bbox_max);
 
       memory->meshes.push_back(bake_mesh);
       memory->instances.push_back(instance);
     }
   }
 
+  // Prim groups with the same vertex window share one bbox computation
+  if (!memory->meshes.empty()) {
+    compute_mesh_bboxes(&memory->meshes[0], memory->meshes.size());
+  }
+  if (!memory->instances.empty()) {
+    xform_instance_bboxes(&memory->meshes[0], &memory->instances[0], memory->instances.size(), scene_bbox_min, scene_bbox_max);
+  }
+
   if (num_instances_per_mesh > 1) {
     make_debug_instances(memory->meshes, memory->instances, num_instances_per_mesh-1, scene_bbox_min, scene_bbox_max);
   }
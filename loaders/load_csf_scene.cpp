@@ -8,7 +8,9 @@
 #include <optixu/optixu_matrix_namespace.h>
 
 #include <cfloat>
+#include <deque>
 #include <iostream>
+#include <map>
 #include <sstream>
 #include <stdexcept>
 
@@ -52,9 +54,61 @@ namespace {
 
     std::vector<bake::Mesh> meshes;
     std::vector<bake::Instance> instances;
+    std::deque< std::vector<unsigned int> > part_indices;  // active parts that are not contiguous in indexSolid
 
   };
 
+  // All solid triangles of a geometry
+  bake::Mesh geometry_mesh(const CSFGeometry* geom)
+  {
+    bake::Mesh bake_mesh;
+
+    // Same vertex buffer for each primgroup. Prime can also share these.
+    bake_mesh.num_vertices = geom->numVertices;
+    bake_mesh.vertices = geom->vertex;
+    bake_mesh.vertex_stride_bytes = sizeof(float) * 3;
+
+    bake_mesh.normals = geom->normal;
+    bake_mesh.normal_stride_bytes = sizeof(float) * 3;
+
+    bake_mesh.texcoords = geom->tex;
+    bake_mesh.texcoord_stride_bytes = sizeof(float) * 2;
+    bake_mesh.geometry_memory = bake::MEMORY_SPACE_HOST;
+
+    bake_mesh.num_triangles = geom->numIndexSolid / 3;
+    bake_mesh.tri_vertex_indices = geom->indexSolid;
+
+    // empty bbox, computed below for all meshes at once
+    std::fill(bake_mesh.bbox_min, bake_mesh.bbox_min + 3, FLT_MAX);
+    std::fill(bake_mesh.bbox_max, bake_mesh.bbox_max + 3, -FLT_MAX);
+
+    return bake_mesh;
+  }
+
+  // Which parts of its geometry a node shows; empty if all of them, or if the node and geometry disagree on parts
+  std::vector<unsigned char> active_parts(const CSFile* csf, const CSFNode* node)
+  {
+    const CSFGeometry* geom = csf->geometries + node->geometryIDX;
+    std::vector<unsigned char> mask;
+    if (node->numParts != geom->numParts || !geom->parts) return mask;
+    bool all = true;
+    mask.resize(node->numParts);
+    for (int p = 0; p < node->numParts; p++) {
+      mask[p] = node->parts[p].active ? 1 : 0;
+      all = all && mask[p];
+    }
+    if (all) mask.clear();
+    return mask;
+  }
+
+  bool any_part_active(const CSFNode* node)
+  {
+    for (int p = 0; p < node->numParts; p++) {
+      if (node->parts[p].active) return true;
+    }
+    return false;
+  }
+
 }   //namespace
 
 
@@ -78,99 +132,121 @@ bool load_csf_scene(const char* filename, bake::Scene& scene, float scene_bbox_m
 //#define GEOMETRY_LOWER_LIMIT  13400
 //#define GEOMETRY_UPPER_LIMIT  17000
 
-  int numObjects = 0;
+  // Classify nodes in parallel: no instance, instance of the whole geometry, or of some of its parts
+  enum { NODE_HIDDEN = -1, NODE_ALL_PARTS = -2, NODE_SOME_PARTS = -3 };
+  std::vector<int> node_mesh(csf->numNodes, NODE_HIDDEN);
+#pragma omp parallel for if(csf->numNodes > 4096)
   for (int n = 0; n < csf->numNodes; n++){
-    CSFNode* node = csf->nodes + n;
+    const CSFNode* node = csf->nodes + n;
 
     if (node->geometryIDX < 0) continue;
 #if defined(GEOMETRY_UPPER_LIMIT) && defined(GEOMETRY_LOWER_LIMIT)
     if (node->geometryIDX < GEOMETRY_LOWER_LIMIT  || node->geometryIDX > GEOMETRY_UPPER_LIMIT) continue;
 #endif
-    for (int p = 0; p < node->numParts; p++){
-      if (node->parts[p].active){
-        referencedGeometry[node->geometryIDX] = 1;
-        numObjects++;
-        break;
-      }
+    if (any_part_active(node)) {
+      node_mesh[n] = active_parts(csf, node).empty() ? NODE_ALL_PARTS : NODE_SOME_PARTS;
     }
   }
-  
-  memory->meshes.reserve(csf->numGeometries);
-  memory->instances.reserve(numObjects);
+
+  for (int n = 0; n < csf->numNodes; n++){
+    if (node_mesh[n] == NODE_ALL_PARTS) referencedGeometry[csf->nodes[n].geometryIDX] = 1;
+  }
 
   std::fill(scene_bbox_min, scene_bbox_min + 3, FLT_MAX);
   std::fill(scene_bbox_max, scene_bbox_max + 3, -FLT_MAX);
 
+  // Geometries only shown in part get meshes of their parts below
+  int numMeshes = 0;
   for (int g = 0; g < csf->numGeometries; g++) {
-    if (!referencedGeometry[g]) continue;
-
-    // Make separate mesh/instance per prim group
-    CSFGeometry* geom = csf->geometries + g;
-
-    //if (!referencedGeometry[g]) continue; 
-    // for simplicity just add all geometry, even if unreferenced
+    referencedGeometry[g] = referencedGeometry[g] ? numMeshes++ : -1;
+  }
+  memory->meshes.resize(numMeshes);
 
-    bake::Mesh bake_mesh;
+#pragma omp parallel for if(csf->numGeometries > 4096)
+  for (int g = 0; g < csf->numGeometries; g++) {
+    if (referencedGeometry[g] < 0) continue;
+    memory->meshes[referencedGeometry[g]] = geometry_mesh(csf->geometries + g);
+  }
 
-    // Same vertex buffer for each primgroup. Prime can also share these.
-    bake_mesh.num_vertices = geom->numVertices;
-    bake_mesh.vertices = geom->vertex;
-    bake_mesh.vertex_stride_bytes = sizeof(float) * 3;
+  // Nodes with some parts inactive get a mesh of the active parts' triangles over the full vertex buffer, shared by
+  // all nodes of the geometry with the same parts, so hidden parts are neither sampled nor traced.  AO stays per
+  // geometry vertex; vertices of hidden parts only see the regularization of the filters.
+  // Resolving meshes and instance slots is serial, the instances are filled in parallel below.
+  std::map< std::pair< int, std::vector<unsigned char> >, int > part_meshes;
+  std::vector<int> node_instance(csf->numNodes, -1);
+  int numObjects = 0;
+  for (int n = 0; n < csf->numNodes; n++){
+    const CSFNode* node = csf->nodes + n;
 
-    bake_mesh.normals = geom->normal;
-    bake_mesh.normal_stride_bytes = sizeof(float) * 3;
+    if (node_mesh[n] == NODE_HIDDEN) continue;
+    if (node_mesh[n] == NODE_ALL_PARTS) {
+      node_mesh[n] = referencedGeometry[node->geometryIDX];
+      node_instance[n] = numObjects++;
+      continue;
+    }
 
-    bake_mesh.num_triangles = geom->numIndexSolid / 3;
-    bake_mesh.tri_vertex_indices = geom->indexSolid;
+    const std::vector<unsigned char> mask = active_parts(csf, node);
+    // -1: the active parts have no solid triangles
+    const std::pair< int, std::vector<unsigned char> > key(node->geometryIDX, mask);
+    std::map< std::pair< int, std::vector<unsigned char> >, int >::const_iterator it = part_meshes.find(key);
+    if (it != part_meshes.end()) {
+      node_mesh[n] = it->second;
+      if (it->second >= 0) node_instance[n] = numObjects++;
+      continue;
+    }
 
-    {
-      // compute bbox
-      std::fill(bake_mesh.bbox_min, bake_mesh.bbox_min + 3, FLT_MAX);
-      std::fill(bake_mesh.bbox_max, bake_mesh.bbox_max + 3, -FLT_MAX);
-      unsigned char* p = reinterpret_cast<unsigned char*>(bake_mesh.vertices);
-      for (size_t i = 0; i < bake_mesh.num_vertices; ++i) {
-        expand_bbox(bake_mesh.bbox_min, bake_mesh.bbox_max, reinterpret_cast<float*>(p));
-        p += sizeof(float) * 3;
+    const CSFGeometry* geom = csf->geometries + node->geometryIDX;
+    bake::Mesh part_mesh = geometry_mesh(geom);
+    // One run of active parts points into indexSolid, others are gathered
+    size_t first_index = 0, num_indices = 0, num_runs = 0;
+    for (int p = 0, offset = 0; p < geom->numParts; offset += geom->parts[p].indexSolid, p++) {
+      if (!mask[p] || geom->parts[p].indexSolid == 0) continue;
+      if (num_indices == 0 || first_index + num_indices != size_t(offset)) {
+        num_runs++;
+        if (num_indices == 0) first_index = offset;
       }
+      num_indices += geom->parts[p].indexSolid;
     }
-
-    referencedGeometry[g] = int(memory->meshes.size());
-
-    memory->meshes.push_back(bake_mesh);
-  }
-
-  for (int n = 0; n < csf->numNodes; n++){
-    CSFNode* node = csf->nodes + n;
-
-    if (node->geometryIDX < 0) continue;
-#if defined(GEOMETRY_UPPER_LIMIT) && defined(GEOMETRY_LOWER_LIMIT)
-    if (node->geometryIDX < GEOMETRY_LOWER_LIMIT || node->geometryIDX > GEOMETRY_UPPER_LIMIT) continue;
-#endif
-    // fixme, for simplicity we currently don't deal with individual part baking
-    bool active = false;
-    for (int p = 0; p < node->numParts; p++){
-      if (node->parts[p].active){
-        active = true;
-        break;
+    if (num_indices < 3) {
+      part_meshes[key] = node_mesh[n] = NODE_HIDDEN;
+      continue;
+    }
+    if (num_runs > 1) {
+      memory->part_indices.push_back(std::vector<unsigned int>());
+      std::vector<unsigned int>& indices = memory->part_indices.back();
+      indices.reserve(num_indices);
+      for (int p = 0, offset = 0; p < geom->numParts; offset += geom->parts[p].indexSolid, p++) {
+        if (mask[p]) indices.insert(indices.end(), geom->indexSolid + offset, geom->indexSolid + offset + geom->parts[p].indexSolid);
       }
+      part_mesh.tri_vertex_indices = &indices[0];
+    } else {
+      part_mesh.tri_vertex_indices = geom->indexSolid + first_index;
     }
+    part_mesh.num_triangles = num_indices / 3;
+    part_meshes[key] = node_mesh[n] = int(memory->meshes.size());
+    node_instance[n] = numObjects++;
+    memory->meshes.push_back(part_mesh);
+  }
 
-    if (!active) continue;
+  memory->instances.resize(numObjects);
+#pragma omp parallel for if(numObjects > 4096)
+  for (int n = 0; n < csf->numNodes; n++){
+    if (node_instance[n] < 0) continue;
 
-    bake::Instance instance;
-    instance.mesh_index = referencedGeometry[node->geometryIDX];
+    bake::Instance& instance = memory->instances[node_instance[n]];
+    instance.mesh_index = node_mesh[n];
     instance.storage_identifier = n;
 
-    bake::Mesh& bake_mesh = memory->meshes[node->geometryIDX];
-
-    optix::Matrix4x4 xform = optix::Matrix4x4(node->worldTM).transpose();
+    optix::Matrix4x4 xform = optix::Matrix4x4(csf->nodes[n].worldTM).transpose();
     std::copy(xform.getData(), xform.getData() + 16, instance.xform);
+  }
 
-    xform_bbox(xform, bake_mesh.bbox_min, bake_mesh.bbox_max, instance.bbox_min, instance.bbox_max);
-    expand_bbox(scene_bbox_min, scene_bbox_max, instance.bbox_min);
-    expand_bbox(scene_bbox_min, scene_bbox_max, instance.bbox_max);
+  if (!memory->meshes.empty()) {
+    compute_mesh_bboxes(&memory->meshes[0], memory->meshes.size());
+  }
 
-    memory->instances.push_back(instance);
+  if (!memory->instances.empty()) {
+    xform_instance_bboxes(&memory->meshes[0], &memory->instances[0], memory->instances.size(), scene_bbox_min, scene_bbox_max);
   }
 
   scene.meshes = &memory->meshes[0];
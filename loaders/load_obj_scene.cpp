@@ -24,6 +24,7 @@
 #include "load_scene.h"
 #include "load_scene_util.h"
 #include "../bake_api.h"
+#include "../bake_util.h"
 
 #include <vector_types.h>
 #include <optixu/optixu_matrix_namespace.h>
@@ -31,9 +32,7 @@
 #include <cfloat>
 #include <iostream>
 
-
-#define TINYOBJLOADER_IMPLEMENTATION
-#include "tiny_obj_loader.h"
+#include "obj_parser.h"
 
 namespace {
   struct ObjSceneMemory : public SceneMemory
@@ -41,7 +40,7 @@ namespace {
     ObjSceneMemory() {}
     virtual ~ObjSceneMemory() {}
   
-    tinyobj::mesh_t obj_mesh;
+    std::vector<tinyobj::mesh_t> obj_meshes;
     std::vector<bake::Mesh> meshes;
     std::vector<bake::Instance> instances;
   };
@@ -49,51 +48,72 @@ namespace {
 }   //namespace
 
 
-bool load_obj_scene( const char* filename, bake::Scene& scene, float scene_bbox_min[3], float scene_bbox_max[3], SceneMemory*& base_memory, size_t num_instances_per_mesh )
+bool load_obj_scene( const char* filename, bake::Scene& scene, float scene_bbox_min[3], float scene_bbox_max[3], SceneMemory*& base_memory, size_t num_instances_per_mesh, bool split_obj_groups )
 {
   std::string errs;
   ObjSceneMemory* memory = new ObjSceneMemory();
-  bool loaded = tinyobj::LoadObj(memory->obj_mesh, errs, filename);
+  bool loaded = false;
+  Timer timer;
+  timer.start();
+  if (split_obj_groups) {
+    std::vector<std::string> group_names;
+    loaded = load_obj_parallel(memory->obj_meshes, group_names, errs, filename);
+  } else {
+    memory->obj_meshes.resize(1);
+    loaded = load_obj_parallel(memory->obj_meshes[0], errs, filename);
+  }
+  timer.stop();
+  recordTime("load.parse", timer);
   if (!errs.empty() || !loaded) {
     std::cerr << errs << std::endl;
     delete memory;
     return false;
   }
 
-  memory->meshes.resize(1);
-  bake::Mesh& mesh = memory->meshes[0];
-  tinyobj::mesh_t& obj_mesh = memory->obj_mesh;
-
-  mesh.num_vertices  = obj_mesh.positions.size()/3;
-  mesh.num_triangles = obj_mesh.indices.size()/3;
-  mesh.vertices      = &obj_mesh.positions[0];
-  mesh.vertex_stride_bytes = 0;
-  mesh.normals       = obj_mesh.normals.empty() ? NULL : &obj_mesh.normals[0];
-  mesh.normal_stride_bytes = 0;
-  mesh.tri_vertex_indices = &obj_mesh.indices[0];
+  // One mesh and one identity instance per group
 
-  // Build bbox for mesh
+  const size_t num_meshes = memory->obj_meshes.size();
+  memory->meshes.resize(num_meshes);
+  memory->instances.resize(num_meshes);
+  const optix::Matrix4x4 mat = optix::Matrix4x4::identity();
+  const float* matdata = mat.getData();
+  std::fill(scene_bbox_min, scene_bbox_min+3, FLT_MAX);
+  std::fill(scene_bbox_max, scene_bbox_max+3, -FLT_MAX);
+
+  for (size_t m = 0; m < num_meshes; ++m) {
+    bake::Mesh& mesh = memory->meshes[m];
+    tinyobj::mesh_t& obj_mesh = memory->obj_meshes[m];
+
+    mesh.num_vertices  = obj_mesh.positions.size()/3;
+    mesh.num_triangles = obj_mesh.indices.size()/3;
+    mesh.vertices      = &obj_mesh.positions[0];
+    mesh.vertex_stride_bytes = 0;
+    mesh.normals       = obj_mesh.normals.empty() ? NULL : &obj_mesh.normals[0];
+    mesh.normal_stride_bytes = 0;
+    mesh.texcoords     = obj_mesh.texcoords.empty() ? NULL : &obj_mesh.texcoords[0];
+    mesh.texcoord_stride_bytes = 0;
+    mesh.geometry_memory = bake::MEMORY_SPACE_HOST;
+    mesh.tri_vertex_indices = &obj_mesh.indices[0];
+
+    // Empty bbox, computed below for all meshes at once
+    std::fill(mesh.bbox_min, mesh.bbox_min+3, FLT_MAX);
+    std::fill(mesh.bbox_max, mesh.bbox_max+3, -FLT_MAX);
+  }
 
-  std::fill(mesh.bbox_min, mesh.bbox_min+3, FLT_MAX);
-  std::fill(mesh.bbox_max, mesh.bbox_max+3, -FLT_MAX);
-  for (size_t i = 0; i < mesh.num_vertices; ++i) {
-    expand_bbox(mesh.bbox_min, mesh.bbox_max, &mesh.vertices[3*i]);
+  if (num_meshes > 0) {
+    compute_mesh_bboxes(&memory->meshes[0], num_meshes);
   }
 
-  // Make instance
+  // Make instances
 
-  memory->instances.resize(1);
-  bake::Instance& instance = memory->instances[0];
-  instance.mesh_index = 0;
-  instance.storage_identifier = 0;
-  const optix::Matrix4x4 mat = optix::Matrix4x4::identity();
-  const float* matdata = mat.getData();
-  std::copy(matdata, matdata+16, instance.xform);
-  
-  xform_bbox(mat, mesh.bbox_min, mesh.bbox_max, instance.bbox_min, instance.bbox_max);
-  for (size_t k = 0; k < 3; ++k) {
-    scene_bbox_min[k] = instance.bbox_min[k];
-    scene_bbox_max[k] = instance.bbox_max[k];
+  for (size_t m = 0; m < num_meshes; ++m) {
+    bake::Instance& instance = memory->instances[m];
+    instance.mesh_index = (unsigned)m;
+    instance.storage_identifier = m;
+    std::copy(matdata, matdata+16, instance.xform);
+  }
+  if (num_meshes > 0) {
+    xform_instance_bboxes(&memory->meshes[0], &memory->instances[0], num_meshes, scene_bbox_min, scene_bbox_max);
   }
 
   if (num_instances_per_mesh > 1) {
@@ -107,4 +127,3 @@ bool load_obj_scene( const char* filename, bake::Scene& scene, float scene_bbox_
   base_memory = memory;
   return true;
 }
-
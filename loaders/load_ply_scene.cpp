@@ -0,0 +1,472 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+// Binary little-endian PLY, as written by most scanning pipelines. The file is
+// mapped and, when x/y/z (and nx/ny/nz, u/v) are adjacent floats in the vertex
+// element, the mesh attributes point straight into the mapping at the vertex
+// element stride. Only the face lists are converted, to triangle fans.
+// Positions are gathered into a packed copy instead when they are not floats,
+// or the header length or vertex stride leaves them unaligned.
+
+#include "load_scene.h"
+#include "load_scene_util.h"
+#include "mapped_file.h"
+#include "../bake_api.h"
+#include "../bake_util.h"
+
+#include <vector_types.h>
+#include <optixu/optixu_matrix_namespace.h>
+
+#include <cfloat>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+  enum PlyType { PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64, PLY_INVALID };
+
+  struct PlyProperty
+  {
+    std::string name;
+    PlyType type;         // item type for lists
+    PlyType count_type;   // PLY_INVALID for scalars
+  };
+
+  struct PlyElement
+  {
+    std::string name;
+    size_t count;
+    std::vector<PlyProperty> properties;
+  };
+
+  struct PlySceneMemory : public SceneMemory
+  {
+    PlySceneMemory() {}
+    virtual ~PlySceneMemory() {}
+
+    MappedFile mapping;
+    std::vector<float> positions;     // only when the file's positions can't be used in place
+    std::vector<unsigned int> indices;
+    std::vector<bake::Mesh> meshes;
+    std::vector<bake::Instance> instances;
+  };
+
+  PlyType parse_type(const std::string& name)
+  {
+    if (name == "char"   || name == "int8")    return PLY_INT8;
+    if (name == "uchar"  || name == "uint8")   return PLY_UINT8;
+    if (name == "short"  || name == "int16")   return PLY_INT16;
+    if (name == "ushort" || name == "uint16")  return PLY_UINT16;
+    if (name == "int"    || name == "int32")   return PLY_INT32;
+    if (name == "uint"   || name == "uint32")  return PLY_UINT32;
+    if (name == "float"  || name == "float32") return PLY_FLOAT32;
+    if (name == "double" || name == "float64") return PLY_FLOAT64;
+    return PLY_INVALID;
+  }
+
+  size_t type_size(PlyType type)
+  {
+    static const size_t sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8, 0 };
+    return sizes[type];
+  }
+
+  // Integer value of a list count or index; the file is little-endian like every host we build for
+  size_t read_index(const char* p, PlyType type)
+  {
+    switch (type) {
+      case PLY_INT8:   { signed char v;    memcpy(&v, p, 1); return size_t(v); }
+      case PLY_UINT8:  { unsigned char v;  memcpy(&v, p, 1); return v; }
+      case PLY_INT16:  { short v;          memcpy(&v, p, 2); return size_t(v); }
+      case PLY_UINT16: { unsigned short v; memcpy(&v, p, 2); return v; }
+      case PLY_INT32:  { int v;            memcpy(&v, p, 4); return size_t(v); }
+      case PLY_UINT32: { unsigned int v;   memcpy(&v, p, 4); return v; }
+      default: return size_t(-1);
+    }
+  }
+
+  float read_float(const char* p, PlyType type)
+  {
+    if (type == PLY_FLOAT32) { float v;  memcpy(&v, p, 4); return v; }
+    if (type == PLY_FLOAT64) { double v; memcpy(&v, p, 8); return float(v); }
+    return float(read_index(p, type));
+  }
+
+  // Parses the header up to and including end_header; 'data_offset' is where the body starts
+  bool parse_header(const char* data, size_t size, std::vector<PlyElement>& elements, size_t& data_offset, const char* filename)
+  {
+    const char* p = data;
+    const char* end = data + size;
+    bool first = true;
+    while (p < end) {
+      const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+      if (!eol) break;
+      std::string line(p, eol);
+      p = eol + 1;
+      if (!line.empty() && line[line.size()-1] == '\r') line.erase(line.size()-1);
+
+      std::istringstream ss(line);
+      std::string keyword;
+      ss >> keyword;
+      if (first) {
+        if (keyword != "ply") break;
+        first = false;
+      } else if (keyword == "format") {
+        std::string format;
+        ss >> format;
+        if (format != "binary_little_endian") {
+          std::cerr << "PLY format " << format << " is not supported, only binary_little_endian: " << filename << std::endl;
+          return false;
+        }
+      } else if (keyword == "element") {
+        PlyElement element;
+        if (!(ss >> element.name >> element.count)) break;
+        elements.push_back(element);
+      } else if (keyword == "property") {
+        if (elements.empty()) break;
+        PlyProperty property;
+        std::string type;
+        ss >> type;
+        if (type == "list") {
+          std::string count_type;
+          ss >> count_type >> type;
+          property.count_type = parse_type(count_type);
+          if (property.count_type == PLY_INVALID || property.count_type >= PLY_FLOAT32) break;
+        } else {
+          property.count_type = PLY_INVALID;
+        }
+        property.type = parse_type(type);
+        if (property.type == PLY_INVALID || !(ss >> property.name)) break;
+        elements.back().properties.push_back(property);
+      } else if (keyword == "end_header") {
+        data_offset = size_t(p - data);
+        return true;
+      }
+      // comment and obj_info lines are skipped
+    }
+    std::cerr << "Failed to parse PLY header: " << filename << std::endl;
+    return false;
+  }
+
+  // Bytes per record, or 0 if the element has list properties
+  size_t fixed_record_size(const PlyElement& element)
+  {
+    size_t bytes = 0;
+    for (size_t i = 0; i < element.properties.size(); ++i) {
+      if (element.properties[i].count_type != PLY_INVALID) return 0;
+      bytes += type_size(element.properties[i].type);
+    }
+    return bytes;
+  }
+
+  // Size of one record starting at p, walking its lists; 0 if it runs past 'end'
+  size_t record_size(const PlyElement& element, const char* p, const char* end)
+  {
+    size_t bytes = 0;
+    for (size_t i = 0; i < element.properties.size(); ++i) {
+      const PlyProperty& property = element.properties[i];
+      if (property.count_type == PLY_INVALID) {
+        bytes += type_size(property.type);
+        continue;
+      }
+      const size_t count_size = type_size(property.count_type);
+      if (size_t(end - p) < bytes + count_size) return 0;
+      const size_t n = read_index(p + bytes, property.count_type);
+      bytes += count_size + n*type_size(property.type);
+    }
+    return size_t(end - p) < bytes ? 0 : bytes;
+  }
+
+  // Bytes of the whole element body starting at p, 0 if it is truncated
+  size_t element_size(const PlyElement& element, const char* p, const char* end)
+  {
+    const size_t record = fixed_record_size(element);
+    if (record > 0) {
+      return size_t(end - p) / record < element.count ? 0 : record*element.count;
+    }
+    size_t bytes = 0;
+    for (size_t i = 0; i < element.count; ++i) {
+      const size_t n = record_size(element, p + bytes, end);
+      if (n == 0) return 0;
+      bytes += n;
+    }
+    return bytes;
+  }
+
+  // Byte offset of the named scalar property in a fixed-size record, -1 if absent
+  ptrdiff_t property_offset(const PlyElement& element, const char* name, PlyType* type)
+  {
+    size_t offset = 0;
+    for (size_t i = 0; i < element.properties.size(); ++i) {
+      const PlyProperty& property = element.properties[i];
+      if (property.name == name && property.count_type == PLY_INVALID) {
+        *type = property.type;
+        return ptrdiff_t(offset);
+      }
+      offset += type_size(property.type);
+    }
+    return -1;
+  }
+
+  // Offset of an attribute whose components are adjacent floats in the record, so it can be used in place; -1 if not
+  ptrdiff_t float_attribute_offset(const PlyElement& element, const char* const* names, size_t components)
+  {
+    PlyType type = PLY_INVALID;
+    const ptrdiff_t offset = property_offset(element, names[0], &type);
+    if (offset < 0 || type != PLY_FLOAT32) return -1;
+    for (size_t k = 1; k < components; ++k) {
+      PlyType component_type = PLY_INVALID;
+      if (property_offset(element, names[k], &component_type) != offset + ptrdiff_t(k*sizeof(float)) || component_type != PLY_FLOAT32) return -1;
+    }
+    return offset;
+  }
+
+  // Converts the face lists to triangle fans. All-triangle files with nothing else in the face record are
+  // converted directly in parallel; otherwise a serial pass finds each face's record first.
+  bool convert_faces(const PlyElement& faces, const char* p, const char* end, size_t num_vertices, std::vector<unsigned int>& indices, const char* filename)
+  {
+    size_t list_offset = 0;
+    size_t list_property = faces.properties.size();
+    for (size_t i = 0; i < faces.properties.size(); ++i) {
+      const PlyProperty& property = faces.properties[i];
+      if ((property.name == "vertex_indices" || property.name == "vertex_index") && property.count_type != PLY_INVALID &&
+          property.type < PLY_FLOAT32) {
+        list_property = i;
+        break;
+      }
+      if (property.count_type != PLY_INVALID) break;  // lists before the indices: offset varies per face
+      list_offset += type_size(property.type);
+    }
+    if (list_property == faces.properties.size()) {
+      std::cerr << "PLY face element has no integer vertex_indices list ahead of other lists: " << filename << std::endl;
+      return false;
+    }
+    const PlyType count_type = faces.properties[list_property].count_type;
+    const PlyType index_type = faces.properties[list_property].type;
+    const size_t count_size = type_size(count_type);
+    const size_t index_size = type_size(index_type);
+    const ptrdiff_t num_faces = ptrdiff_t(faces.count);
+
+    // Per face: record start and first output triangle
+    std::vector<size_t> face_offsets;
+    std::vector<size_t> face_triangles;
+    size_t num_triangles = 0;
+    const size_t triangle_record = list_offset + count_size + 3*index_size;
+    bool all_triangles = faces.properties.size() == 1 && size_t(end - p) / triangle_record >= faces.count;
+    if (all_triangles) {
+      int mismatch = 0;
+#pragma omp parallel for reduction(+:mismatch)
+      for (ptrdiff_t f = 0; f < num_faces; ++f) {
+        if (read_index(p + f*triangle_record, count_type) != 3) mismatch += 1;
+      }
+      all_triangles = mismatch == 0;
+      num_triangles = faces.count;
+    }
+    if (!all_triangles) {
+      face_offsets.resize(faces.count);
+      face_triangles.resize(faces.count);
+      size_t offset = 0;
+      num_triangles = 0;
+      for (size_t f = 0; f < faces.count; ++f) {
+        const size_t bytes = record_size(faces, p + offset, end);
+        if (bytes == 0) {
+          std::cerr << "PLY face data is truncated: " << filename << std::endl;
+          return false;
+        }
+        face_offsets[f] = offset;
+        face_triangles[f] = num_triangles;
+        const size_t n = read_index(p + offset + list_offset, count_type);
+        if (n >= 3) num_triangles += n - 2;
+        offset += bytes;
+      }
+    }
+
+    indices.resize(3*num_triangles);
+    int bad_indices = 0;
+#pragma omp parallel for reduction(+:bad_indices)
+    for (ptrdiff_t f = 0; f < num_faces; ++f) {
+      const char* record = all_triangles ? p + f*triangle_record : p + face_offsets[f];
+      const char* list = record + list_offset;
+      const size_t n = all_triangles ? 3 : read_index(list, count_type);
+      if (n < 3) continue;
+      const char* items = list + count_size;
+      unsigned int* out = &indices[0] + 3*(all_triangles ? size_t(f) : face_triangles[f]);
+      const size_t first = read_index(items, index_type);
+      size_t prev = read_index(items + index_size, index_type);
+      for (size_t k = 2; k < n; ++k) {
+        const size_t next = read_index(items + k*index_size, index_type);
+        if (first >= num_vertices || prev >= num_vertices || next >= num_vertices) bad_indices += 1;
+        *out++ = unsigned(first);
+        *out++ = unsigned(prev);
+        *out++ = unsigned(next);
+        prev = next;
+      }
+    }
+    if (bad_indices > 0) {
+      std::cerr << "PLY file has " << bad_indices << " triangles with out of range vertex indices: " << filename << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+}   //namespace
+
+
+bool load_ply_scene( const char* filename, bake::Scene& scene, float scene_bbox_min[3], float scene_bbox_max[3], SceneMemory*& base_memory, size_t num_instances_per_mesh )
+{
+  PlySceneMemory* memory = new PlySceneMemory();
+  if (!memory->mapping.open(filename)) {
+    std::cerr << "Failed to map PLY file: " << filename << std::endl;
+    delete memory;
+    return false;
+  }
+
+  Timer timer;
+  timer.start();
+  const char* data = memory->mapping.data();
+  const char* end = data + memory->mapping.size();
+  std::vector<PlyElement> elements;
+  size_t data_offset = 0;
+  if (!parse_header(data, memory->mapping.size(), elements, data_offset, filename)) {
+    delete memory;
+    return false;
+  }
+
+  // Locate the vertex and face bodies, skipping any other elements
+  const PlyElement* vertex_element = NULL;
+  const PlyElement* face_element = NULL;
+  const char* vertex_data = NULL;
+  const char* face_data = NULL;
+  const char* p = data + data_offset;
+  for (size_t e = 0; e < elements.size() && !(vertex_element && face_element); ++e) {
+    if (elements[e].name == "vertex") {
+      vertex_element = &elements[e];
+      vertex_data = p;
+    } else if (elements[e].name == "face") {
+      face_element = &elements[e];
+      face_data = p;
+      break;  // the face body is walked while converting
+    }
+    const size_t bytes = element_size(elements[e], p, end);
+    if (bytes == 0 && elements[e].count > 0) {
+      std::cerr << "PLY element " << elements[e].name << " is truncated: " << filename << std::endl;
+      delete memory;
+      return false;
+    }
+    p += bytes;
+  }
+  const size_t vertex_stride = vertex_element ? fixed_record_size(*vertex_element) : 0;
+  if (!vertex_element || !face_element || vertex_stride == 0) {
+    std::cerr << "PLY file needs a vertex element without lists and a face element: " << filename << std::endl;
+    delete memory;
+    return false;
+  }
+  const size_t num_vertices = vertex_element->count;
+
+  static const char* const position_names[] = { "x", "y", "z" };
+  static const char* const normal_names[]   = { "nx", "ny", "nz" };
+  static const char* const uv_names[]       = { "u", "v" };
+  static const char* const st_names[]       = { "s", "t" };
+  static const char* const texture_names[]  = { "texture_u", "texture_v" };
+  PlyType position_types[3];
+  ptrdiff_t position_offsets[3];
+  for (size_t k = 0; k < 3; ++k) {
+    position_offsets[k] = property_offset(*vertex_element, position_names[k], &position_types[k]);
+    if (position_offsets[k] < 0) {
+      std::cerr << "PLY vertex element has no " << position_names[k] << " property: " << filename << std::endl;
+      delete memory;
+      return false;
+    }
+  }
+  const ptrdiff_t position_offset = float_attribute_offset(*vertex_element, position_names, 3);
+  const ptrdiff_t normal_offset = float_attribute_offset(*vertex_element, normal_names, 3);
+  ptrdiff_t texcoord_offset = float_attribute_offset(*vertex_element, uv_names, 2);
+  if (texcoord_offset < 0) texcoord_offset = float_attribute_offset(*vertex_element, st_names, 2);
+  if (texcoord_offset < 0) texcoord_offset = float_attribute_offset(*vertex_element, texture_names, 2);
+
+  // In place needs float-aligned records; anything else is gathered into packed float3 positions
+  const bool aligned = (size_t(vertex_data - data) % sizeof(float)) == 0 && (vertex_stride % sizeof(float)) == 0;
+  const bool positions_in_place = aligned && position_offset >= 0;
+  if (!positions_in_place) {
+    memory->positions.resize(3*num_vertices);
+#pragma omp parallel for
+    for (ptrdiff_t v = 0; v < ptrdiff_t(num_vertices); ++v) {
+      const char* record = vertex_data + v*vertex_stride;
+      for (size_t k = 0; k < 3; ++k) {
+        memory->positions[3*v+k] = read_float(record + position_offsets[k], position_types[k]);
+      }
+    }
+  }
+
+  if (!convert_faces(*face_element, face_data, end, num_vertices, memory->indices, filename)) {
+    delete memory;
+    return false;
+  }
+  timer.stop();
+  recordTime("load.parse", timer);
+
+  memory->meshes.resize(1);
+  memory->instances.resize(1);
+  bake::Mesh& mesh = memory->meshes[0];
+  float* records = const_cast<float*>(reinterpret_cast<const float*>(vertex_data));
+  mesh.num_vertices = num_vertices;
+  if (positions_in_place) {
+    mesh.vertices = reinterpret_cast<float*>(reinterpret_cast<char*>(records) + position_offset);
+    mesh.vertex_stride_bytes = unsigned(vertex_stride);
+  } else {
+    mesh.vertices = memory->positions.empty() ? NULL : &memory->positions[0];
+    mesh.vertex_stride_bytes = 0;
+  }
+  mesh.normals = aligned && normal_offset >= 0 ? reinterpret_cast<float*>(reinterpret_cast<char*>(records) + normal_offset) : NULL;
+  mesh.normal_stride_bytes = mesh.normals ? unsigned(vertex_stride) : 0;
+  mesh.texcoords = aligned && texcoord_offset >= 0 ? reinterpret_cast<float*>(reinterpret_cast<char*>(records) + texcoord_offset) : NULL;
+  mesh.texcoord_stride_bytes = mesh.texcoords ? unsigned(vertex_stride) : 0;
+  mesh.geometry_memory = bake::MEMORY_SPACE_HOST;
+  mesh.num_triangles = memory->indices.size()/3;
+  mesh.tri_vertex_indices = memory->indices.empty() ? NULL : &memory->indices[0];
+  std::fill(mesh.bbox_min, mesh.bbox_min+3, FLT_MAX);
+  std::fill(mesh.bbox_max, mesh.bbox_max+3, -FLT_MAX);
+  compute_mesh_bboxes(&memory->meshes[0], 1);
+
+  bake::Instance& instance = memory->instances[0];
+  const optix::Matrix4x4 mat = optix::Matrix4x4::identity();
+  std::copy(mat.getData(), mat.getData()+16, instance.xform);
+  instance.mesh_index = 0;
+  instance.storage_identifier = 0;
+  std::fill(scene_bbox_min, scene_bbox_min+3, FLT_MAX);
+  std::fill(scene_bbox_max, scene_bbox_max+3, -FLT_MAX);
+  xform_instance_bboxes(&memory->meshes[0], &memory->instances[0], 1, scene_bbox_min, scene_bbox_max);
+
+  if (num_instances_per_mesh > 1) {
+    make_debug_instances(memory->meshes, memory->instances, num_instances_per_mesh-1, scene_bbox_min, scene_bbox_max);
+  }
+
+  scene.meshes = &memory->meshes[0];
+  scene.num_meshes = memory->meshes.size();
+  scene.instances = &memory->instances[0];
+  scene.num_instances = memory->instances.size();
+  base_memory = memory;
+  return true;
+}
@@ -23,10 +23,39 @@
 
 
 #include "load_scene.h"
+#include "../bake_api.h"
+#include "../bake_util.h"
+#include <algorithm>
+#include <cfloat>
+#include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
 
-bool load_scene( const char* filename, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh )
+namespace {
+
+struct MultiSceneMemory : public SceneMemory
+{
+  MultiSceneMemory() {}
+  virtual ~MultiSceneMemory()
+  {
+    for (size_t i = 0; i < file_memory.size(); ++i) delete file_memory[i];
+  }
+
+  std::vector<SceneMemory*> file_memory;
+  std::vector<bake::Mesh> meshes;
+  std::vector<bake::Instance> instances;
+};
+
+bool load_scene_files( const std::vector<std::string>& filenames, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh, bool split_obj_groups );
+
+bool is_scene_list( const std::string& filename )
+{
+  const std::string extension(".scenes");
+  return filename.size() >= extension.size() && filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+bool load_scene_by_extension( const char* filename, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh, bool split_obj_groups )
 {
   if (!filename) return false;
   
@@ -40,8 +69,14 @@ bool load_scene( const char* filename, bake::Scene& scene, float* scene_bbox_min
   }
 
   std::string extension = s.substr(pos);
+  if (extension == ".scenes") {
+    return load_scene_files(std::vector<std::string>(1, s), scene, scene_bbox_min, scene_bbox_max, memory, num_instances_per_mesh, split_obj_groups);
+  }
   if (extension == ".obj") {
-    return load_obj_scene(filename, scene, scene_bbox_min, scene_bbox_max, memory, num_instances_per_mesh);
+    return load_obj_scene(filename, scene, scene_bbox_min, scene_bbox_max, memory, num_instances_per_mesh, split_obj_groups);
+  }
+  if (extension == ".ply") {
+    return load_ply_scene(filename, scene, scene_bbox_min, scene_bbox_max, memory, num_instances_per_mesh);
   }
   
 #ifdef NOGZLIB
@@ -70,3 +105,152 @@ bool load_scene( const char* filename, bake::Scene& scene, float* scene_bbox_min
   std::cerr << filename << std::endl;
   return load_bk3d_scene(filename, scene, scene_bbox_min, scene_bbox_max, memory, num_instances_per_mesh);
 }
+
+// Loads the files concurrently, each into its own memory, and appends their meshes and instances in file order.
+// Scene lists are replaced by their files first.  File k's instances get k in the upper 32 bits of their storage
+// identifiers, so ids stay unique across files.
+bool load_scene_files( const std::vector<std::string>& inputs, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh, bool split_obj_groups )
+{
+  std::vector<std::string> filenames;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (!is_scene_list(inputs[i])) {
+      filenames.push_back(inputs[i]);
+      continue;
+    }
+    std::vector<std::string> listed;
+    if (!read_scene_list(inputs[i].c_str(), listed)) return false;
+    filenames.insert(filenames.end(), listed.begin(), listed.end());
+  }
+  const size_t num_files = filenames.size();
+  if (num_files == 0) {
+    std::cerr << "No scene files to load" << std::endl;
+    return false;
+  }
+  std::vector<bake::Scene> scenes(num_files);
+  std::vector<float> bboxes(6*num_files);
+  MultiSceneMemory* multi = new MultiSceneMemory();
+  multi->file_memory.resize(num_files, NULL);
+  std::vector<char> loaded(num_files, 0);
+
+  // One thread per file; loaders that parallelize internally run serially inside it
+#pragma omp parallel for schedule(dynamic, 1) num_threads(int(std::min(num_files, size_t(numThreads()))))
+  for (ptrdiff_t f = 0; f < ptrdiff_t(num_files); ++f) {
+    loaded[f] = load_scene_by_extension(filenames[f].c_str(), scenes[f], &bboxes[6*f], &bboxes[6*f+3], multi->file_memory[f], num_instances_per_mesh, split_obj_groups);
+  }
+
+  size_t num_meshes = 0, num_instances = 0;
+  for (size_t f = 0; f < num_files; ++f) {
+    if (!loaded[f]) {
+      std::cerr << "Failed to load scene file: " << filenames[f] << std::endl;
+      delete multi;
+      return false;
+    }
+    num_meshes += scenes[f].num_meshes;
+    num_instances += scenes[f].num_instances;
+  }
+
+  multi->meshes.reserve(num_meshes);
+  multi->instances.reserve(num_instances);
+  std::fill(scene_bbox_min, scene_bbox_min+3, FLT_MAX);
+  std::fill(scene_bbox_max, scene_bbox_max+3, -FLT_MAX);
+  for (size_t f = 0; f < num_files; ++f) {
+    const unsigned mesh_offset = unsigned(multi->meshes.size());
+    multi->meshes.insert(multi->meshes.end(), scenes[f].meshes, scenes[f].meshes + scenes[f].num_meshes);
+    for (size_t i = 0; i < scenes[f].num_instances; ++i) {
+      bake::Instance instance = scenes[f].instances[i];
+      instance.mesh_index += mesh_offset;
+      instance.storage_identifier |= uint64_t(f) << 32;
+      multi->instances.push_back(instance);
+    }
+    for (size_t k = 0; k < 3; ++k) {
+      scene_bbox_min[k] = std::min(scene_bbox_min[k], bboxes[6*f+k]);
+      scene_bbox_max[k] = std::max(scene_bbox_max[k], bboxes[6*f+3+k]);
+    }
+  }
+
+  scene.meshes = multi->meshes.empty() ? NULL : &multi->meshes[0];
+  scene.num_meshes = multi->meshes.size();
+  scene.instances = multi->instances.empty() ? NULL : &multi->instances[0];
+  scene.num_instances = multi->instances.size();
+  memory = multi;
+  return true;
+}
+
+void record_load_metrics( const bake::Scene& scene, const Timer& timer )
+{
+  recordTime( "load.scene", timer );
+  size_t num_vertices = 0, num_triangles = 0;
+  for (size_t i = 0; i < scene.num_meshes; ++i) {
+    num_vertices += scene.meshes[i].num_vertices;
+    num_triangles += scene.meshes[i].num_triangles;
+  }
+  recordCount( "load.meshes", scene.num_meshes );
+  recordCount( "load.instances", scene.num_instances );
+  recordCount( "load.vertices", num_vertices );
+  recordCount( "load.triangles", num_triangles );
+}
+
+} // end namespace
+
+
+bool read_scene_list( const char* filename, std::vector<std::string>& filenames )
+{
+  std::ifstream file(filename);
+  if (!file) {
+    std::cerr << "Failed to open scene list: " << filename << std::endl;
+    return false;
+  }
+  // Relative paths are relative to the list's directory
+  const std::string path(filename);
+  const size_t slash = path.find_last_of("/\\");
+  const std::string directory = slash == std::string::npos ? std::string() : path.substr(0, slash+1);
+  filenames.clear();
+  std::string line;
+  while (std::getline(file, line)) {
+    const size_t first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos || line[first] == '#') continue;
+    const size_t last = line.find_last_not_of(" \t\r");
+    const std::string name = line.substr(first, last - first + 1);
+    if (is_scene_list(name)) {
+      std::cerr << "Scene list " << filename << " names another scene list: " << name << std::endl;
+      return false;
+    }
+    const bool absolute = name[0] == '/' || name[0] == '\\' || (name.size() > 1 && name[1] == ':');
+    filenames.push_back(absolute ? name : directory + name);
+  }
+  if (filenames.empty()) {
+    std::cerr << "Scene list names no files: " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+
+bool load_scene( const char* filename, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh, bool split_obj_groups )
+{
+  ProfileRange range( "load scene", PROFILE_COLOR_LOAD );
+  Timer timer;
+  timer.start();
+  const bool loaded = load_scene_by_extension( filename, scene, scene_bbox_min, scene_bbox_max, memory, num_instances_per_mesh, split_obj_groups );
+  timer.stop();
+  if (!loaded) return false;
+
+  record_load_metrics( scene, timer );
+  return true;
+}
+
+bool load_scenes( const std::vector<std::string>& filenames, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh, bool split_obj_groups )
+{
+  if (filenames.size() == 1) {
+    return load_scene( filenames[0].c_str(), scene, scene_bbox_min, scene_bbox_max, memory, num_instances_per_mesh, split_obj_groups );
+  }
+  ProfileRange range( "load scene", PROFILE_COLOR_LOAD );
+  Timer timer;
+  timer.start();
+  const bool loaded = load_scene_files( filenames, scene, scene_bbox_min, scene_bbox_max, memory, num_instances_per_mesh, split_obj_groups );
+  timer.stop();
+  if (!loaded) return false;
+
+  record_load_metrics( scene, timer );
+  return true;
+}
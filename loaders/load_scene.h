@@ -24,6 +24,8 @@
 #pragma once
 
 #include <cstddef>
+#include <string>
+#include <vector>
 
 struct SceneMemory {
   virtual ~SceneMemory() { }
@@ -34,10 +36,44 @@ namespace bake {
   struct Scene;
 }
 
-bool load_obj_scene(const char* filename, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh=1 );
+// split_obj_groups: make a separate mesh and instance per OBJ group (g/o record)
+bool load_obj_scene(const char* filename, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh=1, bool split_obj_groups=false );
 bool load_bk3d_scene(const char* filename, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh=1 );
 bool load_csf_scene(const char* filename, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh = 1);
+// Binary little-endian PLY; vertex attributes are used in place from a file mapping where possible
+bool load_ply_scene(const char* filename, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh = 1);
 
-// Choose one of the above based on filename
-bool load_scene(const char* filename, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh=1 );
+// Choose one of the above based on filename. A '.scenes' file is a list of
+// scene files, loaded as by load_scenes.
+bool load_scene(const char* filename, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh=1, bool split_obj_groups=false );
+
+// Loads the files concurrently and concatenates their meshes and instances in
+// order, with any scene lists replaced by the files they name. File k's
+// instances have k in the upper 32 bits of storage_identifier.
+bool load_scenes(const std::vector<std::string>& filenames, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh=1, bool split_obj_groups=false );
+
+// Reads a '.scenes' list: one scene file per line, blank lines and '#'
+// comments skipped, relative paths taken from the list's directory. Lists
+// can't name other lists.
+bool read_scene_list(const char* filename, std::vector<std::string>& filenames);
+
+// Flat binary snapshot of a loaded scene, mapped directly on later runs.
+// A cache is only used if the source file size and modification time, and the
+// loading options, match the values recorded when it was written.
+bool load_scene_cache(const char* cache_filename, const char* source_filename, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh=1, bool split_obj_groups=false );
+bool save_scene_cache(const char* cache_filename, const char* source_filename, const bake::Scene& scene, const float* scene_bbox_min, const float* scene_bbox_max, size_t num_instances_per_mesh=1, bool split_obj_groups=false );
+
+// Writes a copy of the bk3d file the scene was loaded from, with the AO of
+// each instance (per vertex, in loaded order) added to its mesh as a float
+// vertex attribute named "ambientocclusion" in a slot of its own. Prim groups
+// sharing vertices average their AO. The copy is written uncompressed.
+bool save_bk3d_scene_ao(const char* filename, const char* bk3d_filename, const bake::Scene& scene, const float* const* vertex_ao );
+
+// Scene snapshot shared read-only by the processes on one node. The first
+// process to lock '<shared_filename>.lock' loads the scene file and publishes
+// the snapshot (in the scene cache format) at shared_filename, ideally on a
+// tmpfs such as /dev/shm; every process then maps it read-only, so the
+// geometry is held in memory once. 'published' is set for the process that
+// wrote the snapshot.
+bool load_shared_scene(const char* shared_filename, const char* source_filename, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh=1, bool split_obj_groups=false, bool* published=NULL );
 
@@ -23,10 +23,144 @@
 
 #include "load_scene_util.h"
 #include "../bake_api.h"
+#include "../bake_util.h"
 
 #include <vector_types.h>
 #include <optixu/optixu_matrix_namespace.h>
 
+#include <cfloat>
+#include <map>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define BBOX_USE_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace {
+
+const size_t BBOX_BLOCK_VERTICES = 1 << 16;
+
+struct BboxJob {
+  const float*  vertices;
+  size_t        num_vertices;
+  unsigned      stride_bytes;
+  size_t        first_block;
+  size_t        num_blocks;
+};
+
+}  // namespace
+
+void compute_bbox(const float* vertices, size_t num_vertices, unsigned stride_bytes, float bbox_min[3], float bbox_max[3])
+{
+  std::fill(bbox_min, bbox_min+3, FLT_MAX);
+  std::fill(bbox_max, bbox_max+3, -FLT_MAX);
+  if (num_vertices == 0) return;
+
+  const size_t stride = stride_bytes ? stride_bytes : 3*sizeof(float);
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(vertices);
+  size_t i = 0;
+
+#ifdef BBOX_USE_SSE
+  // One unaligned 4-wide load per vertex; the 4th lane is ignored.  The last vertex is done below 
+  // so the load never reads past the end of the buffer.
+  __m128 vmin = _mm_set1_ps(FLT_MAX);
+  __m128 vmax = _mm_set1_ps(-FLT_MAX);
+  for (; i + 1 < num_vertices; ++i, p += stride) {
+    const __m128 v = _mm_loadu_ps(reinterpret_cast<const float*>(p));
+    vmin = _mm_min_ps(vmin, v);
+    vmax = _mm_max_ps(vmax, v);
+  }
+  float lanes_min[4], lanes_max[4];
+  _mm_storeu_ps(lanes_min, vmin);
+  _mm_storeu_ps(lanes_max, vmax);
+  std::copy(lanes_min, lanes_min+3, bbox_min);
+  std::copy(lanes_max, lanes_max+3, bbox_max);
+#endif
+
+  for (; i < num_vertices; ++i, p += stride) {
+    expand_bbox(bbox_min, bbox_max, const_cast<float*>(reinterpret_cast<const float*>(p)));
+  }
+}
+
+void compute_mesh_bboxes(bake::Mesh* meshes, size_t num_meshes)
+{
+  Timer timer;
+  timer.start();
+  // One job per distinct vertex buffer, split into blocks so large meshes spread over threads too
+  std::vector<BboxJob> jobs;
+  std::vector<size_t> mesh_jobs(num_meshes, size_t(-1));
+  std::map<const float*, size_t> job_of_buffer;
+  size_t num_blocks = 0;
+  for (size_t m = 0; m < num_meshes; ++m) {
+    const bake::Mesh& mesh = meshes[m];
+    if (mesh.bbox_min[0] <= mesh.bbox_max[0] && mesh.bbox_min[1] <= mesh.bbox_max[1] && mesh.bbox_min[2] <= mesh.bbox_max[2]) continue;
+    std::map<const float*, size_t>::const_iterator it = job_of_buffer.find(mesh.vertices);
+    if (it != job_of_buffer.end() && jobs[it->second].num_vertices == mesh.num_vertices && jobs[it->second].stride_bytes == mesh.vertex_stride_bytes) {
+      mesh_jobs[m] = it->second;
+      continue;
+    }
+    BboxJob job;
+    job.vertices = mesh.vertices;
+    job.num_vertices = mesh.num_vertices;
+    job.stride_bytes = mesh.vertex_stride_bytes;
+    job.first_block = num_blocks;
+    job.num_blocks = std::max((mesh.num_vertices + BBOX_BLOCK_VERTICES - 1) / BBOX_BLOCK_VERTICES, size_t(1));
+    num_blocks += job.num_blocks;
+    mesh_jobs[m] = jobs.size();
+    job_of_buffer[mesh.vertices] = jobs.size();
+    jobs.push_back(job);
+  }
+  if (jobs.empty()) return;
+
+  std::vector<size_t> block_jobs(num_blocks);
+  for (size_t j = 0; j < jobs.size(); ++j) {
+    std::fill(block_jobs.begin() + jobs[j].first_block, block_jobs.begin() + jobs[j].first_block + jobs[j].num_blocks, j);
+  }
+
+  std::vector<float> block_bounds(6*num_blocks);
+#pragma omp parallel for schedule(dynamic) if(num_blocks > 1)
+  for (ptrdiff_t b = 0; b < ptrdiff_t(num_blocks); ++b) {
+    const BboxJob& job = jobs[block_jobs[b]];
+    const size_t first = (size_t(b) - job.first_block) * BBOX_BLOCK_VERTICES;
+    const size_t count = std::min(BBOX_BLOCK_VERTICES, job.num_vertices - first);
+    const size_t stride = job.stride_bytes ? job.stride_bytes : 3*sizeof(float);
+    const float* vertices = reinterpret_cast<const float*>(reinterpret_cast<const unsigned char*>(job.vertices) + first*stride);
+    compute_bbox(vertices, count, job.stride_bytes, &block_bounds[6*b], &block_bounds[6*b+3]);
+  }
+
+  for (size_t m = 0; m < num_meshes; ++m) {
+    if (mesh_jobs[m] == size_t(-1)) continue;
+    const BboxJob& job = jobs[mesh_jobs[m]];
+    bake::Mesh& mesh = meshes[m];
+    std::fill(mesh.bbox_min, mesh.bbox_min+3, FLT_MAX);
+    std::fill(mesh.bbox_max, mesh.bbox_max+3, -FLT_MAX);
+    for (size_t b = job.first_block; b < job.first_block + job.num_blocks; ++b) {
+      expand_bbox(mesh.bbox_min, mesh.bbox_max, &block_bounds[6*b]);
+      expand_bbox(mesh.bbox_min, mesh.bbox_max, &block_bounds[6*b+3]);
+    }
+  }
+  timer.stop();
+  recordTime("load.bbox", timer);
+}
+
+void xform_instance_bboxes(const bake::Mesh* meshes, bake::Instance* instances, size_t num_instances, float scene_bbox_min[3], float scene_bbox_max[3])
+{
+  Timer timer;
+  timer.start();
+#pragma omp parallel for if(num_instances > 1024)
+  for (ptrdiff_t i = 0; i < ptrdiff_t(num_instances); ++i) {
+    bake::Instance& instance = instances[i];
+    const bake::Mesh& mesh = meshes[instance.mesh_index];
+    xform_bbox(optix::Matrix4x4(instance.xform), mesh.bbox_min, mesh.bbox_max, instance.bbox_min, instance.bbox_max);
+  }
+  for (size_t i = 0; i < num_instances; ++i) {
+    expand_bbox(scene_bbox_min, scene_bbox_max, instances[i].bbox_min);
+    expand_bbox(scene_bbox_min, scene_bbox_max, instances[i].bbox_max);
+  }
+  timer.stop();
+  recordTime("load.bbox", timer);
+}
+
 void make_debug_instances(std::vector<bake::Mesh>& meshes, std::vector<bake::Instance>& instances, size_t n, float scene_bbox_min[3], float scene_bbox_max[3])
 {
   // Make up a transform per instance
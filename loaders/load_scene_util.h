@@ -27,16 +27,31 @@
 #include <optixu/optixu_matrix_namespace.h>
 
 #include <algorithm>
+#include <cmath>
 #include <vector>
 
+// Tight bbox of the transformed box: the center maps through the affine xform, and each output
+// half extent is the input half extents weighted by the absolute values of the matrix row.
 inline void xform_bbox(const optix::Matrix4x4& mat, const float in_min[3], const float in_max[3],
                 float out_min[3], float out_max[3])
 {
-  float4 a = mat*optix::make_float4( in_min[0], in_min[1], in_min[2], 1.0f);
-  float4 b = mat*optix::make_float4( in_max[0], in_max[1], in_max[2], 1.0f);
+  if (in_min[0] > in_max[0] || in_min[1] > in_max[1] || in_min[2] > in_max[2]) {
+    std::copy(in_min, in_min+3, out_min);
+    std::copy(in_max, in_max+3, out_max);
+    return;
+  }
+  const float* m = mat.getData();  // row major
+  float center[3], extent[3];
   for (size_t k = 0; k < 3; ++k) {
-    out_min[k] = (&a.x)[k];
-    out_max[k] = (&b.x)[k];
+    center[k] = 0.5f*(in_min[k] + in_max[k]);
+    extent[k] = 0.5f*(in_max[k] - in_min[k]);
+  }
+  for (size_t i = 0; i < 3; ++i) {
+    const float* row = m + 4*i;
+    const float c = row[0]*center[0] + row[1]*center[1] + row[2]*center[2] + row[3];
+    const float e = std::fabs(row[0])*extent[0] + std::fabs(row[1])*extent[1] + std::fabs(row[2])*extent[2];
+    out_min[i] = c - e;
+    out_max[i] = c + e;
   }
 }
 
@@ -53,5 +68,15 @@ namespace bake {
   struct Instance;
 }
 
+// Bounds of float3 positions at the given byte stride (0 means tightly packed)
+void compute_bbox(const float* vertices, size_t num_vertices, unsigned stride_bytes, float bbox_min[3], float bbox_max[3]);
+
+// Computes the bbox of every mesh whose bbox is empty (min > max), in parallel across meshes and vertex blocks.
+// Meshes sharing a vertex buffer, e.g. bk3d prim groups, compute it once.
+void compute_mesh_bboxes(bake::Mesh* meshes, size_t num_meshes);
+
+// Sets the world bbox of every instance from its mesh bbox and xform, in parallel, and expands the scene bbox by them
+void xform_instance_bboxes(const bake::Mesh* meshes, bake::Instance* instances, size_t num_instances, float scene_bbox_min[3], float scene_bbox_max[3]);
+
 void make_debug_instances(std::vector<bake::Mesh>& meshes, std::vector<bake::Instance>& instances, size_t n, float scene_bbox_min[3], float scene_bbox_max[3]);
 
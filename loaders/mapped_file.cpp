@@ -0,0 +1,130 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#define MAPPED_FILE_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+  : m_data(NULL), m_size(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+  close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const char* filename, bool shared)
+{
+  close();
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file == INVALID_HANDLE_VALUE) return false;
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || (unsigned long long)size.QuadPart > (size_t)-1) {
+    CloseHandle(file);
+    return false;
+  }
+
+  // PAGE_WRITECOPY + FILE_MAP_COPY gives private pages on first write.
+  HANDLE mapping = CreateFileMappingA(file, NULL, shared ? PAGE_READONLY : PAGE_WRITECOPY, 0, 0, NULL);
+  CloseHandle(file);
+  if (!mapping) return false;
+
+  void* view = MapViewOfFile(mapping, shared ? FILE_MAP_READ : FILE_MAP_COPY, 0, 0, 0);
+  // The view keeps the mapping object alive.
+  CloseHandle(mapping);
+  if (!view) return false;
+
+  m_data = (char*)view;
+  m_size = (size_t)size.QuadPart;
+  return true;
+}
+
+void MappedFile::close()
+{
+  if (m_data) UnmapViewOfFile(m_data);
+  m_data = NULL;
+  m_size = 0;
+}
+
+#elif defined(MAPPED_FILE_POSIX)
+
+bool MappedFile::open(const char* filename, bool shared)
+{
+  close();
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    ::close(fd);
+    return false;
+  }
+
+  // MAP_PRIVATE: writes go to anonymous copies of the touched pages only.
+  void* addr = shared ?
+    mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0) :
+    mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  // The mapping holds its own reference to the file.
+  ::close(fd);
+  if (addr == MAP_FAILED) return false;
+
+  m_data = (char*)addr;
+  m_size = (size_t)st.st_size;
+  return true;
+}
+
+void MappedFile::close()
+{
+  if (m_data) munmap(m_data, m_size);
+  m_data = NULL;
+  m_size = 0;
+}
+
+#else
+
+bool MappedFile::open(const char*, bool)
+{
+  return false;
+}
+
+void MappedFile::close()
+{
+}
+
+#endif
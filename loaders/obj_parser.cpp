@@ -0,0 +1,500 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#include "obj_parser.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <vector>
+
+
+namespace {
+
+const size_t OBJ_CHUNK_SIZE = 1 << 22;   // bytes of text parsed per task
+
+enum {
+  RELATIVE_V  = 1,
+  RELATIVE_VT = 2,
+  RELATIVE_VN = 4
+};
+
+struct ObjCorner
+{
+  int v, vt, vn;  // zero based, -1 if absent
+};
+
+// Records parsed from one chunk of lines. Negative (relative) face indices
+// can only be resolved once the number of records before the chunk is known,
+// so they are stored relative to the chunk start and flagged.
+struct ObjChunk
+{
+  ObjChunk() : has_relative(false) {}
+
+  std::vector<float>          positions;
+  std::vector<float>          normals;
+  std::vector<float>          texcoords;
+  std::vector<ObjCorner>      corners;   // 3 per triangle
+  std::vector<unsigned char>  relative;  // RELATIVE_* per corner, only if has_relative
+  bool                        has_relative;
+  std::vector<size_t>         group_starts;  // local triangle index of each g/o record
+  std::vector<std::string>    group_names;
+};
+
+// All records of the file, with face indices resolved
+struct ObjRecords
+{
+  std::vector<float>      positions;
+  std::vector<float>      normals;
+  std::vector<float>      texcoords;
+  std::vector<ObjCorner>  corners;
+  std::vector<size_t>     group_starts;  // global triangle index of each g/o record
+  std::vector<std::string> group_names;
+};
+
+const double POW10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+inline const char* skip_space(const char* p, const char* end)
+{
+  while (p < end && is_space(*p)) ++p;
+  return p;
+}
+
+// Parses the whitespace delimited token at p. Plain decimal and exponent
+// forms take the fast path; anything else goes through strtod. Like tinyobj,
+// a missing or malformed value reads as 0.
+float parse_float(const char*& p, const char* end)
+{
+  p = skip_space(p, end);
+  const char* token = p;
+  while (p < end && !is_space(*p)) ++p;
+  const char* token_end = p;
+
+  const char* s = token;
+  bool negative = false;
+  if (s < token_end && (*s == '+' || *s == '-')) {
+    negative = *s == '-';
+    ++s;
+  }
+  unsigned long long mantissa = 0;
+  int significant = 0;
+  int exponent = 0;
+  bool any_digits = false;
+  for (; s < token_end && is_digit(*s); ++s) {
+    any_digits = true;
+    if (significant < 19) {
+      mantissa = mantissa*10 + (*s - '0');
+      if (mantissa) ++significant;
+    } else {
+      ++exponent;
+    }
+  }
+  if (s < token_end && *s == '.') {
+    for (++s; s < token_end && is_digit(*s); ++s) {
+      any_digits = true;
+      if (significant < 19) {
+        mantissa = mantissa*10 + (*s - '0');
+        if (mantissa) ++significant;
+        --exponent;
+      }
+    }
+  }
+  if (any_digits && s < token_end && (*s == 'e' || *s == 'E')) {
+    ++s;
+    bool exp_negative = false;
+    if (s < token_end && (*s == '+' || *s == '-')) {
+      exp_negative = *s == '-';
+      ++s;
+    }
+    int e = 0;
+    bool exp_digits = false;
+    for (; s < token_end && is_digit(*s); ++s) {
+      exp_digits = true;
+      if (e < 10000) e = e*10 + (*s - '0');
+    }
+    if (!exp_digits) any_digits = false;
+    exponent += exp_negative ? -e : e;
+  }
+
+  if (any_digits && s == token_end && exponent >= -22 && exponent <= 22) {
+    double value = double(mantissa);
+    value = exponent < 0 ? value / POW10[-exponent] : value * POW10[exponent];
+    return float(negative ? -value : value);
+  }
+  if (token == token_end) return 0.0f;
+
+  char buf[128];
+  const size_t len = std::min(size_t(token_end - token), sizeof(buf) - 1);
+  memcpy(buf, token, len);
+  buf[len] = '\0';
+  return float(strtod(buf, NULL));
+}
+
+// atoi semantics: optional sign and digits, 0 if there are none
+inline int parse_int(const char*& p, const char* end)
+{
+  bool negative = false;
+  if (p < end && (*p == '+' || *p == '-')) {
+    negative = *p == '-';
+    ++p;
+  }
+  int value = 0;
+  for (; p < end && is_digit(*p); ++p) {
+    value = value*10 + (*p - '0');
+  }
+  return negative ? -value : value;
+}
+
+// Same convention as tinyobj's fixIndex, with 'n' the records seen so far in
+// this chunk; relative indices are flagged for the merge.
+inline int fix_index(int idx, int n, unsigned char flag, unsigned char& relative)
+{
+  if (idx > 0) return idx - 1;
+  if (idx == 0) return 0;
+  relative |= flag;
+  return n + idx;
+}
+
+void parse_face(const char* p, const char* end, ObjChunk& chunk, std::vector<ObjCorner>& face, std::vector<unsigned char>& face_relative)
+{
+  const int nv  = int(chunk.positions.size() / 3);
+  const int nvn = int(chunk.normals.size() / 3);
+  const int nvt = int(chunk.texcoords.size() / 2);
+
+  face.clear();
+  face_relative.clear();
+  p = skip_space(p, end);
+  while (p < end) {
+    ObjCorner c;
+    c.vt = c.vn = -1;
+    unsigned char relative = 0;
+
+    // i, i/j, i//k, i/j/k
+    c.v = fix_index(parse_int(p, end), nv, RELATIVE_V, relative);
+    if (p < end && *p == '/') {
+      ++p;
+      if (p < end && *p != '/') {
+        c.vt = fix_index(parse_int(p, end), nvt, RELATIVE_VT, relative);
+      }
+      if (p < end && *p == '/') {
+        ++p;
+        c.vn = fix_index(parse_int(p, end), nvn, RELATIVE_VN, relative);
+      }
+    }
+    while (p < end && !is_space(*p)) ++p;
+    p = skip_space(p, end);
+
+    face.push_back(c);
+    face_relative.push_back(relative);
+  }
+
+  // Polygon -> triangle fan conversion
+  for (size_t k = 2; k < face.size(); ++k) {
+    const size_t fan[3] = { 0, k-1, k };
+    for (size_t j = 0; j < 3; ++j) {
+      chunk.corners.push_back(face[fan[j]]);
+      if (face_relative[fan[j]] && !chunk.has_relative) {
+        chunk.has_relative = true;
+        chunk.relative.resize(chunk.corners.size() - 1, 0);
+      }
+      if (chunk.has_relative) chunk.relative.push_back(face_relative[fan[j]]);
+    }
+  }
+}
+
+void parse_chunk(const char* begin, const char* end, ObjChunk& chunk)
+{
+  std::vector<ObjCorner> face;
+  std::vector<unsigned char> face_relative;
+
+  const char* p = begin;
+  while (p < end) {
+    const char* line_end = (const char*)memchr(p, '\n', size_t(end - p));
+    if (!line_end) line_end = end;
+
+    const char* token = skip_space(p, line_end);
+    const size_t len = size_t(line_end - token);
+    if (len >= 2 && token[0] == 'v' && is_space(token[1])) {
+      token += 2;
+      for (int k = 0; k < 3; ++k) chunk.positions.push_back(parse_float(token, line_end));
+    } else if (len >= 3 && token[0] == 'v' && token[1] == 'n' && is_space(token[2])) {
+      token += 3;
+      for (int k = 0; k < 3; ++k) chunk.normals.push_back(parse_float(token, line_end));
+    } else if (len >= 3 && token[0] == 'v' && token[1] == 't' && is_space(token[2])) {
+      token += 3;
+      for (int k = 0; k < 2; ++k) chunk.texcoords.push_back(parse_float(token, line_end));
+    } else if (len >= 2 && token[0] == 'f' && is_space(token[1])) {
+      parse_face(token + 2, line_end, chunk, face, face_relative);
+    } else if (len >= 1 && (token[0] == 'g' || token[0] == 'o') && (len == 1 || is_space(token[1]))) {
+      const char* name = skip_space(token + 1, line_end);
+      const char* name_end = line_end;
+      while (name_end > name && is_space(name_end[-1])) --name_end;
+      chunk.group_starts.push_back(chunk.corners.size() / 3);
+      chunk.group_names.push_back(std::string(name, name_end));
+    }
+    // Everything else (comments, materials) is ignored.
+
+    p = line_end + 1;
+  }
+}
+
+// Start of the first line beginning at or after 'offset'
+size_t next_line(const char* data, size_t size, size_t offset)
+{
+  if (offset == 0) return 0;
+  const char* nl = (const char*)memchr(data + offset - 1, '\n', size - offset + 1);
+  return nl ? size_t(nl - data) + 1 : size;
+}
+
+bool same_normal(const std::vector<float>& normals, int a, int b)
+{
+  if (a == b) return true;
+  if (a < 0 || b < 0) return false;
+  for (int k = 0; k < 3; ++k) {
+    if (normals[3*a+k] != normals[3*b+k]) return false;
+  }
+  return true;
+}
+
+bool parse_obj(const char* filename, ObjRecords& records, std::string& err)
+{
+  MappedFile file;
+  if (!file.open(filename)) {
+    err = std::string("Cannot map file [") + filename + "]";
+    return false;
+  }
+  const char* data = file.data();
+  const size_t size = file.size();
+
+  // Split at line boundaries and parse chunks independently
+  const size_t num_chunks = std::max<size_t>(1, size / OBJ_CHUNK_SIZE);
+  std::vector<size_t> chunk_begin(num_chunks + 1);
+  for (size_t i = 0; i <= num_chunks; ++i) {
+    chunk_begin[i] = next_line(data, size, i == num_chunks ? size : size / num_chunks * i);
+  }
+  std::vector<ObjChunk> chunks(num_chunks);
+#pragma omp parallel for schedule(dynamic)
+  for (ptrdiff_t i = 0; i < ptrdiff_t(num_chunks); ++i) {
+    parse_chunk(data + chunk_begin[i], data + chunk_begin[i+1], chunks[i]);
+  }
+
+  // Prefix sums of record counts give each chunk's place in the merged arrays
+  std::vector<size_t> v_offset(num_chunks + 1, 0), vn_offset(num_chunks + 1, 0), vt_offset(num_chunks + 1, 0), c_offset(num_chunks + 1, 0);
+  for (size_t i = 0; i < num_chunks; ++i) {
+    v_offset[i+1]  = v_offset[i]  + chunks[i].positions.size();
+    vn_offset[i+1] = vn_offset[i] + chunks[i].normals.size();
+    vt_offset[i+1] = vt_offset[i] + chunks[i].texcoords.size();
+    c_offset[i+1]  = c_offset[i]  + chunks[i].corners.size();
+  }
+  const size_t num_positions = v_offset[num_chunks] / 3;
+  const size_t num_normals   = vn_offset[num_chunks] / 3;
+  const size_t num_texcoords = vt_offset[num_chunks] / 2;
+  const size_t num_corners   = c_offset[num_chunks];
+  if (num_corners == 0) {
+    err = std::string("No faces in [") + filename + "]";
+    return false;
+  }
+
+  std::vector<float>& positions = records.positions;
+  std::vector<float>& normals   = records.normals;
+  std::vector<float>& texcoords = records.texcoords;
+  std::vector<ObjCorner>& corners = records.corners;
+  positions.resize(3*num_positions);
+  normals.resize(3*num_normals);
+  texcoords.resize(2*num_texcoords);
+  corners.resize(num_corners);
+  int bad_indices = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+:bad_indices)
+  for (ptrdiff_t i = 0; i < ptrdiff_t(num_chunks); ++i) {
+    ObjChunk& chunk = chunks[i];
+    std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + v_offset[i]);
+    std::copy(chunk.normals.begin(), chunk.normals.end(), normals.begin() + vn_offset[i]);
+    std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), texcoords.begin() + vt_offset[i]);
+
+    const int v_base  = int(v_offset[i] / 3);
+    const int vn_base = int(vn_offset[i] / 3);
+    const int vt_base = int(vt_offset[i] / 2);
+    for (size_t c = 0; c < chunk.corners.size(); ++c) {
+      ObjCorner corner = chunk.corners[c];
+      const unsigned char relative = chunk.has_relative ? chunk.relative[c] : 0;
+      if (relative & RELATIVE_V)  corner.v  += v_base;
+      if (relative & RELATIVE_VN) corner.vn += vn_base;
+      if (relative & RELATIVE_VT) corner.vt += vt_base;
+      if (corner.v < 0 || size_t(corner.v) >= num_positions ||
+          (corner.vn >= 0 && size_t(corner.vn) >= num_normals) ||
+          (corner.vt >= 0 && size_t(corner.vt) >= num_texcoords)) {
+        ++bad_indices;
+        corner.v = 0;
+        corner.vn = corner.vt = -1;
+      }
+      corners[c_offset[i] + c] = corner;
+    }
+    // release as we go
+    std::vector<float>().swap(chunk.positions);
+    std::vector<float>().swap(chunk.normals);
+    std::vector<float>().swap(chunk.texcoords);
+    std::vector<ObjCorner>().swap(chunk.corners);
+  }
+  if (bad_indices) {
+    std::ostringstream ss;
+    ss << "Face index out of range (" << bad_indices << " corners) in [" << filename << "]";
+    err = ss.str();
+    return false;
+  }
+
+  for (size_t i = 0; i < num_chunks; ++i) {
+    for (size_t g = 0; g < chunks[i].group_starts.size(); ++g) {
+      records.group_starts.push_back(c_offset[i]/3 + chunks[i].group_starts[g]);
+      records.group_names.push_back(chunks[i].group_names[g]);
+    }
+  }
+  return true;
+}
+
+// Builds vertex rate arrays for a list of triangle corners
+void flatten_corners(const ObjRecords& records, const ObjCorner* corners, size_t num_corners, tinyobj::mesh_t& mesh)
+{
+  const std::vector<float>& positions = records.positions;
+  const std::vector<float>& normals   = records.normals;
+  const std::vector<float>& texcoords = records.texcoords;
+
+  // Groups usually reference a compact range of positions
+  int v_min = corners[0].v, v_max = corners[0].v;
+  for (size_t c = 1; c < num_corners; ++c) {
+    v_min = std::min(v_min, corners[c].v);
+    v_max = std::max(v_max, corners[c].v);
+  }
+
+  // Share vertices per position index, splitting on differing normal values.
+  // A chain per position keeps the first-use order tinyobj produces.
+  std::vector<int> head(size_t(v_max - v_min) + 1, -1);
+  std::vector<int> next;
+  std::vector<ObjCorner> out_vertices;
+  mesh.indices.resize(num_corners);
+  for (size_t c = 0; c < num_corners; ++c) {
+    const ObjCorner& corner = corners[c];
+    int id = head[corner.v - v_min];
+    int prev = -1;
+    while (id >= 0 && !same_normal(normals, out_vertices[id].vn, corner.vn)) {
+      prev = id;
+      id = next[id];
+    }
+    if (id < 0) {
+      id = int(out_vertices.size());
+      out_vertices.push_back(corner);
+      next.push_back(-1);
+      if (prev < 0) head[corner.v - v_min] = id;
+      else next[prev] = id;
+    }
+    mesh.indices[c] = unsigned(id);
+  }
+
+  // Vertex rate attributes. Normals and texcoords are only kept if every
+  // vertex has one, otherwise the arrays would not line up with positions.
+  const size_t num_out = out_vertices.size();
+  int missing_normals = 0, missing_texcoords = 0;
+#pragma omp parallel for reduction(+:missing_normals,missing_texcoords)
+  for (ptrdiff_t i = 0; i < ptrdiff_t(num_out); ++i) {
+    if (out_vertices[i].vn < 0) ++missing_normals;
+    if (out_vertices[i].vt < 0) ++missing_texcoords;
+  }
+  mesh.positions.resize(3*num_out);
+  mesh.normals.resize(missing_normals ? 0 : 3*num_out);
+  mesh.texcoords.resize(missing_texcoords ? 0 : 2*num_out);
+#pragma omp parallel for
+  for (ptrdiff_t i = 0; i < ptrdiff_t(num_out); ++i) {
+    const ObjCorner& vertex = out_vertices[i];
+    for (int k = 0; k < 3; ++k) mesh.positions[3*i+k] = positions[3*size_t(vertex.v)+k];
+    if (!missing_normals) {
+      for (int k = 0; k < 3; ++k) mesh.normals[3*i+k] = normals[3*size_t(vertex.vn)+k];
+    }
+    if (!missing_texcoords) {
+      for (int k = 0; k < 2; ++k) mesh.texcoords[2*i+k] = texcoords[2*size_t(vertex.vt)+k];
+    }
+  }
+}
+
+}  // namespace
+
+
+bool load_obj_parallel(tinyobj::mesh_t& mesh, std::string& err, const char* filename)
+{
+  ObjRecords records;
+  if (!parse_obj(filename, records, err)) return false;
+  flatten_corners(records, &records.corners[0], records.corners.size(), mesh);
+  return true;
+}
+
+
+bool load_obj_parallel(std::vector<tinyobj::mesh_t>& meshes, std::vector<std::string>& names, std::string& err, const char* filename)
+{
+  ObjRecords records;
+  if (!parse_obj(filename, records, err)) return false;
+
+  // Triangle ranges per group name, in order of first appearance. Faces
+  // before the first g/o record form an unnamed group.
+  std::map<std::string, size_t> group_index;
+  std::vector< std::vector< std::pair<size_t, size_t> > > group_ranges;
+  names.clear();
+  const size_t num_triangles = records.corners.size() / 3;
+  for (size_t g = 0; g <= records.group_starts.size(); ++g) {
+    const size_t begin = g == 0 ? 0 : records.group_starts[g-1];
+    const size_t end = g < records.group_starts.size() ? records.group_starts[g] : num_triangles;
+    if (begin == end) continue;
+    const std::string name = g == 0 ? std::string() : records.group_names[g-1];
+    std::map<std::string, size_t>::iterator it = group_index.find(name);
+    if (it == group_index.end()) {
+      it = group_index.insert(std::make_pair(name, names.size())).first;
+      names.push_back(name);
+      group_ranges.push_back(std::vector< std::pair<size_t, size_t> >());
+    }
+    group_ranges[it->second].push_back(std::make_pair(begin, end));
+  }
+
+  meshes.clear();
+  meshes.resize(names.size());
+  const bool parallel_groups = names.size() > 1;
+#pragma omp parallel for schedule(dynamic) if(parallel_groups)
+  for (ptrdiff_t g = 0; g < ptrdiff_t(names.size()); ++g) {
+    const std::vector< std::pair<size_t, size_t> >& ranges = group_ranges[g];
+    if (ranges.size() == 1) {
+      flatten_corners(records, &records.corners[3*ranges[0].first], 3*(ranges[0].second - ranges[0].first), meshes[g]);
+    } else {
+      std::vector<ObjCorner> corners;
+      for (size_t r = 0; r < ranges.size(); ++r) {
+        corners.insert(corners.end(), records.corners.begin() + 3*ranges[r].first, records.corners.begin() + 3*ranges[r].second);
+      }
+      flatten_corners(records, &corners[0], corners.size(), meshes[g]);
+    }
+  }
+  return true;
+}
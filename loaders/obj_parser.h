@@ -0,0 +1,42 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#pragma once
+
+#include "tiny_obj_loader.h"
+
+#include <string>
+#include <vector>
+
+// Parallel replacement for tinyobj::LoadObj. The mapped file is split into
+// chunks at line boundaries; v/vn/vt/f records are parsed per chunk and merged
+// with prefix-summed offsets. The result matches tinyobj::LoadObj: polygons
+// are fan triangulated and vertices are shared per position, split only where
+// normal values differ, in order of first use.
+// Returns false with 'err' set if the file cannot be mapped or is malformed.
+bool load_obj_parallel(tinyobj::mesh_t& mesh, std::string& err, const char* filename);
+
+// Same, but keeps each OBJ group (g or o record) as a separate mesh. Faces of
+// groups that appear more than once are merged; faces before the first group
+// record form a group with an empty name.
+bool load_obj_parallel(std::vector<tinyobj::mesh_t>& meshes, std::vector<std::string>& names, std::string& err, const char* filename);
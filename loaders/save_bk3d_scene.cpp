@@ -0,0 +1,330 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+// Copy of a bk3d file with baked vertex AO as one more vertex attribute of each mesh.  The file is kept as stored,
+// with pointers as offsets: the new pools, slot and attribute nodes of each mesh, and a relocation table with their
+// pointers, are inserted after the header structs, and the AO arrays appended to the buffer area.  Offsets into
+// the buffer area move by the bytes inserted, which keep its alignment.
+
+#include "load_scene.h"
+#include "../bake_api.h"
+
+#include "bk3dEx.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <vector>
+
+namespace {
+
+  const char*  const AO_ATTRIBUTE_NAME = "ambientocclusion";
+  const size_t READ_CHUNK_BYTES = 4 << 20;
+  const size_t INSERTED_ALIGNMENT = 64;  // of the bytes inserted before the buffer area
+  const size_t AO_ARRAY_ALIGNMENT = 16;
+
+  typedef bk3d::RelocationTable::Offsets Relocation;
+
+  size_t align_up(size_t offset, size_t alignment)
+  {
+    return (offset + alignment - 1) / alignment * alignment;
+  }
+
+  // The whole uncompressed file: header structs, then the buffer area
+  bool read_bk3d_image(const char* filename, std::vector<char>& image)
+  {
+    GFILE fd = GOPEN(filename, "rb");
+    if (!fd) return false;
+    image.clear();
+    std::vector<char> chunk(READ_CHUNK_BYTES);
+    int n = 0;
+    while ((n = GREAD(fd, &chunk[0], chunk.size())) > 0) image.insert(image.end(), chunk.begin(), chunk.begin() + n);
+    GCLOSE(fd);
+    return n == 0 && !image.empty();
+  }
+
+  void store_offset(std::vector<char>& bytes, size_t at, size_t offset)
+  {
+    const unsigned long long value = offset;
+    memcpy(&bytes[at], &value, sizeof(value));
+  }
+
+  size_t field_offset(const void* node, const void* field)
+  {
+    return size_t((const char*)field - (const char*)node);
+  }
+
+  template <typename Pool>
+  size_t pool_bytes(int n)
+  {
+    return sizeof(Pool) + size_t(std::max(n - 1, 0))*sizeof(((Pool*)0)->p[0]);
+  }
+
+  // Nodes and AO of one mesh, with their offsets in the output file
+  struct MeshAO
+  {
+    int    mesh_index;
+    std::vector<float> ao;
+    size_t slot_attributes;   // attribute pool of the new slot
+    size_t attribute;
+    size_t slot;
+    size_t slots;             // slot pool of the mesh, the new slot last
+    size_t attributes;        // attribute pool of the mesh, the new attribute last
+    size_t ao_offset;
+  };
+
+}   //namespace
+
+
+bool save_bk3d_scene_ao(const char* filename, const char* bk3d_filename, const bake::Scene& scene, const float* const* vertex_ao)
+{
+  std::vector<char> image;
+  if (!read_bk3d_image(bk3d_filename, image)) {
+    std::cerr << "Failed to read: " << bk3d_filename << std::endl;
+    return false;
+  }
+  const bk3d::FileHeader* stored = (const bk3d::FileHeader*)&image[0];
+  if (image.size() < sizeof(bk3d::FileHeader) || stored->version != RAWMESHVERSION || stored->nodeByteSize > image.size()) {
+    std::cerr << "Not a bk3d file of version " << RAWMESHVERSIONSTR << ": " << bk3d_filename << std::endl;
+    return false;
+  }
+  const size_t node_bytes = stored->nodeByteSize;
+
+  // Structs are walked on a resolved copy, where the file offset of anything is its distance from the start
+  std::vector<char> resolved(image);
+  const char* base = &resolved[0];
+  bk3d::FileHeader* header = (bk3d::FileHeader*)&resolved[0];
+  header->resolvePointers(&resolved[0] + node_bytes);
+  if (!header->pMeshes || !header->pRelocationTable) {
+    std::cerr << "No meshes in: " << bk3d_filename << std::endl;
+    return false;
+  }
+  const size_t table_offset = size_t((const char*)(bk3d::RelocationTable*)header->pRelocationTable - base);
+  std::vector<Relocation> relocations(header->pRelocationTable->pRelocationOffsets,
+                                      header->pRelocationTable->pRelocationOffsets + header->pRelocationTable->numRelocationOffsets);
+  std::map<size_t, size_t> relocation_at;
+  for (size_t r = 0; r < relocations.size(); ++r) relocation_at[relocations[r].ptrOffset] = r;
+
+  std::map<uint64_t, size_t> instance_by_id;
+  for (size_t i = 0; i < scene.num_instances; ++i) instance_by_id.insert(std::make_pair(scene.instances[i].storage_identifier, i));
+
+  // AO of each mesh with triangles, over its whole vertex buffer.  Prim groups sharing vertices average their AO, and
+  // vertices no baked prim group uses are unoccluded.
+  std::vector<MeshAO> meshes;
+  size_t num_missing = 0;
+  for (int m = 0; m < header->pMeshes->n; ++m) {
+    bk3d::Mesh* pMesh = header->pMeshes->p[m];
+    if (!pMesh->pAttributes || pMesh->pAttributes->n < 1 || !pMesh->pSlots) continue;
+    const unsigned num_vertices = pMesh->pSlots->p[pMesh->pAttributes->p[0]->slot]->vertexCount;
+    std::vector<float> sum(num_vertices, 0.0f);
+    std::vector<unsigned> count(num_vertices, 0);
+    bool has_triangles = false;
+    for (int pg = 0; pg < pMesh->pPrimGroups->n; ++pg) {
+      bk3d::PrimGroup* pPG = pMesh->pPrimGroups->p[pg];
+      if (pPG->topologyGL != GL_TRIANGLES || pPG->indexFormatGL != GL_UNSIGNED_INT) continue;
+      has_triangles = true;
+      const std::map<uint64_t, size_t>::const_iterator it = instance_by_id.find((uint64_t(m) << 32) | uint64_t(pg));
+      if (it == instance_by_id.end() || !vertex_ao[it->second]) {
+        ++num_missing;
+        continue;
+      }
+      const unsigned* indices = (const unsigned*)pPG->pIndexBufferData;
+      const size_t num_indices = 3*size_t(pPG->primitiveCount);
+      if (num_indices == 0) continue;
+      const unsigned first_vertex = *std::min_element(indices, indices + num_indices);
+      const unsigned last_vertex = *std::max_element(indices, indices + num_indices);
+      const bake::Mesh& mesh = scene.meshes[scene.instances[it->second].mesh_index];
+      if (last_vertex >= num_vertices || mesh.num_vertices != size_t(last_vertex - first_vertex) + 1) {
+        std::cerr << "Prim group " << pg << " of mesh " << m << " of " << bk3d_filename << " does not match the baked scene" << std::endl;
+        return false;
+      }
+      const float* ao = vertex_ao[it->second];
+      for (size_t k = 0; k < num_indices; ++k) {
+        sum[indices[k]] += ao[indices[k] - first_vertex];
+        ++count[indices[k]];
+      }
+    }
+    if (!has_triangles) continue;
+    meshes.push_back(MeshAO());
+    MeshAO& mesh_ao = meshes.back();
+    mesh_ao.mesh_index = m;
+    mesh_ao.ao.resize(num_vertices);
+    for (unsigned v = 0; v < num_vertices; ++v) mesh_ao.ao[v] = count[v] ? sum[v] / float(count[v]) : 1.0f;
+  }
+  if (num_missing > 0) {
+    std::cerr << num_missing << " prim groups of " << bk3d_filename << " were not baked and are unoccluded" << std::endl;
+  }
+
+  // Layout: the new nodes and relocation table go between the header structs and the buffer area, the AO after it
+  size_t offset = align_up(node_bytes, 8);
+  size_t num_new_relocations = 0;
+  for (size_t k = 0; k < meshes.size(); ++k) {
+    MeshAO& mesh_ao = meshes[k];
+    const bk3d::Mesh* pMesh = header->pMeshes->p[mesh_ao.mesh_index];
+    mesh_ao.slot_attributes = offset;
+    offset += pool_bytes<bk3d::AttributePool>(1);
+    mesh_ao.attribute = offset;
+    offset += sizeof(bk3d::Attribute);
+    mesh_ao.slot = offset;
+    offset += sizeof(bk3d::Slot);
+    mesh_ao.slots = offset;
+    offset += align_up(pool_bytes<bk3d::SlotPool>(pMesh->pSlots->n + 1), 8);
+    mesh_ao.attributes = offset;
+    offset += align_up(pool_bytes<bk3d::AttributePool>(pMesh->pAttributes->n + 1), 8);
+    num_new_relocations += 4 + size_t(pMesh->pSlots->n + 1) + size_t(pMesh->pAttributes->n + 1);
+  }
+  const size_t new_table_offset = offset;
+  offset += (relocations.size() + num_new_relocations)*sizeof(Relocation);
+  const size_t new_node_bytes = node_bytes + align_up(offset - node_bytes, INSERTED_ALIGNMENT);
+  const size_t shift = new_node_bytes - node_bytes;
+  offset = align_up(image.size() + shift, AO_ARRAY_ALIGNMENT);
+  for (size_t k = 0; k < meshes.size(); ++k) {
+    meshes[k].ao_offset = offset;
+    offset = align_up(offset + meshes[k].ao.size()*sizeof(float), AO_ARRAY_ALIGNMENT);
+  }
+  if (offset > size_t(0xffffffffu)) {
+    std::cerr << "bk3d offsets are 32 bits; " << bk3d_filename << " with AO would be too large" << std::endl;
+    return false;
+  }
+
+  // Offsets into the buffer area move past the inserted bytes, where the pointers are and where they point.  A
+  // stored pointer of 0 is NULL and stays so.
+  const size_t moved = node_bytes;
+  for (size_t r = 0; r < relocations.size(); ++r) {
+    Relocation& relocation = relocations[r];
+    if (relocation.ptrOffset == 0) continue;
+    unsigned long long value = 0;
+    memcpy(&value, &image[relocation.ptrOffset], sizeof(value));
+    if (relocation.offset >= moved) relocation.offset += unsigned(shift);
+    if (value != 0) store_offset(image, relocation.ptrOffset, relocation.offset);
+    if (relocation.ptrOffset >= moved) relocation.ptrOffset += unsigned(shift);
+  }
+  const size_t old_relocations = relocations.size();
+
+  // The inserted bytes, at node_bytes in the output file
+  std::vector<char> inserted(shift, 0);
+  for (size_t k = 0; k < meshes.size(); ++k) {
+    const MeshAO& mesh_ao = meshes[k];
+    const bk3d::Mesh* pMesh = header->pMeshes->p[mesh_ao.mesh_index];
+
+    bk3d::Attribute attribute;
+    strncpy(attribute.name, AO_ATTRIBUTE_NAME, NODENAMESZ - 1);
+    attribute.nodeByteSize = sizeof(bk3d::Attribute);
+    attribute.formatDX9 = D3DDECLTYPE_FLOAT1;
+    attribute.formatDXGI = DXGI_FORMAT_R32_FLOAT;
+    attribute.formatGL = GL_FLOAT;
+    attribute.numComp = 1;
+    attribute.strideBytes = sizeof(float);
+    attribute.slot = unsigned(pMesh->pSlots->n);
+    memcpy(&inserted[mesh_ao.attribute - node_bytes], &attribute, sizeof(attribute));
+    const size_t attribute_data = mesh_ao.attribute + field_offset(&attribute, &attribute.pAttributeBufferData);
+
+    bk3d::Slot slot;
+    strncpy(slot.name, AO_ATTRIBUTE_NAME, NODENAMESZ - 1);
+    slot.nodeByteSize = sizeof(bk3d::Slot);
+    slot.vtxBufferSizeBytes = unsigned(mesh_ao.ao.size()*sizeof(float));
+    slot.vtxBufferStrideBytes = sizeof(float);
+    slot.vertexCount = unsigned(mesh_ao.ao.size());
+    memcpy(&inserted[mesh_ao.slot - node_bytes], &slot, sizeof(slot));
+    const size_t slot_attributes = mesh_ao.slot + field_offset(&slot, &slot.pAttributes);
+    const size_t slot_data = mesh_ao.slot + field_offset(&slot, &slot.pVtxBufferData);
+
+    // Pools hold n, then the pointers
+    const int num_slot_attributes = 1;
+    const int num_slots = pMesh->pSlots->n + 1;
+    const int num_attributes = pMesh->pAttributes->n + 1;
+    memcpy(&inserted[mesh_ao.slot_attributes - node_bytes], &num_slot_attributes, sizeof(int));
+    memcpy(&inserted[mesh_ao.slots - node_bytes], &num_slots, sizeof(int));
+    memcpy(&inserted[mesh_ao.attributes - node_bytes], &num_attributes, sizeof(int));
+    const size_t pointers = field_offset(pMesh->pSlots, &pMesh->pSlots->p[0]);
+
+    std::vector< std::pair<size_t, size_t> > pointer_targets;
+    pointer_targets.push_back(std::make_pair(mesh_ao.slot_attributes + pointers, mesh_ao.attribute));
+    pointer_targets.push_back(std::make_pair(attribute_data, mesh_ao.ao_offset));
+    pointer_targets.push_back(std::make_pair(slot_attributes, mesh_ao.slot_attributes));
+    pointer_targets.push_back(std::make_pair(slot_data, mesh_ao.ao_offset));
+    for (int s = 0; s < num_slots; ++s) {
+      size_t target = s < pMesh->pSlots->n ? size_t((const char*)(bk3d::Slot*)pMesh->pSlots->p[s].p - base) : mesh_ao.slot;
+      if (s < pMesh->pSlots->n && target >= moved) target += shift;
+      pointer_targets.push_back(std::make_pair(mesh_ao.slots + pointers + 8*size_t(s), target));
+    }
+    for (int a = 0; a < num_attributes; ++a) {
+      size_t target = a < pMesh->pAttributes->n ? size_t((const char*)(bk3d::Attribute*)pMesh->pAttributes->p[a].p - base) : mesh_ao.attribute;
+      if (a < pMesh->pAttributes->n && target >= moved) target += shift;
+      pointer_targets.push_back(std::make_pair(mesh_ao.attributes + pointers + 8*size_t(a), target));
+    }
+    for (size_t p = 0; p < pointer_targets.size(); ++p) {
+      store_offset(inserted, pointer_targets[p].first - node_bytes, pointer_targets[p].second);
+      Relocation relocation;
+      relocation.ptrOffset = unsigned(pointer_targets[p].first);
+      relocation.offset = unsigned(pointer_targets[p].second);
+      relocations.push_back(relocation);
+    }
+
+    // The mesh takes the new pools
+    const size_t mesh_offset = size_t((const char*)pMesh - base);
+    const size_t mesh_pointers[2] = { mesh_offset + field_offset(pMesh, &pMesh->pSlots), mesh_offset + field_offset(pMesh, &pMesh->pAttributes) };
+    const size_t mesh_targets[2] = { mesh_ao.slots, mesh_ao.attributes };
+    for (int f = 0; f < 2; ++f) {
+      const size_t at = mesh_pointers[f] >= moved ? mesh_pointers[f] + shift : mesh_pointers[f];
+      const std::map<size_t, size_t>::const_iterator it = relocation_at.find(mesh_pointers[f]);
+      if (at >= moved || it == relocation_at.end()) {
+        std::cerr << "Unexpected layout of mesh " << mesh_ao.mesh_index << " in: " << bk3d_filename << std::endl;
+        return false;
+      }
+      relocations[it->second].offset = unsigned(mesh_targets[f]);
+      store_offset(image, at, mesh_targets[f]);
+    }
+  }
+  assert(relocations.size() == old_relocations + num_new_relocations);
+  memcpy(&inserted[new_table_offset - node_bytes], &relocations[0], relocations.size()*sizeof(Relocation));
+
+  // The header and the relocation table node, both in the header structs, point to the new table
+  bk3d::FileHeader* out_header = (bk3d::FileHeader*)&image[0];
+  out_header->nodeByteSize = unsigned(new_node_bytes);
+  bk3d::RelocationTable* table = (bk3d::RelocationTable*)&image[table_offset];
+  table->numRelocationOffsets = LONG(relocations.size());
+  store_offset(image, table_offset + field_offset(table, &table->pRelocationOffsets), new_table_offset);
+
+  FILE* file = fopen(filename, "wb");
+  if (!file) {
+    std::cerr << "Failed to open: " << filename << std::endl;
+    return false;
+  }
+  bool ok = fwrite(&image[0], 1, node_bytes, file) == node_bytes;
+  ok = ok && fwrite(&inserted[0], 1, inserted.size(), file) == inserted.size();
+  ok = ok && fwrite(&image[node_bytes], 1, image.size() - node_bytes, file) == image.size() - node_bytes;
+  size_t written = image.size() + shift;
+  const char zeros[AO_ARRAY_ALIGNMENT] = { 0 };
+  for (size_t k = 0; ok && k < meshes.size(); ++k) {
+    ok = fwrite(zeros, 1, meshes[k].ao_offset - written, file) == meshes[k].ao_offset - written;
+    ok = ok && fwrite(&meshes[k].ao[0], sizeof(float), meshes[k].ao.size(), file) == meshes[k].ao.size();
+    written = meshes[k].ao_offset + meshes[k].ao.size()*sizeof(float);
+  }
+  ok = fclose(file) == 0 && ok;
+  if (!ok) std::cerr << "Failed to write: " << filename << std::endl;
+  return ok;
+}
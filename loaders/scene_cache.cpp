@@ -0,0 +1,394 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#include "load_scene.h"
+#include "mapped_file.h"
+#include "../bake_api.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SCENE_CACHE_LOCK_POSIX
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+
+namespace {
+
+  const char     SCENE_CACHE_MAGIC[8] = { 'B', 'A', 'K', 'E', 'S', 'C', 'N', '1' };
+  const uint32_t SCENE_CACHE_VERSION = 4;  // 3: bk3d prim groups keep only their vertex window, 4: csf part meshes
+  const uint64_t SCENE_CACHE_ALIGNMENT = 16;
+
+  // All offsets are in bytes from the start of the file. Sections are aligned
+  // to SCENE_CACHE_ALIGNMENT so the mapped arrays can be used in place.
+  struct CacheHeader
+  {
+    char     magic[8];
+    uint32_t version;
+    uint32_t split_obj_groups;
+    uint64_t source_size;
+    int64_t  source_mtime;
+    uint64_t num_instances_per_mesh;
+    uint64_t num_meshes;
+    uint64_t num_instances;
+    uint64_t meshes_offset;
+    uint64_t instances_offset;
+    float    bbox_min[3];
+    float    bbox_max[3];
+  };
+
+  struct CacheMesh
+  {
+    uint64_t num_vertices;
+    uint64_t num_triangles;
+    uint64_t vertices_offset;  // tightly packed float3
+    uint64_t normals_offset;   // tightly packed float3, 0 if the mesh has no normals
+    uint64_t texcoords_offset; // tightly packed float2, 0 if the mesh has no texcoords
+    uint64_t indices_offset;   // uint3 per triangle
+    float    bbox_min[3];
+    float    bbox_max[3];
+  };
+
+  struct CacheSceneMemory : public SceneMemory
+  {
+    virtual ~CacheSceneMemory() {}
+
+    MappedFile mapping;
+    std::vector<bake::Mesh> meshes;
+    std::vector<bake::Instance> instances;
+  };
+
+  uint64_t align_offset(uint64_t offset)
+  {
+    return (offset + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT * SCENE_CACHE_ALIGNMENT;
+  }
+
+  bool stat_file(const char* filename, uint64_t& size, int64_t& mtime)
+  {
+    struct stat buf;
+    if (stat(filename, &buf) != 0) return false;
+    size = (uint64_t)buf.st_size;
+    mtime = (int64_t)buf.st_mtime;
+    return true;
+  }
+
+  // A scene list stands for the files it names too: the total size and the newest time
+  bool stat_source(const char* filename, uint64_t& size, int64_t& mtime)
+  {
+    if (!stat_file(filename, size, mtime)) return false;
+    const std::string name(filename);
+    const std::string list_extension(".scenes");
+    if (name.size() < list_extension.size() || name.compare(name.size() - list_extension.size(), list_extension.size(), list_extension) != 0) return true;
+    std::vector<std::string> filenames;
+    if (!read_scene_list(filename, filenames)) return false;
+    for (size_t i = 0; i < filenames.size(); ++i) {
+      uint64_t file_size = 0;
+      int64_t file_mtime = 0;
+      if (!stat_source(filenames[i].c_str(), file_size, file_mtime)) return false;
+      size += file_size;
+      mtime = std::max(mtime, file_mtime);
+    }
+    return true;
+  }
+
+  bool write_padded(FILE* file, const void* data, size_t size, uint64_t& offset)
+  {
+    static const char zeros[SCENE_CACHE_ALIGNMENT] = {0};
+    if (size && fwrite(data, 1, size, file) != size) return false;
+    const uint64_t end = offset + size;
+    offset = align_offset(end);
+    const size_t pad = size_t(offset - end);
+    return pad == 0 || fwrite(zeros, 1, pad, file) == pad;
+  }
+
+  // Packs a strided array of float vectors with 'components' floats each into 'out'.
+  void pack_floats(const float* data, unsigned stride_bytes, size_t count, unsigned components, std::vector<float>& out)
+  {
+    out.resize(components*count);
+    const unsigned stride = stride_bytes ? stride_bytes : components*sizeof(float);
+    const char* src = (const char*)data;
+    for (size_t i = 0; i < count; ++i) {
+      memcpy(&out[components*i], src + i*stride, components*sizeof(float));
+    }
+  }
+
+  bool in_range(uint64_t offset, uint64_t bytes, size_t file_size)
+  {
+    return offset <= file_size && bytes <= file_size - offset && offset % SCENE_CACHE_ALIGNMENT == 0;
+  }
+
+}  // namespace
+
+
+bool save_scene_cache(const char* cache_filename, const char* source_filename, const bake::Scene& scene, const float* scene_bbox_min, const float* scene_bbox_max, size_t num_instances_per_mesh, bool split_obj_groups)
+{
+  CacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic));
+  header.version = SCENE_CACHE_VERSION;
+  if (!stat_source(source_filename, header.source_size, header.source_mtime)) return false;
+  header.num_instances_per_mesh = num_instances_per_mesh;
+  header.split_obj_groups = split_obj_groups ? 1 : 0;
+  header.num_meshes = scene.num_meshes;
+  header.num_instances = scene.num_instances;
+  std::copy(scene_bbox_min, scene_bbox_min+3, header.bbox_min);
+  std::copy(scene_bbox_max, scene_bbox_max+3, header.bbox_max);
+
+  // Lay out all sections up front so the header can be written first.
+  std::vector<CacheMesh> cache_meshes(scene.num_meshes);
+  uint64_t offset = align_offset(sizeof(CacheHeader));
+  header.meshes_offset = offset;
+  offset = align_offset(offset + scene.num_meshes*sizeof(CacheMesh));
+  header.instances_offset = offset;
+  offset = align_offset(offset + scene.num_instances*sizeof(bake::Instance));
+  for (size_t m = 0; m < scene.num_meshes; ++m) {
+    const bake::Mesh& mesh = scene.meshes[m];
+    CacheMesh& cmesh = cache_meshes[m];
+    cmesh.num_vertices = mesh.num_vertices;
+    cmesh.num_triangles = mesh.num_triangles;
+    std::copy(mesh.bbox_min, mesh.bbox_min+3, cmesh.bbox_min);
+    std::copy(mesh.bbox_max, mesh.bbox_max+3, cmesh.bbox_max);
+    cmesh.vertices_offset = offset;
+    offset = align_offset(offset + mesh.num_vertices*3*sizeof(float));
+    cmesh.normals_offset = 0;
+    if (mesh.normals) {
+      cmesh.normals_offset = offset;
+      offset = align_offset(offset + mesh.num_vertices*3*sizeof(float));
+    }
+    cmesh.texcoords_offset = 0;
+    if (mesh.texcoords) {
+      cmesh.texcoords_offset = offset;
+      offset = align_offset(offset + mesh.num_vertices*2*sizeof(float));
+    }
+    cmesh.indices_offset = offset;
+    offset = align_offset(offset + mesh.num_triangles*3*sizeof(unsigned int));
+  }
+
+  // Write to a temporary name so an interrupted run never leaves a truncated
+  // cache that looks valid.
+  const std::string temp_filename = std::string(cache_filename) + ".tmp";
+  FILE* file = fopen(temp_filename.c_str(), "wb");
+  if (!file) return false;
+
+  uint64_t written = 0;
+  bool ok = write_padded(file, &header, sizeof(header), written);
+  ok = ok && write_padded(file, scene.num_meshes ? &cache_meshes[0] : NULL, scene.num_meshes*sizeof(CacheMesh), written);
+  ok = ok && write_padded(file, scene.instances, scene.num_instances*sizeof(bake::Instance), written);
+
+  std::vector<float> packed;
+  for (size_t m = 0; ok && m < scene.num_meshes; ++m) {
+    const bake::Mesh& mesh = scene.meshes[m];
+    pack_floats(mesh.vertices, mesh.vertex_stride_bytes, mesh.num_vertices, 3, packed);
+    ok = ok && write_padded(file, packed.empty() ? NULL : &packed[0], packed.size()*sizeof(float), written);
+    if (mesh.normals) {
+      pack_floats(mesh.normals, mesh.normal_stride_bytes, mesh.num_vertices, 3, packed);
+      ok = ok && write_padded(file, packed.empty() ? NULL : &packed[0], packed.size()*sizeof(float), written);
+    }
+    if (mesh.texcoords) {
+      pack_floats(mesh.texcoords, mesh.texcoord_stride_bytes, mesh.num_vertices, 2, packed);
+      ok = ok && write_padded(file, packed.empty() ? NULL : &packed[0], packed.size()*sizeof(float), written);
+    }
+    ok = ok && write_padded(file, mesh.tri_vertex_indices, mesh.num_triangles*3*sizeof(unsigned int), written);
+  }
+  ok = fclose(file) == 0 && ok && written == offset;
+
+  if (ok) {
+    remove(cache_filename);
+    ok = rename(temp_filename.c_str(), cache_filename) == 0;
+  }
+  if (!ok) remove(temp_filename.c_str());
+  return ok;
+}
+
+
+// shared: map the snapshot read-only so all processes use the same pages.
+static bool load_cache(const char* cache_filename, const char* source_filename, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& base_memory, size_t num_instances_per_mesh, bool split_obj_groups, bool shared)
+{
+  uint64_t source_size = 0;
+  int64_t  source_mtime = 0;
+  if (!stat_source(source_filename, source_size, source_mtime)) return false;
+
+  CacheSceneMemory* memory = new CacheSceneMemory;
+  MappedFile& mapping = memory->mapping;
+  if (!mapping.open(cache_filename, shared) || mapping.size() < sizeof(CacheHeader)) {
+    delete memory;
+    return false;
+  }
+
+  const CacheHeader& header = *(const CacheHeader*)mapping.data();
+  const size_t file_size = mapping.size();
+  if (memcmp(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != SCENE_CACHE_VERSION ||
+      header.source_size != source_size ||
+      header.source_mtime != source_mtime ||
+      header.num_instances_per_mesh != num_instances_per_mesh ||
+      header.split_obj_groups != (split_obj_groups ? 1u : 0u) ||
+      header.num_meshes == 0 || header.num_instances == 0 ||
+      header.num_meshes > file_size / sizeof(CacheMesh) ||
+      header.num_instances > file_size / sizeof(bake::Instance) ||
+      !in_range(header.meshes_offset, header.num_meshes*sizeof(CacheMesh), file_size) ||
+      !in_range(header.instances_offset, header.num_instances*sizeof(bake::Instance), file_size)) {
+    delete memory;
+    return false;
+  }
+
+  const CacheMesh* cache_meshes = (const CacheMesh*)(mapping.data() + header.meshes_offset);
+  memory->meshes.resize(header.num_meshes);
+  for (size_t m = 0; m < header.num_meshes; ++m) {
+    const CacheMesh& cmesh = cache_meshes[m];
+    const uint64_t vertex_bytes = cmesh.num_vertices*3*sizeof(float);
+    const uint64_t index_bytes = cmesh.num_triangles*3*sizeof(unsigned int);
+    if (cmesh.num_vertices > file_size || cmesh.num_triangles > file_size ||
+        !in_range(cmesh.vertices_offset, vertex_bytes, file_size) ||
+        (cmesh.normals_offset && !in_range(cmesh.normals_offset, vertex_bytes, file_size)) ||
+        (cmesh.texcoords_offset && !in_range(cmesh.texcoords_offset, cmesh.num_vertices*2*sizeof(float), file_size)) ||
+        !in_range(cmesh.indices_offset, index_bytes, file_size)) {
+      delete memory;
+      return false;
+    }
+
+    bake::Mesh& mesh = memory->meshes[m];
+    mesh.num_vertices = cmesh.num_vertices;
+    mesh.vertices = (float*)(mapping.data() + cmesh.vertices_offset);
+    mesh.vertex_stride_bytes = 0;
+    mesh.normals = cmesh.normals_offset ? (float*)(mapping.data() + cmesh.normals_offset) : NULL;
+    mesh.normal_stride_bytes = 0;
+    mesh.texcoords = cmesh.texcoords_offset ? (float*)(mapping.data() + cmesh.texcoords_offset) : NULL;
+    mesh.texcoord_stride_bytes = 0;
+    mesh.geometry_memory = bake::MEMORY_SPACE_HOST;
+    mesh.num_triangles = cmesh.num_triangles;
+    mesh.tri_vertex_indices = (unsigned int*)(mapping.data() + cmesh.indices_offset);
+    std::copy(cmesh.bbox_min, cmesh.bbox_min+3, mesh.bbox_min);
+    std::copy(cmesh.bbox_max, cmesh.bbox_max+3, mesh.bbox_max);
+  }
+
+  const bake::Instance* instances = (const bake::Instance*)(mapping.data() + header.instances_offset);
+  memory->instances.assign(instances, instances + header.num_instances);
+  for (size_t i = 0; i < memory->instances.size(); ++i) {
+    if (memory->instances[i].mesh_index >= header.num_meshes) {
+      delete memory;
+      return false;
+    }
+  }
+
+  std::copy(header.bbox_min, header.bbox_min+3, scene_bbox_min);
+  std::copy(header.bbox_max, header.bbox_max+3, scene_bbox_max);
+
+  scene.meshes = &memory->meshes[0];
+  scene.num_meshes = memory->meshes.size();
+  scene.instances = &memory->instances[0];
+  scene.num_instances = memory->instances.size();
+  base_memory = memory;
+  return true;
+}
+
+namespace {
+
+#ifdef SCENE_CACHE_LOCK_POSIX
+
+  // Exclusive advisory lock on '<filename>.lock'. The kernel drops it if the
+  // holder dies, so a crashed publisher never blocks the other processes.
+  class SharedSceneLock
+  {
+  public:
+    explicit SharedSceneLock(const char* filename) : m_fd(-1)
+    {
+      const std::string lock_filename = std::string(filename) + ".lock";
+      m_fd = ::open(lock_filename.c_str(), O_RDWR | O_CREAT, 0666);
+      if (m_fd >= 0 && flock(m_fd, LOCK_EX) != 0) {
+        ::close(m_fd);
+        m_fd = -1;
+      }
+    }
+    ~SharedSceneLock()
+    {
+      if (m_fd >= 0) {
+        flock(m_fd, LOCK_UN);
+        ::close(m_fd);
+      }
+    }
+    bool locked() const { return m_fd >= 0; }
+
+  private:
+    SharedSceneLock(const SharedSceneLock&);
+    SharedSceneLock& operator=(const SharedSceneLock&);
+    int m_fd;
+  };
+
+#else
+
+  // Without a lock two processes may both publish; the rename in
+  // save_scene_cache keeps the snapshot whole either way.
+  class SharedSceneLock
+  {
+  public:
+    explicit SharedSceneLock(const char*) {}
+    bool locked() const { return true; }
+  };
+
+#endif
+
+}  // namespace
+
+
+bool load_scene_cache(const char* cache_filename, const char* source_filename, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh, bool split_obj_groups)
+{
+  return load_cache(cache_filename, source_filename, scene, scene_bbox_min, scene_bbox_max, memory, num_instances_per_mesh, split_obj_groups, false);
+}
+
+
+bool load_shared_scene(const char* shared_filename, const char* source_filename, bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max, SceneMemory*& memory, size_t num_instances_per_mesh, bool split_obj_groups, bool* published)
+{
+  if (published) *published = false;
+  SharedSceneLock lock(shared_filename);
+  if (!lock.locked()) return false;
+
+  // Whoever held the lock before us has published an up to date snapshot,
+  // unless the scene file changed or the publisher failed.
+  if (load_cache(shared_filename, source_filename, scene, scene_bbox_min, scene_bbox_max, memory, num_instances_per_mesh, split_obj_groups, true)) {
+    return true;
+  }
+
+  SceneMemory* loader_memory = NULL;
+  bake::Scene loaded;
+  float bbox_min[3], bbox_max[3];
+  if (!load_scene(source_filename, loaded, bbox_min, bbox_max, loader_memory, num_instances_per_mesh, split_obj_groups)) {
+    return false;
+  }
+  const bool saved = save_scene_cache(shared_filename, source_filename, loaded, bbox_min, bbox_max, num_instances_per_mesh, split_obj_groups);
+  delete loader_memory;
+
+  // The publisher drops its private copy and attaches like everyone else.
+  if (!saved || !load_cache(shared_filename, source_filename, scene, scene_bbox_min, scene_bbox_max, memory, num_instances_per_mesh, split_obj_groups, true)) {
+    return false;
+  }
+  if (published) *published = true;
+  return true;
+}
@@ -22,20 +22,30 @@
 -----------------------------------------------------------------------*/
 
 #include "bake_api.h"
+#include "bake_ao_file.h"
 #include "bake_view.h"
 #include "bake_util.h"
 #include "loaders/load_scene.h"
 
+#ifndef BAKE_HEADLESS
 #include <main.h>
+#endif
 #include <optixu/optixu_matrix_namespace.h>
 
 #include <algorithm>
 #include <cassert>
+#include <cfloat>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <string>
 #include <set>
+#include <sstream>
+#include <vector>
 #include <sys/stat.h>
 
 const size_t NUM_RAYS = 64;
@@ -44,7 +54,20 @@ const float  GROUND_SCALE = 100.0f;
 const float  GROUND_OFFSET = 0.03f;
 const float  SCENE_OFFSET_SCALE = 0.01f;
 const float  SCENE_MAXDISTANCE_SCALE = 1.1f;
+const size_t AUTO_DISTANCE_SAMPLES = 1 << 16;     // samples of the --auto_hit_distance pre-pass
+const int    AUTO_DISTANCE_RAYS = 16;
+const int    AUTO_DISTANCE_STEPS = 12;            // hit distances tried, halving down from the default
 const float  REGULARIZATION_WEIGHT = 0.1f;
+const float  CG_TOLERANCE = 1e-5f;                // relative residual of the conjugate gradient filters, as the library's default
+const unsigned LIGHTMAP_DILATION = 4;
+const size_t LIGHTMAP_TEXELS_PER_PART = 1 << 22;
+const size_t MERGE_OCCLUDER_TRIANGLES = 256;      // meshes below this size, with one instance, are merged for tracing
+const size_t MERGED_OCCLUDER_TRIANGLES = 1 << 16; // size of each merged occluder mesh
+const size_t QUALITY_MERGE_OCCLUDER_TRIANGLES = 4096; // merge threshold of the quality accel preset
+const size_t PROXY_OCCLUDER_TRIANGLES = 1 << 16;  // meshes from this size are traced as simplified proxies, if enabled
+const size_t RESULT_CACHE_MB = 8192;
+const size_t SPILL_BLOCK_SAMPLES = 1 << 20;      // samples per block of a --spill_dir file, unless --batch_size is given
+const uint64_t RESULT_CACHE_VERSION = 1;          // bump when the output of unchanged settings changes
 const char* DEFAULT_BK3DGZ_FILE = "sled_v134.bk3d.gz";
 const char* DEFAULT_BK3D_FILE = "lucy_v134.bk3d";
 #ifdef PROJECT_ABSDIRECTORY
@@ -57,13 +80,27 @@ const char* DEFAULT_BK3D_FILE = "lucy_v134.bk3d";
 // For parsing command line into constants
 struct Config {
   std::string scene_filename;
+  std::vector<std::string> scene_filenames;  // every -f in order, the first being scene_filename
   size_t num_instances_per_mesh;
-  int num_samples;
-  int min_samples_per_face;
+  size_t num_samples;
+  float min_samples_per_face;  // may be fractional, spread over neighboring triangles
   int num_rays;
+  std::vector<uint64_t> instance_ray_ranges;  // first and last storage identifier of each --instance_rays line
+  std::vector<int> instance_ray_counts;       // rays of each line; later lines win
+  float large_instance_scale;  // instances with a bbox diagonal of at least this times the scene extent trace large_instance_rays
+  int   large_instance_rays;   // 0 for none
   bake::VertexFilterMode filter_mode;
   float regularization_weight;
+  std::vector<float> regularization_weights;  // a sweep of weights filtered at once, the first being regularization_weight; empty for one
+  float analytic_mass_weight;
+  bake::LeastSquaresSolver ls_solver;
+  bake::LeastSquaresOrdering ls_ordering;
+  size_t ls_patch_vertices;  // least squares filters larger meshes by overlapping patches of about this many vertices; 0 never
+  float cg_tolerance;        // residual at which the conjugate gradient filters stop, relative to the right hand side
+  bake::CGPreconditioner cg_preconditioner;  // of --cpu_cg_least_squares
+  float weld_tolerance;      // filters see seam copies of a vertex within this fraction of the mesh diagonal as one; negative never
   bool use_ground_plane_blocker;
+  bool analytic_ground_plane;
   bool use_viewer;
   int  ground_upaxis;
   float ground_scale_factor;
@@ -74,8 +111,99 @@ struct Config {
   float scene_offset;
   bool  use_cpu;
   bool  conserve_memory;
+  size_t batch_size;
+  int   passes_per_query;
+  size_t queries_in_flight;
+  float  latency_budget;     // milliseconds of device time per submission; 0 leaves the device to the bake
+  bool   peer_geometry;      // occluder geometry stored once over the devices instead of on each
+  size_t mesh_library_bytes; // device geometry of mesh accels kept for later contexts, e.g. of batch jobs, per device
+  bool   managed_geometry;   // occluder geometry in unified memory, which may exceed device memory
+  float  far_field;          // fraction of the hit distance traced, the rest cone-marched through a volume; 0 traces it all
+  int    far_field_resolution;
+  float adaptive_tolerance;
+  double time_budget;        // seconds for a progressive trace; 0 traces all rays
+  double snapshot_interval;  // seconds between saves of a progressive trace's estimate; 0 saves the result only
+  bool   live_view;          // show the estimate of a progressive trace in the viewer as it refines
+  double progress_interval;  // seconds between progress lines of the trace and the filters; 0 prints none
+  bool   tune_kernels;       // time a few block sizes for ray generation at its first launch on each device
+  int    num_threads;        // host stage threads; 0 uses every core not kept for device submission
+  int    submit_cores;       // cores kept free of host stage threads for the threads feeding the devices
+  bool   pin_threads;        // pin host stage threads to the other cores, and the trace to the kept ones
+  float denoise_scale;       // sample AO denoiser radius in mean sample spacings; 0 disables it
+  float ao_cache_scale;      // cell size of the sparse AO cache in hit distances; 0 traces every sample
+  float ao_cache_error;      // AO error up to which a cell of the cache is interpolated
+  std::vector<int> devices;
+  std::vector<float> hit_distances;  // ascending, for multi radius AO; empty for one hit distance
+  bool  gpu_sampling;
+  bool  vertex_samples;  // trace one sample per vertex and take its AO as is, without the filters
+  int   variance_rays;   // rays per sample of the pilot trace that weighs extra samples by AO variance; 0 weighs by area
+  float auto_hit_distance;  // fraction of the occlusion the hit distance picked by a pre-pass keeps; 0 for the fixed distance
+  bool  sample_templates;  // similarity instances of a mesh with equal sample counts share one mesh space sample pattern
+  bool  compact_samples;
+  bool  share_mesh_ao;
+  bool  sort_samples;
+  bool  reconstruct_samples;  // upload host samples as instance, triangle and barycentrics, rebuilt on the device
+  float tile_scale;  // tile edge in hit distances; 0 means no tiles
+  bool  pinned_memory;
+  size_t merge_occluder_triangles;
+  float proxy_ratio;  // fraction of the triangles kept by proxy occluders; 0 traces the full meshes
+  std::string proxy_cache_dir;
+  std::string part_cache_dir;  // self-occlusion AO of isolated parts by mesh content, reused across bakes
+  std::string result_cache_dir;  // whole output files by scene content and settings, reused across bakes
+  size_t result_cache_bytes;     // least recently used results are removed beyond this; 0 means no limit
+  bake::AccelPreset accel_preset;
+  bake::AOBackend backend;
   bool  flip_orientation;
+  bool  two_sided;
+  bool  bent_normals;  // bake bent normals with the AO, saved next to the output file
+  bool  sh_visibility; // bake L1 SH visibility with the AO, likewise
   std::string output_filename;
+  std::string bk3d_output_filename;  // copy of the bk3d scene file with the AO as a vertex attribute
+  std::string view_filename;  // show this saved vertex AO file instead of baking
+  std::string scene_cache_filename;
+  std::string shared_scene_filename;  // snapshot mapped read-only by all bake processes on a node
+  std::string context_filename;       // geometry that only occludes: no samples, filtering or output
+  std::vector<std::string> lod_filenames;  // LODs of the scene that get AO transferred from its samples, untraced
+  float lod_radius_scale;             // transfer lookup radius in mean sample spacings
+  bool  use_roi_bbox;                 // bake only instances touching this box, and those of roi_ids_filename
+  float roi_bbox_min[3];
+  float roi_bbox_max[3];
+  std::string roi_ids_filename;       // storage identifiers of instances to bake
+  bool  roi_cull;                     // trace only the other instances within reach of those baked
+  std::string filter_cache_dir;
+  std::string checkpoint_dir;
+  std::string save_samples_filename;  // traced samples and AO, written after the trace
+  std::string load_samples_filename;  // ... read instead of tracing, so only the filters run
+  bool  split_obj_groups;
+  size_t instance_chunk;
+  bool  pipeline_chunks;
+  std::string spill_dir;              // scratch directory the samples and AO of chunked bakes go to, traced in one pass
+  int   move_instance;
+  float move_offset[3];
+  std::vector<std::string> occluder_variant_suffixes;  // extra outputs baked with some occluders hidden, by suffix
+  std::vector< std::vector<int> > occluder_variant_hidden;  // ... the hidden scene instances of each, -1 for the ground plane
+  std::string frames_filename;        // list of scenes, the frames of an animation of the -f scene, baked after it
+  float frame_rigid_tolerance;        // relative edge change up to which a frame reuses the least squares regularizer
+  unsigned output_bits;
+  bool  compress_output;
+  bool  mapped_output;
+  bool  output_index;
+  std::string patch_base_filename;  // if set, save a patch against this raw file instead of the full output
+  std::string warm_start_filename;  // if set, the iterative least squares filters start from the vertex AO in this file
+  bool  reorder_meshes;        // bake copies of the meshes in vertex cache order, saving AO in the loaded vertex order
+  bool  clean_meshes;          // bake without degenerate and duplicate triangles
+  const unsigned* const* loaded_vertex_order;  // set by the bake: per mesh, the loaded vertex of each vertex; NULL if unchanged
+  unsigned lightmap_size;
+  std::string lightmap_prefix;
+  std::string batch_filename;
+  size_t pack_jobs;        // batch jobs traced together, at most; 1 bakes each on its own
+  std::string stats_filename;
+  std::string profile_meshes_filename;  // CSV of per mesh costs
+  size_t host_memory_budget;    // bytes; 0 means no budget
+  size_t device_memory_budget;  // bytes per device; 0 means no budget
+  bool  dry_run;
+  size_t partition_rank;   // this process bakes partition rank of partition_count
+  size_t partition_count;  // 1 means no partitioning
 
   Config( int argc, const char ** argv ) {
     // set defaults
@@ -92,15 +220,93 @@ struct Config {
     scene_maxdistance = 0;
     use_cpu = false;
     conserve_memory = false;
+    batch_size = 0;  // default means determine from free device memory
+    passes_per_query = 0;  // default means let the raytracer decide
+    queries_in_flight = 0;  // default means the raytracer default
+    latency_budget = 0.0f;
+    peer_geometry = false;
+    mesh_library_bytes = 0;
+    managed_geometry = false;
+    far_field = 0.0f;
+    far_field_resolution = 128;
+    adaptive_tolerance = 0.0f;  // default means trace all rays for every sample
+    time_budget = 0.0;
+    snapshot_interval = 0.0;
+    live_view = false;
+    progress_interval = 0.0;
+    tune_kernels = false;
+    num_threads = 0;
+    submit_cores = 0;
+    pin_threads = false;
+    denoise_scale = 0.0f;
+    ao_cache_scale = 0.0f;
+    ao_cache_error = 0.03f;
+    lod_radius_scale = 2.0f;
+    gpu_sampling = false;
+    vertex_samples = false;
+    variance_rays = 0;
+    large_instance_scale = 0.0f;
+    large_instance_rays = 0;
+    auto_hit_distance = 0.0f;
+    sample_templates = false;
+    compact_samples = false;
+    share_mesh_ao = false;
+    sort_samples = false;
+    reconstruct_samples = false;
+    tile_scale = 0.0f;
+    pinned_memory = false;
+    merge_occluder_triangles = MERGE_OCCLUDER_TRIANGLES;
+    proxy_ratio = 0.0f;
+    accel_preset = bake::ACCEL_PRESET_BALANCED;
+    backend = bake::AO_BACKEND_AUTO;
+    bool merge_occluders_set = false;
     flip_orientation = false;
+    two_sided = false;
+    bent_normals = false;
+    sh_visibility = false;
+    split_obj_groups = false;
+    instance_chunk = 0;  // default means bake all instances at once
+    pipeline_chunks = true;
+    move_instance = -1;  // default means no incremental rebake
+    use_roi_bbox = false;
+    roi_cull = false;
+    move_offset[0] = move_offset[1] = move_offset[2] = 0.0f;
+    frame_rigid_tolerance = 0.01f;
+    output_bits = 32;  // with no compression, the raw float output format
+    compress_output = false;
+    mapped_output = false;
+    reorder_meshes = false;
+    clean_meshes = false;
+    loaded_vertex_order = NULL;
+    output_index = false;
+    lightmap_size = 0;  // default means no lightmaps
+    host_memory_budget = 0;
+    result_cache_bytes = RESULT_CACHE_MB << 20;
+    device_memory_budget = 0;
+    dry_run = false;
+    partition_rank = 0;
+    partition_count = 1;
+    pack_jobs = 1;
 #ifdef EIGEN3_ENABLED
     filter_mode = bake::VERTEX_FILTER_LEAST_SQUARES;
 #else
     filter_mode = bake::VERTEX_FILTER_AREA_BASED;
 #endif
     regularization_weight = REGULARIZATION_WEIGHT;
+    analytic_mass_weight = 0.0f;
+    ls_solver = bake::LEAST_SQUARES_SOLVER_SIMPLICIAL;
+    ls_ordering = bake::LEAST_SQUARES_ORDERING_AMD;
+    ls_patch_vertices = 0;
+    cg_tolerance = CG_TOLERANCE;
+    cg_preconditioner = bake::CG_PRECONDITIONER_JACOBI;
+    weld_tolerance = -1.0f;
     use_ground_plane_blocker = true;
+    analytic_ground_plane = false;
+#ifdef BAKE_HEADLESS
+    use_viewer = false;
+#else
     use_viewer = true;
+#endif
 
 
     // parse arguments
@@ -115,14 +321,150 @@ struct Config {
       } 
       else if( (arg == "-f" || arg == "--file") && i+1 < argc ) 
       {
-        assert( scene_filename.empty() && "multiple -f (--file) flags found when parsing command line");
-        scene_filename = argv[++i];
+        scene_filenames.push_back( argv[++i] );
+        if ( scene_filename.empty() ) scene_filename = scene_filenames.back();
       } 
       else if ((arg == "-o" || arg == "--outfile") && i + 1 < argc)
       {
         assert(output_filename.empty() && "multiple -o (--outfile) flags found when parsing command line");
         output_filename = argv[++i];
       }
+      else if ((arg == "--bk3d_outfile") && i + 1 < argc) {
+        bk3d_output_filename = argv[++i];
+      }
+      else if ( (arg == "--stats") && i+1 < argc ) {
+        stats_filename = argv[++i];
+      }
+      else if ( (arg == "--profile_meshes") && i+1 < argc ) {
+        profile_meshes_filename = argv[++i];
+      }
+      else if ( (arg == "--mem_budget") && i+1 < argc ) {
+        // Host megabytes, optionally followed by megabytes per device: <host>[,<device>]
+        unsigned long long host_mb = 0, device_mb = 0;
+        const int n = sscanf( argv[++i], "%llu,%llu", &host_mb, &device_mb );
+        if ( n < 1 || host_mb == 0 || (n == 2 && device_mb == 0) ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+        host_memory_budget = size_t( host_mb ) << 20;
+        device_memory_budget = size_t( device_mb ) << 20;
+      }
+      else if ( (arg == "--dry_run") ) {
+        dry_run = true;
+      }
+      else if ( (arg == "--partition") && i+1 < argc ) {
+        // <rank>,<count>, or the rank and size an MPI or Slurm launcher gives the process
+        unsigned long long rank = 0, count = 0;
+        const std::string value( argv[++i] );
+        const bool parsed = value == "mpi" ? launcherRankAndSize( rank, count ) : sscanf( argv[i], "%llu,%llu", &rank, &count ) == 2;
+        if ( !parsed || count == 0 || rank >= count ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+        partition_rank = size_t( rank );
+        partition_count = size_t( count );
+      }
+      else if ( (arg == "--checkpoint") && i+1 < argc ) {
+        checkpoint_dir = argv[++i];
+      }
+      else if ( (arg == "--save_samples") && i+1 < argc ) {
+        save_samples_filename = argv[++i];
+      }
+      else if ( (arg == "--load_samples") && i+1 < argc ) {
+        load_samples_filename = argv[++i];
+      }
+      else if ( (arg == "--batch") && i+1 < argc ) {
+        batch_filename = argv[++i];
+      }
+      else if ( (arg == "--pack") && i+1 < argc ) {
+        int n = 0;
+        if( (sscanf( argv[++i], "%d", &n ) != 1) || n < 1 ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+        pack_jobs = size_t(n);
+      }
+      else if ( (arg == "--lightmap") && i+2 < argc ) {
+        if( (sscanf( argv[++i], "%u", &lightmap_size ) != 1) || lightmap_size < 1 || lightmap_size > 16384 ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+        lightmap_prefix = argv[++i];
+      }
+      else if ( (arg == "--output_bits") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%u", &output_bits ) != 1) || (output_bits != 8 && output_bits != 16 && output_bits != 32) ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+#ifndef NOGZLIB
+      else if ((arg == "--compress_output")) {
+        compress_output = true;
+      }
+#endif
+      else if ((arg == "--mapped_output")) {
+        mapped_output = true;
+      }
+      else if ((arg == "--output_index")) {
+        output_index = true;
+      }
+      else if ((arg == "--output_patch") && i + 1 < argc) {
+        patch_base_filename = argv[++i];
+      }
+      else if ((arg == "--warm_start") && i + 1 < argc) {
+        warm_start_filename = argv[++i];
+      }
+      else if ((arg == "--scene_cache") && i + 1 < argc)
+      {
+        scene_cache_filename = argv[++i];
+      }
+      else if ((arg == "--view_only") && i + 1 < argc)
+      {
+        view_filename = argv[++i];
+      }
+      else if ((arg == "--shared_scene") && i + 1 < argc)
+      {
+        shared_scene_filename = argv[++i];
+      }
+      else if ((arg == "--context_scene") && i + 1 < argc)
+      {
+        context_filename = argv[++i];
+      }
+      else if ((arg == "--lod") && i + 1 < argc) {
+        lod_filenames.push_back( argv[++i] );
+      }
+      else if ((arg == "--lod_radius") && i + 1 < argc) {
+        if ( sscanf( argv[++i], "%f", &lod_radius_scale ) != 1 || !(lod_radius_scale > 0.0f) ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--reorder_meshes" ) ) {
+        reorder_meshes = true;
+      }
+      else if ( (arg == "--clean_meshes" ) ) {
+        clean_meshes = true;
+      }
+      else if ( (arg == "--weld" ) ) {
+        weld_tolerance = std::max( weld_tolerance, 0.0f );
+      }
+      else if ( (arg == "--weld_tolerance") && i + 1 < argc ) {
+        if ( sscanf( argv[++i], "%f", &weld_tolerance ) != 1 || !(weld_tolerance >= 0.0f) ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--roi_bbox") && i+1 < argc ) {
+        float* b[6] = { &roi_bbox_min[0], &roi_bbox_min[1], &roi_bbox_min[2], &roi_bbox_max[0], &roi_bbox_max[1], &roi_bbox_max[2] };
+        if ( sscanf( argv[++i], "%f,%f,%f,%f,%f,%f", b[0], b[1], b[2], b[3], b[4], b[5] ) != 6 ||
+             roi_bbox_min[0] > roi_bbox_max[0] || roi_bbox_min[1] > roi_bbox_max[1] || roi_bbox_min[2] > roi_bbox_max[2] ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+        use_roi_bbox = true;
+      }
+      else if ( (arg == "--roi_ids") && i+1 < argc ) {
+        roi_ids_filename = argv[++i];
+      }
+      else if ( (arg == "--roi_cull") ) {
+        roi_cull = true;
+      }
+      else if ((arg == "--filter_cache") && i + 1 < argc)
+      {
+        filter_cache_dir = argv[++i];
+      }
       else if ( (arg == "-i" || arg == "--instances") && i+1 < argc )
       {
         int n = -1;
@@ -133,13 +475,16 @@ struct Config {
       }
       else if ( (arg == "-s" || arg == "--samples") && i+1 < argc )
       {
-        if( sscanf( argv[++i], "%d", &num_samples ) != 1 ) {
+        // 64 bit, for dense scans beyond 2^31 samples
+        long long n = -1;
+        if( (sscanf( argv[++i], "%lld", &n ) != 1) || n < 0 ) {
           printParseErrorAndExit( argv[0], arg, argv[i] );
         }
+        num_samples = static_cast<size_t>(n);
       }
       else if ( (arg == "-t" || arg == "--samples_per_face") && i+1 < argc )
       {
-        if (sscanf( argv[++i], "%d", &min_samples_per_face ) != 1 ) {
+        if (sscanf( argv[++i], "%f", &min_samples_per_face ) != 1 || !(min_samples_per_face >= 0.0f) ) {
           printParseErrorAndExit( argv[0], arg, argv[i] );
         }
 
@@ -168,12 +513,49 @@ struct Config {
           printParseErrorAndExit(argv[0], arg, argv[i]);
         }
       }
+      else if ((arg == "--auto_hit_distance") && i + 1 < argc)
+      {
+        if (sscanf(argv[++i], "%f", &auto_hit_distance) != 1 || auto_hit_distance <= 0.0f || auto_hit_distance > 1.0f) {
+          printParseErrorAndExit(argv[0], arg, argv[i]);
+        }
+      }
+      else if ((arg == "--hit_distances") && i + 1 < argc)
+      {
+        // Comma separated list of hit distances, traced at once
+        std::string list( argv[++i] );
+        size_t pos = 0;
+        while ( pos <= list.size() ) {
+          const size_t end = std::min( list.find( ',', pos ), list.size() );
+          float distance = 0.0f;
+          if ( sscanf( list.substr( pos, end - pos ).c_str(), "%f", &distance ) != 1 || distance <= 0.0f || 
+               hit_distances.size() == bake::MAX_AO_RADII ) {
+            printParseErrorAndExit( argv[0], arg, argv[i] );
+          }
+          hit_distances.push_back( distance );
+          pos = end + 1;
+        }
+        std::sort( hit_distances.begin(), hit_distances.end() );
+        scene_maxdistance = hit_distances.back();
+      }
       else if ( (arg == "-r" || arg == "--rays") && i+1 < argc )
       {
         if( sscanf( argv[++i], "%d", &num_rays ) != 1 ) {
           printParseErrorAndExit( argv[0], arg, argv[i] );
         }
       }
+      else if ( (arg == "--instance_rays") && i+1 < argc ) {
+        if ( !readInstanceRays( argv[++i] ) ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--large_instance_rays") && i+2 < argc ) {
+        if ( sscanf( argv[++i], "%f", &large_instance_scale ) != 1 || large_instance_scale <= 0.0f ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+        if ( sscanf( argv[++i], "%d", &large_instance_rays ) != 1 || large_instance_rays < 1 ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
       else if ((arg == "-g" || arg == "--ground_setup") && i + 3 < argc)
       {
         if (sscanf(argv[++i], "%d", &ground_upaxis) != 1 || (ground_upaxis < 0 || ground_upaxis > 5)) {
@@ -189,9 +571,24 @@ struct Config {
       else if ((arg == "--flip_orientation")) {
         flip_orientation = true;
       }
+      else if ((arg == "--two_sided")) {
+        two_sided = true;
+      }
+      else if ((arg == "--bent_normals")) {
+        bent_normals = true;
+      }
+      else if ((arg == "--sh_visibility")) {
+        sh_visibility = true;
+      }
+      else if ((arg == "--obj_groups")) {
+        split_obj_groups = true;
+      }
       else if ( (arg == "--no_ground_plane" ) ) {
         use_ground_plane_blocker = false;
       }
+      else if ( (arg == "--analytic_ground_plane" ) ) {
+        analytic_ground_plane = true;
+      }
       else if ((arg == "--no_viewer")) {
         use_viewer = false;
       }
@@ -201,14 +598,360 @@ struct Config {
       else if ((arg == "--conserve_memory")) {
         conserve_memory = true;
       }
+      else if ( (arg == "--batch_size") && i+1 < argc ) {
+        int n = -1;
+        if( (sscanf( argv[++i], "%d", &n ) != 1) || n < 1 ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+        batch_size = static_cast<size_t>(n);
+      }
+      else if ( (arg == "--instance_chunk") && i+1 < argc ) {
+        int n = -1;
+        if( (sscanf( argv[++i], "%d", &n ) != 1) || n < 1 ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+        instance_chunk = static_cast<size_t>(n);
+      }
+      else if ( (arg == "--move_instance") && i+4 < argc ) {
+        if( (sscanf( argv[++i], "%d", &move_instance ) != 1) || move_instance < 0 ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+        for (int k = 0; k < 3; ++k) {
+          if( sscanf( argv[++i], "%f", &move_offset[k] ) != 1 ) {
+            printParseErrorAndExit( argv[0], arg, argv[i] );
+          }
+        }
+      }
+      else if ( (arg == "--occluder_variant") && i+2 < argc ) {
+        // Comma separated list of scene instance indices, or ground for the ground plane
+        occluder_variant_suffixes.push_back( argv[++i] );
+        std::string list( argv[++i] );
+        std::vector<int> hidden;
+        size_t pos = 0;
+        while ( pos <= list.size() ) {
+          const size_t end = std::min( list.find( ',', pos ), list.size() );
+          const std::string item = list.substr( pos, end - pos );
+          int index = -1;
+          if ( item != "ground" && ( sscanf( item.c_str(), "%d", &index ) != 1 || index < 0 ) ) {
+            printParseErrorAndExit( argv[0], arg, argv[i] );
+          }
+          hidden.push_back( index );
+          pos = end + 1;
+        }
+        if ( occluder_variant_suffixes.back().empty() ) printParseErrorAndExit( argv[0], arg, argv[i-1] );
+        occluder_variant_hidden.push_back( hidden );
+      }
+      else if ( (arg == "--frames") && i+1 < argc ) {
+        frames_filename = argv[++i];
+      }
+      else if ( (arg == "--frame_rigid_tolerance") && i+1 < argc ) {
+        if ( sscanf( argv[++i], "%f", &frame_rigid_tolerance ) != 1 || frame_rigid_tolerance < 0.0f ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--passes_per_query") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%d", &passes_per_query ) != 1) || passes_per_query < 1 ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--queries_in_flight") && i+1 < argc ) {
+        int n = 0;
+        if( (sscanf( argv[++i], "%d", &n ) != 1) || n < 1 || size_t(n) > bake::MAX_QUERIES_IN_FLIGHT ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+        queries_in_flight = size_t(n);
+      }
+      else if ( (arg == "--latency_budget") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%f", &latency_budget ) != 1) || !(latency_budget > 0.0f) ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--peer_geometry") ) {
+        peer_geometry = true;
+      }
+      else if ( (arg == "--mesh_library_mb") && i+1 < argc ) {
+        unsigned long long mb = 0;
+        if ( sscanf( argv[++i], "%llu", &mb ) != 1 || mb == 0 ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+        mesh_library_bytes = size_t( mb ) << 20;
+      }
+      else if ( (arg == "--managed_geometry") ) {
+        managed_geometry = true;
+      }
+      else if ( (arg == "--far_field") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%f", &far_field ) != 1) || !(far_field > 0.0f && far_field < 1.0f) ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--far_field_resolution") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%d", &far_field_resolution ) != 1) || far_field_resolution < 16 || far_field_resolution > 1024 ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--denoise") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%f", &denoise_scale ) != 1) || !(denoise_scale > 0.0f) ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--ao_cache") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%f", &ao_cache_scale ) != 1) || !(ao_cache_scale > 0.0f) ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--ao_cache_error") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%f", &ao_cache_error ) != 1) || !(ao_cache_error > 0.0f) ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ((arg == "--gpu_sampling")) {
+        gpu_sampling = true;
+      }
+      else if ((arg == "--vertex_samples")) {
+        vertex_samples = true;
+      }
+      else if ( (arg == "--variance_sampling") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%d", &variance_rays ) != 1) || variance_rays < 1 ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ((arg == "--sample_templates")) {
+        sample_templates = true;
+      }
+      else if ((arg == "--compact_samples")) {
+        compact_samples = true;
+      }
+      else if ((arg == "--share_mesh_ao")) {
+        share_mesh_ao = true;
+      }
+      else if ((arg == "--sort_samples")) {
+        sort_samples = true;
+      }
+      else if ((arg == "--reconstruct_samples")) {
+        reconstruct_samples = true;
+      }
+      else if ( (arg == "--tiled") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%f", &tile_scale ) != 1) || !(tile_scale > 0.0f) ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ((arg == "--no_pipeline")) {
+        pipeline_chunks = false;
+      }
+      else if ( (arg == "--spill_dir") && i+1 < argc ) {
+        spill_dir = argv[++i];
+      }
+      else if ((arg == "--pinned_memory")) {
+        pinned_memory = true;
+      }
+      else if ( (arg == "--merge_occluders") && i+1 < argc ) {
+        int n = -1;
+        if( (sscanf( argv[++i], "%d", &n ) != 1) || n < 0 ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+        merge_occluder_triangles = static_cast<size_t>(n);
+        merge_occluders_set = true;
+      }
+      else if ( (arg == "--proxy_occluders") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%f", &proxy_ratio ) != 1) || !(proxy_ratio > 0.0f && proxy_ratio < 1.0f) ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ((arg == "--proxy_cache") && i + 1 < argc)
+      {
+        proxy_cache_dir = argv[++i];
+      }
+      else if ((arg == "--part_cache") && i + 1 < argc)
+      {
+        part_cache_dir = argv[++i];
+      }
+      else if ((arg == "--result_cache") && i + 1 < argc)
+      {
+        result_cache_dir = argv[++i];
+      }
+      else if ( (arg == "--result_cache_mb") && i+1 < argc ) {
+        unsigned long long mb = 0;
+        if ( sscanf( argv[++i], "%llu", &mb ) != 1 ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+        result_cache_bytes = size_t( mb ) << 20;
+      }
+      else if ( (arg == "--accel_preset") && i+1 < argc ) {
+        const std::string preset( argv[++i] );
+        if (preset == "fast") {
+          accel_preset = bake::ACCEL_PRESET_FAST;
+        } else if (preset == "balanced") {
+          accel_preset = bake::ACCEL_PRESET_BALANCED;
+        } else if (preset == "quality") {
+          accel_preset = bake::ACCEL_PRESET_QUALITY;
+        } else {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--backend") && i+1 < argc ) {
+        const std::string name( argv[++i] );
+        if (name == "auto") {
+          backend = bake::AO_BACKEND_AUTO;
+        } else if (name == "prime") {
+          backend = bake::AO_BACKEND_OPTIX_PRIME;
+        } else if (name == "optix") {
+          backend = bake::AO_BACKEND_OPTIX;
+        } else if (name == "embree") {
+          backend = bake::AO_BACKEND_EMBREE;
+        } else if (name == "hybrid") {
+          backend = bake::AO_BACKEND_HYBRID;
+        } else {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--adaptive") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%f", &adaptive_tolerance ) != 1) || adaptive_tolerance < 0.0f ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--time_budget") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%lf", &time_budget ) != 1) || !(time_budget > 0.0) ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--snapshot") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%lf", &snapshot_interval ) != 1) || !(snapshot_interval > 0.0) ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--progress") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%lf", &progress_interval ) != 1) || !(progress_interval > 0.0) ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--tune_kernels") ) {
+        tune_kernels = true;
+      }
+      else if ( (arg == "--threads") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%d", &num_threads ) != 1) || num_threads < 1 ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--submit_cores") && i+1 < argc ) {
+        if( (sscanf( argv[++i], "%d", &submit_cores ) != 1) || submit_cores < 0 ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--pin_threads") ) {
+        pin_threads = true;
+      }
+      else if ( (arg == "--live") ) {
+        live_view = true;
+      }
+      else if ( (arg == "--devices") && i+1 < argc ) {
+        // Comma separated list of CUDA device numbers
+        std::string list( argv[++i] );
+        size_t pos = 0;
+        while ( pos <= list.size() ) {
+          const size_t end = std::min( list.find( ',', pos ), list.size() );
+          int device = -1;
+          if ( sscanf( list.substr( pos, end - pos ).c_str(), "%d", &device ) != 1 || device < 0 ) {
+            printParseErrorAndExit( argv[0], arg, argv[i] );
+          }
+          devices.push_back( device );
+          pos = end + 1;
+        }
+      }
       else if ( (arg == "--no_least_squares" ) ) {
         filter_mode = bake::VERTEX_FILTER_AREA_BASED;  
       }
+      else if ( (arg == "--gpu_least_squares" ) ) {
+        filter_mode = bake::VERTEX_FILTER_LEAST_SQUARES_CG;
+      }
+      else if ( (arg == "--matrix_free_least_squares" ) ) {
+        filter_mode = bake::VERTEX_FILTER_LEAST_SQUARES_MATRIX_FREE;
+      }
+      else if ( (arg == "--float_least_squares" ) ) {
+        filter_mode = bake::VERTEX_FILTER_LEAST_SQUARES_FLOAT;
+      }
+      else if ( (arg == "--cpu_cg_least_squares" ) ) {
+        filter_mode = bake::VERTEX_FILTER_LEAST_SQUARES_HOST_CG;
+      }
+      else if ( (arg == "--cg_preconditioner") && i+1 < argc ) {
+        const std::string name( argv[++i] );
+        if (name == "jacobi") {
+          cg_preconditioner = bake::CG_PRECONDITIONER_JACOBI;
+        } else if (name == "ichol") {
+          cg_preconditioner = bake::CG_PRECONDITIONER_INCOMPLETE_CHOLESKY;
+        } else {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
+      else if ( (arg == "--cg_tolerance") && i+1 < argc ) {
+        if( sscanf( argv[++i], "%f", &cg_tolerance ) != 1 || !(cg_tolerance > 0.0f) ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+      }
       else if ( (arg == "-w" || arg == "--regularization_weight" ) && i+1 < argc ) {
-        if( sscanf( argv[++i], "%f", &regularization_weight ) != 1 ) {
+        // One weight, or a comma separated sweep of them
+        std::string list( argv[++i] );
+        regularization_weights.clear();
+        size_t pos = 0;
+        while ( pos <= list.size() ) {
+          const size_t end = std::min( list.find( ',', pos ), list.size() );
+          float weight = 0.0f;
+          if ( sscanf( list.substr( pos, end - pos ).c_str(), "%f", &weight ) != 1 ) {
+            printParseErrorAndExit( argv[0], arg, argv[i] );
+          }
+          regularization_weights.push_back( std::max( weight, 0.0f ) );
+          pos = end + 1;
+        }
+        regularization_weight = regularization_weights[0];
+        if ( regularization_weights.size() == 1 ) regularization_weights.clear();
+      }
+      else if ( (arg == "--analytic_mass" ) && i+1 < argc ) {
+        if( sscanf( argv[++i], "%f", &analytic_mass_weight ) != 1 ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+        analytic_mass_weight = std::min( std::max( analytic_mass_weight, 0.0f ), 1.0f );
+      }
+      else if ( (arg == "--ls_solver") && i+1 < argc ) {
+        const std::string name( argv[++i] );
+        if (name == "simplicial") {
+          ls_solver = bake::LEAST_SQUARES_SOLVER_SIMPLICIAL;
+        } else if (name == "cholmod") {
+          ls_solver = bake::LEAST_SQUARES_SOLVER_CHOLMOD;
+        } else if (name == "pardiso") {
+          ls_solver = bake::LEAST_SQUARES_SOLVER_PARDISO;
+        } else {
           printParseErrorAndExit( argv[0], arg, argv[i] );
         }
-        regularization_weight = std::max( regularization_weight, 0.0f );
+        if (!bake::leastSquaresSolverAvailable( ls_solver )) {
+          std::cerr << "--ls_solver " << name << " is not available in this build, using simplicial" << std::endl;
+          ls_solver = bake::LEAST_SQUARES_SOLVER_SIMPLICIAL;
+        }
+      }
+      else if ( (arg == "--ls_ordering") && i+1 < argc ) {
+        const std::string name( argv[++i] );
+        if (name == "amd") {
+          ls_ordering = bake::LEAST_SQUARES_ORDERING_AMD;
+        } else if (name == "colamd") {
+          ls_ordering = bake::LEAST_SQUARES_ORDERING_COLAMD;
+        } else if (name == "metis") {
+          ls_ordering = bake::LEAST_SQUARES_ORDERING_METIS;
+        } else if (name == "geometric") {
+          ls_ordering = bake::LEAST_SQUARES_ORDERING_GEOMETRIC;
+        } else if (name == "auto") {
+          ls_ordering = bake::LEAST_SQUARES_ORDERING_AUTO;
+        } else {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+        if (!bake::leastSquaresOrderingAvailable( ls_ordering )) {
+          std::cerr << "--ls_ordering " << name << " is not available in this build, using amd" << std::endl;
+          ls_ordering = bake::LEAST_SQUARES_ORDERING_AMD;
+        }
+      }
+      else if ( (arg == "--ls_patches") && i+1 < argc ) {
+        int n = 0;
+        if( sscanf( argv[++i], "%d", &n ) != 1 || n < 1 ) {
+          printParseErrorAndExit( argv[0], arg, argv[i] );
+        }
+        ls_patch_vertices = size_t( n );
       }
       else 
       {
@@ -217,64 +960,527 @@ struct Config {
       }
     }
 
-    if (scene_filename.empty()) {
+    if (two_sided && !hit_distances.empty()) {
+      std::cerr << "--two_sided and --hit_distances can't be combined" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
 
-      // Make default filename
+    if (bent_normals && sh_visibility) {
+      std::cerr << "--bent_normals and --sh_visibility can't be combined" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+    if ((bent_normals || sh_visibility) && (two_sided || !hit_distances.empty() || adaptive_tolerance > 0.0f || tile_scale > 0.0f || instance_chunk > 0 || 
+        partition_count > 1 || time_budget > 0.0 || snapshot_interval > 0.0 || live_view || move_instance >= 0 || 
+        !instance_ray_counts.empty() || large_instance_rays > 0)) {
+      std::cerr << "--bent_normals and --sh_visibility can't be combined with --two_sided, --hit_distances, --adaptive, --tiled, --instance_chunk, --partition, "
+                << "--time_budget, --snapshot, --live, --move_instance, --instance_rays or --large_instance_rays" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
 
-      const std::string asset_path(ASSET_PATH);
+    if (tile_scale > 0.0f && (gpu_sampling || move_instance >= 0 || instance_chunk > 0 || partition_count > 1)) {
+      std::cerr << "--tiled can't be combined with --gpu_sampling, --move_instance, --instance_chunk or --partition" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
 
-#ifndef NOGZLIB
-      // Try more interesting gzipped file first
-      std::string bk3d_path = asset_path + std::string(DEFAULT_BK3DGZ_FILE);
-      struct stat buf;
-      if (stat(bk3d_path.c_str(), &buf) == 0) {
-        scene_filename = bk3d_path;
-      }
-#endif
-      if (scene_filename.empty()) {
-        // Fall back to simpler file
-        std::string obj_path = asset_path + std::string(DEFAULT_BK3D_FILE);
-        struct stat buf;
-        if (stat(obj_path.c_str(), &buf) == 0) {
-          scene_filename = obj_path;
-        } else {
-          std::cerr << "Could not find default scene file (" << obj_path << "). Use options to specify one." << std::endl;
-          printUsageAndExit( argv[0] );
-        }
-      }
-     
+    if (latency_budget > 0.0f && (use_cpu || time_budget > 0.0 || snapshot_interval > 0.0 || live_view || 
+        (backend != bake::AO_BACKEND_AUTO && backend != bake::AO_BACKEND_OPTIX_PRIME))) {
+      std::cerr << "--latency_budget needs the Prime tracer on a GPU, and can't be combined with --no_gpu, --backend other than prime, "
+                << "--time_budget, --snapshot or --live" << std::endl;
+      printUsageAndExit( argv[0] );
     }
-  }
+    // Only the Prime tracer is governed
+    if (latency_budget > 0.0f) backend = bake::AO_BACKEND_OPTIX_PRIME;
 
-  void printUsageAndExit( const char* argv0 )
-  {
-    std::cerr
-    << "Usage  : " << argv0 << " [options]\n"
-    << "App options:\n"
-    << "  -h  | --help                          Print this usage message\n"
-    << "  -f  | --file <scene_file>             Specify model to be rendered (obj, bk3d, bk3d.gz, csf, csf.gz).\n"
-    << "  -o  | --outfile <vertex_ao_file>      Specify raw file where per-instance ao vertices are stored (very basic fileformat).\n"
-    << "  -i  | --instances <n>                 Number of instances per mesh (default 1).  For testing.\n"
-    << "  -r  | --rays    <n>                   Number of rays per sample point for gather (default " << NUM_RAYS << ")\n"
-    << "  -s  | --samples <n>                   Number of sample points on mesh (default " << SAMPLES_PER_FACE << " per face; any extra samples are based on area)\n"
-    << "  -t  | --samples_per_face <n>          Minimum number of samples per face (default " << SAMPLES_PER_FACE << ")\n"
-    << "  -d  | --ray_distance_scale <s>        Distance offset scale for ray from face: ray offset = maximum scene extent * s. (default " << SCENE_OFFSET_SCALE << ")\n"
+    if (far_field > 0.0f && (!hit_distances.empty() || bent_normals || sh_visibility || time_budget > 0.0 || snapshot_interval > 0.0 || 
+        live_view || (backend != bake::AO_BACKEND_AUTO && backend != bake::AO_BACKEND_OPTIX_PRIME))) {
+      std::cerr << "--far_field needs the Prime tracer, and can't be combined with --backend other than prime, --hit_distances, "
+                << "--bent_normals, --sh_visibility, --time_budget, --snapshot or --live" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+    // Only the Prime tracer has the far field
+    if (far_field > 0.0f) backend = bake::AO_BACKEND_OPTIX_PRIME;
+
+    if ((peer_geometry || managed_geometry) && (use_cpu || (backend != bake::AO_BACKEND_AUTO && backend != bake::AO_BACKEND_OPTIX_PRIME))) {
+      std::cerr << "--peer_geometry and --managed_geometry need the Prime tracer on GPUs, and can't be combined with --no_gpu or "
+                << "--backend other than prime" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+    // Only Prime accels are built over geometry buffers this program allocates
+    if (peer_geometry || managed_geometry) backend = bake::AO_BACKEND_OPTIX_PRIME;
+
+    if (mesh_library_bytes > 0 && (use_cpu || peer_geometry || managed_geometry || 
+        (backend != bake::AO_BACKEND_AUTO && backend != bake::AO_BACKEND_OPTIX_PRIME))) {
+      std::cerr << "--mesh_library_mb keeps Prime accels on GPUs, and can't be combined with --no_gpu, --peer_geometry, "
+                << "--managed_geometry or --backend other than prime" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+    if (mesh_library_bytes > 0) backend = bake::AO_BACKEND_OPTIX_PRIME;
+
+    if (live_view && !use_viewer) {
+      std::cerr << "--live needs the viewer" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+    if ((time_budget > 0.0 || snapshot_interval > 0.0 || live_view) && (gpu_sampling || two_sided || !hit_distances.empty() || adaptive_tolerance > 0.0f || 
+        tile_scale > 0.0f || instance_chunk > 0 || partition_count > 1 || host_memory_budget > 0 || dry_run || !checkpoint_dir.empty())) {
+      std::cerr << "--time_budget, --snapshot and --live can't be combined with --gpu_sampling, --two_sided, --hit_distances, --adaptive, --tiled, " 
+                << "--instance_chunk, --partition, --mem_budget, --dry_run or --checkpoint" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+    if ((snapshot_interval > 0.0 || live_view) && sort_samples) {
+      std::cerr << "--snapshot and --live can't be combined with --sort_samples" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+    if (reconstruct_samples && (use_cpu || gpu_sampling || vertex_samples || instance_chunk > 0 || partition_count > 1 || 
+        !load_samples_filename.empty())) {
+      std::cerr << "--reconstruct_samples can't be combined with --no_gpu, --gpu_sampling, --vertex_samples, --instance_chunk, --partition "
+                << "or --load_samples" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (vertex_samples && (gpu_sampling || instance_chunk > 0 || partition_count > 1 || host_memory_budget > 0 || dry_run)) {
+      std::cerr << "--vertex_samples can't be combined with --gpu_sampling, --instance_chunk, --partition, --mem_budget or --dry_run" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (!lod_filenames.empty() && (output_filename.empty() || use_cpu || gpu_sampling || vertex_samples || instance_chunk > 0 || 
+        partition_count > 1)) {
+      std::cerr << "--lod needs --outfile, and can't be combined with --no_gpu, --gpu_sampling, --vertex_samples, --instance_chunk or --partition" 
+                << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (denoise_scale > 0.0f && (use_cpu || gpu_sampling || vertex_samples || instance_chunk > 0 || partition_count > 1)) {
+      std::cerr << "--denoise can't be combined with --no_gpu, --gpu_sampling, --vertex_samples, --instance_chunk or --partition" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (ao_cache_scale > 0.0f && (gpu_sampling || two_sided || !hit_distances.empty() || bent_normals || sh_visibility || 
+        tile_scale > 0.0f || time_budget > 0.0 || snapshot_interval > 0.0 || live_view || !instance_ray_counts.empty() || 
+        large_instance_rays > 0 || instance_chunk > 0 || partition_count > 1)) {
+      std::cerr << "--ao_cache can't be combined with --gpu_sampling, --two_sided, --hit_distances, --bent_normals, --sh_visibility, "
+                   "--tiled, --time_budget, --snapshot, --live, --instance_rays, --large_instance_rays, --instance_chunk or --partition" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if ((!instance_ray_counts.empty() || large_instance_rays > 0) && 
+        (two_sided || !hit_distances.empty() || tile_scale > 0.0f || time_budget > 0.0 || snapshot_interval > 0.0 || live_view || 
+         gpu_sampling || sort_samples || move_instance >= 0)) {
+      std::cerr << "--instance_rays and --large_instance_rays can't be combined with --two_sided, --hit_distances, --tiled, --time_budget, "
+                << "--snapshot, --live, --gpu_sampling, --sort_samples or --move_instance" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (auto_hit_distance > 0.0f && (scene_maxdistance > 0.0f || tile_scale > 0.0f || instance_chunk > 0 || partition_count > 1)) {
+      std::cerr << "--auto_hit_distance can't be combined with --hit_distance, --hit_distances, --tiled, --instance_chunk or --partition" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (variance_rays > 0 && (vertex_samples || tile_scale > 0.0f || instance_chunk > 0 || partition_count > 1)) {
+      std::cerr << "--variance_sampling can't be combined with --vertex_samples, --tiled, --instance_chunk or --partition" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (weld_tolerance >= 0.0f && vertex_samples) {
+      std::cerr << "--weld applies to the vertex filters, which --vertex_samples doesn't use" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (sample_templates && (gpu_sampling || vertex_samples)) {
+      std::cerr << "--sample_templates can't be combined with --gpu_sampling or --vertex_samples" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (mapped_output && (output_bits != 32 || compress_output || instance_chunk > 0 || partition_count > 1)) {
+      std::cerr << "--mapped_output writes the raw format of a whole scene bake; it can't be combined with --output_bits 8|16, "
+                   "--compress_output, --instance_chunk or --partition" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (!warm_start_filename.empty() && ((filter_mode != bake::VERTEX_FILTER_LEAST_SQUARES_CG && filter_mode != bake::VERTEX_FILTER_LEAST_SQUARES_MATRIX_FREE &&
+        filter_mode != bake::VERTEX_FILTER_LEAST_SQUARES_HOST_CG) ||
+        !regularization_weights.empty() || vertex_samples || bent_normals || sh_visibility || instance_chunk > 0)) {
+      std::cerr << "--warm_start needs --gpu_least_squares, --cpu_cg_least_squares or --matrix_free_least_squares, and can't be combined with a -w sweep, "
+                   "--vertex_samples, --bent_normals, --sh_visibility or --instance_chunk" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (!occluder_variant_suffixes.empty() && (output_filename.empty() || mapped_output || gpu_sampling || tile_scale > 0.0f || 
+        instance_chunk > 0 || partition_count > 1 || !load_samples_filename.empty() || time_budget > 0.0 || snapshot_interval > 0.0 || 
+        live_view || two_sided || !hit_distances.empty() || bent_normals || sh_visibility || move_instance >= 0 || roi_cull || 
+        !part_cache_dir.empty() || !result_cache_dir.empty())) {
+      std::cerr << "--occluder_variant needs -o, and can't be combined with --mapped_output, --gpu_sampling, --tiled, --instance_chunk, "
+                   "--partition, --load_samples, --time_budget, --snapshot, --live, --two_sided, --hit_distances, --bent_normals, "
+                   "--sh_visibility, --move_instance, --roi_cull, --part_cache or --result_cache" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (!frames_filename.empty() && (output_filename.empty() || scene_filenames.size() > 1 || gpu_sampling || vertex_samples || 
+        tile_scale > 0.0f || instance_chunk > 0 || partition_count > 1 || !load_samples_filename.empty() || time_budget > 0.0 || 
+        snapshot_interval > 0.0 || live_view || two_sided || !hit_distances.empty() || bent_normals || sh_visibility || 
+        !regularization_weights.empty() || move_instance >= 0 || proxy_ratio > 0.0f || use_roi_bbox || !roi_ids_filename.empty() || 
+        flip_orientation || reorder_meshes || clean_meshes || !part_cache_dir.empty() || !result_cache_dir.empty() || lightmap_size > 0)) {
+      std::cerr << "--frames needs -o and one -f scene, and can't be combined with --gpu_sampling, --vertex_samples, --tiled, "
+                   "--instance_chunk, --partition, --load_samples, --time_budget, --snapshot, --live, --two_sided, --hit_distances, "
+                   "--bent_normals, --sh_visibility, a -w sweep, --move_instance, --proxy_occluders, --roi_bbox, --roi_ids, --flip_orientation, "
+                   "--reorder_meshes, --clean_meshes, --part_cache, --result_cache or --lightmap" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (!patch_base_filename.empty() && (output_filename.empty() || mapped_output || output_bits != 32 || compress_output || output_index ||
+        instance_chunk > 0 || partition_count > 1 || !lod_filenames.empty())) {
+      std::cerr << "--output_patch saves the changes of a whole scene bake against a raw file; it needs -o and can't be combined with "
+                   "--mapped_output, --output_bits 8|16, --compress_output, --output_index, --instance_chunk, --partition or --lod" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (clean_meshes && (instance_chunk > 0 || partition_count > 1)) {
+      std::cerr << "--clean_meshes can't be combined with --instance_chunk or --partition" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (!spill_dir.empty() && ((instance_chunk == 0 && host_memory_budget == 0) || gpu_sampling || compact_samples || 
+        !instance_ray_counts.empty() || large_instance_rays > 0 || !checkpoint_dir.empty())) {
+      std::cerr << "--spill_dir needs --instance_chunk or --mem_budget, and can't be combined with --gpu_sampling, --compact_samples, "
+                   "--instance_rays, --large_instance_rays or --checkpoint" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (mapped_output && reorder_meshes) {
+      std::cerr << "--mapped_output filters into the loaded vertex order, which --reorder_meshes changes" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (!view_filename.empty() && !use_viewer) {
+      std::cerr << "--view_only needs the viewer" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (scene_filenames.size() > 1 && (!shared_scene_filename.empty() || !scene_cache_filename.empty())) {
+      std::cerr << "--shared_scene and --scene_cache track one scene file; list several in a .scenes file instead of repeating -f" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (!shared_scene_filename.empty() && (!scene_cache_filename.empty() || flip_orientation)) {
+      std::cerr << "--shared_scene maps the scene read-only; it can't be combined with --scene_cache or --flip_orientation" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (roi_cull && !use_roi_bbox && roi_ids_filename.empty()) {
+      std::cerr << "--roi_cull needs --roi_bbox or --roi_ids" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if ((use_roi_bbox || !roi_ids_filename.empty()) && move_instance >= 0) {
+      std::cerr << "--roi_bbox and --roi_ids can't be combined with --move_instance" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (!load_samples_filename.empty() && (instance_chunk > 0 || partition_count > 1 || time_budget > 0.0 || snapshot_interval > 0.0 || 
+        live_view || move_instance >= 0 || lightmap_size > 0 || variance_rays > 0 || auto_hit_distance > 0.0f || !part_cache_dir.empty())) {
+      std::cerr << "--load_samples only skips the trace of a whole scene bake; it can't be combined with --instance_chunk, --partition, "
+                << "--time_budget, --snapshot, --live, --move_instance, --lightmap, --variance_rays, --auto_hit_distance or --part_cache" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+    if (!save_samples_filename.empty() && (instance_chunk > 0 || partition_count > 1 || !part_cache_dir.empty())) {
+      std::cerr << "--save_samples can't be combined with --instance_chunk, --partition or --part_cache" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (!regularization_weights.empty() && (output_filename.empty() || filter_mode == bake::VERTEX_FILTER_AREA_BASED || vertex_samples || 
+        two_sided || !hit_distances.empty() || bent_normals || sh_visibility || instance_chunk > 0 || partition_count > 1 || 
+        !part_cache_dir.empty() || !patch_base_filename.empty() || !result_cache_dir.empty())) {
+      std::cerr << "Several -w weights need -o and a least squares filter, and can't be combined with --vertex_samples, --two_sided, "
+                << "--hit_distances, --bent_normals, --sh_visibility, --instance_chunk, --partition, --part_cache, --output_patch or --result_cache" 
+                << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (!result_cache_dir.empty() && (output_filename.empty() || !patch_base_filename.empty() || instance_chunk > 0 || partition_count > 1 || 
+        !lod_filenames.empty() || lightmap_size > 0 || two_sided || hit_distances.size() > 1 || bent_normals || sh_visibility)) {
+      std::cerr << "--result_cache keeps the one output file of a whole scene bake; it needs -o and can't be combined with --output_patch, "
+                << "--instance_chunk, --partition, --lod, --lightmap, --two_sided, several --hit_distances, --bent_normals or --sh_visibility" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (!part_cache_dir.empty() && (share_mesh_ao || instance_chunk > 0 || partition_count > 1 || host_memory_budget > 0 || mapped_output || 
+        move_instance >= 0 || !lod_filenames.empty() || two_sided || !hit_distances.empty() || bent_normals || sh_visibility || 
+        auto_hit_distance > 0.0f || vertex_samples || !instance_ray_counts.empty() || large_instance_rays > 0)) {
+      std::cerr << "--part_cache can't be combined with --share_mesh_ao, --instance_chunk, --partition, --mem_budget, --mapped_output, "
+                << "--move_instance, --lod, --two_sided, --hit_distances, --bent_normals, --sh_visibility, --auto_hit_distance, "
+                << "--vertex_samples, --instance_rays or --large_instance_rays" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (!profile_meshes_filename.empty() && ((instance_chunk > 0 && !share_mesh_ao) || partition_count > 1 || !batch_filename.empty())) {
+      std::cerr << "--profile_meshes can't be combined with --instance_chunk, --partition or --batch" << std::endl;
+      printUsageAndExit( argv[0] );
+    }
+
+    if (partition_count > 1) {
+      if (share_mesh_ao || move_instance >= 0) {
+        std::cerr << "--partition can't be combined with --share_mesh_ao or --move_instance" << std::endl;
+        printUsageAndExit( argv[0] );
+      }
+      // A partition holds only some instances' AO
+      use_viewer = false;
+      if (!output_filename.empty()) {
+        std::ostringstream suffix;
+        suffix << "." << partition_rank;
+        output_filename += suffix.str();
+      }
+    }
+
+    // The least squares filter fills in faces without samples from their neighbors; the area based filter leaves
+    // vertices with only such faces black
+    if (min_samples_per_face < 1.0f && filter_mode == bake::VERTEX_FILTER_AREA_BASED && !vertex_samples) {
+      std::cerr << "Warning: with fewer than 1 sample per face, the area based filter gives vertices of faces without samples no AO" 
+                << std::endl;
+    }
+
+    // Merging occluders costs host time before the build, and pays off in the queries
+    if (!merge_occluders_set) {
+      if (accel_preset == bake::ACCEL_PRESET_FAST) merge_occluder_triangles = 0;
+      if (accel_preset == bake::ACCEL_PRESET_QUALITY) merge_occluder_triangles = QUALITY_MERGE_OCCLUDER_TRIANGLES;
+    }
+
+    if (scene_filename.empty()) {
+
+      // Make default filename
+
+      const std::string asset_path(ASSET_PATH);
+
+#ifndef NOGZLIB
+      // Try more interesting gzipped file first
+      std::string bk3d_path = asset_path + std::string(DEFAULT_BK3DGZ_FILE);
+      struct stat buf;
+      if (stat(bk3d_path.c_str(), &buf) == 0) {
+        scene_filename = bk3d_path;
+      }
+#endif
+      if (scene_filename.empty()) {
+        // Fall back to simpler file
+        std::string obj_path = asset_path + std::string(DEFAULT_BK3D_FILE);
+        struct stat buf;
+        if (stat(obj_path.c_str(), &buf) == 0) {
+          scene_filename = obj_path;
+        } else {
+          std::cerr << "Could not find default scene file (" << obj_path << "). Use options to specify one." << std::endl;
+          printUsageAndExit( argv[0] );
+        }
+      }
+     
+    }
+
+    // The bk3d copy gets one AO stream per mesh, joined to the instances by their prim groups.  CSF geometry has
+    // fixed vertex, normal and texcoord streams and no slot for another attribute.
+    if (!bk3d_output_filename.empty()) {
+      const size_t pos = scene_filename.rfind(".bk3d");
+      const bool bk3d = pos != std::string::npos && (scene_filename.substr(pos) == ".bk3d" || scene_filename.substr(pos) == ".bk3d.gz");
+      if (!bk3d || scene_filenames.size() > 1 || num_instances_per_mesh > 1 || instance_chunk > 0 || partition_count > 1 || 
+          !spill_dir.empty() || !frames_filename.empty() || !view_filename.empty() || two_sided || hit_distances.size() > 1 || 
+          bent_normals || sh_visibility) {
+        std::cerr << "--bk3d_outfile writes the AO of a whole bake of one .bk3d or .bk3d.gz -f file (CSF has no room for another "
+                  << "vertex attribute); it can't be combined with -i, --instance_chunk, --partition, --spill_dir, --frames, --view_only, "
+                  << "--two_sided, several --hit_distances, --bent_normals or --sh_visibility" << std::endl;
+        printUsageAndExit( argv[0] );
+      }
+    }
+  }
+
+  void printUsageAndExit( const char* argv0 )
+  {
+    std::cerr
+    << "Usage  : " << argv0 << " [options]\n"
+    << "App options:\n"
+    << "  -h  | --help                          Print this usage message\n"
+    << "  -f  | --file <scene_file>             Specify model to be rendered (obj, ply, bk3d, bk3d.gz, csf, csf.gz, or a .scenes\n"
+    << "                                        list of such files).  Repeat to load several files concurrently as one scene\n"
+    << "  -o  | --outfile <vertex_ao_file>      Specify raw file where per-instance ao vertices are stored (very basic fileformat).\n"
+    << "        --stats <file>                  Save timers, counters and memory high water marks of the run as JSON\n"
+    << "        --profile_meshes <file.csv>     Save one row per mesh of its samples, rays, occlusion and sampling and filter costs\n"
+    << "        --progress <s>                  Print the progress of the trace and the filters every s seconds, with rays/s and ETA\n"
+    << "        --tune_kernels                  Time a few block sizes for ray generation on each device and keep the fastest\n"
+    << "        --threads <n>                   Threads of the sampling, filtering and loading stages (default: every core not kept\n"
+    << "                                        by --submit_cores).  For the whole process, including batch jobs\n"
+    << "        --submit_cores <n>              Keep n cores free of those threads for the threads feeding the devices\n"
+    << "        --pin_threads                   Pin the stage threads to the other cores, NUMA node by node, and the trace to the\n"
+    << "                                        kept cores (Linux)\n"
+    << "        --mem_budget <h>[,<d>]          Fit the bake into h MB of host memory, and d MB per device if given, by picking the batch\n"
+    << "                                        size, instance chunks and least squares solver from an estimate of each phase\n"
+    << "        --dry_run                       Print the memory estimate and plan of the bake after loading the scene, without baking\n"
+    << "        --partition <r,n>|mpi           Bake partition r of n, a range of instances with about 1/n of the samples, traced against\n"
+    << "                                        the full scene, and save it to <vertex_ao_file>.<r>; merge_ao joins the partitions.  mpi takes\n"
+    << "                                        r and n from the MPI or Slurm launcher.  Disables the viewer.\n"
+    << "        --batch <listfile>              Bake one job per line of listfile in this process, each line holding options added to the\n"
+    << "                                        command line for that job.  Prints a JSON record per job to stdout.  Disables the viewer.\n"
+    << "        --pack <n>                      Trace up to n consecutive batch jobs with the same options in one context, each scene\n"
+    << "                                        in a cell of its own out of the others' reach; for libraries of small assets\n"
+    << "        --lightmap <n> <prefix>         Also bake an n x n AO lightmap for each instance with texcoords, saved as <prefix><id>.pgm\n"
+    << "        --output_bits <8|16|32>         Quantize output AO to 8 or 16 bits per vertex (v2 format; default 32, raw floats)\n"
+#ifndef NOGZLIB
+    << "        --compress_output               Deflate each instance's output AO (v2 format)\n"
+#endif
+    << "        --mapped_output                 Size and map the raw output file up front, and filter vertex AO straight into it\n"
+    << "        --output_index                  End the output file with a hash index of the instances by storage identifier\n"
+    << "        --bk3d_outfile <file.bk3d>      Also save a copy of the bk3d scene file with the vertex AO added to each mesh as a float\n"
+    << "                                        attribute named \"ambientocclusion\", in a vertex buffer slot of its own\n"
+    << "        --output_patch <base_file>      Save only the instances whose AO differs from this raw file, as a patch that merge_ao\n"
+    << "                                        --apply writes into it in place.  Extra channels patch <base_file> with their suffix\n"
+    << "        --reorder_meshes                Bake copies of the meshes with triangles in vertex cache order and vertices in the order\n"
+    << "                                        those fetch them, for locality in sampling, filters and the viewer; output keeps the\n"
+    << "                                        vertex order of the scene file\n"
+    << "        --clean_meshes                  Bake without zero area triangles and copies of triangles, by vertex or by position, so they\n"
+    << "                                        get no samples, rays or filter entries; vertices only those used take the AO of a vertex\n"
+    << "                                        at their position\n"
+    << "        --scene_cache <cache_file>      Load the scene from this snapshot if it matches the scene file, otherwise write it after loading\n"
+    << "        --shared_scene <file>           Map the scene read-only from this snapshot (e.g. under /dev/shm), shared by all bake processes\n"
+    << "                                        on the node; the first process to get there loads the scene file and writes it\n"
+    << "        --context_scene <scene_file>    Trace this scene as occluders only: it gets no samples, filtering or output\n"
+    << "        --lod <scene_file>              A LOD of the scene, which gets AO from the samples of the bake instead of tracing, saved\n"
+    << "                                        to <vertex_ao_file>.lod1, .lod2, ... in the order given; repeat for each LOD\n"
+    << "        --lod_radius <k>                Radius of the LOD transfer lookup, in mean sample spacings (default 2)\n"
+    << "        --roi_bbox <x0,y0,z0,x1,y1,z1>  Bake and save only the instances whose bounds touch this box; the rest of the scene\n"
+    << "                                        only occludes them.  merge_ao --overlay puts the result into an earlier full bake\n"
+    << "        --roi_ids <file>                Bake and save only the instances with the storage identifiers listed in this file\n"
+    << "                                        (as well as those of --roi_bbox)\n"
+    << "        --roi_cull                      Trace only the instances within the hit distance of those baked by --roi_bbox or --roi_ids\n"
+    << "        --filter_cache <dir>            Keep least squares filter matrices per mesh in this existing directory, for later bakes\n"
+    << "        --checkpoint <dir>              Keep traced batches of vertex AO in this existing directory, and skip those found there\n"
+    << "                                        from an earlier run of the same bake (Prime tracer only)\n"
+    << "        --save_samples <file>           Save the samples and their traced AO after the trace, before any filter\n"
+    << "        --load_samples <file>           Take the traced AO from a --save_samples file of the same scene and trace settings instead\n"
+    << "                                        of tracing, so that only the filters run, e.g. to tune -w or the filter mode\n"
+    << "  -i  | --instances <n>                 Number of instances per mesh (default 1).  For testing.\n"
+    << "  -r  | --rays    <n>                   Number of rays per sample point for gather (default " << NUM_RAYS << ")\n"
+    << "        --instance_rays <file>          Rays per sample of instances by storage identifier, from lines of <id> <n> or <first>-<last> <n>\n"
+    << "        --large_instance_rays <s> <n>   Trace n rays per sample on instances whose bbox diagonal is at least s times the scene extent\n"
+    << "  -s  | --samples <n>                   Number of sample points on mesh (default " << SAMPLES_PER_FACE << " per face; any extra samples are based on area)\n"
+    << "  -t  | --samples_per_face <n>          Minimum number of samples per face (default " << SAMPLES_PER_FACE << ").  May be a fraction, e.g. 0.25\n"
+    << "                                        for a sample per 4 neighboring faces, for meshes with faces far below the AO detail\n"
+    << "  -d  | --ray_distance_scale <s>        Distance offset scale for ray from face: ray offset = maximum scene extent * s. (default " << SCENE_OFFSET_SCALE << ")\n"
     << "        --ray_distance <s>              Distance offset scale for ray from face: ray offset = s. (overrides scale-based version, used if non zero)\n"
     << "  -m  | --hit_distance_scale <s>        Maximum hit distance to contribute: max distance = maximum scene extent * s. (default " << SCENE_MAXDISTANCE_SCALE << ")\n"
     << "        --hit_distance <s>              Maximum hit distance to contribute: max distance = s. (overrides scale-based version, used if non zero)\n"
+    << "        --auto_hit_distance <f>         Shorten the hit distance to the least that keeps fraction f (0-1] of the occlusion\n"
+    << "                                        found within the scale-based distance, by a pre-pass on a subset of samples\n"
+    << "        --hit_distances <s0,s1,...>     AO at up to " << bake::MAX_AO_RADII << " hit distances from one trace.  The largest goes to the outfile and viewer,\n"
+    << "                                        the others, ascending, to <vertex_ao_file>.r0, .r1, ...\n"
     << "  -g  | --ground_setup <axis> <s> <o>   Ground plane setup: axis(int 0,1,2,3,4,5 = +x,+y,+z,-x,-y,-z) scale(float) offset(float). "
     <<                                          " (default 1 " << GROUND_SCALE << " " << GROUND_OFFSET << ")\n"
     << "        --flip_orientation              Flips model winding and vertex normals (useful for storing two-sided baking results separately)\n"
+    << "        --two_sided                     Bake both sides in one run: the front side goes to the outfile and viewer, the back side to <vertex_ao_file>.back\n"
+    << "        --bent_normals                  Also bake bent normals in the same trace, to <vertex_ao_file>.bent_x, .bent_y and .bent_z as 0.5 + 0.5*n\n"
+    << "        --sh_visibility                 Also bake L1 SH visibility in the same trace, to <vertex_ao_file>.sh0 - .sh3 as 0.5 + c\n"
+    << "        --obj_groups                    Keep OBJ groups as separate meshes instead of flattening the file into one mesh\n"
     << "        --no_ground_plane               Disable virtual ground plane\n"
+    << "        --analytic_ground_plane         Test rays against the ground plane in ray generation instead of tracing it as geometry\n"
     << "        --no_viewer                     Disable OpenGL viewer\n"
-    << "        --no_gpu                        Disable GPU usage in raytracer\n"
+    << "        --view_only <vertex_ao_file>    Show the AO saved by an earlier bake of the scene in the viewer, without baking\n"
+    << "        --no_gpu                        Disable GPU usage in raytracer (Embree traces without any device, Prime still makes rays on one)\n"
     << "        --conserve_memory               Triggers some internal settings in optix to save memory\n"
+    << "        --batch_size <n>                Number of samples traced per batch (default: sized from free device memory)\n"
+    << "        --instance_chunk <n>            Bake n instances at a time against the full scene, to bound sample memory (default: all at once)\n"
+    << "        --no_pipeline                   Bake instance chunks one after another, instead of sampling the next and filtering the\n"
+    << "                                        previous chunk while one traces\n"
+    << "        --spill_dir <dir>               Write the samples of instance chunks to a scratch file in this existing directory,\n"
+    << "                                        ideally on NVMe, trace all chunks in one pass reading them back ahead of the\n"
+    << "                                        devices, and filter each chunk from the AO written back there\n"
+    << "        --move_instance <i> <x> <y> <z> After baking, move instance i by (x,y,z) and retrace only the samples it can affect.  For testing.\n"
+    << "        --occluder_variant <name> <i,j,...> Also save <outfile>.<name>, baked with scene instances i, j, ... hidden, or ground\n"
+    << "                                        for the mesh ground plane.  Repeatable; the accels of the bake are reused\n"
+    << "        --frames <list.txt>             Also bake the frames of an animation of the -f scene, one scene file per line, each\n"
+    << "                                        with its meshes' vertex and triangle counts and triangles, and save the -f scene then\n"
+    << "                                        every frame to <outfile>.frames, frame after frame.  Samples stay at the same points\n"
+    << "                                        of the surface, and the accels and filter systems are updated instead of built again\n"
+    << "        --frame_rigid_tolerance <t>     Relative edge length change up to which a frame reuses the least squares regularizer\n"
+    << "                                        of the one before (default 0.01)\n"
+    << "        --passes_per_query <n>          Number of ray passes traced together in one query (default 8, more for small batches; 1 traces pass by pass)\n"
+    << "        --queries_in_flight <n>         Batches traced at once on each device, each by its own query and stream (default 2, at most 8)\n"
+    << "        --latency_budget <ms>           Share the GPU with interactive work: keep each submission to about ms milliseconds of\n"
+    << "                                        device time at low stream priority, yielding in between (Prime tracer)\n"
+    << "        --peer_geometry                 Store the occluders' vertices and indices once, spread over the devices, which read each\n"
+    << "                                        other's through peer access (NVLink), instead of a copy on each (Prime tracer)\n"
+    << "        --managed_geometry              Keep the occluders' vertices and indices in unified memory, so scenes larger than device\n"
+    << "                                        memory trace at reduced speed instead of failing (Prime tracer)\n"
+    << "        --mesh_library_mb <n>           Keep the accels of up to n MB of mesh geometry per device for later batch jobs, which\n"
+    << "                                        build only the meshes they don't share with earlier ones (Prime tracer)\n"
+    << "        --far_field <f>                 Trace rays only fraction f of the hit distance, and estimate the occlusion beyond by\n"
+    << "                                        cone tracing a voxel volume of the occluders; faster for long hit distances (Prime tracer)\n"
+    << "        --far_field_resolution <n>      Voxels along the longest side of the far field volume (default 128, 16 to 1024)\n"
+    << "        --adaptive <e>                  Stop tracing a sample once the standard error of its AO is below e (default 0: trace all rays)\n"
+    << "        --time_budget <s>               Trace progressively, a pass group of rays over all samples at a time, and stop before the first\n"
+    << "                                        group that would not finish within s seconds of tracing\n"
+    << "        --snapshot <s>                  Trace progressively, and save the estimate so far to <vertex_ao_file> every s seconds\n"
+    << "        --live                          Trace progressively with the viewer open, showing the estimate after every pass group;\n"
+    << "                                        closing the viewer stops the trace.  Once it is done, [ ] change the hit distance, - +\n"
+    << "                                        the rays and , . the ground offset, and bake again on the same samples and accels\n"
+    << "        --denoise <k>                   Smooth the traced sample AO on the device with a bilateral filter k mean sample spacings\n"
+    << "                                        across, guided by sample positions and normals, so fewer rays give the same noise\n"
+    << "        --ao_cache <k>                  Trace one sample per cell k hit distances across and normal direction, and interpolate\n"
+    << "                                        the others from these along fitted gradients where those predict the cells around\n"
+    << "                                        within --ao_cache_error; trace all samples of the other cells\n"
+    << "        --ao_cache_error <e>            AO error up to which a cell of --ao_cache is interpolated (default 0.03)\n"
+    << "        --devices <d0,d1,...>           CUDA devices to trace on (default all visible devices)\n"
+    << "        --gpu_sampling                  Place sample points on the device instead of storing them on the host\n"
+    << "        --vertex_samples                Trace one sample at each vertex and save its AO without filtering, for previews and dense\n"
+    << "                                        meshes.  Ignores -s, -t and the filter options.\n"
+    << "        --variance_sampling <n>         Trace a pilot of the minimum samples per face with n rays each, and place the extra samples\n"
+    << "                                        by area times the variance of its AO instead of by area\n"
+    << "        --sample_templates              Sample each mesh once in mesh space and place the same samples on all of its rigid or\n"
+    << "                                        uniformly scaled instances that get the same sample count\n"
+    << "        --compact_samples               Store sample infos with 16 bit barycentrics and area per triangle\n"
+    << "        --share_mesh_ao                 Bake one representative instance per mesh, against the full scene, and share its AO with all instances of the mesh\n"
+    << "        --sort_samples                  Trace host samples in Morton order of position and normal octant, for coherent rays\n"
+    << "        --reconstruct_samples           Upload host samples as instance, triangle and 16 bit barycentrics, 12 bytes instead of 24,\n"
+    << "                                        and rebuild positions and normals on the device (Prime tracer)\n"
+    << "        --tiled <k>                     Trace samples in cubic tiles k hit distances across, each against accels of only the occluders\n"
+    << "                                        within a hit distance of it, built for the tile and released after it.  For scenes much larger\n"
+    << "                                        than the hit distance.\n"
+    << "        --pinned_memory                 Keep samples and AO values in page locked host memory, for direct device copies\n"
+    << "        --merge_occluders <n>           Trace meshes with fewer than n triangles and a single instance as merged occluders (default " << MERGE_OCCLUDER_TRIANGLES << ", 0 disables)\n"
+    << "        --proxy_occluders <f>           Trace meshes of at least " << PROXY_OCCLUDER_TRIANGLES << " triangles as simplified proxies with about fraction f of\n"
+    << "                                        their triangles, for far field occlusion; samples stay on the full meshes\n"
+    << "        --proxy_cache <dir>             Keep proxy occluder meshes in this existing directory, for later bakes\n"
+    << "        --part_cache <dir>              Take the AO of instances with nothing else within the hit distance from the AO of their mesh\n"
+    << "                                        alone, kept in this existing directory by mesh content; missing meshes are baked and added\n"
+    << "        --result_cache <dir>            Copy the output file from this existing directory if an earlier bake had the same scene\n"
+    << "                                        content and output settings, skipping the bake; otherwise bake and add it\n"
+    << "        --result_cache_mb <n>           Remove the least recently used results beyond n MB of --result_cache (default " << RESULT_CACHE_MB << ", 0 no limit)\n"
+    << "        --accel_preset <p>              Accel build speed against query speed: fast, balanced or quality (default balanced).  Fast skips\n"
+    << "                                        occluder merging and Prime's triangle copy of large meshes, quality merges more occluders\n"
+    << "        --backend <b>                   Ray tracer: auto, prime, optix, embree or hybrid (default auto: OptiX on devices with ray tracing\n"
+    << "                                        cores if built with an OptiX 7 SDK, Embree with --no_gpu if built with Embree, else OptiX Prime).\n"
+    << "                                        Hybrid traces with Embree on the host and the devices at once, sharing out batches\n"
+    << "        --weld                          Filter each mesh with its copies of a vertex at UV and normal seams welded into one, so\n"
+    << "                                        they get the same AO and the filters solve for fewer vertices\n"
+    << "        --weld_tolerance <t>            Weld vertices less than about t times the bbox diagonal of their mesh apart (implies --weld,\n"
+    << "                                        default 0: equal positions only)\n"
 #ifdef EIGEN3_ENABLED
     << "  -w  | --regularization_weight <w>     Regularization weight for least squares, positive range. (default " << REGULARIZATION_WEIGHT << ")\n"
+    << "                                        A list w0,w1,... filters each instance's assembled system for every weight; w0 goes to the\n"
+    << "                                        outfile and viewer, wk to <vertex_ao_file>.w<k>\n"
     << "        --no_least_squares              Disable least squares filtering\n"
+    << "        --gpu_least_squares             Solve least squares filtering with conjugate gradients on the device\n"
+    << "        --matrix_free_least_squares     Solve least squares filtering iteratively on the host, without assembling matrices\n"
+    << "        --float_least_squares           Factorize least squares filtering in float, falling back to double if inaccurate\n"
+    << "        --cpu_cg_least_squares          Solve least squares filtering with preconditioned conjugate gradients on the host,\n"
+    << "                                        multithreaded inside each large mesh, without factorizing\n"
+    << "        --cg_preconditioner <name>      Preconditioner of --cpu_cg_least_squares: jacobi (default), or ichol, incomplete\n"
+    << "                                        Cholesky, for fewer but sequential iterations\n"
+    << "        --cg_tolerance <t>              Relative residual at which conjugate gradient filters stop (default " << CG_TOLERANCE << ")\n"
+    << "        --warm_start <vertex_ao_file>   Start the iterative least squares solves from the vertex AO of an earlier bake, matched\n"
+    << "                                        by storage identifier, e.g. to refilter after small changes in few iterations\n"
+    << "        --analytic_mass <t>             Blend of analytic per-triangle mass matrix into the sampled one, in [0,1] (default 0)\n"
+    << "        --ls_solver <name>              Factorization of large meshes for least squares filtering: simplicial (default), or the\n"
+    << "                                        multithreaded supernodal cholmod or pardiso, if the build found them\n"
+    << "        --ls_ordering <name>            Fill reducing ordering of simplicial least squares factorizations: amd (default),\n"
+    << "                                        colamd, metis if the build found it, geometric, or auto for the fewest nonzeros per mesh\n"
+    << "        --ls_patches <n>                Least squares filter meshes of more than 2n vertices as overlapping patches of about n\n"
+    << "                                        vertices, solved in parallel and blended, for bounded memory per solve\n"
 #endif
     << std::endl
     << "Viewer keys:\n"
+    << "   c                                    Frustum culling on/off\n"
     << "   e                                    Draw mesh edges on/off\n"
     << "   f                                    Frame scene\n"
     << "   q                                    Quit\n"
@@ -283,62 +1489,78 @@ struct Config {
     exit(1);
   }
   
+  // Lines of "<id> <rays>" or "<first>-<last> <rays>"; # starts a comment
+  bool readInstanceRays( const char* filename )
+  {
+    std::ifstream file( filename );
+    if ( !file ) return false;
+    std::string line;
+    while ( std::getline( file, line ) ) {
+      const std::string text = line.substr( 0, line.find( '#' ) );
+      if ( text.find_first_not_of( " \t\r" ) == std::string::npos ) continue;
+      unsigned long long first = 0, last = 0;
+      int rays = 0;
+      if ( sscanf( text.c_str(), "%llu-%llu %d", &first, &last, &rays ) != 3 ) {
+        if ( sscanf( text.c_str(), "%llu %d", &first, &rays ) != 2 ) return false;
+        last = first;
+      }
+      if ( rays < 1 || last < first ) return false;
+      instance_ray_ranges.push_back( first );
+      instance_ray_ranges.push_back( last );
+      instance_ray_counts.push_back( rays );
+    }
+    return true;
+  }
+
   void printParseErrorAndExit( const char* argv0, const std::string& flag, const char* arg )
   {
     std::cerr << "Could not parse argument: " << flag << " " << arg << std::endl;
     printUsageAndExit( argv0 );
   }
 
-
-};
-
-namespace {
-
-  void xform_bbox(const optix::Matrix4x4& mat, const float in_min[3], const float in_max[3],
-                  float out_min[3], float out_max[3])
+  // Rank and size of this process from the environment of Open MPI, MPICH/Intel MPI or Slurm, without linking MPI
+  static bool launcherRankAndSize( unsigned long long& rank, unsigned long long& size )
   {
-    float4 a = mat*optix::make_float4( in_min[0], in_min[1], in_min[2], 1.0f);
-    float4 b = mat*optix::make_float4( in_max[0], in_max[1], in_max[2], 1.0f);
-    for (size_t k = 0; k < 3; ++k) {
-      out_min[k] = (&a.x)[k];
-      out_max[k] = (&b.x)[k];
+    const char* const variables[][2] = {
+      { "OMPI_COMM_WORLD_RANK", "OMPI_COMM_WORLD_SIZE" },
+      { "PMI_RANK", "PMI_SIZE" },
+      { "SLURM_PROCID", "SLURM_NTASKS" }
+    };
+    for (size_t i = 0; i < sizeof(variables)/sizeof(variables[0]); ++i) {
+      const char* r = getenv( variables[i][0] );
+      const char* n = getenv( variables[i][1] );
+      if ( r && n ) {
+        return sscanf( r, "%llu", &rank ) == 1 && sscanf( n, "%llu", &size ) == 1;
+      }
     }
+    return false;
   }
 
-  void expand_bbox(float bbox_min[3], float bbox_max[3], float v[3])
-  {
-    for (size_t k = 0; k < 3; ++k) {
-      bbox_min[k] = std::min(bbox_min[k], v[k]);
-      bbox_max[k] = std::max(bbox_max[k], v[k]);
-    }
-  }
+
+};
+
+namespace {
 
   void set_vertex_entry(float* vertices, int idx, int axis, float* vec)
   {
     vertices[3 * idx + axis] = vec[axis];
   }
 
-  void make_ground_plane(float scene_bbox_min[3], float scene_bbox_max[3],
-                         unsigned upaxis, float scale_factor, float offset_factor,
-                         unsigned scene_vertex_stride_bytes,
-                         std::vector<float>& plane_vertices, std::vector<unsigned int>& plane_indices,
-                         std::vector<bake::Mesh>& meshes, std::vector<bake::Instance>& instances)
+  // Bounds of the ground plane rectangle, flat along the returned axis
+  unsigned ground_plane_bounds(const float scene_bbox_min[3], const float scene_bbox_max[3],
+                               unsigned upaxis, float scale_factor, float offset_factor,
+                               float ground_min[3], float ground_max[3])
   {
-
-    const unsigned int index_data[] = {0, 1, 2, 0, 2, 3, 2, 1, 0, 3, 2, 0};
-    unsigned int num_indices = sizeof(index_data) / sizeof(index_data[0]);
-    plane_indices.resize(num_indices);
-    std::copy(index_data, index_data + num_indices, plane_indices.begin());
     float scene_extents[] = {scene_bbox_max[0] - scene_bbox_min[0],
                              scene_bbox_max[1] - scene_bbox_min[1],
                              scene_bbox_max[2] - scene_bbox_min[2]};
     
-    float ground_min[] = {scene_bbox_max[0] - scale_factor*scene_extents[0],
-                          scene_bbox_min[1] - scale_factor*scene_extents[1],
-                          scene_bbox_max[2] - scale_factor*scene_extents[2]};
-    float ground_max[] = {scene_bbox_min[0] + scale_factor*scene_extents[0],
-                          scene_bbox_min[1] + scale_factor*scene_extents[1],
-                          scene_bbox_min[2] + scale_factor*scene_extents[2]};
+    ground_min[0] = scene_bbox_max[0] - scale_factor*scene_extents[0];
+    ground_min[1] = scene_bbox_min[1] - scale_factor*scene_extents[1];
+    ground_min[2] = scene_bbox_max[2] - scale_factor*scene_extents[2];
+    ground_max[0] = scene_bbox_min[0] + scale_factor*scene_extents[0];
+    ground_max[1] = scene_bbox_min[1] + scale_factor*scene_extents[1];
+    ground_max[2] = scene_bbox_min[2] + scale_factor*scene_extents[2];
 
     if (upaxis > 2){
       upaxis %= 3;
@@ -349,6 +1571,23 @@ namespace {
       ground_min[upaxis] = scene_bbox_min[upaxis] - scene_extents[upaxis] * offset_factor;
       ground_max[upaxis] = scene_bbox_min[upaxis] - scene_extents[upaxis] * offset_factor;
     }
+    return upaxis;
+  }
+
+  void make_ground_plane(float scene_bbox_min[3], float scene_bbox_max[3],
+                         unsigned upaxis, float scale_factor, float offset_factor,
+                         std::vector<float>& plane_vertices, std::vector<unsigned int>& plane_indices,
+                         std::vector<bake::Mesh>& meshes, std::vector<bake::Instance>& instances)
+  {
+
+    const unsigned int index_data[] = {0, 1, 2, 0, 2, 3, 2, 1, 0, 3, 2, 0};
+    unsigned int num_indices = sizeof(index_data) / sizeof(index_data[0]);
+    plane_indices.resize(num_indices);
+    std::copy(index_data, index_data + num_indices, plane_indices.begin());
+
+    float ground_min[3];
+    float ground_max[3];
+    upaxis = ground_plane_bounds(scene_bbox_min, scene_bbox_max, upaxis, scale_factor, offset_factor, ground_min, ground_max);
 
     int axis0 = (upaxis + 2) % 3;
     int axis1 = (upaxis + 1) % 3;
@@ -370,27 +1609,18 @@ namespace {
     set_vertex_entry(vertex_data, 3, axis0, ground_min);
     set_vertex_entry(vertex_data, 3, axis1, ground_max);
     
-
-
-    // OptiX Prime requires all meshes in the same scene to have the same vertex stride.
-    const unsigned vertex_stride_bytes = scene_vertex_stride_bytes > 0 ? scene_vertex_stride_bytes : 3*sizeof(float);
-    assert(vertex_stride_bytes % sizeof(float) == 0);
-    const unsigned num_floats_per_vert = vertex_stride_bytes / sizeof(float);
-    plane_vertices.resize(4*(num_floats_per_vert));
-    std::fill(plane_vertices.begin(), plane_vertices.end(), 0.0f);
-    for (size_t i = 0; i < 4; ++i) {
-      plane_vertices[num_floats_per_vert*i  ] = vertex_data[3*i];
-      plane_vertices[num_floats_per_vert*i+1] = vertex_data[3*i+1];
-      plane_vertices[num_floats_per_vert*i+2] = vertex_data[3*i+2];
-    }
+    plane_vertices.assign(vertex_data, vertex_data + 4*3);
     
     bake::Mesh plane_mesh;
     plane_mesh.num_vertices  = 4;
     plane_mesh.num_triangles = num_indices/3;
     plane_mesh.vertices      = &plane_vertices[0];
-    plane_mesh.vertex_stride_bytes = vertex_stride_bytes;
+    plane_mesh.vertex_stride_bytes = 3*sizeof(float);
     plane_mesh.normals       = NULL;
     plane_mesh.normal_stride_bytes = 0;
+    plane_mesh.texcoords     = NULL;
+    plane_mesh.texcoord_stride_bytes = 0;
+    plane_mesh.geometry_memory = bake::MEMORY_SPACE_HOST;
     plane_mesh.tri_vertex_indices = &plane_indices[0];
     
     bake::Instance instance;
@@ -410,65 +1640,160 @@ namespace {
 
   }
 
-  void allocate_ao_samples(bake::AOSamples& ao_samples, size_t n) {
+  void allocate_ao_samples(bake::AOSamples& ao_samples, size_t n, const bake::Scene& scene, bool gpu_sampling, bool compact_samples, bool pinned,
+                           bool sample_infos = true, bool sample_instances = false) {
     ao_samples.num_samples = n;
-    ao_samples.sample_positions = new float[3*n];
-    ao_samples.sample_normals = new float[3*n];
-    ao_samples.sample_face_normals = new float[3*n];
-    ao_samples.sample_infos = new bake::SampleInfo[n];
+    ao_samples.first_sample_index = 0;
+    ao_samples.sample_memory = bake::MEMORY_SPACE_HOST;
+    ao_samples.ao_memory = bake::MEMORY_SPACE_HOST;
+    size_t num_triangles = 0;
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      num_triangles += scene.meshes[scene.instances[i].mesh_index].num_triangles;
+    }
+    if (!sample_infos) {
+      // Vertex samples go to the vertices as they are
+      ao_samples.sample_infos = NULL;
+      ao_samples.compact_sample_infos = NULL;
+      ao_samples.tri_sample_dA = NULL;
+    } else if (compact_samples) {
+      ao_samples.sample_infos = NULL;
+      ao_samples.compact_sample_infos = static_cast<bake::CompactSampleInfo*>( bake::allocateHostMemory( n*sizeof(bake::CompactSampleInfo), false ) );
+      ao_samples.tri_sample_dA = static_cast<float*>( bake::allocateHostMemory( num_triangles*sizeof(float), false ) );
+    } else {
+      ao_samples.sample_infos = static_cast<bake::SampleInfo*>( bake::allocateHostMemory( n*sizeof(bake::SampleInfo), false ) );
+      ao_samples.compact_sample_infos = NULL;
+      ao_samples.tri_sample_dA = NULL;
+    }
+    if (gpu_sampling) {
+      // Only per-triangle counts are kept; computeAO places the samples on the device
+      ao_samples.sample_positions = NULL;
+      ao_samples.sample_normals = NULL;
+      ao_samples.sample_face_normals = NULL;
+      ao_samples.tri_sample_counts = static_cast<unsigned*>( bake::allocateHostMemory( num_triangles*sizeof(unsigned), false ) );
+    } else {
+      ao_samples.sample_positions = static_cast<float*>( bake::allocateHostMemory( 3*n*sizeof(float), pinned ) );
+      ao_samples.sample_normals = static_cast<float*>( bake::allocateHostMemory( 3*n*sizeof(float), pinned ) );
+      ao_samples.sample_face_normals = static_cast<float*>( bake::allocateHostMemory( 3*n*sizeof(float), pinned ) );
+      ao_samples.tri_sample_counts = NULL;
+    }
+    ao_samples.sample_instances = sample_instances ? static_cast<unsigned*>( bake::allocateHostMemory( n*sizeof(unsigned), false ) ) : NULL;
   }
 
-  void destroy_ao_samples(bake::AOSamples& ao_samples) {
-    delete [] ao_samples.sample_positions;
+  // Zeroed AO values, in pinned host memory if asked for, so the tracers copy them straight from the device
+  struct AOValues {
+    AOValues( size_t n, bool pinned ) : values( static_cast<float*>( bake::allocateHostMemory( n*sizeof(float), pinned ) ) ) {
+#pragma omp parallel for if(n >= (1 << 20))
+      for (ptrdiff_t i = 0; i < ptrdiff_t(n); ++i) values[i] = 0.0f;
+    }
+    ~AOValues() { release(); }
+    void release() { bake::freeHostMemory( values ); values = NULL; }
+    float& operator[]( size_t i ) { return values[i]; }
+    float* values;
+  private:
+    AOValues( const AOValues& );             // forbidden
+    AOValues& operator=( const AOValues& );  // forbidden
+  };
+
+  // Vertex AO of an instance.  Arrays of giant meshes come from the large host allocator like the sample arrays; the
+  // rest stay plain, and free without asking CUDA about the pointer.
+  float* allocate_vertex_ao( size_t num_vertices ) {
+    const size_t bytes = std::max( num_vertices, size_t(1) )*sizeof(float);
+    void* ptr = bytes >= LARGE_HOST_ALLOCATION ? allocateLargeHostMemory( bytes, false ) : NULL;
+    return static_cast<float*>( ptr ? ptr : std::malloc( bytes ) );
+  }
+
+  void free_vertex_ao( float* vertex_ao ) {
+    if ( !freeLargeHostMemory( vertex_ao ) ) std::free( vertex_ao );
+  }
+
+  // The area based filter can run on the device, during the trace, when the samples are placed there too
+  bool splat_on_device( const Config& config, const bake::AOSamples& ao_samples ) {
+    return ao_samples.sample_positions == NULL && config.filter_mode == bake::VERTEX_FILTER_AREA_BASED && config.hit_distances.empty() && 
+      !config.two_sided && !config.bent_normals && !config.sh_visibility && config.weld_tolerance < 0.0f && 
+      config.save_samples_filename.empty() && config.load_samples_filename.empty();
+  }
+
+  // Positions and normals are only traced; the filters need just the sample infos and the AO values
+  void release_sample_geometry(bake::AOSamples& ao_samples) {
+    bake::freeHostMemory( ao_samples.sample_positions );
     ao_samples.sample_positions = NULL;
-    delete [] ao_samples.sample_normals;
+    bake::freeHostMemory( ao_samples.sample_normals );
     ao_samples.sample_normals = NULL;
-    delete [] ao_samples.sample_face_normals;
+    bake::freeHostMemory( ao_samples.sample_face_normals );
     ao_samples.sample_face_normals = NULL;
-    delete [] ao_samples.sample_infos;
+  }
+
+  void destroy_ao_samples(bake::AOSamples& ao_samples) {
+    release_sample_geometry( ao_samples );
+    bake::freeHostMemory( ao_samples.sample_infos );
     ao_samples.sample_infos = NULL;
+    bake::freeHostMemory( ao_samples.tri_sample_counts );
+    ao_samples.tri_sample_counts = NULL;
+    bake::freeHostMemory( ao_samples.compact_sample_infos );
+    ao_samples.compact_sample_infos = NULL;
+    bake::freeHostMemory( ao_samples.tri_sample_dA );
+    ao_samples.tri_sample_dA = NULL;
+    bake::freeHostMemory( ao_samples.sample_instances );
+    ao_samples.sample_instances = NULL;
     ao_samples.num_samples = 0;
   }
 
-  bool save_results(const char* outputfile, bake::Scene & scene, const float* const * ao_vertex)
+  // Vertex AO of instances [begin, end) in the vertex order of the scene file, for output.  Copies are only made when 
+  // --reorder_meshes changed the order.
+  const float* const* in_loaded_order( const Config& config, const bake::Scene& scene, const size_t begin, const size_t end, 
+    const float* const* ao_vertex, std::vector< std::vector<float> >& copies, std::vector<const float*>& ptrs )
   {
-    FILE* file = fopen(outputfile, "wb");
-    if (!file) return false;
-
-    uint64_t numInstances = scene.num_instances;
-    uint64_t numVertices = 0;
-    
-    for (size_t i = 0; i < scene.num_instances; i++){
-      numVertices += scene.meshes[scene.instances[i].mesh_index].num_vertices;
+    if (!config.loaded_vertex_order) return ao_vertex;
+    copies.resize( scene.num_instances );
+    ptrs.assign( ao_vertex, ao_vertex + scene.num_instances );
+#pragma omp parallel for schedule(dynamic)
+    for (ptrdiff_t i = ptrdiff_t(begin); i < ptrdiff_t(end); ++i) {
+      const unsigned mesh_index = scene.instances[i].mesh_index;
+      const unsigned* order = config.loaded_vertex_order[mesh_index];
+      const size_t n = scene.meshes[mesh_index].num_vertices;
+      if (!ao_vertex[i] || n == 0) continue;
+      copies[i].resize( n );
+      for (size_t v = 0; v < n; ++v) copies[i][order[v]] = ao_vertex[i][v];
+      ptrs[i] = &copies[i][0];
     }
+    return &ptrs[0];
+  }
 
-    // write header
-    fwrite(&numInstances, sizeof(numInstances), 1, file);
-    fwrite(&numVertices, sizeof(numVertices), 1, file);
-    
-    // write instances
-
-    uint64_t vertexOffset = 0;
-    for (size_t i = 0; i < scene.num_instances; i++){
-      uint64_t identifier = scene.instances[i].storage_identifier;
-      fwrite(&identifier, sizeof(identifier), 1, file);
-      fwrite(&vertexOffset, sizeof(vertexOffset), 1, file);
-      numVertices = scene.meshes[scene.instances[i].mesh_index].num_vertices;
-      fwrite(&numVertices, sizeof(numVertices), 1, file);
-
-      vertexOffset += numVertices;
+  bool save_results(const Config& config, bake::Scene & scene, const float* const * ao_vertex, size_t& num_shared_instances)
+  {
+    ProfileRange range("save vertex ao", PROFILE_COLOR_SAVE, uint64_t(scene.num_instances));
+    if (!config.patch_base_filename.empty()) {
+      std::vector< std::vector<float> > copies;
+      std::vector<const float*> ptrs;
+      size_t num_changed = 0;
+      num_shared_instances = 0;
+      const bool patched = bake::writeVertexAOPatch(config.output_filename.c_str(), config.patch_base_filename.c_str(), scene,
+        in_loaded_order(config, scene, 0, scene.num_instances, ao_vertex, copies, ptrs), &num_changed);
+      if (patched) std::cerr << "Patch against " << config.patch_base_filename << " holds " << num_changed << " changed instances" << std::endl;
+      return patched;
     }
+    bake::VertexAOWriter writer;
+    if (!writer.open(config.output_filename.c_str(), scene, config.output_bits, config.compress_output, config.output_index)) return false;
+    std::vector< std::vector<float> > copies;
+    std::vector<const float*> ptrs;
+    const bool appended = writer.append(scene, 0, scene.num_instances, in_loaded_order(config, scene, 0, scene.num_instances, ao_vertex, copies, ptrs));
+    num_shared_instances = writer.numSharedInstances();
+    return writer.close() && appended;
+  }
 
-    // write vertices
-    for (size_t i = 0; i < scene.num_instances; i++){
-      numVertices = scene.meshes[scene.instances[i].mesh_index].num_vertices;
-      fwrite(ao_vertex[i], sizeof(float)*numVertices, 1, file);
+  // Results baked into a mapped output file: instances that share the AO of a representative get a copy in their own 
+  // slot, and the mapping is written back
+  bool save_mapped_results(bake::MappedVertexAOFile& file, const bake::Scene& scene, const float* const* ao_vertex)
+  {
+    ProfileRange range("save vertex ao", PROFILE_COLOR_SAVE, uint64_t(scene.num_instances));
+#pragma omp parallel for schedule(dynamic)
+    for (ptrdiff_t i = 0; i < ptrdiff_t(scene.num_instances); ++i) {
+      float* slot = file.vertexAO(i);
+      if (ao_vertex[i] != slot) {
+        std::copy(ao_vertex[i], ao_vertex[i] + scene.meshes[scene.instances[i].mesh_index].num_vertices, slot);
+      }
     }
-    
-    fflush(file);
-    fclose(file);
-
-    return true;
+    return file.flush();
   }
 
   // Concat two scenes using shallow copies for all buffers
@@ -493,123 +1818,24 @@ namespace {
     scene.instances = &instances[0];
   }
 
-}
-
-
-
-// Required entry point
-//------------------------------------------------------------------------------
-int sample_main( int argc, const char** argv )
-{
-  
-  // show console and redirect printing
-  NVPWindow::sysVisibleConsole();
-
-  const Config config( argc, argv ); 
-  
-  Timer timer;
-
-  //
-  // Load scene
-  //
-  std::cerr << "Load scene ...              "; std::cerr.flush();
-
-  timer.start();
-
-  bake::Scene scene;
-  SceneMemory* scene_memory;
-  float scene_bbox_min[] = {FLT_MAX, FLT_MAX, FLT_MAX};
-  float scene_bbox_max[] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
-  if (!load_scene( config.scene_filename.c_str(), scene, scene_bbox_min, scene_bbox_max, scene_memory, config.num_instances_per_mesh )) {
-    std::cerr << "Failed to load scene, exiting" << std::endl;
-    exit(-1);
-  }
-
-  printTimeElapsed( timer ); 
-
-  // Print scene stats
+  // The -f scene, or all of them, loaded concurrently and concatenated
+  bool load_input_scene( const Config& config, bake::Scene& scene, float scene_bbox_min[3], float scene_bbox_max[3], SceneMemory*& memory )
   {
-    std::cerr << "Loaded scene: " << config.scene_filename << std::endl;
-    std::cerr << "\t" << scene.num_meshes << " meshes, " << scene.num_instances << " instances" << std::endl;
-    size_t num_vertices = 0;
-    size_t num_triangles = 0;
-    for (size_t i = 0; i < scene.num_meshes; ++i) {
-      num_vertices += scene.meshes[i].num_vertices;
-      num_triangles += scene.meshes[i].num_triangles;
-    }
-    std::cerr << "\tuninstanced vertices: " << num_vertices << std::endl;
-    std::cerr << "\tuninstanced triangles: " << num_triangles << std::endl;
-  }
-
-  // OptiX Prime requires all instances to have the same vertex stride
-  for (size_t i = 1; i < scene.num_meshes; ++i) {
-    if (scene.meshes[i].vertex_stride_bytes != scene.meshes[0].vertex_stride_bytes) {
-      std::cerr << "Error: all meshes must have the same vertex stride.  Bailing.\n";
-      exit(-1);
+    if (config.scene_filenames.size() > 1) {
+      return load_scenes( config.scene_filenames, scene, scene_bbox_min, scene_bbox_max, memory, config.num_instances_per_mesh, config.split_obj_groups );
     }
+    return load_scene( config.scene_filename.c_str(), scene, scene_bbox_min, scene_bbox_max, memory, config.num_instances_per_mesh, config.split_obj_groups );
   }
 
-  if (config.flip_orientation){
-    for (size_t m = 0; m < scene.num_meshes; ++m) {
-      bake::Mesh& mesh = scene.meshes[m];
-      for (size_t i = 0; i < mesh.num_triangles; i++){
-        std::swap(mesh.tri_vertex_indices[i * 3 + 0], mesh.tri_vertex_indices[i * 3 + 2]);
-      }
-      if (mesh.normals){
-        size_t stride = mesh.normal_stride_bytes / sizeof(float);
-        for (size_t i = 0; i < mesh.num_vertices; i++){
-          mesh.normals[i * stride + 0] *= -1.0;
-          mesh.normals[i * stride + 1] *= -1.0;
-          mesh.normals[i * stride + 2] *= -1.0;
-        }
-      }
-    }
-  }
-
-
-  //
-  // Generate AO samples
-  //
-
-  std::cerr << "Minimum samples per face: " << config.min_samples_per_face << std::endl;
-
-  std::cerr << "Generate sample points ... \n"; std::cerr.flush();
-
-  timer.reset();
-  timer.start();
-  
-
-  std::vector<size_t> num_samples_per_instance(scene.num_instances);
-  const size_t total_samples = bake::distributeSamples( scene, config.min_samples_per_face, config.num_samples, &num_samples_per_instance[0] );
-
-  bake::AOSamples ao_samples;
-  allocate_ao_samples( ao_samples, total_samples );
-
-  bake::sampleInstances( scene, &num_samples_per_instance[0], config.min_samples_per_face, ao_samples );
-  
-  printTimeElapsed( timer ); 
-
-  std::cerr << "Total samples: " << total_samples << std::endl;
+  std::string scene_label( const Config& config )
   {
-    const int sqrt_num_rays = static_cast<int>( sqrtf( static_cast<float>( config.num_rays ) ) + .5f );
-    std::cerr << "Rays per sample: " << sqrt_num_rays * sqrt_num_rays << std::endl;
-    std::cerr << "Total rays: " << total_samples * sqrt_num_rays * sqrt_num_rays << std::endl;
+    std::string label = config.scene_filename;
+    for (size_t i = 1; i < config.scene_filenames.size(); ++i) label += ", " + config.scene_filenames[i];
+    return label;
   }
 
-  //
-  // Evaluate AO samples 
-  //
-  std::cerr << "Compute AO ...             "; std::cerr.flush();
-  
-  timer.reset();
-  timer.start();
-
-  std::vector<float> ao_values( total_samples );
-  std::fill(ao_values.begin(), ao_values.end(), 0.0f);
-
-
-  float scene_maxdistance;
-  float scene_offset;
+  void scene_distances( const Config& config, const float scene_bbox_min[3], const float scene_bbox_max[3],
+    float& scene_offset, float& scene_maxdistance )
   {
     const float scene_scale = std::max(std::max(scene_bbox_max[0] - scene_bbox_min[0],
                                                 scene_bbox_max[1] - scene_bbox_min[1]),
@@ -624,74 +1850,3690 @@ int sample_main( int argc, const char** argv )
     }
   }
 
-  if (config.use_ground_plane_blocker) {
-    // Add blocker for ground plane (no surface samples)
+  // The scene plus the optional context scene and ground plane blocker (no surface samples), keeping the scene's
+  // mesh and instance indices
+  struct Occluders {
+    std::vector<bake::ProxyMesh> proxies;
+    std::vector<bake::Mesh> proxy_meshes;         // scene meshes, with the proxies in place of the simplified ones
+    std::vector<float> merged_vertices;
+    std::vector<unsigned int> merged_indices;
+    std::vector<bake::Mesh> merged_meshes;
+    std::vector<bake::Mesh> base_meshes;          // scene meshes still instanced, then merged meshes
+    std::vector<bake::Instance> base_instances;   // instances that were not merged, then one per merged mesh
+    std::vector<bake::Mesh> context_meshes;       // base meshes, then the context scene's
+    std::vector<bake::Instance> context_instances;
+    bake::Scene context;                          // the context scene on its own, for checkpoint hashes
     std::vector<bake::Mesh> blocker_meshes;
     std::vector<bake::Instance> blocker_instances;
     std::vector<float> plane_vertices;
     std::vector<unsigned int> plane_indices;
-    make_ground_plane(scene_bbox_min, scene_bbox_max, config.ground_upaxis, config.ground_scale_factor, config.ground_offset_factor,
-      scene.meshes[0].vertex_stride_bytes, 
-      plane_vertices, plane_indices, blocker_meshes, blocker_instances);
-    bake::Scene blockers = { &blocker_meshes[0], blocker_meshes.size(), &blocker_instances[0], blocker_instances.size() };
-
-    bake::Scene combined_scene;
     std::vector<bake::Mesh> combined_meshes;
     std::vector<bake::Instance> combined_instances;
-    concat_scenes( scene, blockers, combined_scene, combined_meshes, combined_instances );
-    bake::computeAO(combined_scene,
-      ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.use_cpu, config.conserve_memory, &ao_values[0]);
-  } else {
-    bake::computeAO(scene, 
-      ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.use_cpu, config.conserve_memory, &ao_values[0]);
-  }
-  printTimeElapsed( timer ); 
+    bake::Scene scene;
+    bool analytic_ground;               // the ground plane is tested in ray generation instead of being in the scene
+    bake::GroundPlane ground_plane;
 
-  std::cerr << "Map AO to vertices  ...    "; std::cerr.flush();
-
-  timer.reset();
-  timer.start();
-  float** vertex_ao = new float*[ scene.num_instances ];
-  for (size_t i = 0; i < scene.num_instances; ++i ) {
-    vertex_ao[i] = new float[ scene.meshes[scene.instances[i].mesh_index].num_vertices ];
-  }
-  bake::mapAOToVertices( scene, &num_samples_per_instance[0], ao_samples, &ao_values[0], config.filter_mode, config.regularization_weight, vertex_ao );
+    Occluders() : analytic_ground( false ) { context.num_meshes = context.num_instances = 0; }
 
-  printTimeElapsed( timer ); 
+    const bake::GroundPlane* analytic_ground_plane() const { return analytic_ground ? &ground_plane : NULL; }
+  };
 
-  if (!config.output_filename.empty())
+  // Occluders for tracing only: meshes with fewer than max_triangles and a single instance are transformed to world
+  // space and merged, in Morton order of their bbox centers, into a few meshes of up to MERGED_OCCLUDER_TRIANGLES.
+  // Thousands of tiny models otherwise dominate both the top level accel and per-model overhead.  Meshes with
+  // several instances stay instanced.  Samples and filtering still use the original scene.
+  void merge_small_occluders( const bake::Scene& scene, const size_t max_triangles, const float scene_bbox_min[3], const float scene_bbox_max[3],
+                              Occluders& occluders, bake::Scene& merged )
   {
-    std::cerr << "Save vertex ao ...              "; std::cerr.flush();
-    timer.reset();
-    timer.start();
-    bool saved = save_results(config.output_filename.c_str(), scene, vertex_ao);
-    printTimeElapsed(timer);
-    if (saved){
-      std::cerr << "Saved vertex ao to: " << config.output_filename << std::endl;
+    merged = scene;
+    std::vector<size_t> instances_per_mesh( scene.num_meshes, 0 );
+    for (size_t i = 0; i < scene.num_instances; ++i) instances_per_mesh[scene.instances[i].mesh_index]++;
+
+    std::vector< std::pair<unsigned, size_t> > candidates;  // Morton code, instance
+    float extent[3];
+    for (int k = 0; k < 3; ++k) extent[k] = std::max( scene_bbox_max[k] - scene_bbox_min[k], FLT_MIN );
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      const bake::Instance& instance = scene.instances[i];
+      if (instances_per_mesh[instance.mesh_index] != 1 || scene.meshes[instance.mesh_index].num_triangles >= max_triangles) continue;
+      unsigned cell[3];
+      for (int k = 0; k < 3; ++k) {
+        const float t = (0.5f*(instance.bbox_min[k] + instance.bbox_max[k]) - scene_bbox_min[k]) / extent[k];
+        cell[k] = unsigned( std::min( std::max( t, 0.0f ), 1.0f ) * 1023.0f );
+      }
+      candidates.push_back( std::make_pair( mortonCode( cell[0], cell[1], cell[2] ), i ) );
     }
-    else{
-      std::cerr << "Failed to save vertex ao to: " << config.output_filename << std::endl;
-    }    
+    if (candidates.size() < 2) return;
+    std::sort( candidates.begin(), candidates.end() );
+
+    // Sizes first, so the merged arrays are allocated once and the meshes can point into them
+    size_t num_vertices = 0;
+    size_t num_triangles = 0;
+    for (size_t c = 0; c < candidates.size(); ++c) {
+      const bake::Mesh& mesh = scene.meshes[scene.instances[candidates[c].second].mesh_index];
+      num_vertices += mesh.num_vertices;
+      num_triangles += mesh.num_triangles;
+    }
+    occluders.merged_vertices.resize( 3*num_vertices );
+    occluders.merged_indices.resize( 3*num_triangles );
+
+    std::vector<bool> is_merged( scene.num_instances, false );
+    size_t vertex_offset = 0;
+    size_t triangle_offset = 0;
+    for (size_t c = 0; c < candidates.size(); ++c) {
+      const bake::Instance& instance = scene.instances[candidates[c].second];
+      const bake::Mesh& mesh = scene.meshes[instance.mesh_index];
+      is_merged[candidates[c].second] = true;
+
+      if (occluders.merged_meshes.empty() || occluders.merged_meshes.back().num_triangles + mesh.num_triangles > MERGED_OCCLUDER_TRIANGLES) {
+        bake::Mesh merged_mesh;
+        std::memset( &merged_mesh, 0, sizeof(merged_mesh) );
+        merged_mesh.vertices = &occluders.merged_vertices[0] + 3*vertex_offset;
+        merged_mesh.vertex_stride_bytes = 3*sizeof(float);
+        merged_mesh.tri_vertex_indices = &occluders.merged_indices[0] + 3*triangle_offset;
+        std::fill( merged_mesh.bbox_min, merged_mesh.bbox_min+3, FLT_MAX );
+        std::fill( merged_mesh.bbox_max, merged_mesh.bbox_max+3, -FLT_MAX );
+        occluders.merged_meshes.push_back( merged_mesh );
+      }
+      bake::Mesh& merged_mesh = occluders.merged_meshes.back();
+
+      const unsigned stride = mesh.vertex_stride_bytes > 0 ? mesh.vertex_stride_bytes : 3*sizeof(float);
+      const float* m = instance.xform;
+      for (size_t v = 0; v < mesh.num_vertices; ++v) {
+        const float* p = reinterpret_cast<const float*>( reinterpret_cast<const unsigned char*>(mesh.vertices) + v*stride );
+        float* q = &occluders.merged_vertices[3*(vertex_offset + v)];
+        for (int k = 0; k < 3; ++k) {
+          q[k] = m[4*k]*p[0] + m[4*k+1]*p[1] + m[4*k+2]*p[2] + m[4*k+3];
+        }
+      }
+      const unsigned base_vertex = unsigned( merged_mesh.num_vertices );
+      for (size_t t = 0; t < 3*mesh.num_triangles; ++t) {
+        occluders.merged_indices[3*triangle_offset + t] = mesh.tri_vertex_indices[t] + base_vertex;
+      }
+      for (int k = 0; k < 3; ++k) {
+        merged_mesh.bbox_min[k] = std::min( merged_mesh.bbox_min[k], instance.bbox_min[k] );
+        merged_mesh.bbox_max[k] = std::max( merged_mesh.bbox_max[k], instance.bbox_max[k] );
+      }
+      merged_mesh.num_vertices += mesh.num_vertices;
+      merged_mesh.num_triangles += mesh.num_triangles;
+      vertex_offset += mesh.num_vertices;
+      triangle_offset += mesh.num_triangles;
+    }
+
+    // Remaining instances keep their meshes, without the ones that were merged, so no accels are built for them.
+    // Merged meshes follow, with identity transforms.
+    const optix::Matrix4x4 identity = optix::Matrix4x4::identity();
+    std::vector<unsigned> base_mesh_index( scene.num_meshes, unsigned(-1) );
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      if (is_merged[i]) continue;
+      bake::Instance instance = scene.instances[i];
+      if (base_mesh_index[instance.mesh_index] == unsigned(-1)) {
+        base_mesh_index[instance.mesh_index] = unsigned( occluders.base_meshes.size() );
+        occluders.base_meshes.push_back( scene.meshes[instance.mesh_index] );
+      }
+      instance.mesh_index = base_mesh_index[instance.mesh_index];
+      occluders.base_instances.push_back( instance );
+    }
+    for (size_t j = 0; j < occluders.merged_meshes.size(); ++j) {
+      bake::Instance instance;
+      std::memset( &instance, 0, sizeof(instance) );
+      std::copy( identity.getData(), identity.getData()+16, instance.xform );
+      instance.mesh_index = unsigned( occluders.base_meshes.size() );
+      std::copy( occluders.merged_meshes[j].bbox_min, occluders.merged_meshes[j].bbox_min+3, instance.bbox_min );
+      std::copy( occluders.merged_meshes[j].bbox_max, occluders.merged_meshes[j].bbox_max+3, instance.bbox_max );
+      occluders.base_meshes.push_back( occluders.merged_meshes[j] );
+      occluders.base_instances.push_back( instance );
+    }
+    merged.meshes = &occluders.base_meshes[0];
+    merged.num_meshes = occluders.base_meshes.size();
+    merged.instances = &occluders.base_instances[0];
+    merged.num_instances = occluders.base_instances.size();
+    std::cerr << "Merged " << candidates.size() << " small instances into " << occluders.merged_meshes.size() << " occluder meshes" << std::endl;
+  }
+
+  // Occluders for tracing only: meshes of at least PROXY_OCCLUDER_TRIANGLES are replaced by simplified proxies with
+  // about proxy_ratio of their triangles.  Far field occlusion hardly depends on fine detail, and the accels of large
+  // scans shrink with their triangles.  Instances keep their meshes' indices, so samples and filtering still use
+  // the full meshes of the original scene.
+  void make_proxy_occluders( const Config& config, const bake::Scene& scene, const float scene_bbox_min[3], const float scene_bbox_max[3],
+                             Occluders& occluders, bake::Scene& proxied )
+  {
+    proxied = scene;
+    std::vector<size_t> candidates;
+    for (size_t m = 0; m < scene.num_meshes; ++m) {
+      if (scene.meshes[m].num_triangles >= PROXY_OCCLUDER_TRIANGLES) candidates.push_back( m );
+    }
+    if (candidates.empty()) return;
+
+    const char* cache_dir = config.proxy_cache_dir.empty() ? NULL : config.proxy_cache_dir.c_str();
+    occluders.proxies.resize( candidates.size() );
+#pragma omp parallel for schedule(dynamic)
+    for (ptrdiff_t c = 0; c < ptrdiff_t(candidates.size()); ++c) {
+      const bake::Mesh& mesh = scene.meshes[candidates[c]];
+      const size_t target_triangles = std::max( size_t(1), size_t( config.proxy_ratio*mesh.num_triangles ) );
+      bake::simplifyMesh( mesh, target_triangles, occluders.proxies[c], cache_dir );
+    }
+
+    occluders.proxy_meshes.assign( scene.meshes, scene.meshes + scene.num_meshes );
+    size_t full_triangles = 0;
+    size_t proxy_triangles = 0;
+    float max_error = 0.0f;
+    for (size_t c = 0; c < candidates.size(); ++c) {
+      bake::ProxyMesh& proxy = occluders.proxies[c];
+      if (proxy.indices.empty()) continue;  // nothing left of a degenerate mesh; trace the original
+      const size_t num_vertices = proxy.vertices.size()/3;
+      bake::Mesh& mesh = occluders.proxy_meshes[candidates[c]];
+      full_triangles += mesh.num_triangles;
+      mesh.num_vertices = num_vertices;
+      mesh.vertices = &proxy.vertices[0];
+      mesh.vertex_stride_bytes = 3*sizeof(float);
+      mesh.normals = NULL;
+      mesh.normal_stride_bytes = 0;
+      mesh.texcoords = NULL;
+      mesh.texcoord_stride_bytes = 0;
+      mesh.geometry_memory = bake::MEMORY_SPACE_HOST;
+      mesh.num_triangles = proxy.indices.size()/3;
+      mesh.tri_vertex_indices = &proxy.indices[0];
+      std::fill( mesh.bbox_min, mesh.bbox_min+3, FLT_MAX );
+      std::fill( mesh.bbox_max, mesh.bbox_max+3, -FLT_MAX );
+      for (size_t v = 0; v < num_vertices; ++v) {
+        for (int k = 0; k < 3; ++k) {
+          mesh.bbox_min[k] = std::min( mesh.bbox_min[k], proxy.vertices[3*v+k] );
+          mesh.bbox_max[k] = std::max( mesh.bbox_max[k], proxy.vertices[3*v+k] );
+        }
+      }
+      proxy_triangles += mesh.num_triangles;
+      max_error = std::max( max_error, proxy.max_error );
+    }
+    proxied.meshes = &occluders.proxy_meshes[0];
+    std::cerr << "Simplified " << candidates.size() << " meshes from " << full_triangles << " to " << proxy_triangles 
+              << " triangles as proxy occluders, max error " << max_error << std::endl;
+
+    // Samples on the full surface that lie below its proxy occlude themselves unless rays start above the proxy.
+    // The error is in mesh space, so this is only a hint for scaled instances.
+    float scene_offset, scene_maxdistance;
+    scene_distances( config, scene_bbox_min, scene_bbox_max, scene_offset, scene_maxdistance );
+    if (max_error > scene_offset) {
+      std::cerr << "Proxy error exceeds the ray offset " << scene_offset << "; raise --proxy_occluders or --scene_offset "
+                << "if surfaces darken" << std::endl;
+    }
+  }
+
+  void make_occluders( const Config& config, const bake::Scene& scene, const bake::Scene& context_scene, float scene_bbox_min[3], 
+                       float scene_bbox_max[3], Occluders& occluders )
+  {
+    // An incremental rebake moves occluder instances by their index in the scene
+    bake::Scene proxied = scene;
+    if (config.proxy_ratio > 0.0f) {
+      make_proxy_occluders( config, scene, scene_bbox_min, scene_bbox_max, occluders, proxied );
+    }
+    bake::Scene base = proxied;
+    if (config.merge_occluder_triangles > 0 && config.move_instance < 0 && config.occluder_variant_suffixes.empty() && 
+        config.frames_filename.empty()) {
+      merge_small_occluders( proxied, config.merge_occluder_triangles, scene_bbox_min, scene_bbox_max, occluders, base );
+    }
+    // Context instances go after the scene's, so those keep their indices
+    occluders.context = context_scene;
+    if (context_scene.num_instances > 0) {
+      bake::Scene with_context;
+      concat_scenes( base, context_scene, with_context, occluders.context_meshes, occluders.context_instances );
+      base = with_context;
+    }
+    if (!config.use_ground_plane_blocker) {
+      occluders.scene = base;
+      return;
+    }
+    // Closest hit queries for multi radius AO need the plane in the scene
+    if (config.analytic_ground_plane && config.hit_distances.empty()) {
+      occluders.scene = base;
+      occluders.analytic_ground = true;
+      occluders.ground_plane.axis = int( ground_plane_bounds( scene_bbox_min, scene_bbox_max, config.ground_upaxis, config.ground_scale_factor, 
+        config.ground_offset_factor, occluders.ground_plane.bbox_min, occluders.ground_plane.bbox_max ) );
+      return;
+    }
+    make_ground_plane(scene_bbox_min, scene_bbox_max, config.ground_upaxis, config.ground_scale_factor, config.ground_offset_factor,
+      occluders.plane_vertices, occluders.plane_indices, occluders.blocker_meshes, occluders.blocker_instances);
+    bake::Scene blockers = { &occluders.blocker_meshes[0], occluders.blocker_meshes.size(), &occluders.blocker_instances[0], occluders.blocker_instances.size() };
+    concat_scenes( base, blockers, occluders.scene, occluders.combined_meshes, occluders.combined_instances );
+  }
+
+  // Pre-pass for --auto_hit_distance: occlusion of a subset of samples at hit distances halving down from the default,
+  // and the shortest distance that keeps the asked for fraction of the occlusion at the default.  Longer rays cost
+  // more traversal, so the time of each step estimates what the bake saves.
+  float choose_hit_distance( const Config& config, const bake::Scene& scene, bake::AOContext* context, float scene_offset, 
+    float scene_maxdistance )
+  {
+    std::vector<size_t> num_samples_per_instance( scene.num_instances );
+    bake::SamplingPlan plan;
+    const size_t num_samples = bake::distributeSamples( scene, 0, AUTO_DISTANCE_SAMPLES, &num_samples_per_instance[0], &plan );
+    if (num_samples == 0) return scene_maxdistance;
+    bake::AOSamples samples;
+    allocate_ao_samples( samples, num_samples, scene, false, false, config.pinned_memory );
+    bake::sampleInstances( scene, &num_samples_per_instance[0], 0, samples, &plan );
+
+    std::cerr << "Hit distance pre-pass (" << num_samples << " samples, " << AUTO_DISTANCE_RAYS << " rays, " 
+              << AUTO_DISTANCE_STEPS << " distances) ... "; std::cerr.flush();
+    Timer timer;
+    timer.start();
+    AOValues ao( num_samples, config.pinned_memory );
+    std::vector<float> distances( AUTO_DISTANCE_STEPS );
+    std::vector<double> occlusion( AUTO_DISTANCE_STEPS );
+    std::vector<double> seconds( AUTO_DISTANCE_STEPS );
+    for (int k = AUTO_DISTANCE_STEPS - 1; k >= 0; --k) {
+      distances[k] = std::ldexp( scene_maxdistance, k - (AUTO_DISTANCE_STEPS - 1) );
+      Timer step_timer;
+      step_timer.start();
+      bake::computeAO( context, scene, samples, AUTO_DISTANCE_RAYS, scene_offset, distances[k], config.batch_size, 
+        config.passes_per_query, 0.0f, &ao[0] );
+      step_timer.stop();
+      seconds[k] = step_timer.elapsed;
+      double sum = 0.0;
+      for (size_t i = 0; i < num_samples; ++i) sum += 1.0 - ao[i];
+      occlusion[k] = sum / double( num_samples );
+    }
+    timer.stop();
+    printTimeElapsed( timer );
+    recordTime( "sample.auto_distance", timer );
+    destroy_ao_samples( samples );
+
+    // Occlusion only grows with the distance, up to sampling noise
+    const int last = AUTO_DISTANCE_STEPS - 1;
+    int chosen = last;
+    while (chosen > 0 && occlusion[chosen - 1] >= config.auto_hit_distance * occlusion[last]) --chosen;
+    std::cerr << "Hit distance: " << distances[chosen] << " of " << scene_maxdistance << ", keeping " 
+              << ( occlusion[last] > 0.0 ? 100.0 * occlusion[chosen] / occlusion[last] : 100.0 ) << "% of the occlusion";
+    if (seconds[last] > 0.0) {
+      std::cerr << ", trace time estimated at " << 100.0 * seconds[chosen] / seconds[last] << "%";
+    }
+    std::cerr << std::endl;
+    return distances[chosen];
+  }
+
+  // Pilot trace for --variance_sampling: the minimum samples per face, at least two, traced with few rays, whose AO
+  // variance per triangle weighs where the extra samples of the bake go
+  void weigh_samples_by_variance( const Config& config, const bake::Scene& scene, bake::AOContext* context, float scene_offset, 
+    float scene_maxdistance, bake::SamplingPlan& plan )
+  {
+    const float min_samples_per_face = std::max( config.min_samples_per_face, 2.0f );
+    std::vector<size_t> num_samples_per_instance( scene.num_instances );
+    const size_t num_samples = bake::distributeSamples( scene, min_samples_per_face, 0, &num_samples_per_instance[0] );
+    bake::AOSamples pilot_samples;
+    allocate_ao_samples( pilot_samples, num_samples, scene, false, false, config.pinned_memory );
+    bake::sampleInstances( scene, &num_samples_per_instance[0], min_samples_per_face, pilot_samples );
+
+    std::cerr << "Pilot AO (" << num_samples << " samples, " << config.variance_rays << " rays) ... "; std::cerr.flush();
+    Timer timer;
+    timer.start();
+    AOValues pilot_ao( num_samples, config.pinned_memory );
+    bake::computeAO( context, scene, pilot_samples, config.variance_rays, scene_offset, scene_maxdistance, config.batch_size, 
+      config.passes_per_query, 0.0f, &pilot_ao[0] );
+    timer.stop();
+    printTimeElapsed( timer );
+    recordTime( "sample.pilot", timer );
+
+    bake::weighSamplesByVariance( scene, &num_samples_per_instance[0], pilot_samples, &pilot_ao[0], plan );
+    destroy_ao_samples( pilot_samples );
+  }
+
+  // Translate one instance of the scene and its occluder copy, then retrace just the samples within ray reach of its old or new bounds
+  void rebake_moved_instance( const Config& config, bake::Scene& scene, Occluders& occluders, bake::AOContext* context,
+    const size_t* num_samples_per_instance, bake::AOSamples& ao_samples, float scene_offset, float scene_maxdistance, float* ao_values )
+  {
+    const size_t index = static_cast<size_t>( config.move_instance );
+    bake::Instance& instance = scene.instances[index];
+    float box_mins[6], box_maxs[6];
+    std::copy( instance.bbox_min, instance.bbox_min + 3, box_mins );
+    std::copy( instance.bbox_max, instance.bbox_max + 3, box_maxs );
+    for (int k = 0; k < 3; ++k) {
+      instance.xform[4*k+3] += config.move_offset[k];  // row major translation
+      instance.bbox_min[k]  += config.move_offset[k];
+      instance.bbox_max[k]  += config.move_offset[k];
+    }
+    std::copy( instance.bbox_min, instance.bbox_min + 3, box_mins + 3 );
+    std::copy( instance.bbox_max, instance.bbox_max + 3, box_maxs + 3 );
+
+    // The occluders start with a copy of the scene instances when there is a context scene or ground plane
+    if (occluders.scene.instances != scene.instances) {
+      occluders.scene.instances[index] = instance;
+    }
+
+    // The instance's own samples move with it; normals are unchanged by a translation
+    size_t first_sample = 0;
+    for (size_t i = 0; i < index; ++i) first_sample += num_samples_per_instance[i];
+    for (size_t i = first_sample; i < first_sample + num_samples_per_instance[index]; ++i) {
+      for (int k = 0; k < 3; ++k) ao_samples.sample_positions[3*i+k] += config.move_offset[k];
+    }
+
+    std::cerr << "Rebake moved instance " << index << " ... "; std::cerr.flush();
+    Timer timer;
+    timer.start();
+    bake::updateAOContextInstances( context, occluders.scene.instances, occluders.scene.num_instances );
+    const size_t num_retraced = bake::recomputeAONearBoxes( context, scene, ao_samples, box_mins, box_maxs, 2, config.num_rays, 
+      scene_offset, scene_maxdistance, config.batch_size, config.passes_per_query, config.adaptive_tolerance, ao_values );
+    std::cerr << num_retraced << " of " << ao_samples.num_samples << " samples retraced ... "; printTimeElapsed( timer );
+  }
+
+  // 16 bit binary PGM, with the first texture row (v = 0) at the bottom
+  bool save_pgm(const std::string& filename, unsigned width, unsigned height, const std::vector<float>& texture)
+  {
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file) return false;
+    fprintf(file, "P5\n%u %u\n65535\n", width, height);
+    std::vector<unsigned char> row(2*width);
+    for (unsigned y = 0; y < height; ++y) {
+      const float* src = &texture[size_t(height - 1 - y)*width];
+      for (unsigned x = 0; x < width; ++x) {
+        const unsigned v = unsigned(std::min(std::max(src[x], 0.0f), 1.0f)*65535.0f + 0.5f);
+        row[2*x] = (unsigned char)(v >> 8);
+        row[2*x+1] = (unsigned char)(v & 0xff);
+      }
+      fwrite(&row[0], 1, row.size(), file);
+    }
+    const bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+  }
+
+  // Hash of everything the traced AO of a sample depends on, for checkpoints: geometry, sampling and trace options
+  uint64_t hash_scene_geometry( const bake::Scene& scene, uint64_t hash )
+  {
+    for (size_t i = 0; i < scene.num_meshes; ++i) hash = hashMeshGeometry( scene.meshes[i], hash );
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      hash = hashBytes( scene.instances[i].xform, sizeof(scene.instances[i].xform), hash );
+      hash = hashBytes( &scene.instances[i].mesh_index, sizeof(scene.instances[i].mesh_index), hash );
+    }
+    return hash;
+  }
+
+  uint64_t checkpoint_hash( const Config& config, const bake::Scene& scene, const bake::Scene& context_scene )
+  {
+    uint64_t hash = hash_scene_geometry( scene, HASH_SEED );
+    if (context_scene.num_instances > 0) hash = hash_scene_geometry( context_scene, hash );
+    const uint64_t counts[] = { config.num_samples, uint64_t( config.num_rays ), 
+                                uint64_t( config.ground_upaxis ), config.use_ground_plane_blocker, config.analytic_ground_plane, 
+                                config.gpu_sampling, config.compact_samples, config.sort_samples, config.share_mesh_ao, config.two_sided, 
+                                config.bent_normals, config.sh_visibility, config.flip_orientation, config.vertex_samples, uint64_t( config.variance_rays ), 
+                                config.sample_templates };
+    const float scales[] = { config.ground_scale_factor, config.ground_offset_factor, config.scene_offset_scale, config.scene_maxdistance_scale,
+                             config.scene_offset, config.scene_maxdistance, config.adaptive_tolerance, config.tile_scale,
+                             config.proxy_ratio, config.auto_hit_distance, config.min_samples_per_face, config.ao_cache_scale, 
+                             config.ao_cache_error };
+    hash = hashBytes( counts, sizeof(counts), hash );
+    hash = hashBytes( scales, sizeof(scales), hash );
+    if (!config.hit_distances.empty()) hash = hashBytes( &config.hit_distances[0], config.hit_distances.size()*sizeof(float), hash );
+    if (!config.instance_ray_counts.empty()) {
+      hash = hashBytes( &config.instance_ray_ranges[0], config.instance_ray_ranges.size()*sizeof(uint64_t), hash );
+      hash = hashBytes( &config.instance_ray_counts[0], config.instance_ray_counts.size()*sizeof(int), hash );
+    }
+    const float large_instances[] = { config.large_instance_scale, float( config.large_instance_rays ) };
+    if (config.large_instance_rays > 0) hash = hashBytes( large_instances, sizeof(large_instances), hash );
+    const float far_field[] = { config.far_field, float( config.far_field_resolution ) };
+    if (config.far_field > 0.0f) hash = hashBytes( far_field, sizeof(far_field), hash );
+    return hash;
+  }
+
+  // Key of a whole bake's output file: the checkpoint hash, plus normals and storage identifiers, and the settings of
+  // everything after the trace
+  uint64_t result_cache_key( const Config& config, const bake::Scene& scene, const bake::Scene& context_scene )
+  {
+    uint64_t hash = hashBytes( &RESULT_CACHE_VERSION, sizeof(RESULT_CACHE_VERSION), checkpoint_hash( config, scene, context_scene ) );
+    for (size_t m = 0; m < scene.num_meshes; ++m) {
+      const bake::Mesh& mesh = scene.meshes[m];
+      const unsigned normal_stride = mesh.normal_stride_bytes > 0 ? mesh.normal_stride_bytes : 3*sizeof(float);
+      const unsigned char* normals = reinterpret_cast<const unsigned char*>( mesh.normals );
+      for (size_t v = 0; normals && v < mesh.num_vertices; ++v) {
+        hash = hashBytes( normals + v*normal_stride, 3*sizeof(float), hash );
+      }
+    }
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      hash = hashBytes( &scene.instances[i].storage_identifier, sizeof(scene.instances[i].storage_identifier), hash );
+    }
+    const uint64_t counts[] = { uint64_t( config.filter_mode ), uint64_t( config.ls_solver ), uint64_t( config.ls_ordering ), 
+                                config.ls_patch_vertices, uint64_t( config.accel_preset ), uint64_t( config.backend ), config.use_cpu, 
+                                config.merge_occluder_triangles, config.reorder_meshes, !config.part_cache_dir.empty(), config.roi_cull, 
+                                uint64_t( int64_t( config.move_instance ) ), config.output_bits, config.compress_output, config.output_index,
+                                config.clean_meshes };
+    const float scales[] = { config.regularization_weight, config.analytic_mass_weight, config.weld_tolerance, config.denoise_scale, 
+                             float( config.time_budget ), config.move_offset[0], config.move_offset[1], config.move_offset[2] };
+    hash = hashBytes( counts, sizeof(counts), hash );
+    return hashBytes( scales, sizeof(scales), hash );
+  }
+
+  // Traced samples of a bake, so that filter settings can be swept without tracing again: the samples of each baked
+  // instance, their infos and the traced AO of every channel in instance order, keyed by the checkpoint hash.  Loading
+  // checks the counts and infos against those just sampled, so only the AO is taken from the file.
+  const char TRACED_SAMPLES_MAGIC[8] = { 'B', 'A', 'K', 'E', 'S', 'M', 'P', '1' };
+
+  struct TracedSamplesHeader {
+    char     magic[8];
+    uint64_t key;
+    uint64_t num_instances;
+    uint64_t num_samples;
+    uint64_t num_channels;
+    uint64_t num_triangles;  // entries of tri_sample_dA for compact infos, 0 otherwise
+    uint32_t infos;          // 0 for vertex samples, 1 for SampleInfo, 2 for CompactSampleInfo
+    uint32_t reserved;
+    // followed by num_instances sample counts, the infos, the tri_sample_dA of compact infos, 
+    // then num_channels x num_samples AO values
+  };
+
+  TracedSamplesHeader traced_samples_header( const uint64_t key, const bake::Scene& baked_scene, const bake::AOSamples& ao_samples, 
+                                             const size_t num_channels )
+  {
+    TracedSamplesHeader header;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, TRACED_SAMPLES_MAGIC, sizeof(header.magic) );
+    header.key = key;
+    header.num_instances = baked_scene.num_instances;
+    header.num_samples = ao_samples.num_samples;
+    header.num_channels = num_channels;
+    header.infos = ao_samples.sample_infos ? 1 : ao_samples.compact_sample_infos ? 2 : 0;
+    for (size_t i = 0; i < baked_scene.num_instances && header.infos == 2; ++i) {
+      header.num_triangles += baked_scene.meshes[baked_scene.instances[i].mesh_index].num_triangles;
+    }
+    return header;
+  }
+
+  // The sections of a traced samples file before the AO values, as the sampler made them
+  void traced_samples_sections( const TracedSamplesHeader& header, const bake::AOSamples& ao_samples, const std::vector<uint64_t>& counts,
+                                std::vector<const void*>& data, std::vector<size_t>& bytes )
+  {
+    data.push_back( &header );
+    bytes.push_back( sizeof(header) );
+    data.push_back( counts.empty() ? NULL : &counts[0] );
+    bytes.push_back( counts.size()*sizeof(uint64_t) );
+    if (header.infos == 1) {
+      data.push_back( ao_samples.sample_infos );
+      bytes.push_back( ao_samples.num_samples*sizeof(bake::SampleInfo) );
+    } else if (header.infos == 2) {
+      data.push_back( ao_samples.compact_sample_infos );
+      bytes.push_back( ao_samples.num_samples*sizeof(bake::CompactSampleInfo) );
+      data.push_back( ao_samples.tri_sample_dA );
+      bytes.push_back( size_t( header.num_triangles )*sizeof(float) );
+    }
+  }
+
+  bool save_traced_samples( const std::string& filename, const uint64_t key, const bake::Scene& baked_scene, const size_t* num_samples_per_instance,
+                            const bake::AOSamples& ao_samples, const size_t num_channels, const float* ao_values )
+  {
+    const TracedSamplesHeader header = traced_samples_header( key, baked_scene, ao_samples, num_channels );
+    const std::vector<uint64_t> counts( num_samples_per_instance, num_samples_per_instance + baked_scene.num_instances );
+    std::vector<const void*> data;
+    std::vector<size_t> bytes;
+    traced_samples_sections( header, ao_samples, counts, data, bytes );
+    data.push_back( ao_values );
+    bytes.push_back( num_channels*ao_samples.num_samples*sizeof(float) );
+
+    FILE* file = fopen( filename.c_str(), "wb" );
+    if (!file) return false;
+    bool ok = true;
+    for (size_t k = 0; k < data.size() && ok; ++k) {
+      ok = bytes[k] == 0 || fwrite( data[k], 1, bytes[k], file ) == bytes[k];
+    }
+    return fclose( file ) == 0 && ok;
+  }
+
+  // Compares the next bytes of a file with memory, a chunk at a time
+  bool read_matches( FILE* file, const void* data, size_t bytes )
+  {
+    std::vector<unsigned char> buffer( std::min( bytes, size_t( 1 << 20 ) ) );
+    const unsigned char* p = static_cast<const unsigned char*>( data );
+    while (bytes > 0) {
+      const size_t n = std::min( bytes, buffer.size() );
+      if (fread( &buffer[0], 1, n, file ) != n || memcmp( &buffer[0], p, n ) != 0) return false;
+      p += n;
+      bytes -= n;
+    }
+    return true;
+  }
+
+  bool load_traced_samples( const std::string& filename, const uint64_t key, const bake::Scene& baked_scene, const size_t* num_samples_per_instance,
+                            const bake::AOSamples& ao_samples, const size_t num_channels, float* ao_values )
+  {
+    const TracedSamplesHeader header = traced_samples_header( key, baked_scene, ao_samples, num_channels );
+    const std::vector<uint64_t> counts( num_samples_per_instance, num_samples_per_instance + baked_scene.num_instances );
+    std::vector<const void*> data;
+    std::vector<size_t> bytes;
+    traced_samples_sections( header, ao_samples, counts, data, bytes );
+
+    FILE* file = fopen( filename.c_str(), "rb" );
+    if (!file) return false;
+    bool ok = true;
+    for (size_t k = 0; k < data.size() && ok; ++k) ok = read_matches( file, data[k], bytes[k] );
+    const size_t num_values = num_channels*ao_samples.num_samples;
+    ok = ok && fread( ao_values, sizeof(float), num_values, file ) == num_values;
+    fclose( file );
+    return ok;
+  }
+
+  void begin_checkpoint( const Config& config, const bake::Scene& scene, const Occluders& occluders, bake::AOContext* context )
+  {
+    if (config.checkpoint_dir.empty()) return;
+    if (bake::getAOBackend( context ) != bake::AO_BACKEND_OPTIX_PRIME) {
+      std::cerr << "Checkpoints need the Prime tracer; this bake traces without them" << std::endl;
+    }
+    bake::setAOCheckpoint( context, config.checkpoint_dir.c_str(), checkpoint_hash( config, scene, occluders.context ) );
+  }
+
+  // Occluder instances whose bounds come within reach of a box, with only the meshes they instance
+  struct TileOccluders {
+    std::vector<bake::Mesh> meshes;
+    std::vector<bake::Instance> instances;
+    bake::Scene scene;
+  };
+
+  void cull_occluders( const bake::Scene& occluders, const float box_min[3], const float box_max[3], const float reach, TileOccluders& tile )
+  {
+    tile.meshes.clear();
+    tile.instances.clear();
+    std::vector<unsigned> tile_mesh_index( occluders.num_meshes, ~0u );
+    for (size_t i = 0; i < occluders.num_instances; ++i) {
+      bake::Instance instance = occluders.instances[i];
+      bool near = true;
+      for (int k = 0; k < 3; ++k) {
+        near = near && instance.bbox_min[k] <= box_max[k] + reach && instance.bbox_max[k] >= box_min[k] - reach;
+      }
+      if (!near) continue;
+      if (tile_mesh_index[instance.mesh_index] == ~0u) {
+        tile_mesh_index[instance.mesh_index] = unsigned( tile.meshes.size() );
+        tile.meshes.push_back( occluders.meshes[instance.mesh_index] );
+      }
+      instance.mesh_index = tile_mesh_index[instance.mesh_index];
+      tile.instances.push_back( instance );
+    }
+    const bake::Scene scene = { tile.meshes.empty() ? NULL : &tile.meshes[0], tile.meshes.size(), 
+                                tile.instances.empty() ? NULL : &tile.instances[0], tile.instances.size() };
+    tile.scene = scene;
+  }
+
+  // Traces the samples of each tile against a context of the occluders within reach of it, which only lives while
+  // the tile traces, so device memory holds the accels of one neighborhood at a time.  Multi channel AO goes
+  // through a buffer per tile, since channels are num_samples apart in ao_values.
+  void trace_tiles( const Config& config, const bake::Scene& baked_scene, const Occluders& occluders, const bake::AOSamples& ao_samples,
+                    const std::vector<bake::SampleTile>& tiles, const float scene_offset, const float scene_maxdistance,
+                    const size_t num_ao_channels, float* ao_values, Timer& accel_timer )
+  {
+    const float reach = config.hit_distances.empty() ? scene_maxdistance : config.hit_distances.back();
+    TileOccluders tile_occluders;
+    std::vector<float> tile_ao;
+    size_t num_culled_instances = 0;
+    for (size_t t = 0; t < tiles.size(); ++t) {
+      const bake::SampleTile& tile = tiles[t];
+      bake::AOSamples tile_samples = ao_samples;
+      tile_samples.num_samples = tile.num_samples;
+      tile_samples.sample_positions    += 3*tile.first_sample;
+      tile_samples.sample_normals      += 3*tile.first_sample;
+      tile_samples.sample_face_normals += 3*tile.first_sample;
+      if (tile_samples.sample_infos) tile_samples.sample_infos += tile.first_sample;
+      if (tile_samples.compact_sample_infos) tile_samples.compact_sample_infos += tile.first_sample;
+      if (tile_samples.sample_instances) tile_samples.sample_instances += tile.first_sample;
+      tile_samples.first_sample_index = ao_samples.first_sample_index + tile.first_sample;
+      tile_ao.resize( num_ao_channels > 1 ? num_ao_channels*tile.num_samples : 0 );
+      float* values = num_ao_channels > 1 ? &tile_ao[0] : ao_values + tile.first_sample;
+
+      cull_occluders( occluders.scene, tile.bbox_min, tile.bbox_max, reach, tile_occluders );
+      num_culled_instances += occluders.scene.num_instances - tile_occluders.scene.num_instances;
+      if (tile_occluders.scene.num_instances == 0 && !occluders.analytic_ground) {
+        std::fill( values, values + num_ao_channels*tile.num_samples, 1.0f );  // nothing to hit
+      } else {
+        accel_timer.start();
+        bake::AOContext* context = bake::createAOContext( tile_occluders.scene, config.use_cpu, config.conserve_memory, 
+          config.devices.empty() ? NULL : &config.devices[0], config.devices.size(), config.accel_preset, occluders.analytic_ground_plane(), 
+          config.backend, config.peer_geometry, config.managed_geometry );
+        bake::setAOQueriesInFlight( context, config.queries_in_flight );
+        bake::setAOLatencyBudget( context, config.latency_budget );
+        bake::setAOFarField( context, config.far_field, config.far_field_resolution );
+        accel_timer.stop();
+        begin_checkpoint( config, baked_scene, occluders, context );
+        if (config.two_sided) {
+          bake::computeAOTwoSided( context, baked_scene, tile_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, 
+            config.passes_per_query, values );
+        } else if (!config.hit_distances.empty()) {
+          bake::computeAOMultiRadius( context, baked_scene, tile_samples, config.num_rays, scene_offset, &config.hit_distances[0], 
+            config.hit_distances.size(), config.batch_size, config.passes_per_query, values );
+        } else {
+          bake::computeAO( context, baked_scene, tile_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, 
+            config.passes_per_query, config.adaptive_tolerance, values );
+        }
+        bake::destroyAOContext( context );
+      }
+
+      if (num_ao_channels > 1) {
+        for (size_t c = 0; c < num_ao_channels; ++c) {
+          std::copy( &tile_ao[c*tile.num_samples], &tile_ao[c*tile.num_samples] + tile.num_samples, 
+                     ao_values + c*ao_samples.num_samples + tile.first_sample );
+        }
+      }
+    }
+    std::cerr << "\n\t" << tiles.size() << " tiles, " << ( tiles.empty() ? 0 : num_culled_instances / tiles.size() ) << " of " 
+              << occluders.scene.num_instances << " occluder instances culled per tile on average\n";
+    recordCount( "ao.tiles", tiles.size() );
+  }
+
+  // Bakes a lightmap for every instance with texcoords, a few texture rows at a time, and saves it as <prefix><storage_identifier>.pgm
+  void bake_lightmaps( const Config& config, const bake::Scene& scene, bake::AOContext* context, const bake::Scene& occluders,
+    float scene_offset, float scene_maxdistance )
+  {
+    const unsigned size = config.lightmap_size;
+    const unsigned rows_per_part = unsigned(std::max(LIGHTMAP_TEXELS_PER_PART / size, size_t(1)));
+    std::vector<float> texture(size_t(size)*size);
+    bake::TexelSamples texel_samples;
+    std::vector<float> ao_values;
+
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      if (!scene.meshes[scene.instances[i].mesh_index].texcoords) continue;
+
+      ProfileRange range( "bake lightmap", PROFILE_COLOR_TRACE, uint64_t( i ) );
+      std::cerr << "Bake lightmap " << scene.instances[i].storage_identifier << " ...\n";
+      Timer timer;
+      timer.start();
+
+      // Negative until a texel sample is mapped
+      std::fill(texture.begin(), texture.end(), -1.0f);
+      for (unsigned first_row = 0; first_row < size; first_row += rows_per_part) {
+        bake::sampleTexels( scene, i, size, size, first_row, std::min(rows_per_part, size - first_row), texel_samples );
+        if (texel_samples.size() == 0) continue;
+        ao_values.assign( texel_samples.size(), 0.0f );
+        bake::computeAO( context, occluders, texel_samples.aoSamples(), config.num_rays, scene_offset, scene_maxdistance,
+          config.batch_size, config.passes_per_query, config.adaptive_tolerance, &ao_values[0] );
+        bake::mapAOToTextures( texel_samples, &ao_values[0], &texture[0] );
+      }
+      bake::dilateTexture( size, size, LIGHTMAP_DILATION, &texture[0] );
+
+      std::ostringstream filename;
+      filename << config.lightmap_prefix << scene.instances[i].storage_identifier << ".pgm";
+      if (!save_pgm( filename.str(), size, size, texture )) {
+        std::cerr << "Failed to save lightmap to: " << filename.str() << std::endl;
+      }
+      std::cerr << "Lightmap ...               "; printTimeElapsed( timer );
+    }
+  }
+
+  // The instance of each mesh nearest to the mean position of all its instances, to bake in place of all of them.
+  // representative_of maps every instance of the scene to its representative.
+  void select_mesh_representatives( const bake::Scene& scene, std::vector<bake::Instance>& representatives, std::vector<size_t>& representative_of )
+  {
+    std::vector<double> mean( 3*scene.num_meshes, 0.0 );
+    std::vector<size_t> count( scene.num_meshes, 0 );
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      const bake::Instance& instance = scene.instances[i];
+      for (int k = 0; k < 3; ++k) mean[3*instance.mesh_index + k] += instance.xform[4*k + 3];
+      count[instance.mesh_index]++;
+    }
+
+    std::vector<size_t> best( scene.num_meshes, scene.num_instances );
+    std::vector<double> best_distance( scene.num_meshes, 0.0 );
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      const bake::Instance& instance = scene.instances[i];
+      const unsigned m = instance.mesh_index;
+      double distance = 0.0;
+      for (int k = 0; k < 3; ++k) {
+        const double d = instance.xform[4*k + 3] - mean[3*m + k] / double( count[m] );
+        distance += d*d;
+      }
+      if (best[m] == scene.num_instances || distance < best_distance[m]) {
+        best[m] = i;
+        best_distance[m] = distance;
+      }
+    }
+
+    representatives.clear();
+    std::vector<size_t> representative_of_mesh( scene.num_meshes, 0 );
+    for (size_t m = 0; m < scene.num_meshes; ++m) {
+      if (best[m] == scene.num_instances) continue;
+      representative_of_mesh[m] = representatives.size();
+      representatives.push_back( scene.instances[best[m]] );
+    }
+    representative_of.resize( scene.num_instances );
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      representative_of[i] = representative_of_mesh[scene.instances[i].mesh_index];
+    }
+  }
+
+  // Vertex AO of isolated instances from the part cache
+  struct PartCache {
+    std::vector< std::vector<float> > mesh_ao;  // self-occlusion AO of each mesh with isolated instances
+    std::vector<float*> instance_ao;            // per instance: its mesh's AO if isolated, else NULL
+    size_t num_instances;
+    size_t num_loaded;
+    size_t num_baked;
+  };
+
+  // Sorts boxes by their low x, for the sweep
+  struct BoxMinXLess {
+    explicit BoxMinXLess( const std::vector<float>& boxes ) : boxes( boxes ) {}
+    bool operator()( size_t a, size_t b ) const { return boxes[6*a] < boxes[6*b]; }
+    const std::vector<float>& boxes;
+  };
+
+  // Rotation and translation only, so the AO of the instance is that of its mesh
+  bool rigid_xform( const float* xform )
+  {
+    for (int r = 0; r < 3; ++r) {
+      for (int c = 0; c < 3; ++c) {
+        const float dot = xform[4*r]*xform[4*c] + xform[4*r + 1]*xform[4*c + 1] + xform[4*r + 2]*xform[4*c + 2];
+        if (std::fabs( dot - (r == c ? 1.0f : 0.0f) ) > 1e-4f) return false;
+      }
+    }
+    return xform[12] == 0.0f && xform[13] == 0.0f && xform[14] == 0.0f && xform[15] == 1.0f;
+  }
+
+  // Rigid instances whose bounds are further than the hit distance from those of every other instance, of the context
+  // scene and of the ground plane blocker, by sort and sweep along x
+  std::vector<char> find_isolated_instances( const Config& config, const bake::Scene& scene, const bake::Scene& context_scene, 
+                                             const float scene_bbox_min[3], const float scene_bbox_max[3], const float reach )
+  {
+    // min x, y, z, max x, y, z of each box, grown by half the reach so boxes overlap when they are within reach
+    const size_t num_boxes = scene.num_instances + context_scene.num_instances + (config.use_ground_plane_blocker ? 1 : 0);
+    std::vector<float> boxes( 6*num_boxes );
+    for (size_t b = 0; b < scene.num_instances + context_scene.num_instances; ++b) {
+      const bake::Instance& instance = b < scene.num_instances ? scene.instances[b] : context_scene.instances[b - scene.num_instances];
+      for (int k = 0; k < 3; ++k) {
+        boxes[6*b + k] = instance.bbox_min[k] - 0.5f*reach;
+        boxes[6*b + 3 + k] = instance.bbox_max[k] + 0.5f*reach;
+      }
+    }
+    if (config.use_ground_plane_blocker) {
+      float ground_min[3], ground_max[3];
+      ground_plane_bounds( scene_bbox_min, scene_bbox_max, config.ground_upaxis, config.ground_scale_factor, config.ground_offset_factor,
+                           ground_min, ground_max );
+      for (int k = 0; k < 3; ++k) {
+        boxes[6*(num_boxes - 1) + k] = ground_min[k] - 0.5f*reach;
+        boxes[6*(num_boxes - 1) + 3 + k] = ground_max[k] + 0.5f*reach;
+      }
+    }
+
+    std::vector<size_t> order( num_boxes );
+    for (size_t b = 0; b < num_boxes; ++b) order[b] = b;
+    std::sort( order.begin(), order.end(), BoxMinXLess( boxes ) );
+
+    std::vector<char> isolated( scene.num_instances, 1 );
+    for (size_t j = 0; j < num_boxes; ++j) {
+      const size_t a = order[j];
+      for (size_t k = j + 1; k < num_boxes && boxes[6*order[k]] <= boxes[6*a + 3]; ++k) {
+        const size_t b = order[k];
+        if (a >= scene.num_instances && b >= scene.num_instances) continue;
+        if (boxes[6*a + 1] <= boxes[6*b + 4] && boxes[6*b + 1] <= boxes[6*a + 4] && 
+            boxes[6*a + 2] <= boxes[6*b + 5] && boxes[6*b + 2] <= boxes[6*a + 5]) {
+          if (a < scene.num_instances) isolated[a] = 0;
+          if (b < scene.num_instances) isolated[b] = 0;
+        }
+      }
+    }
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      if (isolated[i] && !rigid_xform( scene.instances[i].xform )) isolated[i] = 0;
+    }
+    return isolated;
+  }
+
+  // Cache key of a mesh's self-occlusion AO: its positions, triangles and normals, and the settings that change the result
+  uint64_t part_cache_key( const Config& config, const bake::Mesh& mesh, const float scene_offset, const float scene_maxdistance )
+  {
+    uint64_t key = hashMeshGeometry( mesh );
+    const unsigned normal_stride = mesh.normal_stride_bytes > 0 ? mesh.normal_stride_bytes : 3*sizeof(float);
+    const unsigned char* normals = reinterpret_cast<const unsigned char*>( mesh.normals );
+    for (size_t v = 0; normals && v < mesh.num_vertices; ++v) {
+      key = hashBytes( normals + v*normal_stride, 3*sizeof(float), key );
+    }
+    const float settings[] = { float( config.num_rays ), float( config.min_samples_per_face ), scene_offset, scene_maxdistance, 
+                               float( config.filter_mode ), config.regularization_weight, config.analytic_mass_weight, 
+                               float( config.ls_solver ), float( config.ls_patch_vertices ), config.weld_tolerance, config.adaptive_tolerance, 
+                               float( config.ls_ordering ) };
+    return hashBytes( settings, sizeof(settings), key );
+  }
+
+  // Bakes each mesh alone: one instance per mesh, on a grid with cells a hit distance wider than the largest mesh so 
+  // they don't see each other, at the minimum samples per face
+  void bake_parts( const Config& config, const bake::Scene& scene, const std::vector<unsigned>& meshes, const float scene_offset, 
+                   const float scene_maxdistance, std::vector< std::vector<float> >& mesh_ao )
+  {
+    float cell = 0.0f;
+    for (size_t k = 0; k < meshes.size(); ++k) {
+      const bake::Mesh& mesh = scene.meshes[meshes[k]];
+      for (int c = 0; c < 3; ++c) cell = std::max( cell, mesh.bbox_max[c] - mesh.bbox_min[c] );
+    }
+    cell += 2.0f*(scene_maxdistance + scene_offset);
+    const size_t side = std::max( size_t( std::ceil( std::pow( double( meshes.size() ), 1.0/3.0 ) ) ), size_t(1) );
+
+    std::vector<bake::Instance> instances( meshes.size() );
+    for (size_t k = 0; k < meshes.size(); ++k) {
+      const bake::Mesh& mesh = scene.meshes[meshes[k]];
+      const size_t cell_index[] = { k % side, (k / side) % side, k / (side*side) };
+      bake::Instance& instance = instances[k];
+      std::fill( instance.xform, instance.xform + 16, 0.0f );
+      for (int c = 0; c < 3; ++c) {
+        const float translation = cell*float( cell_index[c] ) - 0.5f*(mesh.bbox_min[c] + mesh.bbox_max[c]);
+        instance.xform[5*c] = 1.0f;
+        instance.xform[4*c + 3] = translation;
+        instance.bbox_min[c] = mesh.bbox_min[c] + translation;
+        instance.bbox_max[c] = mesh.bbox_max[c] + translation;
+      }
+      instance.xform[15] = 1.0f;
+      instance.storage_identifier = k;
+      instance.mesh_index = meshes[k];
+    }
+    bake::Scene part_scene = scene;
+    part_scene.instances = &instances[0];
+    part_scene.num_instances = instances.size();
+
+    std::vector<size_t> num_samples_per_instance( part_scene.num_instances );
+    const size_t total_samples = bake::distributeSamples( part_scene, config.min_samples_per_face, 0, &num_samples_per_instance[0] );
+    bake::AOSamples ao_samples;
+    allocate_ao_samples( ao_samples, total_samples, part_scene, false, config.compact_samples, config.pinned_memory );
+    bake::sampleInstances( part_scene, &num_samples_per_instance[0], config.min_samples_per_face, ao_samples );
+
+    AOValues ao_values( total_samples, config.pinned_memory );
+    bake::AOContext* context = bake::createAOContext( part_scene, config.use_cpu, config.conserve_memory, 
+      config.devices.empty() ? NULL : &config.devices[0], config.devices.size(), config.accel_preset, NULL, config.backend, config.peer_geometry, config.managed_geometry );
+    bake::setAOQueriesInFlight( context, config.queries_in_flight );
+    bake::setAOLatencyBudget( context, config.latency_budget );
+    bake::setAOFarField( context, config.far_field, config.far_field_resolution );
+    bake::computeAO( context, part_scene, ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, 
+      config.passes_per_query, config.adaptive_tolerance, &ao_values[0] );
+    bake::destroyAOContext( context );
+
+    std::vector<float*> vertex_ao( meshes.size() );
+    for (size_t k = 0; k < meshes.size(); ++k) vertex_ao[k] = &mesh_ao[meshes[k]][0];
+    bake::mapAOToVertices( part_scene, &num_samples_per_instance[0], ao_samples, &ao_values[0], config.filter_mode, config.regularization_weight, 
+      &vertex_ao[0], config.filter_cache_dir.empty() ? NULL : config.filter_cache_dir.c_str(), config.analytic_mass_weight, config.ls_solver, 
+      config.ls_patch_vertices, 1, config.weld_tolerance, config.ls_ordering );
+    destroy_ao_samples( ao_samples );
+  }
+
+  // Finds the isolated instances and gives them the AO of their mesh, loaded from the part cache or baked and saved
+  // there.  The scene bake still needs an instance, so if all are isolated the last one is traced anyway.
+  void resolve_part_cache( const Config& config, const bake::Scene& scene, const bake::Scene& context_scene, const float scene_bbox_min[3], 
+                           const float scene_bbox_max[3], const float scene_offset, const float scene_maxdistance, PartCache& parts )
+  {
+    std::cerr << "Part cache ...              "; std::cerr.flush();
+    Timer timer;
+    timer.start();
+    std::vector<char> isolated = find_isolated_instances( config, scene, context_scene, scene_bbox_min, scene_bbox_max, 
+                                                          scene_maxdistance + scene_offset );
+    if (scene.num_instances > 0 && std::count( isolated.begin(), isolated.end(), 1 ) == ptrdiff_t( scene.num_instances )) {
+      isolated.back() = 0;
+    }
+
+    std::vector<char> used( scene.num_meshes, 0 );
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      if (isolated[i]) used[scene.instances[i].mesh_index] = 1;
+    }
+    parts.mesh_ao.assign( scene.num_meshes, std::vector<float>() );
+    std::vector<uint64_t> keys( scene.num_meshes, 0 );
+    std::vector<char> loaded( scene.num_meshes, 0 );
+    const char* cache_dir = config.part_cache_dir.c_str();
+#pragma omp parallel for schedule(dynamic, 16)
+    for (ptrdiff_t m = 0; m < ptrdiff_t(scene.num_meshes); ++m) {
+      if (!used[m]) continue;
+      const bake::Mesh& mesh = scene.meshes[m];
+      keys[m] = part_cache_key( config, mesh, scene_offset, scene_maxdistance );
+      parts.mesh_ao[m].resize( std::max( mesh.num_vertices, size_t(1) ) );
+      loaded[m] = bake::loadPartAO( cache_dir, keys[m], mesh.num_vertices, &parts.mesh_ao[m][0] );
+    }
+    std::vector<unsigned> missing;
+    parts.num_loaded = 0;
+    for (size_t m = 0; m < scene.num_meshes; ++m) {
+      if (used[m] && loaded[m]) parts.num_loaded++;
+      if (used[m] && !loaded[m]) missing.push_back( unsigned( m ) );
+    }
+    parts.num_baked = missing.size();
+    if (!missing.empty()) {
+      bake_parts( config, scene, missing, scene_offset, scene_maxdistance, parts.mesh_ao );
+      size_t num_failed = 0;
+      for (size_t k = 0; k < missing.size(); ++k) {
+        const unsigned m = missing[k];
+        if (!bake::savePartAO( cache_dir, keys[m], scene.meshes[m].num_vertices, &parts.mesh_ao[m][0] )) num_failed++;
+      }
+      if (num_failed > 0) {
+        std::cerr << "\n\tFailed to save " << num_failed << " parts to " << config.part_cache_dir << "\n\t";
+      }
+    }
+
+    parts.instance_ao.assign( scene.num_instances, (float*)NULL );
+    parts.num_instances = 0;
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      if (!isolated[i]) continue;
+      parts.instance_ao[i] = &parts.mesh_ao[scene.instances[i].mesh_index][0];
+      parts.num_instances++;
+    }
+    printTimeElapsed( timer );
+    std::cerr << "\t" << parts.num_instances << " isolated instances of " << parts.num_loaded + parts.num_baked << " parts, " 
+              << parts.num_loaded << " from the cache, " << parts.num_baked << " baked" << std::endl;
+  }
+
+  // What --profile_meshes has per mesh of the baked scene besides the library's mesh profile
+  struct MeshProfileRows
+  {
+    std::vector<size_t> instances;
+    std::vector<size_t> samples;
+    std::vector<double> rays;
+    std::vector<double> ao_sums;  // over the samples, before any filter
+    bool has_ao;                  // false if the AO of the samples stayed on the device
+  };
+
+  void count_mesh_profile( const Config& config, const bake::Scene& scene, const size_t* num_samples_per_instance, 
+                           const std::vector<int>& rays_per_instance, const float* ao_values, MeshProfileRows& rows )
+  {
+    rows.instances.assign( scene.num_meshes, 0 );
+    rows.samples.assign( scene.num_meshes, 0 );
+    rows.rays.assign( scene.num_meshes, 0.0 );
+    rows.ao_sums.assign( scene.num_meshes, 0.0 );
+    rows.has_ao = ao_values != NULL;
+    size_t sample_offset = 0;
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      const size_t m = scene.instances[i].mesh_index;
+      const size_t n = num_samples_per_instance[i];
+      const int rays = rays_per_instance.empty() ? config.num_rays : rays_per_instance[i];
+      rows.instances[m]++;
+      rows.samples[m] += n;
+      rows.rays[m] += double( n ) * std::max( rays, 1 );
+      for (size_t k = 0; k < n && ao_values; ++k) rows.ao_sums[m] += ao_values[sample_offset + k];
+      sample_offset += n;
+    }
+  }
+
+  // Meshes no instance of was baked have no row.  Times are summed over the threads and instances of a mesh.
+  bool save_mesh_profile( const std::string& filename, const bake::Scene& scene, const MeshProfileRows& rows )
+  {
+    std::ofstream out( filename.c_str() );
+    if (!out) return false;
+    out << "mesh,instances,triangles,vertices,samples,rays,occluded_fraction,sample_ms,filter_assembly_ms,filter_factor_ms,"
+        << "filter_solve_ms,filter_ms,matrix_nnz,factor_nnz,fill_in" << std::endl;
+    for (size_t m = 0; m < scene.num_meshes; ++m) {
+      if (rows.instances[m] == 0) continue;
+      const double assembly = meshProfile( m, MESH_PROFILE_FILTER_ASSEMBLY_SECONDS );
+      const double factor = meshProfile( m, MESH_PROFILE_FILTER_FACTOR_SECONDS );
+      const double solve = meshProfile( m, MESH_PROFILE_FILTER_SOLVE_SECONDS );
+      const double matrix_nnz = meshProfile( m, MESH_PROFILE_MATRIX_NONZEROS );
+      const double factor_nnz = meshProfile( m, MESH_PROFILE_FACTOR_NONZEROS );
+      out << m << "," << rows.instances[m] << "," << scene.meshes[m].num_triangles << "," << scene.meshes[m].num_vertices << ","
+          << rows.samples[m] << "," << std::fixed << std::setprecision( 0 ) << rows.rays[m] << ",";
+      out << std::setprecision( 4 );
+      if (rows.has_ao && rows.samples[m] > 0) out << 1.0 - rows.ao_sums[m] / double( rows.samples[m] );
+      out << std::setprecision( 3 ) << "," << meshProfile( m, MESH_PROFILE_SAMPLE_SECONDS )*1000.0 << "," << assembly*1000.0 << ","
+          << factor*1000.0 << "," << solve*1000.0 << "," << (assembly + factor + solve)*1000.0 << ","
+          << std::setprecision( 0 ) << matrix_nnz << "," << factor_nnz << ",";
+      if (matrix_nnz > 0.0) out << std::setprecision( 3 ) << factor_nnz / matrix_nnz;
+      out << std::endl;
+      out.unsetf( std::ios::floatfield );
+    }
+    return bool( out );
+  }
+
+  // Stages of baking a chunk of instances, run by bake_instance_chunks on different threads for consecutive chunks
+  // Rays per sample of each instance by --large_instance_rays, then --instance_rays; empty if all trace config.num_rays
+  std::vector<int> instance_ray_budgets( const Config& config, const bake::Scene& scene, const float scene_bbox_min[3], 
+                                         const float scene_bbox_max[3] )
+  {
+    std::vector<int> rays;
+    if (config.instance_ray_counts.empty() && config.large_instance_rays == 0) return rays;
+    const float scene_scale = std::max( std::max( scene_bbox_max[0] - scene_bbox_min[0], scene_bbox_max[1] - scene_bbox_min[1] ),
+                                        scene_bbox_max[2] - scene_bbox_min[2] );
+    const float large_diagonal = config.large_instance_scale * scene_scale;
+    rays.assign( scene.num_instances, config.num_rays );
+    size_t num_changed = 0;
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      const bake::Instance& instance = scene.instances[i];
+      if (config.large_instance_rays > 0) {
+        float diagonal2 = 0.0f;
+        for (int k = 0; k < 3; ++k) diagonal2 += (instance.bbox_max[k] - instance.bbox_min[k]) * (instance.bbox_max[k] - instance.bbox_min[k]);
+        if (diagonal2 >= large_diagonal * large_diagonal) rays[i] = config.large_instance_rays;
+      }
+      for (size_t r = config.instance_ray_counts.size(); r-- > 0; ) {
+        if (instance.storage_identifier >= config.instance_ray_ranges[2*r] && instance.storage_identifier <= config.instance_ray_ranges[2*r+1]) {
+          rays[i] = config.instance_ray_counts[r];
+          break;
+        }
+      }
+      if (rays[i] != config.num_rays) num_changed++;
+    }
+    std::cerr << "Ray budgets: " << num_changed << " of " << scene.num_instances << " instances trace other than " 
+              << config.num_rays << " rays" << std::endl;
+    if (num_changed == 0) rays.clear();
+    return rays;
+  }
+
+  struct ChunkPipeline {
+    struct Chunk {
+      size_t begin;
+      size_t count;
+      size_t num_samples;
+      bake::AOSamples ao_samples;
+      AOValues* ao_values;  // NULL when the filter splats on the device
+      unsigned char* packed_ao;  // vertex AO quantized on the device for the writer, or NULL
+      Timer timer;
+    };
+
+    ChunkPipeline( const Config& config_, bake::Scene& scene_, bake::AOContext* context_, const size_t* num_samples_per_instance_,
+                   const float scene_offset_, const float scene_maxdistance_, bake::VertexAOWriter* writer_, float** vertex_ao_,
+                   const size_t first_instance_, const size_t end_instance_, const size_t chunk_size_, const int* rays_per_instance_ )
+      : config( config_ ), scene( scene_ ), context( context_ ), num_samples_per_instance( num_samples_per_instance_ ), 
+        scene_offset( scene_offset_ ), scene_maxdistance( scene_maxdistance_ ), writer( writer_ ), vertex_ao( vertex_ao_ ),
+        first_instance( first_instance_ ), end_instance( end_instance_ ), chunk_size( chunk_size_ ), 
+        rays_per_instance( rays_per_instance_ ) {}
+
+    bake::Scene instances( const size_t begin, const size_t count ) const {
+      const bake::Scene instances = { scene.meshes, scene.num_meshes, scene.instances + begin, count };
+      return instances;
+    }
+    bake::Scene instances( const Chunk& chunk ) const { return instances( chunk.begin, chunk.count ); }
+
+    // Vertex AO that only goes to an 8 or 16 bit file comes back from the device quantized, without floats on the host
+    bool pack_on_device( const Chunk& chunk ) const {
+      return writer && (config.output_bits == 8 || config.output_bits == 16) && !config.use_viewer && 
+        !config.loaded_vertex_order && splat_on_device( config, chunk.ao_samples );
+    }
+
+    // Instances and sample count of chunk index
+    void range( const size_t index, Chunk& chunk ) const {
+      chunk.begin = first_instance + index*chunk_size;
+      chunk.count = std::min( chunk_size, end_instance - chunk.begin );
+      chunk.num_samples = 0;
+      for (size_t i = chunk.begin; i < chunk.begin + chunk.count; ++i) chunk.num_samples += num_samples_per_instance[i];
+    }
+
+    void sample( const size_t index, Chunk& chunk ) {
+      chunk.timer.reset();
+      chunk.timer.start();
+      range( index, chunk );
+
+      const bake::Scene chunk_scene = instances( chunk );
+      allocate_ao_samples( chunk.ao_samples, chunk.num_samples, chunk_scene, config.gpu_sampling && !config.use_cpu, config.compact_samples, 
+        config.pinned_memory );
+      // Seeded as in a bake of all instances at once
+      for (size_t i = 0; i < chunk.begin; ++i) chunk.ao_samples.first_sample_index += num_samples_per_instance[i];
+      bake::sampleInstances( chunk_scene, &num_samples_per_instance[chunk.begin], config.min_samples_per_face, chunk.ao_samples, NULL,
+        config.sample_templates );
+      chunk.packed_ao = NULL;
+      if ( pack_on_device( chunk ) ) {
+        size_t num_vertices = 0;
+        for (size_t i = chunk.begin; i < chunk.begin + chunk.count; ++i ) {
+          num_vertices += scene.meshes[scene.instances[i].mesh_index].num_vertices;
+        }
+        chunk.packed_ao = new unsigned char[ std::max( num_vertices*(config.output_bits/8), size_t(1) ) ];
+      } else {
+        for (size_t i = chunk.begin; i < chunk.begin + chunk.count; ++i ) {
+          vertex_ao[i] = allocate_vertex_ao( scene.meshes[scene.instances[i].mesh_index].num_vertices );
+        }
+      }
+      chunk.ao_values = NULL;
+    }
+
+    void trace( Chunk& chunk ) {
+      ScopedSubmitThread submit_thread;
+      const bake::Scene chunk_scene = instances( chunk );
+      if ( chunk.packed_ao ) {
+        bake::computeAOToPackedVertices( context, chunk_scene,
+          chunk.ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, config.passes_per_query,
+          config.adaptive_tolerance, config.output_bits, chunk.packed_ao );
+      } else if ( splat_on_device( config, chunk.ao_samples ) ) {
+        bake::computeAOToVertices( context, chunk_scene,
+          chunk.ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, config.passes_per_query,
+          config.adaptive_tolerance, NULL, vertex_ao + chunk.begin );
+      } else {
+        chunk.ao_values = new AOValues( chunk.num_samples, config.pinned_memory );
+        if ( rays_per_instance ) {
+          bake::computeAOPerInstance( context, chunk_scene, chunk.ao_samples, num_samples_per_instance + chunk.begin, 
+            rays_per_instance + chunk.begin, scene_offset, scene_maxdistance, config.batch_size, config.passes_per_query,
+            config.adaptive_tolerance, &(*chunk.ao_values)[0] );
+        } else {
+          bake::computeAO( context, chunk_scene,
+            chunk.ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, config.passes_per_query,
+            config.adaptive_tolerance, &(*chunk.ao_values)[0] );
+        }
+        release_sample_geometry( chunk.ao_samples );
+      }
+    }
+
+    // Filter, save and release a traced chunk.  Chunks finish in order, so the writer appends them in order.
+    void finish( Chunk& chunk ) {
+      if (chunk.ao_values) {
+        bake::mapAOToVertices( instances( chunk ), &num_samples_per_instance[chunk.begin], chunk.ao_samples, &(*chunk.ao_values)[0], 
+          config.filter_mode, config.regularization_weight, vertex_ao + chunk.begin,
+          config.filter_cache_dir.empty() ? NULL : config.filter_cache_dir.c_str(), config.analytic_mass_weight, config.ls_solver, 
+          config.ls_patch_vertices, 1, config.weld_tolerance, config.ls_ordering );
+        delete chunk.ao_values;
+        chunk.ao_values = NULL;
+      }
+      destroy_ao_samples( chunk.ao_samples );
+
+      // The writer holds the instances of this partition
+      if (chunk.packed_ao) {
+        const bake::Scene partition = instances( first_instance, end_instance - first_instance );
+        writer->appendPacked( partition, chunk.begin - first_instance, chunk.count, chunk.packed_ao );
+        delete [] chunk.packed_ao;
+        chunk.packed_ao = NULL;
+      } else if (writer) {
+        const bake::Scene partition = instances( first_instance, end_instance - first_instance );
+        std::vector< std::vector<float> > copies;
+        std::vector<const float*> ptrs;
+        writer->append( partition, chunk.begin - first_instance, chunk.count, 
+                        in_loaded_order( config, partition, chunk.begin - first_instance, chunk.begin - first_instance + chunk.count, 
+                                         vertex_ao + first_instance, copies, ptrs ) );
+      }
+      if (!config.use_viewer) {
+        for (size_t i = chunk.begin; i < chunk.begin + chunk.count; ++i ) {
+          free_vertex_ao( vertex_ao[i] );
+          vertex_ao[i] = NULL;
+        }
+      }
+
+      chunk.timer.stop();
+      std::cerr << "Instances " << chunk.begin << " - " << chunk.begin + chunk.count - 1 << ", " << chunk.num_samples << " samples ... ";
+      printTimeElapsed( chunk.timer );
+    }
+
+    const Config& config;
+    bake::Scene& scene;
+    bake::AOContext* context;
+    const size_t* num_samples_per_instance;
+    const float scene_offset;
+    const float scene_maxdistance;
+    bake::VertexAOWriter* writer;
+    float** vertex_ao;
+    const size_t first_instance;  // the instances baked, all of them unless partitioned
+    const size_t end_instance;
+    const size_t chunk_size;
+    const int* rays_per_instance;  // NULL if all instances trace config.num_rays
+  private:
+    ChunkPipeline& operator=( const ChunkPipeline& ); // forbidden
+  };
+
+  // First instance of partition rank of count: the ranges are contiguous and split the samples about evenly, so every
+  // process that distributes the same samples picks the same ranges
+  size_t partition_begin( const size_t* num_samples_per_instance, const size_t num_instances, const size_t total_samples,
+                          const size_t rank, const size_t count )
+  {
+    if (rank >= count) return num_instances;
+    const double target = double( total_samples ) * double( rank ) / double( count );
+    size_t begin = 0;
+    size_t samples = 0;
+    while (begin < num_instances && double( samples ) < target) {
+      samples += num_samples_per_instance[begin++];
+    }
+    return begin;
+  }
+
+  // Bakes the chunks through a scratch file in --spill_dir instead: each chunk is sampled and written there, all of them
+  // are traced in one pass, with the samples read back ahead of the devices and the AO written back as batches finish,
+  // and then each chunk is filtered and saved from the file.  Host memory holds the samples of one chunk at a time.
+  bool bake_spilled_chunks( ChunkPipeline& pipeline, const size_t num_chunks )
+  {
+    const Config& config = pipeline.config;
+    size_t first_sample_index = 0;
+    for (size_t i = 0; i < pipeline.first_instance; ++i) first_sample_index += pipeline.num_samples_per_instance[i];
+    size_t num_samples = 0;
+    for (size_t i = pipeline.first_instance; i < pipeline.end_instance; ++i) num_samples += pipeline.num_samples_per_instance[i];
+
+    bake::SampleSpill* spill = bake::createSampleSpill( config.spill_dir.c_str(), num_samples, 
+      config.batch_size > 0 ? config.batch_size : SPILL_BLOCK_SAMPLES );
+    if (!spill) {
+      std::cerr << "Failed to create a spill file in " << config.spill_dir << std::endl;
+      return false;
+    }
+
+    Timer timer;
+    std::cerr << "Spill samples ...          "; std::cerr.flush();
+    timer.start();
+    bool ok = true;
+    size_t first_sample = 0;
+    for (size_t c = 0; c < num_chunks && ok; ++c) {
+      ChunkPipeline::Chunk chunk;
+      pipeline.range( c, chunk );
+      const bake::Scene chunk_scene = pipeline.instances( chunk );
+      allocate_ao_samples( chunk.ao_samples, chunk.num_samples, chunk_scene, false, false, false );
+      chunk.ao_samples.first_sample_index = first_sample_index + first_sample;
+      bake::sampleInstances( chunk_scene, &pipeline.num_samples_per_instance[chunk.begin], config.min_samples_per_face, chunk.ao_samples, NULL,
+        config.sample_templates );
+      ok = bake::spillSamples( spill, chunk.ao_samples, first_sample );
+      destroy_ao_samples( chunk.ao_samples );
+      first_sample += chunk.num_samples;
+    }
+    printTimeElapsed( timer );
+
+    if (ok) {
+      std::cerr << "Compute AO ...             "; std::cerr.flush();
+      timer.reset();
+      timer.start();
+      ScopedSubmitThread submit_thread;
+      const bake::Scene partition = pipeline.instances( pipeline.first_instance, pipeline.end_instance - pipeline.first_instance );
+      ok = bake::computeAOSpilled( pipeline.context, partition, spill, first_sample_index, config.num_rays, pipeline.scene_offset, 
+        pipeline.scene_maxdistance, config.batch_size, config.passes_per_query, config.adaptive_tolerance );
+      printTimeElapsed( timer );
+    }
+
+    // Chunks are filtered and saved in order, from their sample infos and AO in the file
+    first_sample = 0;
+    for (size_t c = 0; c < num_chunks && ok; ++c) {
+      ChunkPipeline::Chunk chunk;
+      chunk.timer.reset();
+      chunk.timer.start();
+      pipeline.range( c, chunk );
+      chunk.ao_samples = bake::AOSamples();
+      chunk.ao_samples.num_samples = chunk.num_samples;
+      chunk.ao_samples.sample_infos = static_cast<bake::SampleInfo*>( bake::allocateHostMemory( chunk.num_samples*sizeof(bake::SampleInfo), false ) );
+      chunk.ao_samples.sample_memory = bake::MEMORY_SPACE_HOST;
+      chunk.ao_samples.ao_memory = bake::MEMORY_SPACE_HOST;
+      chunk.ao_samples.first_sample_index = first_sample_index + first_sample;
+      chunk.ao_values = new AOValues( chunk.num_samples, false );
+      chunk.packed_ao = NULL;
+      ok = bake::readSpilledSamples( spill, first_sample, chunk.num_samples, chunk.ao_samples.sample_infos, &(*chunk.ao_values)[0] );
+      for (size_t i = chunk.begin; i < chunk.begin + chunk.count; ++i ) {
+        pipeline.vertex_ao[i] = allocate_vertex_ao( pipeline.scene.meshes[pipeline.scene.instances[i].mesh_index].num_vertices );
+      }
+      if (ok) {
+        pipeline.finish( chunk );
+      } else {
+        delete chunk.ao_values;
+        destroy_ao_samples( chunk.ao_samples );
+      }
+      first_sample += chunk.num_samples;
+    }
+
+    bake::destroySampleSpill( spill );
+    if (!ok) {
+      std::cerr << "Failed to read or write the spill file in " << config.spill_dir << std::endl;
+    }
+    return ok;
+  }
+
+  // Bakes a chunk of instances at a time, each traced against the full scene, so only one chunk's samples are 
+  // in memory and vertex AO is written out as chunks finish.  Accel structures are built once for all chunks.
+  // A partitioned bake does the same for its range of instances only.  False if a spilled bake fails.
+  bool bake_instance_chunks( const Config& config, bake::Scene& scene, const bake::Scene& context_scene, float scene_bbox_min[3], 
+                             float scene_bbox_max[3] )
+  {
+    Timer timer;
+
+    float scene_offset;
+    float scene_maxdistance;
+    scene_distances( config, scene_bbox_min, scene_bbox_max, scene_offset, scene_maxdistance );
+
+    std::cerr << "Build occluders ...        "; std::cerr.flush();
+    timer.start();
+    Occluders occluders;
+    make_occluders( config, scene, context_scene, scene_bbox_min, scene_bbox_max, occluders );
+    bake::AOContext* context = bake::createAOContext( occluders.scene, config.use_cpu, config.conserve_memory, 
+      config.devices.empty() ? NULL : &config.devices[0], config.devices.size(), config.accel_preset, occluders.analytic_ground_plane(), 
+      config.backend, config.peer_geometry, config.managed_geometry );
+    bake::setAOQueriesInFlight( context, config.queries_in_flight );
+    bake::setAOLatencyBudget( context, config.latency_budget );
+    bake::setAOFarField( context, config.far_field, config.far_field_resolution );
+    printTimeElapsed( timer );
+    // Each chunk is checkpointed as a sample set of its own, under its first sample index
+    begin_checkpoint( config, scene, occluders, context );
+
+    std::vector<size_t> num_samples_per_instance(scene.num_instances);
+    const size_t total_samples = bake::distributeSamples( scene, config.min_samples_per_face, config.num_samples, &num_samples_per_instance[0] );
+    std::cerr << "Total samples: " << total_samples << std::endl;
+    {
+      const size_t num_rays = static_cast<size_t>( std::max( config.num_rays, 1 ) );
+      std::cerr << "Rays per sample: " << num_rays << std::endl;
+      std::cerr << "Total rays: " << total_samples * num_rays << std::endl;
+    }
+
+    // Samples are distributed over the full scene, and seeded by their index in it, so partitions add up to a bake of all instances
+    const size_t first_instance = partition_begin( &num_samples_per_instance[0], scene.num_instances, total_samples, 
+      config.partition_rank, config.partition_count );
+    const size_t end_instance = partition_begin( &num_samples_per_instance[0], scene.num_instances, total_samples, 
+      config.partition_rank + 1, config.partition_count );
+    if (config.partition_count > 1) {
+      size_t partition_samples = 0;
+      for (size_t i = first_instance; i < end_instance; ++i) partition_samples += num_samples_per_instance[i];
+      std::cerr << "Partition " << config.partition_rank << " of " << config.partition_count << ": " << end_instance - first_instance 
+                << " instances from " << first_instance << ", " << partition_samples << " samples" << std::endl;
+    }
+    const bake::Scene partition = { scene.meshes, scene.num_meshes, scene.instances + first_instance, end_instance - first_instance };
+    const std::vector<int> rays_per_instance = instance_ray_budgets( config, scene, scene_bbox_min, scene_bbox_max );
+
+    bake::VertexAOWriter writer;
+    bool save = false;
+    if (!config.output_filename.empty()) {
+      save = writer.open( config.output_filename.c_str(), partition, config.output_bits, config.compress_output, config.output_index );
+      if (!save) {
+        std::cerr << "Failed to save vertex ao to: " << config.output_filename << std::endl;
+      }
+    }
+
+    float** vertex_ao = new float*[ scene.num_instances ];
+    std::fill( vertex_ao, vertex_ao + scene.num_instances, (float*)NULL );
+
+    // Each step samples chunk k+1, traces chunk k on this thread, which created the device context, and filters
+    // and saves chunk k-1, each stage on a thread of its own.  A step ends when all its stages do, so at most three
+    // chunks are in memory.  The device conjugate gradient filter would compete with the trace, so it doesn't overlap.
+    const size_t chunk_size = config.instance_chunk > 0 ? config.instance_chunk : std::max( partition.num_instances, size_t(1) );
+    const size_t num_chunks = ( partition.num_instances + chunk_size - 1 ) / chunk_size;
+    const int max_threads = maxThreads();
+    const bool pipelined = config.pipeline_chunks && max_threads > 1 && num_chunks > 1 && 
+                           config.filter_mode != bake::VERTEX_FILTER_LEAST_SQUARES_CG;
+    const size_t lag = pipelined ? 1 : 0;
+    ChunkPipeline pipeline( config, scene, context, &num_samples_per_instance[0], scene_offset, scene_maxdistance, 
+                            save ? &writer : NULL, vertex_ao, first_instance, end_instance, chunk_size, 
+                            rays_per_instance.empty() ? NULL : &rays_per_instance[0] );
+    bool ok = true;
+    if (!config.spill_dir.empty()) {
+      ok = bake_spilled_chunks( pipeline, num_chunks );
+    } else {
+      std::vector<ChunkPipeline::Chunk> chunks( 2*lag + 1 );
+      const int previous_levels = setMaxActiveLevels( pipelined ? 2 : 1 );
+      for (size_t step = 0; step < num_chunks + 2*lag; ++step) {
+#pragma omp parallel num_threads(3) if(pipelined)
+        {
+          // Sampling and filtering loops share the cores that the trace leaves
+          if (pipelined && threadIndex() > 0) setMaxThreads( std::max( max_threads / 2, 1 ) );
+          if (step < num_chunks && threadIndex() == 1 % numThreads()) {
+            pipeline.sample( step, chunks[step % chunks.size()] );
+          }
+          if (step >= lag && step - lag < num_chunks && threadIndex() == 0) {
+            pipeline.trace( chunks[(step - lag) % chunks.size()] );
+          }
+          if (step >= 2*lag && step - 2*lag < num_chunks && threadIndex() == 2 % numThreads()) {
+            pipeline.finish( chunks[(step - 2*lag) % chunks.size()] );
+          }
+        }
+      }
+      setMaxActiveLevels( previous_levels );
+    }
+
+    // Lightmaps are not partitioned; the first partition bakes all of them
+    bake::setAOCheckpoint( context, NULL, 0 );
+    if (config.lightmap_size > 0 && config.partition_rank == 0) {
+      bake_lightmaps( config, scene, context, occluders.scene, scene_offset, scene_maxdistance );
+    }
+
+    bake::destroyAOContext( context );
+
+    if (save) {
+      if (writer.close()) {
+        std::cerr << "Saved vertex ao to: " << config.output_filename << std::endl;
+      } else {
+        std::cerr << "Failed to save vertex ao to: " << config.output_filename << std::endl;
+      }
+    }
+
+#ifndef BAKE_HEADLESS
+    if (config.use_viewer){
+      std::cerr << "Launch viewer  ... \n" << std::endl;
+      bake::view(scene.meshes, scene.num_meshes, scene.instances, scene.num_instances, vertex_ao, scene_bbox_min, scene_bbox_max);
+    }
+#endif
+
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      free_vertex_ao( vertex_ao[i] );
+    }
+    delete [] vertex_ao;
+    return ok;
+  }
+
+}
+
+
+
+namespace {
+
+  // Timings and counts of one bake, for batch job records
+  struct JobStats {
+    size_t num_instances;
+    size_t num_triangles;
+    size_t num_samples;
+    double load_ms;
+    double sample_ms;
+    double ao_ms;
+    double accel_ms;  // part of ao_ms
+    double map_ms;
+    double lightmap_ms;
+    double save_ms;
+
+    JobStats() : num_instances( 0 ), num_triangles( 0 ), num_samples( 0 ), 
+      load_ms( 0 ), sample_ms( 0 ), ao_ms( 0 ), accel_ms( 0 ), map_ms( 0 ), lightmap_ms( 0 ), save_ms( 0 ) {}
+  };
+
+  // Rough peak bytes of phases the planner cannot size exactly.  Accel builds keep vertices, indices, the BVH
+  // and build scratch of every occluder triangle; the filters factorize one instance at a time, so the largest
+  // mesh bounds them.
+  const size_t ACCEL_BYTES_PER_TRIANGLE = 128;
+  const size_t LEAST_SQUARES_BYTES_PER_VERTEX = 1536;        // R, mass matrix and LDLT fill in double
+  const size_t FLOAT_LEAST_SQUARES_BYTES_PER_VERTEX = 1024;  // float factorization, plus the double retry pattern
+  const size_t MATRIX_FREE_BYTES_PER_VERTEX = 128;           // butterfly blocks and CG vectors
+  const size_t HOST_CG_BYTES_PER_VERTEX = 768;               // R, mass and system matrices, incomplete factor, CG vectors
+  const size_t AREA_BASED_BYTES_PER_VERTEX = 16;
+
+  // Estimated memory of each phase of a bake, and the settings picked to fit the budgets of the config
+  struct MemoryPlan {
+    size_t num_samples;
+    size_t num_baked_instances;
+    size_t sample_bytes;       // host sample infos, positions and normals of all baked instances
+    size_t sort_bytes;         // host sort order
+    size_t ao_bytes;           // host AO values of all channels
+    size_t accel_bytes;        // per device, or host for the CPU tracer
+    size_t batch_bytes;        // per device, or host for the CPU tracer
+    size_t filter_bytes;       // host, for the largest mesh
+    size_t output_bytes;       // host vertex AO
+    size_t host_peak_bytes;
+    size_t device_peak_bytes;  // per device; 0 for the CPU tracer
+
+    size_t batch_size;
+    size_t instance_chunk;
+    bake::VertexFilterMode filter_mode;
+    bool fits;
+  };
+
+  size_t filter_bytes_per_vertex( const bake::VertexFilterMode mode )
+  {
+    switch (mode) {
+      case bake::VERTEX_FILTER_LEAST_SQUARES:             return LEAST_SQUARES_BYTES_PER_VERTEX;
+      case bake::VERTEX_FILTER_LEAST_SQUARES_FLOAT:       return FLOAT_LEAST_SQUARES_BYTES_PER_VERTEX;
+      case bake::VERTEX_FILTER_LEAST_SQUARES_MATRIX_FREE: return MATRIX_FREE_BYTES_PER_VERTEX;
+      case bake::VERTEX_FILTER_LEAST_SQUARES_HOST_CG:     return HOST_CG_BYTES_PER_VERTEX;
+      default:                                            return AREA_BASED_BYTES_PER_VERTEX;
+    }
+  }
+
+  // Peaks of the trace and filter phases, with the samples of 'chunk' of the baked instances in memory at a time.
+  // Sample geometry is released before the filters run.  Pipelined chunks keep up to three chunks in memory, spilled
+  // chunks one.
+  void estimate_memory_peaks( const Config& config, const size_t chunk, MemoryPlan& plan )
+  {
+    const bool chunked = chunk > 0 && chunk < plan.num_baked_instances;
+    const double chunks_in_memory = config.pipeline_chunks && config.spill_dir.empty() ? 3.0 : 1.0;
+    const double fraction = chunked ? std::min( chunks_in_memory * double( chunk ) / double( plan.num_baked_instances ), 1.0 ) : 1.0;
+    const size_t samples = size_t( fraction * double( plan.sample_bytes + plan.sort_bytes + plan.ao_bytes ) );
+    const size_t output = size_t( fraction * double( plan.output_bytes ) );
+    const size_t traced_on_host = config.use_cpu ? plan.accel_bytes + plan.batch_bytes : 0;
+    const size_t info_bytes = config.compact_samples ? sizeof( bake::CompactSampleInfo ) : sizeof( bake::SampleInfo );
+    const size_t filtered = size_t( fraction * double( plan.num_samples * info_bytes + plan.ao_bytes ) ) + output + plan.filter_bytes;
+    plan.host_peak_bytes = std::max( samples + output + traced_on_host, filtered );
+    plan.device_peak_bytes = config.use_cpu ? 0 : plan.accel_bytes + plan.batch_bytes;
+    if (plan.filter_mode == bake::VERTEX_FILTER_LEAST_SQUARES_CG && !config.use_cpu) {
+      plan.device_peak_bytes = std::max( plan.device_peak_bytes, plan.filter_bytes );
+    }
+  }
+
+  // Estimate host and device memory of each phase, and pick the batch size, instance chunks and least squares solver
+  // so the bake fits the budgets of the config.  Settings given on the command line are kept.
+  MemoryPlan plan_memory( const Config& config, const bake::Scene& scene, const bake::Scene& context_scene )
+  {
+    MemoryPlan plan;
+
+    // Samples are distributed as the bake will, over one instance per mesh when meshes share their AO
+    bake::Scene baked_scene = scene;
+    std::vector<bake::Instance> representatives;
+    std::vector<size_t> representative_of;
+    if (config.share_mesh_ao) {
+      select_mesh_representatives( scene, representatives, representative_of );
+      baked_scene.instances = representatives.empty() ? NULL : &representatives[0];
+      baked_scene.num_instances = representatives.size();
+    }
+    std::vector<size_t> num_samples_per_instance( baked_scene.num_instances );
+    plan.num_samples = baked_scene.num_instances > 0 ? 
+      bake::distributeSamples( baked_scene, config.min_samples_per_face, config.num_samples, &num_samples_per_instance[0] ) : 0;
+    plan.num_baked_instances = baked_scene.num_instances;
+
+    size_t num_triangles = 0, num_vertices = 0, max_mesh_vertices = 0;
+    for (size_t i = 0; i < scene.num_meshes; ++i) {
+      num_triangles += scene.meshes[i].num_triangles;
+      max_mesh_vertices = std::max( max_mesh_vertices, size_t( scene.meshes[i].num_vertices ) );
+    }
+    size_t num_context_triangles = 0;
+    for (size_t i = 0; i < context_scene.num_meshes; ++i) num_context_triangles += context_scene.meshes[i].num_triangles;
+    size_t num_baked_triangles = 0;
+    for (size_t i = 0; i < baked_scene.num_instances; ++i) {
+      const bake::Mesh& mesh = baked_scene.meshes[baked_scene.instances[i].mesh_index];
+      num_baked_triangles += mesh.num_triangles;
+      num_vertices += mesh.num_vertices;
+    }
+
+    const bool device_samples = config.gpu_sampling && !config.use_cpu && config.move_instance < 0;
+    const bool directional = config.bent_normals || config.sh_visibility;
+    const size_t num_channels = config.two_sided ? 2 : directional ? 4 : std::max( config.hit_distances.size(), size_t(1) );
+    plan.sample_bytes = plan.num_samples * (config.compact_samples ? sizeof( bake::CompactSampleInfo ) : sizeof( bake::SampleInfo ))
+      + (config.compact_samples ? num_baked_triangles*sizeof(float) : 0)
+      + (device_samples ? num_baked_triangles*sizeof(unsigned) : plan.num_samples*9*sizeof(float))
+      + (config.reconstruct_samples ? plan.num_samples*sizeof(unsigned) : 0);
+    plan.sort_bytes = config.sort_samples && !device_samples ? plan.num_samples*sizeof(size_t) : 0;
+    plan.ao_bytes = plan.num_samples*num_channels*sizeof(float);
+    plan.output_bytes = num_vertices*sizeof(float)*(directional ? 1 + 4 : 1);
+    plan.accel_bytes = (num_triangles + num_context_triangles)*ACCEL_BYTES_PER_TRIANGLE;
+
+    const bool adaptive = config.adaptive_tolerance > 0.0f;
+    const size_t bytes_per_batch_sample = bake::batchBytesPerSample( config.passes_per_query, adaptive, num_channels, config.hit_distances.size(), 
+                                                                       config.queries_in_flight );
+    plan.batch_size = config.batch_size;
+    plan.instance_chunk = config.instance_chunk;
+    plan.filter_mode = config.filter_mode;
+    plan.fits = true;
+
+    // Batches fill what the accels leave of the budget that holds them.  The CPU tracer shares host memory with the
+    // samples, so its batches get a quarter of the host budget.
+    const size_t trace_budget = config.use_cpu ? config.host_memory_budget / 4 : config.device_memory_budget;
+    if (plan.batch_size == 0 && trace_budget > 0) {
+      if (trace_budget > plan.accel_bytes + bytes_per_batch_sample) {
+        plan.batch_size = std::min( (trace_budget - plan.accel_bytes) / bytes_per_batch_sample, plan.num_samples );
+      } else {
+        plan.fits = false;
+      }
+    }
+    const size_t batch_samples = plan.batch_size > 0 ? std::min( plan.batch_size, plan.num_samples ) : plan.num_samples;
+    plan.batch_bytes = batch_samples*bytes_per_batch_sample;
+
+    // Step down to leaner least squares solvers while the largest mesh does not fit
+    // Patched meshes hold a patch per thread, overlap included
+    const size_t filter_vertices = config.ls_patch_vertices > 0 ? 
+                                   std::min( max_mesh_vertices, 2*config.ls_patch_vertices*size_t( maxThreads() ) ) : max_mesh_vertices;
+    plan.filter_bytes = filter_vertices*filter_bytes_per_vertex( plan.filter_mode );
+    estimate_memory_peaks( config, plan.instance_chunk, plan );
+    if (config.host_memory_budget > 0) {
+      while (plan.host_peak_bytes > config.host_memory_budget && 
+             (plan.filter_mode == bake::VERTEX_FILTER_LEAST_SQUARES || plan.filter_mode == bake::VERTEX_FILTER_LEAST_SQUARES_FLOAT)) {
+        plan.filter_mode = plan.filter_mode == bake::VERTEX_FILTER_LEAST_SQUARES ? bake::VERTEX_FILTER_LEAST_SQUARES_FLOAT : 
+                                                                                  bake::VERTEX_FILTER_LEAST_SQUARES_MATRIX_FREE;
+        plan.filter_bytes = filter_vertices*filter_bytes_per_vertex( plan.filter_mode );
+        estimate_memory_peaks( config, plan.instance_chunk, plan );
+      }
+
+      // Then bake fewer instances at a time.  A shared bake is not chunked.
+      if (plan.instance_chunk == 0 && !config.share_mesh_ao) {
+        size_t chunk = plan.num_baked_instances;
+        while (chunk > 1 && plan.host_peak_bytes > config.host_memory_budget) {
+          const size_t scaled = size_t( double( chunk ) * double( config.host_memory_budget ) / double( plan.host_peak_bytes ) );
+          chunk = std::max( std::min( scaled, chunk - 1 ), size_t(1) );
+          plan.instance_chunk = chunk;
+          estimate_memory_peaks( config, plan.instance_chunk, plan );
+        }
+      }
+      if (plan.host_peak_bytes > config.host_memory_budget) plan.fits = false;
+    }
+    if (config.device_memory_budget > 0 && plan.device_peak_bytes > config.device_memory_budget) plan.fits = false;
+    return plan;
+  }
+
+  void print_memory_plan( const Config& config, const MemoryPlan& plan )
+  {
+    const double mb = 1.0 / double( 1 << 20 );
+    const char* traced_on = config.use_cpu ? "host" : "per device";
+    std::cerr << std::fixed << std::setprecision( 1 );
+    std::cerr << "Memory plan: " << plan.num_samples << " samples" << std::endl;
+    std::cerr << "\tsampling:        " << (plan.sample_bytes + plan.sort_bytes)*mb << " MB host" << std::endl;
+    std::cerr << "\taccel build:     " << plan.accel_bytes*mb << " MB " << traced_on << std::endl;
+    std::cerr << "\tbatch:           " << plan.batch_bytes*mb << " MB " << traced_on << std::endl;
+    std::cerr << "\tAO values:       " << plan.ao_bytes*mb << " MB host" << std::endl;
+    std::cerr << "\tfilter matrices: " << plan.filter_bytes*mb << " MB " 
+              << (plan.filter_mode == bake::VERTEX_FILTER_LEAST_SQUARES_CG && !config.use_cpu ? "per device" : "host") << std::endl;
+    std::cerr << "\toutput:          " << plan.output_bytes*mb << " MB host" << std::endl;
+    std::cerr << "\tpeak:            " << plan.host_peak_bytes*mb << " MB host";
+    if (config.host_memory_budget > 0) std::cerr << " (budget " << config.host_memory_budget*mb << ")";
+    if (!config.use_cpu) {
+      std::cerr << ", " << plan.device_peak_bytes*mb << " MB per device";
+      if (config.device_memory_budget > 0) std::cerr << " (budget " << config.device_memory_budget*mb << ")";
+    }
+    std::cerr << std::endl;
+    std::cerr.unsetf( std::ios_base::floatfield );
+    std::cerr << std::setprecision( 6 );
+
+    static const char* filter_names[] = { "area based", "least squares", "least squares CG", "least squares matrix free", "least squares float",
+                                          "least squares host CG" };
+    std::cerr << "\tbatch size: ";
+    if (plan.batch_size > 0) std::cerr << plan.batch_size; else std::cerr << "auto";
+    std::cerr << ", instance chunk: ";
+    if (plan.instance_chunk > 0) std::cerr << plan.instance_chunk; else std::cerr << "all";
+    std::cerr << ", filter: " << filter_names[plan.filter_mode] << std::endl;
+    if (!plan.fits) {
+      std::cerr << "\tdoes not fit the memory budget" << std::endl;
+    }
+  }
+
+  // Filter and save the AO of extra channels, i.e. smaller hit distances or the back side, to <outfile><suffix>
+  // Vertex samples are the vertices of the instances in order, so their AO is the vertex AO
+  void copy_vertex_ao( const bake::Scene& scene, const float* ao_values, float** vertex_ao )
+  {
+    size_t offset = 0;
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      const size_t num_vertices = scene.meshes[scene.instances[i].mesh_index].num_vertices;
+      std::copy( ao_values + offset, ao_values + offset + num_vertices, vertex_ao[i] );
+      offset += num_vertices;
+    }
+  }
+
+  // AO and bent normals, or SH visibility, are filtered together, as right hand sides of one solve per mesh.  The AO
+  // goes to baked_ao, and the bent normals, renormalized, or the SH coefficients, mapped to [0, 1], to files next to 
+  // the output.
+  void map_directional_ao( const Config& config, bake::Scene& scene, const bake::Scene& baked_scene, const std::vector<size_t>& representative_of,
+    const size_t* num_samples_per_instance, const bake::AOSamples& ao_samples, const float* ao_values, float** baked_ao )
+  {
+    const size_t num_channels = 4;
+    std::vector< std::vector<float> > channels( baked_scene.num_instances );
+    std::vector<float*> channel_ptrs( baked_scene.num_instances );
+    for (size_t i = 0; i < baked_scene.num_instances; ++i) {
+      channels[i].resize( num_channels*baked_scene.meshes[baked_scene.instances[i].mesh_index].num_vertices );
+      channel_ptrs[i] = channels[i].empty() ? NULL : &channels[i][0];
+    }
+    if (config.vertex_samples) {
+      std::vector<float*> ptrs( baked_scene.num_instances );
+      for (size_t c = 0; c < num_channels; ++c) {
+        for (size_t i = 0; i < baked_scene.num_instances; ++i) ptrs[i] = channel_ptrs[i] + c*channels[i].size()/num_channels;
+        copy_vertex_ao( baked_scene, ao_values + c*ao_samples.num_samples, &ptrs[0] );
+      }
+    } else {
+      bake::mapAOToVertices( baked_scene, num_samples_per_instance, ao_samples, ao_values, config.filter_mode, config.regularization_weight, 
+        &channel_ptrs[0], config.filter_cache_dir.empty() ? NULL : config.filter_cache_dir.c_str(), config.analytic_mass_weight, config.ls_solver, 
+        config.ls_patch_vertices, num_channels, config.weld_tolerance, config.ls_ordering );
+    }
+
+    // SH coefficients are within +-0.49
+    const bool sh = config.sh_visibility;
+#pragma omp parallel for schedule(dynamic, 16)
+    for (ptrdiff_t i = 0; i < ptrdiff_t(baked_scene.num_instances); ++i) {
+      const size_t num_vertices = channels[i].size()/num_channels;
+      float* ao = channel_ptrs[i];
+      for (size_t v = 0; v < num_vertices; ++v) {
+        if (sh) {
+          baked_ao[i][v] = ao[v] / bake::SH_Y00;
+          for (size_t c = 0; c < num_channels; ++c) ao[c*num_vertices + v] += 0.5f;
+          continue;
+        }
+        baked_ao[i][v] = ao[v];
+        float* n[3] = { ao + num_vertices + v, ao + 2*num_vertices + v, ao + 3*num_vertices + v };
+        const float len = std::sqrt( *n[0] * *n[0] + *n[1] * *n[1] + *n[2] * *n[2] );
+        const float scale = len > 0.0f ? 0.5f / len : 0.0f;
+        for (int k = 0; k < 3; ++k) *n[k] = 0.5f + scale * *n[k];
+      }
+    }
+
+    if (config.output_filename.empty()) return;
+    static const char* bent_suffixes[] = { ".bent_x", ".bent_y", ".bent_z" };
+    static const char* sh_suffixes[] = { ".sh0", ".sh1", ".sh2", ".sh3" };
+    const size_t first_channel = sh ? 0 : 1;
+    std::vector<float*> vertex_values( scene.num_instances );
+    for (size_t c = first_channel; c < num_channels; ++c) {
+      for (size_t i = 0; i < scene.num_instances; ++i) {
+        const size_t b = representative_of[i];
+        vertex_values[i] = channel_ptrs[b] + c*(channels[b].size()/num_channels);
+      }
+      Config channel_config = config;
+      channel_config.output_filename = config.output_filename + (sh ? sh_suffixes[c] : bent_suffixes[c - 1]);
+      if (!config.patch_base_filename.empty()) {
+        channel_config.patch_base_filename = config.patch_base_filename + (sh ? sh_suffixes[c] : bent_suffixes[c - 1]);
+      }
+      const char* what = sh ? "SH visibility" : "bent normals";
+      size_t num_shared_instances = 0;
+      if (save_results( channel_config, scene, &vertex_values[0], num_shared_instances )) {
+        std::cerr << "Saved " << what << " to: " << channel_config.output_filename << std::endl;
+      } else {
+        std::cerr << "Failed to save " << what << " to: " << channel_config.output_filename << std::endl;
+      }
+    }
+  }
+
+  // Filters the main channel for every weight of a -w sweep, with one assembly per instance: the first weight into
+  // baked_ao, as without a sweep, and the others saved next to the output file
+  void filter_weight_sweep( const Config& config, bake::Scene& scene, const bake::Scene& baked_scene, const std::vector<size_t>& representative_of,
+    const size_t* num_samples_per_instance, const bake::AOSamples& ao_samples, const float* ao_values, float** baked_ao )
+  {
+    const size_t num_weights = config.regularization_weights.size();
+    std::vector< std::vector<float> > swept_ao( baked_scene.num_instances );
+    std::vector<float*> swept_ao_ptrs( baked_scene.num_instances );
+    for (size_t i = 0; i < baked_scene.num_instances; ++i) {
+      swept_ao[i].resize( num_weights*baked_scene.meshes[baked_scene.instances[i].mesh_index].num_vertices );
+      swept_ao_ptrs[i] = swept_ao[i].empty() ? NULL : &swept_ao[i][0];
+    }
+    bake::mapAOToVertices( baked_scene, num_samples_per_instance, ao_samples, ao_values, config.filter_mode, config.regularization_weight, 
+      swept_ao_ptrs.empty() ? NULL : &swept_ao_ptrs[0], config.filter_cache_dir.empty() ? NULL : config.filter_cache_dir.c_str(), 
+      config.analytic_mass_weight, config.ls_solver, config.ls_patch_vertices, 1, config.weld_tolerance, config.ls_ordering, 
+      &config.regularization_weights[0], num_weights );
+
+    for (size_t i = 0; i < baked_scene.num_instances; ++i) {
+      std::copy( swept_ao[i].begin(), swept_ao[i].begin() + swept_ao[i].size()/num_weights, baked_ao[i] );
+    }
+    std::vector<const float*> vertex_ao( scene.num_instances );
+    for (size_t k = 1; k < num_weights; ++k) {
+      for (size_t i = 0; i < scene.num_instances; ++i) {
+        const std::vector<float>& ao = swept_ao[representative_of[i]];
+        vertex_ao[i] = ao.empty() ? NULL : &ao[0] + k*(ao.size()/num_weights);
+      }
+      Config weight_config = config;
+      std::ostringstream suffix;
+      suffix << ".w" << k;
+      weight_config.output_filename = config.output_filename + suffix.str();
+      size_t num_shared_instances = 0;
+      if (save_results( weight_config, scene, vertex_ao.empty() ? NULL : &vertex_ao[0], num_shared_instances )) {
+        std::cerr << "Saved vertex ao for -w " << config.regularization_weights[k] << " to: " << weight_config.output_filename << std::endl;
+      } else {
+        std::cerr << "Failed to save vertex ao to: " << weight_config.output_filename << std::endl;
+      }
+    }
+  }
+
+  void save_ao_channels( const Config& config, bake::Scene& scene, const bake::Scene& baked_scene, const std::vector<size_t>& representative_of,
+    const size_t* num_samples_per_instance, const bake::AOSamples& ao_samples, const float* ao_values, 
+    const std::vector<size_t>& channels, const std::vector<std::string>& suffixes )
+  {
+    std::vector< std::vector<float> > baked_ao( baked_scene.num_instances );
+    std::vector<float*> baked_ao_ptrs( baked_scene.num_instances );
+    for (size_t i = 0; i < baked_scene.num_instances; ++i) {
+      baked_ao[i].resize( baked_scene.meshes[baked_scene.instances[i].mesh_index].num_vertices );
+      baked_ao_ptrs[i] = baked_ao[i].empty() ? NULL : &baked_ao[i][0];
+    }
+    std::vector<float*> vertex_ao( scene.num_instances );
+    for (size_t i = 0; i < scene.num_instances; ++i) vertex_ao[i] = baked_ao_ptrs[representative_of[i]];
+
+    for (size_t k = 0; k < channels.size(); ++k) {
+      if (config.vertex_samples) {
+        copy_vertex_ao( baked_scene, ao_values + channels[k]*ao_samples.num_samples, &baked_ao_ptrs[0] );
+      } else {
+        bake::mapAOToVertices( baked_scene, num_samples_per_instance, ao_samples, ao_values + channels[k]*ao_samples.num_samples, config.filter_mode, 
+          config.regularization_weight, &baked_ao_ptrs[0], config.filter_cache_dir.empty() ? NULL : config.filter_cache_dir.c_str(), 
+          config.analytic_mass_weight, config.ls_solver, config.ls_patch_vertices, 1, config.weld_tolerance, config.ls_ordering );
+      }
+      Config channel_config = config;
+      channel_config.output_filename = config.output_filename + suffixes[k];
+      if (!config.patch_base_filename.empty()) channel_config.patch_base_filename = config.patch_base_filename + suffixes[k];
+      size_t num_shared_instances = 0;
+      if (save_results( channel_config, scene, &vertex_ao[0], num_shared_instances )) {
+        std::cerr << "Saved vertex ao to: " << channel_config.output_filename << std::endl;
+      } else {
+        std::cerr << "Failed to save vertex ao to: " << channel_config.output_filename << std::endl;
+      }
+    }
+  }
+
+  // Traces the samples again for each --occluder_variant, with its instances hidden from the accels of the bake, and
+  // saves the result next to the output like an extra channel.  Only the top levels are rebuilt.
+  bool bake_occluder_variants( const Config& config, bake::Scene& scene, const bake::Scene& baked_scene, 
+    const std::vector<size_t>& representative_of, const Occluders& occluders, bake::AOContext* context, 
+    const size_t* num_samples_per_instance, const std::vector<int>& rays_per_instance, const bake::AOSamples& ao_samples, 
+    float scene_offset, float scene_maxdistance )
+  {
+    // The mesh ground plane, if any, is the last occluder
+    const size_t num_occluders = occluders.scene.num_instances;
+    const size_t num_ground = occluders.blocker_instances.size();
+    std::vector<unsigned char> visible( num_occluders );
+    std::vector<float> variant_ao( ao_samples.num_samples );
+    const std::vector<size_t> channels( 1, 0 );
+    bool ok = true;
+    for (size_t v = 0; v < config.occluder_variant_suffixes.size() && ok; ++v) {
+      const std::string& name = config.occluder_variant_suffixes[v];
+      const std::vector<int>& hidden = config.occluder_variant_hidden[v];
+      std::fill( visible.begin(), visible.end(), (unsigned char)1 );
+      for (size_t k = 0; k < hidden.size() && ok; ++k) {
+        if (hidden[k] < 0 ? num_ground == 0 : size_t(hidden[k]) >= num_occluders - num_ground) {
+          std::cerr << "Occluder variant " << name << ": no " << (hidden[k] < 0 ? "mesh ground plane" : "such instance") << std::endl;
+          ok = false;
+        } else {
+          visible[hidden[k] < 0 ? num_occluders - 1 : size_t(hidden[k])] = 0;
+        }
+      }
+      if (ok && std::count( visible.begin(), visible.end(), 0 ) == ptrdiff_t(num_occluders)) {
+        std::cerr << "Occluder variant " << name << " hides every occluder" << std::endl;
+        ok = false;
+      }
+      if (!ok) break;
+
+      std::cerr << "Bake occluder variant " << name << " ... "; std::cerr.flush();
+      Timer timer;
+      timer.start();
+      bake::setAOOccluderMask( context, &visible[0], num_occluders );
+      if (!rays_per_instance.empty()) {
+        bake::computeAOPerInstance( context, baked_scene, ao_samples, num_samples_per_instance, &rays_per_instance[0], scene_offset, 
+          scene_maxdistance, config.batch_size, config.passes_per_query, config.adaptive_tolerance, &variant_ao[0] );
+      } else {
+        bake::computeAO( context, baked_scene, ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, 
+          config.passes_per_query, config.adaptive_tolerance, &variant_ao[0] );
+      }
+      printTimeElapsed( timer );
+      recordTime( "ao.occluder_variant", timer );
+      save_ao_channels( config, scene, baked_scene, representative_of, num_samples_per_instance, ao_samples, &variant_ao[0], channels, 
+        std::vector<std::string>( 1, "." + name ) );
+    }
+    bake::setAOOccluderMask( context, NULL, 0 );
+    return ok;
+  }
+
+  // The scene files of --frames, one per line
+  bool read_frame_list( const std::string& filename, std::vector<std::string>& frames )
+  {
+    std::ifstream file( filename.c_str() );
+    if (!file) return false;
+    std::string line;
+    while (std::getline( file, line )) {
+      if (!line.empty() && line[line.size()-1] == '\r') line.erase( line.size() - 1 );
+      if (!line.empty()) frames.push_back( line );
+    }
+    return !frames.empty();
+  }
+
+  // Whether a frame has the meshes and instances of the -f scene, with the same triangles, only moved vertices
+  bool same_topology( const bake::Scene& scene, const bake::Scene& frame )
+  {
+    if (frame.num_meshes != scene.num_meshes || frame.num_instances != scene.num_instances) return false;
+    for (size_t m = 0; m < scene.num_meshes; ++m) {
+      const bake::Mesh& a = scene.meshes[m];
+      const bake::Mesh& b = frame.meshes[m];
+      if (a.num_vertices != b.num_vertices || a.num_triangles != b.num_triangles ||
+          !std::equal( a.tri_vertex_indices, a.tri_vertex_indices + 3*a.num_triangles, b.tri_vertex_indices )) {
+        return false;
+      }
+    }
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      if (frame.instances[i].mesh_index != scene.instances[i].mesh_index) return false;
+    }
+    return true;
+  }
+
+  // Bakes the --frames of an animation of the scene after it, and saves the scene's vertex AO then each frame's to
+  // <outfile>.frames as they are done.  The samples of the bake are placed on each frame's vertices at the same
+  // barycentrics, the accels are refit to them, and the least squares filters keep their systems from frame to frame
+  // and start from the frame before.  Instances and their transforms stay those of the scene.
+  bool bake_frames( const Config& config, bake::Scene& scene, const bake::Scene& baked_scene, 
+    const std::vector<size_t>& representative_of, const Occluders& occluders, bake::AOContext* context, 
+    const size_t* num_samples_per_instance, const std::vector<int>& rays_per_instance, bake::AOSamples& ao_samples, 
+    float scene_offset, float scene_maxdistance, float** baked_ao, float** vertex_ao )
+  {
+    std::vector<std::string> frames;
+    if (!read_frame_list( config.frames_filename, frames )) {
+      std::cerr << "Failed to read frames from: " << config.frames_filename << std::endl;
+      return false;
+    }
+
+    // Every frame goes after the scene's instances, as the same instances again
+    const size_t num_instances = scene.num_instances;
+    const size_t num_frames = frames.size() + 1;
+    std::vector<bake::Instance> sequence_instances( num_frames*num_instances );
+    for (size_t f = 0; f < num_frames; ++f) {
+      std::copy( scene.instances, scene.instances + num_instances, sequence_instances.begin() + f*num_instances );
+    }
+    const bake::Scene sequence = { scene.meshes, scene.num_meshes, sequence_instances.empty() ? NULL : &sequence_instances[0], 
+                                   sequence_instances.size() };
+    const std::string frames_output = config.output_filename + ".frames";
+    bake::VertexAOWriter writer;
+    std::vector<const float*> sequence_ao( sequence_instances.size(), (const float*)NULL );
+    std::copy( vertex_ao, vertex_ao + num_instances, sequence_ao.begin() );
+    if (!writer.open( frames_output.c_str(), sequence, config.output_bits, config.compress_output, config.output_index ) ||
+        !writer.append( sequence, 0, num_instances, &sequence_ao[0] )) {
+      std::cerr << "Failed to save frames to: " << frames_output << std::endl;
+      return false;
+    }
+
+    // Two frames of vertex AO, the one baked and the one before, which its iterative solves start from
+    std::vector<size_t> offsets( baked_scene.num_instances + 1 );
+    const size_t num_values = bake::vertexAOOffsets( baked_scene, 1, &offsets[0] );
+    std::vector<float> frame_values[2];
+    std::vector<float*> frame_ao[2];
+    for (int k = 0; k < 2; ++k) {
+      frame_values[k].resize( std::max( num_values, size_t(1) ) );
+      frame_ao[k].resize( baked_scene.num_instances );
+      for (size_t i = 0; i < baked_scene.num_instances; ++i) frame_ao[k][i] = &frame_values[k][offsets[i]];
+    }
+    std::vector<const float*> previous_ao( baked_ao, baked_ao + baked_scene.num_instances );
+
+    AOValues ao_values( ao_samples.num_samples, config.pinned_memory );
+    std::vector<bake::Mesh> occluder_meshes( occluders.scene.meshes, occluders.scene.meshes + occluders.scene.num_meshes );
+    SceneMemory* frame_memory = NULL;
+    bool ok = true;
+    for (size_t f = 1; f < num_frames && ok; ++f) {
+      const std::string& filename = frames[f-1];
+      std::cerr << "Bake frame " << f << " (" << filename << ") ... "; std::cerr.flush();
+      Timer timer;
+      timer.start();
+      bake::Scene frame;
+      SceneMemory* memory = NULL;
+      float bbox_min[3], bbox_max[3];
+      if (!load_scene( filename.c_str(), frame, bbox_min, bbox_max, memory, config.num_instances_per_mesh, config.split_obj_groups )) {
+        std::cerr << "failed to load" << std::endl;
+        ok = false;
+        break;
+      }
+      if (!same_topology( scene, frame )) {
+        std::cerr << "its meshes or instances differ from those of " << config.scene_filename << std::endl;
+        delete memory;
+        ok = false;
+        break;
+      }
+
+      // The frame's meshes in place of the scene's; context and ground plane occluders stay
+      std::copy( frame.meshes, frame.meshes + scene.num_meshes, occluder_meshes.begin() );
+      bake::updateAOContextGeometry( context, &occluder_meshes[0], occluder_meshes.size() );
+      // The context reads the vertices of the frame before until here
+      delete frame_memory;
+      frame_memory = memory;
+
+      bake::Scene frame_baked = baked_scene;
+      frame_baked.meshes = frame.meshes;
+      bake::placeSamples( frame_baked, num_samples_per_instance, ao_samples );
+      std::fill( &ao_values[0], &ao_values[0] + ao_samples.num_samples, 0.0f );
+      if (!rays_per_instance.empty()) {
+        bake::computeAOPerInstance( context, frame_baked, ao_samples, num_samples_per_instance, &rays_per_instance[0], scene_offset, 
+          scene_maxdistance, config.batch_size, config.passes_per_query, config.adaptive_tolerance, &ao_values[0] );
+      } else if (config.ao_cache_scale > 0.0f) {
+        bake::computeAOCached( context, frame_baked, ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, 
+          config.passes_per_query, config.adaptive_tolerance, config.ao_cache_scale * scene_maxdistance, config.ao_cache_error, &ao_values[0] );
+      } else {
+        bake::computeAO( context, frame_baked, ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, 
+          config.passes_per_query, config.adaptive_tolerance, &ao_values[0] );
+      }
+      if (config.denoise_scale > 0.0f) {
+        bake::denoiseAO( ao_samples, config.denoise_scale, &ao_values[0] );
+      }
+      float** ao = &frame_ao[f % 2][0];
+      bake::mapAOToVertices( frame_baked, num_samples_per_instance, ao_samples, &ao_values[0], config.filter_mode, 
+        config.regularization_weight, ao, config.filter_cache_dir.empty() ? NULL : config.filter_cache_dir.c_str(), 
+        config.analytic_mass_weight, config.ls_solver, config.ls_patch_vertices, 1, config.weld_tolerance, config.ls_ordering, NULL, 0, 
+        &previous_ao[0] );
+
+      for (size_t i = 0; i < num_instances; ++i) sequence_ao[f*num_instances + i] = ao[representative_of[i]];
+      ok = writer.append( sequence, f*num_instances, num_instances, &sequence_ao[0] );
+      std::copy( ao, ao + baked_scene.num_instances, previous_ao.begin() );
+      printTimeElapsed( timer );
+      recordTime( "ao.frame", timer );
+      if (!ok) std::cerr << "Failed to save frame " << f << " to: " << frames_output << std::endl;
+    }
+    ok = writer.close() && ok;
+    delete frame_memory;
+    if (ok) std::cerr << "Saved " << num_frames << " frames of vertex ao to: " << frames_output << std::endl;
+    return ok;
+  }
+
+  // Saves the estimate of a progressive trace every snapshot_interval seconds, filtered like the final result, and
+  // hands it to a live viewer after every pass group
+  struct ProgressiveSnapshot {
+    const Config* config;
+    bake::Scene* scene;
+    const bake::Scene* baked_scene;
+    const size_t* num_samples_per_instance;
+    const bake::AOSamples* ao_samples;
+    float** baked_ao;
+    float** vertex_ao;
+    bake::MappedVertexAOFile* mapped_output;  // NULL unless the output is mapped
+    bake::LiveView* live_view;                // NULL unless the viewer shows the trace
+    bool save_snapshots;
+    Timer timer;
+    bool tweaking;            // the viewer can ask for a bake with other parameters, which stops this one
+    unsigned tweak_request;   // ... the last request taken
+  };
+
+  void filter_estimate( ProgressiveSnapshot& snapshot, const float* ao_values )
+  {
+    const Config& config = *snapshot.config;
+    if (config.vertex_samples) {
+      copy_vertex_ao( *snapshot.baked_scene, ao_values, snapshot.baked_ao );
+    } else {
+      bake::mapAOToVertices( *snapshot.baked_scene, snapshot.num_samples_per_instance, *snapshot.ao_samples, ao_values, config.filter_mode, 
+        config.regularization_weight, snapshot.baked_ao, config.filter_cache_dir.empty() ? NULL : config.filter_cache_dir.c_str(), 
+        config.analytic_mass_weight, config.ls_solver, config.ls_patch_vertices, 1, config.weld_tolerance, config.ls_ordering );
+    }
+  }
+
+  bool save_snapshot( void* snapshot_data, const float* ao_values, const int rays_per_sample )
+  {
+    ProgressiveSnapshot& snapshot = *static_cast<ProgressiveSnapshot*>( snapshot_data );
+    snapshot.timer.stop();
+    if (snapshot.timer.elapsed < snapshot.config->snapshot_interval) {
+      snapshot.timer.start();
+      return true;
+    }
+    const Config& config = *snapshot.config;
+    // A live view has filtered this estimate already
+    if (!snapshot.live_view) filter_estimate( snapshot, ao_values );
+    size_t num_shared_instances = 0;
+    const bool saved = snapshot.mapped_output ? save_mapped_results( *snapshot.mapped_output, *snapshot.scene, snapshot.vertex_ao )
+                                              : save_results( config, *snapshot.scene, snapshot.vertex_ao, num_shared_instances );
+    if (saved) {
+      std::cerr << "\n\tsnapshot of " << rays_per_sample << " rays per sample saved to: " << config.output_filename;
+    } else {
+      std::cerr << "\n\tfailed to save snapshot to: " << config.output_filename;
+    }
+    snapshot.timer.reset();
+    snapshot.timer.start();
+    return true;
+  }
+
+  // Filters every pass group's estimate into the arrays the live viewer shows, between its uploads.  Closing the
+  // viewer stops the trace with the estimate so far.
+  bool update_live_view( void* snapshot_data, const float* ao_values, const int rays_per_sample )
+  {
+    ProgressiveSnapshot& snapshot = *static_cast<ProgressiveSnapshot*>( snapshot_data );
+    bake::LiveView& live_view = *snapshot.live_view;
+    live_view.beginUpdate();
+    filter_estimate( snapshot, ao_values );
+    live_view.endUpdate();
+    if (snapshot.save_snapshots) save_snapshot( snapshot_data, ao_values, rays_per_sample );
+    return !live_view.closed() && !(snapshot.tweaking && live_view.requestedSince( snapshot.tweak_request ));
+  }
+
+  // Share of the screen a world space bbox covers through a world to clip space matrix (column major), 0 if it is out
+  // of view.  A box reaching behind the eye counts as covering the screen.
+  float view_coverage( const float world2clip[16], const float bbox_min[3], const float bbox_max[3] )
+  {
+    float ndc_min[2] = { 1.0f, 1.0f }, ndc_max[2] = { -1.0f, -1.0f };
+    unsigned outside_all = 0x3f;  // frustum planes every corner is outside of
+    bool behind = false;
+    for (int c = 0; c < 8; ++c) {
+      const float p[3] = { (c & 1) ? bbox_max[0] : bbox_min[0], (c & 2) ? bbox_max[1] : bbox_min[1], (c & 4) ? bbox_max[2] : bbox_min[2] };
+      float clip[4];
+      for (int r = 0; r < 4; ++r) clip[r] = world2clip[r]*p[0] + world2clip[4+r]*p[1] + world2clip[8+r]*p[2] + world2clip[12+r];
+      unsigned outside = 0;
+      for (int k = 0; k < 3; ++k) {
+        if (clip[k] < -clip[3]) outside |= 1u << (2*k);
+        if (clip[k] > clip[3])  outside |= 1u << (2*k + 1);
+      }
+      outside_all &= outside;
+      if (clip[3] <= 0.0f) {
+        behind = true;
+        continue;
+      }
+      for (int k = 0; k < 2; ++k) {
+        ndc_min[k] = std::min( ndc_min[k], std::max( clip[k] / clip[3], -1.0f ) );
+        ndc_max[k] = std::max( ndc_max[k], std::min( clip[k] / clip[3], 1.0f ) );
+      }
+    }
+    if (outside_all) return 0.0f;
+    if (behind) return 1.0f;
+    // Tiny but visible instances still come before those out of view
+    return std::max( 0.25f*std::max( ndc_max[0] - ndc_min[0], 0.0f )*std::max( ndc_max[1] - ndc_min[1], 0.0f ), 1.0e-6f );
+  }
+
+  // Weights the samples of each instance by its share of the live viewer's screen, so the progressive trace refines
+  // what is in view first.  Before the first frame no sample is weighted.
+  void rank_by_view( void* snapshot_data, float* sample_weights )
+  {
+    ProgressiveSnapshot& snapshot = *static_cast<ProgressiveSnapshot*>( snapshot_data );
+    const bake::Scene& scene = *snapshot.baked_scene;
+    float world2clip[16];
+    const bool has_camera = snapshot.live_view->camera( world2clip );
+    std::vector<size_t> first_sample( scene.num_instances + 1, 0 );
+    for (size_t i = 0; i < scene.num_instances; ++i) first_sample[i+1] = first_sample[i] + snapshot.num_samples_per_instance[i];
+#pragma omp parallel for schedule(dynamic, 64) if(scene.num_instances > 64)
+    for (ptrdiff_t i = 0; i < ptrdiff_t(scene.num_instances); ++i) {
+      const bake::Instance& instance = scene.instances[i];
+      const float weight = has_camera ? view_coverage( world2clip, instance.bbox_min, instance.bbox_max ) : 0.0f;
+      std::fill( sample_weights + first_sample[i], sample_weights + first_sample[i+1], weight );
+    }
+  }
+
+  // Moves the ground plane blocker to config's offset: a mesh plane in place, with the accels updated, an analytic one
+  // by making the context again
+  void move_ground_plane( const Config& config, float scene_bbox_min[3], float scene_bbox_max[3], Occluders& occluders, 
+    bake::AOContext*& context )
+  {
+    if (occluders.analytic_ground) {
+      occluders.ground_plane.axis = int( ground_plane_bounds( scene_bbox_min, scene_bbox_max, config.ground_upaxis, config.ground_scale_factor, 
+        config.ground_offset_factor, occluders.ground_plane.bbox_min, occluders.ground_plane.bbox_max ) );
+      bake::destroyAOContext( context );
+      context = bake::createAOContext( occluders.scene, config.use_cpu, config.conserve_memory, 
+        config.devices.empty() ? NULL : &config.devices[0], config.devices.size(), config.accel_preset, occluders.analytic_ground_plane(), 
+        config.backend, config.peer_geometry, config.managed_geometry );
+      bake::setAOQueriesInFlight( context, config.queries_in_flight );
+      bake::setAOLatencyBudget( context, config.latency_budget );
+      bake::setAOFarField( context, config.far_field, config.far_field_resolution );
+      return;
+    }
+    if (occluders.blocker_instances.empty()) return;
+    std::vector<float> vertices;
+    std::vector<unsigned int> indices;
+    std::vector<bake::Mesh> meshes;
+    std::vector<bake::Instance> instances;
+    make_ground_plane( scene_bbox_min, scene_bbox_max, config.ground_upaxis, config.ground_scale_factor, config.ground_offset_factor,
+      vertices, indices, meshes, instances );
+    std::copy( vertices.begin(), vertices.end(), occluders.plane_vertices.begin() );
+    // The plane is the last occluder
+    bake::Instance& plane = occluders.scene.instances[occluders.scene.num_instances - 1];
+    std::copy( instances[0].bbox_min, instances[0].bbox_min + 3, plane.bbox_min );
+    std::copy( instances[0].bbox_max, instances[0].bbox_max + 3, plane.bbox_max );
+    bake::updateAOContextGeometry( context, occluders.scene.meshes, occluders.scene.num_meshes );
+    bake::updateAOContextInstances( context, occluders.scene.instances, occluders.scene.num_instances );
+  }
+
+  // After the trace of a live view, until the viewer closes: traces again, progressively, with the parameters its keys
+  // ask for.  Samples and accels are kept, only the ground plane moves, and the filter systems of the estimates are 
+  // kept from one bake to the next.  ao_values holds the last bake's AO in the end.
+  void tweak_live_bake( Config& config, const bake::Scene& baked_scene, const bake::AOSamples& ao_samples, 
+    float scene_bbox_min[3], float scene_bbox_max[3], Occluders& occluders, bake::AOContext*& context, const float scene_offset, 
+    float& scene_maxdistance, ProgressiveSnapshot& snapshot, float* ao_values )
+  {
+    bake::LiveView& live_view = *snapshot.live_view;
+    bake::LiveParameters parameters = { scene_maxdistance, config.ground_offset_factor, config.num_rays };
+    live_view.setParameters( parameters );
+    bake::setFilterFrameReuse( config.frame_rigid_tolerance );
+    snapshot.tweaking = true;
+    snapshot.tweak_request = 0;
+    bool tweaked = false;
+    while (!live_view.closed()) {
+      if (!live_view.takeRequest( snapshot.tweak_request, parameters )) {
+        sleepMilliseconds( 20.0 );
+        continue;
+      }
+      Timer timer;
+      timer.start();
+      if (parameters.ground_offset != config.ground_offset_factor && config.use_ground_plane_blocker) {
+        config.ground_offset_factor = parameters.ground_offset;
+        move_ground_plane( config, scene_bbox_min, scene_bbox_max, occluders, context );
+      }
+      config.num_rays = std::max( parameters.num_rays, 1 );
+      scene_maxdistance = parameters.hit_distance;
+      std::fill( ao_values, ao_values + ao_samples.num_samples, 0.0f );
+      bake::computeAOProgressive( context, baked_scene, ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, 
+        config.passes_per_query, 0.0, ao_values, update_live_view, &snapshot, rank_by_view, &snapshot );
+      timer.stop();
+      recordTime( "live.rebake", timer );
+      tweaked = true;
+    }
+    bake::setFilterFrameReuse( -1.0f );
+    if (tweaked) {
+      std::cerr << "\n\tlast live bake: --hit_distance " << scene_maxdistance << " -r " << config.num_rays << " --ground_setup "
+                << config.ground_upaxis << " " << config.ground_scale_factor << " " << config.ground_offset_factor << " ... ";
+    }
+  }
+
+  // Reads the vertex AO of an earlier bake for the instances of the scene, matched by storage identifier, as first guesses
+  // of the iterative least squares filters.  Instances the file has no results for, or other vertex counts, get none.
+  bool load_warm_start( const Config& config, const bake::Scene& scene, std::vector< std::vector<float> >& decoded, 
+                        std::vector<const float*>& initial_ao )
+  {
+    bake::VertexAOReader reader;
+    if (!reader.open( config.warm_start_filename.c_str() )) {
+      std::cerr << "failed to open: " << config.warm_start_filename << std::endl;
+      return false;
+    }
+    decoded.assign( scene.num_instances, std::vector<float>() );
+    initial_ao.assign( scene.num_instances, NULL );
+    long long num_missing = 0;
+#pragma omp parallel for schedule(dynamic, 64) reduction(+:num_missing)
+    for (long long i = 0; i < (long long)scene.num_instances; ++i) {
+      const bake::Instance& instance = scene.instances[i];
+      const size_t num_vertices = scene.meshes[instance.mesh_index].num_vertices;
+      bake::VertexAOEntry entry;
+      std::vector<float> saved( num_vertices );
+      if (num_vertices == 0 || !reader.find( instance.storage_identifier, entry ) || entry.num_vertices != num_vertices ||
+          !reader.decode( entry, &saved[0] )) {
+        ++num_missing;
+        continue;
+      }
+      // Saved AO is in the loaded vertex order of the mesh
+      const unsigned* order = config.loaded_vertex_order ? config.loaded_vertex_order[instance.mesh_index] : NULL;
+      if (order) {
+        decoded[i].resize( num_vertices );
+        for (size_t v = 0; v < num_vertices; ++v) decoded[i][v] = saved[order[v]];
+      } else {
+        decoded[i].swap( saved );
+      }
+      initial_ao[i] = &decoded[i][0];
+    }
+    reader.close();
+    if (num_missing > 0) {
+      std::cerr << "\n\t" << num_missing << " of " << scene.num_instances << " instances have no results in " 
+                << config.warm_start_filename << " and start from the area based result";
+    }
+    return true;
+  }
+
+#ifndef BAKE_HEADLESS
+  // Shows the vertex AO of an earlier bake, matched to the scene's instances by storage identifier.  Instances the
+  // file has no results for show as unoccluded.
+  bool view_saved_results( const Config& config, const bake::Scene& scene, float* scene_bbox_min, float* scene_bbox_max )
+  {
+    Timer timer;
+    std::cerr << "Read vertex ao ...          "; std::cerr.flush();
+    timer.start();
+    bake::VertexAOReader reader;
+    if (!reader.open( config.view_filename.c_str() )) {
+      std::cerr << "failed to open: " << config.view_filename << std::endl;
+      return false;
+    }
+
+    size_t max_vertices = 0;
+    for (size_t m = 0; m < scene.num_meshes; ++m) max_vertices = std::max( max_vertices, size_t( scene.meshes[m].num_vertices ) );
+    const std::vector<float> unoccluded( std::max( max_vertices, size_t( 1 ) ), 1.0f );
+
+    std::vector< std::vector<float> > decoded( scene.num_instances );
+    std::vector<const float*> vertex_ao( scene.num_instances, &unoccluded[0] );
+    long long num_missing = 0;
+#pragma omp parallel for schedule(dynamic, 64) reduction(+:num_missing)
+    for (long long i = 0; i < (long long)scene.num_instances; ++i) {
+      const bake::Instance& instance = scene.instances[i];
+      const size_t num_vertices = scene.meshes[instance.mesh_index].num_vertices;
+      bake::VertexAOEntry entry;
+      if (!reader.find( instance.storage_identifier, entry ) || entry.num_vertices != num_vertices) {
+        ++num_missing;
+        continue;
+      }
+      decoded[i].resize( num_vertices );
+      if (num_vertices > 0 && !reader.decode( entry, &decoded[i][0] )) {
+        std::vector<float>().swap( decoded[i] );
+        ++num_missing;
+        continue;
+      }
+      if (num_vertices > 0) vertex_ao[i] = &decoded[i][0];
+    }
+    reader.close();
+    printTimeElapsed( timer );
+    if (num_missing > 0) {
+      std::cerr << "\t" << num_missing << " of " << scene.num_instances << " instances have no results in " << config.view_filename << std::endl;
+    }
+
+    std::cerr << "Launch viewer  ... \n" << std::endl;
+    bake::view( scene.meshes, scene.num_meshes, scene.instances, scene.num_instances, &vertex_ao[0], scene_bbox_min, scene_bbox_max );
+    return true;
+  }
+#endif
+
+  // The --context_scene geometry, owned for the length of a bake
+  // Vertex AO of each --lod scene from the samples of the bake, without tracing: the LOD is sampled like the scene,
+  // its samples get AO from the transfer, and the filter maps it to the LOD's vertices.  Without --samples, LODs get
+  // the minimum per face; with it, as many as keep the density of the scene's num_triangles.
+  void transfer_to_lods( const Config& config, const bake::AOTransfer* transfer, const size_t num_triangles )
+  {
+    for (size_t k = 0; k < config.lod_filenames.size(); ++k) {
+      const std::string& filename = config.lod_filenames[k];
+      std::cerr << "Transfer AO to LOD " << filename << " ... "; std::cerr.flush();
+      Timer timer;
+      timer.start();
+      bake::Scene lod;
+      float lod_bbox_min[3], lod_bbox_max[3];
+      SceneMemory* memory = NULL;
+      if (!load_scene( filename.c_str(), lod, lod_bbox_min, lod_bbox_max, memory )) {
+        std::cerr << "failed to load" << std::endl;
+        continue;
+      }
+      size_t lod_triangles = 0;
+      for (size_t i = 0; i < lod.num_instances; ++i) lod_triangles += lod.meshes[lod.instances[i].mesh_index].num_triangles;
+      const size_t requested = config.num_samples > 0 ? size_t( double( config.num_samples ) * lod_triangles / std::max( num_triangles, size_t(1) ) ) : 0;
+
+      std::vector<size_t> num_samples_per_instance( lod.num_instances );
+      bake::SamplingPlan plan;
+      const size_t num_samples = bake::distributeSamples( lod, config.min_samples_per_face, requested, 
+        num_samples_per_instance.empty() ? NULL : &num_samples_per_instance[0], &plan );
+      bake::AOSamples samples;
+      allocate_ao_samples( samples, num_samples, lod, false, config.compact_samples, config.pinned_memory );
+      std::vector< std::vector<float> > vertex_ao( lod.num_instances );
+      std::vector<float*> vertex_ao_ptrs( lod.num_instances );
+      for (size_t i = 0; i < lod.num_instances; ++i) {
+        vertex_ao[i].resize( lod.meshes[lod.instances[i].mesh_index].num_vertices );
+        vertex_ao_ptrs[i] = vertex_ao[i].empty() ? NULL : &vertex_ao[i][0];
+      }
+      if (num_samples > 0) {
+        bake::sampleInstances( lod, &num_samples_per_instance[0], config.min_samples_per_face, samples, &plan );
+        AOValues ao( num_samples, config.pinned_memory );
+        bake::transferAO( transfer, samples, &ao[0] );
+        release_sample_geometry( samples );
+        bake::mapAOToVertices( lod, &num_samples_per_instance[0], samples, &ao[0], config.filter_mode, config.regularization_weight, 
+          &vertex_ao_ptrs[0], config.filter_cache_dir.empty() ? NULL : config.filter_cache_dir.c_str(), config.analytic_mass_weight, 
+          config.ls_solver, config.ls_patch_vertices, 1, config.weld_tolerance, config.ls_ordering );
+      }
+      destroy_ao_samples( samples );
+      printTimeElapsed( timer );
+
+      std::ostringstream lod_filename;
+      lod_filename << config.output_filename << ".lod" << k + 1;
+      Config lod_config = config;
+      lod_config.output_filename = lod_filename.str();
+      lod_config.loaded_vertex_order = NULL;
+      size_t num_shared_instances = 0;
+      if (save_results( lod_config, lod, vertex_ao_ptrs.empty() ? NULL : &vertex_ao_ptrs[0], num_shared_instances )) {
+        std::cerr << "Saved vertex ao of " << num_samples << " transferred samples to: " << lod_config.output_filename << std::endl;
+      } else {
+        std::cerr << "Failed to save vertex ao to: " << lod_config.output_filename << std::endl;
+      }
+      delete memory;
+    }
+  }
+
+  struct ContextScene {
+    bake::Scene scene;
+    SceneMemory* memory;
+
+    ContextScene() : memory( NULL ) { scene.num_meshes = scene.num_instances = 0; }
+    ~ContextScene() { delete memory; }
+
+  private:
+    ContextScene( const ContextScene& );
+    ContextScene& operator=( const ContextScene& );
+  };
+
+  bool load_context_scene( const Config& config, ContextScene& context )
+  {
+    std::cerr << "Load context scene ...      "; std::cerr.flush();
+    Timer timer;
+    timer.start();
+    // Its bounds don't widen the scene's: ray distances and the ground plane follow the baked scene
+    float context_bbox_min[3], context_bbox_max[3];
+    SceneMemory* memory = NULL;
+    if (!load_scene( config.context_filename.c_str(), context.scene, context_bbox_min, context_bbox_max, memory )) {
+      std::cerr << "failed" << std::endl;
+      return false;
+    }
+    context.memory = memory;
+    printTimeElapsed( timer );
+    std::cerr << "Loaded context scene: " << config.context_filename << std::endl;
+    std::cerr << "\t" << context.scene.num_meshes << " meshes, " << context.scene.num_instances << " instances, occluders only" << std::endl;
+    return true;
+  }
+
+  // The instances --roi_bbox and --roi_ids bake, and the others, which only occlude them together with any context scene
+  struct RegionOfInterest {
+    std::vector<bake::Instance> receivers;
+    std::vector<bake::Instance> others;
+    TileOccluders culled;
+    std::vector<bake::Mesh> context_meshes;
+    std::vector<bake::Instance> context_instances;
+    bake::Scene occluders;
+  };
+
+  bool read_roi_ids( const std::string& filename, std::set<uint64_t>& ids )
+  {
+    std::ifstream file( filename.c_str() );
+    if (!file) return false;
+    unsigned long long id;
+    while (file >> id) ids.insert( uint64_t( id ) );
+    return file.eof();
+  }
+
+  // Replaces the instances of the scene with those in the region of interest, and makes the rest occluders.  Ray 
+  // distances and the ground plane still follow the full scene bounds, so the result matches a full bake.
+  bool select_region_of_interest( const Config& config, bake::Scene& scene, const bake::Scene& context_scene, 
+                                  const float scene_bbox_min[3], const float scene_bbox_max[3], RegionOfInterest& roi )
+  {
+    std::set<uint64_t> ids;
+    if (!config.roi_ids_filename.empty() && !read_roi_ids( config.roi_ids_filename, ids )) {
+      std::cerr << "Failed to read instance identifiers from: " << config.roi_ids_filename << std::endl;
+      return false;
+    }
+
+    float receivers_min[] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float receivers_max[] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      const bake::Instance& instance = scene.instances[i];
+      bool inside = config.use_roi_bbox;
+      for (int k = 0; k < 3; ++k) {
+        inside = inside && instance.bbox_min[k] <= config.roi_bbox_max[k] && instance.bbox_max[k] >= config.roi_bbox_min[k];
+      }
+      if (inside || ids.count( instance.storage_identifier )) {
+        roi.receivers.push_back( instance );
+        for (int k = 0; k < 3; ++k) {
+          receivers_min[k] = std::min( receivers_min[k], instance.bbox_min[k] );
+          receivers_max[k] = std::max( receivers_max[k], instance.bbox_max[k] );
+        }
+      } else {
+        roi.others.push_back( instance );
+      }
+    }
+    std::cerr << "Region of interest: " << roi.receivers.size() << " of " << scene.num_instances << " instances" << std::endl;
+    if (roi.receivers.empty()) {
+      std::cerr << "No instances in the region of interest" << std::endl;
+      return false;
+    }
+
+    bake::Scene others = { scene.meshes, scene.num_meshes, roi.others.empty() ? NULL : &roi.others[0], roi.others.size() };
+    if (config.roi_cull) {
+      float scene_offset, scene_maxdistance;
+      scene_distances( config, scene_bbox_min, scene_bbox_max, scene_offset, scene_maxdistance );
+      const float reach = config.hit_distances.empty() ? scene_maxdistance : config.hit_distances.back();
+      cull_occluders( others, receivers_min, receivers_max, reach, roi.culled );
+      std::cerr << "\t" << others.num_instances - roi.culled.scene.num_instances << " instances out of reach culled" << std::endl;
+      others = roi.culled.scene;
+    }
+    if (context_scene.num_instances > 0) {
+      concat_scenes( others, context_scene, roi.occluders, roi.context_meshes, roi.context_instances );
+    } else {
+      roi.occluders = others;
+    }
+
+    scene.instances = &roi.receivers[0];
+    scene.num_instances = roi.receivers.size();
+    return true;
   }
 
-  if (config.use_viewer){
+  // Load, bake, save and view one scene.  Returns a negative value on failure.
+  int bake_scene( const Config& job_config, JobStats& stats )
+  {
+    Config config = job_config;
+    Timer timer;
+    bake::setFilterConjugateGradient( config.cg_tolerance, config.cg_preconditioner );
+
+    //
+    // Load scene
+    //
+    std::cerr << "Load scene ...              "; std::cerr.flush();
+
+    beginMemoryPhase( "load" );
+    timer.start();
+
+    bake::Scene scene;
+    SceneMemory* scene_memory;
+    float scene_bbox_min[] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float scene_bbox_max[] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    const bool use_scene_cache = !config.scene_cache_filename.empty();
+    const bool use_shared_scene = !config.shared_scene_filename.empty();
+    bool loaded_from_cache = false;
+    bool published_shared_scene = false;
+    bool loaded = false;
+
+    // CUDA and Prime contexts start up on a second thread while this one loads, unless nothing traces on the devices
+    const bool prepare_devices = (!config.use_cpu || config.backend == bake::AO_BACKEND_OPTIX_PRIME) && config.view_filename.empty();
+    const int previous_levels = setMaxActiveLevels( 2 );
+#pragma omp parallel num_threads(2) if(prepare_devices)
+    {
+      if (prepare_devices && threadIndex() == numThreads() - 1) {
+        bake::prepareDevices( config.use_cpu, config.devices.empty() ? NULL : &config.devices[0], config.devices.size() );
+      }
+      if (threadIndex() == 0 && use_shared_scene) {
+        loaded = load_shared_scene( config.shared_scene_filename.c_str(), config.scene_filename.c_str(), scene, scene_bbox_min, scene_bbox_max, scene_memory,
+          config.num_instances_per_mesh, config.split_obj_groups, &published_shared_scene );
+      } else if (threadIndex() == 0) {
+        loaded_from_cache = use_scene_cache &&
+          load_scene_cache( config.scene_cache_filename.c_str(), config.scene_filename.c_str(), scene, scene_bbox_min, scene_bbox_max, scene_memory, config.num_instances_per_mesh, config.split_obj_groups );
+        loaded = loaded_from_cache || load_input_scene( config, scene, scene_bbox_min, scene_bbox_max, scene_memory );
+      }
+    }
+    setMaxActiveLevels( previous_levels );
+    if (!loaded) {
+      std::cerr << "Failed to load scene, exiting" << std::endl;
+      return -1;
+    }
+
+    printTimeElapsed( timer ); 
+    stats.load_ms = timer.elapsed * 1000.0;
+
+    if (use_shared_scene) {
+      std::cerr << (published_shared_scene ? "Published" : "Attached") << " shared scene: " << config.shared_scene_filename << std::endl;
+    }
+    if (use_scene_cache) {
+      if (loaded_from_cache) {
+        std::cerr << "Loaded scene cache: " << config.scene_cache_filename << std::endl;
+      } else {
+        std::cerr << "Write scene cache ...       "; std::cerr.flush();
+        timer.reset();
+        timer.start();
+        if (save_scene_cache( config.scene_cache_filename.c_str(), config.scene_filename.c_str(), scene, scene_bbox_min, scene_bbox_max, config.num_instances_per_mesh, config.split_obj_groups )) {
+          printTimeElapsed( timer );
+        } else {
+          std::cerr << "failed, continuing without cache" << std::endl;
+        }
+      }
+    }
+
+    // Print scene stats
+    {
+      std::cerr << "Loaded scene: " << scene_label( config ) << std::endl;
+      std::cerr << "\t" << scene.num_meshes << " meshes, " << scene.num_instances << " instances" << std::endl;
+      size_t num_vertices = 0;
+      size_t num_triangles = 0;
+      for (size_t i = 0; i < scene.num_meshes; ++i) {
+        num_vertices += scene.meshes[i].num_vertices;
+        num_triangles += scene.meshes[i].num_triangles;
+      }
+      std::cerr << "\tuninstanced vertices: " << num_vertices << std::endl;
+      std::cerr << "\tuninstanced triangles: " << num_triangles << std::endl;
+      stats.num_instances = scene.num_instances;
+      stats.num_triangles = num_triangles;
+    }
+
+    if (config.flip_orientation){
+      for (size_t m = 0; m < scene.num_meshes; ++m) {
+        bake::Mesh& mesh = scene.meshes[m];
+        for (size_t i = 0; i < mesh.num_triangles; i++){
+          std::swap(mesh.tri_vertex_indices[i * 3 + 0], mesh.tri_vertex_indices[i * 3 + 2]);
+        }
+        if (mesh.normals){
+          size_t stride = mesh.normal_stride_bytes / sizeof(float);
+          for (size_t i = 0; i < mesh.num_vertices; i++){
+            mesh.normals[i * stride + 0] *= -1.0;
+            mesh.normals[i * stride + 1] *= -1.0;
+            mesh.normals[i * stride + 2] *= -1.0;
+          }
+        }
+      }
+    }
+
+#ifndef BAKE_HEADLESS
+    if (!config.view_filename.empty()) {
+      const bool viewed = view_saved_results( config, scene, scene_bbox_min, scene_bbox_max );
+      delete scene_memory;
+      return viewed ? 1 : -1;
+    }
+#endif
+
+    // From here on the bake sees the reordered copies; the loaded meshes are kept for nothing but the vertex order
+    std::vector<bake::ReorderedMesh> reordered;
+    std::vector<bake::Mesh> reordered_meshes;
+    std::vector<const unsigned*> loaded_vertex_order;
+    if (config.reorder_meshes && scene.num_meshes > 0) {
+      std::cerr << "Reorder meshes ...          "; std::cerr.flush();
+      timer.reset();
+      timer.start();
+      reordered.resize( scene.num_meshes );
+      reordered_meshes.assign( scene.meshes, scene.meshes + scene.num_meshes );
+      loaded_vertex_order.resize( scene.num_meshes );
+#pragma omp parallel for schedule(dynamic, 1)
+      for (ptrdiff_t m = 0; m < ptrdiff_t(scene.num_meshes); ++m) {
+        bake::reorderMesh( scene.meshes[m], reordered[m] );
+        bake::Mesh& mesh = reordered_meshes[m];
+        mesh.vertices = reordered[m].vertices.empty() ? NULL : &reordered[m].vertices[0];
+        mesh.vertex_stride_bytes = 3*sizeof(float);
+        mesh.normals = reordered[m].normals.empty() ? NULL : &reordered[m].normals[0];
+        mesh.normal_stride_bytes = mesh.normals ? 3*sizeof(float) : 0;
+        mesh.texcoords = reordered[m].texcoords.empty() ? NULL : &reordered[m].texcoords[0];
+        mesh.texcoord_stride_bytes = mesh.texcoords ? 2*sizeof(float) : 0;
+        mesh.geometry_memory = bake::MEMORY_SPACE_HOST;
+        mesh.tri_vertex_indices = reordered[m].indices.empty() ? NULL : &reordered[m].indices[0];
+        loaded_vertex_order[m] = reordered[m].vertex_order.empty() ? NULL : &reordered[m].vertex_order[0];
+      }
+      scene.meshes = &reordered_meshes[0];
+      config.loaded_vertex_order = &loaded_vertex_order[0];
+      printTimeElapsed( timer );
+    }
+
+    // Occluders, samples and filters all see the meshes without the triangles that only cost the bake; their vertices
+    // are kept, in the order vertex AO is saved in
+    std::vector<bake::CleanedMesh> cleaned;
+    std::vector<bake::Mesh> cleaned_meshes;
+    if (config.clean_meshes && scene.num_meshes > 0) {
+      std::cerr << "Clean meshes ...            "; std::cerr.flush();
+      timer.reset();
+      timer.start();
+      cleaned.resize( scene.num_meshes );
+      cleaned_meshes.assign( scene.meshes, scene.meshes + scene.num_meshes );
+#pragma omp parallel for schedule(dynamic, 1)
+      for (ptrdiff_t m = 0; m < ptrdiff_t(scene.num_meshes); ++m) {
+        bake::cleanMesh( scene.meshes[m], cleaned[m] );
+        bake::Mesh& mesh = cleaned_meshes[m];
+        mesh.num_triangles = cleaned[m].triangle_order.size();
+        mesh.tri_vertex_indices = cleaned[m].indices.empty() ? NULL : &cleaned[m].indices[0];
+      }
+      scene.meshes = &cleaned_meshes[0];
+      size_t num_degenerate = 0, num_duplicate = 0;
+      for (size_t m = 0; m < cleaned.size(); ++m) {
+        num_degenerate += cleaned[m].num_degenerate;
+        num_duplicate += cleaned[m].num_duplicate;
+      }
+      printTimeElapsed( timer );
+      std::cerr << "\tremoved " << num_degenerate << " degenerate and " << num_duplicate << " duplicate triangles" << std::endl;
+      recordCount( "clean.degenerate_triangles", num_degenerate );
+      recordCount( "clean.duplicate_triangles", num_duplicate );
+    }
+
+    ContextScene context_geometry;
+    if (!config.context_filename.empty() && !load_context_scene( config, context_geometry )) {
+      std::cerr << "Failed to load context scene, exiting" << std::endl;
+      delete scene_memory;
+      return -1;
+    }
+
+    // Occluders besides the baked instances
+    bake::Scene context_scene = context_geometry.scene;
+    RegionOfInterest roi;
+    if (config.use_roi_bbox || !config.roi_ids_filename.empty()) {
+      if (!select_region_of_interest( config, scene, context_geometry.scene, scene_bbox_min, scene_bbox_max, roi )) {
+        delete scene_memory;
+        return -1;
+      }
+      context_scene = roi.occluders;
+      stats.num_instances = scene.num_instances;
+    }
+
+    // Fit the bake into the memory budget before anything large is allocated
+    if (config.host_memory_budget > 0 || config.device_memory_budget > 0 || config.dry_run) {
+      const MemoryPlan plan = plan_memory( config, scene, context_scene );
+      print_memory_plan( config, plan );
+      if (config.dry_run) {
+        delete scene_memory;
+        return plan.fits ? 1 : -1;
+      }
+      if (!plan.fits) {
+        std::cerr << "Error: the bake does not fit the memory budget.  Bailing.\n";
+        delete scene_memory;
+        return -1;
+      }
+      config.batch_size = plan.batch_size;
+      config.instance_chunk = plan.instance_chunk;
+      config.filter_mode = plan.filter_mode;
+    }
+
+    // An earlier bake of the same content and settings is copied instead of baked
+    uint64_t result_key = 0;
+    if (!config.result_cache_dir.empty()) {
+      result_key = result_cache_key( config, scene, context_scene );
+      if (bake::fetchCachedResult( config.result_cache_dir.c_str(), result_key, config.output_filename.c_str() )) {
+        std::cerr << "Result cache hit: copied vertex ao to " << config.output_filename << std::endl;
+        recordCount( "result_cache.hits", 1 );
+        delete scene_memory;
+        return 1;
+      }
+      std::cerr << "Result cache miss" << std::endl;
+      recordCount( "result_cache.misses", 1 );
+    }
+
     //
-    // Visualize results
+    // Generate AO samples
     //
-    std::cerr << "Launch viewer  ... \n" << std::endl;
-    bake::view(scene.meshes, scene.num_meshes, scene.instances, scene.num_instances, vertex_ao, scene_bbox_min, scene_bbox_max);
+
+    std::cerr << "Minimum samples per face: " << config.min_samples_per_face << std::endl;
+
+    // Chunks bound the memory of baking every instance; a shared bake has one instance per mesh to begin with.
+    // Partitions bake their range of instances the same way.
+    if ((config.instance_chunk > 0 && config.instance_chunk < scene.num_instances && !config.share_mesh_ao) || config.partition_count > 1) {
+      const bool baked = bake_instance_chunks( config, scene, context_scene, scene_bbox_min, scene_bbox_max );
+      delete scene_memory;
+      return baked ? 1 : -1;
+    }
+
+    // Instances that get baked: all of them, or one per mesh whose results all instances of the mesh share
+    bake::Scene baked_scene = scene;
+    std::vector<bake::Instance> representatives;
+    std::vector<size_t> representative_of;
+    if (config.share_mesh_ao) {
+      select_mesh_representatives( scene, representatives, representative_of );
+      baked_scene.instances = representatives.empty() ? NULL : &representatives[0];
+      baked_scene.num_instances = representatives.size();
+      std::cerr << "Baking " << baked_scene.num_instances << " instances shared by " << scene.num_instances << std::endl;
+    } else {
+      representative_of.resize( scene.num_instances );
+      for (size_t i = 0; i < scene.num_instances; ++i) representative_of[i] = i;
+    }
+
+    float scene_maxdistance;
+    float scene_offset;
+    scene_distances( config, scene_bbox_min, scene_bbox_max, scene_offset, scene_maxdistance );
+
+    // Isolated instances take their AO from the part cache, and only the others are baked
+    PartCache parts;
+    if (!config.part_cache_dir.empty()) {
+      resolve_part_cache( config, scene, context_scene, scene_bbox_min, scene_bbox_max, scene_offset, scene_maxdistance, parts );
+      representatives.clear();
+      for (size_t i = 0; i < scene.num_instances; ++i) {
+        if (parts.instance_ao[i]) {
+          representative_of[i] = SIZE_MAX;
+        } else {
+          representative_of[i] = representatives.size();
+          representatives.push_back( scene.instances[i] );
+        }
+      }
+      baked_scene.instances = representatives.empty() ? NULL : &representatives[0];
+      baked_scene.num_instances = representatives.size();
+    }
+
+    // Occluder setup and accel builds are timed on their own too, to weigh them against the trace for accel presets.
+    // The hit distance pre-pass and a variance guided bake's pilot trace against them before sampling.
+    Timer accel_timer;
+    Occluders occluders;
+    bake::AOContext* context = NULL;
+    bake::SamplingPlan sampling_plan;
+    if (config.variance_rays > 0 || config.auto_hit_distance > 0.0f) {
+      accel_timer.start();
+      make_occluders( config, scene, context_scene, scene_bbox_min, scene_bbox_max, occluders );
+      context = bake::createAOContext( occluders.scene, config.use_cpu, config.conserve_memory, 
+        config.devices.empty() ? NULL : &config.devices[0], config.devices.size(), config.accel_preset, occluders.analytic_ground_plane(), 
+        config.backend, config.peer_geometry, config.managed_geometry );
+      bake::setAOQueriesInFlight( context, config.queries_in_flight );
+      bake::setAOLatencyBudget( context, config.latency_budget );
+      bake::setAOFarField( context, config.far_field, config.far_field_resolution );
+      accel_timer.stop();
+      beginMemoryPhase( "pilot" );
+      if (config.auto_hit_distance > 0.0f) {
+        scene_maxdistance = choose_hit_distance( config, baked_scene, context, scene_offset, scene_maxdistance );
+      }
+      if (config.variance_rays > 0) {
+        weigh_samples_by_variance( config, baked_scene, context, scene_offset, scene_maxdistance, sampling_plan );
+      }
+    }
+
+    std::cerr << "Generate sample points ... \n"; std::cerr.flush();
+
+    timer.reset();
+    timer.start();
+  
+
+    beginMemoryPhase( "sample" );
+    if (!config.profile_meshes_filename.empty()) enableMeshProfile( baked_scene.num_meshes );
+    std::vector<size_t> num_samples_per_instance(baked_scene.num_instances);
+    size_t total_samples = 0;
+    if (config.vertex_samples) {
+      for (size_t i = 0; i < baked_scene.num_instances; ++i) {
+        num_samples_per_instance[i] = baked_scene.meshes[baked_scene.instances[i].mesh_index].num_vertices;
+        total_samples += num_samples_per_instance[i];
+      }
+    } else {
+      total_samples = bake::distributeSamples( baked_scene, config.min_samples_per_face, config.num_samples, &num_samples_per_instance[0], &sampling_plan );
+    }
+
+    bake::AOSamples ao_samples;
+    // An incremental rebake selects samples by their host positions
+    allocate_ao_samples( ao_samples, total_samples, baked_scene, config.gpu_sampling && !config.use_cpu && config.move_instance < 0, config.compact_samples,
+      config.pinned_memory, !config.vertex_samples, config.reconstruct_samples );
+
+    if (config.vertex_samples) {
+      bake::sampleVertices( baked_scene, ao_samples );
+    } else {
+      bake::sampleInstances( baked_scene, &num_samples_per_instance[0], config.min_samples_per_face, ao_samples, &sampling_plan,
+        config.sample_templates );
+    }
+
+    // Traced in spatial order, or tile by tile, then put back in instance order for the filters
+    std::vector<size_t> sorted_order;
+    std::vector<bake::SampleTile> tiles;
+    if (config.tile_scale > 0.0f && ao_samples.sample_positions) {
+      sorted_order.resize( total_samples );
+      bake::tileSamples( ao_samples, scene_bbox_min, scene_bbox_max, config.tile_scale * scene_maxdistance, &sorted_order[0], tiles );
+    } else if (config.sort_samples && ao_samples.sample_positions) {
+      sorted_order.resize( total_samples );
+      bake::sortSamples( ao_samples, scene_bbox_min, scene_bbox_max, &sorted_order[0] );
+    }
+  
+    printTimeElapsed( timer ); 
+    stats.sample_ms = timer.elapsed * 1000.0;
+    const std::vector<int> rays_per_instance = instance_ray_budgets( config, baked_scene, scene_bbox_min, scene_bbox_max );
+    stats.num_samples = total_samples;
+
+    std::cerr << "Total samples: " << total_samples << std::endl;
+    {
+      const size_t num_rays = static_cast<size_t>( std::max( config.num_rays, 1 ) );
+      std::cerr << "Rays per sample: " << num_rays << std::endl;
+      std::cerr << "Total rays: " << total_samples * num_rays << std::endl;
+    }
+
+    //
+    // Evaluate AO samples 
+    //
+    std::cerr << "Compute AO ...             "; std::cerr.flush();
+  
+    beginMemoryPhase( "trace" );
+    timer.reset();
+    timer.start();
+
+    // Area based filtering of device placed samples happens during the trace, and per-sample AO stays on the device
+    const bool device_filter = splat_on_device( config, ao_samples );
+    const size_t num_ao_channels = config.two_sided ? 2 : config.bent_normals || config.sh_visibility ? 4 : std::max( config.hit_distances.size(), size_t(1) );
+    AOValues ao_values( device_filter ? 0 : num_ao_channels*total_samples, config.pinned_memory );
+
+    // Samples traced by an earlier run of the same scene and trace settings only need filtering.  They were saved in
+    // instance order, so sorted samples go back to it first.
+    const bool use_saved_samples = !config.save_samples_filename.empty() || !config.load_samples_filename.empty();
+    const uint64_t samples_key = use_saved_samples ? checkpoint_hash( config, scene, context_scene ) : 0;
+    const bool loaded_samples = !config.load_samples_filename.empty();
+    if (loaded_samples) {
+      if (!sorted_order.empty()) {
+        bake::unsortSamples( ao_samples, &sorted_order[0], &ao_values[0], num_ao_channels );
+        std::vector<size_t>().swap( sorted_order );
+      }
+      if (!load_traced_samples( config.load_samples_filename, samples_key, baked_scene, &num_samples_per_instance[0], ao_samples, 
+                                num_ao_channels, &ao_values[0] )) {
+        std::cerr << "\nFailed to load samples of this scene and trace settings from: " << config.load_samples_filename << std::endl;
+        destroy_ao_samples( ao_samples );
+        delete scene_memory;
+        return -1;
+      }
+      std::cerr << "loaded from " << config.load_samples_filename << " ... "; std::cerr.flush();
+    }
+
+    // A mapped output file holds the vertex AO of the bake itself: each baked instance filters into the slot of the first
+    // instance it stands for
+    bake::MappedVertexAOFile mapped_file;
+    bake::MappedVertexAOFile* mapped_output = NULL;
+    if (config.mapped_output && !config.output_filename.empty()) {
+      if (mapped_file.open( config.output_filename.c_str(), scene, config.output_index )) {
+        mapped_output = &mapped_file;
+      } else {
+        std::cerr << "Failed to map " << config.output_filename << "; saving it after the bake instead" << std::endl;
+      }
+    }
+    float** baked_ao = new float*[ baked_scene.num_instances ];
+    std::fill( baked_ao, baked_ao + baked_scene.num_instances, (float*)NULL );
+    for (size_t i = 0; i < scene.num_instances && mapped_output; ++i ) {
+      if (!baked_ao[representative_of[i]]) baked_ao[representative_of[i]] = mapped_output->vertexAO( i );
+    }
+    // Otherwise one array for all baked instances, in the order of the output file, rather than one per instance
+    float* baked_ao_values = NULL;
+    if (!mapped_output) {
+      std::vector<size_t> offsets( baked_scene.num_instances + 1 );
+      const size_t num_values = bake::vertexAOOffsets( baked_scene, 1, &offsets[0] );
+      baked_ao_values = static_cast<float*>( bake::allocateHostMemory( num_values*sizeof(float), false ) );
+      for (size_t i = 0; i < baked_scene.num_instances; ++i ) baked_ao[i] = baked_ao_values + offsets[i];
+    }
+    float** vertex_ao = new float*[ scene.num_instances ];
+    for (size_t i = 0; i < scene.num_instances; ++i ) {
+      vertex_ao[i] = representative_of[i] < baked_scene.num_instances ? baked_ao[representative_of[i]] : parts.instance_ao[i];
+    }
+
+    // A live view opens before the accels build, unoccluded, and shows the estimate of every pass group while the
+    // trace goes on on a second thread
+    bake::LiveView live_view;
+    const bool live = config.live_view;
+    for (size_t i = 0; i < baked_scene.num_instances && live; ++i) {
+      std::fill( baked_ao[i], baked_ao[i] + baked_scene.meshes[baked_scene.instances[i].mesh_index].num_vertices, 1.0f );
+    }
+    const int levels_before_live = live ? setMaxActiveLevels( 2 ) : 0;
+#pragma omp parallel num_threads(2) if(live)
+    {
+#ifndef BAKE_HEADLESS
+      if (live && threadIndex() == 0) {
+        bake::view( scene.meshes, scene.num_meshes, scene.instances, scene.num_instances, vertex_ao, scene_bbox_min, scene_bbox_max, 
+          &live_view );
+      }
+#endif
+      if (threadIndex() == numThreads() - 1 && !loaded_samples) {
+        // Vertex and lightmap samples are traced against the same accels.  Tiles have accels of their own, and the
+        // full context is only made if lightmaps need it.
+        accel_timer.start();
+        if (!context) {
+          make_occluders( config, scene, context_scene, scene_bbox_min, scene_bbox_max, occluders );
+          if (tiles.empty()) {
+            context = bake::createAOContext( occluders.scene, config.use_cpu, config.conserve_memory, 
+              config.devices.empty() ? NULL : &config.devices[0], config.devices.size(), config.accel_preset, occluders.analytic_ground_plane(), 
+              config.backend, config.peer_geometry, config.managed_geometry );
+            bake::setAOQueriesInFlight( context, config.queries_in_flight );
+            bake::setAOLatencyBudget( context, config.latency_budget );
+            bake::setAOFarField( context, config.far_field, config.far_field_resolution );
+          }
+        }
+        if (context) begin_checkpoint( config, scene, occluders, context );
+        accel_timer.stop();
+        if (!tiles.empty()) {
+          trace_tiles( config, baked_scene, occluders, ao_samples, tiles, scene_offset, scene_maxdistance, num_ao_channels, &ao_values[0], 
+            accel_timer );
+        } else if (config.time_budget > 0.0 || config.snapshot_interval > 0.0 || live) {
+          const bool snapshots = config.snapshot_interval > 0.0 && !config.output_filename.empty();
+          ProgressiveSnapshot snapshot = { &config, &scene, &baked_scene, &num_samples_per_instance[0], &ao_samples, baked_ao, vertex_ao, 
+                                           mapped_output, live ? &live_view : NULL, snapshots, Timer(), false, 0 };
+          snapshot.timer.start();
+          bake::computeAOProgressive(context, baked_scene, ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, 
+            config.passes_per_query, config.time_budget, &ao_values[0], live ? update_live_view : snapshots ? save_snapshot : NULL, &snapshot,
+            live ? rank_by_view : NULL, &snapshot);
+          if (live && context) {
+            tweak_live_bake( config, baked_scene, ao_samples, scene_bbox_min, scene_bbox_max, occluders, context, scene_offset, scene_maxdistance, 
+              snapshot, &ao_values[0] );
+          }
+        } else if (device_filter) {
+          bake::computeAOToVertices(context, baked_scene, ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, config.passes_per_query,
+            config.adaptive_tolerance, NULL, baked_ao);
+        } else if (config.bent_normals) {
+          bake::computeAOBentNormals(context, baked_scene, ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, 
+            config.passes_per_query, &ao_values[0]);
+        } else if (config.sh_visibility) {
+          bake::computeAOSHVisibility(context, baked_scene, ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, 
+            config.passes_per_query, &ao_values[0]);
+        } else if (config.two_sided) {
+          bake::computeAOTwoSided(context, baked_scene, ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, config.passes_per_query,
+            &ao_values[0]);
+        } else if (!config.hit_distances.empty()) {
+          bake::computeAOMultiRadius(context, baked_scene, ao_samples, config.num_rays, scene_offset, &config.hit_distances[0], config.hit_distances.size(), 
+            config.batch_size, config.passes_per_query, &ao_values[0]);
+        } else if (!rays_per_instance.empty()) {
+          bake::computeAOPerInstance(context, baked_scene, ao_samples, &num_samples_per_instance[0], &rays_per_instance[0], scene_offset, 
+            scene_maxdistance, config.batch_size, config.passes_per_query, config.adaptive_tolerance, &ao_values[0]);
+        } else if (config.ao_cache_scale > 0.0f) {
+          bake::computeAOCached(context, baked_scene, ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, 
+            config.passes_per_query, config.adaptive_tolerance, config.ao_cache_scale * scene_maxdistance, config.ao_cache_error, &ao_values[0]);
+        } else {
+          bake::computeAO(context, baked_scene, ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, config.passes_per_query,
+            config.adaptive_tolerance, &ao_values[0]);
+        }
+      }
+    }
+    if (live) setMaxActiveLevels( levels_before_live );
+    stats.accel_ms = accel_timer.elapsed * 1000.0;
+    if (context) bake::setAOCheckpoint( context, NULL, 0 );
+    if (!sorted_order.empty()) {
+      bake::unsortSamples( ao_samples, &sorted_order[0], &ao_values[0], num_ao_channels );
+    }
+    if (!config.save_samples_filename.empty() && !loaded_samples &&
+        !save_traced_samples( config.save_samples_filename, samples_key, baked_scene, &num_samples_per_instance[0], ao_samples, 
+                              num_ao_channels, &ao_values[0] )) {
+      std::cerr << "\n\tFailed to save samples to: " << config.save_samples_filename << "\n\t"; std::cerr.flush();
+    }
+    // The front side, or the largest hit distance, is the main result.  Other channels are only saved.
+    std::vector<size_t> extra_channels;
+    std::vector<std::string> extra_suffixes;
+    size_t main_channel = 0;
+    if (config.two_sided) {
+      extra_channels.push_back( 1 );
+      extra_suffixes.push_back( ".back" );
+    } else if (num_ao_channels > 1 && !config.bent_normals && !config.sh_visibility) {
+      main_channel = num_ao_channels - 1;
+      for (size_t k = 0; k < main_channel; ++k) {
+        std::ostringstream suffix;
+        suffix << ".r" << k;
+        extra_channels.push_back( k );
+        extra_suffixes.push_back( suffix.str() );
+      }
+    }
+    float* main_ao_values = device_filter ? NULL : &ao_values[main_channel*total_samples];
+    printTimeElapsed( timer ); 
+    stats.ao_ms = timer.elapsed * 1000.0;
+
+    MeshProfileRows mesh_profile;
+    if (!config.profile_meshes_filename.empty()) {
+      count_mesh_profile( config, baked_scene, &num_samples_per_instance[0], rays_per_instance, main_ao_values, mesh_profile );
+    }
+
+    if (!config.occluder_variant_suffixes.empty() && context &&
+        !bake_occluder_variants( config, scene, baked_scene, representative_of, occluders, context, &num_samples_per_instance[0], 
+                                 rays_per_instance, ao_samples, scene_offset, scene_maxdistance )) {
+      destroy_ao_samples( ao_samples );
+      delete scene_memory;
+      return -1;
+    }
+
+    if (config.move_instance >= 0 && size_t(config.move_instance) < scene.num_instances && !config.share_mesh_ao && num_ao_channels == 1) {
+      rebake_moved_instance( config, scene, occluders, context, &num_samples_per_instance[0], ao_samples, scene_offset, scene_maxdistance, &ao_values[0] );
+    }
+
+    if (config.denoise_scale > 0.0f && !device_filter) {
+      bake::denoiseAO( ao_samples, config.denoise_scale, &ao_values[0], num_ao_channels );
+    }
+
+    // LODs look up the AO of the samples where they are, after the filters
+    bake::AOTransfer* lod_transfer = NULL;
+    if (!config.lod_filenames.empty() && main_ao_values) {
+      lod_transfer = bake::createAOTransfer( ao_samples, main_ao_values, config.lod_radius_scale );
+    }
+
+    // Nothing traces these samples again, so drop their geometry before the filters factorize.  Frames place them anew.
+    if (config.frames_filename.empty()) release_sample_geometry( ao_samples );
+    std::vector<size_t>().swap( sorted_order );
+    beginMemoryPhase( "filter" );
+
+    if (!device_filter) {
+      std::cerr << "Map AO to vertices  ...    "; std::cerr.flush();
+
+      timer.reset();
+      timer.start();
+      if (config.bent_normals || config.sh_visibility) {
+        map_directional_ao( config, scene, baked_scene, representative_of, &num_samples_per_instance[0], ao_samples, &ao_values[0], 
+          baked_ao );
+      } else if (config.vertex_samples) {
+        copy_vertex_ao( baked_scene, main_ao_values, baked_ao );
+      } else if (!config.regularization_weights.empty()) {
+        filter_weight_sweep( config, scene, baked_scene, representative_of, &num_samples_per_instance[0], ao_samples, main_ao_values, baked_ao );
+      } else {
+        // Incremental rebakes start the iterative solves from the previous result
+        std::vector< std::vector<float> > warm_start_ao;
+        std::vector<const float*> initial_ao;
+        if (!config.warm_start_filename.empty() && !load_warm_start( config, baked_scene, warm_start_ao, initial_ao )) {
+          return 1;
+        }
+        // Frames take the filter systems of the bake over
+        if (!config.frames_filename.empty()) bake::setFilterFrameReuse( config.frame_rigid_tolerance );
+        bake::mapAOToVertices( baked_scene, &num_samples_per_instance[0], ao_samples, main_ao_values, config.filter_mode, config.regularization_weight, 
+          baked_ao, config.filter_cache_dir.empty() ? NULL : config.filter_cache_dir.c_str(), config.analytic_mass_weight, config.ls_solver, 
+          config.ls_patch_vertices, 1, config.weld_tolerance, config.ls_ordering, NULL, 0, initial_ao.empty() ? NULL : &initial_ao[0] );
+      }
+
+      printTimeElapsed( timer ); 
+      if (!extra_channels.empty() && !config.output_filename.empty()) {
+        save_ao_channels( config, scene, baked_scene, representative_of, &num_samples_per_instance[0], ao_samples, &ao_values[0], 
+          extra_channels, extra_suffixes );
+      }
+      stats.map_ms = timer.elapsed * 1000.0;
+    }
+    if (!config.profile_meshes_filename.empty()) {
+      if (!save_mesh_profile( config.profile_meshes_filename, baked_scene, mesh_profile )) {
+        std::cerr << "Failed to save mesh profile to: " << config.profile_meshes_filename << std::endl;
+      }
+      enableMeshProfile( 0 );
+    }
+    for (size_t i = 0; i < baked_scene.num_instances && !cleaned.empty(); ++i) {
+      if (baked_ao[i]) bake::fillCleanedVertexAO( cleaned[baked_scene.instances[i].mesh_index], baked_ao[i] );
+    }
+    if (!config.frames_filename.empty()) {
+      const bool baked_frames = bake_frames( config, scene, baked_scene, representative_of, occluders, context, &num_samples_per_instance[0], 
+        rays_per_instance, ao_samples, scene_offset, scene_maxdistance, baked_ao, vertex_ao );
+      bake::setFilterFrameReuse( -1.0f );
+      if (!baked_frames) {
+        destroy_ao_samples( ao_samples );
+        delete scene_memory;
+        return -1;
+      }
+    }
+    // Only the vertex AO is needed from here on
+    destroy_ao_samples( ao_samples );
+    ao_values.release();
+
+    if (lod_transfer) {
+      size_t num_baked_triangles = 0;
+      for (size_t i = 0; i < baked_scene.num_instances; ++i) {
+        num_baked_triangles += baked_scene.meshes[baked_scene.instances[i].mesh_index].num_triangles;
+      }
+      transfer_to_lods( config, lod_transfer, num_baked_triangles );
+      bake::destroyAOTransfer( lod_transfer );
+    }
+
+    if (config.lightmap_size > 0) {
+      beginMemoryPhase( "lightmap" );
+      timer.reset();
+      timer.start();
+      if (!context) {
+        context = bake::createAOContext( occluders.scene, config.use_cpu, config.conserve_memory, 
+          config.devices.empty() ? NULL : &config.devices[0], config.devices.size(), config.accel_preset, occluders.analytic_ground_plane(), 
+          config.backend, config.peer_geometry, config.managed_geometry );
+        bake::setAOQueriesInFlight( context, config.queries_in_flight );
+        bake::setAOLatencyBudget( context, config.latency_budget );
+        bake::setAOFarField( context, config.far_field, config.far_field_resolution );
+      }
+      bake_lightmaps( config, scene, context, occluders.scene, scene_offset, scene_maxdistance );
+      timer.stop();
+      stats.lightmap_ms = timer.elapsed * 1000.0;
+    }
+    bake::destroyAOContext( context );
+    beginMemoryPhase( "save" );
+
+    // Save on a second thread while the viewer starts up and runs on this one
+    const bool save = !config.output_filename.empty() || !config.bk3d_output_filename.empty();
+    bool saved = false;
+    bool saved_bk3d = false;
+    size_t num_shared_instances = 0;
+    Timer save_timer;
+#pragma omp parallel num_threads(2) if(save && config.use_viewer && !live)
+    {
+      if (save && threadIndex() == numThreads() - 1) {
+        save_timer.start();
+        if (!config.output_filename.empty()) {
+          saved = mapped_output ? save_mapped_results(*mapped_output, scene, vertex_ao) 
+                                : save_results(config, scene, vertex_ao, num_shared_instances);
+        }
+        if (!config.bk3d_output_filename.empty()) {
+          std::vector< std::vector<float> > copies;
+          std::vector<const float*> ptrs;
+          saved_bk3d = save_bk3d_scene_ao(config.bk3d_output_filename.c_str(), config.scene_filename.c_str(), scene,
+            in_loaded_order(config, scene, 0, scene.num_instances, vertex_ao, copies, ptrs));
+        }
+        save_timer.stop();
+      }
+
+#ifndef BAKE_HEADLESS
+      if (config.use_viewer && !live && threadIndex() == 0) {
+        //
+        // Visualize results
+        //
+        std::cerr << "Launch viewer  ... \n" << std::endl;
+        bake::view(scene.meshes, scene.num_meshes, scene.instances, scene.num_instances, vertex_ao, scene_bbox_min, scene_bbox_max);
+      }
+#endif
+    }
+
+    if (save)
+    {
+      std::cerr << "Save vertex ao ...              "; printTimeElapsed(save_timer);
+      stats.save_ms = save_timer.elapsed * 1000.0;
+      if (saved){
+        std::cerr << "Saved vertex ao to: " << config.output_filename << std::endl;
+        if (num_shared_instances > 0) {
+          std::cerr << "\t" << num_shared_instances << " instances share stored results" << std::endl;
+        }
+      }
+      else if (!config.output_filename.empty()){
+        std::cerr << "Failed to save vertex ao to: " << config.output_filename << std::endl;
+      }    
+      if (!config.bk3d_output_filename.empty()) {
+        std::cerr << (saved_bk3d ? "Saved bk3d scene with vertex ao to: " : "Failed to save bk3d scene with vertex ao to: ")
+                  << config.bk3d_output_filename << std::endl;
+      }
+    }
+
+    bake::freeHostMemory( baked_ao_values );
+    if (mapped_output && !mapped_output->close()) saved = false;
+    if (saved && !config.result_cache_dir.empty() &&
+        !bake::storeCachedResult( config.result_cache_dir.c_str(), result_key, config.output_filename.c_str(), config.result_cache_bytes )) {
+      std::cerr << "Failed to add vertex ao to the result cache: " << config.result_cache_dir << std::endl;
+    }
+    delete [] baked_ao;
+    delete [] vertex_ao;
+
+    delete scene_memory;
+    beginMemoryPhase( NULL );
+  
+    return saved || !save ? 1 : 0;
+  }
+
+  // Split a batch line into options, with double quotes around arguments that contain spaces
+  std::vector<std::string> split_job_line( const std::string& line )
+  {
+    std::vector<std::string> args;
+    std::string arg;
+    bool in_arg = false, quoted = false;
+    for (size_t i = 0; i < line.size(); ++i) {
+      const char c = line[i];
+      if (c == '"') {
+        quoted = !quoted;
+        in_arg = true;
+      } else if (!quoted && (c == ' ' || c == '\t' || c == '\r')) {
+        if (in_arg) args.push_back( arg );
+        arg.clear();
+        in_arg = false;
+      } else {
+        arg += c;
+        in_arg = true;
+      }
+    }
+    if (in_arg) args.push_back( arg );
+    return args;
+  }
+
+  std::string json_escape( const std::string& str )
+  {
+    std::string escaped;
+    for (size_t i = 0; i < str.size(); ++i) {
+      if (str[i] == '"' || str[i] == '\\') escaped += '\\';
+      escaped += str[i];
+    }
+    return escaped;
+  }
+
+  // One JSON line per batch job on stdout
+  void print_job_record( const size_t job, const Config& config, const int result, const JobStats& stats, const double total_ms )
+  {
+    std::cout << "{\"job\": " << job
+              << ", \"scene\": \"" << json_escape( scene_label( config ) ) << "\""
+              << ", \"status\": \"" << (result < 0 ? "failed" : result == 0 ? "save_failed" : "ok") << "\""
+              << ", \"instances\": " << stats.num_instances
+              << ", \"triangles\": " << stats.num_triangles
+              << ", \"samples\": " << stats.num_samples
+              << ", \"rays\": " << stats.num_samples * size_t( std::max( config.num_rays, 1 ) )
+              << std::fixed << std::setprecision( 2 )
+              << ", \"load_ms\": " << stats.load_ms
+              << ", \"sample_ms\": " << stats.sample_ms
+              << ", \"ao_ms\": " << stats.ao_ms
+              << ", \"accel_ms\": " << stats.accel_ms
+              << ", \"map_ms\": " << stats.map_ms
+              << ", \"lightmap_ms\": " << stats.lightmap_ms
+              << ", \"save_ms\": " << stats.save_ms
+              << ", \"total_ms\": " << total_ms
+              << "}" << std::endl;
+  }
+
+  // Whether a batch job can be traced together with others by --pack: one scene whose only occluders are its own
+  // instances and ground plane, traced with one hit distance and filtered into one output file
+  bool packable_job( const Config& config )
+  {
+    return !config.output_filename.empty() && config.view_filename.empty() && config.scene_cache_filename.empty() && 
+      config.shared_scene_filename.empty() && config.context_filename.empty() && !config.use_roi_bbox && config.roi_ids_filename.empty() && 
+      config.lod_filenames.empty() && !config.flip_orientation && !config.reorder_meshes && !config.clean_meshes && config.instance_ray_ranges.empty() && 
+      config.large_instance_rays == 0 && config.regularization_weights.empty() && config.hit_distances.empty() && !config.two_sided && 
+      !config.bent_normals && !config.sh_visibility && !config.gpu_sampling && !config.vertex_samples && config.variance_rays == 0 && 
+      config.auto_hit_distance == 0.0f && !config.share_mesh_ao && !config.sort_samples && !config.reconstruct_samples && config.tile_scale == 0.0f && 
+      config.part_cache_dir.empty() && config.result_cache_dir.empty() && config.checkpoint_dir.empty() && config.save_samples_filename.empty() && 
+      config.load_samples_filename.empty() && config.time_budget == 0.0 && config.denoise_scale == 0.0f && config.ao_cache_scale == 0.0f && config.move_instance < 0 && 
+      config.instance_chunk == 0 && config.spill_dir.empty() && config.partition_count <= 1 && !config.mapped_output && config.patch_base_filename.empty() && 
+      config.bk3d_output_filename.empty() && 
+      config.lightmap_size == 0 && config.profile_meshes_filename.empty() && config.host_memory_budget == 0 && config.device_memory_budget == 0 && 
+      !config.dry_run && config.frames_filename.empty();
+  }
+
+  // Jobs of one pack share every option but the scene and output files
+  std::string pack_key( const std::vector<std::string>& job_args )
+  {
+    std::string key;
+    for (size_t i = 0; i < job_args.size(); ++i) {
+      const std::string& arg = job_args[i];
+      if ((arg == "-f" || arg == "--file" || arg == "-o" || arg == "--outfile") && i+1 < job_args.size()) {
+        ++i;
+        continue;
+      }
+      key += arg;
+      key += '\0';
+    }
+    return key;
+  }
+
+  // A job of a pack: its scene and occluders, and the cell of the packed scene they are moved to.  Each job is 
+  // scaled so its hit distance is that of the first job, which keeps its AO that of a bake on its own.
+  struct PackedJob {
+    Config config;
+    size_t job;
+    std::string line;
+    bake::Scene scene;
+    SceneMemory* scene_memory;
+    float bbox_min[3];
+    float bbox_max[3];
+    float scene_offset;
+    float scene_maxdistance;
+    Occluders occluders;
+    float scale;
+    float translation[3];
+    std::vector<size_t> num_samples_per_instance;
+    size_t first_sample;
+    size_t first_triangle;  // of the job's instances among those of the pack, for compact sample areas
+    size_t num_samples;
+    JobStats stats;
+    double total_ms;
+    int result;
+
+    PackedJob( const Config& job_config, const size_t job_index, const std::string& job_line ) 
+      : config( job_config ), job( job_index ), line( job_line ), scene_memory( NULL ), scene_offset( 0.0f ), scene_maxdistance( 0.0f ), 
+        scale( 1.0f ), first_sample( 0 ), first_triangle( 0 ), num_samples( 0 ), total_ms( 0.0 ), result( -1 ) {
+      scene.meshes = NULL;
+      scene.num_meshes = 0;
+      scene.instances = NULL;
+      scene.num_instances = 0;
+      translation[0] = translation[1] = translation[2] = 0.0f;
+    }
+    ~PackedJob() { delete scene_memory; }
+  };
+
+  // An instance moved into its job's cell: scaled about the origin, then translated
+  bake::Instance pack_instance( const bake::Instance& instance, const PackedJob& job, const unsigned mesh_offset )
+  {
+    bake::Instance packed = instance;
+    for (int r = 0; r < 3; ++r) {
+      for (int c = 0; c < 4; ++c) packed.xform[4*r + c] = job.scale*instance.xform[4*r + c];
+      packed.xform[4*r + 3] += job.translation[r];
+      packed.bbox_min[r] = job.scale*instance.bbox_min[r] + job.translation[r];
+      packed.bbox_max[r] = job.scale*instance.bbox_max[r] + job.translation[r];
+    }
+    packed.mesh_index = instance.mesh_index + mesh_offset;
+    return packed;
+  }
+
+  // Appends a job's scene, moved into its cell, to the meshes and instances of a pack
+  void append_packed_scene( const bake::Scene& scene, const PackedJob& job, std::vector<bake::Mesh>& meshes, std::vector<bake::Instance>& instances )
+  {
+    const unsigned mesh_offset = unsigned( meshes.size() );
+    meshes.insert( meshes.end(), scene.meshes, scene.meshes + scene.num_meshes );
+    for (size_t i = 0; i < scene.num_instances; ++i) {
+      instances.push_back( pack_instance( scene.instances[i], job, mesh_offset ) );
+    }
+  }
+
+  template <typename T>
+  T* offset_or_null( T* ptr, const size_t n ) { return ptr ? ptr + n : NULL; }
+
+  // The samples of one job of a pack, as a set of their own
+  bake::AOSamples packed_job_samples( const bake::AOSamples& ao_samples, const PackedJob& job )
+  {
+    bake::AOSamples samples = ao_samples;
+    samples.num_samples = job.num_samples;
+    samples.sample_positions = offset_or_null( ao_samples.sample_positions, 3*job.first_sample );
+    samples.sample_normals = offset_or_null( ao_samples.sample_normals, 3*job.first_sample );
+    samples.sample_face_normals = offset_or_null( ao_samples.sample_face_normals, 3*job.first_sample );
+    samples.sample_infos = offset_or_null( ao_samples.sample_infos, job.first_sample );
+    samples.compact_sample_infos = offset_or_null( ao_samples.compact_sample_infos, job.first_sample );
+    samples.tri_sample_dA = offset_or_null( ao_samples.tri_sample_dA, job.first_triangle );
+    return samples;
+  }
+
+  // Loads the scenes of a pack of jobs and places them on a grid, with cells a few hit distances wider than the
+  // largest scene so no ray reaches another job's geometry, then samples each job as a bake of its own would, traces 
+  // all samples in one context, and filters and saves each job's share.  Ground planes are clipped to within reach 
+  // of their scene, which leaves the AO as it is.  Jobs whose ratio of ray offset to hit distance differs from the
+  // first's, which scaling can't match, are baked on their own.  Trace times are split over the jobs by samples.
+  void bake_pack( std::vector<PackedJob*>& pack )
+  {
+    Timer timer;
+    std::cerr << "\nPack of " << pack.size() << " batch jobs, " << pack[0]->job << " to " << pack.back()->job << std::endl;
+    bake::setFilterConjugateGradient( pack[0]->config.cg_tolerance, pack[0]->config.cg_preconditioner );
+
+    const bake::Scene no_context = { NULL, 0, NULL, 0 };
+    std::vector<PackedJob*> packed;
+    for (size_t k = 0; k < pack.size(); ++k) {
+      PackedJob& job = *pack[k];
+      std::fill( job.bbox_min, job.bbox_min + 3, FLT_MAX );
+      std::fill( job.bbox_max, job.bbox_max + 3, -FLT_MAX );
+      timer.reset();
+      timer.start();
+      const bool loaded = load_input_scene( job.config, job.scene, job.bbox_min, job.bbox_max, job.scene_memory );
+      timer.stop();
+      if (!loaded) {
+        std::cerr << "Failed to load scene of batch job " << job.job << ": " << scene_label( job.config ) << std::endl;
+        job.total_ms = timer.elapsed * 1000.0;
+        continue;
+      }
+      job.stats.load_ms = timer.elapsed * 1000.0;
+      job.stats.num_instances = job.scene.num_instances;
+      for (size_t m = 0; m < job.scene.num_meshes; ++m) job.stats.num_triangles += job.scene.meshes[m].num_triangles;
+      scene_distances( job.config, job.bbox_min, job.bbox_max, job.scene_offset, job.scene_maxdistance );
+
+      const float scale = packed.empty() ? 1.0f : packed[0]->scene_maxdistance / job.scene_maxdistance;
+      const float offset = packed.empty() ? job.scene_offset : packed[0]->scene_offset;
+      if (!(job.scene_maxdistance > 0.0f) || std::fabs( scale*job.scene_offset - offset ) > 1.0e-4f*offset) {
+        std::cerr << "Batch job " << job.job << " traces with another ray offset for its hit distance, baking it alone" << std::endl;
+        delete job.scene_memory;
+        job.scene_memory = NULL;
+        job.stats = JobStats();
+        Timer job_timer;
+        job_timer.start();
+        job.result = bake_scene( job.config, job.stats );
+        job_timer.stop();
+        job.total_ms = job_timer.elapsed * 1000.0;
+        continue;
+      }
+      job.scale = scale;
+      packed.push_back( &job );
+
+      Config occluder_config = job.config;
+      occluder_config.analytic_ground_plane = false;
+      make_occluders( occluder_config, job.scene, no_context, job.bbox_min, job.bbox_max, job.occluders );
+      if (!job.occluders.plane_vertices.empty()) {
+        const float reach = job.scene_maxdistance + job.scene_offset;
+        const int up = job.config.ground_upaxis % 3;
+        for (size_t v = 0; v < job.occluders.plane_vertices.size(); ++v) {
+          const int c = int( v % 3 );
+          if (c == up) continue;
+          job.occluders.plane_vertices[v] = std::min( std::max( job.occluders.plane_vertices[v], job.bbox_min[c] - reach ), job.bbox_max[c] + reach );
+        }
+        bake::Instance& plane = job.occluders.combined_instances.back();
+        for (int c = 0; c < 3; ++c) {
+          if (c == up) continue;
+          plane.bbox_min[c] = std::max( plane.bbox_min[c], job.bbox_min[c] - reach );
+          plane.bbox_max[c] = std::min( plane.bbox_max[c], job.bbox_max[c] + reach );
+        }
+      }
+    }
+
+    if (!packed.empty()) {
+      const Config& config = packed[0]->config;
+      const float scene_offset = packed[0]->scene_offset;
+      const float scene_maxdistance = packed[0]->scene_maxdistance;
+
+      // Cells, and each job's scene centered in its cell
+      float cell = 0.0f;
+      for (size_t k = 0; k < packed.size(); ++k) {
+        for (int c = 0; c < 3; ++c) cell = std::max( cell, packed[k]->scale*(packed[k]->bbox_max[c] - packed[k]->bbox_min[c]) );
+      }
+      cell += 3.0f*(scene_maxdistance + scene_offset);
+      const size_t side = std::max( size_t( std::ceil( std::pow( double( packed.size() ), 1.0/3.0 ) ) ), size_t(1) );
+      std::vector<bake::Mesh> scene_meshes, occluder_meshes;
+      std::vector<bake::Instance> scene_instances, occluder_instances;
+      size_t total_samples = 0, total_triangles = 0;
+      std::vector<bake::SamplingPlan> plans( packed.size() );
+      for (size_t k = 0; k < packed.size(); ++k) {
+        PackedJob& job = *packed[k];
+        const size_t cell_index[] = { k % side, (k / side) % side, k / (side*side) };
+        for (int c = 0; c < 3; ++c) {
+          job.translation[c] = cell*float( cell_index[c] ) - 0.5f*job.scale*(job.bbox_min[c] + job.bbox_max[c]);
+        }
+        append_packed_scene( job.scene, job, scene_meshes, scene_instances );
+        append_packed_scene( job.occluders.scene, job, occluder_meshes, occluder_instances );
+
+        timer.reset();
+        timer.start();
+        job.num_samples_per_instance.resize( job.scene.num_instances );
+        job.num_samples = bake::distributeSamples( job.scene, job.config.min_samples_per_face, job.config.num_samples, 
+          job.num_samples_per_instance.empty() ? NULL : &job.num_samples_per_instance[0], &plans[k] );
+        timer.stop();
+        job.stats.sample_ms = timer.elapsed * 1000.0;
+        job.stats.num_samples = job.num_samples;
+        job.first_sample = total_samples;
+        job.first_triangle = total_triangles;
+        total_samples += job.num_samples;
+        for (size_t i = 0; i < job.scene.num_instances; ++i) {
+          total_triangles += job.scene.meshes[job.scene.instances[i].mesh_index].num_triangles;
+        }
+      }
+      const bake::Scene scene = { scene_meshes.empty() ? NULL : &scene_meshes[0], scene_meshes.size(), 
+                                  scene_instances.empty() ? NULL : &scene_instances[0], scene_instances.size() };
+      const bake::Scene occluders = { occluder_meshes.empty() ? NULL : &occluder_meshes[0], occluder_meshes.size(), 
+                                      occluder_instances.empty() ? NULL : &occluder_instances[0], occluder_instances.size() };
+
+      // Each job samples in its own space, then its samples move to its cell with its scene
+      bake::AOSamples ao_samples;
+      allocate_ao_samples( ao_samples, total_samples, scene, false, config.compact_samples, config.pinned_memory );
+      for (size_t k = 0; k < packed.size(); ++k) {
+        PackedJob& job = *packed[k];
+        timer.reset();
+        timer.start();
+        bake::AOSamples job_samples = packed_job_samples( ao_samples, job );
+        bake::sampleInstances( job.scene, job.num_samples_per_instance.empty() ? NULL : &job.num_samples_per_instance[0], 
+          job.config.min_samples_per_face, job_samples, &plans[k], job.config.sample_templates );
+        float* positions = job_samples.sample_positions;
+#pragma omp parallel for if(job.num_samples >= (1 << 16))
+        for (ptrdiff_t i = 0; i < ptrdiff_t(3*job.num_samples); ++i) {
+          positions[i] = job.scale*positions[i] + job.translation[i % 3];
+        }
+        timer.stop();
+        job.stats.sample_ms += timer.elapsed * 1000.0;
+      }
+      std::vector<bake::SamplingPlan>().swap( plans );
+
+      std::cerr << "Trace pack: " << packed.size() << " jobs, " << scene.num_instances << " instances, " << total_samples << " samples ... "; 
+      std::cerr.flush();
+      Timer accel_timer;
+      timer.reset();
+      timer.start();
+      AOValues ao_values( total_samples, config.pinned_memory );
+      accel_timer.start();
+      bake::AOContext* context = bake::createAOContext( occluders, config.use_cpu, config.conserve_memory, 
+        config.devices.empty() ? NULL : &config.devices[0], config.devices.size(), config.accel_preset, NULL, config.backend, 
+        config.peer_geometry, config.managed_geometry );
+      bake::setAOQueriesInFlight( context, config.queries_in_flight );
+      bake::setAOLatencyBudget( context, config.latency_budget );
+      bake::setAOFarField( context, config.far_field, config.far_field_resolution );
+      accel_timer.stop();
+      bake::computeAO( context, scene, ao_samples, config.num_rays, scene_offset, scene_maxdistance, config.batch_size, 
+        config.passes_per_query, config.adaptive_tolerance, &ao_values[0] );
+      bake::destroyAOContext( context );
+      timer.stop();
+      printTimeElapsed( timer );
+      recordCount( "pack.jobs", packed.size() );
+      release_sample_geometry( ao_samples );
+
+      for (size_t k = 0; k < packed.size(); ++k) {
+        PackedJob& job = *packed[k];
+        const double share = total_samples > 0 ? double( job.num_samples ) / double( total_samples ) : 1.0 / double( packed.size() );
+        job.stats.ao_ms = timer.elapsed * 1000.0 * share;
+        job.stats.accel_ms = accel_timer.elapsed * 1000.0 * share;
+
+        Timer job_timer;
+        job_timer.start();
+        std::vector<float*> vertex_ao( job.scene.num_instances );
+        for (size_t i = 0; i < job.scene.num_instances; ++i) {
+          vertex_ao[i] = allocate_vertex_ao( job.scene.meshes[job.scene.instances[i].mesh_index].num_vertices );
+        }
+        const bake::AOSamples job_samples = packed_job_samples( ao_samples, job );
+        if (job.scene.num_instances > 0) {
+          bake::mapAOToVertices( job.scene, &job.num_samples_per_instance[0], job_samples, &ao_values[job.first_sample], job.config.filter_mode, 
+            job.config.regularization_weight, &vertex_ao[0], job.config.filter_cache_dir.empty() ? NULL : job.config.filter_cache_dir.c_str(), 
+            job.config.analytic_mass_weight, job.config.ls_solver, job.config.ls_patch_vertices, 1, job.config.weld_tolerance, job.config.ls_ordering );
+        }
+        job_timer.stop();
+        job.stats.map_ms = job_timer.elapsed * 1000.0;
+
+        job_timer.reset();
+        job_timer.start();
+        size_t num_shared_instances = 0;
+        const bool saved = save_results( job.config, job.scene, vertex_ao.empty() ? NULL : &vertex_ao[0], num_shared_instances );
+        job_timer.stop();
+        job.stats.save_ms = job_timer.elapsed * 1000.0;
+        if (!saved) std::cerr << "Failed to save vertex ao of batch job " << job.job << " to: " << job.config.output_filename << std::endl;
+        job.result = saved ? 1 : 0;
+        job.total_ms = job.stats.load_ms + job.stats.sample_ms + job.stats.ao_ms + job.stats.map_ms + job.stats.save_ms;
+        for (size_t i = 0; i < vertex_ao.size(); ++i) free_vertex_ao( vertex_ao[i] );
+      }
+      destroy_ao_samples( ao_samples );
+    }
+
+    // Scenes are only needed by the pack
+    for (size_t k = 0; k < pack.size(); ++k) {
+      delete pack[k]->scene_memory;
+      pack[k]->scene_memory = NULL;
+    }
+  }
+
+  // Bake every job of the list file in this process, so CUDA and OpenMP start up once.  With --pack, consecutive jobs
+  // that can be are traced together.  Returns the number of failed jobs.
+  int bake_batch( int argc, const char** argv, const std::string& batch_filename )
+  {
+    std::ifstream file( batch_filename.c_str() );
+    if (!file) {
+      std::cerr << "Failed to open batch file: " << batch_filename << std::endl;
+      return -1;
+    }
+
+    // Base options for every job: the command line without the batch option
+    std::vector<std::string> base_args;
+    for (int i = 0; i < argc; ++i) {
+      if (std::string( argv[i] ) == "--batch" && i+1 < argc) {
+        ++i;
+        continue;
+      }
+      base_args.push_back( argv[i] );
+    }
+
+    int num_failed = 0;
+    size_t job = 0;
+    std::string line;
+    std::vector<PackedJob*> pack;
+    std::string current_pack_key;
+    for (;;) {
+      const bool more = static_cast<bool>( std::getline( file, line ) );
+      std::vector<std::string> job_args;
+      if (more) {
+        job_args = split_job_line( line );
+        if (job_args.empty() || job_args[0][0] == '#') continue;
+      }
+
+      Config* config = NULL;
+      if (more) {
+        // A job's -f files replace the command line's rather than adding to them
+        bool job_files = false;
+        for (size_t i = 0; i < job_args.size(); ++i) job_files = job_files || job_args[i] == "-f" || job_args[i] == "--file";
+        std::vector<const char*> job_argv;
+        for (size_t i = 0; i < base_args.size(); ++i) {
+          if (job_files && (base_args[i] == "-f" || base_args[i] == "--file") && i+1 < base_args.size()) {
+            ++i;
+            continue;
+          }
+          job_argv.push_back( base_args[i].c_str() );
+        }
+        for (size_t i = 0; i < job_args.size(); ++i) job_argv.push_back( job_args[i].c_str() );
+        config = new Config( int(job_argv.size()), &job_argv[0] );
+        config->use_viewer = false;
+      }
+
+      // A pack is baked when the next job can't join it, or it is full
+      const bool pack_job = config && config->pack_jobs > 1 && packable_job( *config );
+      const std::string key = pack_job ? pack_key( job_args ) : std::string();
+      if (!pack.empty() && (!pack_job || key != current_pack_key || pack.size() >= pack[0]->config.pack_jobs)) {
+        bake_pack( pack );
+        for (size_t k = 0; k < pack.size(); ++k) {
+          if (pack[k]->result <= 0) ++num_failed;
+          print_job_record( pack[k]->job, pack[k]->config, pack[k]->result, pack[k]->stats, pack[k]->total_ms );
+          delete pack[k];
+        }
+        pack.clear();
+      }
+      if (!config) break;
+
+      if (pack_job) {
+        std::cerr << "\nBatch job " << job << " (packed): " << line << std::endl;
+        pack.push_back( new PackedJob( *config, job, line ) );
+        current_pack_key = key;
+      } else {
+        std::cerr << "\nBatch job " << job << (config->pack_jobs > 1 ? " (not packable)" : "") << ": " << line << std::endl;
+        Timer timer;
+        timer.start();
+        JobStats stats;
+        const int result = bake_scene( *config, stats );
+        timer.stop();
+        if (result <= 0) ++num_failed;
+        print_job_record( job, *config, result, stats, timer.elapsed * 1000.0 );
+      }
+      delete config;
+      ++job;
+    }
+    return num_failed;
+  }
+
+  // --progress: a line per stage at most every interval, and when it is done, with the time left at the rate since the
+  // stage's first report
+  struct ProgressPrinter
+  {
+    double interval;
+    std::string stage;
+    double stage_start;
+    uint64_t stage_first_done;
+    double last_print;
+    uint64_t last_done;
+  };
+
+  void print_progress( void* progress_data, const char* stage, const uint64_t done, const uint64_t total, const double rays_per_second )
+  {
+    ProgressPrinter& printer = *static_cast<ProgressPrinter*>( progress_data );
+    Timer clock;
+    const double now = clock.start();
+    // A stage starts over when its name changes, or when a new call of it counts from zero
+    if (printer.stage != stage || done < printer.last_done) {
+      printer.stage = stage;
+      printer.stage_start = now;
+      printer.stage_first_done = done;
+      printer.last_print = now;
+    }
+    printer.last_done = done;
+    if (done < total && now - printer.last_print < printer.interval) return;
+    printer.last_print = now;
+
+    const double elapsed = now - printer.stage_start;
+    std::ostringstream line;
+    line << "\n\t" << stage << " progress ... " << std::fixed << std::setprecision( 1 ) 
+         << (total > 0 ? 100.0 * double( done ) / double( total ) : 100.0) << "% (" << done << " of " << total << ")";
+    if (rays_per_second > 0.0) line << ", " << rays_per_second * 1.0e-6 << " Mrays/s";
+    if (done > printer.stage_first_done && done < total) {
+      const long long left = (long long)( elapsed * double( total - done ) / double( done - printer.stage_first_done ) + 0.5 );
+      line << ", ETA " << left / 3600 << ":" << std::setfill( '0' ) << std::setw( 2 ) << left / 60 % 60 << ":" << std::setw( 2 ) << left % 60;
+    }
+    std::cerr << line.str();
+    std::cerr.flush();
   }
 
-  for (size_t i = 0; i < scene.num_instances; ++i) {
-    delete [] vertex_ao[i];
+  // Shared by the viewer and headless entry points
+  int bake_main( int argc, const char** argv )
+  {
+    const Config config( argc, argv ); 
+
+    // Before the first parallel region, so the OpenMP threads inherit the placement
+    const ThreadPlacement placement = placeThreads( config.num_threads, config.submit_cores, config.pin_threads );
+    if (config.num_threads > 0 || config.submit_cores > 0 || config.pin_threads) {
+      std::cerr << "Threads: " << placement.host_threads << " for host stages, " << placement.submit_cores << " cores kept for device submission";
+      if (placement.pinned) std::cerr << ", pinned over " << placement.numa_nodes << " NUMA node" << (placement.numa_nodes == 1 ? "" : "s");
+      std::cerr << std::endl;
+    }
+
+    ProgressPrinter progress_printer;
+    progress_printer.interval = config.progress_interval;
+    progress_printer.stage_start = progress_printer.last_print = 0.0;
+    progress_printer.stage_first_done = progress_printer.last_done = 0;
+    if (config.progress_interval > 0.0) bake::setProgressCallback( print_progress, &progress_printer );
+    bake::setKernelTuning( config.tune_kernels );
+    bake::setMeshLibraryBudget( config.mesh_library_bytes );
+
+    int result = 1;
+    if (!config.batch_filename.empty()) {
+      result = bake_batch( argc, argv, config.batch_filename ) == 0 ? 1 : -1;
+    } else {
+      JobStats stats;
+      if (bake_scene( config, stats ) < 0) {
+        result = -1;
+      }
+    }
+
+    bake::setMeshLibraryBudget( 0 );
+    bake::releasePreparedDevices();
+    bake::setProgressCallback( NULL, NULL );
+
+    if (!config.stats_filename.empty() && !saveMetrics( config.stats_filename.c_str() )) {
+      std::cerr << "Failed to save stats to: " << config.stats_filename << std::endl;
+    }
+    if (result < 0 && config.batch_filename.empty()) {
+      exit(-1);
+    }
+    return result;
   }
-  delete [] vertex_ao;
 
-  destroy_ao_samples( ao_samples );
+} // end namespace
 
-  delete scene_memory;
+
+#ifdef BAKE_HEADLESS
+
+int main( int argc, char** argv )
+{
+  return bake_main( argc, const_cast<const char**>( argv ) ) < 0 ? 1 : 0;
+}
+
+#else
+
+// Required entry point
+//------------------------------------------------------------------------------
+int sample_main( int argc, const char** argv )
+{
   
-  return 1;
+  // show console and redirect printing
+  NVPWindow::sysVisibleConsole();
+
+  return bake_main( argc, argv );
 }
 
 // Required logging function
@@ -700,3 +5542,5 @@ void sample_print(int level, const char * fmt)
   //stub
 }
 
+#endif
+
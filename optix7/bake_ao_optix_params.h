@@ -0,0 +1,58 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+#pragma once
+
+#include "../bake_kernels.h"
+#include <optix.h>
+
+namespace bake
+{
+
+// Launch parameters of the programs in bake_ao_optix_programs.cu.  One launch traces all rays of a batch, with
+// a thread per sample.
+struct OptixAOParams
+{
+  OptixTraversableHandle handle;
+  DeviceSamples          samples;
+  unsigned long long     first_sample_index;   // of the batch in the bake, as for generateRaysDevice
+  int                    num_passes;           // rays per sample and side
+  float                  scene_offset;
+  float                  scene_maxdistance;
+  float                  adaptive_tolerance;   // 0 traces all rays
+  int                    two_sided;            // trace with flipped normals too, into the second channel
+  DeviceGroundPlane      ground_plane;         // axis < 0 if none
+  DeviceAORadii          radii;                // count 0 for AO at scene_maxdistance only
+  float*                 ao;                   // channels of samples.num_samples values, final AO
+  unsigned long long*    num_rays_traced;      // summed over the launch
+};
+
+// Ray types, i.e. miss records
+enum OptixAORayType
+{
+  OPTIX_AO_RAY_OCCLUSION = 0,  // payload 1 on a hit, 0 on a miss
+  OPTIX_AO_RAY_DISTANCE,       // payload is the closest hit distance, as float bits, -1 on a miss
+  OPTIX_AO_RAY_TYPE_COUNT
+};
+
+}
@@ -0,0 +1,133 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+// Ray generation, miss and closest hit programs of the OptiX backend, see bake_ao_optix.cpp.  The build compiles
+// this file to PTX and embeds it, so it is not part of the CUDA sources of bake_core.
+
+#include "bake_ao_optix_params.h"
+#include "../bake_ray_sampling.h"
+
+#include <optix.h>
+#include <optixu/optixu_math_namespace.h>
+using optix::float3;
+
+
+extern "C" {
+__constant__ bake::OptixAOParams params;
+}
+
+
+// Occlusion rays stop at the first hit and run no hit programs; only their miss program writes the payload.
+static __forceinline__ __device__ bool traceOcclusion( const float3& origin, const float3& dir, const float tmin, const float tmax )
+{
+  unsigned int occluded = 1u;
+  optixTrace( params.handle, origin, dir, tmin, tmax, 0.0f, OptixVisibilityMask( 255 ),
+              OPTIX_RAY_FLAG_TERMINATE_ON_FIRST_HIT | OPTIX_RAY_FLAG_DISABLE_ANYHIT | OPTIX_RAY_FLAG_DISABLE_CLOSESTHIT,
+              0, 1, bake::OPTIX_AO_RAY_OCCLUSION, occluded );
+  return occluded != 0u;
+}
+
+// Distance to the closest hit from the ray origin, or -1 for a miss
+static __forceinline__ __device__ float traceHitDistance( const float3& origin, const float3& dir, const float tmin, const float tmax )
+{
+  unsigned int t = __float_as_uint( -1.0f );
+  optixTrace( params.handle, origin, dir, tmin, tmax, 0.0f, OptixVisibilityMask( 255 ), OPTIX_RAY_FLAG_DISABLE_ANYHIT,
+              0, 1, bake::OPTIX_AO_RAY_DISTANCE, t );
+  return __uint_as_float( t );
+}
+
+
+// Traces the rays of all passes of one sample, with the directions of generateRaysDevice, and writes its final AO.
+// Forward rays from the sample are as fast as reverse ones here, and more precise.
+extern "C" __global__ void __raygen__ao()
+{
+  const size_t idx = optixGetLaunchIndex().x;
+  const size_t num_samples = params.samples.num_samples;
+
+  const unsigned int scramble_seed = bake::aoScrambleSeed( params.first_sample_index + idx );
+  const uint2  packed_normals = params.samples.normals[idx];
+  const float4 sample_pos     = params.samples.positions[idx];
+  const float3 ray_origin     = optix::make_float3( sample_pos.x, sample_pos.y, sample_pos.z );
+  const float  tmin           = params.scene_offset;
+  const float  tmax           = params.scene_maxdistance;
+  const int    num_radii      = params.radii.count;
+  const int    num_sides      = params.two_sided ? 2 : 1;
+
+  unsigned long long rays_traced = 0;
+  for ( int s = 0; s < num_sides; ++s ) {
+    const float  side             = s == 0 ? 1.0f : -1.0f;
+    const float3 sample_norm      = side * bake::decodeOctahedral( packed_normals.x );
+    const float3 sample_face_norm = side * bake::decodeOctahedral( packed_normals.y );
+    
+    int occluded[bake::MAX_DEVICE_AO_RADII] = {};
+    int num_rays = 0;
+    while ( num_rays < params.num_passes ) {
+      const float3 ray_dir = bake::sampleAODirection( num_rays, scramble_seed, sample_norm, sample_face_norm );
+
+      // The ground plane is tested analytically, as in generateRaysDevice
+      const float plane_t = params.ground_plane.axis >= 0 ? 
+        bake::groundPlaneDistance( params.ground_plane, ray_origin, ray_dir, tmin, tmax ) : -1.0f;
+
+      if ( num_radii > 0 ) {
+        // A ray blocked by the plane only needs to look for closer hits
+        float t = traceHitDistance( ray_origin, ray_dir, tmin, plane_t >= 0.0f ? plane_t : tmax );
+        if ( t < 0.0f ) t = plane_t;
+        if ( t >= 0.0f ) {
+          for ( int r = 0; r < num_radii; ++r ) occluded[r] += t <= params.radii.radii[r] ? 1 : 0;
+        }
+      } else if ( plane_t >= 0.0f || traceOcclusion( ray_origin, ray_dir, tmin, tmax ) ) {
+        ++occluded[0];
+      }
+      ++num_rays;
+
+      // Adaptive sampling stops once the standard error is within tolerance, like retireConvergedDevice, 
+      // but per sample and at power of two ray counts, whose Sobol prefixes are stratified
+      if ( params.adaptive_tolerance > 0.0f && num_rays >= bake::ADAPTIVE_MIN_RAYS && ( num_rays & ( num_rays - 1 ) ) == 0 ) {
+        const float p = float( occluded[0] ) / num_rays;
+        if ( sqrtf( p*( 1.0f - p ) / num_rays ) <= params.adaptive_tolerance ) break;
+      }
+    }
+
+    const int num_channels = num_radii > 0 ? num_radii : 1;
+    for ( int c = 0; c < num_channels; ++c ) {
+      params.ao[( s + c )*num_samples + idx] = 1.0f - float( occluded[c] ) / num_rays;
+    }
+    rays_traced += num_rays;
+  }
+  atomicAdd( params.num_rays_traced, rays_traced );
+}
+
+extern "C" __global__ void __miss__occlusion()
+{
+  optixSetPayload_0( 0u );
+}
+
+extern "C" __global__ void __miss__distance()
+{
+  // Keeps the -1 of a miss
+}
+
+extern "C" __global__ void __closesthit__distance()
+{
+  optixSetPayload_0( __float_as_uint( optixGetRayTmax() ) );
+}
@@ -21,6 +21,8 @@
   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 -----------------------------------------------------------------------*/
 
+#pragma once
+
 #include <optixu/optixu_math_namespace.h>
 
 template<unsigned int N>
@@ -0,0 +1,409 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+// Ray throughput benchmark for the AO raytracer on procedural scenes, so results don't depend on the asset 
+// at hand.  Sweeps rays per sample, batch size and Prime context type, and writes one CSV row per run with
+// rays per second, phase times and memory.  No viewer or scene loaders are involved.
+
+#include "../bake_api.h"
+#include "../bake_util.h"
+
+#include <cuda_runtime.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+const float SCENE_OFFSET_SCALE      = 0.01f;
+const float SCENE_MAXDISTANCE_SCALE = 1.1f;
+
+// Geometry of a generated scene, kept alive while it is baked
+struct ProceduralScene {
+  std::string name;
+  std::vector<float>    vertices;
+  std::vector<float>    normals;
+  std::vector<unsigned> indices;
+  std::vector<bake::Mesh>     meshes;
+  std::vector<bake::Instance> instances;
+  bake::Scene scene;
+  float bbox_min[3], bbox_max[3];
+};
+
+void set_identity( float* xform )
+{
+  std::fill( xform, xform + 16, 0.0f );
+  xform[0] = xform[5] = xform[10] = xform[15] = 1.0f;
+}
+
+// One mesh over the vertex and index arrays; instances are added by the caller
+void finish_mesh( ProceduralScene& ps )
+{
+  bake::Mesh mesh;
+  mesh.num_vertices = ps.vertices.size() / 3;
+  mesh.vertices = &ps.vertices[0];
+  mesh.vertex_stride_bytes = 0;
+  mesh.normals = ps.normals.empty() ? NULL : &ps.normals[0];
+  mesh.normal_stride_bytes = 0;
+  mesh.texcoords = NULL;
+  mesh.texcoord_stride_bytes = 0;
+  mesh.geometry_memory = bake::MEMORY_SPACE_HOST;
+  mesh.num_triangles = ps.indices.size() / 3;
+  mesh.tri_vertex_indices = &ps.indices[0];
+  for (int k = 0; k < 3; ++k) {
+    mesh.bbox_min[k] = FLT_MAX;
+    mesh.bbox_max[k] = -FLT_MAX;
+  }
+  for (size_t i = 0; i < mesh.num_vertices; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      mesh.bbox_min[k] = std::min( mesh.bbox_min[k], ps.vertices[3*i+k] );
+      mesh.bbox_max[k] = std::max( mesh.bbox_max[k], ps.vertices[3*i+k] );
+    }
+  }
+  ps.meshes.push_back( mesh );
+}
+
+// Translated instance of mesh 0
+void add_instance( ProceduralScene& ps, float x, float y, float z )
+{
+  const bake::Mesh& mesh = ps.meshes[0];
+  bake::Instance instance;
+  set_identity( instance.xform );
+  instance.xform[3] = x;
+  instance.xform[7] = y;
+  instance.xform[11] = z;
+  instance.storage_identifier = ps.instances.size();
+  instance.mesh_index = 0;
+  const float offset[] = { x, y, z };
+  for (int k = 0; k < 3; ++k) {
+    instance.bbox_min[k] = mesh.bbox_min[k] + offset[k];
+    instance.bbox_max[k] = mesh.bbox_max[k] + offset[k];
+  }
+  ps.instances.push_back( instance );
+}
+
+void finish_scene( ProceduralScene& ps )
+{
+  ps.scene.meshes = &ps.meshes[0];
+  ps.scene.num_meshes = ps.meshes.size();
+  ps.scene.instances = &ps.instances[0];
+  ps.scene.num_instances = ps.instances.size();
+  for (int k = 0; k < 3; ++k) {
+    ps.bbox_min[k] = FLT_MAX;
+    ps.bbox_max[k] = -FLT_MAX;
+  }
+  for (size_t i = 0; i < ps.instances.size(); ++i) {
+    for (int k = 0; k < 3; ++k) {
+      ps.bbox_min[k] = std::min( ps.bbox_min[k], ps.instances[i].bbox_min[k] );
+      ps.bbox_max[k] = std::max( ps.bbox_max[k], ps.instances[i].bbox_max[k] );
+    }
+  }
+}
+
+// A flat grid of n x n unit cubes, one shared mesh instanced with gaps of half a cube, which makes for many 
+// short occluded rays and a large top level.
+void make_cube_grid( size_t n, ProceduralScene& ps )
+{
+  ps.name = "cubes";
+  const float corners[] = { 0,0,0, 1,0,0, 1,1,0, 0,1,0, 0,0,1, 1,0,1, 1,1,1, 0,1,1 };
+  const unsigned faces[] = { 0,2,1, 0,3,2,  4,5,6, 4,6,7,  0,1,5, 0,5,4,  3,7,6, 3,6,2,  0,4,7, 0,7,3,  1,2,6, 1,6,5 };
+  ps.vertices.assign( corners, corners + 24 );
+  ps.indices.assign( faces, faces + 36 );
+  finish_mesh( ps );
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t j = 0; j < n; ++j) {
+      add_instance( ps, 1.5f*i, 0.0f, 1.5f*j );
+    }
+  }
+  finish_scene( ps );
+}
+
+// Cheap value noise on the lattice of integer points, smoothly interpolated
+float lattice_value( int x, int y, int z )
+{
+  unsigned h = unsigned(x)*73856093u ^ unsigned(y)*19349663u ^ unsigned(z)*83492791u;
+  h = (h ^ (h >> 13))*1274126177u;
+  return float( h & 0xffff ) / 65535.0f * 2.0f - 1.0f;
+}
+
+float value_noise( float x, float y, float z )
+{
+  const int xi = int( std::floor( x ) ), yi = int( std::floor( y ) ), zi = int( std::floor( z ) );
+  float fx = x - xi, fy = y - yi, fz = z - zi;
+  fx = fx*fx*(3.0f - 2.0f*fx);
+  fy = fy*fy*(3.0f - 2.0f*fy);
+  fz = fz*fz*(3.0f - 2.0f*fz);
+  float v[2][2];
+  for (int a = 0; a < 2; ++a) {
+    for (int b = 0; b < 2; ++b) {
+      v[a][b] = lattice_value( xi+a, yi+b, zi )*(1.0f - fz) + lattice_value( xi+a, yi+b, zi+1 )*fz;
+    }
+  }
+  const float v0 = v[0][0]*(1.0f - fy) + v[0][1]*fy;
+  const float v1 = v[1][0]*(1.0f - fy) + v[1][1]*fy;
+  return v0*(1.0f - fx) + v1*fx;
+}
+
+// A UV sphere with n stacks and 2n slices, optionally displaced along the normal by a few octaves of noise.
+// The displaced version stands in for a dense scanned statue: lots of self occlusion in crevices.
+void make_sphere( size_t n, bool displace, ProceduralScene& ps )
+{
+  ps.name = displace ? "noise" : "sphere";
+  const unsigned stacks = unsigned( std::max( n, size_t(2) ) );
+  const unsigned slices = 2*stacks;
+  const float pi = 3.14159265358979f;
+  for (unsigned i = 0; i <= stacks; ++i) {
+    const float theta = pi*i / stacks;
+    for (unsigned j = 0; j <= slices; ++j) {
+      const float phi = 2.0f*pi*j / slices;
+      const float d[] = { std::sin( theta )*std::cos( phi ), std::cos( theta ), std::sin( theta )*std::sin( phi ) };
+      float r = 1.0f;
+      if ( displace ) {
+        float amplitude = 0.25f, frequency = 2.0f;
+        for (int octave = 0; octave < 5; ++octave) {
+          r += amplitude*value_noise( d[0]*frequency, d[1]*frequency, d[2]*frequency );
+          amplitude *= 0.5f;
+          frequency *= 2.0f;
+        }
+      }
+      for (int k = 0; k < 3; ++k) {
+        ps.vertices.push_back( r*d[k] );
+        ps.normals.push_back( d[k] );
+      }
+    }
+  }
+  for (unsigned i = 0; i < stacks; ++i) {
+    for (unsigned j = 0; j < slices; ++j) {
+      const unsigned a = i*(slices + 1) + j, b = a + slices + 1;
+      const unsigned tris[] = { a, a+1, b,  a+1, b+1, b };
+      ps.indices.insert( ps.indices.end(), tris, tris + 6 );
+    }
+  }
+  // Displaced normals are left as the sphere's, which is what a coarse normal map bake would see
+  finish_mesh( ps );
+  add_instance( ps, 0.0f, 0.0f, 0.0f );
+  finish_scene( ps );
+}
+
+bool make_scene( const std::string& name, size_t size, ProceduralScene& ps )
+{
+  if ( name == "cubes" )  { make_cube_grid( size, ps ); return true; }
+  if ( name == "sphere" ) { make_sphere( size, false, ps ); return true; }
+  if ( name == "noise" )  { make_sphere( size, true, ps ); return true; }
+  return false;
+}
+
+template <typename T>
+bool parse_list( const char* arg, std::vector<T>& values )
+{
+  values.clear();
+  std::stringstream ss( arg );
+  std::string item;
+  while ( std::getline( ss, item, ',' ) ) {
+    std::stringstream item_ss( item );
+    T value;
+    if ( !(item_ss >> value) ) return false;
+    values.push_back( value );
+  }
+  return !values.empty();
+}
+
+void print_usage_and_exit( const char* argv0 )
+{
+  std::cerr
+    << "Usage  : " << argv0 << " [options]\n"
+    << "        --scenes <cubes,sphere,noise>   Procedural scenes to bake (default all)\n"
+    << "        --size <n>                      Cubes per grid side, or sphere stacks (default 64 cubes, 512 stacks)\n"
+    << "        --rays <r0,r1,...>              Rays per sample to sweep (default 16,64,256)\n"
+    << "        --batch_sizes <b0,b1,...>       Batch sizes to sweep; 0 sizes from free device memory (default 0)\n"
+    << "        --contexts <gpu,cpu,session>    Prime context types to sweep (default gpu).  session bakes single mesh scenes\n"
+    << "                                        with bakeObjectAO, warm after a first untimed bake; build_ms is its time\n"
+    << "                                        outside the trace, and batch sizes don't apply\n"
+    << "        --samples_per_face <n>          Samples per triangle (default 3)\n"
+    << "        --passes_per_query <n>          Ray passes per query (default: raytracer default)\n"
+    << "        --devices <d0,d1,...>           CUDA devices to trace on (default all visible devices)\n"
+    << "  -o  | --outfile <file.csv>            Write results here instead of stdout\n"
+    << std::endl;
+  exit( 1 );
+}
+
+} // end namespace
+
+
+int main( int argc, char** argv )
+{
+  std::vector<std::string> scene_names;
+  scene_names.push_back( "cubes" );
+  scene_names.push_back( "sphere" );
+  scene_names.push_back( "noise" );
+  int size = 0;
+  std::vector<int> rays;
+  rays.push_back( 16 );
+  rays.push_back( 64 );
+  rays.push_back( 256 );
+  std::vector<size_t> batch_sizes( 1, 0 );
+  std::vector<std::string> contexts( 1, "gpu" );
+  int samples_per_face = 3;
+  int passes_per_query = 0;
+  std::vector<int> devices;
+  std::string output_filename;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg( argv[i] );
+    bool ok = true;
+    if ( arg == "--scenes" && i+1 < argc )                ok = parse_list( argv[++i], scene_names );
+    else if ( arg == "--size" && i+1 < argc )             ok = sscanf( argv[++i], "%d", &size ) == 1 && size > 0;
+    else if ( arg == "--rays" && i+1 < argc )             ok = parse_list( argv[++i], rays );
+    else if ( arg == "--batch_sizes" && i+1 < argc )      ok = parse_list( argv[++i], batch_sizes );
+    else if ( arg == "--contexts" && i+1 < argc )         ok = parse_list( argv[++i], contexts );
+    else if ( arg == "--samples_per_face" && i+1 < argc ) ok = sscanf( argv[++i], "%d", &samples_per_face ) == 1 && samples_per_face >= 0;
+    else if ( arg == "--passes_per_query" && i+1 < argc ) ok = sscanf( argv[++i], "%d", &passes_per_query ) == 1 && passes_per_query > 0;
+    else if ( arg == "--devices" && i+1 < argc )          ok = parse_list( argv[++i], devices );
+    else if ( (arg == "-o" || arg == "--outfile") && i+1 < argc ) output_filename = argv[++i];
+    else print_usage_and_exit( argv[0] );
+    if ( !ok ) {
+      std::cerr << "Bad value for " << arg << ": " << argv[i] << std::endl;
+      print_usage_and_exit( argv[0] );
+    }
+  }
+
+  std::ofstream file;
+  if ( !output_filename.empty() ) {
+    file.open( output_filename.c_str() );
+    if ( !file ) {
+      std::cerr << "Failed to open " << output_filename << std::endl;
+      return 1;
+    }
+  }
+  std::ostream& out = output_filename.empty() ? std::cout : file;
+
+  // Pay for CUDA initialization before anything is timed
+  cudaFree( 0 );
+
+  out << "scene,triangles,instances,context,rays_per_sample,batch_size,samples,rays,"
+      << "build_ms,trace_ms,raygen_ms,query_ms,update_ao_ms,copy_ao_ms,mrays_per_s,device_memory_mb,peak_rss_mb" << std::endl;
+
+  for (size_t s = 0; s < scene_names.size(); ++s) {
+    ProceduralScene ps;
+    const size_t scene_size = size > 0 ? size_t( size ) : ( scene_names[s] == "cubes" ? 64 : 512 );
+    if ( !make_scene( scene_names[s], scene_size, ps ) ) {
+      std::cerr << "Unknown scene: " << scene_names[s] << std::endl;
+      return 1;
+    }
+    const bake::Scene& scene = ps.scene;
+    size_t num_triangles = 0;
+    for (size_t i = 0; i < scene.num_instances; ++i) num_triangles += scene.meshes[scene.instances[i].mesh_index].num_triangles;
+
+    // One host sample set per scene, shared by all runs
+    std::vector<size_t> num_samples_per_instance( scene.num_instances );
+    const size_t num_samples = bake::distributeSamples( scene, samples_per_face, 0, &num_samples_per_instance[0] );
+    std::vector<float> positions( 3*num_samples ), normals( 3*num_samples ), face_normals( 3*num_samples );
+    std::vector<bake::SampleInfo> infos( num_samples );
+    bake::AOSamples ao_samples = bake::AOSamples();
+    ao_samples.num_samples = num_samples;
+    ao_samples.sample_positions = &positions[0];
+    ao_samples.sample_normals = &normals[0];
+    ao_samples.sample_face_normals = &face_normals[0];
+    ao_samples.sample_infos = &infos[0];
+    bake::sampleInstances( scene, &num_samples_per_instance[0], samples_per_face, ao_samples );
+    std::vector<float> ao_values( num_samples );
+
+    const float scene_scale = std::max( std::max( ps.bbox_max[0] - ps.bbox_min[0], ps.bbox_max[1] - ps.bbox_min[1] ), ps.bbox_max[2] - ps.bbox_min[2] );
+    const float scene_offset = scene_scale*SCENE_OFFSET_SCALE;
+    const float scene_maxdistance = scene_scale*SCENE_MAXDISTANCE_SCALE;
+
+    for (size_t c = 0; c < contexts.size(); ++c) {
+      if ( contexts[c] == "session" ) {
+        if ( scene.num_instances != 1 ) {
+          std::cerr << "Skipping session runs of " << ps.name << ", which has more than one instance" << std::endl;
+          continue;
+        }
+        const bake::Mesh& mesh = scene.meshes[0];
+        bake::ObjectBakeSession* session = bake::createObjectBakeSession( devices.empty() ? 0 : devices[0] );
+        float* vertex_ao = static_cast<float*>( bake::allocateHostMemory( mesh.num_vertices*sizeof(float) ) );
+        bake::bakeObjectAO( session, mesh, samples_per_face, rays[0], scene_offset, scene_maxdistance, vertex_ao, bake::MEMORY_SPACE_HOST );
+        for (size_t r = 0; r < rays.size(); ++r) {
+          resetMetrics();
+          bake::bakeObjectAO( session, mesh, samples_per_face, rays[r], scene_offset, scene_maxdistance, vertex_ao, bake::MEMORY_SPACE_HOST );
+          recordMemoryUsage();
+
+          const double bake_s = metricTime( "ao.object_bake" );
+          const double trace_s = metricTime( "ao.trace" );
+          const uint64_t num_rays = metricCount( "ao.rays" );
+          out << ps.name << "," << num_triangles << "," << scene.num_instances << "," << contexts[c] << ","
+              << rays[r] << ",0," << num_samples << "," << num_rays << ","
+              << std::fixed << std::setprecision( 3 )
+              << std::max( bake_s - trace_s, 0.0 )*1000.0 << "," << trace_s*1000.0 << ","
+              << metricTime( "ao.raygen" )*1000.0 << "," << metricTime( "ao.query" )*1000.0 << ","
+              << metricTime( "ao.update_ao" )*1000.0 << "," << metricTime( "ao.copy_ao" )*1000.0 << ","
+              << ( trace_s > 0.0 ? double( num_rays ) / trace_s * 1.0e-6 : 0.0 ) << ","
+              << metricGaugeMax( "device.memory_used_bytes" ) / (1024.0*1024.0) << ","
+              << metricGaugeMax( "host.peak_rss_bytes" ) / (1024.0*1024.0) << std::endl;
+          out.unsetf( std::ios::floatfield );
+        }
+        bake::freeHostMemory( vertex_ao );
+        bake::destroyObjectBakeSession( session );
+        continue;
+      }
+      const bool cpu_mode = contexts[c] == "cpu";
+      resetMetrics();
+      Timer build_timer;
+      build_timer.start();
+      bake::AOContext* context = bake::createAOContext( scene, cpu_mode, false, devices.empty() ? NULL : &devices[0], devices.size() );
+      build_timer.stop();
+
+      for (size_t r = 0; r < rays.size(); ++r) {
+        for (size_t b = 0; b < batch_sizes.size(); ++b) {
+          resetMetrics();
+          bake::computeAO( context, scene, ao_samples, rays[r], scene_offset, scene_maxdistance, batch_sizes[b], passes_per_query, 0.0f, &ao_values[0] );
+          recordMemoryUsage();
+
+          const double trace_s = metricTime( "ao.trace" );
+          const uint64_t num_rays = metricCount( "ao.rays" );
+          out << ps.name << "," << num_triangles << "," << scene.num_instances << "," << contexts[c] << ","
+              << rays[r] << "," << batch_sizes[b] << "," << num_samples << "," << num_rays << ","
+              << std::fixed << std::setprecision( 3 )
+              << build_timer.elapsed*1000.0 << "," << trace_s*1000.0 << ","
+              << metricTime( "ao.raygen" )*1000.0 << "," << metricTime( "ao.query" )*1000.0 << ","
+              << metricTime( "ao.update_ao" )*1000.0 << "," << metricTime( "ao.copy_ao" )*1000.0 << ","
+              << ( trace_s > 0.0 ? double( num_rays ) / trace_s * 1.0e-6 : 0.0 ) << ","
+              << metricGaugeMax( "device.memory_used_bytes" ) / (1024.0*1024.0) << ","
+              << metricGaugeMax( "host.peak_rss_bytes" ) / (1024.0*1024.0) << std::endl;
+          out.unsetf( std::ios::floatfield );
+        }
+      }
+      bake::destroyAOContext( context );
+    }
+  }
+  return 0;
+}
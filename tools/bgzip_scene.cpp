@@ -0,0 +1,50 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+// Converts a scene file (.csf, .bk3d, or their plain .gz versions) into a
+// block compressed .gz that the scene loaders inflate in parallel. The output
+// is still a valid gzip file for other tools.
+
+#include "../loaders/block_gzip.h"
+
+#include <cstdlib>
+#include <iostream>
+
+int main(int argc, char** argv)
+{
+  if (argc < 3 || argc > 4) {
+    std::cerr << "Usage: " << argv[0] << " <input> <output.gz> [level 1-9]" << std::endl;
+    return 1;
+  }
+  const int level = argc == 4 ? atoi(argv[3]) : 6;
+  if (level < 1 || level > 9) {
+    std::cerr << "Compression level must be between 1 and 9" << std::endl;
+    return 1;
+  }
+
+  if (!write_block_gzip(argv[1], argv[2], level)) {
+    std::cerr << "Failed to convert " << argv[1] << std::endl;
+    return 1;
+  }
+  return 0;
+}
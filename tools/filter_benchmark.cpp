@@ -0,0 +1,414 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+// Vertex filter benchmark on generated meshes with synthetic samples, so filter changes can be measured without
+// tracing.  Sweeps mesh size, sample density, filter mode and least squares solver, and writes one CSV row per
+// run with the time of each filter phase, the nonzeros of the system and its factor, and memory.
+
+#include "../bake_api.h"
+#include "../bake_util.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+// A generated mesh and its synthetic samples and AO
+struct SyntheticMesh {
+  std::string name;
+  std::vector<float>    vertices;
+  std::vector<float>    normals;
+  std::vector<unsigned> indices;
+  bake::Mesh     mesh;
+  bake::Instance instance;
+  bake::Scene    scene;
+  std::vector<bake::SampleInfo> infos;
+  std::vector<float> ao_values;
+};
+
+// Uniform in [0, 1) from a few integers
+float hash_float( unsigned a, unsigned b, unsigned c = 0 )
+{
+  unsigned h = a*73856093u ^ b*19349663u ^ c*83492791u;
+  h = (h ^ (h >> 13))*1274126177u;
+  h ^= h >> 16;
+  return float( h & 0xffffff ) / float( 0x1000000 );
+}
+
+// One instance of the mesh over the vertex and index arrays
+void finish_mesh( SyntheticMesh& sm )
+{
+  bake::Mesh& mesh = sm.mesh;
+  mesh.num_vertices = sm.vertices.size() / 3;
+  mesh.vertices = &sm.vertices[0];
+  mesh.vertex_stride_bytes = 0;
+  mesh.normals = &sm.normals[0];
+  mesh.normal_stride_bytes = 0;
+  mesh.texcoords = NULL;
+  mesh.texcoord_stride_bytes = 0;
+  mesh.geometry_memory = bake::MEMORY_SPACE_HOST;
+  mesh.num_triangles = sm.indices.size() / 3;
+  mesh.tri_vertex_indices = &sm.indices[0];
+  for (int k = 0; k < 3; ++k) {
+    mesh.bbox_min[k] = FLT_MAX;
+    mesh.bbox_max[k] = -FLT_MAX;
+  }
+  for (size_t i = 0; i < mesh.num_vertices; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      mesh.bbox_min[k] = std::min( mesh.bbox_min[k], sm.vertices[3*i+k] );
+      mesh.bbox_max[k] = std::max( mesh.bbox_max[k], sm.vertices[3*i+k] );
+    }
+  }
+  bake::Instance& instance = sm.instance;
+  std::fill( instance.xform, instance.xform + 16, 0.0f );
+  instance.xform[0] = instance.xform[5] = instance.xform[10] = instance.xform[15] = 1.0f;
+  instance.storage_identifier = 0;
+  instance.mesh_index = 0;
+  std::copy( mesh.bbox_min, mesh.bbox_min + 3, instance.bbox_min );
+  std::copy( mesh.bbox_max, mesh.bbox_max + 3, instance.bbox_max );
+  sm.scene.meshes = &sm.mesh;
+  sm.scene.num_meshes = 1;
+  sm.scene.instances = &sm.instance;
+  sm.scene.num_instances = 1;
+}
+
+// A flat square of about num_vertices vertices in a regular grid
+void make_grid( size_t num_vertices, SyntheticMesh& sm )
+{
+  sm.name = "grid";
+  const unsigned side = unsigned( std::max( std::sqrt( double( num_vertices ) ), 2.0 ) );
+  for (unsigned i = 0; i < side; ++i) {
+    for (unsigned j = 0; j < side; ++j) {
+      const float v[] = { float( i ) / (side - 1), 0.0f, float( j ) / (side - 1) };
+      const float n[] = { 0.0f, 1.0f, 0.0f };
+      sm.vertices.insert( sm.vertices.end(), v, v + 3 );
+      sm.normals.insert( sm.normals.end(), n, n + 3 );
+    }
+  }
+  for (unsigned i = 0; i + 1 < side; ++i) {
+    for (unsigned j = 0; j + 1 < side; ++j) {
+      const unsigned a = i*side + j, b = a + side;
+      const unsigned tris[] = { a, a+1, b,  a+1, b+1, b };
+      sm.indices.insert( sm.indices.end(), tris, tris + 6 );
+    }
+  }
+  finish_mesh( sm );
+}
+
+// A UV sphere of about num_vertices vertices.  The scan version has every vertex pushed along its normal by up to
+// a few percent at random, like the noise of a dense 3D scan, which gives badly shaped triangles and a rough signal.
+void make_sphere( size_t num_vertices, bool scan, SyntheticMesh& sm )
+{
+  sm.name = scan ? "scan" : "sphere";
+  const unsigned stacks = unsigned( std::max( std::sqrt( double( num_vertices ) / 2.0 ), 2.0 ) );
+  const unsigned slices = 2*stacks;
+  const float pi = 3.14159265358979f;
+  for (unsigned i = 0; i <= stacks; ++i) {
+    const float theta = pi*i / stacks;
+    for (unsigned j = 0; j <= slices; ++j) {
+      const float phi = 2.0f*pi*j / slices;
+      const float d[] = { std::sin( theta )*std::cos( phi ), std::cos( theta ), std::sin( theta )*std::sin( phi ) };
+      const float r = scan ? 1.0f + 0.03f*(hash_float( i, j ) - 0.5f) : 1.0f;
+      for (int k = 0; k < 3; ++k) {
+        sm.vertices.push_back( r*d[k] );
+        sm.normals.push_back( d[k] );
+      }
+    }
+  }
+  for (unsigned i = 0; i < stacks; ++i) {
+    for (unsigned j = 0; j < slices; ++j) {
+      const unsigned a = i*(slices + 1) + j, b = a + slices + 1;
+      const unsigned tris[] = { a, a+1, b,  a+1, b+1, b };
+      sm.indices.insert( sm.indices.end(), tris, tris + 6 );
+    }
+  }
+  finish_mesh( sm );
+}
+
+bool make_mesh( const std::string& name, size_t num_vertices, SyntheticMesh& sm )
+{
+  if ( name == "grid" )   { make_grid( num_vertices, sm ); return true; }
+  if ( name == "sphere" ) { make_sphere( num_vertices, false, sm ); return true; }
+  if ( name == "scan" )   { make_sphere( num_vertices, true, sm ); return true; }
+  return false;
+}
+
+// Samples at random points of each triangle, samples_per_triangle on average, in triangle order like
+// sampleInstances places them, with AO of a smooth pattern plus noise, as a trace with few rays gives
+void make_samples( float samples_per_triangle, SyntheticMesh& sm )
+{
+  const bake::Mesh& mesh = sm.mesh;
+  const size_t whole = size_t( samples_per_triangle );
+  const float fraction = samples_per_triangle - float( whole );
+  sm.infos.clear();
+  sm.ao_values.clear();
+  for (size_t t = 0; t < mesh.num_triangles; ++t) {
+    const unsigned* tri = &sm.indices[3*t];
+    const float* v0 = &sm.vertices[3*tri[0]];
+    const float* v1 = &sm.vertices[3*tri[1]];
+    const float* v2 = &sm.vertices[3*tri[2]];
+    const float e1[] = { v1[0] - v0[0], v1[1] - v0[1], v1[2] - v0[2] };
+    const float e2[] = { v2[0] - v0[0], v2[1] - v0[1], v2[2] - v0[2] };
+    const float c[] = { e1[1]*e2[2] - e1[2]*e2[1], e1[2]*e2[0] - e1[0]*e2[2], e1[0]*e2[1] - e1[1]*e2[0] };
+    const float area = 0.5f*std::sqrt( c[0]*c[0] + c[1]*c[1] + c[2]*c[2] );
+    const size_t n = std::max( whole + (hash_float( unsigned( t ), 1 ) < fraction ? 1 : 0 ), size_t(1) );
+    for (size_t k = 0; k < n; ++k) {
+      float u = hash_float( unsigned( t ), unsigned( k ), 2 ), v = hash_float( unsigned( t ), unsigned( k ), 3 );
+      if ( u + v > 1.0f ) {
+        u = 1.0f - u;
+        v = 1.0f - v;
+      }
+      bake::SampleInfo info;
+      info.tri_idx = unsigned( t );
+      info.bary[0] = 1.0f - u - v;
+      info.bary[1] = u;
+      info.bary[2] = v;
+      info.dA = area / float( n );
+      sm.infos.push_back( info );
+      float p[3];
+      for (int a = 0; a < 3; ++a) p[a] = info.bary[0]*v0[a] + info.bary[1]*v1[a] + info.bary[2]*v2[a];
+      const float smooth = 0.5f + 0.4f*std::sin( 7.0f*p[0] )*std::cos( 5.0f*p[1] + 3.0f*p[2] );
+      const float noise = 0.2f*(hash_float( unsigned( t ), unsigned( k ), 4 ) - 0.5f);
+      sm.ao_values.push_back( std::min( std::max( smooth + noise, 0.0f ), 1.0f ) );
+    }
+  }
+}
+
+bool parse_filter( const std::string& name, bake::VertexFilterMode& mode )
+{
+  if ( name == "area" )               mode = bake::VERTEX_FILTER_AREA_BASED;
+  else if ( name == "least_squares" ) mode = bake::VERTEX_FILTER_LEAST_SQUARES;
+  else if ( name == "float" )         mode = bake::VERTEX_FILTER_LEAST_SQUARES_FLOAT;
+  else if ( name == "cg" )            mode = bake::VERTEX_FILTER_LEAST_SQUARES_CG;
+  else if ( name == "matrix_free" )   mode = bake::VERTEX_FILTER_LEAST_SQUARES_MATRIX_FREE;
+  else if ( name == "host_cg" )       mode = bake::VERTEX_FILTER_LEAST_SQUARES_HOST_CG;
+  else return false;
+  return true;
+}
+
+bool parse_solver( const std::string& name, bake::LeastSquaresSolver& solver )
+{
+  if ( name == "simplicial" )   solver = bake::LEAST_SQUARES_SOLVER_SIMPLICIAL;
+  else if ( name == "cholmod" ) solver = bake::LEAST_SQUARES_SOLVER_CHOLMOD;
+  else if ( name == "pardiso" ) solver = bake::LEAST_SQUARES_SOLVER_PARDISO;
+  else return false;
+  return true;
+}
+
+template <typename T>
+bool parse_list( const char* arg, std::vector<T>& values )
+{
+  values.clear();
+  std::stringstream ss( arg );
+  std::string item;
+  while ( std::getline( ss, item, ',' ) ) {
+    std::stringstream item_ss( item );
+    T value;
+    if ( !(item_ss >> value) ) return false;
+    values.push_back( value );
+  }
+  return !values.empty();
+}
+
+void print_usage_and_exit( const char* argv0 )
+{
+  std::cerr
+    << "Usage  : " << argv0 << " [options]\n"
+    << "        --meshes <grid,sphere,scan>     Generated meshes to filter (default all)\n"
+    << "        --vertices <v0,v1,...>          Approximate vertex counts to sweep (default 10000,100000,1000000)\n"
+    << "        --densities <d0,d1,...>         Average samples per triangle to sweep (default 3)\n"
+    << "        --filters <f0,f1,...>           Filter modes to sweep: area, least_squares, float, cg, matrix_free,\n"
+    << "                                        host_cg (default area,least_squares)\n"
+    << "        --solvers <s0,s1,...>           Least squares solvers to sweep in least_squares mode: simplicial, cholmod,\n"
+    << "                                        pardiso (default all available)\n"
+    << "        --regularization_weight <w>     Regularization weight for least squares (default 0.1)\n"
+    << "        --analytic_mass <w>             Blend of the analytic mass matrix, 0-1 (default 0)\n"
+    << "        --patch_vertices <n>            Filter larger meshes by patches of about n vertices (default 0, whole meshes)\n"
+    << "        --repeat <n>                    Runs of each configuration (default 1)\n"
+    << "  -o  | --outfile <file.csv>            Write results here instead of stdout\n"
+    << std::endl;
+  exit( 1 );
+}
+
+} // end namespace
+
+
+int main( int argc, char** argv )
+{
+  std::vector<std::string> mesh_names;
+  mesh_names.push_back( "grid" );
+  mesh_names.push_back( "sphere" );
+  mesh_names.push_back( "scan" );
+  std::vector<size_t> vertex_counts;
+  vertex_counts.push_back( 10000 );
+  vertex_counts.push_back( 100000 );
+  vertex_counts.push_back( 1000000 );
+  std::vector<float> densities( 1, 3.0f );
+  std::vector<std::string> filter_names;
+  filter_names.push_back( "area" );
+  filter_names.push_back( "least_squares" );
+  std::vector<std::string> solver_names;
+  float regularization_weight = 0.1f;
+  float analytic_mass_weight = 0.0f;
+  int patch_vertices = 0;
+  int repeat = 1;
+  std::string output_filename;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg( argv[i] );
+    bool ok = true;
+    if ( arg == "--meshes" && i+1 < argc )                     ok = parse_list( argv[++i], mesh_names );
+    else if ( arg == "--vertices" && i+1 < argc )              ok = parse_list( argv[++i], vertex_counts );
+    else if ( arg == "--densities" && i+1 < argc )             ok = parse_list( argv[++i], densities );
+    else if ( arg == "--filters" && i+1 < argc )               ok = parse_list( argv[++i], filter_names );
+    else if ( arg == "--solvers" && i+1 < argc )               ok = parse_list( argv[++i], solver_names );
+    else if ( arg == "--regularization_weight" && i+1 < argc ) ok = sscanf( argv[++i], "%f", &regularization_weight ) == 1 && regularization_weight >= 0.0f;
+    else if ( arg == "--analytic_mass" && i+1 < argc )         ok = sscanf( argv[++i], "%f", &analytic_mass_weight ) == 1 &&
+                                                                    analytic_mass_weight >= 0.0f && analytic_mass_weight <= 1.0f;
+    else if ( arg == "--patch_vertices" && i+1 < argc )        ok = sscanf( argv[++i], "%d", &patch_vertices ) == 1 && patch_vertices >= 0;
+    else if ( arg == "--repeat" && i+1 < argc )                ok = sscanf( argv[++i], "%d", &repeat ) == 1 && repeat > 0;
+    else if ( (arg == "-o" || arg == "--outfile") && i+1 < argc ) output_filename = argv[++i];
+    else print_usage_and_exit( argv[0] );
+    if ( !ok ) {
+      std::cerr << "Bad value for " << arg << ": " << argv[i] << std::endl;
+      print_usage_and_exit( argv[0] );
+    }
+  }
+
+  std::vector<bake::VertexFilterMode> filters( filter_names.size() );
+  for (size_t f = 0; f < filter_names.size(); ++f) {
+    if ( !parse_filter( filter_names[f], filters[f] ) ) {
+      std::cerr << "Unknown filter: " << filter_names[f] << std::endl;
+      return 1;
+    }
+  }
+  for (size_t d = 0; d < densities.size(); ++d) {
+    if ( !(densities[d] > 0.0f) ) {
+      std::cerr << "Sample densities must be positive" << std::endl;
+      return 1;
+    }
+  }
+  std::vector<bake::LeastSquaresSolver> solvers;
+  if ( solver_names.empty() ) {
+    const char* all[] = { "simplicial", "cholmod", "pardiso" };
+    for (int k = 0; k < 3; ++k) {
+      bake::LeastSquaresSolver solver;
+      parse_solver( all[k], solver );
+      if ( bake::leastSquaresSolverAvailable( solver ) ) {
+        solvers.push_back( solver );
+        solver_names.push_back( all[k] );
+      }
+    }
+  } else {
+    for (size_t s = 0; s < solver_names.size(); ++s) {
+      bake::LeastSquaresSolver solver;
+      if ( !parse_solver( solver_names[s], solver ) || !bake::leastSquaresSolverAvailable( solver ) ) {
+        std::cerr << "Solver not available in this build: " << solver_names[s] << std::endl;
+        return 1;
+      }
+      solvers.push_back( solver );
+    }
+  }
+
+  std::ofstream file;
+  if ( !output_filename.empty() ) {
+    file.open( output_filename.c_str() );
+    if ( !file ) {
+      std::cerr << "Failed to open " << output_filename << std::endl;
+      return 1;
+    }
+  }
+  std::ostream& out = output_filename.empty() ? std::cout : file;
+
+  out << "mesh,vertices,triangles,samples_per_triangle,samples,filter,solver,run,"
+      << "mass_ms,regularization_ms,analyze_ms,factorize_ms,solve_ms,total_ms,matrix_nnz,factor_nnz,fill_in,peak_rss_mb" << std::endl;
+
+  for (size_t m = 0; m < mesh_names.size(); ++m) {
+    for (size_t v = 0; v < vertex_counts.size(); ++v) {
+      SyntheticMesh sm;
+      if ( !make_mesh( mesh_names[m], vertex_counts[v], sm ) ) {
+        std::cerr << "Unknown mesh: " << mesh_names[m] << std::endl;
+        return 1;
+      }
+      std::vector<float> vertex_ao( sm.mesh.num_vertices );
+      float* vertex_ao_ptr = &vertex_ao[0];
+
+      for (size_t d = 0; d < densities.size(); ++d) {
+        make_samples( densities[d], sm );
+        bake::AOSamples ao_samples = bake::AOSamples();
+        ao_samples.num_samples = sm.infos.size();
+        ao_samples.sample_infos = &sm.infos[0];
+        ao_samples.sample_memory = bake::MEMORY_SPACE_HOST;
+        ao_samples.ao_memory = bake::MEMORY_SPACE_HOST;
+        const size_t num_samples = ao_samples.num_samples;
+
+        for (size_t f = 0; f < filters.size(); ++f) {
+          // The solver only matters for factorized least squares
+          const size_t num_solvers = filters[f] == bake::VERTEX_FILTER_LEAST_SQUARES ? solvers.size() : 1;
+          for (size_t s = 0; s < num_solvers; ++s) {
+            const bake::LeastSquaresSolver solver = filters[f] == bake::VERTEX_FILTER_LEAST_SQUARES ? solvers[s] :
+                                                    bake::LEAST_SQUARES_SOLVER_SIMPLICIAL;
+            for (int r = 0; r < repeat; ++r) {
+              resetMetrics();
+              Timer timer;
+              timer.start();
+              bake::mapAOToVertices( sm.scene, &num_samples, ao_samples, &sm.ao_values[0], filters[f], regularization_weight,
+                &vertex_ao_ptr, NULL, analytic_mass_weight, solver, size_t( patch_vertices ) );
+              timer.stop();
+              recordMemoryUsage();
+
+              // The area based filter has no phases, only the total
+              const uint64_t matrix_nnz = metricCount( "filter.least_squares.matrix_nonzeros" );
+              const uint64_t factor_nnz = metricCount( "filter.least_squares.factor_nonzeros" );
+              out << sm.name << "," << sm.mesh.num_vertices << "," << sm.mesh.num_triangles << "," << densities[d] << ","
+                  << num_samples << "," << filter_names[f] << ","
+                  << (filters[f] == bake::VERTEX_FILTER_LEAST_SQUARES ? solver_names[s] : std::string( "-" )) << "," << r << ","
+                  << std::fixed << std::setprecision( 3 )
+                  << metricTime( "filter.least_squares.mass_matrices" )*1000.0 << ","
+                  << metricTime( "filter.least_squares.regularization_matrices" )*1000.0 << ","
+                  << metricTime( "filter.least_squares.analyze" )*1000.0 << ","
+                  << metricTime( "filter.least_squares.decompose" )*1000.0 << ","
+                  << metricTime( "filter.least_squares.solve" )*1000.0 << ","
+                  << timer.elapsed*1000.0 << ","
+                  << matrix_nnz << "," << factor_nnz << ","
+                  << (factor_nnz > matrix_nnz ? factor_nnz - matrix_nnz : 0) << ","
+                  << metricGaugeMax( "host.peak_rss_bytes" ) / (1024.0*1024.0) << std::endl;
+              out.unsetf( std::ios::floatfield );
+            }
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
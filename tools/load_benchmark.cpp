@@ -0,0 +1,234 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+// Scene loader benchmark: loads each file given a number of times, with the file's pages dropped from the page
+// cache first (cold) or left there (warm), and writes one CSV row per load with the loader's phase times and
+// MB/s and triangles/s.  A plain sequential read of the file in the same cache state is timed too, as the
+// I/O bound the loader can be compared to.
+
+#include "../bake_api.h"
+#include "../bake_util.h"
+#include "../loaders/load_scene.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const size_t READ_CHUNK_BYTES = 4 << 20;
+
+// Drops the file's clean pages from the page cache, so the next access reads the disk.  Only where the platform
+// lets an unprivileged process do that.
+bool evict_file( const char* filename )
+{
+#if defined(_WIN32)
+  (void)filename;
+  return false;
+#else
+  const int fd = open( filename, O_RDONLY );
+  if ( fd < 0 ) return false;
+  fdatasync( fd );
+  const bool ok = posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED ) == 0;
+  close( fd );
+  return ok;
+#endif
+}
+
+// Reads the whole file in large chunks; the size in bytes, 0 on failure
+size_t read_file( const char* filename )
+{
+  FILE* file = fopen( filename, "rb" );
+  if ( !file ) return 0;
+  std::vector<char> buffer( READ_CHUNK_BYTES );
+  size_t total = 0, n = 0;
+  while ( (n = fread( &buffer[0], 1, buffer.size(), file )) > 0 ) total += n;
+  fclose( file );
+  return total;
+}
+
+// The format as load_scene picks it, by extension
+std::string scene_format( const std::string& filename )
+{
+  const char* extensions[] = { ".bk3d.gz", ".csf.gz", ".bk3d", ".csf", ".obj", ".ply", ".scenes" };
+  for (int k = 0; k < 7; ++k) {
+    const std::string extension( extensions[k] );
+    if ( filename.size() >= extension.size() && filename.compare( filename.size() - extension.size(), extension.size(), extension ) == 0 ) {
+      return extension.substr( 1 );
+    }
+  }
+  return "bk3d";
+}
+
+template <typename T>
+bool parse_list( const char* arg, std::vector<T>& values )
+{
+  values.clear();
+  std::stringstream ss( arg );
+  std::string item;
+  while ( std::getline( ss, item, ',' ) ) {
+    std::stringstream item_ss( item );
+    T value;
+    if ( !(item_ss >> value) ) return false;
+    values.push_back( value );
+  }
+  return !values.empty();
+}
+
+void print_usage_and_exit( const char* argv0 )
+{
+  std::cerr
+    << "Usage  : " << argv0 << " [options] <scene_file> [<scene_file> ...]\n"
+    << "        Scene files of any format load_scene reads: obj, ply, bk3d, bk3d.gz, csf, csf.gz, scenes\n"
+    << "        --cache <cold,warm>             Page cache states to sweep (default cold,warm).  Cold drops the file's\n"
+    << "                                        pages before each load; not available on Windows\n"
+    << "        --repeat <n>                    Loads of each file per cache state (default 3)\n"
+    << "        --obj_groups                    Keep OBJ groups as separate meshes\n"
+    << "  -o  | --outfile <file.csv>            Write results here instead of stdout\n"
+    << std::endl;
+  exit( 1 );
+}
+
+} // end namespace
+
+
+int main( int argc, char** argv )
+{
+  std::vector<std::string> filenames;
+  std::vector<std::string> cache_states;
+  cache_states.push_back( "cold" );
+  cache_states.push_back( "warm" );
+  int repeat = 3;
+  bool split_obj_groups = false;
+  std::string output_filename;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg( argv[i] );
+    bool ok = true;
+    if ( arg == "--cache" && i+1 < argc )                         ok = parse_list( argv[++i], cache_states );
+    else if ( arg == "--repeat" && i+1 < argc )                   ok = sscanf( argv[++i], "%d", &repeat ) == 1 && repeat > 0;
+    else if ( arg == "--obj_groups" )                             split_obj_groups = true;
+    else if ( (arg == "-o" || arg == "--outfile") && i+1 < argc ) output_filename = argv[++i];
+    else if ( !arg.empty() && arg[0] != '-' )                     filenames.push_back( arg );
+    else print_usage_and_exit( argv[0] );
+    if ( !ok ) {
+      std::cerr << "Bad value for " << arg << ": " << argv[i] << std::endl;
+      print_usage_and_exit( argv[0] );
+    }
+  }
+  if ( filenames.empty() ) print_usage_and_exit( argv[0] );
+  for (size_t c = 0; c < cache_states.size(); ++c) {
+    if ( cache_states[c] != "cold" && cache_states[c] != "warm" ) {
+      std::cerr << "Unknown cache state: " << cache_states[c] << std::endl;
+      return 1;
+    }
+  }
+
+  std::ofstream file;
+  if ( !output_filename.empty() ) {
+    file.open( output_filename.c_str() );
+    if ( !file ) {
+      std::cerr << "Failed to open " << output_filename << std::endl;
+      return 1;
+    }
+  }
+  std::ostream& out = output_filename.empty() ? std::cout : file;
+
+  out << "file,format,cache,run,file_mb,meshes,instances,vertices,triangles,read_ms,read_mb_per_s,"
+      << "load_ms,inflate_ms,relocate_ms,parse_ms,bbox_ms,other_ms,mb_per_s,mtriangles_per_s,peak_rss_mb" << std::endl;
+
+  for (size_t f = 0; f < filenames.size(); ++f) {
+    const char* filename = filenames[f].c_str();
+    for (size_t c = 0; c < cache_states.size(); ++c) {
+      const bool cold = cache_states[c] == "cold";
+      if ( cold && !evict_file( filename ) ) {
+        std::cerr << "Can't drop " << filename << " from the page cache here; skipping cold loads" << std::endl;
+        continue;
+      }
+      // A warm run starts from a read of its own, so the first one is warm too
+      if ( !cold ) read_file( filename );
+
+      for (int r = 0; r < repeat; ++r) {
+        if ( cold ) evict_file( filename );
+        Timer read_timer;
+        read_timer.start();
+        const size_t file_bytes = read_file( filename );
+        read_timer.stop();
+        if ( file_bytes == 0 ) {
+          std::cerr << "Failed to read " << filename << std::endl;
+          return 1;
+        }
+        if ( cold ) evict_file( filename );
+
+        resetMetrics();
+        bake::Scene scene;
+        float bbox_min[3], bbox_max[3];
+        SceneMemory* memory = NULL;
+        Timer load_timer;
+        load_timer.start();
+        const bool loaded = load_scene( filename, scene, bbox_min, bbox_max, memory, 1, split_obj_groups );
+        load_timer.stop();
+        recordMemoryUsage();
+        if ( !loaded ) {
+          std::cerr << "Failed to load " << filename << std::endl;
+          return 1;
+        }
+
+        const double file_mb = double( file_bytes ) / (1024.0*1024.0);
+        const double load_s = load_timer.elapsed;
+        const uint64_t num_triangles = metricCount( "load.triangles" );
+        const double inflate_s = metricTime( "load.inflate" );
+        const double relocate_s = metricTime( "load.relocate" );
+        const double parse_s = metricTime( "load.parse" );
+        const double bbox_s = metricTime( "load.bbox" );
+        out << filenames[f] << "," << scene_format( filenames[f] ) << "," << cache_states[c] << "," << r << ","
+            << std::fixed << std::setprecision( 3 ) << file_mb << ","
+            << metricCount( "load.meshes" ) << "," << metricCount( "load.instances" ) << ","
+            << metricCount( "load.vertices" ) << "," << num_triangles << ","
+            << read_timer.elapsed*1000.0 << "," << (read_timer.elapsed > 0.0 ? file_mb / read_timer.elapsed : 0.0) << ","
+            << load_s*1000.0 << "," << inflate_s*1000.0 << "," << relocate_s*1000.0 << ","
+            << parse_s*1000.0 << "," << bbox_s*1000.0 << ","
+            << std::max( load_s - inflate_s - relocate_s - parse_s - bbox_s, 0.0 )*1000.0 << ","
+            << (load_s > 0.0 ? file_mb / load_s : 0.0) << ","
+            << (load_s > 0.0 ? double( num_triangles ) / load_s * 1.0e-6 : 0.0) << ","
+            << metricGaugeMax( "host.peak_rss_bytes" ) / (1024.0*1024.0) << std::endl;
+        out.unsetf( std::ios::floatfield );
+
+        delete memory;
+      }
+    }
+  }
+  return 0;
+}
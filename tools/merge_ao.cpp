@@ -0,0 +1,80 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse 
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+// Joins the vertex AO files of a partitioned bake (bake_cli --partition r,n -o out writes out.r) into one
+// file, as if all instances were baked in one process.  With --overlay, puts the instances of a region of
+// interest bake (bake_cli --roi_bbox / --roi_ids) into an earlier full bake.  --diff writes a patch of the
+// instances of a rebake that changed against a raw base file, and --apply overwrites them in the base in place.
+
+#include "../bake_ao_file.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+int main(int argc, char** argv)
+{
+  if (argc == 5 && std::string(argv[1]) == "--overlay") {
+    size_t num_replaced = 0;
+    if (!bake::overlayVertexAOFiles(argv[2], argv[3], argv[4], &num_replaced)) {
+      std::cerr << "Failed to overlay " << argv[4] << " on " << argv[3] << " into " << argv[2] << std::endl;
+      return 1;
+    }
+    std::cerr << "Replaced " << num_replaced << " instances" << std::endl;
+    return 0;
+  }
+  if (argc == 5 && std::string(argv[1]) == "--diff") {
+    size_t num_changed = 0;
+    if (!bake::diffVertexAOFiles(argv[2], argv[3], argv[4], &num_changed)) {
+      std::cerr << "Failed to diff " << argv[4] << " against " << argv[3] << " into " << argv[2] << std::endl;
+      return 1;
+    }
+    std::cerr << "Patched " << num_changed << " changed instances" << std::endl;
+    return 0;
+  }
+  if (argc >= 4 && std::string(argv[1]) == "--apply") {
+    for (int k = 3; k < argc; ++k) {
+      size_t num_applied = 0;
+      if (!bake::applyVertexAOPatch(argv[2], argv[k], &num_applied)) {
+        std::cerr << "Failed to apply " << argv[k] << " to " << argv[2] << std::endl;
+        return 1;
+      }
+      std::cerr << "Applied " << num_applied << " instances from " << argv[k] << std::endl;
+    }
+    return 0;
+  }
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " <output> <partition 0> [<partition 1> ...]\n"
+              << "       " << argv[0] << " --overlay <output> <full bake> <region of interest bake>\n"
+              << "       " << argv[0] << " --diff <patch> <raw base> <rebake>\n"
+              << "       " << argv[0] << " --apply <raw base> <patch> [<patch> ...]" << std::endl;
+    return 1;
+  }
+
+  const std::vector<const char*> inputs(argv + 2, argv + argc);
+  if (!bake::mergeVertexAOFiles(argv[1], &inputs[0], inputs.size())) {
+    std::cerr << "Failed to merge into " << argv[1] << std::endl;
+    return 1;
+  }
+  return 0;
+}
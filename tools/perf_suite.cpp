@@ -0,0 +1,626 @@
+/*-----------------------------------------------------------------------
+  Copyright (c) 2015-2016, NVIDIA. All rights reserved.
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Neither the name of its contributors may be used to endorse
+     or promote products derived from this software without specific
+     prior written permission.
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+  OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------*/
+
+// Performance regression suite: bakes each run of a suite file with the command line baker, whole pipeline from
+// load to save, reads the metrics it saves with --stats, and compares stage times, rays/s and memory high water
+// marks against a baseline JSON, within tolerances.  Prints one table per run and exits with 1 if anything
+// regressed or a run failed.  With --update the results become the new baseline instead.
+//
+// Suite lines are "<name> <options...>", options as given to the baker, where $ASSETS and $WORK stand for those
+// directories and @cubes:<n> or @noise:<n> for a generated scene, written as binary PLY to the work directory once.
+// Sampling and ray directions are deterministic, so runs of the same options bake the same rays.
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef std::map<std::string, double> Values;
+
+// Default tolerances; a baseline can override them, and each metric can have its own
+struct Tolerances {
+  double time;       // relative, for time.* metrics
+  double time_ms;    // absolute slack, so that stages of a few ms don't flap
+  double rate;       // relative, for rays_per_s
+  double memory;     // relative, for memory.* metrics
+  double memory_mb;  // absolute slack
+  Tolerances() : time( 0.15 ), time_ms( 20.0 ), rate( 0.10 ), memory( 0.10 ), memory_mb( 32.0 ) {}
+};
+
+struct Baseline {
+  Tolerances tolerances;
+  std::map<std::string, Values> runs;
+  std::map<std::string, Values> metric_tolerances;  // per run, relative
+};
+
+struct Run {
+  std::string name;
+  std::vector<std::string> options;
+};
+
+// Minimal reader for the JSON that saveMetrics and this tool write: numbers are kept under their path of member
+// names joined by '/', everything else is checked for syntax and skipped.
+class JsonReader {
+public:
+  JsonReader( const std::string& text, Values& values ) : m_text( text ), m_pos( 0 ), m_values( values ) {}
+
+  bool read() {
+    if ( !value( "" ) ) return false;
+    skipSpace();
+    return m_pos == m_text.size();
+  }
+
+private:
+  void skipSpace() {
+    while ( m_pos < m_text.size() && std::isspace( (unsigned char)m_text[m_pos] ) ) ++m_pos;
+  }
+
+  bool expect( char c ) {
+    skipSpace();
+    if ( m_pos >= m_text.size() || m_text[m_pos] != c ) return false;
+    ++m_pos;
+    return true;
+  }
+
+  bool string( std::string& s ) {
+    if ( !expect( '"' ) ) return false;
+    s.clear();
+    while ( m_pos < m_text.size() && m_text[m_pos] != '"' ) {
+      if ( m_text[m_pos] == '\\' && m_pos + 1 < m_text.size() ) ++m_pos;
+      s += m_text[m_pos++];
+    }
+    return expect( '"' );
+  }
+
+  bool value( const std::string& path ) {
+    skipSpace();
+    if ( m_pos >= m_text.size() ) return false;
+    const char c = m_text[m_pos];
+    if ( c == '{' ) {
+      ++m_pos;
+      if ( expect( '}' ) ) return true;
+      do {
+        std::string name;
+        if ( !string( name ) || !expect( ':' ) || !value( path.empty() ? name : path + "/" + name ) ) return false;
+      } while ( expect( ',' ) );
+      return expect( '}' );
+    }
+    if ( c == '[' ) {
+      ++m_pos;
+      if ( expect( ']' ) ) return true;
+      size_t index = 0;
+      do {
+        std::ostringstream element;
+        element << path << "/" << index++;
+        if ( !value( element.str() ) ) return false;
+      } while ( expect( ',' ) );
+      return expect( ']' );
+    }
+    if ( c == '"' ) {
+      std::string ignored;
+      return string( ignored );
+    }
+    const char* words[] = { "true", "false", "null" };
+    for (int k = 0; k < 3; ++k) {
+      if ( m_text.compare( m_pos, std::strlen( words[k] ), words[k] ) == 0 ) {
+        m_pos += std::strlen( words[k] );
+        return true;
+      }
+    }
+    const char* begin = m_text.c_str() + m_pos;
+    char* end = NULL;
+    const double number = std::strtod( begin, &end );
+    if ( end == begin ) return false;
+    m_pos += size_t( end - begin );
+    m_values[path] = number;
+    return true;
+  }
+
+  const std::string& m_text;
+  size_t m_pos;
+  Values& m_values;
+};
+
+bool read_json( const std::string& filename, Values& values )
+{
+  std::ifstream file( filename.c_str(), std::ios::binary );
+  if ( !file ) return false;
+  std::stringstream ss;
+  ss << file.rdbuf();
+  const std::string text = ss.str();
+  return JsonReader( text, values ).read();
+}
+
+bool starts_with( const std::string& s, const std::string& prefix )
+{
+  return s.compare( 0, prefix.size(), prefix ) == 0;
+}
+
+bool ends_with( const std::string& s, const std::string& suffix )
+{
+  return s.size() >= suffix.size() && s.compare( s.size() - suffix.size(), suffix.size(), suffix ) == 0;
+}
+
+// The metrics compared, from the flattened --stats JSON of a bake: time.<timer> in ms, rays_per_s in Mrays/s over
+// the trace time, and memory.* high water marks in MB, for the process and for each phase.
+void extract_metrics( const Values& stats, Values& metrics )
+{
+  const double mb = 1.0 / (1024.0*1024.0);
+  for (Values::const_iterator it = stats.begin(); it != stats.end(); ++it) {
+    const std::string& key = it->first;
+    if ( starts_with( key, "timers/" ) && ends_with( key, "/total_ms" ) ) {
+      metrics["time." + key.substr( 7, key.size() - 7 - 9 )] = it->second;
+    } else if ( key == "gauges/host.peak_rss_bytes/max" ) {
+      metrics["memory.host_peak"] = it->second*mb;
+    } else if ( key == "gauges/device.memory_used_bytes/max" ) {
+      metrics["memory.device_peak"] = it->second*mb;
+    } else if ( starts_with( key, "gauges/phase." ) && ends_with( key, ".host_rss_bytes/max" ) ) {
+      metrics["memory." + key.substr( 13, key.size() - 13 - 19 ) + ".host"] = it->second*mb;
+    } else if ( starts_with( key, "gauges/phase." ) && ends_with( key, ".device_memory_used_bytes/max" ) ) {
+      metrics["memory." + key.substr( 13, key.size() - 13 - 29 ) + ".device"] = it->second*mb;
+    }
+  }
+  Values::const_iterator rays = stats.find( "counters/ao.rays" );
+  Values::const_iterator trace = stats.find( "timers/ao.trace/total_ms" );
+  if ( rays != stats.end() && trace != stats.end() && trace->second > 0.0 ) {
+    metrics["rays_per_s"] = rays->second / (trace->second*1.0e-3) * 1.0e-6;
+  }
+}
+
+bool higher_is_better( const std::string& metric )
+{
+  return metric == "rays_per_s";
+}
+
+// The better of two repeats of a run
+double best( const std::string& metric, double a, double b )
+{
+  return higher_is_better( metric ) ? std::max( a, b ) : std::min( a, b );
+}
+
+std::string unit( const std::string& metric )
+{
+  if ( starts_with( metric, "time." ) ) return "ms";
+  if ( starts_with( metric, "memory." ) ) return "MB";
+  return "Mrays/s";
+}
+
+// Whether current is worse than base by more than the tolerances allow
+bool regressed( const std::string& metric, const double base, const double current, const Tolerances& tol, const double* relative )
+{
+  if ( higher_is_better( metric ) ) {
+    return current < base*(1.0 - (relative ? *relative : tol.rate));
+  }
+  const bool time = starts_with( metric, "time." );
+  const double rel = relative ? *relative : (time ? tol.time : tol.memory);
+  const double slack = time ? tol.time_ms : tol.memory_mb;
+  return current > base*(1.0 + rel) && current - base > slack;
+}
+
+bool improved( const std::string& metric, const double base, const double current, const Tolerances& tol, const double* relative )
+{
+  // Symmetric to regressed, with the roles swapped
+  return regressed( metric, current, base, tol, relative );
+}
+
+bool read_baseline( const std::string& filename, Baseline& baseline )
+{
+  Values values;
+  if ( !read_json( filename, values ) ) return false;
+  for (Values::const_iterator it = values.begin(); it != values.end(); ++it) {
+    const std::string& key = it->first;
+    if ( key == "tolerances/time" )           baseline.tolerances.time = it->second;
+    else if ( key == "tolerances/time_ms" )   baseline.tolerances.time_ms = it->second;
+    else if ( key == "tolerances/rate" )      baseline.tolerances.rate = it->second;
+    else if ( key == "tolerances/memory" )    baseline.tolerances.memory = it->second;
+    else if ( key == "tolerances/memory_mb" ) baseline.tolerances.memory_mb = it->second;
+    else if ( starts_with( key, "runs/" ) ) {
+      // runs/<run>/<metric>, or runs/<run>/<metric>/value and .../tolerance
+      const size_t run_end = key.find( '/', 5 );
+      if ( run_end == std::string::npos ) continue;
+      const std::string run = key.substr( 5, run_end - 5 );
+      std::string metric = key.substr( run_end + 1 );
+      if ( ends_with( metric, "/value" ) ) {
+        baseline.runs[run][metric.substr( 0, metric.size() - 6 )] = it->second;
+      } else if ( ends_with( metric, "/tolerance" ) ) {
+        baseline.metric_tolerances[run][metric.substr( 0, metric.size() - 10 )] = it->second;
+      } else {
+        baseline.runs[run][metric] = it->second;
+      }
+    }
+  }
+  return true;
+}
+
+bool write_baseline( const std::string& filename, const Baseline& baseline )
+{
+  std::ofstream out( filename.c_str() );
+  if ( !out ) return false;
+  const Tolerances& tol = baseline.tolerances;
+  out << std::fixed << std::setprecision( 3 );
+  out << "{\n  \"tolerances\": {\"time\": " << tol.time << ", \"time_ms\": " << tol.time_ms << ", \"rate\": " << tol.rate
+      << ", \"memory\": " << tol.memory << ", \"memory_mb\": " << tol.memory_mb << "},\n  \"runs\": {";
+  for (std::map<std::string, Values>::const_iterator run = baseline.runs.begin(); run != baseline.runs.end(); ++run) {
+    out << (run == baseline.runs.begin() ? "\n    \"" : ",\n    \"") << run->first << "\": {";
+    std::map<std::string, Values>::const_iterator overrides = baseline.metric_tolerances.find( run->first );
+    for (Values::const_iterator it = run->second.begin(); it != run->second.end(); ++it) {
+      out << (it == run->second.begin() ? "\n      \"" : ",\n      \"") << it->first << "\": ";
+      Values::const_iterator relative;
+      if ( overrides != baseline.metric_tolerances.end() && (relative = overrides->second.find( it->first )) != overrides->second.end() ) {
+        out << "{\"value\": " << it->second << ", \"tolerance\": " << relative->second << "}";
+      } else {
+        out << it->second;
+      }
+    }
+    out << "\n    }";
+  }
+  out << "\n  }\n}\n";
+  return bool( out );
+}
+
+bool read_suite( const std::string& filename, std::vector<Run>& runs )
+{
+  std::ifstream file( filename.c_str() );
+  if ( !file ) return false;
+  std::string line;
+  while ( std::getline( file, line ) ) {
+    const size_t comment = line.find( '#' );
+    if ( comment != std::string::npos ) line.erase( comment );
+    std::istringstream ss( line );
+    Run run;
+    if ( !(ss >> run.name) ) continue;
+    std::string option;
+    while ( ss >> option ) run.options.push_back( option );
+    if ( run.name.find( '/' ) != std::string::npos ) {
+      std::cerr << "Run names can't contain '/': " << run.name << std::endl;
+      return false;
+    }
+    runs.push_back( run );
+  }
+  return true;
+}
+
+// Generated scenes, as one mesh of binary PLY.  Only what the benchmark needs: positions and triangles.
+struct GeneratedMesh {
+  std::vector<float>    vertices;
+  std::vector<unsigned> indices;
+};
+
+// n x n unit cubes on a flat grid with gaps of half a cube: many short occluded rays
+void make_cubes( unsigned n, GeneratedMesh& mesh )
+{
+  const float corners[] = { 0,0,0, 1,0,0, 1,1,0, 0,1,0, 0,0,1, 1,0,1, 1,1,1, 0,1,1 };
+  const unsigned faces[] = { 0,2,1, 0,3,2,  4,5,6, 4,6,7,  0,1,5, 0,5,4,  3,7,6, 3,6,2,  0,4,7, 0,7,3,  1,2,6, 1,6,5 };
+  for (unsigned i = 0; i < n; ++i) {
+    for (unsigned j = 0; j < n; ++j) {
+      const unsigned first = unsigned( mesh.vertices.size() / 3 );
+      for (int c = 0; c < 8; ++c) {
+        mesh.vertices.push_back( corners[3*c+0] + 1.5f*i );
+        mesh.vertices.push_back( corners[3*c+1] );
+        mesh.vertices.push_back( corners[3*c+2] + 1.5f*j );
+      }
+      for (int k = 0; k < 36; ++k) mesh.indices.push_back( first + faces[k] );
+    }
+  }
+}
+
+// A sphere of n stacks and 2n slices, its radius rippled at a few frequencies: crevices like a dense scan
+void make_noise( unsigned n, GeneratedMesh& mesh )
+{
+  const unsigned stacks = std::max( n, 2u );
+  const unsigned slices = 2*stacks;
+  const float pi = 3.14159265358979f;
+  for (unsigned i = 0; i <= stacks; ++i) {
+    const float theta = pi*i / stacks;
+    for (unsigned j = 0; j <= slices; ++j) {
+      const float phi = 2.0f*pi*j / slices;
+      const float d[] = { std::sin( theta )*std::cos( phi ), std::cos( theta ), std::sin( theta )*std::sin( phi ) };
+      const float r = 1.0f + 0.15f*std::sin( 5.0f*d[0] )*std::sin( 7.0f*d[1] )*std::sin( 6.0f*d[2] )
+                           + 0.05f*std::sin( 23.0f*d[0] + 17.0f*d[2] )*std::sin( 19.0f*d[1] )
+                           + 0.02f*std::sin( 61.0f*d[1] + 53.0f*d[0] );
+      for (int k = 0; k < 3; ++k) mesh.vertices.push_back( r*d[k] );
+    }
+  }
+  for (unsigned i = 0; i < stacks; ++i) {
+    for (unsigned j = 0; j < slices; ++j) {
+      const unsigned a = i*(slices + 1) + j, b = a + slices + 1;
+      const unsigned tris[] = { a, a+1, b,  a+1, b+1, b };
+      mesh.indices.insert( mesh.indices.end(), tris, tris + 6 );
+    }
+  }
+}
+
+bool write_ply( const std::string& filename, const GeneratedMesh& mesh )
+{
+  FILE* file = fopen( filename.c_str(), "wb" );
+  if ( !file ) return false;
+  const size_t num_vertices = mesh.vertices.size() / 3, num_triangles = mesh.indices.size() / 3;
+  fprintf( file, "ply\nformat binary_little_endian 1.0\nelement vertex %lu\nproperty float x\nproperty float y\nproperty float z\n"
+                 "element face %lu\nproperty list uchar int vertex_indices\nend_header\n",
+           (unsigned long)num_vertices, (unsigned long)num_triangles );
+  bool ok = fwrite( &mesh.vertices[0], sizeof(float), mesh.vertices.size(), file ) == mesh.vertices.size();
+  for (size_t t = 0; ok && t < num_triangles; ++t) {
+    const unsigned char count = 3;
+    ok = fwrite( &count, 1, 1, file ) == 1 && fwrite( &mesh.indices[3*t], sizeof(unsigned), 3, file ) == 3;
+  }
+  return fclose( file ) == 0 && ok;
+}
+
+bool file_exists( const std::string& filename )
+{
+  FILE* file = fopen( filename.c_str(), "rb" );
+  if ( file ) fclose( file );
+  return file != NULL;
+}
+
+// @cubes:<n> or @noise:<n>, written to the work directory if not there yet; the file name, empty on failure
+std::string generated_scene( const std::string& spec, const std::string& work_dir )
+{
+  const size_t colon = spec.find( ':' );
+  const std::string kind = spec.substr( 1, colon == std::string::npos ? std::string::npos : colon - 1 );
+  unsigned n = 0;
+  if ( colon == std::string::npos || sscanf( spec.c_str() + colon + 1, "%u", &n ) != 1 || n == 0 || (kind != "cubes" && kind != "noise") ) {
+    std::cerr << "Unknown generated scene: " << spec << " (expected @cubes:<n> or @noise:<n>)" << std::endl;
+    return std::string();
+  }
+  std::ostringstream filename;
+  filename << work_dir << "/" << kind << "_" << n << ".ply";
+  if ( file_exists( filename.str() ) ) return filename.str();
+
+  GeneratedMesh mesh;
+  if ( kind == "cubes" ) make_cubes( n, mesh );
+  else                   make_noise( n, mesh );
+  if ( !write_ply( filename.str(), mesh ) ) {
+    std::cerr << "Failed to write " << filename.str() << std::endl;
+    return std::string();
+  }
+  return filename.str();
+}
+
+std::string replace_all( std::string s, const std::string& from, const std::string& to )
+{
+  for (size_t pos = s.find( from ); pos != std::string::npos; pos = s.find( from, pos + to.size() )) {
+    s.replace( pos, from.size(), to );
+  }
+  return s;
+}
+
+// Bakes a run once with --stats, the baker's output in <work_dir>/<name>.log; false if it failed
+bool bake_run( const std::string& bake, const Run& run, const std::string& assets_dir, const std::string& work_dir,
+               Values& metrics )
+{
+  std::ostringstream command;
+  command << "\"" << bake << "\"";
+  for (size_t i = 0; i < run.options.size(); ++i) {
+    std::string option = run.options[i];
+    if ( option[0] == '@' ) {
+      option = generated_scene( option, work_dir );
+      if ( option.empty() ) return false;
+    }
+    option = replace_all( replace_all( option, "$ASSETS", assets_dir ), "$WORK", work_dir );
+    command << " \"" << option << "\"";
+  }
+  const std::string stats_filename = work_dir + "/" + run.name + ".json";
+  const std::string log_filename = work_dir + "/" + run.name + ".log";
+  command << " --stats \"" << stats_filename << "\" > \"" << log_filename << "\" 2>&1";
+
+  std::remove( stats_filename.c_str() );
+  if ( std::system( command.str().c_str() ) != 0 ) {
+    std::cerr << "Run " << run.name << " failed, see " << log_filename << std::endl;
+    return false;
+  }
+  Values stats;
+  if ( !read_json( stats_filename, stats ) ) {
+    std::cerr << "Failed to read stats of run " << run.name << " from " << stats_filename << std::endl;
+    return false;
+  }
+  extract_metrics( stats, metrics );
+  return true;
+}
+
+// One table per run, the metrics of the baseline in order; the number of regressions
+size_t report_run( std::ostream& out, const std::string& name, const Values& base, const Values* overrides, const Values& current,
+                   const Tolerances& tol )
+{
+  size_t num_regressed = 0;
+  out << "\nRun " << name << "\n";
+  if ( base.empty() ) {
+    out << "  no baseline; record one with --update\n";
+    return 0;
+  }
+  out << "  " << std::left << std::setw( 44 ) << "metric" << std::right << std::setw( 19 ) << "baseline" << std::setw( 19 ) << "current"
+      << std::setw( 10 ) << "change" << "\n";
+  for (Values::const_iterator it = base.begin(); it != base.end(); ++it) {
+    const std::string& metric = it->first;
+    Values::const_iterator found = current.find( metric );
+    out << "  " << std::left << std::setw( 44 ) << metric << std::right << std::fixed << std::setprecision( 1 )
+        << std::setw( 11 ) << it->second << " " << std::setw( 7 ) << std::left << unit( metric ) << std::right;
+    if ( found == current.end() ) {
+      out << std::setw( 19 ) << "-" << std::setw( 10 ) << "-" << "  missing\n";
+      continue;
+    }
+    Values::const_iterator relative;
+    const double* rel = NULL;
+    if ( overrides && (relative = overrides->find( metric )) != overrides->end() ) rel = &relative->second;
+    const double change = it->second != 0.0 ? 100.0*(found->second - it->second) / it->second : 0.0;
+    std::string status = "ok";
+    if ( regressed( metric, it->second, found->second, tol, rel ) ) {
+      status = "REGRESSED";
+      ++num_regressed;
+    } else if ( improved( metric, it->second, found->second, tol, rel ) ) {
+      status = "improved";
+    }
+    out << std::setw( 11 ) << found->second << " " << std::setw( 7 ) << std::left << unit( metric ) << std::right
+        << std::setw( 9 ) << std::showpos << change << std::noshowpos << "%  " << status << "\n";
+  }
+  out.unsetf( std::ios::floatfield );
+  return num_regressed;
+}
+
+template <typename T>
+bool parse_list( const char* arg, std::vector<T>& values )
+{
+  values.clear();
+  std::stringstream ss( arg );
+  std::string item;
+  while ( std::getline( ss, item, ',' ) ) {
+    std::stringstream item_ss( item );
+    T value;
+    if ( !(item_ss >> value) ) return false;
+    values.push_back( value );
+  }
+  return !values.empty();
+}
+
+void print_usage_and_exit( const char* argv0 )
+{
+  std::cerr
+    << "Usage  : " << argv0 << " --bake <baker> --suite <suite.txt> --baseline <baseline.json> [options]\n"
+    << "        --bake <file>                   Command line baker to run, e.g. bake_cli\n"
+    << "        --suite <file>                  Runs, one per line: <name> <baker options>\n"
+    << "        --baseline <file>               Baseline JSON to compare against, or to write with --update\n"
+    << "        --assets <dir>                  Directory that $ASSETS stands for (default ./assets)\n"
+    << "        --work_dir <dir>                Existing directory for generated scenes, stats, logs and outputs (default .)\n"
+    << "        --runs <name0,name1,...>        Only these runs of the suite\n"
+    << "        --repeat <n>                    Bakes per run; the best value of each metric counts (default 1)\n"
+    << "        --min_ms <ms>                   With --update, leave out timers shorter than this (default 10)\n"
+    << "        --update                        Write the results as the new baseline, keeping tolerances and other runs\n"
+    << "  -o  | --outfile <file>                Write the report here instead of stdout\n"
+    << std::endl;
+  exit( 1 );
+}
+
+} // end namespace
+
+
+int main( int argc, char** argv )
+{
+  std::string bake, suite_filename, baseline_filename, output_filename;
+  std::string assets_dir( "./assets" ), work_dir( "." );
+  std::vector<std::string> only_runs;
+  int repeat = 1;
+  double min_ms = 10.0;
+  bool update = false;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg( argv[i] );
+    bool ok = true;
+    if ( arg == "--bake" && i+1 < argc )                          bake = argv[++i];
+    else if ( arg == "--suite" && i+1 < argc )                    suite_filename = argv[++i];
+    else if ( arg == "--baseline" && i+1 < argc )                 baseline_filename = argv[++i];
+    else if ( arg == "--assets" && i+1 < argc )                   assets_dir = argv[++i];
+    else if ( arg == "--work_dir" && i+1 < argc )                 work_dir = argv[++i];
+    else if ( arg == "--runs" && i+1 < argc )                     ok = parse_list( argv[++i], only_runs );
+    else if ( arg == "--repeat" && i+1 < argc )                   ok = sscanf( argv[++i], "%d", &repeat ) == 1 && repeat > 0;
+    else if ( arg == "--min_ms" && i+1 < argc )                   ok = sscanf( argv[++i], "%lf", &min_ms ) == 1 && min_ms >= 0.0;
+    else if ( arg == "--update" )                                 update = true;
+    else if ( (arg == "-o" || arg == "--outfile") && i+1 < argc ) output_filename = argv[++i];
+    else print_usage_and_exit( argv[0] );
+    if ( !ok ) {
+      std::cerr << "Bad value for " << arg << ": " << argv[i] << std::endl;
+      print_usage_and_exit( argv[0] );
+    }
+  }
+  if ( bake.empty() || suite_filename.empty() || baseline_filename.empty() ) print_usage_and_exit( argv[0] );
+
+  std::vector<Run> runs;
+  if ( !read_suite( suite_filename, runs ) ) {
+    std::cerr << "Failed to read suite " << suite_filename << std::endl;
+    return 1;
+  }
+  Baseline baseline;
+  if ( !read_baseline( baseline_filename, baseline ) && !update ) {
+    std::cerr << "Failed to read baseline " << baseline_filename << std::endl;
+    return 1;
+  }
+
+  std::ofstream file;
+  if ( !output_filename.empty() ) {
+    file.open( output_filename.c_str() );
+    if ( !file ) {
+      std::cerr << "Failed to open " << output_filename << std::endl;
+      return 1;
+    }
+  }
+  std::ostream& out = output_filename.empty() ? std::cout : file;
+
+  size_t num_failed = 0, num_regressed = 0, num_runs = 0;
+  for (size_t r = 0; r < runs.size(); ++r) {
+    const Run& run = runs[r];
+    if ( !only_runs.empty() && std::find( only_runs.begin(), only_runs.end(), run.name ) == only_runs.end() ) continue;
+    ++num_runs;
+    std::cerr << "Run " << run.name << " ..." << std::endl;
+
+    Values metrics;
+    bool ok = true;
+    for (int k = 0; k < repeat && ok; ++k) {
+      Values repeat_metrics;
+      ok = bake_run( bake, run, assets_dir, work_dir, repeat_metrics );
+      for (Values::const_iterator it = repeat_metrics.begin(); ok && it != repeat_metrics.end(); ++it) {
+        Values::iterator found = metrics.find( it->first );
+        if ( found == metrics.end() ) metrics.insert( *it );
+        else found->second = best( it->first, found->second, it->second );
+      }
+    }
+    if ( !ok ) {
+      out << "\nRun " << run.name << "\n  FAILED\n";
+      ++num_failed;
+      continue;
+    }
+
+    if ( update ) {
+      Values& base = baseline.runs[run.name];
+      base.clear();
+      for (Values::const_iterator it = metrics.begin(); it != metrics.end(); ++it) {
+        if ( !starts_with( it->first, "time." ) || it->second >= min_ms ) base.insert( *it );
+      }
+      continue;
+    }
+    std::map<std::string, Values>::const_iterator overrides = baseline.metric_tolerances.find( run.name );
+    num_regressed += report_run( out, run.name, baseline.runs[run.name],
+                                 overrides == baseline.metric_tolerances.end() ? NULL : &overrides->second, metrics, baseline.tolerances );
+  }
+
+  if ( update ) {
+    if ( !write_baseline( baseline_filename, baseline ) ) {
+      std::cerr << "Failed to write baseline " << baseline_filename << std::endl;
+      return 1;
+    }
+    std::cerr << "Wrote baseline of " << num_runs - num_failed << " runs to " << baseline_filename << std::endl;
+    return num_failed > 0 ? 1 : 0;
+  }
+
+  out << "\n" << num_runs << " runs, " << num_failed << " failed, " << num_regressed << " regressed metrics" << std::endl;
+  return num_failed > 0 || num_regressed > 0 ? 1 : 0;
+}